@@ -1,5 +1,7 @@
 #include "animation.h"
 #include "data_set/data_animation_bits.h"
+#include "data_set/animation_bits_cache.h"
+#include "keyframes.h"
 
 #include "assert.h"
 #include "../utils/utils.h"
@@ -15,15 +17,13 @@
 #include "animation_blinkid.h"
 #include "animation_normals.h"
 #include "animation_sequence.h"
+#include "animation_bake.h"
 #include "animation_worm.h"
 #include "config/settings.h"
 #include "config/dice_variants.h"
-
-
-// Define new and delete
-void* operator new(size_t size) { return malloc(size); }
-void operator delete(void* ptr) { free(ptr); }
-void operator delete(void* ptr, unsigned int) { free(ptr); }
+#include "modules/anim_controller.h"
+#include "app_util_platform.h"
+#include <new>
 
 
 #define MAX_LEVEL (256)
@@ -44,10 +44,34 @@ namespace Animations
         return toColor(r * intensity / MAX_LEVEL, g * intensity / MAX_LEVEL, b * intensity / MAX_LEVEL);
     }
 
+    // Intermediate colors of the frame being rendered. Instances are rendered one at a time from the
+    // main loop, so these are shared rather than put on the stack at every level of the update chain.
+    static uint32_t renderColors[MAX_LED_COUNT];    // Faces or logical LEDs, before the daisy chain conversion
+    static uint32_t canonicalColors[MAX_LED_COUNT]; // Faces in canonical orientation, before remapping
+    static int legacyIndices[MAX_LED_COUNT];        // Results of update()
+    static uint32_t legacyColors[MAX_LED_COUNT];
+
+    // Moves the colors returned by update() to their face, returns the mask of the faces written
+    static uint32_t gatherLegacyColors(int colorCount, uint32_t* outColors) {
+        uint32_t mask = 0;
+        for (int i = 0; i < colorCount; ++i) {
+            int face = legacyIndices[i];
+            if (face < MAX_LED_COUNT) {
+                outColors[face] = legacyColors[i];
+                mask |= 1u << face;
+            }
+        }
+        return mask;
+    }
+
+    static RenderFunction getRenderFunction(AnimationType type);
+
     AnimationInstance::AnimationInstance(const Animation* preset, const AnimationBits* bits) 
         : animationPreset(preset)
         , animationBits(bits)
         , tag(AnimationTag_Unknown)
+        , decodedTracksMask(0)
+        , renderFunction(nullptr)
     {
     }
 
@@ -62,7 +86,43 @@ namespace Animations
         startTime = _startTime;
         remapFace = _remapFace;
         forceFadeTime = -1;
+        faceRemap = SettingsManager::getLayout()->getFaceRemap(_remapFace);
         loopCount = _loopCount;
+        renderFunction = getRenderFunction(animationPreset->type);
+
+        // Decode the palette colors of our tracks so the per-frame evaluation doesn't have to
+        releaseDecodedTracks();
+        const RGBTrack* tracks[MAX_DECODED_TRACKS_PER_ANIM];
+        int trackCount = getRGBTracks(tracks);
+        for (int i = 0; i < trackCount; ++i) {
+            if (acquireDecodedColors(animationBits, tracks[i])) {
+                decodedTracksMask |= (1 << i);
+            }
+        }
+    }
+
+    /*virtual*/
+    int AnimationInstance::getRGBTracks(const RGBTrack* retTracks[]) const {
+        // Base doesn't use any track
+        return 0;
+    }
+
+    /*virtual*/
+    bool AnimationInstance::canShareUpdate() const {
+        return false;
+    }
+
+    void AnimationInstance::releaseDecodedTracks() {
+        if (decodedTracksMask != 0) {
+            const RGBTrack* tracks[MAX_DECODED_TRACKS_PER_ANIM];
+            int trackCount = getRGBTracks(tracks);
+            for (int i = 0; i < trackCount; ++i) {
+                if ((decodedTracksMask & (1 << i)) != 0) {
+                    releaseDecodedColors(tracks[i]);
+                }
+            }
+            decodedTracksMask = 0;
+        }
     }
 
     int AnimationInstance::setColor(uint32_t color, uint32_t faceMask, int retIndices[], uint32_t retColors[]) {
@@ -105,142 +165,416 @@ namespace Animations
         return 0;
     }
 
-    /*virtual*/ 
-    void AnimationInstance::updateFaces(int ms, uint32_t* outFaces) {
+    /*virtual*/
+    uint32_t AnimationInstance::updateCanonicalFaces(int ms, uint32_t* outColors) {
+        return gatherLegacyColors(update(ms, legacyIndices, legacyColors), outColors);
+    }
+
+    // Colors returned by the last shareable instance updated, before remapping. Instances of the same
+    // preset started within a frame of each other (i.e. triggered on several faces) reuse them.
+    static struct
+    {
+        const Animation* preset;
+        const AnimationBits* bits;
+        int startTime;
+        int ms;
+        uint32_t mask;
+        uint32_t colors[MAX_LED_COUNT];
+    } sharedUpdate = { nullptr, nullptr, 0, 0, 0, {0} };
+
+    typedef uint32_t (*CanonicalFacesFunction)(AnimationInstance* instance, int ms, uint32_t* outColors);
+
+    /// <summary>
+    /// Gets the canonical face colors of the instance, from the baked table, the shared update or
+    /// the passed in function, and remaps them to the current orientation
+    /// </summary>
+    static void remapCanonicalFaces(AnimationInstance* instance, int ms, uint32_t* outFaces, CanonicalFacesFunction canonicalFaces) {
 
         auto layout = SettingsManager::getLayout();
 
         // Update the (derived) animation instance
-        int animIndices[MAX_LED_COUNT];
-        uint32_t animColors[MAX_LED_COUNT];
-        int animColorCount = update(ms, animIndices, animColors);
+        const uint32_t* colors = canonicalColors;
+        uint32_t mask;
+        if (getBakedFaces(instance, ms, canonicalColors, mask)) {
+            // Read from the preset's frame table
+        } else if (instance->canShareUpdate()) {
+            const int startDelta = instance->startTime - sharedUpdate.startTime;
+            if (sharedUpdate.preset != instance->animationPreset || sharedUpdate.bits != instance->animationBits || sharedUpdate.ms != ms ||
+                startDelta < -ANIM_FRAME_DURATION_MS || startDelta > ANIM_FRAME_DURATION_MS) {
+                sharedUpdate.preset = instance->animationPreset;
+                sharedUpdate.bits = instance->animationBits;
+                sharedUpdate.startTime = instance->startTime;
+                sharedUpdate.ms = ms;
+                sharedUpdate.mask = canonicalFaces(instance, ms, sharedUpdate.colors);
+            }
+            colors = sharedUpdate.colors;
+            mask = sharedUpdate.mask;
+        } else {
+            mask = canonicalFaces(instance, ms, canonicalColors);
+        }
 
-        // Flatten the colors
+        // Remap the faces that were written
         memset(outFaces, 0, sizeof(uint32_t) * MAX_LED_COUNT);
-        for (int i = 0; i < animColorCount; ++i) {
-            int face = animIndices[i];
-            if (face < layout->faceCount) {
-                // Remap the faces as necessary
-                int remappedFace = layout->remapFaceIndexBasedOnUpFace(remapFace, face);
-                outFaces[remappedFace] = animColors[i];
+        if (layout->faceCount < 32) {
+            mask &= (1u << layout->faceCount) - 1;
+        }
+        for (; mask != 0; mask &= mask - 1) {
+            int face = Utils::lowestBitIndex(mask);
+            outFaces[instance->faceRemap[face]] = colors[face];
+        }
+    }
+
+    static uint32_t virtualCanonicalFaces(AnimationInstance* instance, int ms, uint32_t* outColors) {
+        return instance->updateCanonicalFaces(ms, outColors);
+    }
+
+    /*virtual*/ 
+    void AnimationInstance::updateFaces(int ms, uint32_t* outFaces) {
+        remapCanonicalFaces(this, ms, outFaces, virtualCanonicalFaces);
+    }
+
+    // Averages the face colors an LED is made of
+    uint32_t blendFaceColors(const uint32_t* faceColors, const DiceVariants::DaisyChainLEDFaces& ledFaces) {
+        if (ledFaces.faceCount == 0) {
+            // No face, no color
+            return 0;
+        } else if (ledFaces.faceCount == 1) {
+            // One face, copy the color
+            return faceColors[ledFaces.faces[0]];
+        } else if (ledFaces.faceCount == 2) {
+            // Two faces, the most common case on the daisy chain, is a single halving add
+            return averageColors(faceColors[ledFaces.faces[0]], faceColors[ledFaces.faces[1]]);
+        } else {
+            // Multiple faces, average the colors
+            uint32_t r = 0;
+            uint32_t g = 0;
+            uint32_t b = 0;
+            for (int i = 0; i < ledFaces.faceCount; ++i) {
+                uint32_t faceColor = faceColors[ledFaces.faces[i]];
+                r += getRed(faceColor);
+                g += getGreen(faceColor);
+                b += getBlue(faceColor);
             }
+            r /= ledFaces.faceCount;
+            g /= ledFaces.faceCount;
+            b /= ledFaces.faceCount;
+            return toColor(r, g, b);
         }
     }
 
     /*virtual*/ 
     void AnimationInstance::updateLEDs(int ms, uint32_t* outLEDs) {
 
+        // Not on the render path (see render()), so this one keeps its own buffer
         uint32_t faceColors[MAX_LED_COUNT];
-        memset(faceColors, 0, sizeof(uint32_t) * MAX_LED_COUNT);
         updateFaces(ms, faceColors);
 
-        // Do a bunch of remapping / blending based on the animation flags and layout
+        // Now figure out what color each LED needs, the table is indexed by daisy chain index
+        // but also gives us the logical LED index
         auto layout = SettingsManager::getLayout();
+        auto ledFaces = layout->getDaisyChainLEDFaces();
+        for (int d = 0; d < layout->ledCount; ++d) {
+            outLEDs[ledFaces[d].ledIndex] = blendFaceColors(faceColors, ledFaces[d]);
+        }
+    }
 
-        // Now figure out what color each LED needs
-        // Remap "electrical" index (daisy chain index) to "logical" led index
-        for (int l = 0; l < layout->ledCount; ++l) {
-
-            // Animation specifies face indices, meaning if there are more than one led on a face,
-            // they will all get the same color from the animation.
-            int faces[MAX_BLENDED_COLORS];
-            int faceCount = layout->faceIndicesFromLEDIndex(l, faces);
-
-            // Blend the colors together
-            if (faceCount == 0) {
-                // No face, no color
-                outLEDs[l] = 0;
-            } else if (faceCount == 1) {
-                // One face, copy the color
-                outLEDs[l] = faceColors[faces[0]];
-            } else {
-                // Multiple faces, average the colors
-                uint32_t r = 0;
-                uint32_t g = 0;
-                uint32_t b = 0;
-                for (int i = 0; i < faceCount; ++i) {
-                    uint32_t faceColor = faceColors[faces[i]];
-                    r += getRed(faceColor);
-                    g += getGreen(faceColor);
-                    b += getBlue(faceColor);
-                }
-                r /= faceCount;
-                g /= faceCount;
-                b /= faceCount;
-
-                // Set the led color
-                outLEDs[l] = toColor(r, g, b);
-            }
+    // Gathers the face colors of each daisy chain LED in a single pass: daisy chain index -> LED -> faces
+    static void facesToDaisyChain(const uint32_t* faceColors, uint32_t* outDaisyChainColors) {
+        auto layout = SettingsManager::getLayout();
+        auto ledFaces = layout->getDaisyChainLEDFaces();
+        for (int d = 0; d < layout->ledCount; ++d) {
+            outDaisyChainColors[d] = blendFaceColors(faceColors, ledFaces[d]);
         }
     }
 
     /*virtual*/ 
     void AnimationInstance::updateDaisyChainLEDs(int ms, uint32_t* outDaisyChainColors) {
+        uint32_t faceColors[MAX_LED_COUNT];
+        updateFaces(ms, faceColors);
+        facesToDaisyChain(faceColors, outDaisyChainColors);
+    }
 
+    // Render functions, one per animation type and instantiated for its class, so that the update
+    // method of each type is called directly (qualified calls aren't virtual) and can be inlined
 
-        // Do a bunch of remapping / blending based on the animation flags and layout
-        auto layout = SettingsManager::getLayout();
+    // Animations that return face colors from update()
+    template <typename T>
+    uint32_t canonicalFacesFromUpdate(AnimationInstance* instance, int ms, uint32_t* outColors) {
+        return gatherLegacyColors(static_cast<T*>(instance)->T::update(ms, legacyIndices, legacyColors), outColors);
+    }
+
+    // Animations that write face colors with updateCanonicalFaces()
+    template <typename T>
+    uint32_t canonicalFacesOf(AnimationInstance* instance, int ms, uint32_t* outColors) {
+        return static_cast<T*>(instance)->T::updateCanonicalFaces(ms, outColors);
+    }
 
-        uint32_t ledColors[MAX_LED_COUNT];
-        memset(ledColors, 0, sizeof(uint32_t) * MAX_LED_COUNT);
-        updateLEDs(ms, ledColors);
+    template <CanonicalFacesFunction canonicalFaces>
+    void renderFaces(AnimationInstance* instance, int ms, uint32_t* outDaisyChainColors) {
+        // remapCanonicalFaces() clears the faces that aren't written
+        remapCanonicalFaces(instance, ms, renderColors, canonicalFaces);
+        facesToDaisyChain(renderColors, outDaisyChainColors);
+    }
+
+    // Animations that set the LED colors directly with updateLEDs(), bypassing the face to LED blending
+    template <typename T>
+    void renderLEDs(AnimationInstance* instance, int ms, uint32_t* outDaisyChainColors) {
+        memset(renderColors, 0, sizeof(uint32_t) * MAX_LED_COUNT);
+        static_cast<T*>(instance)->T::updateLEDs(ms, renderColors);
 
         // Remap "electrical" index (daisy chain index) to "logical" led index
-        for (int l = 0; l < layout->ledCount; ++l) {
+        auto layout = SettingsManager::getLayout();
+        auto ledFaces = layout->getDaisyChainLEDFaces();
+        for (int d = 0; d < layout->ledCount; ++d) {
+            outDaisyChainColors[d] = renderColors[ledFaces[d].ledIndex];
+        }
+    }
+
+    // Animations that set the daisy chain colors directly with updateDaisyChainLEDs()
+    template <typename T>
+    void renderDaisyChain(AnimationInstance* instance, int ms, uint32_t* outDaisyChainColors) {
+        static_cast<T*>(instance)->T::updateDaisyChainLEDs(ms, outDaisyChainColors);
+    }
+
+    // Indexed by AnimationType
+    static const RenderFunction renderFunctions[] =
+    {
+        renderFaces<virtualCanonicalFaces>,                                         // Animation_Unknown
+        renderFaces<canonicalFacesFromUpdate<AnimationInstanceSimple>>,             // Animation_Simple
+        renderDaisyChain<AnimationInstanceRainbow>,                                 // Animation_Rainbow
+        renderFaces<canonicalFacesOf<AnimationInstanceKeyframed>>,                  // Animation_Keyframed
+        renderFaces<canonicalFacesOf<AnimationInstanceGradientPattern>>,            // Animation_GradientPattern
+        renderFaces<canonicalFacesFromUpdate<AnimationInstanceGradient>>,           // Animation_Gradient
+        renderLEDs<AnimationInstanceNoise>,                                         // Animation_Noise
+        renderFaces<canonicalFacesFromUpdate<AnimationInstanceCycle>>,              // Animation_Cycle
+        renderFaces<canonicalFacesFromUpdate<AnimationInstanceBlinkId>>,            // Animation_BlinkId
+        renderLEDs<AnimationInstanceNormals>,                                       // Animation_Normals
+        renderFaces<canonicalFacesFromUpdate<AnimationInstanceSequence>>,           // Animation_Sequence
+        renderFaces<canonicalFacesFromUpdate<AnimationInstanceWorm>>,               // Animation_Worm
+    };
+
+    static_assert(sizeof(renderFunctions) / sizeof(renderFunctions[0]) == Animation_Worm + 1, "One render function per animation type");
+
+    static RenderFunction getRenderFunction(AnimationType type) {
+        return type < sizeof(renderFunctions) / sizeof(renderFunctions[0]) ? renderFunctions[type] : renderFunctions[Animation_Unknown];
+    }
+
+
+    // Returns the larger of the sizes of the passed in types, used to size the pool slots
+    template <typename T>
+    constexpr size_t largestSizeOf() { return sizeof(T); }
+
+    template <typename T, typename U, typename... Others>
+    constexpr size_t largestSizeOf() {
+        return sizeof(T) > largestSizeOf<U, Others...>() ? sizeof(T) : largestSizeOf<U, Others...>();
+    }
 
-            int ll = layout->LEDIndexFromDaisyChainIndex(l);
-            outDaisyChainColors[l] = ledColors[ll];
+    // Slot size, in words, of the instance pool
+    #define ANIM_POOL_SLOT_WORDS ((largestSizeOf< \
+        AnimationInstanceSimple, \
+        AnimationInstanceGradient, \
+        AnimationInstanceRainbow, \
+        AnimationInstanceKeyframed, \
+        AnimationInstanceGradientPattern, \
+        AnimationInstanceNoise, \
+        AnimationInstanceCycle, \
+        AnimationInstanceBlinkId, \
+        AnimationInstanceNormals, \
+        AnimationInstanceSequence, \
+        AnimationInstanceWorm>() + sizeof(uint32_t) - 1) / sizeof(uint32_t))
+
+    static_assert(MAX_ANIMS <= 32, "Instance pool uses a 32 bits mask to track used slots");
+
+    // Fixed pool of animation instances, so playing an animation never touches the heap.
+    // Slots are made of words to keep the instances aligned.
+    static uint32_t poolSlots[MAX_ANIMS][ANIM_POOL_SLOT_WORDS];
+    static uint32_t poolUsedMask = 0;
+    static int poolUsedCount = 0;
+    static int poolHighWaterMark = 0;
+    static int poolAllocFailures = 0;
+
+    void* allocInstanceSlot() {
+        void* ret = nullptr;
+        CRITICAL_REGION_ENTER();
+        for (int i = 0; i < MAX_ANIMS; ++i) {
+            if ((poolUsedMask & (1u << i)) == 0) {
+                poolUsedMask |= (1u << i);
+                poolUsedCount++;
+                if (poolUsedCount > poolHighWaterMark) {
+                    poolHighWaterMark = poolUsedCount;
+                }
+                ret = poolSlots[i];
+                break;
+            }
         }
+        if (ret == nullptr) {
+            poolAllocFailures++;
+        }
+        CRITICAL_REGION_EXIT();
+        return ret;
     }
 
+    void freeInstanceSlot(void* slot) {
+        int index = ((uint32_t*)slot - &poolSlots[0][0]) / ANIM_POOL_SLOT_WORDS;
+        if (index >= 0 && index < MAX_ANIMS && slot == poolSlots[index]) {
+            CRITICAL_REGION_ENTER();
+            if ((poolUsedMask & (1u << index)) != 0) {
+                poolUsedMask &= ~(1u << index);
+                poolUsedCount--;
+            }
+            CRITICAL_REGION_EXIT();
+        } else {
+            NRF_LOG_ERROR("Animation instance not from pool");
+        }
+    }
+
+    /// <summary>
+    /// Frozen frame of an instance, rendered as is while it fades out
+    /// </summary>
+    class AnimationInstanceSnapshot
+        : public AnimationInstance
+    {
+    public:
+        uint32_t colors[MAX_LED_COUNT]; // Daisy chain order
+
+        AnimationInstanceSnapshot(const Animation* preset, const AnimationBits* bits)
+            : AnimationInstance(preset, bits) {
+        }
+        virtual int animationSize() const { return 0; }
+        virtual int stop(int retIndices[]) { return 0; }
+    };
+
+    static void renderSnapshot(AnimationInstance* instance, int ms, uint32_t* outDaisyChainColors) {
+        auto snapshot = static_cast<AnimationInstanceSnapshot*>(instance);
+        memcpy(outDaisyChainColors, snapshot->colors, sizeof(uint32_t) * SettingsManager::getLayout()->ledCount);
+    }
+
+#if ANIM_FADE_SNAPSHOTS > 0
+    static_assert(ANIM_FADE_SNAPSHOTS <= 32, "Snapshots use a 32 bits mask to track used ones");
+    #define ANIM_SNAPSHOT_WORDS ((sizeof(AnimationInstanceSnapshot) + sizeof(uint32_t) - 1) / sizeof(uint32_t))
+    static uint32_t snapshotSlots[ANIM_FADE_SNAPSHOTS][ANIM_SNAPSHOT_WORDS];
+    static uint32_t snapshotUsedMask = 0;
+
+    // Index of the snapshot the instance was created in, -1 if it comes from the pool
+    static int snapshotIndexOf(const AnimationInstance* instance) {
+        int index = ((const uint32_t*)instance - &snapshotSlots[0][0]) / (int)ANIM_SNAPSHOT_WORDS;
+        return index >= 0 && index < ANIM_FADE_SNAPSHOTS && (const void*)instance == snapshotSlots[index] ? index : -1;
+    }
+#else
+    static int snapshotIndexOf(const AnimationInstance* instance) {
+        return -1;
+    }
+#endif
+
+    AnimationInstance* createAnimationSnapshot(const AnimationInstance* instance, int ms) {
+#if ANIM_FADE_SNAPSHOTS > 0
+        if (snapshotIndexOf(instance) >= 0) {
+            return nullptr;
+        }
+        for (int i = 0; i < ANIM_FADE_SNAPSHOTS; ++i) {
+            if ((snapshotUsedMask & (1u << i)) == 0) {
+                snapshotUsedMask |= (1u << i);
+                auto ret = new (snapshotSlots[i]) AnimationInstanceSnapshot(instance->animationPreset, instance->animationBits);
+                // Keep the timing, and the preset and face under which the controller finds the instance
+                ret->startTime = instance->startTime;
+                ret->forceFadeTime = instance->forceFadeTime;
+                ret->faceRemap = instance->faceRemap;
+                ret->tag = instance->tag;
+                ret->remapFace = instance->remapFace;
+                ret->loopCount = 1;
+                ret->renderFunction = renderSnapshot;
+                const_cast<AnimationInstance*>(instance)->render(ms, ret->colors);
+                AnimationBitsCache::acquire(instance->animationBits);
+                return ret;
+            }
+        }
+#endif
+        return nullptr;
+    }
 
     AnimationInstance* createAnimationInstance(const Animation* preset, const AnimationBits* bits) {
+        void* slot = allocInstanceSlot();
+        if (slot == nullptr) {
+            NRF_LOG_ERROR("Animation instance pool is full");
+            return nullptr;
+        }
+
         AnimationInstance* ret = nullptr;
         switch (preset->type) {
             case Animation_Simple:
-                // Maybe we'll pass an allocator at some point, this is the only place I've ever used a new in the firmware...
-                ret = new AnimationInstanceSimple(static_cast<const AnimationSimple*>(preset), bits);
+                ret = new (slot) AnimationInstanceSimple(static_cast<const AnimationSimple*>(preset), bits);
                 break;
             case Animation_Gradient:
-                ret = new AnimationInstanceGradient(static_cast<const AnimationGradient*>(preset), bits);
+                ret = new (slot) AnimationInstanceGradient(static_cast<const AnimationGradient*>(preset), bits);
                 break;
             case Animation_Rainbow:
-                ret = new AnimationInstanceRainbow(static_cast<const AnimationRainbow*>(preset), bits);
+                ret = new (slot) AnimationInstanceRainbow(static_cast<const AnimationRainbow*>(preset), bits);
                 break;
             case Animation_Keyframed:
-                ret = new AnimationInstanceKeyframed(static_cast<const AnimationKeyframed*>(preset), bits);
+                ret = new (slot) AnimationInstanceKeyframed(static_cast<const AnimationKeyframed*>(preset), bits);
                 break;
             case Animation_GradientPattern:
-                ret = new AnimationInstanceGradientPattern(static_cast<const AnimationGradientPattern*>(preset), bits);
+                ret = new (slot) AnimationInstanceGradientPattern(static_cast<const AnimationGradientPattern*>(preset), bits);
                 break;
             case Animation_Noise:
-                ret = new AnimationInstanceNoise(static_cast<const AnimationNoise*>(preset), bits);
+                ret = new (slot) AnimationInstanceNoise(static_cast<const AnimationNoise*>(preset), bits);
                 break;
             case Animation_Cycle:
-                ret = new AnimationInstanceCycle(static_cast<const AnimationCycle *>(preset), bits);
+                ret = new (slot) AnimationInstanceCycle(static_cast<const AnimationCycle *>(preset), bits);
                 break;
             case Animation_BlinkId:
-                ret = new AnimationInstanceBlinkId(static_cast<const AnimationBlinkId*>(preset), bits);
+                ret = new (slot) AnimationInstanceBlinkId(static_cast<const AnimationBlinkId*>(preset), bits);
                 break;
             case Animation_Normals:
-                ret = new AnimationInstanceNormals(static_cast<const AnimationNormals*>(preset), bits);
+                ret = new (slot) AnimationInstanceNormals(static_cast<const AnimationNormals*>(preset), bits);
                 break;
             case Animation_Sequence:
-                ret = new AnimationInstanceSequence(static_cast<const AnimationSequence*>(preset), bits);
+                ret = new (slot) AnimationInstanceSequence(static_cast<const AnimationSequence*>(preset), bits);
                 break;
             case Animation_Worm:
-                ret = new AnimationInstanceWorm(static_cast<const AnimationWorm*>(preset), bits);
+                ret = new (slot) AnimationInstanceWorm(static_cast<const AnimationWorm*>(preset), bits);
                 break;
             default:
                 NRF_LOG_ERROR("Unknown animation preset type");
+                freeInstanceSlot(slot);
                 break;
         }
+        if (ret != nullptr) {
+            AnimationBitsCache::acquire(bits);
+        }
         return ret;
     }
 
     void destroyAnimationInstance(AnimationInstance* animationInstance) {
-        // Eventually we might use an allocator
-        delete animationInstance;
+        if (animationInstance != nullptr) {
+            animationInstance->releaseDecodedTracks();
+            AnimationBitsCache::release(animationInstance->animationBits);
+            animationInstance->~AnimationInstance();
+#if ANIM_FADE_SNAPSHOTS > 0
+            int snapshot = snapshotIndexOf(animationInstance);
+            if (snapshot >= 0) {
+                snapshotUsedMask &= ~(1u << snapshot);
+                return;
+            }
+#endif
+            freeInstanceSlot(animationInstance);
+        }
+    }
+
+    int getAnimationInstanceCount() {
+        return poolUsedCount;
+    }
+
+    int getAnimationInstanceHighWaterMark() {
+        return poolHighWaterMark;
+    }
+
+    int getAnimationInstanceAllocFailures() {
+        return poolAllocFailures;
+    }
+
+    int getAnimationInstanceSlotSize() {
+        return ANIM_POOL_SLOT_WORDS * sizeof(uint32_t);
     }
 
 }
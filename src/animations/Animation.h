@@ -13,8 +13,22 @@ namespace DataSet
 #define ANIM_FACEMASK_ALL_LEDS 0xFFFFFFFF
 #define MAX_BLENDED_COLORS (8)
 
+// Maximum number of animation instances playing at once, this is also the capacity of the instance pool
+#define MAX_ANIMS 20
+
+// Maximum number of RGB tracks of an instance that get their colors decoded in RAM
+#define MAX_DECODED_TRACKS_PER_ANIM 8
+
+// Number of instances being faded out that can be replaced by a snapshot of their last frame,
+// set by the makefile. Each one takes a little over MAX_LED_COUNT colors of RAM, 0 disables them.
+#ifndef ANIM_FADE_SNAPSHOTS
+#define ANIM_FADE_SNAPSHOTS 2
+#endif
+
 namespace Animations
 {
+    struct RGBTrack;
+
     /// <summary>
     /// Defines the types of Animation Presets we have/support
     /// </summary>
@@ -41,8 +55,25 @@ namespace Animations
     {
         AnimationFlags_None,
         AnimationFlags_Traveling = 1,     // Make the animation travel around the dice, only available for the Rainbow animation
+        AnimationFlags_BlendModeMask = 0x70, // How the animation is combined with the ones below it, see AnimationBlendMode
     };
 
+    /// <summary>
+    /// How the compositor combines an animation with the animations played before it,
+    /// stored in the animation flags. The default keeps the brightest value of each channel.
+    /// </summary>
+    enum AnimationBlendMode : uint8_t
+    {
+        AnimationBlendMode_Max = 0,
+        AnimationBlendMode_Add,         // Channels are added, saturating
+        AnimationBlendMode_Replace,     // Hides what is below (cross fades when fading out)
+        AnimationBlendMode_Multiply,    // Tints what is below, black where nothing was lit
+        AnimationBlendMode_AlphaOver,   // Draws over what is below, brighter colors being more opaque
+        AnimationBlendMode_Count
+    };
+
+    #define ANIM_BLEND_MODE_SHIFT 4
+
     /// <summary>
     /// Base struct for animation presets. All presets have a few properties in common.
     /// Presets are stored in flash, so do not have methods or vtables or anything like that.
@@ -54,6 +85,11 @@ namespace Animations
         uint16_t duration; // in ms
     };
 
+    class AnimationInstance;
+
+    // Renders a frame of an instance in daisy chain order, see AnimationInstance::render()
+    typedef void (*RenderFunction)(AnimationInstance* instance, int ms, uint32_t* outDaisyChainColors);
+
     /// <summary>
     /// Animation instance data, refers to an animation preset but stores the instance data and
     /// (derived classes) implements logic for displaying the animation.
@@ -65,10 +101,13 @@ namespace Animations
         const DataSet::AnimationBits* animationBits;
         int startTime; //ms
         int forceFadeTime; //ms, used when fading out (because anim is being replaced), -1 otherwise
+        const uint8_t* faceRemap; // Current face of each animation face for the remap face, from the layout, set by start()
         AnimationTag tag; // used to identify where the animation came from / what system triggered it
         uint8_t remapFace;
         uint8_t loopCount;
         uint8_t paddingLoopCount;
+        uint8_t decodedTracksMask; // Which of the tracks returned by getRGBTracks() have their colors decoded
+        RenderFunction renderFunction; // Picked from the animation type by start()
 
     protected:
         AnimationInstance(const Animation* preset, const DataSet::AnimationBits* bits);
@@ -87,6 +126,20 @@ namespace Animations
         int setIndices(uint32_t faceMask, int retIndices[]);
         void forceFadeOut(int fadeOutTime);
 
+        // Returns the RGB tracks used by the animation (at most MAX_DECODED_TRACKS_PER_ANIM),
+        // so their palette colors can be decoded when the instance starts. The base implementation returns none.
+        virtual int getRGBTracks(const RGBTrack* retTracks[]) const;
+        // Whether update() only depends on the preset and the animation time, in which case instances
+        // of the same preset started together share their evaluated colors. The base returns false.
+        virtual bool canShareUpdate() const;
+        // Releases the decoded colors of the tracks, called when the instance is destroyed or restarted
+        void releaseDecodedTracks();
+
+        // Renders the current frame into outDaisyChainColors, this is what the animation controller calls.
+        // Each animation type has a render function that calls the update method of its native space
+        // (faces, LEDs or daisy chain) directly, and does the one conversion to the daisy chain.
+        void render(int ms, uint32_t* outDaisyChainColors) { renderFunction(this, ms, outDaisyChainColors); }
+
         // This method used to set which faces to turn on as well as the color of their LEDs
         // retIndices is one to one with retColors and keeps track of which face to turn on as well as its corresponding color
         // return value of the method is the number of faces to turn on.
@@ -94,6 +147,10 @@ namespace Animations
         // This is the 'legacy' way of doing things, and is used by animations like GradientPattern, etc...
         virtual int update(int ms, int retIndices[], uint32_t retColors[]);
 
+        // Writes the colors of the faces in 'canonical orientation' straight into outColors (indexed by face),
+        // returning the mask of the faces that were written. The base implementation calls update().
+        virtual uint32_t updateCanonicalFaces(int ms, uint32_t* outColors);
+
         // This method is used to return the list of all colors for all FACES of the die, taking into account the current orientation of the die.
         // The base implementation calls update() and then flattens and remaps the faces to the current orientation.
         virtual void updateFaces(int ms, uint32_t* outFaces);
@@ -103,7 +160,8 @@ namespace Animations
         // Animation classes like noise or normals will override this method to directly set the led colors.
         virtual void updateLEDs(int ms, uint32_t* outLEDs);
 
-        // This method remaps the colors of the LEDs in 'logical' order to the colors of the leds in the daisy chain to pass back to the animation controller.
+        // This method returns the colors of the leds in the daisy chain.
+        // The base implementation calls updateFaces() and gathers the face colors of each daisy chain LED in a single pass.
         // Animation classes like Rainbow override this method to directly set the daisy chain colors.
         virtual void updateDaisyChainLEDs(int ms, uint32_t* outDaisyChainColors);
     };
@@ -111,6 +169,16 @@ namespace Animations
     Animations::AnimationInstance* createAnimationInstance(const Animations::Animation* preset, const DataSet::AnimationBits* bits);
     void destroyAnimationInstance(Animations::AnimationInstance* animationInstance);
 
+    // Returns an instance that keeps showing the frame of the given instance at time ms, to be faded out
+    // in its place so it can be destroyed right away. Fails if no snapshot is available (or for a snapshot).
+    Animations::AnimationInstance* createAnimationSnapshot(const Animations::AnimationInstance* instance, int ms);
+
+    // Instance pool statistics
+    int getAnimationInstanceCount();
+    int getAnimationInstanceHighWaterMark();
+    int getAnimationInstanceAllocFailures();
+    int getAnimationInstanceSlotSize(); // Memory taken by each instance, in bytes
+
 }
 
 #pragma pack(pop)
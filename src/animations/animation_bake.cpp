@@ -0,0 +1,186 @@
+#include "animation_bake.h"
+#include "animation.h"
+#include "keyframes.h"
+#include "modules/anim_controller.h"
+#include "data_set/data_set.h"
+#include "utils/utils.h"
+#include "utils/heap.h"
+#include "nrf_log.h"
+
+namespace Animations
+{
+    // A run of frames where the same faces are lit with the same color
+    struct BakedRun
+    {
+        uint32_t mask;
+        uint32_t color;
+        uint16_t startFrame;
+        uint16_t padding;
+    };
+
+    // Table of a preset, runs follow the header. Presets that turned out not to be bakeable
+    // keep a table without runs so they aren't tried again every frame.
+    struct BakedTable
+    {
+        BakedTable* next;
+        const Animation* preset;
+        int lastUsedMs;
+        uint16_t runCount;
+        bool bakeable;
+        uint8_t padding;
+
+        BakedRun* runs() { return (BakedRun*)(void*)(this + 1); }
+        uint32_t size() const { return sizeof(BakedTable) + runCount * sizeof(BakedRun); }
+    };
+
+    static BakedTable* tables = nullptr;
+    static uint32_t tablesSize = 0;
+
+    static BakedTable* findTable(const Animation* preset) {
+        for (auto table = tables; table != nullptr; table = table->next) {
+            if (table->preset == preset) {
+                return table;
+            }
+        }
+        return nullptr;
+    }
+
+    static void dropLeastRecentlyUsed() {
+        BakedTable** oldest = nullptr;
+        for (auto link = &tables; *link != nullptr; link = &(*link)->next) {
+            if (oldest == nullptr || (*link)->lastUsedMs - (*oldest)->lastUsedMs < 0) {
+                oldest = link;
+            }
+        }
+        if (oldest != nullptr) {
+            auto table = *oldest;
+            *oldest = table->next;
+            tablesSize -= table->size();
+            Utils::Heap::free(table);
+        }
+    }
+
+    static void addTable(BakedTable* table) {
+        while (tables != nullptr && tablesSize + table->size() > ANIM_BAKE_BUDGET_BYTES) {
+            dropLeastRecentlyUsed();
+        }
+        table->next = tables;
+        tables = table;
+        tablesSize += table->size();
+    }
+
+    /// <summary>
+    /// Renders every frame of the instance's preset, counting the runs, and writing them if runs isn't null.
+    /// Returns -1 if a frame has faces of different colors.
+    /// </summary>
+    static int renderRuns(AnimationInstance* instance, int frameCount, BakedRun* runs) {
+        const int duration = instance->animationPreset->duration;
+        uint32_t colors[MAX_LED_COUNT];
+        int runCount = 0;
+        uint32_t runMask = 0;
+        uint32_t runColor = 0;
+        for (int f = 0; f < frameCount; ++f) {
+            int time = f * ANIM_FRAME_DURATION_MS < duration ? f * ANIM_FRAME_DURATION_MS : duration;
+            uint32_t mask = instance->updateCanonicalFaces(instance->startTime + time, colors);
+            uint32_t color = mask != 0 ? colors[Utils::lowestBitIndex(mask)] : 0;
+            for (uint32_t remaining = mask; remaining != 0; remaining &= remaining - 1) {
+                if (colors[Utils::lowestBitIndex(remaining)] != color) {
+                    return -1;
+                }
+            }
+            if (runCount == 0 || mask != runMask || color != runColor) {
+                if (runs != nullptr) {
+                    runs[runCount].mask = mask;
+                    runs[runCount].color = color;
+                    runs[runCount].startFrame = (uint16_t)f;
+                    runs[runCount].padding = 0;
+                }
+                runCount++;
+                runMask = mask;
+                runColor = color;
+            }
+        }
+        return runCount;
+    }
+
+    static BakedTable* bake(AnimationInstance* instance, int ms) {
+        const int frameCount = instance->animationPreset->duration / ANIM_FRAME_DURATION_MS + 1;
+        int runCount = renderRuns(instance, frameCount, nullptr);
+
+        // Tables taking more than half the budget would keep pushing the others out
+        bool bakeable = runCount > 0 && sizeof(BakedTable) + runCount * sizeof(BakedRun) <= ANIM_BAKE_BUDGET_BYTES / 2;
+        if (!bakeable) {
+            runCount = 0;
+        }
+
+        auto table = (BakedTable*)Utils::Heap::alloc(sizeof(BakedTable) + runCount * sizeof(BakedRun), Utils::Heap::HeapTag_Animation);
+        if (table == nullptr) {
+            return nullptr;
+        }
+        table->preset = instance->animationPreset;
+        table->lastUsedMs = ms;
+        table->runCount = (uint16_t)runCount;
+        table->bakeable = bakeable;
+        table->padding = 0;
+        if (bakeable) {
+            renderRuns(instance, frameCount, table->runs());
+        }
+        addTable(table);
+        NRF_LOG_DEBUG("Baked animation type %d, %d runs", instance->animationPreset->type, runCount);
+        return table;
+    }
+
+    bool getBakedFaces(AnimationInstance* instance, int ms, uint32_t* outColors, uint32_t& outMask) {
+        auto preset = instance->animationPreset;
+        if (preset->duration == 0 || preset->duration > ANIM_BAKE_MAX_DURATION_MS ||
+            instance->animationBits != DataSet::getAnimationBits() || !instance->canShareUpdate()) {
+            return false;
+        }
+
+        // Tracks taking their color from the current face aren't decoded, and can't be baked either
+        const RGBTrack* tracks[MAX_DECODED_TRACKS_PER_ANIM];
+        int trackCount = instance->getRGBTracks(tracks);
+        if (instance->decodedTracksMask != (1 << trackCount) - 1) {
+            return false;
+        }
+
+        auto table = findTable(preset);
+        if (table == nullptr) {
+            table = bake(instance, ms);
+        }
+        if (table == nullptr || !table->bakeable) {
+            return false;
+        }
+        table->lastUsedMs = ms;
+
+        // Find the run of the current frame
+        int frame = (ms - instance->startTime) / ANIM_FRAME_DURATION_MS;
+        auto runs = table->runs();
+        int low = 0;
+        int high = table->runCount - 1;
+        while (low < high) {
+            int mid = (low + high + 1) / 2;
+            if (runs[mid].startFrame <= frame) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+
+        auto& run = runs[low];
+        for (uint32_t remaining = run.mask; remaining != 0; remaining &= remaining - 1) {
+            outColors[Utils::lowestBitIndex(remaining)] = run.color;
+        }
+        outMask = run.mask;
+        return true;
+    }
+
+    void flushBakedAnimations() {
+        while (tables != nullptr) {
+            auto table = tables;
+            tables = table->next;
+            Utils::Heap::free(table);
+        }
+        tablesSize = 0;
+    }
+}
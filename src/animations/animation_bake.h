@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+// Heap budget of the baked animation tables, the least recently used ones are dropped to make room
+#define ANIM_BAKE_BUDGET_BYTES 1024
+
+// Longest animation preset that gets baked
+#define ANIM_BAKE_MAX_DURATION_MS 3000
+
+namespace Animations
+{
+    class AnimationInstance;
+
+    // Short animations that only depend on their preset and time are rendered once, a frame every
+    // ANIM_FRAME_DURATION_MS, into a run-length coded table. Playing them then only reads the table.
+    // A frame can only be baked if all its lit faces share the same color.
+
+    // Fills in the canonical face colors of the instance from its preset's table, baking it first if needed.
+    // Returns false if the instance can't be baked, it should then be evaluated as usual.
+    bool getBakedFaces(AnimationInstance* instance, int ms, uint32_t* outColors, uint32_t& outMask);
+
+    // Drops all the tables, must be called before the animation data changes
+    void flushBakedAnimations();
+}
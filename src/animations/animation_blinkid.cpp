@@ -7,9 +7,17 @@
 #define CRC_BITS_COUNT 3
 #define CRC_DIVISOR 0xB // = 1011
 #define CRC_MASK 0x7
+#define MAX_SLOT_BITS_COUNT 16
+
+// Pattern color indices, the message uses the first 3
+#define COLOR_INDEX_WHITE 3
 
 namespace Animations
 {
+    static int getSlotBitsCount(const AnimationBlinkId* preset)
+    {
+        return preset->slotBitsCount < MAX_SLOT_BITS_COUNT ? preset->slotBitsCount : MAX_SLOT_BITS_COUNT;
+    }
 
     /// <summary>
     /// Update the animation duration based on the passed preamble duration
@@ -18,7 +26,11 @@ namespace Animations
     void AnimationBlinkId::setDuration(uint16_t preambleDuration)
     {
         // Add preamble duration to time it takes to blink the header and the device id
-        duration = preambleDuration + ANIM_FRAME_DURATION_MS * framesPerBlink * (HEADER_BITS_COUNT + DEVICE_BITS_COUNT);
+        // (the CRC shortens the preamble), or the header, CRC and slot index
+        const int messageBitsCount = slotBitsCount != 0 ?
+            HEADER_BITS_COUNT + CRC_BITS_COUNT + getSlotBitsCount(this) :
+            HEADER_BITS_COUNT + DEVICE_BITS_COUNT;
+        duration = preambleDuration + ANIM_FRAME_DURATION_MS * framesPerBlink * messageBitsCount;
     }
 
     /// <summary>
@@ -26,20 +38,21 @@ namespace Animations
     /// Needs to have an associated preset passed in
     /// </summary>
     AnimationInstanceBlinkId::AnimationInstanceBlinkId(const AnimationBlinkId *preset, const DataSet::AnimationBits *bits)
-        : AnimationInstance(preset, bits), message(AnimationInstanceBlinkId::getMessage())
+        : AnimationInstance(preset, bits)
     {
     }
 
-    uint64_t AnimationInstanceBlinkId::getMessage()
+    uint64_t AnimationInstanceBlinkId::getMessage(uint32_t payload, int payloadBitsCount)
     {
         // 3-bit CRC
         // https://en.wikipedia.org/wiki/Cyclic_redundancy_check#Computation
-        const uint64_t shiftedValue = (uint64_t)Pixel::getDeviceID() << CRC_BITS_COUNT;
+        const uint64_t shiftedValue = (uint64_t)payload << CRC_BITS_COUNT;
         const uint64_t mask = (uint64_t)(-1) ^ CRC_MASK;
-        uint64_t div = (uint64_t)CRC_DIVISOR << DEVICE_BITS_COUNT;
+        uint64_t div = (uint64_t)CRC_DIVISOR << payloadBitsCount;
         uint64_t crc = shiftedValue;
-        uint64_t firstBit = (uint64_t)1 << (DEVICE_BITS_COUNT + CRC_BITS_COUNT);
-        do
+        uint64_t firstBit = (uint64_t)1 << (payloadBitsCount + CRC_BITS_COUNT);
+        // A null payload (e.g. slot 0) has a null CRC
+        while ((crc & mask) != 0)
         {
             while ((crc & firstBit) == 0)
             {
@@ -47,7 +60,7 @@ namespace Animations
                 div >>= 1;
             }
             crc ^= div;
-        } while ((crc & mask) != 0);
+        }
         return (shiftedValue | crc) << HEADER_BITS_COUNT; // Shift the results to add the initial "RGB" header
     }
 
@@ -68,10 +81,38 @@ namespace Animations
 
     /// <summary>
     /// (re)Initializes the instance to animate leds. This can be called on a reused instance.
+    /// The message is expanded into the color of each blink here, so update() only has to look it up.
     /// </summary>
     void AnimationInstanceBlinkId::start(int _startTime, uint8_t _remapFace, uint8_t _loopCount)
     {
         AnimationInstance::start(_startTime, _remapFace, _loopCount);
+
+        auto preset = getPreset();
+        const int payloadBitsCount = preset->slotBitsCount != 0 ? getSlotBitsCount(preset) : DEVICE_BITS_COUNT;
+        const int messageBitsCount = HEADER_BITS_COUNT + CRC_BITS_COUNT + payloadBitsCount;
+        const int totalTicks = preset->duration / preset->framesPerBlink / ANIM_FRAME_DURATION_MS;
+        const int preambleNumTicks = totalTicks - messageBitsCount;
+
+        // Show white for the preamble and after the message (too short a duration makes it all preamble)
+        pattern.reset(
+            ANIM_FRAME_DURATION_MS * preset->framesPerBlink,
+            preambleNumTicks >= 0 ? preambleNumTicks : 0xFFFF,
+            COLOR_INDEX_WHITE,
+            COLOR_INDEX_WHITE);
+
+        // Send lower order bit first (which is the header, then CRC and finally the device id),
+        // we use 3 colors and skip one when getting a 1
+        const uint32_t payload = preset->slotBitsCount != 0 ?
+            preset->slot & ((1u << payloadBitsCount) - 1) :
+            Pixel::getDeviceID();
+        uint64_t msg = getMessage(payload, payloadBitsCount);
+        uint32_t colorIndex = -1;
+        for (int i = 0; i < messageBitsCount; ++i)
+        {
+            colorIndex = (colorIndex + 1 + (msg & 1)) % 3;
+            msg >>= 1;
+            pattern.append(colorIndex);
+        }
     }
 
     /// <summary>
@@ -83,39 +124,17 @@ namespace Animations
     /// <returns>The number of leds/intensities added to the return array</returns>
     int AnimationInstanceBlinkId::update(int ms, int retIndices[], uint32_t retColors[])
     {
-        auto preset = getPreset();
+        const uint32_t brightness = (uint32_t)getPreset()->brightness;
+        const uint32_t colorIndex = pattern.colorIndexAt(ms - startTime);
 
-        // Compute color
-        uint32_t color = 0;
-        const uint32_t brightness = (uint32_t)preset->brightness;
-        const uint32_t frameCounter = (ms - startTime) / ANIM_FRAME_DURATION_MS;
-        const uint32_t tick = frameCounter / preset->framesPerBlink;
-        const uint32_t totalTicks = preset->duration / preset->framesPerBlink / ANIM_FRAME_DURATION_MS;
-        const uint32_t preambleNumTicks = totalTicks - DEVICE_BITS_COUNT - HEADER_BITS_COUNT - CRC_BITS_COUNT;
-
-        if (tick < preambleNumTicks || tick >= totalTicks)
+        uint32_t color;
+        if (colorIndex == COLOR_INDEX_WHITE)
         {
-            // Show white for the preamble (and possibly the last frame)
             auto whiteBrightness = brightness / 2;
             color = (whiteBrightness << 16) | (whiteBrightness << 8) | whiteBrightness;
         }
         else
         {
-            // Find the color index of the current bit of our message
-            // Send lower order bit first (which is the header,
-            // then CRC and finally the device id)
-            uint64_t msg = message;
-            uint32_t colorIndex = -1;
-            for (uint32_t i = preambleNumTicks; i <= tick; ++i)
-            {
-                // Skip a color when getting a 1
-                colorIndex += 1 + (msg & 1);
-                msg >>= 1;
-            }
-
-            // We use 3 colors
-            colorIndex %= 3;
-
             // colorIndex = 0 => red, 1 => green, 2 => blue
             color = brightness << (16 - 8 * colorIndex);
         }
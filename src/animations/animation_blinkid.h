@@ -1,6 +1,7 @@
 #pragma once
 
 #include "animations/Animation.h"
+#include "animations/bit_pattern.h"
 
 #pragma pack(push, 1)
 
@@ -9,8 +10,8 @@ namespace Animations
     /// <summary>
     /// Procedural animation that starts with a white preamble and then
     /// blinks a message on all LEDs using a color scheme.
-    /// The message is composed of a header, a CRC and the Device Id.
-    /// Each blink lasts for the given number of frames.
+    /// The message is composed of a header, a CRC and the Device Id, or the slot index
+    /// when slotBitsCount isn't 0. Each blink lasts for the given number of frames.
     /// Use setDuration() to compute the correct duration.
     /// </summary>
     struct AnimationBlinkId
@@ -18,6 +19,8 @@ namespace Animations
     {
         uint8_t framesPerBlink;
         uint8_t brightness;
+        uint8_t slotBitsCount; // 0 to blink the device id
+        uint16_t slot;
 
         void setDuration(uint16_t preambleDuration);
     };
@@ -39,8 +42,8 @@ namespace Animations
 
     private:
         const AnimationBlinkId* getPreset() const;
-        static uint64_t getMessage();
-        const uint64_t message;
+        static uint64_t getMessage(uint32_t payload, int payloadBitsCount);
+        BitPattern pattern; // Expanded by start()
     };
 }
 
@@ -67,13 +67,15 @@ namespace Animations
         auto& gradient = animationBits->getRGBTrack(preset->gradientTrackOffset);
         int gradientTime = time * preset->count * 1000 / preset->duration;
 
-        // Fill the indices and colors for the anim controller to know how to update leds
+        // Fill the indices and colors for the anim controller to know how to update leds,
+        // same as the worm the cursor carries the keyframe search over from one led to the next
+        uint8_t cursor = 0;
         int retCount = 0;
         for (int i = 0; i < c; ++i) {
             if ((preset->faceMask & (1 << i)) != 0) {
                 retIndices[retCount] = i;
                 int faceTime = (gradientTime + i * 1000 * preset->cyclesTimes10 / (c * 10)) % 1000;
-                retColors[retCount] = Utils::modulateColor(gradient.evaluateColor(animationBits, faceTime), intensity);
+                retColors[retCount] = Utils::modulateColor(gradient.evaluateColor(animationBits, faceTime, &cursor), intensity);
                 retCount++;
             }
         }
@@ -88,6 +90,15 @@ namespace Animations
         return setIndices(preset->faceMask, retIndices);
     }
 
+    /// <summary>
+    /// Returns the RGB tracks used by the animation, so their colors can be decoded
+    /// </summary>
+    int AnimationInstanceCycle::getRGBTracks(const RGBTrack* retTracks[]) const {
+        auto preset = getPreset();
+        retTracks[0] = &animationBits->getRGBTrack(preset->gradientTrackOffset);
+        return 1;
+    }
+
     const AnimationCycle* AnimationInstanceCycle::getPreset() const {
         return static_cast<const AnimationCycle*>(animationPreset);
     }
@@ -29,6 +29,7 @@ namespace Animations
     /// </summary>
     void AnimationInstanceGradient::start(int _startTime, uint8_t _remapFace, uint8_t _loopCount) {
         AnimationInstance::start(_startTime, _remapFace, _loopCount);
+        gradientCursor = 0;
     }
 
     /// <summary>
@@ -46,7 +47,7 @@ namespace Animations
         auto& gradient = animationBits->getRGBTrack(preset->gradientTrackOffset);
 
         int gradientTime = time * 1000 / preset->duration;
-        uint32_t color = gradient.evaluateColor(animationBits, gradientTime);
+        uint32_t color = gradient.evaluateColor(animationBits, gradientTime, &gradientCursor);
 
         // Fill the indices and colors for the anim controller to know how to update leds
         return setColor(color, preset->faceMask, retIndices, retColors);
@@ -60,6 +61,15 @@ namespace Animations
         return setIndices(preset->faceMask, retIndices);
     }
 
+    /// <summary>
+    /// Returns the RGB tracks used by the animation, so their colors can be decoded
+    /// </summary>
+    int AnimationInstanceGradient::getRGBTracks(const RGBTrack* retTracks[]) const {
+        auto preset = getPreset();
+        retTracks[0] = &animationBits->getRGBTrack(preset->gradientTrackOffset);
+        return 1;
+    }
+
     const AnimationGradient* AnimationInstanceGradient::getPreset() const {
         return static_cast<const AnimationGradient*>(animationPreset);
     }
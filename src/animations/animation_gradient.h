@@ -31,9 +31,11 @@ namespace Animations
         virtual void start(int _startTime, uint8_t _remapFace, uint8_t _loopCount);
         virtual int update(int ms, int retIndices[], uint32_t retColors[]);
         virtual int stop(int retIndices[]);
+        virtual int getRGBTracks(const RGBTrack* retTracks[]) const;
 
     private:
         const AnimationGradient* getPreset() const;
+        uint8_t gradientCursor; // Last gradient keyframe lookup
     };
 }
 
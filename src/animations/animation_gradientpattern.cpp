@@ -38,6 +38,7 @@ namespace Animations
     /// </summary>
     void AnimationInstanceGradientPattern::start(int _startTime, uint8_t _remapFace, uint8_t _loopCount) {
         AnimationInstance::start(_startTime, _remapFace, _loopCount);
+        gradientCursor = 0;
         auto preset = getPreset();
         if (preset->overrideWithFace) {
             // Compute color based on face is 127
@@ -46,14 +47,12 @@ namespace Animations
     }
 
     /// <summary>
-    /// Computes the list of LEDs that need to be on, and what their intensities should be
-    /// based on the different tracks of this animation.
+    /// Computes the colors of the LEDs that need to be on, based on the different tracks of this animation.
     /// </summary>
     /// <param name="ms">The animation time (in milliseconds)</param>
-    /// <param name="retIndices">the return list of LED indices to fill, max size should be at least 21, the max number of leds</param>
-    /// <param name="retColors">the return list of LED color to fill, max size should be at least 21, the max number of leds</param>
-    /// <returns>The number of leds/intensities added to the return array</returns>
-    int AnimationInstanceGradientPattern::update(int ms, int retIndices[], uint32_t retColors[])
+    /// <param name="outColors">the LED colors to fill, indexed by LED, size should be at least the max number of leds</param>
+    /// <returns>The mask of the leds that were written</returns>
+    uint32_t AnimationInstanceGradientPattern::updateCanonicalFaces(int ms, uint32_t* outColors)
     {
         int time = ms - startTime;
         auto preset = getPreset();
@@ -67,28 +66,17 @@ namespace Animations
         if (preset->overrideWithFace) {
             gradientColor = rgb;
         } else {
-            gradientColor = gradient.evaluateColor(animationBits, trackTime);
+            gradientColor = gradient.evaluateColor(animationBits, trackTime, &gradientCursor);
         }
 
-        // Each track will append its led indices and colors into the return array
-        // The assumption is that led indices don't overlap between tracks of a single animation,
-        // so there will always be enough room in the return arrays.
-        int totalCount = 0;
-        int indices[MAX_LED_COUNT];
-        uint32_t colors[MAX_LED_COUNT];
+        // Each track writes the modulated colors of its own leds
+        uint32_t mask = 0;
         for (int i = 0; i < preset->trackCount; ++i)
         {
-            auto track = animationBits->getTrack((uint16_t)(preset->tracksOffset + i)); 
-            int count = track.evaluate(animationBits, gradientColor, trackTime, indices, colors);
-            for (int j = 0; j < count; ++j)
-            {
-                retIndices[totalCount+j] = indices[j];
-                retColors[totalCount+j] = colors[j];
-            }
-            totalCount += count;
+            auto& track = animationBits->getTrack((uint16_t)(preset->tracksOffset + i));
+            mask |= track.evaluate(animationBits, gradientColor, trackTime, outColors);
         }
-
-        return totalCount;
+        return mask;
     }
 
     /// <summary>
@@ -114,6 +102,20 @@ namespace Animations
         return totalCount;
     }
 
+    /// <summary>
+    /// Returns the RGB tracks used by the animation, so their colors can be decoded
+    /// </summary>
+    int AnimationInstanceGradientPattern::getRGBTracks(const RGBTrack* retTracks[]) const {
+        auto preset = getPreset();
+        retTracks[0] = &animationBits->getRGBTrack(preset->gradientTrackOffset);
+        return 1;
+    }
+
+    bool AnimationInstanceGradientPattern::canShareUpdate() const {
+        // The override color depends on the remap face
+        return !getPreset()->overrideWithFace;
+    }
+
     /// <summary>
     /// Small helper to get the correct type preset data pointer stored in the instance
     /// </summary
@@ -16,7 +16,7 @@ namespace Animations
     struct AnimationGradientPattern
         : public Animation
     {
-        uint16_t tracksOffset; // offset into a global buffer of tracks
+        uint16_t tracksOffset; // offset into a global buffer of tracks, the range may be shared with other animations
         uint16_t trackCount;
         uint16_t gradientTrackOffset;
         uint8_t overrideWithFace;
@@ -31,6 +31,7 @@ namespace Animations
     {
     private:
         uint32_t rgb;
+        uint8_t gradientCursor; // Last gradient keyframe lookup
 
     public:
         AnimationInstanceGradientPattern(const AnimationGradientPattern* preset, const DataSet::AnimationBits* bits);
@@ -40,8 +41,10 @@ namespace Animations
         virtual int animationSize() const;
 
         virtual void start(int _startTime, uint8_t _remapFace, uint8_t _loopCount);
-        virtual int update(int ms, int retIndices[], uint32_t retColors[]);
+        virtual uint32_t updateCanonicalFaces(int ms, uint32_t* outColors);
         virtual int stop(int retIndices[]);
+        virtual int getRGBTracks(const RGBTrack* retTracks[]) const;
+        virtual bool canShareUpdate() const;
 
     private:
         const AnimationGradientPattern* getPreset() const;
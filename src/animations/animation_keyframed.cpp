@@ -39,14 +39,12 @@ namespace Animations
     }
 
     /// <summary>
-    /// Computes the list of LEDs that need to be on, and what their intensities should be
-    /// based on the different tracks of this animation.
+    /// Computes the colors of the LEDs that need to be on, based on the different tracks of this animation.
     /// </summary>
     /// <param name="ms">The animation time (in milliseconds)</param>
-    /// <param name="retIndices">the return list of LED indices to fill, max size should be at least 21, the max number of leds</param>
-    /// <param name="retColors">the return list of LED color to fill, max size should be at least 21, the max number of leds</param>
-    /// <returns>The number of leds/intensities added to the return array</returns>
-    int AnimationInstanceKeyframed::update(int ms, int retIndices[], uint32_t retColors[])
+    /// <param name="outColors">the LED colors to fill, indexed by LED, size should be at least the max number of leds</param>
+    /// <returns>The mask of the leds that were written</returns>
+    uint32_t AnimationInstanceKeyframed::updateCanonicalFaces(int ms, uint32_t* outColors)
     {
         int time = ms - startTime;
         auto preset = getPreset();
@@ -54,21 +52,13 @@ namespace Animations
         const int trackTime = time * 1000 / preset->duration;
         const RGBTrack * tracks = animationBits->getRGBTracks(preset->tracksOffset);
 
-        // Each track will append its led indices and colors into the return array
-        // The assumption is that led indices don't overlap between tracks of a single animation,
-        // so there will always be enough room in the return arrays.
-        int* indices = retIndices;
-        uint32_t* colors = retColors;
-        int totalCount = 0;
+        // Each track writes the colors of its own leds
+        uint32_t mask = 0;
         for (int i = 0; i < preset->trackCount; ++i)
         {
-            auto& track = tracks[i]; 
-            auto count = track.evaluate(animationBits, trackTime, indices, colors);
-            indices += count;
-            colors += count;
-            totalCount += count;
+            mask |= tracks[i].evaluate(animationBits, trackTime, outColors);
         }
-        return totalCount;
+        return mask;
     }
 
     /// <summary>
@@ -92,6 +82,26 @@ namespace Animations
         return totalCount;
     }
 
+    /// <summary>
+    /// Returns the RGB tracks used by the animation, so their colors can be decoded
+    /// </summary>
+    int AnimationInstanceKeyframed::getRGBTracks(const RGBTrack* retTracks[]) const {
+        auto preset = getPreset();
+        if (preset->trackCount == 0) {
+            return 0;
+        }
+        const RGBTrack* tracks = animationBits->getRGBTracks(preset->tracksOffset);
+        int count = MIN(preset->trackCount, MAX_DECODED_TRACKS_PER_ANIM);
+        for (int i = 0; i < count; ++i) {
+            retTracks[i] = &tracks[i];
+        }
+        return count;
+    }
+
+    bool AnimationInstanceKeyframed::canShareUpdate() const {
+        return true;
+    }
+
     /// <summary>
     /// Small helper to get the correct type preset data pointer stored in the instance
     /// </summary
@@ -16,7 +16,7 @@ namespace Animations
     struct AnimationKeyframed
         : public Animation
     {
-        uint16_t tracksOffset; // offset into a global buffer of tracks
+        uint16_t tracksOffset; // offset into a global buffer of tracks, the range may be shared with other animations
         uint16_t trackCount;
     };
 
@@ -34,8 +34,10 @@ namespace Animations
         virtual int animationSize() const;
 
         virtual void start(int _startTime, uint8_t _remapFace, uint8_t _loopCount);
-        virtual int update(int ms, int retIndices[], uint32_t retColors[]);
+        virtual uint32_t updateCanonicalFaces(int ms, uint32_t* outColors);
         virtual int stop(int retIndices[]);
+        virtual int getRGBTracks(const RGBTrack* retTracks[]) const;
+        virtual bool canShareUpdate() const;
 
     private:
         const AnimationKeyframed* getPreset() const;
@@ -11,7 +11,6 @@
 using namespace DriversNRF;
 using namespace Config;
 
-#define MAX_RETRIES 5
 namespace Animations
 {
     int computeBaseParam(int upFace, NoiseColorOverrideType type) {
@@ -59,16 +58,31 @@ namespace Animations
         int blinkInterValMaxMs = 1000000 / (preset->blinkFrequencyTimes1000 - preset->blinkFrequencyVarTimes1000);
         blinkInterValDeltaMs = MAX(blinkInterValMaxMs - blinkInterValMinMs, 1);
 
-        // initializing the durations and times of each blink
-        for(int i = 0; i < MAX_LED_COUNT; i++){
-            blinkStartTimes[i] = 0;
-            blinkDurations[i] = 0;
-        }
+        activeBlinks = 0;
+        blinkingLEDs = 0;
 
-        nextBlinkTime = _startTime + blinkInterValMinMs + (RNG::randomUInt32() % blinkInterValDeltaMs);
+        nextBlinkTime = _startTime + blinkInterValMinMs + (RNG::fastUInt32() % blinkInterValDeltaMs);
         baseColorParam = computeBaseParam(_remapFace, preset->overallGradientColorType);
     }
 
+    /// <summary>
+    /// Returns a free blink slot, or the one of the oldest blink when they're all taken
+    /// </summary>
+    int AnimationInstanceNoise::allocBlink(int ms) {
+        const uint16_t freeSlots = ~activeBlinks & ((1u << MAX_NOISE_BLINKS) - 1);
+        if (freeSlots != 0) {
+            return Utils::lowestBitIndex(freeSlots);
+        }
+        int oldest = 0;
+        for (int i = 1; i < MAX_NOISE_BLINKS; ++i) {
+            if ((uint16_t)(ms - blinks[i].startTime) > (uint16_t)(ms - blinks[oldest].startTime)) {
+                oldest = i;
+            }
+        }
+        blinkingLEDs &= ~(1u << blinks[oldest].led);
+        return oldest;
+    }
+
     /// <summary>
     /// Computes the list of LEDs that need to be on, and what their intensities should be.
     /// </summary>
@@ -98,26 +112,29 @@ namespace Animations
 
         // Should we start a new blink instance?
         if (ms >= nextBlinkTime) {
-            // Yes, pick an led!
-            int newLed = RNG::randomUInt32() % ledCount;
-            for (int retries = 0; blinkDurations[newLed] != 0 && retries < MAX_RETRIES; ++retries) {
-                newLed = RNG::randomUInt32() % ledCount;
+            // Yes, pick an led that isn't blinking, all leds being equally likely
+            const uint32_t allLEDs = ledCount < 32 ? (1u << ledCount) - 1 : 0xFFFFFFFF;
+            uint32_t candidates = allLEDs & ~blinkingLEDs;
+            if (candidates == 0) {
+                // They all are, restart one of them
+                candidates = allLEDs;
             }
-
-            // Setup next blink
-            blinkDurations[newLed] = preset->blinkDurationMs;
-            blinkStartTimes[newLed] = ms;
+            int skip = RNG::fastUInt32() % __builtin_popcount(candidates);
+            for (; skip > 0; --skip) {
+                candidates &= candidates - 1;
+            }
+            int newLed = Utils::lowestBitIndex(candidates);
 
             uint32_t gradientColor = 0;
             switch (preset->overallGradientColorType) {
                 case NoiseColorOverrideType_RandomFromGradient:
                     // Ignore instance gradient parameter, each blink gets a random value
-                    gradientColor = gradientOverall.evaluateColor(animationBits, RNG::randomUInt32() % 1000);
+                    gradientColor = gradientOverall.evaluateColor(animationBits, RNG::fastUInt32() % 1000);
                     break;
                 case NoiseColorOverrideType_FaceToGradient:
                     {
                         // use the current face (set at start()) + variance
-                        int var = (int)(RNG::randomUInt32() % MAX(1, (2 * preset->overallGradientColorVar))) - preset->overallGradientColorVar;
+                        int var = (int)(RNG::fastUInt32() % MAX(1, (2 * preset->overallGradientColorVar))) - preset->overallGradientColorVar;
                         int param = baseColorParam + var;
                         if (param < 0) {
                             param = 0;
@@ -130,7 +147,7 @@ namespace Animations
                 case NoiseColorOverrideType_FaceToRainbowWheel:
                     {
                         // use the current face (set at start()) + variance
-                        int var = (int)(RNG::randomUInt32() % MAX(1, (2 * preset->overallGradientColorVar))) - preset->overallGradientColorVar;
+                        int var = (int)(RNG::fastUInt32() % MAX(1, (2 * preset->overallGradientColorVar))) - preset->overallGradientColorVar;
                         int param = baseColorParam + var * 255 / 1000;
                         gradientColor = Rainbow::wheel(param);
                     }
@@ -144,29 +161,52 @@ namespace Animations
                     break;
             }
 
-            blinkColors[newLed] = gradientColor;
-            nextBlinkTime = ms + blinkInterValMinMs + (RNG::randomUInt32() % blinkInterValDeltaMs);
+            // Setup the blink, restarting it if that led was already blinking
+            if (preset->blinkDurationMs > 0) {
+                int slot = -1;
+                if ((blinkingLEDs & (1u << newLed)) != 0) {
+                    for (uint32_t remaining = activeBlinks; remaining != 0 && slot < 0; remaining &= remaining - 1) {
+                        int i = Utils::lowestBitIndex(remaining);
+                        if (blinks[i].led == newLed) {
+                            slot = i;
+                        }
+                    }
+                }
+                if (slot < 0) {
+                    slot = allocBlink(ms);
+                }
+                auto& blink = blinks[slot];
+                blink.startTime = (uint16_t)ms;
+                blink.led = (uint8_t)newLed;
+                blink.color[0] = Utils::getRed(gradientColor);
+                blink.color[1] = Utils::getGreen(gradientColor);
+                blink.color[2] = Utils::getBlue(gradientColor);
+                activeBlinks |= 1u << slot;
+                blinkingLEDs |= 1u << newLed;
+            }
+            nextBlinkTime = ms + blinkInterValMinMs + (RNG::fastUInt32() % blinkInterValDeltaMs);
         }
 
-        for (int i = 0; i < ledCount; ++i) {
-            if (blinkDurations[i] > 0) {
-                // Update this blink
-                int blinkTime = ms - blinkStartTimes[i];
-                if (blinkTime > blinkDurations[i]) {
-                    // This blink is over, return black this one time
-                    outLEDs[i] = 0;
-
-                    // and clear the array entry
-                    blinkDurations[i] = 0;
-                    blinkStartTimes[i] = 0;
-                } else {
-                    // Process this blink
-                    int blinkGradientTime = blinkTime * 1000 / blinkDurations[i];
-                    uint32_t blinkColor = gradientIndividual.evaluateColor(animationBits, blinkGradientTime);
-                    outLEDs[i] = Utils::modulateColor(Utils::mulColors(blinkColors[i], blinkColor), intensity);
-                }
+        // Only the blinking leds have a color
+        const int blinkDuration = preset->blinkDurationMs;
+        for (uint32_t remaining = activeBlinks; remaining != 0; remaining &= remaining - 1) {
+            int i = Utils::lowestBitIndex(remaining);
+            auto& blink = blinks[i];
+
+            // Update this blink
+            int blinkTime = (uint16_t)(ms - blink.startTime);
+            if (blinkTime > blinkDuration) {
+                // This blink is over, return black this one time and free the slot
+                outLEDs[blink.led] = 0;
+                activeBlinks &= ~(1u << i);
+                blinkingLEDs &= ~(1u << blink.led);
+            } else {
+                // Process this blink
+                int blinkGradientTime = blinkTime * 1000 / blinkDuration;
+                uint32_t blinkColor = gradientIndividual.evaluateColor(animationBits, blinkGradientTime);
+                uint32_t color = Utils::toColor(blink.color[0], blink.color[1], blink.color[2]);
+                outLEDs[blink.led] = Utils::modulateColor(Utils::mulColors(color, blinkColor), intensity);
             }
-            // Else skip
         }
     }
 
@@ -177,6 +217,16 @@ namespace Animations
         return setIndices(ANIM_FACEMASK_ALL_LEDS, retIndices);
     }
 
+    /// <summary>
+    /// Returns the RGB tracks used by the animation, so their colors can be decoded
+    /// </summary>
+    int AnimationInstanceNoise::getRGBTracks(const RGBTrack* retTracks[]) const {
+        auto preset = getPreset();
+        retTracks[0] = &animationBits->getRGBTrack(preset->overallGradientTrackOffset);
+        retTracks[1] = &animationBits->getRGBTrack(preset->individualGradientTrackOffset);
+        return 2;
+    }
+
     const AnimationNoise* AnimationInstanceNoise::getPreset() const {
         return static_cast<const AnimationNoise*>(animationPreset);
     }
@@ -6,6 +6,9 @@
 
 #pragma pack(push, 1)
 
+// Most blinks that can be lit at the same time, a new blink takes over the oldest one past that
+#define MAX_NOISE_BLINKS 12
+
 namespace Animations
 {
     enum NoiseColorOverrideType : uint8_t
@@ -45,15 +48,26 @@ namespace Animations
 
         virtual void start(int _startTime, uint8_t _remapFace, uint8_t _loopCount);
         virtual int stop(int retIndices[]);
+        virtual int getRGBTracks(const RGBTrack* retTracks[]) const;
         virtual void updateLEDs(int ms, uint32_t* outLEDs);
 
     private:
         
         const AnimationNoise* getPreset() const;
+        int allocBlink(int ms);
+
+        // All blinks last the preset's blinkDurationMs, so only their start is kept
+        struct Blink
+        {
+            uint16_t startTime;         // Low bits of the time in ms, blinks are much shorter than the wrap around
+            uint8_t led;
+            uint8_t color[3];           // Picked from the overall gradient when the blink started
+        };
+
         int nextBlinkTime;
-        int blinkStartTimes[MAX_LED_COUNT];		// state that keeps track of the start of every individual blink so as to know how to fade it based on the time
-        int blinkDurations[MAX_LED_COUNT];	// keeps track of the duration of each individual blink, so as to add a bit of variation 
-        uint32_t blinkColors[MAX_LED_COUNT];
+        Blink blinks[MAX_NOISE_BLINKS];
+        uint16_t activeBlinks;          // Mask of the slots in use
+        uint32_t blinkingLEDs;          // Mask of the leds that are currently blinking
         int ledCount; 					// int that keeps track of how many led's the circuit board has
         int blinkInterValMinMs;
         int blinkInterValDeltaMs;
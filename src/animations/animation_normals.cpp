@@ -43,7 +43,7 @@ namespace Animations
         const Core::int3* normals = layout->faceNormals;
 
         // Grab the orientation normal, based on the current face
-        faceNormal = &normals[_remapFace];
+        const Core::int3* faceNormal = &normals[_remapFace];
         int backFaceOffset = 1;
         Core::int3 backVectorNormal = normals[(_remapFace + backFaceOffset) % layout->faceCount];
         while (abs(Core::int3::dotTimes1000(*faceNormal, backVectorNormal)) > 800 && backFaceOffset < layout->faceCount) {
@@ -55,7 +55,40 @@ namespace Animations
         // a back is at 90 degrees from that.
         auto cross = Core::int3::cross(*faceNormal, backVectorNormal);
         cross.normalize();
-        backVector = Core::int3::cross(cross, *faceNormal);
+        Core::int3 backVector = Core::int3::cross(cross, *faceNormal);
+
+        // The LEDs don't move relative to the face, so the angles are computed once here
+        // rather than every frame
+        for (int i = 0; i < layout->ledCount; ++i) {
+            auto normal = layout->ledNormals[i];
+            // Compute the up/down angle (the angle to the axis)
+            // We'll extract the angle from the dot product of the face's normal and the axis
+            int dotAxisTimes1000 = Core::int3::dotTimes1000(*faceNormal, normal);
+
+            // remap the [-1000, 1000] range to an 8 bit value usable by acos8
+            uint8_t dotAxis8 = (dotAxisTimes1000 * 1275 + 1275000) / 10000;
+
+            // Use lookup acos table
+            angleToAxis8[i] = Utils::acos8(dotAxis8);
+
+            // Compute the angle around the axis, we'll use the dot product to the back vector
+
+            // Start by getting a properly normalized in-plane direction vector
+            Core::int3 inPlaneNormal = normal - *faceNormal * dotAxisTimes1000;
+            inPlaneNormal.normalize();
+
+            // Compute dot product and extract angle
+            int dotBackTimes1000 = Core::int3::dotTimes1000(backVector, inPlaneNormal);
+            int dotBack8 = (dotBackTimes1000 * 1275 + 1275000) / 10000;
+            int angle8 = Utils::acos8(dotBack8);
+
+            // Oops, we need full range so check cross product with axis to swap the sign as needed
+            if (Core::int3::dotTimes1000(Core::int3::cross(backVector, normal), *faceNormal) < 0) {
+                // Negate the angle
+                angle8 = 255 - angle8;
+            }
+            angleToBack8[i] = (uint8_t)angle8;
+        }
 
         // For color override, precompute parameter
         auto preset = getPreset();
@@ -103,19 +136,9 @@ namespace Animations
         auto& angleGradient = animationBits->getRGBTrack(preset->gradientAlongAngle);
         auto layout = Config::SettingsManager::getLayout();
         for (int i = 0; i < layout->ledCount; ++i) {
-            auto normal = layout->ledNormals[i];
             // Compute color relative to up/down angle (based on the angle to axis)
-            // We'll extract the angle from the dot product of the face's normal and the axis
-            int dotAxisTimes1000 = Core::int3::dotTimes1000(*faceNormal, normal);
-
-            // remap the [-1000, 1000] range to an 8 bit value usable by acos8
-            uint8_t dotAxis8 = (dotAxisTimes1000 * 1275 + 1275000) / 10000;
-
-            // Use lookup acos table
-            int angleToAxis8 = Utils::acos8(dotAxis8);
-
             // remap 8 bit value to [-1000, 1000] range
-            int angleToAxisNormalized = (angleToAxis8 - 128) * 1000 / 128;
+            int angleToAxisNormalized = (angleToAxis8[i] - 128) * 1000 / 128;
 
             // Scale / Offset the value so we can use a smaller subset of the gradient
             int axisGradientBaseTime = angleToAxisNormalized * 1000 / preset->axisScaleTimes1000 + preset->axisOffsetTimes1000;
@@ -126,25 +149,9 @@ namespace Animations
             // Compute color along axis
             uint32_t axisColor = axisGradient.evaluateColor(animationBits, axisGradientTime);
 
-            // Compute color relative to up/down angle (angle to axis), we'll use the dot product to the back vector
-
-            // Start by getting a properly normalized in-plane direction vector
-            Core::int3 inPlaneNormal = normal - *faceNormal * dotAxisTimes1000;
-            inPlaneNormal.normalize();
-
-            // Compute dot product and extract angle
-            int dotBackTimes1000 = Core::int3::dotTimes1000(backVector, inPlaneNormal);
-            int dotBack8 = (dotBackTimes1000 * 1275 + 1275000) / 10000;
-            int angleToBack8 = Utils::acos8(dotBack8);
-
-            // Oops, we need full range so check cross product with axis to swap the sign as needed
-            if (Core::int3::dotTimes1000(Core::int3::cross(backVector, normal), *faceNormal) < 0) {
-                // Negate the angle
-                angleToBack8 = 255 - angleToBack8;
-            }
-
+            // Compute color relative to the angle around the axis
             // Remap to proper range
-            int angleToBackTimes1000 = (angleToBack8 - 128) * 1000 / 128;
+            int angleToBackTimes1000 = (angleToBack8[i] - 128) * 1000 / 128;
             int angleGradientNormalized = (angleToBackTimes1000 + 1000) / 2;
 
             // Angle is animated and wrapped around
@@ -187,6 +194,17 @@ namespace Animations
         return setIndices(ANIM_FACEMASK_ALL_LEDS, retIndices);
     }
 
+    /// <summary>
+    /// Returns the RGB tracks used by the animation, so their colors can be decoded
+    /// </summary>
+    int AnimationInstanceNormals::getRGBTracks(const RGBTrack* retTracks[]) const {
+        auto preset = getPreset();
+        retTracks[0] = &animationBits->getRGBTrack(preset->gradientOverTime);
+        retTracks[1] = &animationBits->getRGBTrack(preset->gradientAlongAxis);
+        retTracks[2] = &animationBits->getRGBTrack(preset->gradientAlongAngle);
+        return 3;
+    }
+
     const AnimationNormals* AnimationInstanceNormals::getPreset() const {
         return static_cast<const AnimationNormals*>(animationPreset);
     }
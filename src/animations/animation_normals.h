@@ -2,6 +2,7 @@
 
 #include "animations/Animation.h"
 #include "core/int3.h"
+#include "settings.h"
 
 #pragma pack(push, 1)
 
@@ -45,13 +46,16 @@ namespace Animations
 
         virtual void start(int _startTime, uint8_t _remapFace, uint8_t _loopCount);
         virtual int stop(int retIndices[]);
+        virtual int getRGBTracks(const RGBTrack* retTracks[]) const;
         virtual void updateLEDs(int ms, uint32_t* outLEDs);
 
     private:
         const AnimationNormals* getPreset() const;
-        const Core::int3* faceNormal;
-        Core::int3 backVector;
         int baseColorParam;
+        // Spherical coordinates of each LED relative to the remap face, set by start() since they only
+        // depend on the layout and the face: angle to the face normal and angle around it (8 bit acos)
+        uint8_t angleToAxis8[MAX_LED_COUNT];
+        uint8_t angleToBack8[MAX_LED_COUNT];
     };
 }
 
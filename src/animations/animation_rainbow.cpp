@@ -66,14 +66,8 @@ namespace Animations
 
         auto layout = SettingsManager::getLayout();
         int reverseMapping[MAX_LED_COUNT];
-        // TODO We should do this expensive reverse mapping only once
-        for (int f = 0; f < layout->faceCount; ++f) {
-            for (int ff = 0; ff < layout->faceCount; ++ff) {
-                if (f == layout->remapFaceIndexBasedOnUpFace(remapFace, ff)) {
-                    reverseMapping[f] = ff;
-                    break;
-                }
-            }
+        for (int ff = 0; ff < layout->faceCount; ++ff) {
+            reverseMapping[faceRemap[ff]] = ff;
         }
 
         // Fill the indices and colors for the anim controller to know how to update leds
@@ -6,10 +6,8 @@
 #include "data_set/data_set.h"
 #include "modules/anim_controller.h"
 #include "nrf_log.h"
-#include "drivers_nrf/scheduler.h"
 
 using namespace Modules;
-using namespace DriversNRF;
 
 namespace Animations
 {
@@ -78,25 +76,9 @@ namespace Animations
 
                 NRF_LOG_DEBUG("Starting animation %d", preset->animations[i].animationIndex);
 
-                struct TriggeredAnimation
-                {
-                    const DataSet::AnimationBits* bits;
-                    uint16_t animIndex;
-                    uint8_t remapFace;
-                };
-
-                TriggeredAnimation triggeredAnimation = 
-                {
-                    animationBits,
-                    preset->animations[i].animationIndex,
-                    remapFace
-                };
-                Scheduler::push(&triggeredAnimation, sizeof(TriggeredAnimation), [](void *p_event_data, uint16_t event_size) {
-                    auto ta = (TriggeredAnimation*)p_event_data;
-                    // Start the animation
-                    auto anim = ta->bits->getAnimation(ta->animIndex);
-                    AnimController::play(anim, ta->bits, ta->remapFace, 1);
-                });
+                // Started by the controller once done with us, as if it had been played right on time
+                auto anim = animationBits->getAnimation(preset->animations[i].animationIndex);
+                AnimController::playAt(anim, animationBits, startTime + delay, remapFace, 1);
             }
         }
     }
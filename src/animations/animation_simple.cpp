@@ -78,6 +78,11 @@ namespace Animations
         return setIndices(preset->faceMask, retIndices);
     }
 
+    bool AnimationInstanceSimple::canShareUpdate() const {
+        // The face color is picked when the instance starts
+        return getPreset()->colorIndex != PALETTE_COLOR_FROM_FACE;
+    }
+
     const AnimationSimple* AnimationInstanceSimple::getPreset() const {
         return static_cast<const AnimationSimple*>(animationPreset);
     }
@@ -12,6 +12,7 @@ namespace Animations
         AnimationTag_BluetoothNotification,
         AnimationTag_BatteryNotification,
         AnimationTag_BluetoothMessage,
+        AnimationTag_Count
     };
 
 }
\ No newline at end of file
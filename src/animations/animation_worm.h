@@ -35,6 +35,7 @@ namespace Animations
         virtual void start(int _startTime, uint8_t _remapFace, uint8_t _loopCount);
         virtual int update(int ms, int retIndices[], uint32_t retColors[]);
         virtual int stop(int retIndices[]);
+        virtual int getRGBTracks(const RGBTrack* retTracks[]) const;
 
     private:
         const AnimationWorm *getPreset() const;
@@ -0,0 +1,42 @@
+#include "bit_pattern.h"
+
+namespace Animations
+{
+    /// <summary>
+    /// Empties the pattern, to be filled with append()
+    /// </summary>
+    void BitPattern::reset(uint16_t _stepDurationMs, uint16_t _leadSteps, uint8_t _leadColorIndex, uint8_t _tailColorIndex) {
+        stepDurationMs = _stepDurationMs > 0 ? _stepDurationMs : 1;
+        leadSteps = _leadSteps;
+        stepCount = 0;
+        leadColorIndex = _leadColorIndex;
+        tailColorIndex = _tailColorIndex;
+        for (auto& word : steps) {
+            word = 0;
+        }
+    }
+
+    /// <summary>
+    /// Adds a step at the end of the pattern, returns false if it is full
+    /// </summary>
+    bool BitPattern::append(uint8_t colorIndex) {
+        if (stepCount >= BIT_PATTERN_MAX_STEPS) {
+            return false;
+        }
+        steps[stepCount / 16] |= (uint32_t)(colorIndex & 0x3) << ((stepCount % 16) * 2);
+        stepCount++;
+        return true;
+    }
+
+    uint8_t BitPattern::colorIndexAt(int ms) const {
+        const int step = ms / stepDurationMs;
+        if (step < leadSteps) {
+            return leadColorIndex;
+        }
+        const int index = step - leadSteps;
+        if (index >= stepCount) {
+            return tailColorIndex;
+        }
+        return (steps[index / 16] >> ((index % 16) * 2)) & 0x3;
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+// Steps a pattern can hold, past the lead and before the tail
+#define BIT_PATTERN_MAX_STEPS 48
+
+#pragma pack(push, 1)
+
+namespace Animations
+{
+    /// <summary>
+    /// Sequence of steps of the same duration, each showing one of 4 colors (by index),
+    /// between a lead and a tail of a constant color. The pattern is expanded once,
+    /// finding the color of a given time is then a lookup.
+    /// </summary>
+    struct BitPattern
+    {
+        uint16_t stepDurationMs;
+        uint16_t leadSteps;         // Steps of the lead color, before the pattern
+        uint8_t stepCount;
+        uint8_t leadColorIndex;
+        uint8_t tailColorIndex;     // Color after the pattern
+        uint32_t steps[(BIT_PATTERN_MAX_STEPS * 2 + 31) / 32]; // 2 bits per step
+
+        void reset(uint16_t _stepDurationMs, uint16_t _leadSteps, uint8_t _leadColorIndex, uint8_t _tailColorIndex);
+        bool append(uint8_t colorIndex);
+
+        // Color index at the given time since the start of the lead
+        uint8_t colorIndexAt(int ms) const;
+    };
+}
+
+#pragma pack(pop)
@@ -10,7 +10,7 @@ namespace Animations
     Blink::Blink()
     {
         animBits.Clear();
-        animBits.palette = animPalette;
+        animBits.palette.set(&animBits, animPalette);
         animBits.paletteSize = 3;
     }
 
@@ -4,21 +4,180 @@
 #include "config/settings.h"
 #include "config/dice_variants.h"
 #include "data_set/data_animation_bits.h"
+#include "app_util_platform.h"
+#include "core/ram_function.h"
 
 using namespace Config;
 
 namespace Animations
 {
+    /// <summary>
+    /// Returns the index of the first keyframe at or after the given time (or count if there is none).
+    /// If a cursor is passed and time moved forward since the last call, scan from where we left off,
+    /// which is O(1) amortized, otherwise binary search.
+    /// </summary>
+    template <typename KeyframeType>
+    RAM_FUNCTION int findNextKeyframeIndex(const KeyframeType* keyframes, int count, int time, uint8_t* cursor) {
+        int index = 0;
+        if (cursor != nullptr && *cursor <= count && (*cursor == 0 || keyframes[*cursor - 1].time() < time)) {
+            index = *cursor;
+            while (index < count && keyframes[index].time() < time) {
+                index++;
+            }
+        } else {
+            int low = 0;
+            int high = count;
+            while (low < high) {
+                int mid = (low + high) / 2;
+                if (keyframes[mid].time() < time) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+            index = low;
+        }
+        if (cursor != nullptr) {
+            *cursor = (uint8_t)index;
+        }
+        return index;
+    }
+
+    /// <summary>
+    /// Entry of the decoded colors cache, the colors of a track are stored contiguously in the pool
+    /// </summary>
+    struct DecodedTrack
+    {
+        const RGBTrack* track;
+        uint8_t refCount;
+        uint8_t firstColor;
+        uint8_t ramp;           // Index of the track's ramp, NO_RAMP if it has none
+        uint8_t evaluations;    // Counts up to RGB_TRACK_RAMP_THRESHOLD
+    };
+    #define NO_RAMP 0xFF
+
+    static DecodedTrack decodedTracks[MAX_DECODED_RGB_TRACKS];
+    static uint32_t decodedColors[MAX_DECODED_RGB_COLORS];
+    static uint64_t decodedColorsUsedMask = 0;
+    static int decodedTrackCount = 0;
+
+    static DecodedTrack* findDecodedTrack(const RGBTrack* track) {
+        for (int i = 0; i < MAX_DECODED_RGB_TRACKS; ++i) {
+            if (decodedTracks[i].track == track) {
+                return &decodedTracks[i];
+            }
+        }
+        return nullptr;
+    }
+
+    static uint64_t colorRangeMask(int first, int count) {
+        return (count == 64 ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1)) << first;
+    }
+
+    /// <summary>
+    /// Precomputed colors of a decoded track, spread evenly between its first and last keyframe
+    /// </summary>
+    struct TrackRamp
+    {
+        DecodedTrack* owner;    // nullptr when free
+        uint16_t startTime;
+        uint16_t endTime;
+        uint16_t lastUse;
+        uint32_t colors[RGB_TRACK_RAMP_SIZE];
+    };
+
+#if MAX_RGB_TRACK_RAMPS > 0
+    static TrackRamp ramps[MAX_RGB_TRACK_RAMPS];
+    static uint16_t rampClock = 0;
+#endif
+
+    static void releaseRamp(DecodedTrack* entry) {
+#if MAX_RGB_TRACK_RAMPS > 0
+        if (entry->ramp != NO_RAMP) {
+            ramps[entry->ramp].owner = nullptr;
+            entry->ramp = NO_RAMP;
+        }
+#endif
+    }
+
+    /// <summary>
+    /// Decodes the colors of a track into the cache, or adds a reference if it is already in there.
+    /// Returns false if the cache is full or the track can't be cached, the track will then keep
+    /// reading its palette colors from flash.
+    /// </summary>
+    bool acquireDecodedColors(const DataSet::AnimationBits* bits, const RGBTrack* track) {
+        if (track->keyFrameCount == 0 || track->keyFrameCount > MAX_DECODED_RGB_COLORS) {
+            return false;
+        }
+        for (int i = 0; i < track->keyFrameCount; ++i) {
+            if (track->getRGBKeyframe(bits, i).colorIndex() == PALETTE_COLOR_FROM_FACE) {
+                return false;
+            }
+        }
+
+        bool ret = false;
+        CRITICAL_REGION_ENTER();
+        DecodedTrack* entry = findDecodedTrack(track);
+        if (entry != nullptr) {
+            entry->refCount++;
+            ret = true;
+        } else {
+            entry = findDecodedTrack(nullptr);
+            if (entry != nullptr) {
+                // First fit in the color pool
+                for (int first = 0; first + track->keyFrameCount <= MAX_DECODED_RGB_COLORS; ++first) {
+                    uint64_t mask = colorRangeMask(first, track->keyFrameCount);
+                    if ((decodedColorsUsedMask & mask) == 0) {
+                        decodedColorsUsedMask |= mask;
+                        for (int i = 0; i < track->keyFrameCount; ++i) {
+                            decodedColors[first + i] = track->getRGBKeyframe(bits, i).color(bits);
+                        }
+                        entry->track = track;
+                        entry->refCount = 1;
+                        entry->firstColor = (uint8_t)first;
+                        entry->ramp = NO_RAMP;
+                        entry->evaluations = 0;
+                        decodedTrackCount++;
+                        ret = true;
+                        break;
+                    }
+                }
+            }
+        }
+        CRITICAL_REGION_EXIT();
+        return ret;
+    }
+
+    /// <summary>
+    /// Drops a reference to the decoded colors of a track, freeing them when no instance uses them anymore
+    /// </summary>
+    void releaseDecodedColors(const RGBTrack* track) {
+        CRITICAL_REGION_ENTER();
+        DecodedTrack* entry = findDecodedTrack(track);
+        if (entry != nullptr) {
+            entry->refCount--;
+            if (entry->refCount == 0) {
+                releaseRamp(entry);
+                decodedColorsUsedMask &= ~colorRangeMask(entry->firstColor, track->keyFrameCount);
+                entry->track = nullptr;
+                decodedTrackCount--;
+            }
+        }
+        CRITICAL_REGION_EXIT();
+    }
 
     uint16_t RGBKeyframe::time() const {
         // Take the upper 9 bits and multiply by 2 (scale it to 0 -> 1024)
         return (timeAndColor >> 7) * 2;
     }
     
-    uint32_t RGBKeyframe::color(const DataSet::AnimationBits* bits) const {
+    uint16_t RGBKeyframe::colorIndex() const {
         // Take the lower 7 bits for the index
-        uint16_t index = timeAndColor & 0b1111111;
-        return bits->getPaletteColor(index);
+        return timeAndColor & 0b1111111;
+    }
+
+    uint32_t RGBKeyframe::color(const DataSet::AnimationBits* bits) const {
+        return bits->getPaletteColor(colorIndex());
     }
 
     void RGBKeyframe::setTimeAndColorIndex(uint16_t timeMs, uint16_t colorIndex) {
@@ -41,57 +200,135 @@ namespace Animations
         return bits->getRGBKeyframe(keyframesOffset + keyframeIndex);
     }
 
+    // Mask of the track LEDs that the current layout has
+    static uint32_t layoutLEDMask(uint32_t ledMask) {
+        int ledCount = SettingsManager::getLayout()->ledCount;
+        return ledCount < 32 ? ledMask & ((1u << ledCount) - 1) : ledMask;
+    }
+
     /// <summary>
-    /// Evaluate an animation track's for a given time, in milliseconds, and fills returns arrays of led indices and colors
+    /// Evaluate an animation track's for a given time, in milliseconds, and writes the color of each of its leds
     /// Values outside the track's range are clamped to first or last keyframe value.
     /// </summary>
-    int RGBTrack::evaluate(const DataSet::AnimationBits* bits, int time, int retIndices[], uint32_t retColors[]) const {
+    uint32_t RGBTrack::evaluate(const DataSet::AnimationBits* bits, int time, uint32_t outColors[]) const {
         if (keyFrameCount == 0)
             return 0;
 
         uint32_t color = evaluateColor(bits, time);
 
-        // Fill the return arrays
-        int currentCount = 0;
-        int ledCount = SettingsManager::getLayout()->ledCount;
-        for (int i = 0; i < ledCount; ++i) {
-            if (ledMask & (1 << i)) {
-                retIndices[currentCount] = i;
-                retColors[currentCount] = color;
-                currentCount++;
+        // Only visit the set bits
+        uint32_t mask = layoutLEDMask(ledMask);
+        for (uint32_t remaining = mask; remaining != 0; remaining &= remaining - 1) {
+            outColors[Utils::lowestBitIndex(remaining)] = color;
+        }
+        return mask;
+    }
+
+#if MAX_RGB_TRACK_RAMPS > 0
+    /// <summary>
+    /// Counts the evaluations of a decoded track, and gives it a ramp (the free or least recently
+    /// used one) once it has been evaluated often enough. Returns true if it has one.
+    /// </summary>
+    static bool buildRamp(const DataSet::AnimationBits* bits, DecodedTrack* entry) {
+        if (entry->evaluations < RGB_TRACK_RAMP_THRESHOLD) {
+            entry->evaluations++;
+            return false;
+        }
+
+        // Decoded colors may be released from an interrupt
+        CRITICAL_REGION_ENTER();
+        if (entry->track != nullptr && entry->ramp == NO_RAMP) {
+            int index = 0;
+            for (int i = 0; i < MAX_RGB_TRACK_RAMPS; ++i) {
+                if (ramps[i].owner == nullptr) {
+                    index = i;
+                    break;
+                }
+                if ((uint16_t)(rampClock - ramps[i].lastUse) > (uint16_t)(rampClock - ramps[index].lastUse)) {
+                    index = i;
+                }
+            }
+            auto& ramp = ramps[index];
+            if (ramp.owner != nullptr) {
+                ramp.owner->ramp = NO_RAMP;
+                ramp.owner->evaluations = 0;
+            }
+
+            auto track = entry->track;
+            const uint32_t* decoded = &decodedColors[entry->firstColor];
+            ramp.startTime = track->getRGBKeyframe(bits, 0).time();
+            ramp.endTime = track->getRGBKeyframe(bits, track->keyFrameCount - 1).time();
+            uint8_t cursor = 0;
+            for (int i = 0; i < RGB_TRACK_RAMP_SIZE; ++i) {
+                int time = ramp.startTime + (ramp.endTime - ramp.startTime) * i / (RGB_TRACK_RAMP_SIZE - 1);
+                ramp.colors[i] = track->interpolateColor(bits, decoded, time, &cursor);
             }
+            ramp.owner = entry;
+            ramp.lastUse = rampClock;
+            entry->ramp = (uint8_t)index;
+        }
+        CRITICAL_REGION_EXIT();
+        return entry->ramp != NO_RAMP;
+    }
+
+    static uint32_t rampColor(TrackRamp& ramp, int time) {
+        ramp.lastUse = ++rampClock;
+        if (time <= ramp.startTime) {
+            return ramp.colors[0];
+        } else if (time >= ramp.endTime) {
+            return ramp.colors[RGB_TRACK_RAMP_SIZE - 1];
+        } else {
+            uint32_t pos = (time - ramp.startTime) * ((RGB_TRACK_RAMP_SIZE - 1) * 256) / (ramp.endTime - ramp.startTime);
+            int index = pos >> 8;
+            return Utils::mixColors(ramp.colors[index], ramp.colors[index + 1], pos & 0xFF);
         }
-        return currentCount;
     }
+#endif
 
     /// <summary>
     /// Evaluate an animation track's for a given time, in milliseconds
     /// Values outside the track's range are clamped to first or last keyframe value.
     /// </summary>
-    uint32_t RGBTrack::evaluateColor(const DataSet::AnimationBits* bits, int time) const
+    uint32_t RGBTrack::evaluateColor(const DataSet::AnimationBits* bits, int time, uint8_t* cursor) const
     {
-        // Find the first keyframe
-        int nextIndex = 0;
-        while (nextIndex < keyFrameCount && getRGBKeyframe(bits, nextIndex).time() < time) {
-            nextIndex++;
+        // Use the decoded colors if the track is cached
+        const uint32_t* decoded = nullptr;
+        if (decodedTrackCount > 0) {
+            DecodedTrack* entry = findDecodedTrack(this);
+            if (entry != nullptr) {
+#if MAX_RGB_TRACK_RAMPS > 0
+                if (entry->ramp != NO_RAMP || buildRamp(bits, entry)) {
+                    return rampColor(ramps[entry->ramp], time);
+                }
+#endif
+                decoded = &decodedColors[entry->firstColor];
+            }
         }
+        return interpolateColor(bits, decoded, time, cursor);
+    }
+
+    /// <summary>
+    /// Interpolates between the keyframes around the given time
+    /// </summary>
+    RAM_FUNCTION uint32_t RGBTrack::interpolateColor(const DataSet::AnimationBits* bits, const uint32_t* decoded, int time, uint8_t* cursor) const
+    {
+        // Find the first keyframe
+        int nextIndex = findNextKeyframeIndex(&bits->getRGBKeyframe(keyframesOffset), keyFrameCount, time, cursor);
 
         uint32_t color = 0;
         if (nextIndex == 0) {
             // The first keyframe is already after the requested time, clamp to first value
-            color = getRGBKeyframe(bits, nextIndex).color(bits);
+            color = keyframeColor(bits, decoded, nextIndex);
         } else if (nextIndex == keyFrameCount) {
             // The last keyframe is still before the requested time, clamp to the last value
-            color = getRGBKeyframe(bits, nextIndex- 1).color(bits);
+            color = keyframeColor(bits, decoded, nextIndex - 1);
         } else {
             // Grab the prev and next keyframes
-            auto nextKeyframe = getRGBKeyframe(bits, nextIndex);
-            uint16_t nextKeyframeTime = nextKeyframe.time();
-            uint32_t nextKeyframeColor = nextKeyframe.color(bits);
+            uint16_t nextKeyframeTime = getRGBKeyframe(bits, nextIndex).time();
+            uint32_t nextKeyframeColor = keyframeColor(bits, decoded, nextIndex);
 
-            auto prevKeyframe = getRGBKeyframe(bits, nextIndex - 1);
-            uint16_t prevKeyframeTime = prevKeyframe.time();
-            uint32_t prevKeyframeColor = prevKeyframe.color(bits);
+            uint16_t prevKeyframeTime = getRGBKeyframe(bits, nextIndex - 1).time();
+            uint32_t prevKeyframeColor = keyframeColor(bits, decoded, nextIndex - 1);
 
             // Compute the interpolation parameter
             color = Utils::interpolateColors(prevKeyframeColor, prevKeyframeTime, nextKeyframeColor, nextKeyframeTime, time);
@@ -100,6 +337,17 @@ namespace Animations
         return color;
     }
 
+    /// <summary>
+    /// Returns the color of a keyframe, from the decoded colors if available
+    /// </summary>
+    uint32_t RGBTrack::keyframeColor(const DataSet::AnimationBits* bits, const uint32_t* decoded, int keyframeIndex) const {
+        if (decoded != nullptr) {
+            return decoded[keyframeIndex];
+        } else {
+            return getRGBKeyframe(bits, keyframeIndex).color(bits);
+        }
+    }
+
     /// <summary>
     /// Extracts the LED indices from the led bit mask
     /// </summary>
@@ -150,39 +398,30 @@ namespace Animations
     }
 
     /// <summary>
-    /// Evaluate an animation track's for a given time, in milliseconds, and fills returns arrays of led indices and colors
+    /// Evaluate an animation track's for a given time, in milliseconds, and writes the modulated color of each of its leds
     /// Values outside the track's range are clamped to first or last keyframe value.
     /// </summary>
-    int Track::evaluate(const DataSet::AnimationBits* bits, uint32_t color, int time, int retIndices[], uint32_t retColors[]) const {
+    uint32_t Track::evaluate(const DataSet::AnimationBits* bits, uint32_t color, int time, uint32_t outColors[]) const {
         if (keyFrameCount == 0)
             return 0;
 
         uint32_t mcolor = modulateColor(bits, color, time);
 
-        // Fill the return arrays
-        int currentCount = 0;
-        int ledCount = SettingsManager::getLayout()->ledCount;
-        for (int i = 0; i < ledCount; ++i) {
-            if (ledMask & (1 << i)) {
-                retIndices[currentCount] = i;
-                retColors[currentCount] = mcolor;
-                currentCount++;
-            }
+        uint32_t mask = layoutLEDMask(ledMask);
+        for (uint32_t remaining = mask; remaining != 0; remaining &= remaining - 1) {
+            outColors[Utils::lowestBitIndex(remaining)] = mcolor;
         }
-        return currentCount;
+        return mask;
     }
 
     /// <summary>
     /// Evaluate an animation track's for a given time, in milliseconds
     /// Values outside the track's range are clamped to first or last keyframe value.
     /// </summary>
-    uint32_t Track::modulateColor(const DataSet::AnimationBits* bits, uint32_t color, int time) const
+    RAM_FUNCTION uint32_t Track::modulateColor(const DataSet::AnimationBits* bits, uint32_t color, int time, uint8_t* cursor) const
     {
         // Find the first keyframe
-        int nextIndex = 0;
-        while (nextIndex < keyFrameCount && getKeyframe(bits, (uint16_t)nextIndex).time() < time) {
-            nextIndex++;
-        }
+        int nextIndex = findNextKeyframeIndex(&bits->getKeyframe(keyframesOffset), keyFrameCount, time, cursor);
 
         uint8_t intensity = 0;
         if (nextIndex == 0) {
@@ -4,6 +4,16 @@
 
 #pragma pack(push, 1)
 
+// Capacity of the RAM cache of decoded palette colors, shared by the tracks of the playing animations
+#define MAX_DECODED_RGB_TRACKS 8
+#define MAX_DECODED_RGB_COLORS 64
+
+// Decoded tracks evaluated often (e.g. per face) also get a precomputed color ramp, that is
+// interpolated instead of the keyframes. Set the ramp count to 0 to always use the keyframes.
+#define MAX_RGB_TRACK_RAMPS 2
+#define RGB_TRACK_RAMP_SIZE 64
+#define RGB_TRACK_RAMP_THRESHOLD 64 // Evaluations of a track before it gets a ramp
+
 namespace Animations
 {
     /// <summary>
@@ -20,6 +30,7 @@ namespace Animations
         uint16_t timeAndColor;
 
         uint16_t time() const; // unpack the time in ms
+        uint16_t colorIndex() const; // unpack the palette index
         uint32_t color(const DataSet::AnimationBits* bits) const;// unpack the color using the lookup table from the animation set
 
         void setTimeAndColorIndex(uint16_t timeMs, uint16_t colorIndex);
@@ -32,7 +43,7 @@ namespace Animations
     struct RGBTrack
     {
     public:
-        uint16_t keyframesOffset;	// offset into a global keyframe buffer
+        uint16_t keyframesOffset;	// offset into a global keyframe buffer, several tracks may share the same keyframes
         uint8_t keyFrameCount;		// Keyframe count
         uint8_t padding;
         uint32_t ledMask; 			// indicates which LEDs to drive
@@ -40,11 +51,23 @@ namespace Animations
         // Tracks are expected to 1s long
         uint16_t getDuration(const DataSet::AnimationBits* bits) const;
         const RGBKeyframe& getRGBKeyframe(const DataSet::AnimationBits* bits, uint16_t keyframeIndex) const;
-        int evaluate(const DataSet::AnimationBits* bits, int time, int retIndices[], uint32_t retColors[]) const;
-        uint32_t evaluateColor(const DataSet::AnimationBits* bits, int time) const;
+        // Writes the track color to outColors for each of its LEDs, and returns the mask of the LEDs written
+        uint32_t evaluate(const DataSet::AnimationBits* bits, int time, uint32_t outColors[]) const;
+        // The optional cursor remembers where the last lookup ended, pass one per instance when time only moves forward
+        uint32_t evaluateColor(const DataSet::AnimationBits* bits, int time, uint8_t* cursor = nullptr) const;
+        // Same, straight from the keyframes (or their decoded colors) without going through the ramps
+        uint32_t interpolateColor(const DataSet::AnimationBits* bits, const uint32_t* decodedColors, int time, uint8_t* cursor) const;
         int extractLEDIndices(int retIndices[]) const;
+
+    private:
+        uint32_t keyframeColor(const DataSet::AnimationBits* bits, const uint32_t* decodedColors, int keyframeIndex) const;
     };
 
+    // Decoded palette colors, so that playing tracks don't unpack the palette every frame.
+    // Tracks using the face color are never cached since their color changes with the die orientation.
+    bool acquireDecodedColors(const DataSet::AnimationBits* bits, const RGBTrack* track);
+    void releaseDecodedColors(const RGBTrack* track);
+
     /// <summary>
     /// Stores a single keyframe of a LED animation
     /// size: 2 bytes, split this way:
@@ -70,7 +93,7 @@ namespace Animations
     struct Track
     {
     public:
-        uint16_t keyframesOffset;	// offset into a global keyframe buffer
+        uint16_t keyframesOffset;	// offset into a global keyframe buffer, several tracks may share the same keyframes
         uint8_t keyFrameCount;		// Keyframe count
         uint8_t padding;
         uint32_t ledMask; 			// indicates which LEDs to drive
@@ -78,8 +101,9 @@ namespace Animations
         // Tracks are expected to 1s long
         uint16_t getDuration(const DataSet::AnimationBits *bits) const;
         const Keyframe& getKeyframe(const DataSet::AnimationBits* bits, uint16_t keyframeIndex) const;
-        int evaluate(const DataSet::AnimationBits* bits, uint32_t color, int time, int retIndices[], uint32_t retColors[]) const;
-        uint32_t modulateColor(const DataSet::AnimationBits* bits, uint32_t color, int time) const;
+        // Writes the modulated color to outColors for each of the track LEDs, and returns the mask of the LEDs written
+        uint32_t evaluate(const DataSet::AnimationBits* bits, uint32_t color, int time, uint32_t outColors[]) const;
+        uint32_t modulateColor(const DataSet::AnimationBits* bits, uint32_t color, int time, uint8_t* cursor = nullptr) const;
         int extractLEDIndices(int retIndices[]) const;
     };
 
@@ -0,0 +1,182 @@
+#include "accel_stream.h"
+#include "bluetooth_message_service.h"
+#include "bluetooth_messages.h"
+#include "bluetooth_stack.h"
+#include "app_util.h"
+#include "nrf_log.h"
+#include "drivers_nrf/timers.h"
+#include "drivers_hw/accel_chip.h"
+#include "modules/accelerometer.h"
+#include "core/int3.h"
+#include <stddef.h>
+#include <string.h>
+
+#define ACCEL_STREAM_MIN_DELTA_BITS 8
+#define ACCEL_STREAM_MAX_DELTA_BITS 12
+
+using namespace Modules;
+using namespace DriversHW;
+using namespace Core;
+
+namespace Bluetooth::AccelStream
+{
+    static MessageAccelStream streamMessage;
+    static uint16_t sampleRateHz = 0;   // 0 when not streaming
+    static uint8_t deltaBits = ACCEL_STREAM_MAX_DELTA_BITS;
+    static uint16_t bitCount = 0;       // Bits written to streamMessage.deltas
+    static uint16_t maxDeltaBits = 0;   // Bits that fit in a notification at the current MTU
+    static int3 previousSample;
+    static bool batchFull = false;      // Waiting for the send queue to drain
+    static uint8_t droppedCount = 0;
+
+    void onRequestAccelStreamHandler(const Message* message);
+    void onConnectionEvent(void* param, bool connected);
+    void onAccelSample(void* param, const int3& acc);
+
+    void init() {
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestAccelStream, onRequestAccelStreamHandler);
+        NRF_LOG_DEBUG("Accel stream init");
+    }
+
+    void beginBatch(const int3& acc) {
+        streamMessage.time = DriversNRF::Timers::millis();
+        streamMessage.sampleRateHz = sampleRateHz;
+        streamMessage.deltaBits = deltaBits;
+        streamMessage.sampleCount = 1;
+        streamMessage.droppedCount = droppedCount;
+        streamMessage.first = acc;
+        memset(streamMessage.deltas, 0, sizeof(streamMessage.deltas));
+        bitCount = 0;
+        droppedCount = 0;
+        previousSample = acc;
+
+        // The whole batch must fit in a single notification
+        int maxDeltaBytes = (int)Stack::getMaxPayloadSize() - (int)offsetof(MessageAccelStream, deltas);
+        maxDeltaBits = MIN(MAX(maxDeltaBytes, 0), (int)sizeof(streamMessage.deltas)) * 8;
+    }
+
+    /// <summary>
+    /// Sends the current batch unless the message service already has messages waiting,
+    /// in which case the batch is kept and incoming samples are dropped until it goes out.
+    /// A batch the stack refuses is counted as dropped in the next one.
+    /// </summary>
+    void trySendBatch() {
+        if (MessageService::canSendImmediately()) {
+            int size = offsetof(MessageAccelStream, deltas) + (bitCount + 7) / 8;
+            if (!MessageService::SendMessage(&streamMessage, size)) {
+                NRF_LOG_WARNING("Accel stream batch of %d samples dropped", streamMessage.sampleCount);
+                droppedCount = (uint8_t)MIN(droppedCount + streamMessage.sampleCount, 0xFF);
+            }
+            streamMessage.sampleCount = 0;
+            batchFull = false;
+        } else {
+            batchFull = true;
+        }
+    }
+
+    void writeBits(int value, int bits) {
+        uint32_t v = (uint32_t)value & ((1 << bits) - 1);
+        while (bits > 0) {
+            int shift = bitCount & 7;
+            int n = 8 - shift;
+            if (n > bits) {
+                n = bits;
+            }
+            streamMessage.deltas[bitCount >> 3] |= (uint8_t)(v << shift);
+            v >>= n;
+            bits -= n;
+            bitCount += n;
+        }
+    }
+
+    void onAccelSample(void* param, const int3& acc) {
+        if (batchFull) {
+            trySendBatch();
+        }
+        if (batchFull) {
+            if (droppedCount < 0xFF) {
+                droppedCount++;
+            }
+            return;
+        }
+
+        if (streamMessage.sampleCount == 0) {
+            beginBatch(acc);
+            return;
+        }
+
+        int dx = acc.xTimes1000 - previousSample.xTimes1000;
+        int dy = acc.yTimes1000 - previousSample.yTimes1000;
+        int dz = acc.zTimes1000 - previousSample.zTimes1000;
+        int limit = 1 << (deltaBits - 1);
+        if (dx < -limit || dx >= limit || dy < -limit || dy >= limit || dz < -limit || dz >= limit ||
+            bitCount + 3 * deltaBits > maxDeltaBits) {
+            // Too big a jump for a delta, or no room left at the current MTU, start a new batch with this sample
+            trySendBatch();
+            if (batchFull) {
+                if (droppedCount < 0xFF) {
+                    droppedCount++;
+                }
+            } else {
+                beginBatch(acc);
+            }
+            return;
+        }
+
+        writeBits(dx, deltaBits);
+        writeBits(dy, deltaBits);
+        writeBits(dz, deltaBits);
+        streamMessage.sampleCount++;
+        previousSample = acc;
+
+        // Send as soon as another sample wouldn't fit
+        if (bitCount + 3 * deltaBits > maxDeltaBits) {
+            trySendBatch();
+        }
+    }
+
+    void onConnectionEvent(void* param, bool connected) {
+        if (!connected) {
+            stop();
+        }
+    }
+
+    void onRequestAccelStreamHandler(const Message* message) {
+        auto req = static_cast<const MessageRequestAccelStream*>(message);
+        NRF_LOG_DEBUG("Received Accel Stream Request, rate = %d, bits = %d", req->sampleRateHz, req->deltaBits);
+        if (req->sampleRateHz != 0) {
+            start(req->sampleRateHz, req->deltaBits);
+        } else {
+            stop();
+        }
+    }
+
+    void start(uint16_t rateHz, uint8_t bits) {
+        if (bits < ACCEL_STREAM_MIN_DELTA_BITS || bits > ACCEL_STREAM_MAX_DELTA_BITS) {
+            bits = ACCEL_STREAM_MAX_DELTA_BITS;
+        }
+        deltaBits = bits;
+        streamMessage.sampleCount = 0;
+        batchFull = false;
+        droppedCount = 0;
+
+        bool wasStreaming = sampleRateHz != 0;
+        sampleRateHz = AccelChip::setStreamRate(rateHz);
+        NRF_LOG_INFO("Accel stream on @ %dHz, %d bits", sampleRateHz, deltaBits);
+        if (!wasStreaming) {
+            Bluetooth::Stack::hook(onConnectionEvent, nullptr);
+            AccelChip::hook(onAccelSample, nullptr);
+            Accelerometer::setStreaming(true);
+        }
+    }
+
+    void stop() {
+        if (sampleRateHz != 0) {
+            NRF_LOG_INFO("Accel stream off");
+            sampleRateHz = 0;
+            Bluetooth::Stack::unHook(onConnectionEvent);
+            AccelChip::unHook(onAccelSample);
+            Accelerometer::setStreaming(false);
+        }
+    }
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "stdint.h"
+
+namespace Bluetooth::AccelStream
+{
+    void init();
+    void start(uint16_t sampleRateHz, uint8_t deltaBits);
+    void stop();
+}
@@ -3,14 +3,39 @@
 #include "bluetooth_custom_advertising_data.h"
 #include "modules/accelerometer.h"
 #include "modules/battery_controller.h"
+#include "modules/temperature.h"
+#include "data_set/data_set.h"
 #include "config/board_config.h"
 #include "config/dice_variants.h"
 #include "die.h"
 #include "ble_advdata.h"
 #include "ble_advertising.h"
+#include "drivers_nrf/timers.h"
+#include "app_timer.h"
+#include "nrf_log.h"
+#include <stddef.h>
+
+// Updates are pushed to the SoftDevice no more often than the default advertising interval (187.5 ms),
+// faster changes couldn't be seen by a scanner anyway
+#define ADV_DATA_UPDATE_MIN_INTERVAL_MS 188
+
+// In broadcast mode, roll results are advertised that fast for a short while
+#define BROADCAST_FAST_INTERVAL_MS 20
+#define BROADCAST_BURST_MS 1000
+
+// Roll results kept in the extended advertising data
+#define ADV_LAST_FACES_COUNT 4
+
+// Advertising speeds up when the die is moved, so a phone finds it quickly when a player picks it up,
+// and then slows down by doubling the interval at every step while the die stays still
+#define ADV_INTERVAL_ACTIVE_MS 20
+#define ADV_INTERVAL_IDLE_MS 1000
+#define ADV_INTERVAL_DEFAULT_MS 188 // Until the first motion, see APP_ADV_INTERVAL
+#define ADV_BACKOFF_STEP_MS 5000
 
 using namespace Config;
 using namespace Modules;
+using namespace DriversNRF;
 
 namespace Bluetooth::CustomAdvertisingDataHandler
 {
@@ -23,40 +48,116 @@ namespace Bluetooth::CustomAdvertisingDataHandler
         Accelerometer::RollState rollState; // Indicates whether the dice is being shaken, 8 bits
         uint8_t currentFace; // Which face is currently up
         uint8_t batteryLevelAndCharging; // Charge level in percent, MSB is charging
+        uint8_t rollCounter; // Broadcast mode only, incremented on each roll result so scanners don't miss or repeat one
+
+        // Extended advertising only
+        uint8_t lastFaces[ADV_LAST_FACES_COUNT]; // Most recent roll results first
+        int16_t mcuTemperatureTimes100;
+        int16_t batteryTemperatureTimes100;
+        uint32_t dataSetHash; // Identifies the profile and animations on the die
     };
 #pragma pack(pop)
 
-    // Global custom manufacturer and service data
+    // Global custom manufacturer and service data, and the copy last given to the stack
     static CustomManufacturerData customManufacturerData;
+    static CustomManufacturerData publishedManufacturerData;
+
+    static bool updateThrottled = false;    // An update was pushed less than ADV_DATA_UPDATE_MIN_INTERVAL_MS ago
+    APP_TIMER_DEF(updateTimer);
+
+    static bool started = false;
+    static bool modulesReady = false;
+    static bool broadcastMode = false;
+    static bool burstActive = false;
+    APP_TIMER_DEF(burstTimer);
+
+    static uint16_t advIntervalMs = ADV_INTERVAL_DEFAULT_MS;
+    static uint16_t idleIntervalMs = ADV_INTERVAL_IDLE_MS;
+    APP_TIMER_DEF(backoffTimer);
 
     void onRollStateChange(void* param, Accelerometer::RollState prevState, int prevFace, Accelerometer::RollState newState, int newFace);
     void onBatteryStateChange(void *param, BatteryController::BatteryState state);
     void onBatteryLevelChange(void *param, uint8_t levelPercent);
+    void onTemperatureChange(void* param, int32_t mcuTempTimes100, int32_t ntcTempTimes100);
     void updateCustomAdvertisingDataState(Accelerometer::RollState newState, int newFace);
     void updateCustomAdvertisingDataBattery(uint8_t batteryValue, uint8_t mask);
+    void onUpdateTimer(void* context);
+    void onBurstTimer(void* context);
+    void onBackoffTimer(void* context);
+    void setBroadcastModeHandler(const Message* msg);
 
     void init() {
         // Set custom advertising data values to 0
         // Actual values will be updated on start()
         memset(&customManufacturerData, 0, sizeof(customManufacturerData));
+        memset(&publishedManufacturerData, 0, sizeof(publishedManufacturerData));
+
+        Timers::createTimer(&updateTimer, APP_TIMER_MODE_SINGLE_SHOT, onUpdateTimer);
+        Timers::createTimer(&burstTimer, APP_TIMER_MODE_SINGLE_SHOT, onBurstTimer);
+        Timers::createTimer(&backoffTimer, APP_TIMER_MODE_SINGLE_SHOT, onBackoffTimer);
+
+        MessageService::RegisterMessageHandler(Message::MessageType_SetBroadcastMode, setBroadcastModeHandler);
+    }
+
+    void publish() {
+        memcpy(&publishedManufacturerData, &customManufacturerData, sizeof(customManufacturerData));
+
+        // The roll counter is left out of the payload unless broadcasting, so there's more room for the name,
+        // and only extended advertising has room for the rest
+        uint16_t size = offsetof(CustomManufacturerData, rollCounter);
+        if (Stack::isExtendedAdvertising()) {
+            size = sizeof(publishedManufacturerData);
+        } else if (broadcastMode) {
+            size = offsetof(CustomManufacturerData, lastFaces);
+        }
+        Bluetooth::Stack::updateCustomAdvertisingData((uint8_t*)&publishedManufacturerData, size);
+    }
+
+    /// <summary>
+    /// Pushes the custom data right away, regardless of the update rate limit
+    /// </summary>
+    void publishNow() {
+        Timers::stopTimer(updateTimer);
+        publish();
+        updateThrottled = true;
+        Timers::startTimer(updateTimer, ADV_DATA_UPDATE_MIN_INTERVAL_MS);
+    }
+
+    /// <summary>
+    /// Pushes the custom data to the stack if it changed, right away unless an update just went out,
+    /// in which case the latest data is pushed when the update timer fires
+    /// </summary>
+    void requestUpdate() {
+        if (!updateThrottled && memcmp(&publishedManufacturerData, &customManufacturerData, sizeof(customManufacturerData)) != 0) {
+            publish();
+            updateThrottled = true;
+            Timers::startTimer(updateTimer, ADV_DATA_UPDATE_MIN_INTERVAL_MS);
+        }
+    }
+
+    void onUpdateTimer(void* context) {
+        updateThrottled = false;
+
+        // Publish whatever changed meanwhile
+        requestUpdate();
     }
 
     bool isChargingOrDone(BatteryController::BatteryState state) {
         return state >= BatteryController::BatteryState_Charging && state <= BatteryController::BatteryState_Done;
     }
 
-    void start() {
-        // Initialize the custom advertising data
-        customManufacturerData.ledCount = Config::BoardManager::getBoard()->ledCount;
-        customManufacturerData.designAndColor = (SettingsManager::getDieType() << 4) | SettingsManager::getColorway();
+    /// <summary>
+    /// Reads the state of the modules into the custom data and registers for their changes
+    /// </summary>
+    void trackModules() {
         customManufacturerData.currentFace = Accelerometer::currentFace();
         customManufacturerData.rollState = Accelerometer::currentRollState();
         customManufacturerData.batteryLevelAndCharging =
             (BatteryController::getLevelPercent() & 0x7F)
             | (isChargingOrDone(BatteryController::getBatteryState()) ? 0x80 : 0);
-
-        Bluetooth::Stack::updateCustomAdvertisingData(
-            (uint8_t *)&customManufacturerData, sizeof(customManufacturerData));
+        customManufacturerData.mcuTemperatureTimes100 = Temperature::getMCUTemperatureTimes100();
+        customManufacturerData.batteryTemperatureTimes100 = Temperature::getNTCTemperatureTimes100();
+        customManufacturerData.dataSetHash = DataSet::dataHash();
 
         // Register to be notified of accelerometer changes
         Accelerometer::hookRollState(onRollStateChange, nullptr);
@@ -64,15 +165,119 @@ namespace Bluetooth::CustomAdvertisingDataHandler
         // And battery events too
         BatteryController::hookBatteryState(onBatteryStateChange, nullptr);
         BatteryController::hookLevel(onBatteryLevelChange, nullptr);
+        Temperature::hookTemperatureChange(onTemperatureChange, nullptr);
+    }
+
+    void start() {
+        if (started) {
+            // Advertising was restarted (i.e. the interval changed), the data is already there
+            return;
+        }
+        started = true;
+
+        // Initialize the custom advertising data
+        customManufacturerData.ledCount = Config::BoardManager::getBoard()->ledCount;
+        customManufacturerData.designAndColor = (SettingsManager::getDieType() << 4) | SettingsManager::getColorway();
+        if (modulesReady) {
+            trackModules();
+        }
+
+        // Always published so the stack has the data, even if it didn't change since the last time
+        Timers::stopTimer(updateTimer);
+        updateThrottled = false;
+        publish();
+
+        // Keep slowing down from where we were
+        if (advIntervalMs < idleIntervalMs) {
+            Timers::startTimer(backoffTimer, ADV_BACKOFF_STEP_MS);
+        }
+    }
+
+    void setModulesReady() {
+        modulesReady = true;
+        if (started) {
+            trackModules();
+            requestUpdate();
+        }
     }
 
     void stop() {
+        started = false;
+
         // Unhook from accelerometer events, we don't need them
         Accelerometer::unHookRollState(onRollStateChange);
 
         // Unhook battery events too
         BatteryController::unHookBatteryState(onBatteryStateChange);
         BatteryController::unHookLevel(onBatteryLevelChange);
+        Temperature::unHookTemperatureChange(onTemperatureChange);
+
+        // Nothing to publish until we start again
+        Timers::stopTimer(updateTimer);
+        updateThrottled = false;
+        Timers::stopTimer(burstTimer);
+        burstActive = false;
+        Timers::stopTimer(backoffTimer);
+    }
+
+    void applyAdvertisingInterval() {
+        Stack::setAdvertisingInterval(burstActive ? BROADCAST_FAST_INTERVAL_MS : advIntervalMs);
+    }
+
+    void onBackoffTimer(void* context) {
+        advIntervalMs = MIN(advIntervalMs * 2, idleIntervalMs);
+        applyAdvertisingInterval();
+        if (advIntervalMs < idleIntervalMs) {
+            Timers::startTimer(backoffTimer, ADV_BACKOFF_STEP_MS);
+        }
+    }
+
+    void setIdleInterval(uint16_t intervalMs) {
+        idleIntervalMs = MAX(intervalMs, ADV_INTERVAL_ACTIVE_MS);
+        if (advIntervalMs > idleIntervalMs) {
+            advIntervalMs = idleIntervalMs;
+            if (started) {
+                applyAdvertisingInterval();
+            }
+        } else if (started && advIntervalMs < idleIntervalMs) {
+            // May have been idling at the previous interval, back off to the new one
+            // (this does nothing if already backing off)
+            Timers::startTimer(backoffTimer, ADV_BACKOFF_STEP_MS);
+        }
+    }
+
+    uint16_t getIdleInterval() {
+        return idleIntervalMs;
+    }
+
+    void setBroadcastMode(bool enable) {
+        if (enable != broadcastMode) {
+            NRF_LOG_INFO("Broadcast mode %s", enable ? "on" : "off");
+            broadcastMode = enable;
+            if (started) {
+                // The payload size changed
+                publishNow();
+            }
+        }
+    }
+
+    bool isBroadcastModeEnabled() {
+        return broadcastMode;
+    }
+
+    void setBroadcastModeHandler(const Message* msg) {
+        auto broadcastMsg = (const MessageSetBroadcastMode*)msg;
+        setBroadcastMode(broadcastMsg->enable != 0);
+
+        // Restarts advertising with the new payload if needed
+        Stack::setExtendedAdvertising(broadcastMsg->enable != 0 && broadcastMsg->extended != 0);
+        MessageService::SendMessage(Message::MessageType_SetBroadcastModeAck);
+    }
+
+    void onBurstTimer(void* context) {
+        // Back to the activity driven advertising rate
+        burstActive = false;
+        applyAdvertisingInterval();
     }
 
     void onBatteryStateChange(void *param, BatteryController::BatteryState state) {
@@ -83,20 +288,52 @@ namespace Bluetooth::CustomAdvertisingDataHandler
         updateCustomAdvertisingDataBattery(levelPercent & 0x7F, 0x80);
     }
 
+    void onTemperatureChange(void* param, int32_t mcuTempTimes100, int32_t ntcTempTimes100) {
+        // Only advertised with extended advertising, don't bother re-encoding the data otherwise
+        if (Stack::isExtendedAdvertising()) {
+            customManufacturerData.mcuTemperatureTimes100 = mcuTempTimes100;
+            customManufacturerData.batteryTemperatureTimes100 = ntcTempTimes100;
+            requestUpdate();
+        }
+    }
+
     void onRollStateChange(void* param, Accelerometer::RollState prevState, int prevFace, Accelerometer::RollState newState, int newFace) {
-        updateCustomAdvertisingDataState(newState, newFace);
+        if (newState == Accelerometer::RollState_Handling || newState == Accelerometer::RollState_Rolling) {
+            // Someone is playing with the die, start over from the fastest rate
+            advIntervalMs = ADV_INTERVAL_ACTIVE_MS;
+            applyAdvertisingInterval();
+            Timers::stopTimer(backoffTimer);
+            Timers::startTimer(backoffTimer, ADV_BACKOFF_STEP_MS);
+        }
+
+        const bool rollResult = newState == Accelerometer::RollState_Rolled || newState == Accelerometer::RollState_Crooked;
+        if (broadcastMode && rollResult) {
+            // Publish the result at once and advertise it fast for a bit so scanners pick it up quickly
+            customManufacturerData.currentFace = newFace;
+            customManufacturerData.rollState = newState;
+            customManufacturerData.rollCounter++;
+            memmove(customManufacturerData.lastFaces + 1, customManufacturerData.lastFaces, ADV_LAST_FACES_COUNT - 1);
+            customManufacturerData.lastFaces[0] = newFace;
+            publishNow();
+            burstActive = true;
+            applyAdvertisingInterval();
+            Timers::stopTimer(burstTimer);
+            Timers::startTimer(burstTimer, BROADCAST_BURST_MS);
+        } else {
+            updateCustomAdvertisingDataState(newState, newFace);
+        }
     }
 
     void updateCustomAdvertisingDataBattery(uint8_t batteryValue, uint8_t mask) {
         customManufacturerData.batteryLevelAndCharging &= mask;
         customManufacturerData.batteryLevelAndCharging |= batteryValue;
-        Bluetooth::Stack::updateCustomAdvertisingData((uint8_t*)&customManufacturerData, sizeof(customManufacturerData));
+        requestUpdate();
     }
 
     void updateCustomAdvertisingDataState(Accelerometer::RollState newState, int newFace) {
         // Update manufacturer specific advertising data
         customManufacturerData.currentFace = newFace;
         customManufacturerData.rollState = newState;
-        Bluetooth::Stack::updateCustomAdvertisingData((uint8_t*)&customManufacturerData, sizeof(customManufacturerData));
+        requestUpdate();
     }
 }
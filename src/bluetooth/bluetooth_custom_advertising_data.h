@@ -10,5 +10,21 @@ namespace Bluetooth
         void init();
         void start();
         void stop();
+
+        // Advertising starts before the accelerometer, battery and data set are initialized,
+        // their state is only advertised once this is called
+        void setModulesReady();
+
+        // Encodes the custom data again right away, e.g. once the advertising type changed
+        void publishNow();
+
+        // In broadcast mode, roll results are advertised along with a roll counter, in a short
+        // burst of fast advertising, so scanners can follow many dice without connecting to them
+        void setBroadcastMode(bool enable);
+        bool isBroadcastModeEnabled();
+
+        // Advertising speeds up when the die is handled and backs off to this interval
+        void setIdleInterval(uint16_t intervalMs);
+        uint16_t getIdleInterval();
     }
 }
\ No newline at end of file
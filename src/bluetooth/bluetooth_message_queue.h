@@ -9,18 +9,93 @@ namespace Bluetooth
 
     /// <summary>
     /// Simple FIFO queue template, with a fixed max size so it doesn't allocate
-    /// This version stores the size of items added, and shifts the entire buffer
-    /// down on a dequeue for simplicity.
+    /// This version stores the size of items added, in a ring buffer. Messages are
+    /// always stored contiguously, if one doesn't fit at the end of the buffer
+    /// it is placed at the beginning instead (and the rest of the end is skipped).
+    /// Items may be enqueued from interrupts, but should only be dequeued from the main loop.
     /// </summary>
     template <int Size>
     class MessageQueue
     {
         // The data structure inside the buffer is as follows:
-        // [size|message][size|message][..]
-        // size is a uint16_t
-        uint8_t buffer[Size];
+        // [header|message][header|message][..]
+        // Each entry is aligned on 4 bytes, the header stores the size of the entry (header included)
+        // and the size of the message. An entry size of WrapMarker means the next entry is at the
+        // beginning of the buffer.
+        struct Header
+        {
+            uint16_t entrySize;
+            uint16_t msgSize;   // PendingFlag is set until a reserved entry is committed
+        };
+
+        static const uint16_t WrapMarker = 0xFFFF;
+        static const uint16_t PendingFlag = 0x8000;
+        static const int Alignment = 4;
+
+        uint8_t buffer[Size] __attribute__((aligned(4)));
         int _count;
-        int _end;
+        int _head;      // Offset of the oldest entry
+        int _tail;      // Offset where the next entry goes
+        int _reserved;  // Offset of the reserved entry, -1 if none
+
+        static int entrySize(uint16_t msgSize)
+        {
+            return (sizeof(Header) + msgSize + Alignment - 1) & ~(Alignment - 1);
+        }
+
+        Header& headerAt(int offset)
+        {
+            return *(Header*)(void*)(buffer + offset);
+        }
+
+        /// <summary>
+        /// Returns the offset of the oldest entry, skipping the wrap marker if any
+        /// </summary>
+        int headEntry()
+        {
+            if (Size - _head < (int)sizeof(Header) || headerAt(_head).entrySize == WrapMarker) {
+                return 0;
+            }
+            return _head;
+        }
+
+        /// <summary>
+        /// Finds room for an entry and writes its header, must be called in a critical region
+        /// Returns the offset of the entry, or -1 if there isn't enough room
+        /// </summary>
+        int allocate(uint16_t size, uint16_t flags)
+        {
+            const int needed = entrySize(size);
+            if (_count == 0) {
+                // Empty, start over from the beginning so there's as much contiguous room as possible
+                _head = 0;
+                _tail = 0;
+            }
+
+            int offset = -1;
+            const bool wrapped = _tail < _head || (_tail == _head && _count > 0);
+            if (!wrapped) {
+                if (Size - _tail >= needed) {
+                    offset = _tail;
+                } else if (_head >= needed) {
+                    // Doesn't fit at the end, go back to the beginning
+                    if (Size - _tail >= (int)sizeof(Header)) {
+                        headerAt(_tail).entrySize = WrapMarker;
+                    }
+                    offset = 0;
+                }
+            } else if (_head - _tail >= needed) {
+                offset = _tail;
+            }
+
+            if (offset >= 0) {
+                headerAt(offset).entrySize = needed;
+                headerAt(offset).msgSize = size | flags;
+                _tail = offset + needed;
+                _count++;
+            }
+            return offset;
+        }
 
     public:
         /// <summary>
@@ -28,7 +103,9 @@ namespace Bluetooth
         /// </summary>
         MessageQueue()
             : _count(0)
-            , _end(0)
+            , _head(0)
+            , _tail(0)
+            , _reserved(-1)
         {
         }
 
@@ -41,16 +118,83 @@ namespace Bluetooth
             bool ret = false;
             CRITICAL_REGION_ENTER();
             // Is there enough room?
-            ret = _end + size + sizeof(uint16_t) < Size;
+            int offset = allocate(size, 0);
+            ret = offset >= 0;
             if (ret) {
-                // Yes, go ahead and allocate
-                auto sizeptr = (uint16_t*)(void*)(buffer + _end);
-                *sizeptr = size;
+                // Yes, go ahead and copy
+                memcpy(buffer + offset + sizeof(Header), msg, size);
+            }
+            CRITICAL_REGION_EXIT();
+            return ret;
+        }
 
-                auto queueMsg = (Message*)(void*)(buffer + _end + sizeof(uint16_t));
-                memcpy(queueMsg, msg, size);
-                _end += size + sizeof(uint16_t);
-                _count++;
+        /// <summary>
+        /// Reserves room for a message of up to the given size, for the caller to fill in place.
+        /// The entry holds back the entries queued after it until commit() is called.
+        /// Only one entry can be reserved at a time, returns nullptr if there isn't enough room.
+        /// </summary>
+        Message* reserve(uint16_t maxSize)
+        {
+            Message* ret = nullptr;
+            CRITICAL_REGION_ENTER();
+            if (_reserved < 0) {
+                int offset = allocate(maxSize, PendingFlag);
+                if (offset >= 0) {
+                    _reserved = offset;
+                    ret = (Message*)(void*)(buffer + offset + sizeof(Header));
+                }
+            }
+            CRITICAL_REGION_EXIT();
+            return ret;
+        }
+
+        /// <summary>
+        /// Makes the reserved message available to dequeue, with its actual size (no more than reserved)
+        /// Returns false if there was no reserved message (i.e. the queue was cleared since)
+        /// </summary>
+        bool commit(uint16_t size)
+        {
+            bool ret = false;
+            CRITICAL_REGION_ENTER();
+            ret = _reserved >= 0;
+            if (ret) {
+                auto& header = headerAt(_reserved);
+                if (size > (header.msgSize & ~PendingFlag)) {
+                    size = header.msgSize & ~PendingFlag;
+                }
+                header.msgSize = size;
+                _reserved = -1;
+            }
+            CRITICAL_REGION_EXIT();
+            return ret;
+        }
+
+        /// <summary>
+        /// Overwrites the most recent queued message of the same type and size with the passed in one
+        /// Returns false if there is no such message. The oldest message is never replaced since it
+        /// may be being sent.
+        /// </summary>
+        bool tryReplace(const Message* msg, uint16_t size)
+        {
+            bool ret = false;
+            const uint8_t type = *(const uint8_t*)msg;
+            CRITICAL_REGION_ENTER();
+            int offset = headEntry();
+            int found = -1;
+            for (int i = 0; i < _count; ++i) {
+                const Header& header = headerAt(offset);
+                const uint8_t* entryMsg = buffer + offset + sizeof(Header);
+                if (i > 0 && header.msgSize == size && entryMsg[0] == type) {
+                    found = offset;
+                }
+                offset += header.entrySize;
+                if (Size - offset < (int)sizeof(Header) || headerAt(offset).entrySize == WrapMarker) {
+                    offset = 0;
+                }
+            }
+            ret = found >= 0;
+            if (ret) {
+                memcpy(buffer + found + sizeof(Header), msg, size);
             }
             CRITICAL_REGION_EXIT();
             return ret;
@@ -62,31 +206,34 @@ namespace Bluetooth
         /// Tries to dequeue the oldest element and call functor on it,
         /// Returns true if the element could be peeked AND functor could process it
         /// if functor could not process element, then it isn't popped
+        /// The functor is called with interrupts enabled, new items never overwrite the oldest one.
         /// </summary>
         bool tryDequeue(TryDequeueFunctor functor)
         {
-            bool ret = false;
+            int count;
+            int head;
             CRITICAL_REGION_ENTER();
-            ret = _count > 0;
+            count = _count;
+            head = headEntry();
+            CRITICAL_REGION_EXIT();
+
+            bool ret = count > 0;
             if (ret)
             {
-                auto sizeptr = (uint16_t*)(void*)(buffer);
-                uint16_t msgSize = *sizeptr;
-                uint16_t bufferSize = msgSize + sizeof(uint16_t);
-                auto msg = (const Message*)(void*)(buffer + sizeof(uint16_t));
-                ret = functor(msg, msgSize);
+                const Header header = headerAt(head);
+                ret = (header.msgSize & PendingFlag) == 0;
+                if (ret) {
+                    auto msg = (const Message*)(void*)(buffer + head + sizeof(Header));
+                    ret = functor(msg, header.msgSize);
+                }
                 if (ret)
                 {
-                    // Shift everything down
-                    auto nextItemPtr = (uint8_t*)(void*)(buffer + bufferSize);
-                    memcpy(buffer, nextItemPtr, _end - bufferSize);
-
-                    // Update counts
-                    _end -= bufferSize;
+                    CRITICAL_REGION_ENTER();
+                    _head = head + header.entrySize;
                     _count--;
+                    CRITICAL_REGION_EXIT();
                 }
             }
-            CRITICAL_REGION_EXIT();
             return ret;
         }
 
@@ -96,8 +243,10 @@ namespace Bluetooth
         void clear()
         {
             CRITICAL_REGION_ENTER();
-            _end = 0;
+            _head = 0;
+            _tail = 0;
             _count = 0;
+            _reserved = -1;
             CRITICAL_REGION_EXIT();
         }
 
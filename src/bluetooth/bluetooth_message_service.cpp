@@ -14,10 +14,19 @@
 #include "drivers_nrf/scheduler.h"
 #include "drivers_nrf/power_manager.h"
 #include "drivers_nrf/timers.h"
+#include "drivers_nrf/profiler.h"
 
 #include "core/queue.h"
 
-#define MESSAGE_QUEUE_SIZE 160
+#define SEND_QUEUE_SIZE 384
+#define BULK_QUEUE_SIZE 256
+#define RECEIVE_QUEUE_SIZE 256
+
+// Largest message that fits the priority slot, see SendPriorityMessage()
+#define PRIORITY_MESSAGE_MAX_SIZE 8
+
+// Total observers, for all message types
+#define MAX_MESSAGE_OBSERVERS 8
 
 using namespace DriversNRF;
 using namespace Core;
@@ -28,21 +37,71 @@ namespace Bluetooth::MessageService
 
     NRF_SDH_BLE_OBSERVER(GenericServiceObserver, 3, BLEObserver, nullptr);
 
-    MessageQueue<MESSAGE_QUEUE_SIZE> SendQueue;
-    MessageQueue<MESSAGE_QUEUE_SIZE> ReceiveQueue;
+    // Control and realtime messages, always sent before anything in the bulk queue
+    MessageQueue<SEND_QUEUE_SIZE> SendQueue;
+    // Bulk data and debug logs, sent when there is nothing more urgent
+    MessageQueue<BULK_QUEUE_SIZE> BulkQueue;
+    MessageQueue<RECEIVE_QUEUE_SIZE> ReceiveQueue;
 
     uint16_t service_handle;
+    static uint8_t uuid_type;
     ble_gatts_char_handles_t rx_handles;
     ble_gatts_char_handles_t tx_handles;
 
     MessageHandler messageHandlers[Message::MessageType_Count];
 
+    // One bit per message type, see AddMessageObserver()
+    #define MESSAGE_TYPE_FLAGS_SIZE ((Message::MessageType_Count + 31) / 32)
+    static uint32_t observedTypes[MESSAGE_TYPE_FLAGS_SIZE];
+
+    // See AddMessageObserver(), types without any observer are skipped with their bit in observedTypes
+    struct ObserverEntry
+    {
+        MessageObserver observer;   // nullptr when the entry is free
+        void* token;
+        Message::MessageType msgType;
+    };
+    static ObserverEntry observers[MAX_MESSAGE_OBSERVERS];
+    static bool observeAll = false;
+
+    // Lane of the currently reserved message
+    static Lane reservedLane = Lane_Realtime;
+
     Stack::SendResult send(const uint8_t* data, uint16_t size);
     bool SendMessage(Message::MessageType msgType);
     bool SendMessage(const Message* msg, int msgSize);
+    bool isCoalescable(Message::MessageType msgType);
+    Lane getLane(Message::MessageType msgType);
+    bool isInline(Message::MessageType msgType);
+    void dispatch(MessageHandler handler, const Message* msg, uint16_t msgSize);
+    bool enqueue(const Message* msg, int msgSize);
 
     void onMessageReceived(const uint8_t* data, uint16_t len);
     void update();
+    bool sendQueuedMessage();
+    void sendQueuedMessages();
+    void enableBatchingHandler(const Message* msg);
+    void onConnectionEvent(void* param, bool connected);
+
+    // Batching is only used once the central says it can decode batches
+    static bool batchingEnabled = false;
+
+    // See setReady()
+    static bool ready = false;
+    static bool receiveHeld = false;    // The oldest received message is waiting for its handler
+
+    // Batch being sent, messages are moved out of the send queue
+    // into it and it's kept until the stack accepts it
+    static MessageBatch batch;
+    static uint16_t batchSize = 0;      // 0 if there is no pending batch
+    static uint16_t batchMaxSize = 0;
+
+    // Priority message waiting for the stack, sent before the batch and the queues
+    static uint32_t priorityMessage[PRIORITY_MESSAGE_MAX_SIZE / sizeof(uint32_t)];
+    static uint8_t priorityMessageSize = 0;     // 0 if there is no pending priority message
+
+    // Received size of the message being dispatched, see getReceivedMessageSize()
+    static uint16_t dispatchedSize = 0;
 
     void init() {
         // Clear message handle array
@@ -54,7 +113,6 @@ namespace Bluetooth::MessageService
         ble_add_char_params_t add_char_params;
 
         // Add a custom base UUID.
-        uint8_t uuid_type;
         err_code = sd_ble_uuid_vs_add(&nus_base_uuid, &uuid_type);
         APP_ERROR_CHECK(err_code);
 
@@ -99,6 +157,10 @@ namespace Bluetooth::MessageService
         err_code = characteristic_add(service_handle, &add_char_params, &tx_handles);
         APP_ERROR_CHECK(err_code);
 
+        RegisterMessageHandler(Message::MessageType_EnableBatching, enableBatchingHandler);
+
+        Stack::hook(onConnectionEvent, nullptr);
+
         NRF_LOG_DEBUG("Message Service init");
     }
 
@@ -106,41 +168,178 @@ namespace Bluetooth::MessageService
         return Stack::isConnected();
     }
 
+    uint16_t getServiceHandle() {
+        return service_handle;
+    }
+
+    uint8_t getUUIDType() {
+        return uuid_type;
+    }
+
+    bool canSendImmediately() {
+        return Stack::isConnected() && SendQueue.count() + BulkQueue.count() == 0;
+    }
+
     bool needUpdate() {
-        return ReceiveQueue.count() + SendQueue.count() > 0;
+        // While the SoftDevice queue is full, sending waits for the next HVN_TX_COMPLETE rather than polling
+        const bool sendPending = (SendQueue.count() + BulkQueue.count() > 0 || batchSize > 0 || priorityMessageSize > 0) &&
+            (!Stack::isConnected() || Stack::canQueueNotification());
+        return (receiveHeld ? 0 : ReceiveQueue.count()) > 0 || sendPending;
+    }
+
+    void setReady() {
+        ready = true;
+        receiveHeld = false;
+        NRF_LOG_INFO("Message service ready, %d messages were waiting", ReceiveQueue.count());
+    }
+
+    bool isReady() {
+        return ready;
     }
 
     void update() {
+        TIMELINE_BEGIN(Profiler::TimelineEvent_MessageServiceUpdate);
+
         // Process received messages if possible
         while (ReceiveQueue.tryDequeue([] (const Message* msg, uint16_t msgSize) {
             // Cast the data
             auto handler = messageHandlers[(int)msg->type];
-            if (handler != nullptr) {
-                NRF_LOG_DEBUG("Calling message handler %08x", handler);
-                handler(msg);
+            if (handler == nullptr && !ready) {
+                // Keep it (and the ones after it, so they stay in order) until the die is initialized
+                receiveHeld = true;
+                return false;
             }
+            dispatch(handler, msg, msgSize);
             return true;
         })) {
             // No body to the loop, everything happens in the condition
         }
 
-        // Send queued messages if possible
-        if (SendQueue.count() > 0) {
-            if (!Stack::isConnected()) {
-                NRF_LOG_INFO("Disconnected, clearing messages send queue!");
-                SendQueue.clear();
+        sendQueuedMessages();
+        TIMELINE_END(Profiler::TimelineEvent_MessageServiceUpdate);
+    }
+
+    void enableBatchingHandler(const Message* msg) {
+        batchingEnabled = ((const MessageEnableBatching*)msg)->enable != 0;
+        NRF_LOG_INFO("Message batching %s", batchingEnabled ? "enabled" : "disabled");
+    }
+
+    void onConnectionEvent(void* param, bool connected) {
+        batchingEnabled = false;
+        batchSize = 0;
+        priorityMessageSize = 0;
+    }
+
+    /// <summary>
+    /// Moves as many messages from the given queue as still fit in the batch
+    /// </summary>
+    template <int Size>
+    void fillBatch(MessageQueue<Size>& queue) {
+        while (queue.tryDequeue([] (const Message* msg, uint16_t msgSize) {
+            bool fits = batchSize + 1 + msgSize <= batchMaxSize && msgSize <= 0xFF;
+            if (fits) {
+                uint8_t* dst = (uint8_t*)(void*)&batch + batchSize;
+                dst[0] = (uint8_t)msgSize;
+                memcpy(dst + 1, msg, msgSize);
+                batchSize += 1 + msgSize;
+            }
+            return fits;
+        })) {
+            // No body to the loop, everything happens in the condition
+        }
+    }
+
+    /// <summary>
+    /// Sends the pending batch, returns false if the stack is busy
+    /// </summary>
+    bool sendBatch() {
+        bool ret = send((const uint8_t*)&batch, batchSize) != Stack::SendResult_Busy;
+        if (ret) {
+            NRF_LOG_DEBUG("Batch of size %d SENT (Queue=%d)", batchSize, SendQueue.count());
+            batchSize = 0;
+        }
+        return ret;
+    }
+
+    /// <summary>
+    /// Sends the oldest message of the given queue if the stack isn't busy
+    /// </summary>
+    template <int Size>
+    bool sendOldest(MessageQueue<Size>& queue) {
+        return queue.tryDequeue([] (const Message* msg, uint16_t msgSize) {
+            auto ret = send((const uint8_t*)msg, msgSize) != Stack::SendResult_Busy;
+            if (ret) {
+                NRF_LOG_DEBUG("Queued Message of type %d of size %d SENT", msg->type, msgSize);
             } else {
-                NRF_LOG_INFO("Message queue count: %d", SendQueue.count());
-                SendQueue.tryDequeue([] (const Message* msg, uint16_t msgSize) {
-                    auto ret = send((const uint8_t*)msg, msgSize) != Stack::SendResult_Busy;
-                    if (ret) {
-                        NRF_LOG_DEBUG("Queued Message of type %d of size %d SENT (Queue=%d)", msg->type, msgSize, SendQueue.count());
-                    } else {
-                        NRF_LOG_DEBUG("Queued Message of type %d of size %d NOT SENT (Stack Busy) (Queue=%d)", msg->type, msgSize, SendQueue.count());
-                    }
-                    return ret;
-                });
+                NRF_LOG_DEBUG("Queued Message of type %d of size %d NOT SENT (Stack Busy)", msg->type, msgSize);
+            }
+            return ret;
+        });
+    }
+
+    /// <summary>
+    /// Sends the oldest queued message if possible, the realtime lane goes first
+    /// Returns true if a notification was handed to the stack
+    /// </summary>
+    bool sendQueuedMessage() {
+        if (priorityMessageSize > 0) {
+            if (send((const uint8_t*)priorityMessage, priorityMessageSize) == Stack::SendResult_Busy) {
+                return false;
+            }
+            NRF_LOG_DEBUG("Priority Message of type %d SENT", ((const Message*)priorityMessage)->type);
+            priorityMessageSize = 0;
+            return true;
+        }
+        if (batchSize > 0 && !sendBatch()) {
+            // Stack still busy
+            return false;
+        }
+        const int count = SendQueue.count() + BulkQueue.count();
+        if (count == 0) {
+            return false;
+        }
+        if (!Stack::isConnected()) {
+            NRF_LOG_INFO("Disconnected, clearing messages send queues!");
+            SendQueue.clear();
+            BulkQueue.clear();
+            return false;
+        }
+        if (count > 1 && batchingEnabled) {
+            batchSize = sizeof(Message);
+            batchMaxSize = MIN(Stack::getMaxPayloadSize(), sizeof(MessageBatch));
+            fillBatch(SendQueue);
+            if (SendQueue.count() == 0 && Stack::canQueueBulkNotification()) {
+                // Top off with bulk messages
+                fillBatch(BulkQueue);
+            }
+            if (batchSize > sizeof(Message)) {
+                sendBatch();
+                return true;
             }
+            // First message too large to be batched, send it on its own
+            batchSize = 0;
+        }
+        NRF_LOG_INFO("Message queue count: %d (Bulk=%d)", SendQueue.count(), BulkQueue.count());
+        if (SendQueue.count() > 0) {
+            return sendOldest(SendQueue);
+        } else if (Stack::canQueueBulkNotification()) {
+            return sendOldest(BulkQueue);
+        } else {
+            // Leave the last SoftDevice slots to realtime messages, HVN_TX_COMPLETE will get back to it
+            return false;
+        }
+    }
+
+    /// <summary>
+    /// Keeps the SoftDevice notification queue full, rather than sending one message per update
+    /// </summary>
+    void sendQueuedMessages() {
+        while (Stack::canQueueNotification() && sendQueuedMessage()) {
+            // No body to the loop, everything happens in the condition
+        }
+        // Disconnected or empty queues are handled by sendQueuedMessage()
+        if (!Stack::isConnected()) {
+            sendQueuedMessage();
         }
     }
 
@@ -150,7 +349,7 @@ namespace Bluetooth::MessageService
             case BLE_GATTS_EVT_WRITE:
                 {
                     ble_gatts_evt_write_t const * p_evt_write = &p_ble_evt->evt.gatts_evt.params.write;
-                    if (p_evt_write->handle == rx_handles.value_handle)
+                    if (p_evt_write->handle == rx_handles.value_handle && Stack::isMainLink(p_ble_evt->evt.gatts_evt.conn_handle))
                     {
                         NRF_LOG_DEBUG("Generic Service Message Received: %d bytes", p_evt_write->len);
                         NRF_LOG_HEXDUMP_DEBUG(p_evt_write->data, p_evt_write->len);
@@ -161,6 +360,13 @@ namespace Bluetooth::MessageService
                 break;
 
             case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+                // Refill the SoftDevice queue right away. Scheduled so that it runs after the stack
+                // observer has counted the notifications as sent.
+                if (SendQueue.count() + BulkQueue.count() > 0 || batchSize > 0 || priorityMessageSize > 0) {
+                    Scheduler::pushCoalesced(nullptr, 0, [](void* ignoreData, uint16_t ignoreSize) {
+                        sendQueuedMessages();
+                    }, Scheduler::Priority_Realtime);
+                }
                 break;
 
             default:
@@ -175,12 +381,78 @@ namespace Bluetooth::MessageService
         return Stack::send(tx_handles.value_handle, data, size);
     }
 
+    Message* ReserveMessage(uint16_t maxSize, Lane lane) {
+        if (!Stack::isConnected()) {
+            return nullptr;
+        }
+        auto ret = lane == Lane_Bulk ? BulkQueue.reserve(maxSize) : SendQueue.reserve(maxSize);
+        if (ret == nullptr) {
+            NRF_LOG_ERROR("Message of size %d NOT RESERVED (%s)", maxSize, "Queue full");
+        } else {
+            reservedLane = lane;
+        }
+        return ret;
+    }
+
+    bool CommitMessage(uint16_t size) {
+        bool ret = reservedLane == Lane_Bulk ? BulkQueue.commit(size) : SendQueue.commit(size);
+        if (ret) {
+            // Try to send right away, the SoftDevice copies the data out of the queue
+            sendQueuedMessages();
+        }
+        return ret;
+    }
+
+    bool isCoalescable(Message::MessageType msgType) {
+        return (getMessageDescriptor(msgType).flags & MessageFlag_Coalescable) != 0;
+    }
+
+    Lane getLane(Message::MessageType msgType) {
+        return (getMessageDescriptor(msgType).flags & MessageFlag_BulkLane) != 0 ? Lane_Bulk : Lane_Realtime;
+    }
+
+    // Inline messages are handled straight from the BLE write event, on the received data, rather than
+    // being copied to the receive queue for the next update(). SoftDevice events are dispatched from
+    // the scheduler, so their handlers run in the main context as usual. They still wait in the queue
+    // behind messages received before them, or until setReady().
+    bool isInline(Message::MessageType msgType) {
+        return (getMessageDescriptor(msgType).flags & MessageFlag_Inline) != 0;
+    }
+
+    /// <summary>
+    /// Schedules the message to be sent later, in its lane
+    /// </summary>
+    bool enqueue(const Message* msg, int msgSize) {
+        bool ret;
+        if (getLane(msg->type) == Lane_Bulk) {
+            ret = BulkQueue.tryEnqueue(msg, msgSize);
+        } else if (isCoalescable(msg->type) && SendQueue.tryReplace(msg, msgSize)) {
+            NRF_LOG_INFO("Message of type %d of size %d REPLACED queued one (Queue=%d)", msg->type, msgSize, SendQueue.count());
+            return true;
+        } else {
+            ret = SendQueue.tryEnqueue(msg, msgSize);
+        }
+        if (ret) {
+            NRF_LOG_INFO("Message of type %d of size %d QUEUED (Queue=%d, Bulk=%d)", msg->type, msgSize, SendQueue.count(), BulkQueue.count());
+            // update() will be called on the next frame
+        } else {
+            NRF_LOG_ERROR("Message of type %d of size %d NOT QUEUED (%s)", msg->type, msgSize, "Queue full");
+        }
+        return ret;
+    }
+
     bool SendMessage(Message::MessageType msgType) {
         Message msg(msgType);
         return SendMessage(&msg, sizeof(Message));
     }
 
     bool SendMessage(const Message* msg, int msgSize) {
+        if (getLane(msg->type) == Lane_Bulk && Stack::isConnected() &&
+            (SendQueue.count() > 0 || priorityMessageSize > 0 || !Stack::canQueueBulkNotification())) {
+            // Don't let bulk messages get ahead of pending realtime ones, or take the reserved slots
+            return enqueue(msg, msgSize);
+        }
+
         bool ret = false;
         auto res = send((const uint8_t*)msg, msgSize);
         switch (res) {
@@ -190,16 +462,8 @@ namespace Bluetooth::MessageService
                 ret = true;
                 break;
             case Stack::SendResult_Busy:
-                {
-                    // Couldn't send right away, try to schedule it for later
-                    ret = SendQueue.tryEnqueue(msg, msgSize);
-                    if (ret) {
-                        NRF_LOG_INFO("Message of type %d of size %d QUEUED (Queue=%d)", msg->type, msgSize, SendQueue.count());
-                        // update() will be called on the next frame
-                    } else {
-                        NRF_LOG_ERROR("Message of type %d of size %d NOT QUEUED (%s)", msg->type, msgSize, "Queue full");
-                    }
-                }
+                // Couldn't send right away, try to schedule it for later
+                ret = enqueue(msg, msgSize);
                 break;
             case Stack::SendResult_Error:
                 // Any other error, don't know what to do, forget the message
@@ -220,6 +484,37 @@ namespace Bluetooth::MessageService
         return ret;
     }
 
+    bool SendPriorityMessage(const Message* msg, int msgSize) {
+        if (msgSize > PRIORITY_MESSAGE_MAX_SIZE) {
+            NRF_LOG_WARNING("Message of type %d too large for the priority slot", msg->type);
+            return SendMessage(msg, msgSize);
+        }
+        if (!Stack::isConnected()) {
+            NRF_LOG_ERROR("Message of type %d of size %d NOT QUEUED (%s)", msg->type, msgSize, "Not Connected");
+            return false;
+        }
+        if (priorityMessageSize == 0) {
+            auto res = send((const uint8_t*)msg, msgSize);
+            if (res == Stack::SendResult_Ok) {
+                NRF_LOG_DEBUG("Priority Message of type %d SENT IMMEDIATELY", msg->type);
+                return true;
+            } else if (res != Stack::SendResult_Busy) {
+                NRF_LOG_ERROR("Priority Message of type %d NOT SENT (Error %d)", msg->type, res);
+                return false;
+            }
+        } else {
+            NRF_LOG_INFO("Priority Message of type %d REPLACED pending one", msg->type);
+        }
+        // Wait for the next free notification slot, without going through the queues
+        memcpy(priorityMessage, msg, msgSize);
+        priorityMessageSize = (uint8_t)msgSize;
+        return true;
+    }
+
+    bool hasPendingPriorityMessage() {
+        return priorityMessageSize > 0;
+    }
+
     void RegisterMessageHandler(Message::MessageType msgType, MessageHandler handler) {
         if (messageHandlers[msgType] != nullptr)
         {
@@ -229,6 +524,9 @@ namespace Bluetooth::MessageService
         {
             messageHandlers[msgType] = handler;
             NRF_LOG_DEBUG("Setting message handler for %d to %08x", msgType, handler);
+
+            // A held message may be for this handler
+            receiveHeld = false;
         }
     }
 
@@ -236,17 +534,107 @@ namespace Bluetooth::MessageService
         messageHandlers[msgType] = nullptr;
     }
 
+    /// <summary>
+    /// Calls the handler of a received message, then its observers
+    /// </summary>
+    void dispatch(MessageHandler handler, const Message* msg, uint16_t msgSize) {
+        dispatchedSize = msgSize;
+        if (handler != nullptr) {
+            NRF_LOG_DEBUG("Calling message handler %08x", handler);
+            handler(msg);
+        }
+        if (observeAll || (observedTypes[msg->type / 32] & (1u << (msg->type % 32))) != 0) {
+            for (int i = 0; i < MAX_MESSAGE_OBSERVERS; ++i) {
+                // Observers may remove themselves, their entries are only cleared
+                const auto& entry = observers[i];
+                if (entry.observer != nullptr && (entry.msgType == msg->type || entry.msgType == Message::MessageType_Count)) {
+                    entry.observer(entry.token, msg);
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Rebuilds the bits of the observed types from the observer entries
+    /// </summary>
+    static void updateObservedTypes() {
+        memset(observedTypes, 0, sizeof(observedTypes));
+        observeAll = false;
+        for (const auto& entry : observers) {
+            if (entry.observer == nullptr) {
+                continue;
+            }
+            if (entry.msgType == Message::MessageType_Count) {
+                observeAll = true;
+            } else {
+                observedTypes[entry.msgType / 32] |= 1u << (entry.msgType % 32);
+            }
+        }
+    }
+
+    bool AddMessageObserver(Message::MessageType msgType, MessageObserver observer, void* token) {
+        for (auto& entry : observers) {
+            if (entry.observer == nullptr) {
+                entry = { observer, token, msgType };
+                updateObservedTypes();
+                return true;
+            }
+        }
+        NRF_LOG_ERROR("Too many message observers, can't observe message %d", msgType);
+        return false;
+    }
+
+    void RemoveMessageObservers(void* token) {
+        for (auto& entry : observers) {
+            if (entry.token == token) {
+                entry.observer = nullptr;
+            }
+        }
+        updateObservedTypes();
+    }
+
+    uint16_t getReceivedMessageSize() {
+        return dispatchedSize;
+    }
+
     void onMessageReceived(const uint8_t* data, uint16_t len) {
+        if (len > sizeof(Message) && data[0] == Message::MessageType_Batch) {
+            // Unpack the batched messages
+            uint16_t offset = sizeof(Message);
+            while (offset < len) {
+                uint8_t msgSize = data[offset];
+                if (msgSize == 0 || offset + 1 + msgSize > len) {
+                    NRF_LOG_ERROR("Bad batched message length %d", msgSize);
+                    break;
+                }
+                onMessageReceived(data + offset + 1, msgSize);
+                offset += 1 + msgSize;
+            }
+            return;
+        }
         if (len >= sizeof(Message)) {
             auto msg = reinterpret_cast<const Message*>(data);
-            if (msg->type >= Message::MessageType_WhoAreYou && msg->type < Message::MessageType_Count) {
-                if (!ReceiveQueue.tryEnqueue(msg, len)) {
+            if (msg->type < Message::MessageType_WhoAreYou || msg->type >= Message::MessageType_Count) {
+                NRF_LOG_ERROR("Bad message type %d", msg->type);
+            } else if (len < getMessageDescriptor(msg->type).minSize) {
+                // Handlers read their message as is, a truncated one would have them read past the data
+                NRF_LOG_ERROR("Message of type %d too short, %d bytes for %d", msg->type, len, getMessageDescriptor(msg->type).minSize);
+            } else {
+                auto handler = messageHandlers[(int)msg->type];
+                if (handler != nullptr && ready && ReceiveQueue.count() == 0 && isInline(msg->type)) {
+                    // Nothing to wait for, skip the copy
+                    dispatch(handler, msg, len);
+                } else if (!ReceiveQueue.tryEnqueue(msg, len)) {
                     NRF_LOG_ERROR("Message of type %d NOT HANDLED (Scheduler full)", msg->type);
+                    if (!ready) {
+                        // Let the central know it should ask again later
+                        MessageNotReady notReadyMsg;
+                        notReadyMsg.requestType = msg->type;
+                        SendMessage(&notReadyMsg);
+                    }
                 } else {
                     // update() will be called on the next frame
                 }
-            } else {
-                NRF_LOG_ERROR("Bad message type %d", msg->type);
             }
         } else {
             NRF_LOG_ERROR("Bad message length %d", len);
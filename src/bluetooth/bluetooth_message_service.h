@@ -1,5 +1,7 @@
 #pragma once
 #include "bluetooth_messages.h"
+#include <new>
+#include <string.h>
 
 #ifndef BLE_LOG_ENABLED
 #define BLE_LOG_ENABLED 0
@@ -16,9 +18,21 @@ namespace Bluetooth::MessageService
     void init();
     bool isConnected();
 
+    // For other characteristics to be added to the generic data service
+    uint16_t getServiceHandle();
+    uint8_t getUUIDType();
+
+    // Advertising starts before all the modules are initialized, until then received messages that
+    // have no handler yet are kept in the receive queue, and processed once setReady() is called
+    void setReady();
+    bool isReady();
+
     bool needUpdate();
     void update();
 
+    // Whether messages are sent right away rather than queued, for a lossy stream to back off
+    bool canSendImmediately();
+
     bool SendMessage(Message::MessageType msgType);
     bool SendMessage(const Message* msg, int msgSize);
 
@@ -27,12 +41,63 @@ namespace Bluetooth::MessageService
         return SendMessage(msg, sizeof(Msg));
     }
 
+    // Latest value messages that must go out in the next connection event (i.e. roll state).
+    // They skip the send queues, when the stack is busy the message waits in a single slot that
+    // is sent before anything else, and a newer priority message replaces it.
+    bool SendPriorityMessage(const Message* msg, int msgSize);
+    bool hasPendingPriorityMessage();
+
+    template <typename Msg>
+    bool SendPriorityMessage(const Msg* msg) {
+        return SendPriorityMessage(msg, sizeof(Msg));
+    }
+
+    // Queued messages are sent from the realtime lane first, the bulk lane only
+    // gets the link when there is nothing else to send.
+    // Which types are coalesced, use the bulk lane or are handled inline is set
+    // in the message descriptors (see bluetooth_messages.h)
+    enum Lane
+    {
+        Lane_Realtime = 0,
+        Lane_Bulk,
+    };
+
+    // Zero-copy sending: the message is built directly in the send queue, then committed
+    // with its actual size. Returns nullptr if not connected or the queue is full.
+    Message* ReserveMessage(uint16_t maxSize, Lane lane = Lane_Realtime);
+    bool CommitMessage(uint16_t size);
+
+    template <typename Msg>
+    Msg* ReserveMessage(Lane lane = Lane_Realtime) {
+        auto ret = ReserveMessage(sizeof(Msg), lane);
+        return ret != nullptr ? new (ret) Msg() : nullptr;
+    }
+
     // Our bluetooth message handlers
     typedef void (*MessageHandler)(const Message* message);
 
+    // Number of bytes received for the message being handled, only valid in its handler (and observers).
+    // It's at least the minimum size from the message descriptor, variable size messages must check
+    // their data against it, and trailing fields added to a message may not have been sent.
+    uint16_t getReceivedMessageSize();
+
+    // Copies the message being handled, the trailing fields that weren't received are zeroed
+    template <typename Msg>
+    void copyReceivedMessage(const Message* msg, Msg& outMsg) {
+        const uint16_t size = getReceivedMessageSize();
+        memset(&outMsg, 0, sizeof(Msg));
+        memcpy(&outMsg, msg, size < sizeof(Msg) ? size : sizeof(Msg));
+    }
+
     void RegisterMessageHandler(Message::MessageType msgType, MessageHandler handler);
     void UnregisterMessageHandler(Message::MessageType msgType);
 
+    // Observers get the received messages of a type after its handler (if any), several can watch
+    // the same type. Use MessageType_Count to observe every message. Returns false if the observers are full.
+    typedef void (*MessageObserver)(void* token, const Message* message);
+    bool AddMessageObserver(Message::MessageType msgType, MessageObserver observer, void* token);
+    void RemoveMessageObservers(void* token);
+
     typedef void (*NotifyUserCallback)(bool result);
     void NotifyUser(const char* text, bool ok, bool cancel, uint8_t timeout_s, NotifyUserCallback callback);
 
@@ -79,6 +79,138 @@ namespace Bluetooth
             return "TransferTestAck";
         case MessageType_TransferTestFinished:
             return "TransferTestFinished";
+        case MessageType_SetFrameRate:
+            return "SetFrameRate";
+        case MessageType_RequestFrameRate:
+            return "RequestFrameRate";
+        case MessageType_FrameRate:
+            return "FrameRate";
+        case MessageType_RequestProfile:
+            return "RequestProfile";
+        case MessageType_Profile:
+            return "Profile";
+        case MessageType_RequestAccelStream:
+            return "RequestAccelStream";
+        case MessageType_AccelStream:
+            return "AccelStream";
+        case MessageType_RequestRollLog:
+            return "RequestRollLog";
+        case MessageType_RollLog:
+            return "RollLog";
+        case MessageType_RequestRollStats:
+            return "RequestRollStats";
+        case MessageType_RollStats:
+            return "RollStats";
+        case MessageType_SetAdaptiveThresholds:
+            return "SetAdaptiveThresholds";
+        case MessageType_RollThresholds:
+            return "RollThresholds";
+        case MessageType_LikelyFace:
+            return "LikelyFace";
+        case MessageType_EnableBatching:
+            return "EnableBatching";
+        case MessageType_Batch:
+            return "Batch";
+        case MessageType_BulkSetupWindowAck:
+            return "BulkSetupWindowAck";
+        case MessageType_BulkSetupCompressed:
+            return "BulkSetupCompressed";
+        case MessageType_RequestDataSetHashes:
+            return "RequestDataSetHashes";
+        case MessageType_DataSetHashes:
+            return "DataSetHashes";
+        case MessageType_TransferDataSetPatch:
+            return "TransferDataSetPatch";
+        case MessageType_TransferDataSetPatchAck:
+            return "TransferDataSetPatchAck";
+        case MessageType_TransferDataSetPatchFinished:
+            return "TransferDataSetPatchFinished";
+        case MessageType_RequestSchedulerStats:
+            return "RequestSchedulerStats";
+        case MessageType_SchedulerStats:
+            return "SchedulerStats";
+        case MessageType_RequestWakeStats:
+            return "RequestWakeStats";
+        case MessageType_WakeStats:
+            return "WakeStats";
+        case MessageType_RequestLinkInfo:
+            return "RequestLinkInfo";
+        case MessageType_LinkInfo:
+            return "LinkInfo";
+        case MessageType_TransferTestData:
+            return "TransferTestData";
+        case MessageType_SetBroadcastMode:
+            return "SetBroadcastMode";
+        case MessageType_SetBroadcastModeAck:
+            return "SetBroadcastModeAck";
+        case MessageType_TelemetryDelta:
+            return "TelemetryDelta";
+        case MessageType_TelemetryBatch:
+            return "TelemetryBatch";
+        case MessageType_RequestTraceLog:
+            return "RequestTraceLog";
+        case MessageType_TraceLog:
+            return "TraceLog";
+        case MessageType_RequestTimeline:
+            return "RequestTimeline";
+        case MessageType_Timeline:
+            return "Timeline";
+        case MessageType_RequestMemoryStats:
+            return "RequestMemoryStats";
+        case MessageType_MemoryStats:
+            return "MemoryStats";
+        case MessageType_NotReady:
+            return "NotReady";
+        case MessageType_CalibrateFaceSample:
+            return "CalibrateFaceSample";
+        case MessageType_CalibrateFaceSampled:
+            return "CalibrateFaceSampled";
+        case MessageType_CommitFaceCalibration:
+            return "CommitFaceCalibration";
+        case MessageType_SyncTime:
+            return "SyncTime";
+        case MessageType_SyncTimeAck:
+            return "SyncTimeAck";
+        case MessageType_PlayAnimAt:
+            return "PlayAnimAt";
+        case MessageType_ArmAnimTrigger:
+            return "ArmAnimTrigger";
+        case MessageType_ArmAnimTriggerAck:
+            return "ArmAnimTriggerAck";
+        case MessageType_DisarmAnimTriggers:
+            return "DisarmAnimTriggers";
+        case MessageType_AnimTriggerFired:
+            return "AnimTriggerFired";
+        case MessageType_SetRssiFilter:
+            return "SetRssiFilter";
+        case MessageType_EnableAnimEvents:
+            return "EnableAnimEvents";
+        case MessageType_AnimEvent:
+            return "AnimEvent";
+        case MessageType_LEDStream:
+            return "LEDStream";
+        case MessageType_LEDStreamFrame:
+            return "LEDStreamFrame";
+        case MessageType_SetLEDColors:
+            return "SetLEDColors";
+        case MessageType_RequestAnimEnergyStats:
+            return "RequestAnimEnergyStats";
+        case MessageType_AnimEnergyStats:
+            return "AnimEnergyStats";
+        case MessageType_RunSelfTest:
+            return "RunSelfTest";
+        case MessageType_SelfTestResult:
+            return "SelfTestResult";
+        case MessageType_AnimControllerState:
+            return "AnimControllerState";
+        case MessageType_BlinkSlot:
+            return "BlinkSlot";
+        case MessageType_BlinkSlotAck:
+            return "BlinkSlotAck";
+        case MessageType_SetPerformanceProfile:
+            return "SetPerformanceProfile";
+        case MessageType_PerformanceProfile:
+            return "PerformanceProfile";
         default:
             return "<missing>";
     }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 #include "config/sdk_config.h"
 #include "config/dice_variants.h"
 #include "modules/accelerometer.h"
@@ -10,6 +11,12 @@
 #include "core/int3.h"
 #include "modules/accelerometer.h"
 #include "modules/user_mode_controller.h"
+#include "modules/anim_controller.h"
+#include "drivers_nrf/profiler.h"
+#include "drivers_nrf/scheduler.h"
+#include "modules/roll_stats.h"
+#include "modules/anim_energy.h"
+#include "utils/heap.h"
 #include "pixel.h"
 #include "die.h"
 
@@ -19,6 +26,12 @@
 // Maximum size for messages (sort of)
 #define MAX_DATA_SIZE 100
 
+// Bulk data chunks fill a notification at the largest MTU (minus type, size and offset)
+#define MAX_BULK_DATA_SIZE (NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3 - 4)
+
+// Number of sections reported in DataSetHashes, must match DataSet::DataSetSection_Count
+#define DATA_SET_SECTION_COUNT 13
+
 #pragma pack(push, 1)
 
 namespace Bluetooth
@@ -32,6 +45,7 @@ using RollState = Modules::Accelerometer::RollState;
 using BatteryControllerMode = Modules::BatteryController::ControllerOverrideMode;
 using RunMode = Pixel::RunMode;
 using UserMode = Modules::UserModeController::UserMode;
+using FrameRateMode = Modules::AnimController::FrameRateMode;
 
 /// <summary>
 ///  Base class for messages from the die to the app
@@ -114,6 +128,73 @@ struct Message
         MessageType_ClearSettingsAck,
         MessageType_SetUserMode,
         MessageType_SetUserModeAck,
+        MessageType_SetFrameRate,
+        MessageType_RequestFrameRate,
+        MessageType_FrameRate,
+        MessageType_RequestProfile,
+        MessageType_Profile,
+        MessageType_RequestAccelStream,
+        MessageType_AccelStream,
+        MessageType_RequestRollLog,
+        MessageType_RollLog,
+        MessageType_RequestRollStats,
+        MessageType_RollStats,
+        MessageType_SetAdaptiveThresholds,
+        MessageType_RollThresholds,
+        MessageType_LikelyFace,
+        MessageType_EnableBatching,
+        MessageType_Batch,
+        MessageType_BulkSetupWindowAck,
+        MessageType_BulkSetupCompressed,
+        MessageType_RequestDataSetHashes,
+        MessageType_DataSetHashes,
+        MessageType_TransferDataSetPatch,
+        MessageType_TransferDataSetPatchAck,
+        MessageType_TransferDataSetPatchFinished,
+        MessageType_RequestSchedulerStats,
+        MessageType_SchedulerStats,
+        MessageType_RequestWakeStats,
+        MessageType_WakeStats,
+        MessageType_RequestLinkInfo,
+        MessageType_LinkInfo,
+        MessageType_TransferTestData,
+        MessageType_SetBroadcastMode,
+        MessageType_SetBroadcastModeAck,
+        MessageType_TelemetryDelta,
+        MessageType_TelemetryBatch,
+        MessageType_RequestTraceLog,
+        MessageType_TraceLog,
+        MessageType_RequestTimeline,
+        MessageType_Timeline,
+        MessageType_RequestMemoryStats,
+        MessageType_MemoryStats,
+        MessageType_NotReady,
+        MessageType_CalibrateFaceSample,
+        MessageType_CalibrateFaceSampled,
+        MessageType_CommitFaceCalibration,
+        MessageType_SyncTime,
+        MessageType_SyncTimeAck,
+        MessageType_PlayAnimAt,
+        MessageType_ArmAnimTrigger,
+        MessageType_ArmAnimTriggerAck,
+        MessageType_DisarmAnimTriggers,
+        MessageType_AnimTriggerFired,
+        MessageType_SetRssiFilter,
+        MessageType_EnableAnimEvents,
+        MessageType_AnimEvent,
+        MessageType_LEDStream,
+        MessageType_LEDStreamFrame,
+        MessageType_SetLEDColors,
+        MessageType_RequestAnimEnergyStats,
+        MessageType_AnimEnergyStats,
+        MessageType_RunSelfTest,
+        MessageType_SelfTestResult,
+        MessageType_AnimControllerState,
+        MessageType_BlinkSlot,
+        MessageType_BlinkSlotAck,
+        MessageType_SetPerformanceProfile,
+        MessageType_PerformanceProfile,
+        MessageType_RollLogCleared,
 
         // TESTING
         MessageType_TestBulkSend,
@@ -125,6 +206,7 @@ struct Message
         MessageType_LightUpFace,
         MessageType_SetLEDToColor,
         MessageType_PrintAnimControllerState,
+        MessageType_SetLinkConditions,
 
         MessageType_Count,
     };
@@ -206,6 +288,34 @@ struct StatusInfo : Chunk<StatusInfo>
     uint8_t rollFace; // This is the current face index
 };
 
+// Optional features the central may use
+enum Capabilities : uint8_t
+{
+    Capabilities_None = 0,
+    Capabilities_WindowedBulkData = 1 << 0, // See MessageBulkSetupWindowAck
+    Capabilities_CompressedBulkData = 1 << 1, // See MessageBulkSetupCompressed
+    Capabilities_MessageBatching = 1 << 2, // See MessageEnableBatching
+    Capabilities_LinkInfo = 1 << 3, // See MessageRequestLinkInfo
+    Capabilities_TransferTest = 1 << 4, // See MessageTransferTest
+    Capabilities_BroadcastMode = 1 << 5, // See MessageSetBroadcastMode
+    Capabilities_SharedTrackData = 1 << 6, // Tracks and animations may point to the same keyframes and tracks
+};
+
+struct CapabilitiesInfo : Chunk<CapabilitiesInfo>
+{
+    uint8_t capabilities;           // Combination of Capabilities flags
+    uint8_t bulkDataReceiveWindow;  // Number of chunks the central may send ahead of the last ack
+    uint16_t instantAnimationsMaxSize; // Memory reserved for instant animations
+};
+
+// Same readings as MessageTemperature and MessageBatteryLevel, so the central doesn't have to ask
+struct SensorInfo : Chunk<SensorInfo>
+{
+    int16_t mcuTempTimes100;
+    int16_t batteryTempTimes100;
+    uint16_t batteryVoltageMilli;
+};
+
 /// <summary>
 /// Identifies the dice
 /// </summary>
@@ -235,11 +345,16 @@ struct MessageIAmADie
     DieName dieName;
     SettingsInfo settingsInfo;
     StatusInfo statusInfo;
+    CapabilitiesInfo capabilitiesInfo;
+    SensorInfo sensorInfo;
 #endif
 
     MessageIAmADie() : Message(Message::MessageType_IAmADie){}
 };
 
+// The handshake has to go out in a single notification
+static_assert(sizeof(MessageIAmADie) <= NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3, "IAmADie doesn't fit in the MTU");
+
 /// <summary>
 /// Describes a state change detection message
 /// </summary>
@@ -294,10 +409,56 @@ struct MessageTelemetry
     MessageTelemetry() : Message(Message::MessageType_Telemetry) {}
 };
 
+/// <summary>
+/// Sent instead of Telemetry in RepeatDelta mode, with only the field groups that changed since the last one.
+/// The first message after the request has all the subscribed groups.
+/// </summary>
+struct MessageTelemetryDelta
+    : Message
+{
+    uint16_t fields; // TelemetryField flags of the groups in data, each packed as in MessageTelemetry
+    uint8_t data[sizeof(MessageTelemetry) - sizeof(Message)];
+
+    MessageTelemetryDelta() : Message(Message::MessageType_TelemetryDelta) {}
+};
+
+struct TelemetryBatchSample
+{
+    uint16_t timeOffset;    // Milliseconds since the batch time
+    Core::int3 acc;
+    uint8_t face;
+    RollState rollState;
+    uint8_t faceConfidenceTimes100;
+};
+
+#define TELEMETRY_BATCH_MAX_SAMPLES 10
+
+/// <summary>
+/// Sent in Batch telemetry mode, accelerometer samples plus the slower changing values as of the last sample
+/// </summary>
+struct MessageTelemetryBatch
+    : Message
+{
+    uint32_t time;          // Time of the first sample, in ms
+    uint8_t sampleCount;
+    uint8_t droppedCount;   // Samples overwritten before they could be sent
+    uint8_t batteryLevelPercent;
+    uint8_t voltageTimes50;
+    int8_t rssi;
+    int16_t mcuTempTimes100;
+    int16_t batteryTempTimes100;
+    TelemetryBatchSample samples[TELEMETRY_BATCH_MAX_SAMPLES];
+
+    MessageTelemetryBatch() : Message(Message::MessageType_TelemetryBatch) {}
+};
+
+static_assert(sizeof(MessageTelemetryBatch) <= NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3, "TelemetryBatch doesn't fit in the MTU");
+
 struct MessageBulkSetup
     : Message
 {
     uint16_t size;
+    uint8_t chunkSize; // Used by the die when acknowledged with BulkSetupWindowAck, otherwise chunks have MAX_DATA_SIZE
 
     MessageBulkSetup() : Message(Message::MessageType_BulkSetup) {}
 };
@@ -307,7 +468,7 @@ struct MessageBulkData
 {
     uint8_t size;
     uint16_t offset;
-    uint8_t data[MAX_DATA_SIZE];
+    uint8_t data[MAX_BULK_DATA_SIZE]; // Only size bytes are sent, except with legacy centrals
 
     MessageBulkData() : Message(Message::MessageType_BulkData) {}
 };
@@ -402,6 +563,21 @@ enum TelemetryRequestMode : uint8_t
     TelemetryRequestMode_Off = 0,
     TelemetryRequestMode_Once = 1,
     TelemetryRequestMode_Repeat = 2,
+    TelemetryRequestMode_RepeatDelta = 3, // Only the subscribed fields, as TelemetryDelta messages when they change
+    TelemetryRequestMode_Batch = 4,       // Several samples per TelemetryBatch message
+};
+
+// Groups of MessageTelemetry fields, in the order they are packed in a TelemetryDelta message
+enum TelemetryField : uint16_t
+{
+    TelemetryField_Accelerometer = 1 << 0,  // acc, faceConfidenceTimes1000, time
+    TelemetryField_Roll = 1 << 1,           // rollState, face
+    TelemetryField_Battery = 1 << 2,        // batteryLevelPercent, batteryState, batteryControllerState, internalChargeState, batteryControllerMode
+    TelemetryField_Voltages = 1 << 3,       // voltageTimes50, vCoilTimes50, vCoilMinTimes50, vCoilMaxTimes50
+    TelemetryField_Rssi = 1 << 4,           // rssi, channelIndex
+    TelemetryField_Temperatures = 1 << 5,   // mcuTempTimes100, batteryTempTimes100
+    TelemetryField_LedCurrent = 1 << 6,     // ledCurrent
+    TelemetryField_All = 0x7F,
 };
 
 struct MessageRequestTelemetry
@@ -409,6 +585,8 @@ struct MessageRequestTelemetry
 {
     TelemetryRequestMode requestMode;
     uint16_t minInterval; // Milliseconds, 0 for no cap on rate
+    uint16_t fieldsMask;  // Combination of TelemetryField flags, only read in RepeatDelta mode (0 for all)
+    uint16_t flushInterval; // Milliseconds, only read in Batch mode, 0 to send batches only once full
 
     MessageRequestTelemetry() : Message(Message::MessageType_RequestTelemetry) {}
 };
@@ -468,6 +646,15 @@ struct MessageRssi
     MessageRssi() : Message(Message::MessageType_Rssi) {}
 };
 
+struct MessageSetBroadcastMode
+    : Message
+{
+    uint8_t enable;
+    uint8_t extended;   // Use BLE 5 extended advertising, with more data (last faces, temperatures, data set hash)
+
+    MessageSetBroadcastMode() : Message(Message::MessageType_SetBroadcastMode) {}
+};
+
 struct MessageSetDesignAndColor
     : Message
 {
@@ -565,6 +752,322 @@ struct MessageSetUserMode
     MessageSetUserMode() : Message(MessageType_SetUserMode) {}
 };
 
+struct MessageSetFrameRate
+    : Message
+{
+    FrameRateMode mode;
+    uint8_t fps; // Frame rate, or max frame rate in adaptive mode
+
+    MessageSetFrameRate() : Message(MessageType_SetFrameRate) {}
+};
+
+struct MessageFrameRate
+    : Message
+{
+    FrameRateMode mode;
+    uint8_t fps;
+    uint8_t frameDurationMs; // Current time between animation updates
+
+    MessageFrameRate() : Message(MessageType_FrameRate) {}
+};
+
+struct MessageRequestProfile
+    : Message
+{
+    uint8_t reset; // Clear the accumulators after sending them
+
+    MessageRequestProfile() : Message(MessageType_RequestProfile) {}
+};
+
+struct MessageProfile
+    : Message
+{
+    struct Stage
+    {
+        uint32_t count;
+        uint32_t minCycles;
+        uint32_t avgCycles;
+        uint32_t maxCycles;
+    };
+
+    uint8_t stageCount;
+    Stage stages[DriversNRF::Profiler::Stage_Count]; // Indexed by DriversNRF::Profiler::Stage
+
+    MessageProfile() : Message(MessageType_Profile) {}
+};
+
+struct MessageRequestSchedulerStats
+    : Message
+{
+    uint8_t reset; // Clear the stats after sending them
+
+    MessageRequestSchedulerStats() : Message(MessageType_RequestSchedulerStats) {}
+};
+
+struct MessageSchedulerStats
+    : Message
+{
+    struct Queue
+    {
+        uint32_t eventCount;
+        uint16_t avgWaitMs;
+        uint16_t maxWaitMs;
+        uint8_t maxDepth;
+        uint32_t overflowCount;
+    };
+
+    struct Handler
+    {
+        uint32_t address;   // Look it up in the map file
+        uint32_t count;
+        uint32_t maxCycles;
+        uint16_t runtimeHistogram[SCHED_RUNTIME_BUCKETS];
+    };
+
+    uint8_t queueCount;
+    Queue queues[DriversNRF::Scheduler::Priority_Count]; // Indexed by DriversNRF::Scheduler::Priority
+    uint8_t handlerCount;
+    Handler handlers[SCHED_PROFILED_HANDLERS];
+
+    MessageSchedulerStats() : Message(MessageType_SchedulerStats) {}
+};
+
+struct MessageRequestWakeStats
+    : Message
+{
+    uint8_t reset; // Clear the counters after sending them
+
+    MessageRequestWakeStats() : Message(MessageType_RequestWakeStats) {}
+};
+
+struct MessageWakeStats
+    : Message
+{
+    uint32_t time;          // Current time in ms
+    uint32_t wakeCount;     // CPU wake ups since the last reset
+    uint8_t reasonCount;
+    uint32_t reasonCounts[DriversNRF::Scheduler::WakeReason_Count]; // Main loop passes, indexed by DriversNRF::Scheduler::WakeReason
+
+    MessageWakeStats() : Message(MessageType_WakeStats) {}
+};
+
+struct MessageLinkInfo
+    : Message
+{
+    uint16_t attMtu;                // Negotiated ATT MTU
+    uint16_t dataLengthTx;          // Link layer payload, in bytes
+    uint16_t dataLengthRx;
+    uint8_t txPhy;                  // BLE_GAP_PHY_1MBPS or BLE_GAP_PHY_2MBPS
+    uint8_t rxPhy;
+    uint16_t connectionInterval;    // In units of 1.25 ms
+    uint16_t slaveLatency;
+    uint16_t supervisionTimeout;    // In units of 10 ms
+
+    MessageLinkInfo() : Message(MessageType_LinkInfo) {}
+};
+
+struct MessageRequestAccelStream
+    : Message
+{
+    uint16_t sampleRateHz;  // 0 to stop streaming
+    uint8_t deltaBits;      // Bits per axis for the deltas, 8 to 12
+
+    MessageRequestAccelStream() : Message(MessageType_RequestAccelStream) {}
+};
+
+/// <summary>
+/// Batch of raw accelerometer samples, the first one is sent as is and the following ones
+/// as deltas from the previous sample, packed on deltaBits bits per axis (x, y then z, LSB first)
+/// </summary>
+struct MessageAccelStream
+    : Message
+{
+    uint32_t time;          // Time of the first sample, in ms
+    uint16_t sampleRateHz;
+    uint8_t deltaBits;
+    uint8_t sampleCount;    // Including the first sample
+    uint8_t droppedCount;   // Samples dropped before this batch while the send queue was busy
+    Core::int3 first;
+    uint8_t deltas[MAX_DATA_SIZE];
+
+    MessageAccelStream() : Message(MessageType_AccelStream) {}
+};
+
+struct MessageRequestRollLog
+    : Message
+{
+    uint8_t clear; // Erase the records instead of sending them
+
+    MessageRequestRollLog() : Message(MessageType_RequestRollLog) {}
+};
+
+/// <summary>
+/// Sent before the roll log pages, which follow as bulk data (see Config::RollLog for the format)
+/// </summary>
+struct MessageRollLog
+    : Message
+{
+    uint16_t recordCount;
+    uint16_t pageSize;
+    uint8_t pageCount;
+
+    MessageRollLog() : Message(MessageType_RollLog) {}
+};
+
+/// <summary>
+/// Reply to a roll log request with the clear flag set
+/// </summary>
+struct MessageRollLogCleared
+    : Message
+{
+    uint8_t result; // 0 if the log was busy writing and wasn't cleared, the stats are then left alone too
+
+    MessageRollLogCleared() : Message(MessageType_RollLogCleared) {}
+};
+
+struct MessageRollStats
+    : Message
+{
+    uint16_t rollCount;     // Rolls that landed on a face
+    uint16_t crookedCount;
+    uint8_t faceCount;
+    uint32_t chiSquareTimes1000;
+    uint16_t durationBins[ROLL_STATS_DURATION_BINS]; // ROLL_STATS_DURATION_BIN_MS wide
+    uint16_t faceCounts[MAX_LED_COUNT];
+
+    MessageRollStats() : Message(MessageType_RollStats) {}
+};
+
+enum AdaptiveThresholdsMode : uint8_t
+{
+    AdaptiveThresholdsMode_Off = 0,     // Back to the programmed thresholds
+    AdaptiveThresholdsMode_On,          // Learn thresholds from the noise floor
+    AdaptiveThresholdsMode_Persist,     // Program the current thresholds in the settings
+    AdaptiveThresholdsMode_Report,      // Only send the current thresholds
+};
+
+struct MessageSetAdaptiveThresholds
+    : Message
+{
+    AdaptiveThresholdsMode mode;
+
+    MessageSetAdaptiveThresholds() : Message(MessageType_SetAdaptiveThresholds) {}
+};
+
+struct MessageRollThresholds
+    : Message
+{
+    uint8_t adaptive;
+    int16_t noiseFloorTimes1000;
+    int16_t lowerThresholdTimes1000;
+    int16_t middleThresholdTimes1000;
+    int16_t upperThresholdTimes1000;
+
+    MessageRollThresholds() : Message(MessageType_RollThresholds) {}
+};
+
+/// <summary>
+/// Sent while rolling with the face the die is most likely to land on, a RollState message confirms the result
+/// </summary>
+struct MessageLikelyFace
+    : Message
+{
+    uint8_t face;
+    int16_t confidenceTimes1000;
+
+    MessageLikelyFace() : Message(MessageType_LikelyFace) {}
+};
+
+/// <summary>
+/// Sent by a central that can decode batches, the die may then pack several messages into one notification
+/// </summary>
+struct MessageEnableBatching
+    : Message
+{
+    uint8_t enable;
+
+    MessageEnableBatching() : Message(MessageType_EnableBatching) {}
+};
+
+/// <summary>
+/// Several messages in one notification (or write), each one preceded by its size on one byte
+/// </summary>
+struct MessageBatch
+    : Message
+{
+    uint8_t data[NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3 - sizeof(Message)];
+
+    MessageBatch() : Message(MessageType_Batch) {}
+};
+
+/// <summary>
+/// Sent by the central instead of BulkSetupAck when it can receive several
+/// chunks before acknowledging them, each ack then covers all the data up to its offset
+/// </summary>
+struct MessageBulkSetupWindowAck
+    : Message
+{
+    uint8_t windowSize; // Number of chunks the die may send ahead of the last ack
+
+    MessageBulkSetupWindowAck() : Message(MessageType_BulkSetupWindowAck) {}
+};
+
+/// <summary>
+/// Sent by the central instead of BulkSetup to send lz77 compressed data (see Utils::lz77_compress),
+/// the chunks that follow are the compressed stream and the die acks them as usual
+/// </summary>
+struct MessageBulkSetupCompressed
+    : Message
+{
+    uint16_t size;          // Size of the compressed stream
+    uint16_t decodedSize;   // Size of the data once decompressed
+
+    MessageBulkSetupCompressed() : Message(MessageType_BulkSetupCompressed) {}
+};
+
+/// <summary>
+/// Hash of each section of the data set, in flash order (see DataSet::DataSetSection)
+/// so the central can tell which parts of its data set changed
+/// </summary>
+struct MessageDataSetHashes
+    : Message
+{
+    uint32_t dataSetHash;
+    uint32_t dataSetSize;
+    uint32_t sectionHashes[DATA_SET_SECTION_COUNT];
+
+    MessageDataSetHashes() : Message(MessageType_DataSetHashes) {}
+};
+
+/// <summary>
+/// Replaces a range of the data set data with the bytes sent in the bulk transfer that follows
+/// The layout of the data set can't change, so the counts and sizes of all sections must stay the same
+/// </summary>
+struct MessageTransferDataSetPatch
+    : Message
+{
+    uint32_t offset;    // From the start of the data set data (i.e. the palette)
+    uint16_t size;
+
+    MessageTransferDataSetPatch() : Message(MessageType_TransferDataSetPatch) {}
+};
+
+struct MessageTransferDataSetPatchAck
+    : Message
+{
+    uint8_t result;     // 0 if the patch can't be applied, the central should send the whole set instead
+
+    MessageTransferDataSetPatchAck() : Message(MessageType_TransferDataSetPatchAck) {}
+};
+
+struct MessageTransferDataSetPatchFinished
+    : Message
+{
+    uint8_t result;
+
+    MessageTransferDataSetPatchFinished() : Message(MessageType_TransferDataSetPatchFinished) {}
+};
+
 struct MessageCalibrateFace
     : Message
 {
@@ -604,6 +1107,212 @@ struct MessageSetLEDToColor
     MessageSetLEDToColor() : Message(Message::MessageType_SetLEDToColor) {}
 };
 
+/// <summary>
+/// Sets several LEDs at once, the colors (RGB) follow the order of the bits set in the mask, lowest first.
+/// The LEDs not in the mask are left as they are.
+/// </summary>
+struct MessageSetLEDColors
+    : Message
+{
+    uint32_t ledMask; // Same LED indices as SetLEDToColor
+    uint8_t colors[MAX_LED_COUNT * 3];
+    MessageSetLEDColors() : Message(Message::MessageType_SetLEDColors) {}
+};
+
+struct MessageRequestAnimEnergyStats
+    : Message
+{
+    uint8_t reset; // Clear the totals after sending them
+
+    MessageRequestAnimEnergyStats() : Message(MessageType_RequestAnimEnergyStats) {}
+};
+
+// Estimated LED charge since the last reset, from the same current model as the power budget
+// (a fixed cost while any LED is lit, plus a cost per LED on and per intensity level)
+struct MessageAnimEnergyStats
+    : Message
+{
+    struct Anim
+    {
+        uint8_t source;             // DataSet::AnimationBitsCache::Source, 0xFF for built-in animations
+        uint16_t animationIndex;    // Index in the source, 0xFFFF if it couldn't be found
+        uint32_t nanoAmpHours;
+    };
+
+    uint32_t time;                  // Milliseconds since the last reset
+    uint32_t totalNanoAmpHours;
+    uint8_t tagCount;
+    uint32_t tagNanoAmpHours[Animations::AnimationTag_Count]; // Indexed by Animations::AnimationTag
+    uint8_t animCount;
+    Anim anims[ANIM_ENERGY_TRACKED_ANIMS];
+
+    MessageAnimEnergyStats() : Message(MessageType_AnimEnergyStats) {}
+};
+
+enum SelfTestFlags : uint8_t
+{
+    SelfTestFlags_None = 0,
+    SelfTestFlags_SleepWhenDone = 1 << 0,  // Turn off right after sending the result, instead of waiting for the validation timeout
+};
+
+// All the validation checks in one message, only handled in validation mode
+struct MessageRunSelfTest
+    : Message
+{
+    uint8_t flags; // SelfTestFlags
+
+    MessageRunSelfTest() : Message(MessageType_RunSelfTest) {}
+};
+
+enum SelfTestFailures : uint32_t
+{
+    SelfTestFailures_None = 0,
+    SelfTestFailures_Battery = 1 << 0,
+    SelfTestFailures_VDD = 1 << 1,
+    SelfTestFailures_Accelerometer = 1 << 2,
+    SelfTestFailures_LEDReturn = 1 << 3,
+    SelfTestFailures_DataSet = 1 << 4,
+    SelfTestFailures_NTC = 1 << 5,
+};
+
+struct MessageSelfTestResult
+    : Message
+{
+    uint32_t failures;              // SelfTestFailures, 0 if everything passed
+    int32_t vBatTimes1000;
+    int32_t vddTimes1000;
+    int32_t vBoardTimes1000;        // Board identification resistor
+    int32_t vNTCTimes1000;
+    int16_t ntcTemperatureTimes100;
+    int16_t mcuTemperatureTimes100;
+    int16_t accXTimes1000;          // In g
+    int16_t accYTimes1000;
+    int16_t accZTimes1000;
+    uint8_t face;
+    uint8_t ledReturn;              // Result of the LED return test at boot
+    uint32_t dataSetHash;
+
+    MessageSelfTestResult() : Message(MessageType_SelfTestResult) {}
+};
+
+// Answer to PrintAnimControllerState, running instances in blending order, split over as many
+// messages as needed. The cycle counts and overdraw are only measured in debug builds (0 otherwise).
+#define ANIM_CONTROLLER_STATE_INSTANCES 6
+struct MessageAnimControllerState
+    : Message
+{
+    struct Instance
+    {
+        uint8_t type;           // Animations::AnimationType
+        uint8_t tag;            // Animations::AnimationTag
+        uint16_t memorySize;    // Preset size plus instance size, in bytes
+        uint32_t lastCycles;    // Render time of the last frame
+        uint32_t avgCycles;
+        uint32_t maxCycles;
+        uint8_t overdraw;       // LEDs it lit that came out saturated after blending, last frame
+    };
+
+    uint8_t animationCount;
+    uint8_t firstIndex;         // Index of the first instance of this message in the blending order
+    uint8_t poolUsed;
+    uint8_t poolHighWaterMark;
+    uint16_t poolAllocFailures;
+    uint16_t droppedAnimations;
+    uint8_t instanceCount;
+    Instance instances[ANIM_CONTROLLER_STATE_INSTANCES];
+
+    MessageAnimControllerState() : Message(MessageType_AnimControllerState) {}
+};
+
+/// <summary>
+/// Selects a performance profile (see Modules::PerformanceProfiles), the die answers with
+/// a PerformanceProfile message, as it does when the active profile changes by itself
+/// </summary>
+struct MessageSetPerformanceProfile
+    : Message
+{
+    uint8_t profile;
+
+    MessageSetPerformanceProfile() : Message(Message::MessageType_SetPerformanceProfile) {}
+};
+
+struct MessagePerformanceProfile
+    : Message
+{
+    uint8_t selectedProfile;
+    uint8_t activeProfile;  // Differs from the selected one while the battery is low
+
+    MessagePerformanceProfile() : Message(Message::MessageType_PerformanceProfile) {}
+};
+
+enum TransferTestMode : uint8_t
+{
+    TransferTestMode_BulkSend = 0,  // The die sends with the bulk protocol, windowed if the central acks the setup with a window
+    TransferTestMode_Notify,        // The die streams TransferTestData notifications, no acks
+    TransferTestMode_Receive,       // The central writes TransferTestData messages, the die counts them
+};
+
+struct MessageTransferTest
+    : Message
+{
+    uint8_t mode;           // TransferTestMode
+    uint32_t size;          // Bytes to transfer (up to 64KB with the bulk protocol)
+
+    MessageTransferTest() : Message(Message::MessageType_TransferTest) {}
+};
+
+struct MessageTransferTestAck
+    : Message
+{
+    uint8_t mode;
+    uint32_t size;          // Bytes that will actually be transferred
+
+    MessageTransferTestAck() : Message(Message::MessageType_TransferTestAck) {}
+};
+
+struct MessageTransferTestFinished
+    : Message
+{
+    uint8_t mode;
+    uint8_t result;         // 1 if all the data went through
+    uint32_t size;
+    uint32_t elapsedTicks;  // RTC ticks, from the setup (or first data message) to the end
+    uint32_t durationMs;
+    uint32_t bytesPerSecond;
+    uint16_t retries;       // Bulk protocol timeouts
+    uint16_t queueFullCount;// Times the die had data to send but the send queue was full
+    uint16_t sequenceErrors;// Missing TransferTestData messages
+    uint8_t windowSize;     // Chunks in flight with the bulk protocol, 1 for legacy centrals
+    uint8_t chunkSize;      // Payload bytes per message
+    uint16_t droppedNotifications; // By the conditions of SetLinkConditions
+
+    MessageTransferTestFinished() : Message(Message::MessageType_TransferTestFinished) {}
+};
+
+/// <summary>
+/// Degrades the link for the transfer tests (and everything else) until disconnected,
+/// 0 leaves a parameter unchanged. See Stack::LinkConditions.
+/// </summary>
+struct MessageSetLinkConditions
+    : Message
+{
+    uint16_t maxPayloadSize;
+    uint8_t maxInFlight;
+    uint8_t lossPercent;
+
+    MessageSetLinkConditions() : Message(Message::MessageType_SetLinkConditions) {}
+};
+
+struct MessageTransferTestData
+    : Message
+{
+    uint16_t sequence;
+    uint8_t size;
+    uint8_t data[NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3 - sizeof(Message) - 3];
+
+    MessageTransferTestData() : Message(Message::MessageType_TransferTestData) {}
+};
+
 struct MessageTransferInstantAnimSet
     : Message
 {
@@ -680,6 +1389,437 @@ struct MessageBlinkId
     MessageBlinkId() : Message(Message::MessageType_BlinkId) {}
 };
 
+/// <summary>
+/// Same as BlinkId but blinks a short code made of the given slot index, starting at the
+/// given time of the shared clock (see SyncTime). Giving each die of a group its own slot
+/// and the same start time has them all blink at once, to be told apart by a camera.
+/// </summary>
+struct MessageBlinkSlot
+    : Message
+{
+    uint32_t globalStartTime;
+    uint16_t slot;
+    uint8_t slotBitsCount;  // Bits of the slot index to blink, 1 to 16
+    uint8_t brightness;
+
+    MessageBlinkSlot() : Message(Message::MessageType_BlinkSlot) {}
+};
+
+struct MessageBlinkSlotAck
+    : Message
+{
+    uint16_t durationMs;    // Of the whole pattern, preamble included
+    uint8_t timeSynced;     // 0 if the die was never synced and starts blinking right away
+
+    MessageBlinkSlotAck() : Message(Message::MessageType_BlinkSlotAck) {}
+};
+
+
+/// <summary>
+/// Turns sending the trace log over Bluetooth on or off, until disconnected
+/// </summary>
+struct MessageRequestTraceLog
+    : Message
+{
+    uint8_t enable;
+
+    MessageRequestTraceLog() : Message(Message::MessageType_RequestTraceLog) {}
+};
+
+/// <summary>
+/// Trace log entries (see DriversNRF::Trace), each is the format string address with the argument
+/// count in the top 4 bits, the time in ms and then the arguments
+/// </summary>
+struct MessageTraceLog
+    : Message
+{
+    uint8_t droppedCount;   // Entries lost because the buffer was full
+    uint8_t wordCount;
+    uint32_t words[30];
+
+    MessageTraceLog() : Message(Message::MessageType_TraceLog) {}
+};
+
+struct MessageRequestTimeline
+    : Message
+{
+    uint8_t reset; // Clear the timeline once sent
+
+    MessageRequestTimeline() : Message(Message::MessageType_RequestTimeline) {}
+};
+
+/// <summary>
+/// Sent before the timeline buffer, which follows as bulk data. Each record is a 32 bits word with
+/// the time in us on bits 0-23, the Profiler::TimelineEvent on bits 24-29 and the phase on bits 30-31.
+/// </summary>
+struct MessageTimeline
+    : Message
+{
+    uint16_t recordCount;
+    uint16_t firstIndex;    // Index of the oldest record, the buffer is a ring
+    uint16_t bufferSize;    // In records
+    uint8_t cyclesPerUs;
+
+    MessageTimeline() : Message(Message::MessageType_Timeline) {}
+};
+
+/// <summary>
+/// Stack and heap usage, in bytes. The stack peak is the deepest use since the handlers were initialized.
+/// Heap sizes include the block headers, except the largest free block which is what can be allocated.
+/// </summary>
+struct MessageMemoryStats
+    : Message
+{
+    struct HeapTagStats
+    {
+        uint16_t used;
+        uint16_t peak;
+        uint8_t allocCount;
+    };
+
+    uint16_t stackSize;
+    uint16_t stackPeak;
+    uint16_t heapSize;
+    uint16_t heapUsed;          // Currently allocated
+    uint16_t heapPeak;          // Most ever allocated at once
+    uint16_t heapFree;
+    uint16_t heapLargestFree;
+    uint8_t heapFreeBlocks;
+    uint16_t heapAllocFailures;
+    HeapTagStats heapTags[Utils::Heap::HeapTag_Count]; // Indexed by Utils::Heap::HeapTag
+
+    MessageMemoryStats() : Message(Message::MessageType_MemoryStats) {}
+};
+
+/// <summary>
+/// Sent while the die is still booting, when a request had to be dropped because the modules
+/// handling it aren't initialized yet and there was no more room to keep it until they are
+/// </summary>
+struct MessageNotReady
+    : Message
+{
+    uint8_t requestType;
+
+    MessageNotReady() : Message(Message::MessageType_NotReady) {}
+};
+
+/// <summary>
+/// Measures the normal of a face as part of a calibration session, the measured normals are
+/// kept in RAM until CommitFaceCalibration (or CalibrateFace) programs them all at once
+/// </summary>
+struct MessageCalibrateFaceSample
+    : Message
+{
+    uint8_t face;
+
+    MessageCalibrateFaceSample() : Message(Message::MessageType_CalibrateFaceSample) {}
+};
+
+struct MessageCalibrateFaceSampled
+    : Message
+{
+    uint8_t face;
+    uint8_t result;             // 0 if the die didn't sit still long enough
+    uint32_t sampledFacesMask;  // Faces measured so far in the session
+
+    MessageCalibrateFaceSampled() : Message(Message::MessageType_CalibrateFaceSampled) {}
+};
+
+/// <summary>
+/// Gives the die the current time of a clock shared by several dice (usually the app's), in ms.
+/// Send a few in a row, the die keeps the one that took the least time to arrive.
+/// </summary>
+struct MessageSyncTime
+    : Message
+{
+    uint32_t globalTime;
+    uint8_t restart;    // Forget the previous syncs, e.g. the first message of a burst
+
+    MessageSyncTime() : Message(Message::MessageType_SyncTime) {}
+};
+
+struct MessageSyncTimeAck
+    : Message
+{
+    uint32_t globalTime;    // Copied from the sync message, to measure the round trip
+    uint32_t dieGlobalTime; // The die's estimate of the shared clock when it got the message
+
+    MessageSyncTimeAck() : Message(Message::MessageType_SyncTimeAck) {}
+};
+
+/// <summary>
+/// Same as PlayAnim but starts the animation at the given time of the shared clock
+/// (see SyncTime), plays right away if the die hasn't been synced
+/// </summary>
+struct MessagePlayAnimAt
+    : Message
+{
+    uint8_t animation;
+    uint8_t remapFace;
+    uint8_t loopCount;
+    uint32_t globalStartTime;
+
+    MessagePlayAnimAt() : Message(Message::MessageType_PlayAnimAt) {}
+};
+
+enum AnimTriggerSource : uint8_t
+{
+    AnimTriggerSource_Profile = 0,  // Animation index in the data set
+    AnimTriggerSource_Instant,      // Animation index in the instant animations
+};
+
+/// <summary>
+/// Registers an animation for the die to play on its own the next time it enters the given
+/// roll state on one of the faces, without waiting for the app to react to the roll
+/// </summary>
+struct MessageArmAnimTrigger
+    : Message
+{
+    uint8_t triggerId;          // Chosen by the app, arming the same id again replaces the trigger
+    RollState rollState;
+    uint32_t faceMask;
+    AnimTriggerSource source;
+    uint8_t animation;
+    uint8_t remapFace;          // FACE_INDEX_CURRENT_FACE for the face the die landed on
+    uint8_t loopCount;
+
+    MessageArmAnimTrigger() : Message(Message::MessageType_ArmAnimTrigger) {}
+};
+
+struct MessageArmAnimTriggerAck
+    : Message
+{
+    uint8_t triggerId;
+    uint8_t result;     // 0 if all the triggers are taken
+
+    MessageArmAnimTriggerAck() : Message(Message::MessageType_ArmAnimTriggerAck) {}
+};
+
+struct MessageDisarmAnimTriggers
+    : Message
+{
+    uint8_t triggerId;  // 0xFF for all of them
+
+    MessageDisarmAnimTriggers() : Message(Message::MessageType_DisarmAnimTriggers) {}
+};
+
+struct MessageAnimTriggerFired
+    : Message
+{
+    uint8_t triggerId;
+    uint8_t face;
+
+    MessageAnimTriggerFired() : Message(Message::MessageType_AnimTriggerFired) {}
+};
+
+struct MessageSetRssiFilter
+    : Message
+{
+    uint8_t thresholdDbm;  // Smallest change of the averaged RSSI that is reported
+    uint16_t minInterval;  // Milliseconds between reports
+
+    MessageSetRssiFilter() : Message(Message::MessageType_SetRssiFilter) {}
+};
+
+// Once enabled, the die sends an AnimEvent message for everything that happens
+// to the animations played with a PlayAnim message
+struct MessageEnableAnimEvents
+    : Message
+{
+    uint8_t enable;
+
+    MessageEnableAnimEvents() : Message(Message::MessageType_EnableAnimEvents) {}
+};
+
+struct MessageAnimEvent
+    : Message
+{
+    uint8_t animation;
+    uint8_t remapFace;
+    uint8_t event;      // See AnimController::AnimationEvent
+
+    MessageAnimEvent() : Message(Message::MessageType_AnimEvent) {}
+};
+
+// Colors that palette frames index into
+#define LED_STREAM_PALETTE_SIZE 16
+
+/// <summary>
+/// Starts or stops streaming LED frames, optionally (re)loading the palette
+/// </summary>
+struct MessageLEDStream
+    : Message
+{
+    uint8_t enable;
+    uint8_t paletteSize;        // Number of colors that follow, may be 0 to keep the current palette
+    uint8_t palette[LED_STREAM_PALETTE_SIZE * 3];   // RGB
+
+    MessageLEDStream() : Message(Message::MessageType_LEDStream) {}
+};
+
+enum LEDStreamFormat : uint8_t
+{
+    LEDStreamFormat_Palette4 = 0,   // 4 bits palette index per LED, low nibble first
+    LEDStreamFormat_RGB565,         // 16 bits color per LED, little endian
+};
+
+/// <summary>
+/// Colors of some or all of the LEDs, meant to be sent as write without response.
+/// The data holds one entry for each bit set in the mask (logical LED indices), lowest first.
+/// </summary>
+struct MessageLEDStreamFrame
+    : Message
+{
+    uint8_t format;             // See LEDStreamFormat
+    uint32_t ledMask;           // LEDs not in the mask keep their color from the previous frame
+    uint8_t data[MAX_LED_COUNT * 2];
+
+    MessageLEDStreamFrame() : Message(Message::MessageType_LEDStreamFrame) {}
+};
+
+/// <summary>
+/// What the message service needs to know about each type of message, generated at compile time.
+/// Types without a struct of their own are just a Message.
+/// </summary>
+enum MessageFlags : uint8_t
+{
+    MessageFlag_Coalescable = 1 << 0,   // Only the latest one matters, it replaces the one waiting to be sent
+    MessageFlag_BulkLane    = 1 << 1,   // Sent when there is nothing more urgent
+    MessageFlag_Inline      = 1 << 2,   // Handled straight from the BLE write event (see MessageService)
+};
+
+struct MessageDescriptor
+{
+    uint16_t minSize;   // Shortest valid message, variable size messages may leave out their data
+    uint8_t flags;
+};
+
+struct MessageDescriptorTable
+{
+    MessageDescriptor entries[Message::MessageType_Count];
+
+    constexpr void set(Message::MessageType msgType, uint16_t minSize, uint8_t flags) {
+        entries[msgType] = { minSize, flags };
+    }
+};
+
+constexpr MessageDescriptorTable makeMessageDescriptors() {
+    MessageDescriptorTable t = {};
+    for (int i = 0; i < Message::MessageType_Count; ++i) {
+        t.entries[i] = { sizeof(Message), 0 };
+    }
+    t.set(Message::MessageType_IAmADie, sizeof(MessageIAmADie), 0);
+    t.set(Message::MessageType_RollState, sizeof(MessageRollState), 0);
+    t.set(Message::MessageType_Telemetry, sizeof(MessageTelemetry), MessageFlag_Coalescable);
+    t.set(Message::MessageType_TelemetryDelta, sizeof(MessageTelemetryDelta), 0);
+    t.set(Message::MessageType_TelemetryBatch, sizeof(MessageTelemetryBatch), 0);
+    t.set(Message::MessageType_BulkSetup, offsetof(MessageBulkSetup, chunkSize), 0); // Only the die sends chunkSize
+    t.set(Message::MessageType_BulkData, sizeof(MessageBulkData) - sizeof(MessageBulkData::data), MessageFlag_BulkLane | MessageFlag_Inline);
+    t.set(Message::MessageType_BulkDataAck, sizeof(MessageBulkDataAck), 0);
+    t.set(Message::MessageType_TransferAnimSet, sizeof(MessageTransferAnimSet), 0);
+    t.set(Message::MessageType_TransferAnimSetAck, sizeof(MessageTransferAnimSetAck), 0);
+    t.set(Message::MessageType_DebugLog, sizeof(MessageDebugLog) - sizeof(MessageDebugLog::text), MessageFlag_BulkLane);
+    t.set(Message::MessageType_PlayAnim, sizeof(MessagePlayAnim), MessageFlag_Inline);
+    t.set(Message::MessageType_RemoteAction, sizeof(MessageRemoteAction), 0);
+    t.set(Message::MessageType_PlayAnimEvent, sizeof(MessagePlayAnimEvent), 0);
+    t.set(Message::MessageType_StopAnim, sizeof(MessageStopAnim), 0);
+    t.set(Message::MessageType_RequestTelemetry, offsetof(MessageRequestTelemetry, fieldsMask), 0); // Older apps only send the mode and interval
+    t.set(Message::MessageType_Blink, sizeof(MessageBlink), 0);
+    t.set(Message::MessageType_DefaultAnimSetColor, sizeof(MessageDefaultAnimSetColor), 0);
+    t.set(Message::MessageType_SetAllLEDsToColor, sizeof(MessageSetAllLEDsToColor), 0);
+    t.set(Message::MessageType_BatteryLevel, sizeof(MessageBatteryLevel), MessageFlag_Coalescable);
+    t.set(Message::MessageType_RequestRssi, sizeof(MessageRequestRssi), 0);
+    t.set(Message::MessageType_Rssi, sizeof(MessageRssi), MessageFlag_Coalescable);
+    t.set(Message::MessageType_SetBroadcastMode, sizeof(MessageSetBroadcastMode), 0);
+    t.set(Message::MessageType_SetDesignAndColor, sizeof(MessageSetDesignAndColor), 0);
+    t.set(Message::MessageType_SetCurrentBehavior, sizeof(MessageSetCurrentBehavior), 0);
+    t.set(Message::MessageType_SetName, sizeof(MessageSetName) - sizeof(MessageSetName::name), 0);
+    t.set(Message::MessageType_PowerOperation, sizeof(MessagePowerOperation), 0);
+    t.set(Message::MessageType_NotifyUser, sizeof(MessageNotifyUser) - sizeof(MessageNotifyUser::text), 0);
+    t.set(Message::MessageType_NotifyUserAck, sizeof(MessageNotifyUserAck), 0);
+    t.set(Message::MessageType_StoreValue, sizeof(MessageStoreValue), 0);
+    t.set(Message::MessageType_StoreValueAck, sizeof(MessageStoreValueAck), 0);
+    t.set(Message::MessageType_SetUserMode, sizeof(MessageSetUserMode), 0);
+    t.set(Message::MessageType_SetFrameRate, sizeof(MessageSetFrameRate), 0);
+    t.set(Message::MessageType_FrameRate, sizeof(MessageFrameRate), 0);
+    t.set(Message::MessageType_RequestProfile, sizeof(MessageRequestProfile), 0);
+    t.set(Message::MessageType_Profile, sizeof(MessageProfile), 0);
+    t.set(Message::MessageType_RequestSchedulerStats, sizeof(MessageRequestSchedulerStats), 0);
+    t.set(Message::MessageType_SchedulerStats, sizeof(MessageSchedulerStats), 0);
+    t.set(Message::MessageType_RequestWakeStats, sizeof(MessageRequestWakeStats), 0);
+    t.set(Message::MessageType_WakeStats, sizeof(MessageWakeStats), 0);
+    t.set(Message::MessageType_LinkInfo, sizeof(MessageLinkInfo), 0);
+    t.set(Message::MessageType_RequestAccelStream, sizeof(MessageRequestAccelStream), 0);
+    t.set(Message::MessageType_AccelStream, sizeof(MessageAccelStream), MessageFlag_BulkLane);
+    t.set(Message::MessageType_RequestRollLog, sizeof(MessageRequestRollLog), 0);
+    t.set(Message::MessageType_RollLog, sizeof(MessageRollLog), 0);
+    t.set(Message::MessageType_RollStats, sizeof(MessageRollStats), 0);
+    t.set(Message::MessageType_SetAdaptiveThresholds, sizeof(MessageSetAdaptiveThresholds), 0);
+    t.set(Message::MessageType_RollThresholds, sizeof(MessageRollThresholds), 0);
+    t.set(Message::MessageType_LikelyFace, sizeof(MessageLikelyFace), 0);
+    t.set(Message::MessageType_EnableBatching, sizeof(MessageEnableBatching), 0);
+    t.set(Message::MessageType_Batch, sizeof(MessageBatch) - sizeof(MessageBatch::data), 0);
+    t.set(Message::MessageType_BulkSetupWindowAck, sizeof(MessageBulkSetupWindowAck), 0);
+    t.set(Message::MessageType_BulkSetupCompressed, sizeof(MessageBulkSetupCompressed), 0);
+    t.set(Message::MessageType_DataSetHashes, sizeof(MessageDataSetHashes), 0);
+    t.set(Message::MessageType_TransferDataSetPatch, sizeof(MessageTransferDataSetPatch), 0);
+    t.set(Message::MessageType_TransferDataSetPatchAck, sizeof(MessageTransferDataSetPatchAck), 0);
+    t.set(Message::MessageType_TransferDataSetPatchFinished, sizeof(MessageTransferDataSetPatchFinished), 0);
+    t.set(Message::MessageType_CalibrateFace, sizeof(MessageCalibrateFace), 0);
+    t.set(Message::MessageType_PrintNormals, sizeof(MessagePrintNormals), 0);
+    t.set(Message::MessageType_LightUpFace, sizeof(MessageLightUpFace), 0);
+    t.set(Message::MessageType_SetLEDToColor, sizeof(MessageSetLEDToColor), 0);
+    t.set(Message::MessageType_TransferTest, sizeof(MessageTransferTest), 0);
+    t.set(Message::MessageType_TransferTestAck, sizeof(MessageTransferTestAck), 0);
+    t.set(Message::MessageType_TransferTestFinished, sizeof(MessageTransferTestFinished), 0);
+    t.set(Message::MessageType_TransferTestData, sizeof(MessageTransferTestData) - sizeof(MessageTransferTestData::data), 0);
+    t.set(Message::MessageType_TransferInstantAnimSet, sizeof(MessageTransferInstantAnimSet), 0);
+    t.set(Message::MessageType_TransferInstantAnimSetAck, sizeof(MessageTransferInstantAnimSetAck), 0);
+    t.set(Message::MessageType_PlayInstantAnim, sizeof(MessagePlayInstantAnim), MessageFlag_Inline);
+    t.set(Message::MessageType_Temperature, sizeof(MessageTemperature), MessageFlag_Coalescable);
+    t.set(Message::MessageType_SetBatteryControllerMode, sizeof(MessageSetBatteryControllerMode), 0);
+    t.set(Message::MessageType_Discharge, sizeof(MessageDischarge), 0);
+    t.set(Message::MessageType_BlinkId, sizeof(MessageBlinkId), 0);
+    t.set(Message::MessageType_RequestTraceLog, sizeof(MessageRequestTraceLog), 0);
+    t.set(Message::MessageType_TraceLog, sizeof(MessageTraceLog), MessageFlag_BulkLane);
+    t.set(Message::MessageType_RequestTimeline, sizeof(MessageRequestTimeline), 0);
+    t.set(Message::MessageType_Timeline, sizeof(MessageTimeline), 0);
+    t.set(Message::MessageType_MemoryStats, sizeof(MessageMemoryStats), 0);
+    t.set(Message::MessageType_NotReady, sizeof(MessageNotReady), 0);
+    t.set(Message::MessageType_CalibrateFaceSample, sizeof(MessageCalibrateFaceSample), 0);
+    t.set(Message::MessageType_CalibrateFaceSampled, sizeof(MessageCalibrateFaceSampled), 0);
+    t.set(Message::MessageType_SyncTime, sizeof(MessageSyncTime), 0);
+    t.set(Message::MessageType_SyncTimeAck, sizeof(MessageSyncTimeAck), 0);
+    t.set(Message::MessageType_PlayAnimAt, sizeof(MessagePlayAnimAt), 0);
+    t.set(Message::MessageType_ArmAnimTrigger, sizeof(MessageArmAnimTrigger), 0);
+    t.set(Message::MessageType_ArmAnimTriggerAck, sizeof(MessageArmAnimTriggerAck), 0);
+    t.set(Message::MessageType_DisarmAnimTriggers, sizeof(MessageDisarmAnimTriggers), 0);
+    t.set(Message::MessageType_AnimTriggerFired, sizeof(MessageAnimTriggerFired), 0);
+    t.set(Message::MessageType_SetRssiFilter, sizeof(MessageSetRssiFilter), 0);
+    t.set(Message::MessageType_EnableAnimEvents, sizeof(MessageEnableAnimEvents), 0);
+    t.set(Message::MessageType_AnimEvent, sizeof(MessageAnimEvent), 0);
+    t.set(Message::MessageType_LEDStream, sizeof(MessageLEDStream) - sizeof(MessageLEDStream::palette), 0);
+    t.set(Message::MessageType_LEDStreamFrame, sizeof(MessageLEDStreamFrame) - sizeof(MessageLEDStreamFrame::data), MessageFlag_Inline);
+    t.set(Message::MessageType_SetLEDColors, sizeof(MessageSetLEDColors) - sizeof(MessageSetLEDColors::colors), 0);
+    t.set(Message::MessageType_RequestAnimEnergyStats, sizeof(MessageRequestAnimEnergyStats), 0);
+    t.set(Message::MessageType_AnimEnergyStats, sizeof(MessageAnimEnergyStats) - sizeof(MessageAnimEnergyStats::anims), 0);
+    t.set(Message::MessageType_RunSelfTest, sizeof(MessageRunSelfTest), 0);
+    t.set(Message::MessageType_SelfTestResult, sizeof(MessageSelfTestResult), 0);
+    t.set(Message::MessageType_AnimControllerState, sizeof(MessageAnimControllerState) - sizeof(MessageAnimControllerState::instances), 0);
+    t.set(Message::MessageType_BlinkSlot, sizeof(MessageBlinkSlot), 0);
+    t.set(Message::MessageType_BlinkSlotAck, sizeof(MessageBlinkSlotAck), 0);
+    t.set(Message::MessageType_SetPerformanceProfile, sizeof(MessageSetPerformanceProfile), 0);
+    t.set(Message::MessageType_PerformanceProfile, sizeof(MessagePerformanceProfile), 0);
+    t.set(Message::MessageType_RollLogCleared, sizeof(MessageRollLogCleared), 0);
+    t.set(Message::MessageType_SetLinkConditions, sizeof(MessageSetLinkConditions), 0);
+    return t;
+}
+
+constexpr MessageDescriptorTable messageDescriptors = makeMessageDescriptors();
+
+constexpr const MessageDescriptor& getMessageDescriptor(Message::MessageType msgType) {
+    return messageDescriptors.entries[msgType];
+}
 }
 
 #pragma pack(pop)
@@ -6,6 +6,7 @@
 #include "nrf_sdh_ble.h"
 #include "nrf_sdh_soc.h"
 #include "nrf_log.h"
+#include "app_util_platform.h"
 #include "nrf_ble_qwr.h"
 #include "ble_conn_state.h"
 #include "ble_advdata.h"
@@ -18,6 +19,8 @@
 #include "config/settings.h"
 #include "drivers_nrf/power_manager.h"
 #include "drivers_nrf/timers.h"
+#include "drivers_nrf/profiler.h"
+#include "drivers_nrf/rng.h"
 #include "core/delegate_array.h"
 
 #include "pixel.h"
@@ -35,9 +38,14 @@ namespace Bluetooth::Stack
     #define APP_BLE_OBSERVER_PRIO           3                                       /**< Application's BLE observer priority. You shouldn't need to modify this value. */
     #define APP_BLE_CONN_CFG_TAG            1                                       /**< A tag identifying the SoftDevice BLE configuration. */
 
-    #define MIN_CONN_INTERVAL               MSEC_TO_UNITS(15, UNIT_1_25_MS)         /**< Minimum acceptable connection interval (0.015 seconds). */
-    #define MAX_CONN_INTERVAL               MSEC_TO_UNITS(30, UNIT_1_25_MS)         /**< Maximum acceptable connection interval (0.030 seconds). */
-    #define SLAVE_LATENCY                   0                                       /**< Slave latency. */
+    #define MIN_CONN_INTERVAL               MSEC_TO_UNITS(30, UNIT_1_25_MS)         /**< Minimum acceptable connection interval when idle (0.030 seconds). */
+    #define MAX_CONN_INTERVAL               MSEC_TO_UNITS(75, UNIT_1_25_MS)         /**< Maximum acceptable connection interval when idle (0.075 seconds). */
+    #define SLAVE_LATENCY                   4                                       /**< Slave latency when idle, connection events the die may skip when it has nothing to send. */
+    #define FAST_MIN_CONN_INTERVAL          MSEC_TO_UNITS(7.5, UNIT_1_25_MS)        /**< Minimum connection interval during transfers (0.0075 seconds). */
+    #define FAST_MAX_CONN_INTERVAL          MSEC_TO_UNITS(15, UNIT_1_25_MS)         /**< Maximum connection interval during transfers (0.015 seconds). */
+    #define FAST_SLAVE_LATENCY              0                                       /**< No slave latency during transfers. */
+    #define FAST_CONNECTION_RELEASE_MS      2000                                    /**< Time before relaxing the connection once the last transfer is done, transfers often come in a row. */
+    #define CONNECTION_SETUP_FAST_MS        5000                                    /**< Max time the fast parameters are kept after connecting if the central doesn't identify the die. */
     #define CONN_SUP_TIMEOUT                MSEC_TO_UNITS(3000, UNIT_10_MS)         /**< Connection supervisory timeout (4 seconds). */
 
     #define FIRST_CONN_PARAMS_UPDATE_DELAY  APP_TIMER_TICKS(5000)                   /**< Time from initiating event (connect or start of notification) to first time sd_ble_gap_conn_param_update is called (5 seconds). */
@@ -53,11 +61,19 @@ namespace Bluetooth::Stack
     #define SEC_PARAM_MIN_KEY_SIZE          7                                       /**< Minimum encryption key size. */
     #define SEC_PARAM_MAX_KEY_SIZE          16                                      /**< Maximum encryption key size. */
 
+    #define HVN_TX_QUEUE_SIZE               4                                       /**< Number of notifications the SoftDevice can queue, so several go out per connection event. */
+    #define HVN_TX_QUEUE_RESERVED           1                                       /**< Notification slots bulk messages leave free, so a roll state never waits behind them. */
+
     #define MAX_CLIENTS 8
     #define MAX_RSSI_CLIENTS 2
+    #define MAX_LINK_INFO_CLIENTS 1
 
     #define RSSI_THRESHOLD_DBM 1
     #define RSSI_NOTIFY_MIN_INTERVAL 1000 // In ms
+    #define RSSI_FILTER_THRESHOLD_DBM 2 // Change of the filtered RSSI worth notifying
+    #define RSSI_FILTER_SHIFT 2 // The average moves by 1/4 of the difference with each sample
+
+    #define RADIO_IDLE_MS 250 // Time without traffic after which the connection is considered idle
 
     static uint16_t connectionHandle = BLE_CONN_HANDLE_INVALID;                     /**< Handle of the current connection. */
     //NRF_BLE_QWR_DEF(nrfQwr);                                                        /**< Context for the Queued Write module.*/
@@ -66,8 +82,25 @@ namespace Bluetooth::Stack
     BLE_ADVERTISING_DEF(advertisingModule);                                         /**< Advertising module instance. */
 
     static bool connected = false;
+    static volatile uint8_t notificationsInFlight = 0;                              /**< Notifications handed to the SoftDevice and not yet transmitted. */
+    static volatile int lastTrafficMs = 0;                                          /**< Time of the last notification sent or write received. */
+    static uint8_t fastConnectionUsers = 0;                                         /**< ConnectionUser flags of the features that want short intervals. */
+    static bool fastConnection = false;                                             /**< Whether the fast parameters were last requested. */
+    APP_TIMER_DEF(relaxConnectionTimer);
+    APP_TIMER_DEF(connectionSetupTimer);
+    static LinkInfo linkInfo;                                                       /**< Negotiated link parameters of the current connection. */
+    static uint32_t advertisingInterval = APP_ADV_INTERVAL;                         /**< Current advertising interval, in units of 0.625 ms. */
+    static bool advertiseOnDisconnect = true;
+    static bool extendedAdvertising = false;                                        /**< Single extended advertising set instead of legacy advertising and scan response. */
     static bool resetOnDisconnectPending = false;
     static bool sleepOnDisconnectPending = false;
+    static LinkConditions linkConditions;                                           /**< Test conditions of the current connection, all 0 when not testing. */
+    static uint16_t droppedNotificationCount = 0;
+
+#if BLE_LISTENER_LINK_COUNT > 0
+    static uint16_t listenerHandles[BLE_LISTENER_LINK_COUNT];                      /**< Connections of the listening centrals. */
+    static uint8_t listenerCount = 0;
+#endif
 
     /**< Universally unique service identifiers. */
     static ble_uuid_t advertisedUuids[] = {
@@ -81,6 +114,15 @@ namespace Bluetooth::Stack
     DelegateArray<ConnectionEventMethod, MAX_CLIENTS> clients;
     DelegateArray<RssiEventMethod, MAX_RSSI_CLIENTS> rssiClients;
 
+    // RSSI samples are averaged, clients only get the changes that matter, see setRssiFilter()
+    static int16_t rssiAverageTimes16 = 0;   // Fixed point, 0 until the first sample
+    static int8_t lastNotifiedRssi = 0;
+    static uint32_t lastRssiNotifyMs = 0;
+    static uint8_t rssiFilterThreshold = RSSI_FILTER_THRESHOLD_DBM;
+    static uint16_t rssiFilterMinInterval = RSSI_NOTIFY_MIN_INTERVAL;
+    void onRssiSample(int8_t rssi, uint8_t channelIndex);
+    DelegateArray<LinkInfoEventMethod, MAX_LINK_INFO_CLIENTS> linkInfoClients;
+
 #pragma pack( push, 1)
     struct CustomServiceData {
         uint32_t deviceId;
@@ -111,18 +153,140 @@ namespace Bluetooth::Stack
     static ble_advdata_t advertisementPacket;
     static ble_advdata_t scanResponsePacket;
 
+#if BLE_EXTENDED_ADVERTISING
+    // Extended advertising isn't scannable, the advertising data carries the scan response content too
+    static ble_advdata_t extendedAdvertisementPacket;
+    static ble_uuid_t extendedAdvertisingUuids[] = {
+        {BLE_UUID_DEVICE_INFORMATION_SERVICE, BLE_UUID_TYPE_BLE},
+        {GENERIC_DATA_SERVICE_UUID_SHORT, BLE_UUID_TYPE_VENDOR_BEGIN},
+    };
+#endif
+
     /**@brief Function for handling BLE events.
      *
      * @param[in]   p_ble_evt   Bluetooth stack event.
      * @param[in]   p_context   Unused.
      */
+    void notifyLinkInfo() {
+        for (int i = 0; i < linkInfoClients.Count(); ++i) {
+            linkInfoClients[i].handler(linkInfoClients[i].token, linkInfo);
+        }
+    }
+
+    void setLinkConnectionParameters(const ble_gap_conn_params_t& params) {
+        linkInfo.connectionInterval = params.max_conn_interval;
+        linkInfo.slaveLatency = params.slave_latency;
+        linkInfo.supervisionTimeout = params.conn_sup_timeout;
+    }
+
+    /// <summary>
+    /// Starts the PHY and data length procedures, the SDK GATT module already takes care
+    /// of the MTU exchange but leaves the data length to the central with the S112
+    /// </summary>
+    void negotiateLink() {
+        ble_gap_phys_t const phys =
+        {
+            .tx_phys = BLE_GAP_PHY_2MBPS,
+            .rx_phys = BLE_GAP_PHY_2MBPS,
+        };
+        ret_code_t err_code = sd_ble_gap_phy_update(connectionHandle, &phys);
+        if (err_code != NRF_SUCCESS) {
+            // Busy if the central started its own procedure, we'll get its result
+            NRF_LOG_WARNING("PHY update failed: 0x%x", err_code);
+        }
+
+        ble_gap_data_length_params_t dlParams;
+        memset(&dlParams, 0, sizeof(dlParams));
+        dlParams.max_tx_octets = NRF_SDH_BLE_GAP_DATA_LENGTH;
+        dlParams.max_rx_octets = NRF_SDH_BLE_GAP_DATA_LENGTH;
+        dlParams.max_tx_time_us = BLE_GAP_DATA_LENGTH_AUTO;
+        dlParams.max_rx_time_us = BLE_GAP_DATA_LENGTH_AUTO;
+        err_code = sd_ble_gap_data_length_update(connectionHandle, &dlParams, nullptr);
+        if (err_code != NRF_SUCCESS) {
+            NRF_LOG_WARNING("Data length update failed: 0x%x", err_code);
+        }
+    }
+
+#if BLE_LISTENER_LINK_COUNT > 0
+    /// <summary>
+    /// Keeps advertising while there is room for another listener, the SoftDevice stops
+    /// advertising whenever a central connects
+    /// </summary>
+    void advertiseForListeners() {
+        if (listenerCount < BLE_LISTENER_LINK_COUNT && advertiseOnDisconnect) {
+            sd_ble_gap_adv_stop(advertisingModule.adv_handle);
+            ret_code_t err_code = ble_advertising_start(&advertisingModule, BLE_ADV_MODE_FAST);
+            if (err_code != NRF_SUCCESS) {
+                NRF_LOG_WARNING("Could not advertise for listeners: 0x%x", err_code);
+            }
+        }
+    }
+
+    bool addListener(uint16_t connHandle) {
+        if (listenerCount == BLE_LISTENER_LINK_COUNT) {
+            return false;
+        }
+        listenerHandles[listenerCount++] = connHandle;
+        NRF_LOG_INFO("Listener connected (%d)", listenerCount);
+        advertiseForListeners();
+        return true;
+    }
+
+    bool removeListener(uint16_t connHandle) {
+        for (int i = 0; i < listenerCount; ++i) {
+            if (listenerHandles[i] == connHandle) {
+                listenerHandles[i] = listenerHandles[--listenerCount];
+                NRF_LOG_INFO("Listener disconnected (%d)", listenerCount);
+                advertiseForListeners();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// <summary>
+    /// Keeps track of the listeners, returns true if the event is about one of them. The SoftDevice
+    /// answers them on its own, the rest of the stack events are about the main link.
+    /// </summary>
+    bool onListenerEvent(ble_evt_t const * p_ble_evt) {
+        // All the event structures start with the connection handle
+        const uint16_t connHandle = p_ble_evt->evt.gap_evt.conn_handle;
+        switch (p_ble_evt->header.evt_id) {
+            case BLE_GAP_EVT_CONNECTED:
+                return connected && addListener(connHandle);
+            case BLE_GAP_EVT_DISCONNECTED:
+                return removeListener(connHandle);
+            case BLE_GAP_EVT_PHY_UPDATE:
+            case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+            case BLE_GAP_EVT_RSSI_CHANGED:
+            case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+                return connHandle != connectionHandle;
+            default:
+                return false;
+        }
+    }
+#endif
+
     void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context) {
         ret_code_t err_code = NRF_SUCCESS;
 
+#if BLE_LISTENER_LINK_COUNT > 0
+        if (onListenerEvent(p_ble_evt)) {
+            PowerManager::feed();
+            return;
+        }
+#endif
+
         switch (p_ble_evt->header.evt_id) {
             case BLE_GAP_EVT_DISCONNECTED:
                 NRF_LOG_INFO("Disco: 0x%02x", p_ble_evt->evt.gap_evt.params.disconnected.reason);
                 connected = false;
+                notificationsInFlight = 0;
+                memset(&linkConditions, 0, sizeof(linkConditions));
+                fastConnectionUsers = 0;
+                fastConnection = false;
+                Timers::stopTimer(relaxConnectionTimer);
+                Timers::stopTimer(connectionSetupTimer);
                 for (int i = 0; i < clients.Count(); ++i) {
                     clients[i].handler(clients[i].token, false);
                 }
@@ -135,7 +299,12 @@ namespace Bluetooth::Stack
                     sleepOnDisconnectPending = false;
                     PowerManager::goToSleep();
                 }
-
+#if BLE_LISTENER_LINK_COUNT > 0
+                else if (listenerCount > 0) {
+                    // The advertising module only restarts when the last central to connect leaves
+                    advertiseForListeners();
+                }
+#endif
                 break;
 
             case BLE_GAP_EVT_CONNECTED:
@@ -144,11 +313,27 @@ namespace Bluetooth::Stack
                 // err_code = nrf_ble_qwr_conn_handle_assign(&nrfQwr, connectionHandle);
                 // APP_ERROR_CHECK(err_code);
                 connected = true;
+                notificationsInFlight = 0;
+                linkInfo.attMtu = BLE_GATT_ATT_MTU_DEFAULT;
+                linkInfo.dataLengthTx = BLE_GAP_DATA_LENGTH_DEFAULT;
+                linkInfo.dataLengthRx = BLE_GAP_DATA_LENGTH_DEFAULT;
+                linkInfo.txPhy = BLE_GAP_PHY_1MBPS;
+                linkInfo.rxPhy = BLE_GAP_PHY_1MBPS;
+                setLinkConnectionParameters(p_ble_evt->evt.gap_evt.params.connected.conn_params);
+                negotiateLink();
+
+                // Discovery and the first messages go faster with short intervals, we relax
+                // once the central has identified the die (see WhoAreYou)
+                requestFastConnection(ConnectionUser_Connecting);
+                Timers::startTimer(connectionSetupTimer, CONNECTION_SETUP_FAST_MS);
                 for (int i = 0; i < clients.Count(); ++i) {
                     clients[i].handler(clients[i].token, true);
                 }
 
                 CustomAdvertisingDataHandler::stop();
+#if BLE_LISTENER_LINK_COUNT > 0
+                advertiseForListeners();
+#endif
                 break;
 
             case BLE_GAP_EVT_PHY_UPDATE_REQUEST: {
@@ -163,21 +348,28 @@ namespace Bluetooth::Stack
                 break;
             }
 
-            case BLE_GAP_EVT_RSSI_CHANGED: {
-                static uint32_t nextUpdate = 0;
-                // No more often than once a second
-                const uint32_t time = DriversNRF::Timers::millis();
-                if (nextUpdate <= time) {
-                    nextUpdate = time + RSSI_NOTIFY_MIN_INTERVAL;
-                    auto rssi = p_ble_evt->evt.gap_evt.params.rssi_changed.rssi;
-                    auto chIndex = p_ble_evt->evt.gap_evt.params.rssi_changed.ch_index;
-                    for (int i = 0; i < rssiClients.Count(); ++i) {
-                        rssiClients[i].handler(rssiClients[i].token, rssi, chIndex);
-                    }
+            case BLE_GAP_EVT_PHY_UPDATE: {
+                auto const& update = p_ble_evt->evt.gap_evt.params.phy_update;
+                if (update.status == BLE_HCI_STATUS_CODE_SUCCESS) {
+                    NRF_LOG_INFO("PHY tx: %d, rx: %d", update.tx_phy, update.rx_phy);
+                    linkInfo.txPhy = update.tx_phy;
+                    linkInfo.rxPhy = update.rx_phy;
+                    notifyLinkInfo();
                 }
                 break;
             }
 
+            case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+                setLinkConnectionParameters(p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params);
+                NRF_LOG_DEBUG("Connection interval: %d x 1.25ms, latency: %d", linkInfo.connectionInterval, linkInfo.slaveLatency);
+                notifyLinkInfo();
+                break;
+
+            case BLE_GAP_EVT_RSSI_CHANGED:
+                onRssiSample(p_ble_evt->evt.gap_evt.params.rssi_changed.rssi,
+                    p_ble_evt->evt.gap_evt.params.rssi_changed.ch_index);
+                break;
+
             case BLE_GATTC_EVT_TIMEOUT:
                 // Disconnect on GATT Client timeout event.
                 NRF_LOG_DEBUG("GATT Client Timeout");
@@ -197,22 +389,31 @@ namespace Bluetooth::Stack
             case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
                 // Pairing not supported
                 NRF_LOG_DEBUG("Pairing not supported!");
-                err_code = sd_ble_gap_sec_params_reply(connectionHandle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL, NULL);
+                err_code = sd_ble_gap_sec_params_reply(p_ble_evt->evt.gap_evt.conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL, NULL);
                 APP_ERROR_CHECK(err_code);
                 break;
 
             case BLE_GATTS_EVT_SYS_ATTR_MISSING:
                 // No system attributes have been stored.
                 NRF_LOG_DEBUG("System Attributes Missing!");
-                err_code = sd_ble_gatts_sys_attr_set(connectionHandle, NULL, 0, 0);
+                err_code = sd_ble_gatts_sys_attr_set(p_ble_evt->evt.gatts_evt.conn_handle, NULL, 0, 0);
                 APP_ERROR_CHECK(err_code);
                 break;
 
-            case BLE_GATTS_EVT_HVN_TX_COMPLETE:
-                // Last notification was cleared!
-                NRF_LOG_DEBUG("Notification Complete!");
+            case BLE_GATTS_EVT_WRITE:
+                // Handled by the message service, only noted here
+                lastTrafficMs = DriversNRF::Timers::millis();
                 break;
 
+            case BLE_GATTS_EVT_HVN_TX_COMPLETE: {
+                TIMELINE_INSTANT(Profiler::TimelineEvent_NotificationsSent);
+                // Notifications were cleared, the count covers all of them since the last event
+                uint8_t count = p_ble_evt->evt.gatts_evt.params.hvn_tx_complete.count;
+                notificationsInFlight = notificationsInFlight > count ? notificationsInFlight - count : 0;
+                NRF_LOG_DEBUG("%d Notification(s) Complete!", count);
+                break;
+            }
+
             case BLE_GATTS_EVT_HVC:
                 // Last notification was cleared!
                 NRF_LOG_DEBUG("Confirmation Received!");
@@ -230,6 +431,98 @@ namespace Bluetooth::Stack
         PowerManager::feed();
     }
 
+#if BLE_EXTENDED_ADVERTISING
+    void advertising_config_get(ble_adv_modes_config_t * p_config);
+
+    // While the advertising type is being changed, a failed extended data update is left for
+    // changeAdvertisingType to handle rather than falling back (and restarting advertising) from under it
+    static bool changingAdvertisingType = false;
+    static ret_code_t changeAdvertisingDataError = NRF_SUCCESS;
+
+    static void setAdvertisingType(bool extended) {
+        extendedAdvertising = extended;
+        ble_adv_modes_config_t config;
+        advertising_config_get(&config);
+        ble_advertising_modes_config_set(&advertisingModule, &config);
+
+        // The custom data is sized for the advertising type
+        changingAdvertisingType = true;
+        changeAdvertisingDataError = NRF_SUCCESS;
+        CustomAdvertisingDataHandler::publishNow();
+        changingAdvertisingType = false;
+    }
+
+    /// <summary>
+    /// Switches between legacy and extended advertising, the custom data is re-encoded
+    /// for the new type and advertising restarted if it was running
+    /// </summary>
+    static ret_code_t changeAdvertisingType(bool extended) {
+        const bool restart = !connected && advertisingModule.adv_mode_current != BLE_ADV_MODE_IDLE;
+        if (restart) {
+            sd_ble_gap_adv_stop(advertisingModule.adv_handle);
+        }
+        setAdvertisingType(extended);
+        if (extendedAdvertising && changeAdvertisingDataError != NRF_SUCCESS) {
+            NRF_LOG_WARNING("Extended advertising failed (0x%x), back to legacy advertising", changeAdvertisingDataError);
+            setAdvertisingType(false);
+        }
+        return restart ? ble_advertising_start(&advertisingModule, BLE_ADV_MODE_FAST) : NRF_SUCCESS;
+    }
+
+    /// <summary>
+    /// The SoftDevice (or the advertising module's buffers) may not take the extended advertising set,
+    /// the die then stays discoverable with legacy advertising
+    /// </summary>
+    static void fallBackToLegacyAdvertising(ret_code_t err_code) {
+        NRF_LOG_WARNING("Extended advertising failed (0x%x), back to legacy advertising", err_code);
+        APP_ERROR_CHECK(changeAdvertisingType(false));
+    }
+#endif
+
+    /// <summary>
+    /// Error check for starting advertising, only extended advertising is allowed to fail
+    /// </summary>
+    static void checkAdvertisingError(uint32_t err_code) {
+#if BLE_EXTENDED_ADVERTISING
+        if (err_code != NRF_SUCCESS && extendedAdvertising) {
+            fallBackToLegacyAdvertising(err_code);
+            return;
+        }
+#endif
+        APP_ERROR_CHECK(err_code);
+    }
+
+    /// <summary>
+    /// Encodes the advertising data, the advertised name is shortened if the custom data
+    /// doesn't fit along with the full name
+    /// </summary>
+    ret_code_t updateAdvertisingData() {
+#if BLE_EXTENDED_ADVERTISING
+        if (extendedAdvertising) {
+            // Plenty of room for the full name
+            ret_code_t err_code = ble_advertising_advdata_update(&advertisingModule, &extendedAdvertisementPacket, NULL);
+            if (err_code != NRF_SUCCESS) {
+                if (changingAdvertisingType) {
+                    changeAdvertisingDataError = err_code;
+                } else {
+                    // The legacy data is published instead
+                    fallBackToLegacyAdvertising(err_code);
+                }
+            }
+            return NRF_SUCCESS;
+        }
+#endif
+        advertisementPacket.name_type = BLE_ADVDATA_FULL_NAME;
+        ret_code_t err_code = ble_advertising_advdata_update(&advertisingModule, &advertisementPacket, &scanResponsePacket);
+        uint16_t nameLength = strlen(SettingsManager::getSettings()->name);
+        while (err_code == NRF_ERROR_DATA_SIZE && nameLength > 1) {
+            advertisementPacket.name_type = BLE_ADVDATA_SHORT_NAME;
+            advertisementPacket.short_name_len = --nameLength;
+            err_code = ble_advertising_advdata_update(&advertisingModule, &advertisementPacket, &scanResponsePacket);
+        }
+        return err_code;
+    }
+
     // Function for handling advertising events.
     // This function will be called for advertising events which are passed to the application.
     void on_adv_evt(ble_adv_evt_t ble_adv_evt) {
@@ -237,7 +530,7 @@ namespace Bluetooth::Stack
         {
             case BLE_ADV_EVT_FAST: {
                 NRF_LOG_INFO("Fast adv.");
-                ret_code_t err_code = ble_advertising_advdata_update(&advertisingModule, &advertisementPacket, &scanResponsePacket);
+                ret_code_t err_code = updateAdvertisingData();
                 APP_ERROR_CHECK(err_code);
                 CustomAdvertisingDataHandler::start();
             }
@@ -254,6 +547,33 @@ namespace Bluetooth::Stack
         }
     }
 
+    // Function for handling the GATT module events, MTU and data length are only recorded
+    void gatt_evt_handler(nrf_ble_gatt_t * p_gatt, nrf_ble_gatt_evt_t const * p_evt) {
+#if BLE_LISTENER_LINK_COUNT > 0
+        if (p_evt->conn_handle != connectionHandle) {
+            return;
+        }
+#endif
+        switch (p_evt->evt_id)
+        {
+            case NRF_BLE_GATT_EVT_ATT_MTU_UPDATED:
+                NRF_LOG_INFO("ATT MTU: %d", p_evt->params.att_mtu_effective);
+                linkInfo.attMtu = p_evt->params.att_mtu_effective;
+                notifyLinkInfo();
+                break;
+
+            case NRF_BLE_GATT_EVT_DATA_LENGTH_UPDATED:
+                NRF_LOG_INFO("Data length: %d", p_evt->params.data_length);
+                linkInfo.dataLengthTx = p_evt->params.data_length;
+                linkInfo.dataLengthRx = p_evt->params.data_length;
+                notifyLinkInfo();
+                break;
+
+            default:
+                break;
+        }
+    }
+
     void nrf_qwr_error_handler(uint32_t nrf_error) {
         APP_ERROR_HANDLER(nrf_error);
     }
@@ -266,6 +586,37 @@ namespace Bluetooth::Stack
         APP_ERROR_HANDLER(nrf_error);
     }
 
+    /// <summary>
+    /// Asks the central for the fast or idle connection parameters
+    /// </summary>
+    void requestConnectionParameters(bool fast) {
+        if (fast == fastConnection || !connected) {
+            return;
+        }
+
+        ble_gap_conn_params_t params;
+        params.min_conn_interval = fast ? FAST_MIN_CONN_INTERVAL : MIN_CONN_INTERVAL;
+        params.max_conn_interval = fast ? FAST_MAX_CONN_INTERVAL : MAX_CONN_INTERVAL;
+        params.slave_latency     = fast ? FAST_SLAVE_LATENCY : SLAVE_LATENCY;
+        params.conn_sup_timeout  = CONN_SUP_TIMEOUT;
+
+        // Goes through the connection parameters module so it doesn't negotiate them back
+        ret_code_t err_code = ble_conn_params_change_conn_params(connectionHandle, &params);
+        if (err_code == NRF_SUCCESS) {
+            NRF_LOG_DEBUG("Requested %s connection", fast ? "fast" : "idle");
+            fastConnection = fast;
+        } else {
+            // e.g. a parameter update is already in progress, the next request or release tries again
+            NRF_LOG_WARNING("Connection parameters update failed: 0x%x", err_code);
+        }
+    }
+
+    void relaxConnection(void* context) {
+        if (fastConnectionUsers == 0) {
+            requestConnectionParameters(false);
+        }
+    }
+
     /**@brief Function for handling Peer Manager events.
      *
      * @param[in] p_evt  Peer Manager event.
@@ -279,8 +630,14 @@ namespace Bluetooth::Stack
         memset(p_config, 0, sizeof(ble_adv_modes_config_t));
 
         p_config->ble_adv_fast_enabled  = true;
-        p_config->ble_adv_fast_interval = APP_ADV_INTERVAL;
+        p_config->ble_adv_fast_interval = advertisingInterval;
         p_config->ble_adv_fast_timeout  = APP_ADV_DURATION;
+        p_config->ble_adv_on_disconnect_disabled = !advertiseOnDisconnect;
+#if BLE_EXTENDED_ADVERTISING
+        p_config->ble_adv_extended_enabled = extendedAdvertising;
+        p_config->ble_adv_primary_phy = BLE_GAP_PHY_1MBPS;
+        p_config->ble_adv_secondary_phy = BLE_GAP_PHY_1MBPS;
+#endif
     }
 
     void init() {
@@ -295,10 +652,27 @@ namespace Bluetooth::Stack
         err_code = nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start);
         APP_ERROR_CHECK(err_code);
 
+        // Let the SoftDevice queue more than one notification so it can send several per connection event.
+        // This takes SoftDevice RAM, nrf_sdh_ble_enable() logs the required RAM start if the linker script is short.
+        ble_cfg_t ble_cfg;
+        memset(&ble_cfg, 0, sizeof(ble_cfg));
+        ble_cfg.conn_cfg.conn_cfg_tag = APP_BLE_CONN_CFG_TAG;
+        ble_cfg.conn_cfg.params.gatts_conn_cfg.hvn_tx_queue_size = HVN_TX_QUEUE_SIZE;
+        err_code = sd_ble_cfg_set(BLE_CONN_CFG_GATTS, &ble_cfg, ram_start);
+        APP_ERROR_CHECK(err_code);
+
         // Enable BLE stack.
         err_code = nrf_sdh_ble_enable(&ram_start);
         APP_ERROR_CHECK(err_code);
 
+        // Let connection events run past the configured event length while there is data to send
+        // (and nothing else to do for the radio), so a transfer can fill the whole interval
+        ble_opt_t opt;
+        memset(&opt, 0, sizeof(opt));
+        opt.common_opt.conn_evt_ext.enable = 1;
+        err_code = sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt);
+        APP_ERROR_CHECK(err_code);
+
         // Register a handler for BLE events.
         // Nothing to validate
         NRF_SDH_BLE_OBSERVER(m_ble_observer, APP_BLE_OBSERVER_PRIO, ble_evt_handler, NULL);
@@ -316,9 +690,14 @@ namespace Bluetooth::Stack
         err_code = sd_ble_gap_ppcp_set(&gap_conn_params);
         APP_ERROR_CHECK(err_code);
 
-        err_code = nrf_ble_gatt_init(&nrfGatt, NULL);
+        err_code = nrf_ble_gatt_init(&nrfGatt, gatt_evt_handler);
         APP_ERROR_CHECK(err_code);
 
+        Timers::createTimer(&relaxConnectionTimer, APP_TIMER_MODE_SINGLE_SHOT, relaxConnection);
+        Timers::createTimer(&connectionSetupTimer, APP_TIMER_MODE_SINGLE_SHOT, [](void* context) {
+            releaseFastConnection(ConnectionUser_Connecting);
+        });
+
         NRF_LOG_DEBUG("BLE Stack init, RAM start: 0x%X", ram_start);
     }
 
@@ -346,6 +725,7 @@ namespace Bluetooth::Stack
         advertising_config_get(&init.config);
 
         init.evt_handler = on_adv_evt;
+        init.error_handler = checkAdvertisingError; // Advertising restarted by the module on disconnect
 
         ret_code_t err_code = ble_advertising_init(&advertisingModule, &init);
         APP_ERROR_CHECK(err_code);
@@ -361,7 +741,7 @@ namespace Bluetooth::Stack
         cp_init.next_conn_params_update_delay  = NEXT_CONN_PARAMS_UPDATE_DELAY;
         cp_init.max_conn_params_update_count   = MAX_CONN_PARAMS_UPDATE_COUNT;
         cp_init.start_on_notify_cccd_handle    = BLE_GATT_HANDLE_INVALID;
-        cp_init.disconnect_on_fail             = true; // Disconnect on a failed connection parameters update, use evt_handler to add a custom behavior
+        cp_init.disconnect_on_fail             = false; // Keep the link when the central doesn't grant the requested parameters, it only costs speed or power
         cp_init.error_handler                  = conn_params_error_handler;
 
         err_code = ble_conn_params_init(&cp_init);
@@ -376,6 +756,14 @@ namespace Bluetooth::Stack
         memcpy(&scanResponsePacket, &init.srdata, sizeof(ble_advdata_t));
         advertisementPacket.p_manuf_specific_data = &advertisedManufData;
 
+#if BLE_EXTENDED_ADVERTISING
+        memcpy(&extendedAdvertisementPacket, &advertisementPacket, sizeof(ble_advdata_t));
+        extendedAdvertisementPacket.uuids_complete.uuid_cnt = sizeof(extendedAdvertisingUuids) / sizeof(extendedAdvertisingUuids[0]);
+        extendedAdvertisementPacket.uuids_complete.p_uuids = extendedAdvertisingUuids;
+        extendedAdvertisementPacket.p_service_data_array = &advertisedServiceData;
+        extendedAdvertisementPacket.service_data_count = 1;
+#endif
+
         ble_gap_conn_sec_mode_t sec_mode;
 
         BLE_GAP_CONN_SEC_MODE_SET_OPEN(&sec_mode);
@@ -391,7 +779,7 @@ namespace Bluetooth::Stack
     void updateCustomAdvertisingData(uint8_t* data, uint16_t size) {
         advertisedManufData.data.p_data = data;
         advertisedManufData.data.size = size;
-        ret_code_t err_code = ble_advertising_advdata_update(&advertisingModule, &advertisementPacket, &scanResponsePacket);
+        ret_code_t err_code = updateAdvertisingData();
         APP_ERROR_CHECK(err_code);
     }
 
@@ -415,30 +803,71 @@ namespace Bluetooth::Stack
     }
 
     void startAdvertising() {
-        ret_code_t err_code = ble_advertising_advdata_update(&advertisingModule, &advertisementPacket, &scanResponsePacket);
+        ret_code_t err_code = updateAdvertisingData();
         APP_ERROR_CHECK(err_code);
 
         err_code = ble_advertising_start(&advertisingModule, BLE_ADV_MODE_FAST);
-        APP_ERROR_CHECK(err_code);
+        checkAdvertisingError(err_code);
         NRF_LOG_INFO("Adv. with name=%s and deviceId=0x%x", SettingsManager::getSettings()->name, customServiceData.deviceId);
     }
 
     void disableAdvertisingOnDisconnect() {
         // Prevent device from advertising on disconnect.
+        advertiseOnDisconnect = false;
         ble_adv_modes_config_t config;
         advertising_config_get(&config);
-        config.ble_adv_on_disconnect_disabled = true;
         ble_advertising_modes_config_set(&advertisingModule, &config);
     }
 
     void enableAdvertisingOnDisconnect() {
         // Setup device to re-start advertising on disconnect.
+        advertiseOnDisconnect = true;
         ble_adv_modes_config_t config;
         advertising_config_get(&config);
-        config.ble_adv_on_disconnect_disabled = false;
         ble_advertising_modes_config_set(&advertisingModule, &config);
     }
 
+    /// <summary>
+    /// Gives the advertising module the current config, the interval and advertising type
+    /// only change when advertising starts so it is restarted if needed
+    /// </summary>
+    void applyAdvertisingConfig() {
+        ble_adv_modes_config_t config;
+        advertising_config_get(&config);
+        ble_advertising_modes_config_set(&advertisingModule, &config);
+
+        if (!connected && advertisingModule.adv_mode_current != BLE_ADV_MODE_IDLE) {
+            sd_ble_gap_adv_stop(advertisingModule.adv_handle);
+            ret_code_t err_code = ble_advertising_start(&advertisingModule, BLE_ADV_MODE_FAST);
+            checkAdvertisingError(err_code);
+        }
+    }
+
+    void setAdvertisingInterval(uint16_t intervalMs) {
+        const uint32_t interval = intervalMs == 0 ? APP_ADV_INTERVAL : MSEC_TO_UNITS(intervalMs, UNIT_0_625_MS);
+        if (interval == advertisingInterval) {
+            return;
+        }
+        advertisingInterval = interval;
+        applyAdvertisingConfig();
+    }
+
+    void setExtendedAdvertising(bool enable) {
+#if BLE_EXTENDED_ADVERTISING
+        if (enable != extendedAdvertising) {
+            checkAdvertisingError(changeAdvertisingType(enable));
+        }
+#else
+        if (enable) {
+            NRF_LOG_WARNING("Extended advertising not enabled in this build");
+        }
+#endif
+    }
+
+    bool isExtendedAdvertising() {
+        return extendedAdvertising;
+    }
+
     void resetOnDisconnect() {
         resetOnDisconnectPending = true;
     }
@@ -447,8 +876,21 @@ namespace Bluetooth::Stack
         sleepOnDisconnectPending = true;
     }
 
+    static uint8_t maxNotificationsInFlight(uint8_t queueSize) {
+        return linkConditions.maxInFlight != 0 && linkConditions.maxInFlight < queueSize ? linkConditions.maxInFlight : queueSize;
+    }
+
     SendResult send(uint16_t handle, const uint8_t* data, uint16_t len) {
         PowerManager::feed();
+        if (connected && linkConditions.maxInFlight != 0 && notificationsInFlight >= linkConditions.maxInFlight) {
+            return SendResult_Busy;
+        }
+        if (connected && linkConditions.lossPercent != 0 && DriversNRF::RNG::fastUInt32() % 100 < linkConditions.lossPercent) {
+            // Lost on the way, as far as the sender can tell
+            droppedNotificationCount++;
+            lastTrafficMs = DriversNRF::Timers::millis();
+            return SendResult_Ok;
+        }
         if (connected) {
             ble_gatts_hvx_params_t hvx_params;
             memset(&hvx_params, 0, sizeof(hvx_params));
@@ -459,6 +901,10 @@ namespace Bluetooth::Stack
             ret_code_t err_code = sd_ble_gatts_hvx(connectionHandle, &hvx_params);
             if (err_code == NRF_SUCCESS) {
                 // Message was sent!
+                CRITICAL_REGION_ENTER();
+                notificationsInFlight++;
+                CRITICAL_REGION_EXIT();
+                lastTrafficMs = DriversNRF::Timers::millis();
                 NRF_LOG_DEBUG("Send message type %d of size %d", data[0], len);
                 return SendResult_Ok;
             } else if (err_code == NRF_ERROR_BUSY || err_code == NRF_ERROR_RESOURCES) {
@@ -477,6 +923,67 @@ namespace Bluetooth::Stack
         }
     }
 
+    void notifyAll(uint16_t handle, const uint8_t* data, uint16_t len) {
+        ble_gatts_hvx_params_t hvx_params;
+        memset(&hvx_params, 0, sizeof(hvx_params));
+        hvx_params.handle = handle;
+        hvx_params.p_data = data;
+        hvx_params.type = BLE_GATT_HVX_NOTIFICATION;
+
+        // Fails quietly for the centrals that didn't enable notifications, or whose queue is full
+        if (connected) {
+            uint16_t hvxLen = len;
+            hvx_params.p_len = &hvxLen;
+            if (sd_ble_gatts_hvx(connectionHandle, &hvx_params) == NRF_SUCCESS) {
+                CRITICAL_REGION_ENTER();
+                notificationsInFlight++;
+                CRITICAL_REGION_EXIT();
+            }
+        }
+#if BLE_LISTENER_LINK_COUNT > 0
+        for (int i = 0; i < listenerCount; ++i) {
+            uint16_t hvxLen = len;
+            hvx_params.p_len = &hvxLen;
+            sd_ble_gatts_hvx(listenerHandles[i], &hvx_params);
+        }
+#endif
+    }
+
+    uint8_t getListenerCount() {
+#if BLE_LISTENER_LINK_COUNT > 0
+        return listenerCount;
+#else
+        return 0;
+#endif
+    }
+
+    bool canQueueNotification() {
+        return connected && notificationsInFlight < maxNotificationsInFlight(HVN_TX_QUEUE_SIZE);
+    }
+
+    bool canQueueBulkNotification() {
+        return connected && notificationsInFlight < maxNotificationsInFlight(HVN_TX_QUEUE_SIZE - HVN_TX_QUEUE_RESERVED);
+    }
+
+    void requestFastConnection(ConnectionUser user) {
+        fastConnectionUsers |= user;
+        Timers::stopTimer(relaxConnectionTimer);
+        requestConnectionParameters(true);
+    }
+
+    void releaseFastConnection(ConnectionUser user) {
+        if ((fastConnectionUsers & user) != 0) {
+            fastConnectionUsers &= ~user;
+            if (fastConnectionUsers == 0) {
+                Timers::startTimer(relaxConnectionTimer, FAST_CONNECTION_RELEASE_MS);
+            }
+        }
+    }
+
+    bool isRadioIdle() {
+        return !connected || (notificationsInFlight == 0 && DriversNRF::Timers::millis() - lastTrafficMs >= RADIO_IDLE_MS);
+    }
+
     void slowAdvertising() {
         ret_code_t err_code = ble_advertising_start(&advertisingModule, BLE_ADV_MODE_SLOW);
         APP_ERROR_CHECK(err_code);
@@ -492,6 +999,36 @@ namespace Bluetooth::Stack
         return connected;
     }
 
+    bool isMainLink(uint16_t connHandle) {
+        return connected && connHandle == connectionHandle;
+    }
+
+    uint16_t getMaxPayloadSize() {
+        const uint16_t ret = nrf_ble_gatt_eff_mtu_get(&nrfGatt, connectionHandle) - 3; // 3 bytes of ATT opcode and handle
+        return linkConditions.maxPayloadSize != 0 ? MIN(ret, linkConditions.maxPayloadSize) : ret;
+    }
+
+    void setLinkConditions(const LinkConditions& conditions) {
+        if (connected) {
+            linkConditions = conditions;
+            // The default MTU is always available
+            if (linkConditions.maxPayloadSize != 0) {
+                linkConditions.maxPayloadSize = MAX(linkConditions.maxPayloadSize, BLE_GATT_ATT_MTU_DEFAULT - 3);
+            }
+            linkConditions.lossPercent = MIN(linkConditions.lossPercent, 100);
+            droppedNotificationCount = 0;
+            NRF_LOG_INFO("Link conditions: payload %d, in flight %d, loss %d%%", linkConditions.maxPayloadSize, linkConditions.maxInFlight, linkConditions.lossPercent);
+        }
+    }
+
+    uint16_t getDroppedNotificationCount() {
+        return droppedNotificationCount;
+    }
+
+    const LinkInfo& getLinkInfo() {
+        return linkInfo;
+    }
+
     void hook(ConnectionEventMethod method, void* param) {
         if (!clients.Register(param, method)) {
             NRF_LOG_ERROR("Too many connection state hooks registered.");
@@ -506,8 +1043,39 @@ namespace Bluetooth::Stack
         clients.UnregisterWithToken(param);
     }
 
+    /// <summary>
+    /// Averages the SoftDevice samples, which come as often as every connection event,
+    /// and notifies the clients when the average moved enough
+    /// </summary>
+    void onRssiSample(int8_t rssi, uint8_t channelIndex) {
+        const bool first = rssiAverageTimes16 == 0;
+        if (first) {
+            rssiAverageTimes16 = rssi * 16;
+        } else {
+            rssiAverageTimes16 += (rssi * 16 - rssiAverageTimes16) >> RSSI_FILTER_SHIFT;
+        }
+        // Round to the nearest dBm (values are negative)
+        const int8_t filtered = (int8_t)((rssiAverageTimes16 - 8) / 16);
+        const uint32_t time = DriversNRF::Timers::millis();
+        const int delta = filtered > lastNotifiedRssi ? filtered - lastNotifiedRssi : lastNotifiedRssi - filtered;
+        if (first || (delta >= rssiFilterThreshold && time - lastRssiNotifyMs >= rssiFilterMinInterval)) {
+            lastNotifiedRssi = filtered;
+            lastRssiNotifyMs = time;
+            for (int i = 0; i < rssiClients.Count(); ++i) {
+                rssiClients[i].handler(rssiClients[i].token, filtered, channelIndex);
+            }
+        }
+    }
+
+    void setRssiFilter(uint8_t thresholdDbm, uint16_t minIntervalMs) {
+        rssiFilterThreshold = thresholdDbm;
+        rssiFilterMinInterval = minIntervalMs;
+    }
+
     void hookRssi(RssiEventMethod method, void* param) {
         if (rssiClients.Count() == 0) {
+            // Start averaging over again
+            rssiAverageTimes16 = 0;
             sd_ble_gap_rssi_start(connectionHandle, RSSI_THRESHOLD_DBM, 1); 
         }
         if (!rssiClients.Register(param, method)) {
@@ -522,4 +1090,14 @@ namespace Bluetooth::Stack
             sd_ble_gap_rssi_stop(connectionHandle);
         }
     }
+
+    void hookLinkInfo(LinkInfoEventMethod method, void* param) {
+        if (!linkInfoClients.Register(param, method)) {
+            NRF_LOG_ERROR("Too many link info hooks registered.");
+        }
+    }
+
+    void unHookLinkInfo(LinkInfoEventMethod method) {
+        linkInfoClients.UnregisterWithHandler(method);
+    }
 }
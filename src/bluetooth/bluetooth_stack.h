@@ -12,6 +12,7 @@ namespace Bluetooth::Stack
     void disableAdvertisingOnDisconnect();
     void enableAdvertisingOnDisconnect();
     bool isConnected();
+    bool isMainLink(uint16_t connHandle);
     void resetOnDisconnect();
     void sleepOnDisconnect();
 
@@ -25,7 +26,82 @@ namespace Bluetooth::Stack
     };
 
     SendResult send(uint16_t handle, const uint8_t* data, uint16_t len);
+
+    // Centrals that connect while the main one is connected are listeners (up to BLE_LISTENER_LINK_COUNT),
+    // they don't talk to the message service but get notified of the state characteristics.
+    // This notifies every central that enabled notifications for the characteristic, best effort.
+    void notifyAll(uint16_t handle, const uint8_t* data, uint16_t len);
+    uint8_t getListenerCount();
+
+    // Whether the SoftDevice notification queue has room for another notification
+    bool canQueueNotification();
+    // Same, but keeping slots free for urgent notifications
+    bool canQueueBulkNotification();
+
+    // Whether nothing went over the connection (either way) recently, long flash operations
+    // held off until then don't take radio time away from a transfer
+    bool isRadioIdle();
+
+    // Features that want short connection intervals while they run, the link goes back to
+    // long intervals with slave latency once none of them needs it
+    enum ConnectionUser : uint8_t
+    {
+        ConnectionUser_SendBulk     = 1 << 0,
+        ConnectionUser_ReceiveBulk  = 1 << 1,
+        ConnectionUser_Telemetry    = 1 << 2,
+        ConnectionUser_Benchmark    = 1 << 3,
+        ConnectionUser_Connecting   = 1 << 4,   // From the connection until the central asks WhoAreYou
+        ConnectionUser_Validation   = 1 << 5,   // For the whole connection, in validation mode
+    };
+
+    void requestFastConnection(ConnectionUser user);
+    void releaseFastConnection(ConnectionUser user);
+
+    // Largest notification payload for the current connection (negotiated MTU minus the ATT header)
+    uint16_t getMaxPayloadSize();
+
+    // For testing the protocols: makes the link worse than it is, as seen from the rest of the
+    // firmware. Zeroes leave a parameter as is, the conditions are cleared on disconnect.
+    struct LinkConditions
+    {
+        uint16_t maxPayloadSize;    // Caps getMaxPayloadSize(), as a smaller MTU would
+        uint8_t maxInFlight;        // Caps the notifications queued in the SoftDevice, as fewer packets per event would
+        uint8_t lossPercent;        // Notifications reported as sent but dropped
+    };
+
+    void setLinkConditions(const LinkConditions& conditions);
+    uint16_t getDroppedNotificationCount();
+
+    // What was negotiated with the central, the die asks for 2M PHY and
+    // long link layer packets after connecting
+    struct LinkInfo
+    {
+        uint16_t attMtu;
+        uint16_t dataLengthTx;          // Link layer payload, in bytes
+        uint16_t dataLengthRx;
+        uint8_t txPhy;                  // BLE_GAP_PHY_xxx
+        uint8_t rxPhy;
+        uint16_t connectionInterval;    // In units of 1.25 ms
+        uint16_t slaveLatency;
+        uint16_t supervisionTimeout;    // In units of 10 ms
+    };
+
+    const LinkInfo& getLinkInfo();
+
+    typedef void(*LinkInfoEventMethod)(void* param, const LinkInfo& info);
+    void hookLinkInfo(LinkInfoEventMethod method, void* param);
+    void unHookLinkInfo(LinkInfoEventMethod client);
+
     void slowAdvertising();
+
+    // Advertising interval in ms, 0 for the default one, advertising restarts if needed
+    void setAdvertisingInterval(uint16_t intervalMs);
+
+    // One BLE 5 extended advertising set, with room for more custom data, in place of the legacy
+    // advertising packet and scan response. Only centrals that scan for extended advertising see it.
+    // Does nothing if the SoftDevice doesn't support it.
+    void setExtendedAdvertising(bool enable);
+    bool isExtendedAdvertising();
     void stopAdvertising();
 
     typedef void(*ConnectionEventMethod)(void* param, bool connected);
@@ -36,4 +112,8 @@ namespace Bluetooth::Stack
     typedef void(*RssiEventMethod)(void* param, int8_t rssi, uint8_t channelIndex);
     void hookRssi(RssiEventMethod method, void* param);
     void unHookRssi(RssiEventMethod client);
+
+    // RSSI clients get an average of the samples, only when it changed by at least
+    // the threshold and no more often than the interval (0 for either to get every sample)
+    void setRssiFilter(uint8_t thresholdDbm, uint16_t minIntervalMs);
 }
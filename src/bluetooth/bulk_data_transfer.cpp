@@ -1,14 +1,19 @@
 #include "bulk_data_transfer.h"
 #include "bluetooth_messages.h"
 #include "bluetooth_message_service.h"
+#include "bluetooth_stack.h"
 #include "drivers_nrf/timers.h"
-#include "malloc.h"
+#include "utils/heap.h"
 #include "drivers_nrf/flash.h"
+#include "utils/Utils.h"
 
 #define RETRY_MS (10000) // ms
 #define TIMEOUT_MS (3000) // ms
-#define BLOCK_SIZE (MAX_DATA_SIZE)
+#define LEGACY_BLOCK_SIZE (MAX_DATA_SIZE)
+#define BULK_DATA_HEADER_SIZE (sizeof(MessageBulkData) - MAX_BULK_DATA_SIZE)
 #define MAX_RETRY_COUNT (5)
+#define BULK_DATA_SEND_WINDOW_MAX (4) // Chunks in flight when sending, limited by the bulk send queue
+#define FLASH_WRITE_BUFFER_SIZE (256) // Received data is written to flash in blocks of this size
 
 using namespace DriversNRF;
 
@@ -29,9 +34,15 @@ namespace Bluetooth
         };
 
         State currentState;
-        uint16_t currentOffset;
+        uint16_t currentOffset; // First chunk not acknowledged yet
+        uint16_t nextOffset;    // Next chunk to send
+        uint8_t windowSize;     // Number of chunks that can be sent ahead of the acks
+        uint8_t blockSize;      // Data bytes per chunk
+        uint8_t mtuBlockSize;   // Data bytes per chunk at the current MTU, reported in the setup message
+        bool variableLength;    // Legacy centrals expect full size messages
 
         int retryCount;
+        uint16_t queueFullCount;
         sendResultCallback callback;
         void* context;
 
@@ -45,20 +56,117 @@ namespace Bluetooth
             // Then send the message
             MessageBulkSetup setupMsg;
             setupMsg.size = size;
+            setupMsg.chunkSize = mtuBlockSize;
             MessageService::SendMessage(&setupMsg);
         }
 
-        void sendCurrentChunk() {
-            NRF_LOG_DEBUG("Sending Chunk (offset: %d)", currentOffset);
+        /// <summary>
+        /// Sends the chunk at the given offset, returns false if it couldn't be queued
+        /// </summary>
+        bool sendChunk(uint16_t offset) {
+            NRF_LOG_DEBUG("Sending Chunk (offset: %d)", offset);
+
+            const uint8_t dataSize = MIN(size - offset, blockSize);
+            const uint16_t msgSize = BULK_DATA_HEADER_SIZE + (variableLength ? dataSize : LEGACY_BLOCK_SIZE);
+
+            // Build the data chunk straight in the send queue if possible
+            auto dataMsg = MessageService::ReserveMessage<MessageBulkData>(MessageService::Lane_Bulk);
+            if (dataMsg != nullptr) {
+                dataMsg->size = dataSize;
+                dataMsg->offset = offset;
+                memcpy(dataMsg->data, &data[offset], dataSize);
+                return MessageService::CommitMessage(msgSize);
+            } else {
+                MessageBulkData stackMsg;
+                stackMsg.size = dataSize;
+                stackMsg.offset = offset;
+                memcpy(stackMsg.data, &data[offset], dataSize);
+                return MessageService::SendMessage(&stackMsg, msgSize);
+            }
+        }
+
+        /// <summary>
+        /// Sends as many chunks as the window allows
+        /// </summary>
+        void sendWindow() {
             // Start the timeout timer before anything else
             Timers::startTimer(timeoutTimer, RETRY_MS);
 
-            // Then send the data chunk
-            MessageBulkData dataMsg;
-            dataMsg.size = MIN(size - currentOffset, BLOCK_SIZE);
-            dataMsg.offset = currentOffset;
-            memcpy(dataMsg.data, &data[currentOffset], dataMsg.size);
-            MessageService::SendMessage(&dataMsg);
+            const uint32_t windowEnd = MIN((uint32_t)currentOffset + windowSize * blockSize, size);
+            while (nextOffset < windowEnd) {
+                if (!sendChunk(nextOffset)) {
+                    queueFullCount++;
+                    break;
+                }
+                nextOffset += blockSize;
+            }
+            // If a chunk couldn't be queued, the next ack (or the timeout) sends it
+        }
+
+        /// <summary>
+        /// Starts sending chunks once the setup is acknowledged, theWindowSize is 0 for legacy centrals
+        /// </summary>
+        void startSendingData(uint8_t theWindowSize) {
+            // Cancel the timer first
+            Timers::stopTimer(timeoutTimer);
+
+            // Stop listening for acks
+            MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupAck);
+            MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupWindowAck);
+
+            windowSize = MAX(1, MIN(theWindowSize, BULK_DATA_SEND_WINDOW_MAX));
+
+            // Centrals that ack with a window also take MTU sized, variable length chunks
+            variableLength = theWindowSize > 0;
+            blockSize = variableLength ? mtuBlockSize : LEGACY_BLOCK_SIZE;
+            NRF_LOG_DEBUG("Sending with a window of %d chunk(s) of %d bytes", windowSize, blockSize);
+
+            // Start sending data, wait for timeout or ack
+            Timers::createTimer(&timeoutTimer, APP_TIMER_MODE_SINGLE_SHOT, [](void* context) {
+                if (currentState == State_WaitingForDataAck) {
+                    retryCount++;
+                    if (retryCount >= MAX_RETRY_COUNT) {
+                        // Fail!
+                        currentState = State_Done;
+                        MessageService::UnregisterMessageHandler(Message::MessageType_BulkDataAck);
+                        Stack::releaseFastConnection(Stack::ConnectionUser_SendBulk);
+                        callback(context, false, data, size);
+                    } else {
+                        // Try again from the first chunk that wasn't acknowledged
+                        nextOffset = currentOffset;
+                        sendWindow();
+                    }
+                }
+            });
+
+            // We register for a response first to be sure and not miss the ack
+            MessageService::RegisterMessageHandler(Message::MessageType_BulkDataAck, [](const Message* message) {
+                auto ack = (MessageBulkDataAck*)message;
+                NRF_LOG_DEBUG("Received Ack for Chunk (offset: %d)", ack->offset);
+
+                // The ack covers all the chunks up to its offset
+                if (ack->offset >= currentOffset && ack->offset < nextOffset)
+                {
+                    // Cancel the timer first
+                    Timers::stopTimer(timeoutTimer);
+
+                    if (ack->offset + blockSize < size) {
+                        // Good, move the window forward
+                        currentOffset = ack->offset + blockSize;
+                        sendWindow();
+                    } else {
+                        // Done!
+                        currentState = State_Done;
+                        MessageService::UnregisterMessageHandler(Message::MessageType_BulkDataAck);
+                        Stack::releaseFastConnection(Stack::ConnectionUser_SendBulk);
+                        callback(context, true, data, size);
+                    }
+                }
+                // Else ignore this ack, we've probably already gotten it!
+            });
+
+            currentState = State_WaitingForDataAck;
+            sendWindow();
         }
 
         /// <summary>
@@ -69,12 +177,21 @@ namespace Bluetooth
             data = theData;
             size = theSize;
             currentOffset = 0;
+            nextOffset = 0;
+            windowSize = 1;
+            blockSize = LEGACY_BLOCK_SIZE;
+            mtuBlockSize = MIN(Stack::getMaxPayloadSize() - BULK_DATA_HEADER_SIZE, MAX_BULK_DATA_SIZE);
+            variableLength = false;
             retryCount = 0;
+            queueFullCount = 0;
             callback = theCallback;
             context = theContext;
 
             currentState = State_Init;
 
+            // Short connection intervals until the transfer is over
+            Stack::requestFastConnection(Stack::ConnectionUser_SendBulk);
+
             // Send setup message, and wait for setup ack, or timeout
             Timers::createTimer(&timeoutTimer, APP_TIMER_MODE_SINGLE_SHOT, [](void* context) {
                 if (currentState == State_WaitingForSetupAck) {
@@ -83,6 +200,8 @@ namespace Bluetooth
                         // Fail!
                         currentState = State_Done;
                         MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupAck);
+                        MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupWindowAck);
+                        Stack::releaseFastConnection(Stack::ConnectionUser_SendBulk);
                         callback(context, false, data, size);
                     } else {
                         // Try again...
@@ -92,58 +211,19 @@ namespace Bluetooth
                 // Else ignore
                 });
 
-            // We register for a response first to be sure and not miss the ack
+            // We register for a response first to be sure and not miss the ack,
+            // older centrals only know the plain ack and get one chunk at a time
             MessageService::RegisterMessageHandler(Message::MessageType_BulkSetupAck, [](const Message* message) {
                 NRF_LOG_DEBUG("Received Ack for Setup");
                 if (currentState == State_WaitingForSetupAck) {
-                    // Cancel the timer first
-                    Timers::stopTimer(timeoutTimer);
-
-                    // Stop listening for ack
-                    MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupAck);
-
-                    // Start sending data, wait for timeout or ack
-                    Timers::createTimer(&timeoutTimer, APP_TIMER_MODE_SINGLE_SHOT, [](void* context) {
-                        if (currentState == State_WaitingForDataAck) {
-                            retryCount++;
-                            if (retryCount >= MAX_RETRY_COUNT) {
-                                // Fail!
-                                currentState = State_Done;
-                                MessageService::UnregisterMessageHandler(Message::MessageType_BulkDataAck);
-                                callback(context, false, data, size);
-                            } else {
-                                // Try again
-                                sendCurrentChunk();
-                            }
-                        }
-                    });
-
-                    // We register for a response first to be sure and not miss the ack
-                    MessageService::RegisterMessageHandler(Message::MessageType_BulkDataAck, [](const Message* message) {
-                        auto ack = (MessageBulkDataAck*)message;
-                        NRF_LOG_DEBUG("Received Ack for Chunk (offset: %d)", ack->offset);
-
-                        if (ack->offset == currentOffset)
-                        {
-                            // Cancel the timer first
-                            Timers::stopTimer(timeoutTimer);
-
-                            if (currentOffset + BLOCK_SIZE < size) {
-                                // Good, move onto the next chunk
-                                currentOffset += BLOCK_SIZE;
-                                sendCurrentChunk();
-                            } else {
-                                // Done!
-                                currentState = State_Done;
-                                MessageService::UnregisterMessageHandler(Message::MessageType_BulkDataAck);
-                                callback(context, true, data, size);
-                            }
-                        }
-                        // Else ignore this ack, we've probably already gotten it!
-                    });
-
-                    currentState = State_WaitingForDataAck;
-                    sendCurrentChunk();
+                    startSendingData(0);
+                }
+                // Else ignore this ack, we've probably already gotten it!
+            });
+            MessageService::RegisterMessageHandler(Message::MessageType_BulkSetupWindowAck, [](const Message* message) {
+                NRF_LOG_DEBUG("Received Window Ack for Setup");
+                if (currentState == State_WaitingForSetupAck) {
+                    startSendingData(((const MessageBulkSetupWindowAck*)message)->windowSize);
                 }
                 // Else ignore this ack, we've probably already gotten it!
             });
@@ -152,6 +232,15 @@ namespace Bluetooth
             sendSetupMessage();
         }
 
+        Stats getStats() {
+            Stats ret;
+            ret.retries = retryCount;
+            ret.queueFullCount = queueFullCount;
+            ret.windowSize = windowSize;
+            ret.blockSize = blockSize;
+            return ret;
+        }
+
         #if DICE_SELFTEST && BULK_DATA_TRANSFER_SELFTEST
         uint8_t* testData = nullptr;
 
@@ -161,13 +250,13 @@ namespace Bluetooth
             } else {
                 NRF_LOG_INFO("Failed");
             }
-            free(testData);
+            Utils::Heap::free(testData);
             MessageService::UnregisterMessageHandler(Message::MessageType_TestBulkSend);
         }
 
         void testBulkSend(void* token, const Message* msg) {
             NRF_LOG_INFO("Received Message to send Bulk Data");
-            uint8_t* testData = (uint8_t*)malloc(256);
+            uint8_t* testData = (uint8_t*)Utils::Heap::alloc(256, Utils::Heap::HeapTag_Bluetooth);
             for (int i = 0; i < 256; ++i) {
                 testData[i] = i;
             }
@@ -188,6 +277,7 @@ namespace Bluetooth
         // The buffer we want to send over and its size
         uint8_t* data;
         uint32_t flashAddress;
+        uint32_t flashSize;     // Erased bytes at flashAddress
         uint16_t size;
 
         enum State
@@ -199,7 +289,7 @@ namespace Bluetooth
         };
 
         State currentState;
-        uint16_t currentOffset;
+        uint16_t currentOffset; // Next chunk expected, everything before it has been received
 
         int retryCount;
         receiveAllocator allocator;
@@ -207,9 +297,44 @@ namespace Bluetooth
         receiveToFlashResultCallback flashCallback;
         void* context;
 
-        #pragma pack(push, 4)
-        uint8_t dataBuffer[132] __attribute__ ((aligned (4))); // data is 100 bytes so this should be enough
-        #pragma pack(pop)
+        // Received chunks waiting to be decoded (or just copied when not compressed)
+        struct ChunkBuffer
+        {
+            uint8_t data[MAX_BULK_DATA_SIZE];
+            uint16_t offset;
+            uint8_t size;
+        };
+        ChunkBuffer chunkBuffers[BULK_DATA_RECEIVE_WINDOW];
+
+        // When receiving to flash the data is collected in these buffers and written one at a time,
+        // so chunks are acked as soon as they are buffered and one buffer fills while the other is written.
+        // Compressed transfers (see Utils::lz77_compress) are decoded on the way in.
+        struct WriteBuffer
+        {
+            uint8_t data[FLASH_WRITE_BUFFER_SIZE] __attribute__ ((aligned (4)));
+            uint16_t start;     // Offset of the first byte in the decoded data
+            uint16_t fill;
+        };
+        WriteBuffer writeBuffers[2];
+        int fillingBuffer;
+        int programmingBuffer; // -1 if none
+
+        bool compressed;
+        uint16_t decodedSize;   // Expected size of the decoded data
+        uint16_t decodedOffset; // Bytes decoded so far
+        uint8_t token[4];       // Stream header (decoded size), then pointer and literal triplets
+        uint8_t tokenFill;
+        bool headerDecoded;
+        uint16_t copyDistance;
+        uint8_t copyLeft;
+        uint8_t literal;
+        bool literalPending;
+        int inputHead;          // Chunk being decoded
+        int inputCount;         // Chunks waiting to be decoded
+        uint8_t inputPos;       // Next byte in the chunk being decoded
+        uint16_t decodedInputOffset; // Compressed bytes fully decoded (and acked)
+        bool finishing;
+        uint32_t hash;          // Of the data received (decoded) so far
 
         APP_TIMER_DEF(timeoutTimer);
 
@@ -231,6 +356,282 @@ namespace Bluetooth
             MessageService::SendMessage(&ackMsg);
         }
 
+        /// <summary>
+        /// Ends the transfer, successful or not
+        /// </summary>
+        void finish(bool result) {
+            currentState = State_Done;
+            Stack::releaseFastConnection(Stack::ConnectionUser_ReceiveBulk);
+            MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
+            if (result && compressed && data != nullptr) {
+                // Decoded in place, back references make it simpler to hash it all at the end
+                hash = Utils::updateHash(HASH_SEED, data, decodedSize);
+            }
+            if (data != nullptr || flashCallback == nullptr) {
+                if (callback != nullptr) {
+                    callback(context, result, result ? data : nullptr, result ? decodedSize : 0);
+                }
+            } else {
+                flashCallback(context, result, flashAddress, result ? decodedSize : 0);
+            }
+        }
+
+        void resetDecoder(uint16_t theDecodedSize) {
+            decodedSize = theDecodedSize;
+            decodedOffset = 0;
+            tokenFill = 0;
+            headerDecoded = false;
+            copyLeft = 0;
+            literalPending = false;
+            inputHead = 0;
+            inputCount = 0;
+            inputPos = 0;
+            decodedInputOffset = 0;
+            finishing = false;
+            fillingBuffer = 0;
+            programmingBuffer = -1;
+            writeBuffers[0].start = 0;
+            writeBuffers[0].fill = 0;
+            hash = HASH_SEED;
+        }
+
+        void onWriteBufferWritten(void* ctx, bool result, uint32_t address, uint16_t s);
+        void decode();
+
+        /// <summary>
+        /// Starts writing the buffer being filled and switches over to the other one
+        /// </summary>
+        void flushWriteBuffer() {
+            auto& buffer = writeBuffers[fillingBuffer];
+            NRF_LOG_DEBUG("Writing decoded data to flash at 0x%08x", flashAddress + buffer.start);
+            programmingBuffer = fillingBuffer;
+            fillingBuffer = 1 - fillingBuffer;
+            writeBuffers[fillingBuffer].start = buffer.start + buffer.fill;
+            writeBuffers[fillingBuffer].fill = 0;
+            hash = Utils::updateHash(hash, buffer.data, buffer.fill);
+            Flash::write(nullptr, flashAddress + buffer.start, buffer.data, Utils::roundUpTo4(buffer.fill), onWriteBufferWritten, Flash::Priority_High);
+        }
+
+        void onWriteBufferWritten(void* ctx, bool result, uint32_t address, uint16_t s) {
+            programmingBuffer = -1;
+            if (!result) {
+                NRF_LOG_ERROR("Error writing decoded data at 0x%08x", address);
+                finish(false);
+            } else if (finishing) {
+                if (writeBuffers[fillingBuffer].fill > 0) {
+                    flushWriteBuffer();
+                } else {
+                    NRF_LOG_DEBUG("Done!");
+                    finish(true);
+                }
+            } else {
+                // Resume decoding
+                decode();
+            }
+        }
+
+        /// <summary>
+        /// Returns whether a decoded byte can be output, flushing the full buffer if possible
+        /// </summary>
+        bool canOutput() {
+            if (data != nullptr || writeBuffers[fillingBuffer].fill < FLASH_WRITE_BUFFER_SIZE) {
+                return true;
+            } else if (programmingBuffer < 0) {
+                flushWriteBuffer();
+                return true;
+            } else {
+                return false;
+            }
+        }
+
+        void output(uint8_t byte) {
+            if (data != nullptr) {
+                data[decodedOffset] = byte;
+            } else {
+                auto& buffer = writeBuffers[fillingBuffer];
+                buffer.data[buffer.fill++] = byte;
+            }
+            decodedOffset++;
+        }
+
+        /// <summary>
+        /// Returns an already decoded byte, from RAM or flash depending on where it is by now
+        /// </summary>
+        uint8_t decodedByteAt(uint16_t offset) {
+            if (data != nullptr) {
+                return data[offset];
+            }
+            for (int i = 0; i < 2; ++i) {
+                auto& buffer = writeBuffers[i];
+                if ((i == fillingBuffer || i == programmingBuffer) && offset >= buffer.start && offset < buffer.start + buffer.fill) {
+                    return buffer.data[offset - buffer.start];
+                }
+            }
+            return *(const uint8_t*)(flashAddress + offset);
+        }
+
+        /// <summary>
+        /// Decodes the received chunks until they are all used or the write buffers are full,
+        /// in which case decoding resumes once a buffer is written
+        /// </summary>
+        void decode() {
+            while (currentState == State_WaitingForData) {
+                if (copyLeft > 0 || literalPending) {
+                    // Output the current triplet first
+                    if (!canOutput()) {
+                        return;
+                    }
+                    if (copyLeft > 0) {
+                        output(decodedByteAt(decodedOffset - copyDistance));
+                        copyLeft--;
+                    } else {
+                        output(literal);
+                        literalPending = false;
+                    }
+                    if (decodedOffset >= decodedSize) {
+                        // The last triplet may carry more than needed
+                        copyLeft = 0;
+                        literalPending = false;
+                    }
+                } else if (inputCount > 0) {
+                    // Read the next byte of the stream
+                    auto& chunk = chunkBuffers[inputHead];
+                    uint8_t byte = chunk.data[inputPos++];
+                    if (inputPos >= chunk.size) {
+                        // Done with this chunk
+                        decodedInputOffset = chunk.offset + chunk.size;
+                        sendBulkAckMessage(chunk.offset);
+                        inputHead = (inputHead + 1) % BULK_DATA_RECEIVE_WINDOW;
+                        inputCount--;
+                        inputPos = 0;
+                    }
+                    if (!compressed) {
+                        // Plain data, copied as is (the chunks can't go past the announced size)
+                        literal = byte;
+                        literalPending = true;
+                        continue;
+                    }
+                    token[tokenFill++] = byte;
+                    if (!headerDecoded) {
+                        if (tokenFill == 4) {
+                            uint32_t streamSize = token[0] | (token[1] << 8) | (token[2] << 16) | (token[3] << 24);
+                            if (streamSize != decodedSize) {
+                                NRF_LOG_ERROR("Unexpected decoded size %d, should be %d", streamSize, decodedSize);
+                                finish(false);
+                                return;
+                            }
+                            headerDecoded = true;
+                            tokenFill = 0;
+                        }
+                    } else if (tokenFill == 3) {
+                        uint16_t pointer = token[0] | (token[1] << 8);
+                        copyDistance = pointer >> 4;
+                        if (copyDistance > decodedOffset || decodedOffset >= decodedSize) {
+                            // Back reference before the start, or more data than announced
+                            NRF_LOG_ERROR("Bad compressed stream at 0x%04x", decodedOffset);
+                            finish(false);
+                            return;
+                        }
+                        copyLeft = copyDistance != 0 ? MIN(pointer & 15, decodedSize - decodedOffset) : 0;
+                        literal = token[2];
+                        literalPending = true;
+                        tokenFill = 0;
+                    }
+                } else {
+                    break;
+                }
+            }
+
+            if (currentState == State_WaitingForData && currentOffset >= size && inputCount == 0) {
+                // The whole stream was decoded
+                if (decodedOffset != decodedSize) {
+                    NRF_LOG_ERROR("Stream too short, %d bytes instead of %d", decodedOffset, decodedSize);
+                    finish(false);
+                } else if (data != nullptr) {
+                    finish(true);
+                } else if (!finishing) {
+                    finishing = true;
+                    if (programmingBuffer < 0) {
+                        // Otherwise the last buffer is written once the other one is done
+                        if (writeBuffers[fillingBuffer].fill > 0) {
+                            flushWriteBuffer();
+                        } else {
+                            finish(true);
+                        }
+                    }
+                }
+            }
+        }
+
+        /// <summary>
+        /// Queues a chunk and decodes (or copies) what can be
+        /// </summary>
+        void receiveChunk(const Message* message) {
+            auto msg = (const MessageBulkData*)message;
+            // Cancel the timer first
+            Timers::stopTimer(timeoutTimer);
+
+            NRF_LOG_DEBUG("Received Bulk Data (offset: 0x%04x, length: %d)", msg->offset, msg->size);
+            if (msg->offset + msg->size <= decodedInputOffset) {
+                // Already decoded, the ack was probably lost
+                sendBulkAckMessage(msg->offset);
+                return;
+            }
+            if (msg->offset != currentOffset || msg->offset + msg->size > size || msg->size == 0 || msg->size > MAX_BULK_DATA_SIZE) {
+                // Either a chunk was lost or this one is still being decoded,
+                // the central resends from the last ack
+                NRF_LOG_WARNING("Unexpected chunk (offset: 0x%04x, expected: 0x%04x)", msg->offset, currentOffset);
+                return;
+            }
+            if (inputCount >= BULK_DATA_RECEIVE_WINDOW) {
+                // The central sent more than the window allows
+                NRF_LOG_WARNING("No buffer for chunk (offset: 0x%04x)", msg->offset);
+                return;
+            }
+
+            auto& chunk = chunkBuffers[(inputHead + inputCount) % BULK_DATA_RECEIVE_WINDOW];
+            memcpy(chunk.data, msg->data, msg->size);
+            chunk.offset = msg->offset;
+            chunk.size = msg->size;
+            inputCount++;
+            currentOffset += msg->size;
+
+            decode();
+        }
+
+        /// <summary>
+        /// Handles the setup message of a compressed transfer
+        /// Returns false if the memory couldn't be allocated
+        /// </summary>
+        bool setupCompressed(const MessageBulkSetupCompressed* msg) {
+            size = msg->size;
+            compressed = true;
+            resetDecoder(msg->decodedSize);
+            NRF_LOG_INFO("Compressed transfer size: 0x%04x, decoded: 0x%04x", size, decodedSize);
+            if (flashCallback == nullptr) {
+                data = allocator(context, decodedSize);
+                return data != nullptr;
+            } else if (decodedSize > flashSize) {
+                NRF_LOG_ERROR("Decoded size 0x%04x larger than flash area 0x%04x", decodedSize, flashSize);
+                return false;
+            }
+            return true;
+        }
+
+        void onSetupTimeout(void* c) {
+            if (currentState == State_WaitingForData) {
+                retryCount++;
+                if (retryCount >= MAX_RETRY_COUNT) {
+                    // Fail!
+                    NRF_LOG_WARNING("Timeout waiting for next data message");
+                    finish(false);
+                } else {
+                    // Try again...
+                    sendSetupAckMessage();
+                }
+            }
+            // Else ignore
+        }
 
         /// <summary>
         /// Bulk data transfer
@@ -239,19 +640,28 @@ namespace Bluetooth
         {
             data = nullptr;
             size = 0;
+            currentOffset = 0;
             retryCount = 0;
             allocator = theAllocator;
             callback = theCallback;
+            flashCallback = nullptr;
             context = theContext;
+            compressed = false;
+            hash = HASH_SEED;
 
             currentState = State_Init;
 
+            // Short connection intervals until the transfer is over
+            Stack::requestFastConnection(Stack::ConnectionUser_ReceiveBulk);
+
             // Wait for the setup message, or timeout
             Timers::createTimer(&timeoutTimer, APP_TIMER_MODE_SINGLE_SHOT, [](void* context) {
                 if (currentState == State_Init) {
                     // Fail!
                     currentState = State_Done;
                     MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetup);
+                    MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupCompressed);
+                    Stack::releaseFastConnection(Stack::ConnectionUser_ReceiveBulk);
                     callback(context, false, nullptr, 0);
                 }
                 // Else ignore
@@ -267,6 +677,7 @@ namespace Bluetooth
 
                     // Stop listening for setup
                     MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetup);
+                    MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupCompressed);
 
                     // Allocate memory for the data
                     auto msg = (const MessageBulkSetup*)message;
@@ -275,6 +686,7 @@ namespace Bluetooth
                     if (data == nullptr) {
                         // Not enough memory
                         currentState = State_Done;
+                        Stack::releaseFastConnection(Stack::ConnectionUser_ReceiveBulk);
                         callback(context, false, nullptr, 0);
                         return;
                     }
@@ -289,6 +701,7 @@ namespace Bluetooth
                                 // Fail!
                                 currentState = State_Done;
                                 MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
+                                Stack::releaseFastConnection(Stack::ConnectionUser_ReceiveBulk);
                                 callback(context, false, nullptr, 0);
                             } else {
                                 // Try again...
@@ -303,15 +716,27 @@ namespace Bluetooth
                         // Cancel the timer first
                         Timers::stopTimer(timeoutTimer);
 
-                        // Copy the data
                         auto msg = (const MessageBulkData*)message;
-                        memcpy(&data[msg->offset], msg->data, msg->size);
+                        if (msg->offset > currentOffset || msg->offset + msg->size > size || msg->size > MAX_BULK_DATA_SIZE) {
+                            // A chunk was lost, drop this one too, the central resends from the last ack
+                            NRF_LOG_WARNING("Unexpected chunk (offset: 0x%04x, expected: 0x%04x)", msg->offset, currentOffset);
+                            return;
+                        }
+
+                        if (msg->offset == currentOffset) {
+                            // Copy the data
+                            memcpy(&data[msg->offset], msg->data, msg->size);
+                            hash = Utils::updateHash(hash, &data[msg->offset], msg->size);
+                            currentOffset += msg->size;
 
-                        if (msg->offset + msg->size >= size) {
-                            // Done
-                            MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
-                            callback(context, true, data, size);
+                            if (currentOffset >= size) {
+                                // Done
+                                MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
+                                Stack::releaseFastConnection(Stack::ConnectionUser_ReceiveBulk);
+                                callback(context, true, data, size);
+                            }
                         }
+                        // Else we already have it, the ack was probably lost
 
                         // And send an ack!
                         sendBulkAckMessage(msg->offset);
@@ -323,67 +748,62 @@ namespace Bluetooth
                 // Else ignore this setup, we've probably already gotten it!
             });
 
-            currentState = State_WaitingForSetup;
-        }
-
-        void receiveChunk(const Message* message) {
-            auto msg = (const MessageBulkData*)message;
-            // Cancel the timer first
-            Timers::stopTimer(timeoutTimer);
-
-            // Ignore further messaged until we've programmed flash
-            MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
-
-            // Program the data
-            NRF_LOG_DEBUG("Received Bulk Data (offset: 0x%04x, length: %d)", msg->offset, msg->size);
-
-            // Copy the data to properly aligned buffer
-            memcpy(dataBuffer, msg->data, msg->size);
-            NRF_LOG_DEBUG("Writing data to flash at 0x%08x", flashAddress + msg->offset);
-            //NRF_LOG_HEXDUMP_INFO(dataBuffer, msg->size);
-
-            // Round up the size of the data to write, which should be okay because the
-            // temporary buffer is large enough
-            uint32_t flashWriteSize = 4 * ((msg->size + 3) / 4);
-
-            // Go ahead
-            Flash::write(nullptr, flashAddress + msg->offset, dataBuffer, flashWriteSize,
-                [](void* context, bool result, uint32_t address, uint16_t s) {
+            // Same with compressed data, decoded straight into the allocated memory
+            MessageService::RegisterMessageHandler(Message::MessageType_BulkSetupCompressed, [](const Message* message) {
+                NRF_LOG_INFO("Received Compressed Bulk Setup");
+                if (currentState == State_WaitingForSetup) {
+                    Timers::stopTimer(timeoutTimer);
+                    MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetup);
+                    MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupCompressed);
 
-                    uint16_t offset = (uint16_t)(address - flashAddress);
-                    if (offset + s < size) {
-                        // Be ready to receive the next message
-                        MessageService::RegisterMessageHandler(Message::MessageType_BulkData, receiveChunk);
+                    if (!setupCompressed((const MessageBulkSetupCompressed*)message)) {
+                        // Not enough memory
+                        currentState = State_Done;
+                        Stack::releaseFastConnection(Stack::ConnectionUser_ReceiveBulk);
+                        callback(context, false, nullptr, 0);
+                        return;
                     }
 
-                    // And send an ack!
-                    sendBulkAckMessage(offset);
-
-                    // Are we done?
-                    if (offset + s >= size) {
-                        // Done
-                        NRF_LOG_DEBUG("Done!")
-                        if (flashCallback != nullptr) {
-                            flashCallback(context, true, flashAddress, size);
-                        }
-                    }
+                    currentState = State_WaitingForData;
+                    Timers::createTimer(&timeoutTimer, APP_TIMER_MODE_SINGLE_SHOT, onSetupTimeout);
+                    MessageService::RegisterMessageHandler(Message::MessageType_BulkData, receiveChunk);
+                    sendSetupAckMessage();
                 }
-            );
+            });
+
+            currentState = State_WaitingForSetup;
+        }
+
+        /// <summary>
+        /// Fails a transfer to flash whose setup was rejected
+        /// </summary>
+        void finishFlashSetup() {
+            currentState = State_Done;
+            Stack::releaseFastConnection(Stack::ConnectionUser_ReceiveBulk);
+            flashCallback(context, false, flashAddress, 0);
         }
 
         /// <summary>
-        /// Bulk data transfer directly to flash, note that the flash area must already be erased
+        /// Bulk data transfer directly to flash, note that the flash area must already be erased,
+        /// transfers larger than flashSize are rejected
         /// </summary>
-        void receiveToFlash(uint32_t theFlashAddress, void* theContext, receiveToFlashResultCallback theCallback)
+        void receiveToFlash(uint32_t theFlashAddress, uint32_t theFlashSize, void* theContext, receiveToFlashResultCallback theCallback)
         {
             flashAddress = theFlashAddress;
+            flashSize = theFlashSize;
+            data = nullptr;
             size = 0;
+            currentOffset = 0;
+            compressed = false;
             retryCount = 0;
             flashCallback = theCallback;
             context = theContext;
 
             currentState = State_Init;
 
+            // Short connection intervals until the transfer is over
+            Stack::requestFastConnection(Stack::ConnectionUser_ReceiveBulk);
+
             // Wait for the setup message, or timeout
             Timers::createTimer(&timeoutTimer, APP_TIMER_MODE_SINGLE_SHOT,
                 [](void* c) {
@@ -392,6 +812,8 @@ namespace Bluetooth
                         NRF_LOG_WARNING("Timeout waiting for setup message");
                         currentState = State_Done;
                         MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetup);
+                        MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupCompressed);
+                        Stack::releaseFastConnection(Stack::ConnectionUser_ReceiveBulk);
                         flashCallback(context, false, flashAddress, 0);
                     }
                     // Else ignore
@@ -409,32 +831,22 @@ namespace Bluetooth
 
                         // Stop listening for setup
                         MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetup);
+                        MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupCompressed);
 
                         auto msg = (const MessageBulkSetup*)message;
                         size = msg->size;
+                        compressed = false;
+                        resetDecoder(size);
                         NRF_LOG_INFO("Transfer size: 0x%04x", size);
+                        if (size > flashSize) {
+                            NRF_LOG_ERROR("Transfer size larger than flash area 0x%04x", flashSize);
+                            finishFlashSetup();
+                            return;
+                        }
                         currentState = State_WaitingForData;
 
                         // Send Ack, and wait for data to come in, or timeout!
-                        Timers::createTimer(&timeoutTimer, APP_TIMER_MODE_SINGLE_SHOT,
-                            [](void* c) {
-                                if (currentState == State_WaitingForData) {
-                                    retryCount++;
-                                    if (retryCount >= MAX_RETRY_COUNT) {
-                                        // Fail!
-                                        NRF_LOG_WARNING("Timeout waiting for next data message");
-                                        currentState = State_Done;
-                                        MessageService::UnregisterMessageHandler(Message::MessageType_BulkData);
-                                        flashCallback(context, false, flashAddress, 0);
-                                    } else {
-                                        // Try again...
-                                        sendSetupAckMessage();
-                                    }
-                                }
-                                // Else ignore
-                            }
-                        );
-
+                        Timers::createTimer(&timeoutTimer, APP_TIMER_MODE_SINGLE_SHOT, onSetupTimeout);
                         MessageService::RegisterMessageHandler(Message::MessageType_BulkData, receiveChunk);
 
                         // Send Setup ack
@@ -444,9 +856,34 @@ namespace Bluetooth
                 }
             );
 
+            // Same with compressed data, decoded to flash as it comes in
+            MessageService::RegisterMessageHandler(Message::MessageType_BulkSetupCompressed,
+                [](const Message* message) {
+                    NRF_LOG_INFO("Received Compressed Bulk Setup");
+                    if (currentState == State_WaitingForSetup) {
+                        Timers::stopTimer(timeoutTimer);
+                        MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetup);
+                        MessageService::UnregisterMessageHandler(Message::MessageType_BulkSetupCompressed);
+
+                        if (!setupCompressed((const MessageBulkSetupCompressed*)message)) {
+                            finishFlashSetup();
+                            return;
+                        }
+                        currentState = State_WaitingForData;
+                        Timers::createTimer(&timeoutTimer, APP_TIMER_MODE_SINGLE_SHOT, onSetupTimeout);
+                        MessageService::RegisterMessageHandler(Message::MessageType_BulkData, receiveChunk);
+                        sendSetupAckMessage();
+                    }
+                }
+            );
+
             currentState = State_WaitingForSetup;
         }
 
+        uint32_t dataHash() {
+            return hash;
+        }
+
         #if DICE_SELFTEST && BULK_DATA_TRANSFER_SELFTEST
         void transferDone(void* context, bool result, uint8_t* data, uint16_t size) {
             if (result) {
@@ -455,7 +892,7 @@ namespace Bluetooth
             } else {
                 NRF_LOG_INFO("Failed");
             }
-            free(data);
+            Utils::Heap::free(data);
             MessageService::UnregisterMessageHandler(Message::MessageType_TestBulkReceive);
         }
 
@@ -2,6 +2,9 @@
 
 #include "stdint.h"
 
+// Number of chunks the die can buffer when receiving, advertised in IAmADie
+#define BULK_DATA_RECEIVE_WINDOW 2
+
 namespace Bluetooth
 {
     enum BulkDataState
@@ -21,6 +24,16 @@ namespace Bluetooth
     {
         typedef void (*sendResultCallback)(void* context, bool result, const uint8_t* data, uint16_t size);
         void send(const uint8_t* theData, uint16_t theSize, void* context,   sendResultCallback callback);
+
+        // How the last (or current) transfer went
+        struct Stats
+        {
+            uint16_t retries;
+            uint16_t queueFullCount;    // Chunks that could not be queued right away
+            uint8_t windowSize;
+            uint8_t blockSize;
+        };
+        Stats getStats();
         void selfTest();
     };
 
@@ -30,7 +43,10 @@ namespace Bluetooth
         typedef void (*receiveResultCallback)(void* context, bool result, uint8_t* data, uint16_t size);
         void receive(void* context, receiveAllocator allocator, receiveResultCallback callback);
         typedef void (*receiveToFlashResultCallback)(void* context, bool result, uint32_t address, uint16_t data_size);
-        void receiveToFlash(uint32_t flashAddress, void* context, receiveToFlashResultCallback callback);
+        void receiveToFlash(uint32_t flashAddress, uint32_t flashSize, void* context, receiveToFlashResultCallback callback);
+        // Hash of the data received by the last successful transfer (see Utils::computeHash),
+        // computed as it comes in so the caller doesn't need to read it all back
+        uint32_t dataHash();
         void selfTest();
     };
 }
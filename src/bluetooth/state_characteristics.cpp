@@ -0,0 +1,91 @@
+#include "state_characteristics.h"
+#include "bluetooth_message_service.h"
+#include "bluetooth_stack.h"
+#include "app_error.h"
+#include "nrf_log.h"
+#include "ble.h"
+#include "ble_srv_common.h"
+
+namespace Bluetooth::StateCharacteristics
+{
+    // Same layout as the corresponding messages, without the message type
+#pragma pack(push, 1)
+    struct RollStateValue
+    {
+        uint8_t state;
+        uint8_t face;
+    };
+
+    struct BatteryValue
+    {
+        uint8_t levelPercent;
+        uint8_t state;
+    };
+
+    struct TemperatureValue
+    {
+        int16_t mcuTempTimes100;
+        int16_t batteryTempTimes100;
+    };
+#pragma pack(pop)
+
+    static ble_gatts_char_handles_t rollStateHandles;
+    static ble_gatts_char_handles_t batteryHandles;
+    static ble_gatts_char_handles_t temperatureHandles;
+
+    void addCharacteristic(uint16_t uuid, uint16_t size, bool notify, ble_gatts_char_handles_t* handles) {
+        ble_add_char_params_t add_char_params;
+        memset(&add_char_params, 0, sizeof(add_char_params));
+        add_char_params.uuid            = uuid;
+        add_char_params.uuid_type       = MessageService::getUUIDType();
+        add_char_params.max_len         = size;
+        add_char_params.init_len        = size;
+        add_char_params.char_props.read = 1;
+        add_char_params.read_access     = SEC_OPEN;
+        if (notify) {
+            add_char_params.char_props.notify = 1;
+            add_char_params.cccd_write_access = SEC_OPEN;
+        }
+
+        ret_code_t err_code = characteristic_add(MessageService::getServiceHandle(), &add_char_params, handles);
+        APP_ERROR_CHECK(err_code);
+    }
+
+    void init() {
+        // Centrals that only follow the rolls (e.g. a score board next to the app) subscribe to the roll state
+        addCharacteristic(ROLL_STATE_CHARACTERISTIC, sizeof(RollStateValue), true, &rollStateHandles);
+        addCharacteristic(BATTERY_CHARACTERISTIC, sizeof(BatteryValue), false, &batteryHandles);
+        addCharacteristic(TEMPERATURE_CHARACTERISTIC, sizeof(TemperatureValue), false, &temperatureHandles);
+
+        NRF_LOG_DEBUG("State characteristics init");
+    }
+
+    void setValue(const ble_gatts_char_handles_t& handles, const void* value, uint16_t size) {
+        ble_gatts_value_t gattsValue;
+        gattsValue.len = size;
+        gattsValue.offset = 0;
+        gattsValue.p_value = (uint8_t*)value;
+
+        // The SoftDevice copies the value, the connection handle is ignored for non system attributes
+        ret_code_t err_code = sd_ble_gatts_value_set(BLE_CONN_HANDLE_INVALID, handles.value_handle, &gattsValue);
+        if (err_code != NRF_SUCCESS) {
+            NRF_LOG_ERROR("Could not set characteristic value, Error %s(0x%x)", NRF_LOG_ERROR_STRING_GET(err_code), err_code);
+        }
+    }
+
+    void setRollState(uint8_t state, uint8_t face) {
+        RollStateValue value = { state, face };
+        setValue(rollStateHandles, &value, sizeof(value));
+        Stack::notifyAll(rollStateHandles.value_handle, (const uint8_t*)&value, sizeof(value));
+    }
+
+    void setBattery(uint8_t levelPercent, uint8_t state) {
+        BatteryValue value = { levelPercent, state };
+        setValue(batteryHandles, &value, sizeof(value));
+    }
+
+    void setTemperature(int16_t mcuTempTimes100, int16_t batteryTempTimes100) {
+        TemperatureValue value = { mcuTempTimes100, batteryTempTimes100 };
+        setValue(temperatureHandles, &value, sizeof(value));
+    }
+}
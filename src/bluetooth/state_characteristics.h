@@ -0,0 +1,22 @@
+#pragma once
+
+#include "stdint.h"
+
+namespace Bluetooth::StateCharacteristics
+{
+    // Readable characteristics of the generic data service, next to TX and RX
+    #define ROLL_STATE_CHARACTERISTIC 0x0004
+    #define BATTERY_CHARACTERISTIC 0x0005
+    #define TEMPERATURE_CHARACTERISTIC 0x0006
+
+    // Adds the characteristics, must be called right after MessageService::init()
+    // so they're part of the attribute table before advertising starts
+    void init();
+
+    // The values are kept up to date by the modules, reads are answered
+    // by the SoftDevice without going through the message service.
+    // Roll state changes are also notified to all the subscribed centrals.
+    void setRollState(uint8_t state, uint8_t face);
+    void setBattery(uint8_t levelPercent, uint8_t state);
+    void setTemperature(int16_t mcuTempTimes100, int16_t batteryTempTimes100);
+}
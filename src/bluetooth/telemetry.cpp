@@ -17,6 +17,7 @@
 #include "drivers_hw/battery.h"
 #include "drivers_hw/coil.h"
 #include "utils/utils.h"
+#include "core/ring_buffer.h"
 #include "config/board_config.h"
 #include "modules/leds.h"
 
@@ -31,8 +32,25 @@ namespace Bluetooth::Telemetry
     static MessageTelemetry teleMessage;
     static TelemetryRequestMode requestMode = TelemetryRequestMode_Off;
     static uint32_t minIntervalMs = 0;
+    static uint32_t requestedMinIntervalMs = 0;  // As asked by the central, before the floor
+    static uint32_t minIntervalFloorMs = 0;
     static uint32_t lastMessageMs = 0;
 
+    // Delta mode, fields are only sent when they differ from the last message
+    static bool deltaMode = false;
+    static uint16_t fieldsMask = TelemetryField_All;
+    static MessageTelemetry lastSentMessage;
+    static bool sendAllFields = false;
+
+    // Batch mode, the latest samples are kept until they are sent together
+    static bool batchMode = false;
+    static uint32_t flushIntervalMs = 0;
+    static Core::RingBuffer<TelemetryBatchSample, TELEMETRY_BATCH_MAX_SAMPLES> batchSamples;
+    static uint8_t batchCount = 0;
+    static uint8_t droppedCount = 0;
+    static uint32_t batchTime = 0;
+    static uint32_t lastSampleTime = 0;
+
     void onRequestTelemetryHandler(const Message* message);
 
     void init() {
@@ -52,33 +70,187 @@ namespace Bluetooth::Telemetry
         }
     }
 
+    void updateBatteryValues() {
+        // Battery values
+        teleMessage.internalChargeState = DriversHW::Battery::checkCharging() ? 1 : 0;
+        teleMessage.batteryControllerMode = BatteryController::getControllerOverrideMode();
+        teleMessage.batteryLevelPercent = BatteryController::getLevelPercent();
+        teleMessage.batteryState = BatteryController::getBatteryState();
+        teleMessage.batteryControllerState = BatteryController::getState();
+
+        // Voltage and current
+        teleMessage.voltageTimes50 = BatteryController::getVoltageMilli() / 20;
+        teleMessage.vCoilTimes50 = Coil::getVCoilTimes1000() / 20;
+        teleMessage.vCoilMinTimes50 = Coil::getVCoilMinTimes1000() / 20;
+        teleMessage.vCoilMaxTimes50 = Coil::getVCoilMaxTimes1000() / 20;
+        teleMessage.ledCurrent = LEDs::computeCurrentEstimate();
+    }
+
+    static uint8_t* append(uint8_t* out, const void* value, int size) {
+        memcpy(out, value, size);
+        return out + size;
+    }
+
+    /// <summary>
+    /// Packs one TelemetryField group of the given message, returns the number of bytes written
+    /// </summary>
+    int packFieldGroup(TelemetryField field, const MessageTelemetry& msg, uint8_t* out) {
+        uint8_t* ptr = out;
+        switch (field) {
+            case TelemetryField_Accelerometer:
+                ptr = append(ptr, &msg.acc, sizeof(msg.acc));
+                ptr = append(ptr, &msg.faceConfidenceTimes1000, sizeof(msg.faceConfidenceTimes1000));
+                ptr = append(ptr, &msg.time, sizeof(msg.time));
+                break;
+            case TelemetryField_Roll:
+                ptr = append(ptr, &msg.rollState, sizeof(msg.rollState));
+                ptr = append(ptr, &msg.face, sizeof(msg.face));
+                break;
+            case TelemetryField_Battery:
+                ptr = append(ptr, &msg.batteryLevelPercent, sizeof(msg.batteryLevelPercent));
+                ptr = append(ptr, &msg.batteryState, sizeof(msg.batteryState));
+                ptr = append(ptr, &msg.batteryControllerState, sizeof(msg.batteryControllerState));
+                ptr = append(ptr, &msg.internalChargeState, sizeof(msg.internalChargeState));
+                ptr = append(ptr, &msg.batteryControllerMode, sizeof(msg.batteryControllerMode));
+                break;
+            case TelemetryField_Voltages:
+                ptr = append(ptr, &msg.voltageTimes50, sizeof(msg.voltageTimes50));
+                ptr = append(ptr, &msg.vCoilTimes50, sizeof(msg.vCoilTimes50));
+                ptr = append(ptr, &msg.vCoilMinTimes50, sizeof(msg.vCoilMinTimes50));
+                ptr = append(ptr, &msg.vCoilMaxTimes50, sizeof(msg.vCoilMaxTimes50));
+                break;
+            case TelemetryField_Rssi:
+                ptr = append(ptr, &msg.rssi, sizeof(msg.rssi));
+                ptr = append(ptr, &msg.channelIndex, sizeof(msg.channelIndex));
+                break;
+            case TelemetryField_Temperatures:
+                ptr = append(ptr, &msg.mcuTempTimes100, sizeof(msg.mcuTempTimes100));
+                ptr = append(ptr, &msg.batteryTempTimes100, sizeof(msg.batteryTempTimes100));
+                break;
+            case TelemetryField_LedCurrent:
+                ptr = append(ptr, &msg.ledCurrent, sizeof(msg.ledCurrent));
+                break;
+            default:
+                break;
+        }
+        return ptr - out;
+    }
+
+    /// <summary>
+    /// Sends the subscribed field groups that changed since the last message, returns false if none did
+    /// </summary>
+    bool sendDelta() {
+        MessageTelemetryDelta deltaMsg;
+        deltaMsg.fields = 0;
+        uint8_t* ptr = deltaMsg.data;
+        uint8_t previous[sizeof(deltaMsg.data)];
+        for (uint16_t bit = 1; bit < TelemetryField_All; bit <<= 1) {
+            if (fieldsMask & bit) {
+                const int size = packFieldGroup((TelemetryField)bit, teleMessage, ptr);
+                if (sendAllFields || packFieldGroup((TelemetryField)bit, lastSentMessage, previous) != size ||
+                    memcmp(ptr, previous, size) != 0) {
+                    deltaMsg.fields |= bit;
+                    ptr += size;
+                }
+            }
+        }
+
+        const bool ret = deltaMsg.fields != 0;
+        if (ret) {
+            NRF_LOG_DEBUG("Sending telemetry delta: %04x", deltaMsg.fields);
+            MessageService::SendMessage(&deltaMsg, ptr - (uint8_t*)&deltaMsg);
+            memcpy(&lastSentMessage, &teleMessage, sizeof(teleMessage));
+            sendAllFields = false;
+        }
+        return ret;
+    }
+
+    void flushBatch() {
+        if (batchCount == 0) {
+            return;
+        }
+        if (!MessageService::isConnected()) {
+            batchCount = 0;
+            return;
+        }
+
+        updateBatteryValues();
+        MessageTelemetryBatch batchMsg;
+        batchMsg.time = batchTime;
+        batchMsg.sampleCount = batchCount;
+        batchMsg.droppedCount = droppedCount;
+        batchMsg.batteryLevelPercent = teleMessage.batteryLevelPercent;
+        batchMsg.voltageTimes50 = teleMessage.voltageTimes50;
+        batchMsg.rssi = teleMessage.rssi;
+        batchMsg.mcuTempTimes100 = teleMessage.mcuTempTimes100;
+        batchMsg.batteryTempTimes100 = teleMessage.batteryTempTimes100;
+        for (int i = 0; i < batchCount; ++i) {
+            // The ring buffer is iterated from its oldest item, the batch is the newest ones
+            batchMsg.samples[i] = batchSamples[TELEMETRY_BATCH_MAX_SAMPLES - batchCount + i];
+        }
+
+        const int size = offsetof(MessageTelemetryBatch, samples) + batchCount * sizeof(TelemetryBatchSample);
+        if (MessageService::SendMessage(&batchMsg, size)) {
+            droppedCount = 0;
+        } else {
+            droppedCount = MIN(droppedCount + batchCount, 0xFF);
+        }
+        NRF_LOG_DEBUG("Sending telemetry batch: %d samples", batchCount);
+        batchCount = 0;
+    }
+
+    void addBatchSample(const Accelerometer::AccelFrame& frame) {
+        if (batchCount > 0 && frame.time - lastSampleTime < minIntervalMs) {
+            return;
+        }
+        lastSampleTime = frame.time;
+        if (batchCount == 0) {
+            batchTime = frame.time;
+        }
+
+        TelemetryBatchSample sample;
+        sample.timeOffset = (uint16_t)MIN(frame.time - batchTime, 0xFFFF);
+        sample.acc = frame.acc;
+        sample.face = frame.face;
+        sample.rollState = frame.determinedRollState;
+        sample.faceConfidenceTimes100 = (uint8_t)CLAMP(frame.faceConfidenceTimes1000 / 10, 0, 100);
+        batchSamples.push(sample);
+        batchCount++;
+
+        if (batchCount == TELEMETRY_BATCH_MAX_SAMPLES ||
+            (flushIntervalMs != 0 && frame.time - batchTime >= flushIntervalMs)) {
+            flushBatch();
+        }
+    }
+
     void trySend() {
-        // Check that we got the acceleration, RSSI and temperature data
-        const bool allInit = teleMessage.time != 0 && teleMessage.rssi;
+        if (batchMode) {
+            // Batches go out with the accelerometer samples
+            return;
+        }
+
+        // Check that we got the acceleration, RSSI and temperature data, if they are wanted
+        const bool allInit =
+            (teleMessage.time != 0 || (fieldsMask & (TelemetryField_Accelerometer | TelemetryField_Roll)) == 0) &&
+            (teleMessage.rssi || (fieldsMask & TelemetryField_Rssi) == 0);
 
         // Check time interval since we last send a telemetry message
         const uint32_t time = DriversNRF::Timers::millis();
         if (allInit && time - lastMessageMs >= minIntervalMs) {
             if (MessageService::isConnected()) {
+                updateBatteryValues();
+                if (deltaMode) {
+                    if (sendDelta()) {
+                        lastMessageMs = time;
+                    }
+                    return;
+                }
+
                 lastMessageMs = time;
                 if (requestMode == TelemetryRequestMode_Once) {
                     stop();
                 }
 
-                // Update battery values
-                teleMessage.internalChargeState = DriversHW::Battery::checkCharging() ? 1 : 0;
-                teleMessage.batteryControllerMode = BatteryController::getControllerOverrideMode();
-                teleMessage.batteryLevelPercent = BatteryController::getLevelPercent();
-                teleMessage.batteryState = BatteryController::getBatteryState();
-                teleMessage.batteryControllerState = BatteryController::getState();
-
-                // Voltage and current
-                teleMessage.voltageTimes50 = BatteryController::getVoltageMilli() / 20;
-                teleMessage.vCoilTimes50 = Coil::getVCoilTimes1000() / 20;
-                teleMessage.vCoilMinTimes50 = Coil::getVCoilMinTimes1000() / 20;
-                teleMessage.vCoilMaxTimes50 = Coil::getVCoilMaxTimes1000() / 20;
-                teleMessage.ledCurrent = LEDs::computeCurrentEstimate();
-
                 // Send the message
                 NRF_LOG_DEBUG("Sending telemetry: %d", teleMessage.time);
                 MessageService::SendMessage(&teleMessage);
@@ -94,7 +266,11 @@ namespace Bluetooth::Telemetry
         teleMessage.time = frame.time;
         teleMessage.rollState = frame.determinedRollState;
         teleMessage.face = frame.face;
-        trySend();
+        if (batchMode) {
+            addBatchSample(frame);
+        } else {
+            trySend();
+        }
     }
 
     void onRssiChanged(void* param, int8_t rssi, uint8_t channelIndex) {
@@ -117,17 +293,25 @@ namespace Bluetooth::Telemetry
     }
 
     void onRequestTelemetryHandler(const Message* message) {
-        auto reqTelem = static_cast<const MessageRequestTelemetry *>(message);
+        // Older apps don't send the fields mask and flush interval
+        MessageRequestTelemetry request;
+        MessageService::copyReceivedMessage(message, request);
+        auto reqTelem = &request;
         NRF_LOG_DEBUG("Received Telemetry Request, mode = %d, minInterval = %d", reqTelem->requestMode, reqTelem->minInterval);
-        if (reqTelem->requestMode != TelemetryRequestMode_Off) {
+        if (reqTelem->requestMode == TelemetryRequestMode_Batch) {
+            startBatch(reqTelem->minInterval, reqTelem->flushInterval);
+        } else if (reqTelem->requestMode == TelemetryRequestMode_RepeatDelta) {
+            startDelta(reqTelem->fieldsMask != 0 ? reqTelem->fieldsMask : (uint16_t)TelemetryField_All, reqTelem->minInterval);
+        } else if (reqTelem->requestMode != TelemetryRequestMode_Off) {
             start(reqTelem->requestMode == TelemetryRequestMode_Repeat, reqTelem->minInterval);
         } else {
             stop();
         }
     }
 
-    void start(bool repeat, uint32_t minInterval) {
-        minIntervalMs = minInterval;
+    static void begin(bool repeat, uint32_t minInterval) {
+        requestedMinIntervalMs = minInterval;
+        minIntervalMs = MAX(minInterval, minIntervalFloorMs);
 
         // Reset timestamp so next message is send on the first call to trySend()
         lastMessageMs = 0;
@@ -160,13 +344,46 @@ namespace Bluetooth::Telemetry
             // Battery controller state
             Modules::BatteryController::hookControllerState(onBatteryChanged, nullptr);
             Modules::BatteryController::setUpdateRate(BatteryController::UpdateRate_Fast);
+
+            // Streaming accelerometer data needs short connection intervals
+            if (repeat && (fieldsMask & TelemetryField_Accelerometer) != 0) {
+                Stack::requestFastConnection(Stack::ConnectionUser_Telemetry);
+            }
         }
     }
 
+    void start(bool repeat, uint32_t minInterval) {
+        batchMode = false;
+        deltaMode = false;
+        fieldsMask = TelemetryField_All;
+        begin(repeat, minInterval);
+    }
+
+    void startDelta(uint16_t fields, uint32_t minInterval) {
+        batchMode = false;
+        deltaMode = true;
+        fieldsMask = fields & TelemetryField_All;
+        sendAllFields = true;
+        begin(true, minInterval);
+    }
+
+    void startBatch(uint32_t minInterval, uint32_t flushInterval) {
+        batchMode = true;
+        deltaMode = false;
+        fieldsMask = TelemetryField_All;
+        flushIntervalMs = flushInterval;
+        batchCount = 0;
+        droppedCount = 0;
+        begin(true, minInterval);
+    }
+
     void stop() {
         if (requestMode != TelemetryRequestMode_Off) {
             NRF_LOG_INFO("Telemetry off");
             requestMode = TelemetryRequestMode_Off;
+            if (batchMode) {
+                flushBatch();
+            }
 
             // Stop being notified!
             Bluetooth::Stack::unHook(onConnectionEvent);
@@ -175,6 +392,12 @@ namespace Bluetooth::Telemetry
             Temperature::unHookTemperatureChange(onTemperatureChanged);
             Modules::BatteryController::setUpdateRate(BatteryController::UpdateRate_Normal);
             Modules::BatteryController::unHookControllerState(onBatteryChanged);
+            Stack::releaseFastConnection(Stack::ConnectionUser_Telemetry);
         }
     }
+
+    void setMinIntervalFloor(uint32_t intervalMs) {
+        minIntervalFloorMs = intervalMs;
+        minIntervalMs = MAX(requestedMinIntervalMs, minIntervalFloorMs);
+    }
 }
@@ -6,5 +6,14 @@ namespace Bluetooth::Telemetry
 {
     void init();
     void start(bool repeat, uint32_t maxRate);
+
+    // Repeatedly sends the given TelemetryField groups, only when they change
+    void startDelta(uint16_t fieldsMask, uint32_t maxRate);
+
+    // Buffers samples and sends them several at a time, when the batch is full or flushInterval is up
+    void startBatch(uint32_t maxRate, uint32_t flushInterval);
     void stop();
+
+    // Telemetry is never sent more often than this, whatever the central asks for
+    void setMinIntervalFloor(uint32_t intervalMs);
 }
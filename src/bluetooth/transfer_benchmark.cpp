@@ -0,0 +1,225 @@
+#include "transfer_benchmark.h"
+#include "bluetooth_message_service.h"
+#include "bluetooth_messages.h"
+#include "bluetooth_stack.h"
+#include "bulk_data_transfer.h"
+#include "drivers_nrf/timers.h"
+#include "app_timer.h"
+#include "app_util.h"
+#include "nrf_log.h"
+#include <stddef.h>
+#include <string.h>
+
+#define TRANSFER_BENCHMARK_PUMP_MS 5            // How often notifications are queued in notify mode
+#define TRANSFER_BENCHMARK_RECEIVE_TIMEOUT_MS 3000  // Gives up when the central stops writing
+#define TRANSFER_BENCHMARK_DATA_HEADER_SIZE (offsetof(MessageTransferTestData, data))
+
+using namespace DriversNRF;
+
+namespace Bluetooth::TransferBenchmark
+{
+    static bool running = false;
+    static TransferTestMode mode;
+    static uint32_t size = 0;
+    static uint32_t transferred = 0;
+    static uint32_t startTicks = 0;
+    static uint32_t startMs = 0;
+    static uint16_t sequence = 0;
+    static uint16_t queueFullCount = 0;
+    static uint16_t sequenceErrors = 0;
+    static uint8_t chunkSize = 0;
+    static uint16_t droppedAtStart = 0;
+
+    APP_TIMER_DEF(benchmarkTimer);
+
+    void onTransferTestHandler(const Message* message);
+    void onSetLinkConditionsHandler(const Message* message);
+    void onTransferTestDataHandler(const Message* message);
+    void onConnectionEvent(void* param, bool connected);
+    void onBulkSendDone(void* context, bool result, const uint8_t* data, uint16_t size);
+
+    void init() {
+        MessageService::RegisterMessageHandler(Message::MessageType_TransferTest, onTransferTestHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_SetLinkConditions, onSetLinkConditionsHandler);
+        NRF_LOG_DEBUG("Transfer benchmark init");
+    }
+
+    void startTiming() {
+        startTicks = app_timer_cnt_get();
+        startMs = Timers::millis();
+    }
+
+    /// <summary>
+    /// Reports the results to the central and gets ready for the next test
+    /// </summary>
+    void finish(bool result) {
+        Timers::stopTimer(benchmarkTimer);
+        MessageService::UnregisterMessageHandler(Message::MessageType_TransferTestData);
+        Stack::unHook(onConnectionEvent);
+        if (mode != TransferTestMode_BulkSend) {
+            Stack::releaseFastConnection(Stack::ConnectionUser_Benchmark);
+        }
+        running = false;
+
+        MessageTransferTestFinished finishedMsg;
+        finishedMsg.mode = mode;
+        finishedMsg.result = result ? 1 : 0;
+        finishedMsg.size = transferred;
+        finishedMsg.elapsedTicks = app_timer_cnt_diff_compute(app_timer_cnt_get(), startTicks);
+        finishedMsg.durationMs = Timers::millis() - startMs;
+        finishedMsg.bytesPerSecond = finishedMsg.durationMs > 0 ? (uint32_t)((uint64_t)transferred * 1000 / finishedMsg.durationMs) : 0;
+        finishedMsg.retries = 0;
+        finishedMsg.queueFullCount = queueFullCount;
+        finishedMsg.sequenceErrors = sequenceErrors;
+        finishedMsg.windowSize = 1;
+        finishedMsg.chunkSize = chunkSize;
+        finishedMsg.droppedNotifications = Stack::getDroppedNotificationCount() - droppedAtStart;
+        if (mode == TransferTestMode_BulkSend) {
+            auto stats = SendBulkData::getStats();
+            finishedMsg.retries = stats.retries;
+            finishedMsg.queueFullCount = stats.queueFullCount;
+            finishedMsg.windowSize = stats.windowSize;
+            finishedMsg.chunkSize = stats.blockSize;
+        }
+        NRF_LOG_INFO("Transfer test %s, %d bytes in %d ms", result ? "done" : "failed", transferred, finishedMsg.durationMs);
+        MessageService::SendMessage(&finishedMsg);
+    }
+
+    /// <summary>
+    /// Queues test data notifications until the send queue is full or everything is queued
+    /// </summary>
+    void pumpNotifications(void* context) {
+        if (transferred >= size) {
+            // Everything is queued, the test ends when it's all gone out
+            if (MessageService::canSendImmediately()) {
+                finish(true);
+            }
+            return;
+        }
+        while (transferred < size) {
+            auto dataMsg = MessageService::ReserveMessage<MessageTransferTestData>(MessageService::Lane_Bulk);
+            if (dataMsg == nullptr) {
+                queueFullCount++;
+                return;
+            }
+            const uint8_t dataSize = MIN(size - transferred, chunkSize);
+            dataMsg->sequence = sequence++;
+            dataMsg->size = dataSize;
+            memset(dataMsg->data, (uint8_t)dataMsg->sequence, dataSize);
+            MessageService::CommitMessage(TRANSFER_BENCHMARK_DATA_HEADER_SIZE + dataSize);
+            transferred += dataSize;
+        }
+    }
+
+    void onReceiveTimeout(void* context) {
+        NRF_LOG_WARNING("Transfer test timed out");
+        finish(false);
+    }
+
+    void onTransferTestDataHandler(const Message* message) {
+        auto msg = (const MessageTransferTestData*)message;
+        if (transferred == 0) {
+            // The clock starts with the first message so the central setup time isn't counted
+            startTiming();
+        }
+        const int16_t gap = (int16_t)(msg->sequence - sequence);
+        if (gap > 0) {
+            sequenceErrors += gap;
+        }
+        sequence = msg->sequence + 1;
+        transferred += msg->size;
+        if (transferred >= size) {
+            finish(true);
+        } else {
+            Timers::stopTimer(benchmarkTimer);
+            Timers::startTimer(benchmarkTimer, TRANSFER_BENCHMARK_RECEIVE_TIMEOUT_MS);
+        }
+    }
+
+    void onBulkSendDone(void* context, bool result, const uint8_t* data, uint16_t size) {
+        transferred = result ? size : 0;
+        finish(result);
+    }
+
+    void onConnectionEvent(void* param, bool connected) {
+        if (!connected && running) {
+            // Nobody left to report to
+            Timers::stopTimer(benchmarkTimer);
+            MessageService::UnregisterMessageHandler(Message::MessageType_TransferTestData);
+            Stack::unHook(onConnectionEvent);
+            running = false;
+        }
+    }
+
+    void onTransferTestHandler(const Message* message) {
+        auto msg = (const MessageTransferTest*)message;
+        if (running) {
+            NRF_LOG_WARNING("Transfer test already running");
+            return;
+        }
+
+        mode = (TransferTestMode)msg->mode;
+        size = msg->size;
+        transferred = 0;
+        sequence = 0;
+        queueFullCount = 0;
+        sequenceErrors = 0;
+        droppedAtStart = Stack::getDroppedNotificationCount();
+        chunkSize = MIN(Stack::getMaxPayloadSize() - TRANSFER_BENCHMARK_DATA_HEADER_SIZE, sizeof(MessageTransferTestData::data));
+
+        switch (mode) {
+            case TransferTestMode_BulkSend:
+                // The data comes straight from the firmware image in flash, so it takes no RAM
+                size = MIN(size, MIN(CODE_SIZE, 0xFFFF));
+                break;
+            case TransferTestMode_Notify:
+                Timers::createTimer(&benchmarkTimer, APP_TIMER_MODE_REPEATED, pumpNotifications);
+                break;
+            case TransferTestMode_Receive:
+                Timers::createTimer(&benchmarkTimer, APP_TIMER_MODE_SINGLE_SHOT, onReceiveTimeout);
+                MessageService::RegisterMessageHandler(Message::MessageType_TransferTestData, onTransferTestDataHandler);
+                break;
+            default:
+                NRF_LOG_WARNING("Unknown transfer test mode %d", mode);
+                return;
+        }
+        NRF_LOG_INFO("Transfer test mode %d, %d bytes", mode, size);
+        running = true;
+        Stack::hook(onConnectionEvent, nullptr);
+
+        MessageTransferTestAck ackMsg;
+        ackMsg.mode = mode;
+        ackMsg.size = size;
+        MessageService::SendMessage(&ackMsg);
+
+        startTiming();
+        switch (mode) {
+            case TransferTestMode_BulkSend:
+                // Bulk transfers ask for a fast connection themselves
+                SendBulkData::send((const uint8_t*)CODE_START, size, nullptr, onBulkSendDone);
+                break;
+            case TransferTestMode_Notify:
+                Stack::requestFastConnection(Stack::ConnectionUser_Benchmark);
+                Timers::startTimer(benchmarkTimer, TRANSFER_BENCHMARK_PUMP_MS);
+                pumpNotifications(nullptr);
+                break;
+            default:
+                Stack::requestFastConnection(Stack::ConnectionUser_Benchmark);
+                Timers::startTimer(benchmarkTimer, TRANSFER_BENCHMARK_RECEIVE_TIMEOUT_MS);
+                break;
+        }
+    }
+
+    /// <summary>
+    /// Lets the central test how the protocols cope with smaller MTUs, fewer packets per
+    /// connection event and lost notifications, without a radio setup for it
+    /// </summary>
+    void onSetLinkConditionsHandler(const Message* message) {
+        auto msg = (const MessageSetLinkConditions*)message;
+        Stack::LinkConditions conditions;
+        conditions.maxPayloadSize = msg->maxPayloadSize;
+        conditions.maxInFlight = msg->maxInFlight;
+        conditions.lossPercent = msg->lossPercent;
+        Stack::setLinkConditions(conditions);
+    }
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "stdint.h"
+
+namespace Bluetooth::TransferBenchmark
+{
+    void init();
+}
@@ -4,10 +4,15 @@
 #include "nrf_saadc.h"
 #include "nrf_log.h"
 #include "settings.h"
+#include "value_store.h"
 
 #define BOARD_DETECT_DRIVE_PIN 25
 #define BOARD_DETECT_RESISTOR 100000 // 100k
 
+// Stored in place of the board resistor when the stored board didn't match a measurement,
+// the board is then measured on every boot again
+#define BOARD_STORE_DISABLED 0xFFFFFF
+
 namespace Config
 {
 namespace BoardManager
@@ -216,28 +221,26 @@ namespace BoardManager
         },
     };
 
+    static const int boardCount = sizeof(boards) / sizeof(boards[0]);
+
     // The board we're currently using
     static const Board* currentBoard = nullptr;
 
-    void init() {
-        // Sample adc board pin
-        setNTC_ID_VDD(true);
-
-        int32_t vboardTimes1000 = DriversNRF::A2D::readVBoardTimes1000();
-
-        // Now that we're done reading, we can turn off the drive pin
-        setNTC_ID_VDD(false);
+    // Set when the board was read from the value store and hasn't been measured yet
+    static bool boardToVerify = false;
 
+    /// <summary>
+    /// Returns the index of the board whose identifying resistor gives the measured voltage
+    /// </summary>
+    static int findBoard(int32_t vboardTimes1000, int32_t vddTimes1000) {
         // Do some computation to figure out which variant we're working with!
         // D20v3 board uses 20k over 100k voltage divider
         // i.e. the voltage read should be 3.1V * 20k / 120k = 0.55V
         // The D6v2 board uses 47k over 100k, i.e. 1.05V
         // The D20v2 board should read 0 (unconnected)
         // So we can allow a decent
-        const int32_t vddTimes1000 = DriversNRF::A2D::readVDDTimes1000();
 
         // Compute board voltages
-        const int boardCount = sizeof(boards) / sizeof(boards[0]);
         int32_t boardVoltagesTimes1000[boardCount];
         for (int i = 0; i < boardCount; ++i) {
             boardVoltagesTimes1000[i] = (vddTimes1000 * boards[i].boardResistorValueInKOhms * 1000) / (BOARD_DETECT_RESISTOR + boards[i].boardResistorValueInKOhms * 1000);
@@ -254,14 +257,74 @@ namespace BoardManager
             if (midpointVoltagesTimes1000[boardIndex] > vboardTimes1000)
             break;
         }
+        NRF_LOG_INFO("Board is %s, boardId V: %d.%03d", boards[boardIndex].name, vboardTimes1000 / 1000, vboardTimes1000 % 1000);
+        return boardIndex;
+    }
+
+    /// <summary>
+    /// Measures the identifying resistor, with the divider powered for the reading
+    /// </summary>
+    static int measureBoard() {
+        // Sample adc board pin
+        setNTC_ID_VDD(true);
+
+        int32_t vboardTimes1000 = DriversNRF::A2D::readVBoardTimes1000();
+
+        // Now that we're done reading, we can turn off the drive pin
+        setNTC_ID_VDD(false);
+
+        return findBoard(vboardTimes1000, DriversNRF::A2D::readVDDTimes1000());
+    }
+
+    static int findBoardWithResistor(uint32_t resistorValueInKOhms) {
+        for (int i = 0; i < boardCount; ++i) {
+            if (boards[i].boardResistorValueInKOhms == resistorValueInKOhms) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void init() {
+        // Once validated, the board identified on the first boot is kept in the value store so the
+        // next boots don't wait on the A2D. It is checked later, see verifyStoredBoard().
+        const uint32_t storedResistor = ValueStore::readValue(ValueStore::ValueType_BoardResistor);
+        int boardIndex = storedResistor != BOARD_STORE_DISABLED ? findBoardWithResistor(storedResistor) : -1;
+        if (boardIndex >= 0) {
+            boardToVerify = true;
+            NRF_LOG_INFO("Board is %s (stored)", boards[boardIndex].name);
+        } else {
+            boardIndex = measureBoard();
+            if (storedResistor == (uint32_t)-1 && ValueStore::hasValidationTimestamp()) {
+                ValueStore::writeValue(ValueStore::ValueType_BoardResistor, boards[boardIndex].boardResistorValueInKOhms);
+            }
+        }
         currentBoard = &(boards[boardIndex]);
-        NRF_LOG_INFO("Board is %s, boardId V: %d.%03d", currentBoard->name, vboardTimes1000 / 1000, vboardTimes1000 % 1000);
+    }
+
+    void verifyStoredBoard() {
+        if (boardToVerify) {
+            boardToVerify = false;
+            int32_t vboardTimes1000 = DriversNRF::A2D::readVBoardTimes1000();
+            int boardIndex = findBoard(vboardTimes1000, DriversNRF::A2D::readVDDTimes1000());
+            if (&boards[boardIndex] != currentBoard) {
+                // Don't trust the store anymore, the next boots will be measuring the board again
+                NRF_LOG_ERROR("Stored board %s doesn't match measured board %s", currentBoard->name, boards[boardIndex].name);
+                ValueStore::writeValue(ValueStore::ValueType_BoardResistor, BOARD_STORE_DISABLED);
+            }
+        }
     }
 
     const Board* getBoard() {
         return currentBoard;
     }
 
+    bool supportsFastI2C() {
+        // The accelerometer is the only device on the bus of every board so far, and it supports
+        // fast mode. Should a board not cope, the accelerometer init drops back to standard mode.
+        return true;
+    }
+
     void setNTC_ID_VDD(bool set) {
         if (set) {
             nrf_gpio_cfg_output(BOARD_DETECT_DRIVE_PIN);
@@ -8,4 +8,11 @@ namespace Config::BoardManager
     void init();
     void setNTC_ID_VDD(bool set);
     const Board* getBoard();
+
+    // Checks the board read from the value store against a measurement, to be called while the
+    // identification divider is powered (see setNTC_ID_VDD). Only measures once per boot.
+    void verifyStoredBoard();
+
+    // Whether the I2C bus may run at 400kHz
+    bool supportsFastI2C();
 }
@@ -1,5 +1,6 @@
 #include "dice_variants.h"
 #include "board_config.h"
+#include "settings.h"
 #include "string.h"
 #include "assert.h"
 
@@ -9,6 +10,25 @@ namespace Config
 {
 namespace DiceVariants
 {
+    // Lookup tables derived from the hand written ones are generated at compile time with the
+    // helpers below, so they are stored in flash and can't get out of sync with their source.
+    template <int Size>
+    struct IndexTable
+    {
+        uint8_t values[Size];
+    };
+
+    // Reverses a lookup table, i.e. gives the daisy chain index of each LED from the LED index of
+    // each daisy chain index
+    template <int Size>
+    constexpr IndexTable<Size> invertIndices(const uint8_t (&indices)[Size]) {
+        IndexTable<Size> ret = {};
+        for (int i = 0; i < Size; ++i) {
+            ret.values[indices[i]] = (uint8_t)i;
+        }
+        return ret;
+    }
+
     // Animations are defined with the highest face up, so we may need to remap the Face (or LEDs) to
     // match the current face up. This table is used to do this.
     // If we have computed the color of a face in the canonical orientation (highest face up), then we
@@ -16,7 +36,7 @@ namespace DiceVariants
     // Actual face/led := DXRemap[currentFaceUp * face/led count + canonicalIndex]
     // Note: this remapping happens in the canonical face space, meaning in this case the face index
     // is one less than the number printed on the dice faces.
-    const uint8_t D4Remap[] = {
+    constexpr uint8_t D4Remap[] = {
         3, 2, 1, 0, // Face 1 up
         1, 3, 0, 2, // Face 3 up
         2, 0, 3, 1, // Face 2 up
@@ -55,17 +75,15 @@ namespace DiceVariants
     // 1, 5, 2, 6, 4, 3 <-- face number (6-sided)
     // 1, -, -, 4, 2, 3 <-- face number (4-sided)
     // 0, 4, 5, 3, 1, 2 <-- led index (4-sided)
-    const uint8_t D4LEDIndices[] = {
+    constexpr uint8_t D4LEDIndices[] = {
         0, 4, 5, 3, 1, 2,
     };
 
     // 0, 1, 2, 3, 4, 5 <-- led Index
     // 0, 4, 5, 3 <-- daisy chain index
-    const uint8_t D4ElectricalIndices[] = {
-        0, 4, 5, 3, 1, 2,   // daisy chain index
-    };
+    constexpr auto D4ElectricalIndices = invertIndices(D4LEDIndices);
 
-    const uint32_t D4Adjacency[] = {
+    constexpr uint32_t D4Adjacency[] = {
         // FIXME
         1 << 1 | 1 << 2, // 1
         1 << 0 | 1 << 3,
@@ -78,7 +96,7 @@ namespace DiceVariants
     // If we have computed the color of a face in the canonical orientation (highest face up), then we
     // can use the following to figure out which face/led we should actually set to this color.
     // Actual face/led := DXRemap[currentFaceUp * face/led count + canonicalIndex]
-    const uint8_t D6Remap[] = {
+    constexpr uint8_t D6Remap[] = {
         5, 2, 1, 4, 3, 0,
         4, 0, 2, 3, 5, 1,
         3, 4, 5, 0, 1, 2,
@@ -112,17 +130,15 @@ namespace DiceVariants
     // 0, 1, 2, 3, 4, 5 <-- daisy chain index
     // 1, 5, 2, 6, 4, 3 <-- face number
     // 0, 4, 1, 5, 3, 2 <-- face/led index
-    const uint8_t D6LEDIndices[] = {
+    constexpr uint8_t D6LEDIndices[] = {
         0, 4, 1, 5, 3, 2,
     };
 
     // 0, 1, 2, 3, 4, 5 <-- led index
     // 0, 2, 5, 4, 1, 3 <-- DaisyChain Index
-    const uint8_t D6ElectricalIndices[] = {
-        0, 2, 5, 4, 1, 3,
-    };
+    constexpr auto D6ElectricalIndices = invertIndices(D6LEDIndices);
 
-    const uint32_t D6Adjacency[] = {
+    constexpr uint32_t D6Adjacency[] = {
         1 << 1 | 1 << 2 | 1 << 3 | 1 << 4, // 1
         1 << 0 | 1 << 2 | 1 << 3 | 1 << 5,
         1 << 0 | 1 << 1 | 1 << 4 | 1 << 5,
@@ -136,7 +152,7 @@ namespace DiceVariants
     // If we have computed the color of a face in the canonical orientation (highest face up), then we
     // can use the following to figure out which face/led we should actually set to this color.
     // Actual face/led := DXRemap[currentFaceUp * face/led count + canonicalIndex]
-    const uint8_t D20Remap[] = {
+    constexpr uint8_t D20Remap[] = {
         19, 12, 15, 14, 17, 16, 13, 18, 9, 8, 11, 10, 1, 6, 3, 2, 5, 4, 7, 0, // remap for face at index 0 (= face with number 1)
         18, 17, 16, 13, 10, 7, 0, 11, 15, 14, 5, 4, 8, 19, 12, 9, 6, 3, 2, 1, // remap for face at index 1 (= face with number 2)
         17, 15, 14, 8, 13, 0, 1, 16, 12, 9, 10, 7, 3, 18, 19, 6, 11, 5, 4, 2, // etc.
@@ -184,7 +200,7 @@ namespace DiceVariants
 
     //  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19 <-- daisy chain index
     //  4, 12, 10,  3, 17,  1, 11, 14,  6,  0, 18,  8,  5, 13, 19,  7,  9, 16,  2, 15 <-- face/led Index
-    const uint8_t D20LEDIndices[] = {
+    constexpr uint8_t D20LEDIndices[] = {
         4, 12, 10,  3, 17,  1, 11, 14,  6,  0, 18,  8,  5, 13, 19,  7,  9, 16,  2, 15
     };
 
@@ -192,9 +208,7 @@ namespace DiceVariants
     //  0   1   2   3   4   5   6   7   8   9  10  11  12  13  14  15  16  17  18  19 <-- Face/led index
     //  9,  5, 18,  3,  0, 12,  8, 15, 11, 16,  2,  6,  1, 13,  7, 19, 17,  4, 10, 14 <-- daisy chain index
     //  9, 13,  7, 19, 11, 16,  1,  5, 17,  4, 18,  3, 10, 15,  2,  6,  0, 12,  8, 14 <-- old molds daisy chain index
-    const uint8_t D20ElectricalIndices[] = {
-        9,  5, 18,  3,  0, 12,  8, 15, 11, 16,  2,  6,  1, 13,  7, 19, 17,  4, 10, 14
-    };
+    constexpr auto D20ElectricalIndices = invertIndices(D20LEDIndices);
 
     // Used for determining which face is up and/or for animations that color each face based on their normal
     // Note that the normal is also a good approximation of the position of the LED on the face. In most cases
@@ -223,8 +237,8 @@ namespace DiceVariants
         { 335, -937,   92},
     };
 
-    const uint32_t D20Adjacency[] = {
-        1 <<  6 | 1 << 18 | 1 << 13, // 1
+    constexpr uint32_t D20Adjacency[] = {
+        1 <<  6 | 1 << 18 | 1 << 12, // 1
         1 << 11 | 1 << 17 | 1 << 19,
         1 << 15 | 1 << 16 | 1 << 18,
         1 << 10 | 1 << 13 | 1 << 17,
@@ -251,7 +265,7 @@ namespace DiceVariants
     // If we have computed the color of a face in the canonical orientation (highest face up), then we
     // can use the following to figure out which face/led we should actually set to this color.
     // Actual face/led := DXRemap[currentFaceUp * face/led count + canonicalIndex]
-    const uint8_t D12Remap[] = {
+    constexpr uint8_t D12Remap[] = {
         11, 7, 9, 6, 10, 8, 3, 1, 5, 2, 4, 0,
         10, 2, 6, 11, 4, 8, 3, 7, 0, 5, 9, 1,
         9, 1, 5, 0, 8, 4, 7, 3, 11, 6, 10, 2,
@@ -302,18 +316,16 @@ namespace DiceVariants
 
     // 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11 <-- daisy chain index
     // 3,  7,  1,  0,  5,  2, 11,  6,  9,  4, 10,  8 <-- Face/led index
-    const uint8_t D12LEDIndices[] = {
+    constexpr uint8_t D12LEDIndices[] = {
         3,  7,  1,  0,  5,  2, 11,  6,  9,  4, 10,  8
     };
 
 
     // 0, 1, 2, 3, 4, 5, 6, 7,  8, 9, 10, 11 <-- face/Led Index
     // 3, 2, 5, 0, 9, 4, 7, 1, 11, 8, 10,  6 <-- DaisyChain Index
-    const uint8_t D12ElectricalIndices[] = {
-        3, 2, 5, 0, 9, 4, 7, 1, 11, 8, 10, 6
-    };
+    constexpr auto D12ElectricalIndices = invertIndices(D12LEDIndices);
 
-    const uint32_t D12Adjacency[] = {
+    constexpr uint32_t D12Adjacency[] = {
         1 <<  1 | 1 <<  3 | 1 <<  4 | 1 <<  5 | 1 <<  9, // 1
         1 <<  0 | 1 <<  3 | 1 <<  6 | 1 <<  7 | 1 <<  9,
         1 <<  3 | 1 <<  5 | 1 <<  7 | 1 << 10 | 1 << 11,
@@ -333,7 +345,7 @@ namespace DiceVariants
     // If we have computed the color of a face in the canonical orientation (highest face up), then we
     // can use the following to figure out which face/led we should actually set to this color.
     // Actual face/led := DXRemap[currentFaceUp * face/led count + canonicalIndex]
-    const uint8_t D10Remap[] = {
+    constexpr uint8_t D10Remap[] = {
         0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 
         1, 0, 5, 6, 7, 2, 3, 4, 9, 8, 
         2, 3, 4, 9, 8, 1, 0, 5, 6, 7, 
@@ -378,17 +390,15 @@ namespace DiceVariants
 
     // 0  1  2  3  4  5  6  7  8  9 <-- DaisyChain Index
     // 3  5  9  1  7  4  6  2  8  0 <-- Face / Led Index
-    const uint8_t D10LEDIndices[] = {
+    constexpr uint8_t D10LEDIndices[] = {
          3,  5,  9,  1,  7,  4,  6,  2,  8,  0
     };
 
     // 0  1  2  3  4  5  6  7  8  9 <-- Face / Led Index
     // 9, 3, 7, 0, 5, 1, 6, 4, 8, 2 <-- DaisyChain Index
-    const uint8_t D10ElectricalIndices[] = {
-         9, 3, 7, 0, 5, 1, 6, 4, 8, 2
-    };
+    constexpr auto D10ElectricalIndices = invertIndices(D10LEDIndices);
 
-    const uint32_t D10Adjacency[] = {
+    constexpr uint32_t D10Adjacency[] = {
         1 << 3 | 1 << 4 | 1 << 7 | 1 << 8, // 0
         1 << 4 | 1 << 6 | 1 << 7 | 1 << 9,
         1 << 5 | 1 << 6 | 1 << 8 | 1 << 9,
@@ -406,7 +416,7 @@ namespace DiceVariants
     // If we have computed the color of a face in the canonical orientation (highest face up), then we
     // can use the following to figure out which face/led we should actually set to this color.
     // Actual face/led := DXRemap[currentFaceUp * face/led count + canonicalIndex]
-    const uint8_t D8Remap[] = {
+    constexpr uint8_t D8Remap[] = {
         7, 2, 1, 4, 3, 6, 5, 0,
         6, 3, 0, 5, 2, 7, 4, 1, 
         5, 4, 7, 6, 1, 0, 3, 2, 
@@ -445,18 +455,16 @@ namespace DiceVariants
 
     //  0, 1, 2, 3, 4, 5, 6, 7  // Daisy Chain Index
     //  2, 0, 3, 1, 7, 5, 4, 6  // LED Index
-    const uint8_t D8LEDIndices[] = {
+    constexpr uint8_t D8LEDIndices[] = {
         2, 0, 3, 1, 7, 5, 4, 6
     };
 
     //  1, 2, 3, 4, 5, 6, 7, 8  // Face Number
     //  0, 1, 2, 3, 4, 5, 6, 7  // Face / LED Index
     //  1, 3, 0, 2, 6, 5, 7, 4  // DaisyChain Index
-    const uint8_t D8ElectricalIndices[] = {
-        1, 3, 0, 2, 6, 5, 7, 4  // DaisyChain Index
-    };
+    constexpr auto D8ElectricalIndices = invertIndices(D8LEDIndices);
 
-    const uint32_t D8Adjacency[] = {
+    constexpr uint32_t D8Adjacency[] = {
         1 << 2 | 1 << 3 | 1 << 6, // 1
         1 << 2 | 1 << 3 | 1 << 7,
         1 << 0 | 1 << 1 | 1 << 4,
@@ -511,20 +519,18 @@ namespace DiceVariants
 
     // 0,	1,	2,	3,	4,	5,	6,	7,	8,	9,	10,	11,	12,	13,	14,	15,	16,	17,	18,	19, 20, // Daisy Chain Index
     // 0,	6,	7,	8,	9,	1,	2,	3,	4,	5, 10,	11,	12,	13,	14,	15,	16,	17,	18,	19, 20, // LED Index
-    const uint8_t PD6LEDIndices[] = {
+    constexpr uint8_t PD6LEDIndices[] = {
         0,	6,	7,	8,	9,	1,	2,	3,	4,	5, 10,	11,	12,	13,	14,	15,	16,	17,	18,	19, 20,
     };
 
     // 0,	1,	2,	3,	4,	5,	6,	7,	8,	9,	10,	11,	12,	13,	14,	15,	16,	17,	18,	19, 20, // LED Index
     // 0,	5,	6,	7,	8,	9,	1,	2,	3,	4,	10,	11,	12,	13,	14,	15,	16,	17,	18,	19, 20, // Daisy Chain Index
-    const uint8_t PD6ElectricalIndices[] = {
-        0,	5,	6,	7,	8,	9,	1,	2,	3,	4,	10,	11,	12,	13,	14,	15,	16,	17,	18,	19, 20,
-    };
+    constexpr auto PD6ElectricalIndices = invertIndices(PD6LEDIndices);
 
     // Indicates what face each LED (from its "logical" index) is on
     // 0,	1,	2,	3,	4,	5,	6,	7,	8,	9,	10,	11,	12,	13,	14,	15,	16,	17,	18,	19, 20, // LED Index
     // 0    --1--   ----2----   ------3------   ---------4--------  ----------5-----------  // Face index
-    const uint8_t PD6FaceIndices[] = {
+    constexpr uint8_t PD6FaceIndices[] = {
         0, 1, 1, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5
     };
 
@@ -592,15 +598,12 @@ namespace DiceVariants
         { 1000,  0000,  0000}, // FIXME
     };
 
-    const uint8_t D6V9LEDIndices[] = {
+    constexpr uint8_t D6V9LEDIndices[] = {
         // FIXME
         0,	1, 2, 3, 4, 5, 6,	7,	8,	9,	10,	11,	12,	13,	14,	15,	16,	17,	18,	19, 20,
     };
 
-    const uint8_t D6V9ElectricalIndices[] = {
-        // FIXME
-        0,	1, 2, 3, 4, 5, 6,	7,	8,	9,	10,	11,	12,	13,	14,	15,	16,	17,	18,	19, 20,
-    };
+    constexpr auto D6V9ElectricalIndices = invertIndices(D6V9LEDIndices);
 
     const Core::int3 D00LEDNormals[] = {
         // FIXME!!!
@@ -625,16 +628,83 @@ namespace DiceVariants
         { 065, -996, -055}, 
     };
 
-    const uint8_t D00LEDIndices[] = {
+    constexpr uint8_t D00LEDIndices[] = {
          0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
     };
 
-    const uint8_t D00ElectricalIndices[] = {
-         0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+    constexpr auto D00ElectricalIndices = invertIndices(D00LEDIndices);
+
+
+    // Returns the faces whose colors are averaged for the given LED (a constexpr version of
+    // Layout::faceIndicesFromLEDIndex() so it can be used to generate the tables below)
+    template <typename T>
+    constexpr int ledFaceIndices(LEDLayoutType layoutType, int ledIndex, T outFaces[]) {
+        switch (layoutType) {
+            case LEDLayoutType::DieLayoutType_D6_FD6:
+            case LEDLayoutType::DieLayoutType_D8:
+            case LEDLayoutType::DieLayoutType_D10_D00:
+            case LEDLayoutType::DieLayoutType_D12:
+            case LEDLayoutType::DieLayoutType_D20:
+                // For all these, led index == face index
+                outFaces[0] = ledIndex;
+                return 1;
+            case LEDLayoutType::DieLayoutType_PD6:
+                outFaces[0] = PD6FaceIndices[ledIndex];
+                return 1;
+            case LEDLayoutType::DieLayoutType_D4:
+                if (ledIndex == 4 || ledIndex == 5) {
+                    outFaces[0] = 0;
+                    outFaces[1] = 1;
+                    outFaces[2] = 2;
+                    outFaces[3] = 3;
+                    return 4;
+                } else {
+                    outFaces[0] = ledIndex;
+                    return 1;
+                }
+            case LEDLayoutType::DieLayoutType_M20:
+                // FIXME!!!
+                outFaces[0] = 0;
+                outFaces[1] = 1;
+                outFaces[2] = 2;
+                outFaces[3] = 3;
+                outFaces[4] = 4;
+                return 5;
+            default:
+                return 0;
+        }
+    }
+
+    template <int LEDCount>
+    struct DaisyChainLEDFacesTable
+    {
+        DaisyChainLEDFaces entries[LEDCount];
     };
 
+    // Fuses the daisy chain index -> LED index -> faces lookups
+    template <int LEDCount>
+    constexpr DaisyChainLEDFacesTable<LEDCount> makeDaisyChainLEDFaces(LEDLayoutType layoutType, const uint8_t (&ledIndices)[LEDCount]) {
+        DaisyChainLEDFacesTable<LEDCount> ret = {};
+        for (int i = 0; i < LEDCount; ++i) {
+            ret.entries[i].ledIndex = ledIndices[i];
+            ret.entries[i].faceCount = (uint8_t)ledFaceIndices(layoutType, ledIndices[i], ret.entries[i].faces);
+        }
+        return ret;
+    }
 
-    const Layout D20Layout = {
+    // LED index -> faces table, in daisy chain order
+    constexpr auto D20DaisyChainLEDFaces = makeDaisyChainLEDFaces(LEDLayoutType::DieLayoutType_D20, D20LEDIndices);
+    constexpr auto D12DaisyChainLEDFaces = makeDaisyChainLEDFaces(LEDLayoutType::DieLayoutType_D12, D12LEDIndices);
+    constexpr auto D10DaisyChainLEDFaces = makeDaisyChainLEDFaces(LEDLayoutType::DieLayoutType_D10_D00, D10LEDIndices);
+    constexpr auto D8DaisyChainLEDFaces = makeDaisyChainLEDFaces(LEDLayoutType::DieLayoutType_D8, D8LEDIndices);
+    constexpr auto D6DaisyChainLEDFaces = makeDaisyChainLEDFaces(LEDLayoutType::DieLayoutType_D6_FD6, D6LEDIndices);
+    constexpr auto D4DaisyChainLEDFaces = makeDaisyChainLEDFaces(LEDLayoutType::DieLayoutType_D4, D4LEDIndices);
+    constexpr auto PD6DaisyChainLEDFaces = makeDaisyChainLEDFaces(LEDLayoutType::DieLayoutType_PD6, PD6LEDIndices);
+    constexpr auto M20DaisyChainLEDFaces = makeDaisyChainLEDFaces(LEDLayoutType::DieLayoutType_M20, D12LEDIndices);
+    constexpr auto D6V9DaisyChainLEDFaces = makeDaisyChainLEDFaces(LEDLayoutType::DieLayoutType_D6V9, D6V9LEDIndices);
+    constexpr auto D00DaisyChainLEDFaces = makeDaisyChainLEDFaces(LEDLayoutType::DieLayoutType_D00, D00LEDIndices);
+
+    constexpr Layout D20Layout = {
         .layoutType = LEDLayoutType::DieLayoutType_D20,
         .faceCount = 20,
         .ledCount = 20,
@@ -642,12 +712,13 @@ namespace DiceVariants
         .faceNormals = D20Normals,
         .ledNormals = D20Normals,
         .faceIndexFromAnimFaceIndexLookup = D20Remap,
-        .daisyChainIndexFromLEDIndexLookup = D20ElectricalIndices,
+        .daisyChainIndexFromLEDIndexLookup = D20ElectricalIndices.values,
         .LEDIndexFromDaisyChainLookup = D20LEDIndices,
+        .daisyChainLEDFaces = D20DaisyChainLEDFaces.entries,
         .faceAdjacencyMap = D20Adjacency,
     };
 
-    const Layout D12Layout = {
+    constexpr Layout D12Layout = {
         .layoutType = LEDLayoutType::DieLayoutType_D12,
         .faceCount = 12,
         .ledCount = 12,
@@ -655,12 +726,13 @@ namespace DiceVariants
         .faceNormals = D12Normals,
         .ledNormals = D12Normals,
         .faceIndexFromAnimFaceIndexLookup = D12Remap,
-        .daisyChainIndexFromLEDIndexLookup = D12ElectricalIndices,
+        .daisyChainIndexFromLEDIndexLookup = D12ElectricalIndices.values,
         .LEDIndexFromDaisyChainLookup = D12LEDIndices,
+        .daisyChainLEDFaces = D12DaisyChainLEDFaces.entries,
         .faceAdjacencyMap = D12Adjacency,
     };
 
-    const Layout D10Layout = {
+    constexpr Layout D10Layout = {
         .layoutType = LEDLayoutType::DieLayoutType_D10_D00,
         .faceCount = 10,
         .ledCount = 10,
@@ -668,12 +740,13 @@ namespace DiceVariants
         .faceNormals = D10Normals,
         .ledNormals = D10Normals,
         .faceIndexFromAnimFaceIndexLookup = D10Remap,
-        .daisyChainIndexFromLEDIndexLookup = D10ElectricalIndices,
+        .daisyChainIndexFromLEDIndexLookup = D10ElectricalIndices.values,
         .LEDIndexFromDaisyChainLookup = D10LEDIndices,
+        .daisyChainLEDFaces = D10DaisyChainLEDFaces.entries,
         .faceAdjacencyMap = D10Adjacency,
     };
 
-    const Layout D8Layout = {
+    constexpr Layout D8Layout = {
         .layoutType = LEDLayoutType::DieLayoutType_D8,
         .faceCount = 8,
         .ledCount = 8,
@@ -681,12 +754,13 @@ namespace DiceVariants
         .faceNormals = D8Normals,
         .ledNormals = D8Normals,
         .faceIndexFromAnimFaceIndexLookup = D8Remap,
-        .daisyChainIndexFromLEDIndexLookup = D8ElectricalIndices,
+        .daisyChainIndexFromLEDIndexLookup = D8ElectricalIndices.values,
         .LEDIndexFromDaisyChainLookup = D8LEDIndices,
+        .daisyChainLEDFaces = D8DaisyChainLEDFaces.entries,
         .faceAdjacencyMap = D8Adjacency,
     };
 
-    const Layout D6Layout = {
+    constexpr Layout D6Layout = {
         .layoutType = LEDLayoutType::DieLayoutType_D6_FD6,
         .faceCount = 6,
         .ledCount = 6,
@@ -694,12 +768,13 @@ namespace DiceVariants
         .faceNormals = D6Normals,
         .ledNormals = D6Normals,
         .faceIndexFromAnimFaceIndexLookup = D6Remap,
-        .daisyChainIndexFromLEDIndexLookup = D6ElectricalIndices,
+        .daisyChainIndexFromLEDIndexLookup = D6ElectricalIndices.values,
         .LEDIndexFromDaisyChainLookup = D6LEDIndices,
+        .daisyChainLEDFaces = D6DaisyChainLEDFaces.entries,
         .faceAdjacencyMap = D6Adjacency,
     };
 
-    const Layout D4Layout = {
+    constexpr Layout D4Layout = {
         .layoutType = LEDLayoutType::DieLayoutType_D4,
         .faceCount = 4,
         .ledCount = 6,
@@ -707,13 +782,14 @@ namespace DiceVariants
         .faceNormals = D4FaceNormals,
         .ledNormals = D4LEDNormals,
         .faceIndexFromAnimFaceIndexLookup = D4Remap,
-        .daisyChainIndexFromLEDIndexLookup = D4ElectricalIndices,
+        .daisyChainIndexFromLEDIndexLookup = D4ElectricalIndices.values,
         .LEDIndexFromDaisyChainLookup = D4LEDIndices,
+        .daisyChainLEDFaces = D4DaisyChainLEDFaces.entries,
         .faceAdjacencyMap = D4Adjacency,
     };
 
     // Die layout information
-    const Layout PD6Layout = {
+    constexpr Layout PD6Layout = {
         .layoutType = LEDLayoutType::DieLayoutType_PD6,
         .faceCount = 6,
         .ledCount = 21,
@@ -721,12 +797,13 @@ namespace DiceVariants
         .faceNormals = PD6FaceNormals,
         .ledNormals = PD6LEDNormals,
         .faceIndexFromAnimFaceIndexLookup = D6Remap,
-        .daisyChainIndexFromLEDIndexLookup = PD6ElectricalIndices,
+        .daisyChainIndexFromLEDIndexLookup = PD6ElectricalIndices.values,
         .LEDIndexFromDaisyChainLookup = PD6LEDIndices,
+        .daisyChainLEDFaces = PD6DaisyChainLEDFaces.entries,
         .faceAdjacencyMap = D6Adjacency,
     };
 
-    const Layout M20Layout = {
+    constexpr Layout M20Layout = {
         .layoutType = LEDLayoutType::DieLayoutType_M20,
         .faceCount = 20,
         .ledCount = 12,
@@ -734,12 +811,13 @@ namespace DiceVariants
         .faceNormals = M20FaceNormals,
         .ledNormals = M20LEDNormals,
         .faceIndexFromAnimFaceIndexLookup = D20Remap,
-        .daisyChainIndexFromLEDIndexLookup = D12ElectricalIndices,
+        .daisyChainIndexFromLEDIndexLookup = D12ElectricalIndices.values,
         .LEDIndexFromDaisyChainLookup = D12LEDIndices,
+        .daisyChainLEDFaces = M20DaisyChainLEDFaces.entries,
         .faceAdjacencyMap = D20Adjacency,
     };
 
-    const Layout D6V9Layout = {
+    constexpr Layout D6V9Layout = {
         .layoutType = LEDLayoutType::DieLayoutType_D6V9,
         .faceCount = 6,
         .ledCount = 21,
@@ -747,12 +825,13 @@ namespace DiceVariants
         .faceNormals = D6Normals,
         .ledNormals = D6V9LEDNormals,
         .faceIndexFromAnimFaceIndexLookup = D6Remap,
-        .daisyChainIndexFromLEDIndexLookup = D6V9ElectricalIndices,
+        .daisyChainIndexFromLEDIndexLookup = D6V9ElectricalIndices.values,
         .LEDIndexFromDaisyChainLookup = D6V9LEDIndices,
+        .daisyChainLEDFaces = D6V9DaisyChainLEDFaces.entries,
         .faceAdjacencyMap = D6Adjacency,
     };
 
-    const Layout D00Layout = {
+    constexpr Layout D00Layout = {
         .layoutType = LEDLayoutType::DieLayoutType_D00,
         .faceCount = 10,
         .ledCount = 19,
@@ -760,11 +839,61 @@ namespace DiceVariants
         .faceNormals = D10Normals,
         .ledNormals = D00LEDNormals,
         .faceIndexFromAnimFaceIndexLookup = D10Remap,
-        .daisyChainIndexFromLEDIndexLookup = D00ElectricalIndices,
+        .daisyChainIndexFromLEDIndexLookup = D00ElectricalIndices.values,
         .LEDIndexFromDaisyChainLookup = D00LEDIndices,
+        .daisyChainLEDFaces = D00DaisyChainLEDFaces.entries,
         .faceAdjacencyMap = D10Adjacency,
     };
 
+    // Checks that each lookup table of the layout holds every index exactly once (i.e. is a permutation)
+    constexpr bool isPermutation(const uint8_t* indices, int count) {
+        uint32_t seen = 0;
+        for (int i = 0; i < count; ++i) {
+            if (indices[i] >= count || (seen & (1u << indices[i])) != 0) {
+                return false;
+            }
+            seen |= 1u << indices[i];
+        }
+        return true;
+    }
+
+    constexpr bool isValid(const Layout& layout) {
+        if (!isPermutation(layout.LEDIndexFromDaisyChainLookup, layout.ledCount)) {
+            return false;
+        }
+        for (int f = 0; f < layout.faceCount; ++f) {
+            if (!isPermutation(layout.faceIndexFromAnimFaceIndexLookup + f * layout.faceCount, layout.faceCount)) {
+                return false;
+            }
+            // Adjacency goes both ways
+            uint32_t adj = layout.faceAdjacencyMap[f];
+            int count = 0;
+            for (int i = 0; i < layout.faceCount; ++i) {
+                if ((adj & (1u << i)) != 0) {
+                    if ((layout.faceAdjacencyMap[i] & (1u << f)) == 0) {
+                        return false;
+                    }
+                    count++;
+                }
+            }
+            if (count != layout.adjacencyCount) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static_assert(isValid(D20Layout), "Invalid D20 layout tables");
+    static_assert(isValid(D12Layout), "Invalid D12 layout tables");
+    static_assert(isValid(D10Layout), "Invalid D10 layout tables");
+    static_assert(isValid(D8Layout), "Invalid D8 layout tables");
+    static_assert(isValid(D6Layout), "Invalid D6 layout tables");
+    static_assert(isValid(D4Layout), "Invalid D4 layout tables");
+    static_assert(isValid(PD6Layout), "Invalid PD6 layout tables");
+    static_assert(isValid(M20Layout), "Invalid M20 layout tables");
+    static_assert(isValid(D6V9Layout), "Invalid D6V9 layout tables");
+    static_assert(isValid(D00Layout), "Invalid D00 layout tables");
+
 
     // Given a die type, return the matching layout (for normals, face ordering, remapping, etc...)
     LEDLayoutType getLayoutType(DieType dieType, BoardModel boardModel) {
@@ -870,78 +999,27 @@ namespace DiceVariants
         return faceIndexFromAnimFaceIndexLookup[upFace * faceCount + faceIndex];
     }
 
-    int Layout::faceIndicesFromLEDIndex(int ledIndex, int outFaces[]) const {
-        switch (layoutType) {
-            case LEDLayoutType::DieLayoutType_D6_FD6:
-            case LEDLayoutType::DieLayoutType_D8:
-            case LEDLayoutType::DieLayoutType_D10_D00:
-            case LEDLayoutType::DieLayoutType_D12:
-            case LEDLayoutType::DieLayoutType_D20:
-                // For all these, led index == face index
-                outFaces[0] = ledIndex;
-                return 1;
-            case LEDLayoutType::DieLayoutType_PD6:
-                outFaces[0] = PD6FaceIndices[ledIndex];
-                return 1;
-            case LEDLayoutType::DieLayoutType_D4:
-                if (ledIndex == 4 || ledIndex == 5) {
-                    outFaces[0] = 0;
-                    outFaces[1] = 1;
-                    outFaces[2] = 2;
-                    outFaces[3] = 3;
-                    return 4;
-                } else {
-                    outFaces[0] = ledIndex;
-                    return 1;
-                }
-            case LEDLayoutType::DieLayoutType_M20:
-                // FIXME!!!
-                outFaces[0] = 0;
-                outFaces[1] = 1;
-                outFaces[2] = 2;
-                outFaces[3] = 3;
-                outFaces[4] = 4;
-                return 5;
-            default:
-                return 0;
+    const uint8_t* Layout::getFaceRemap(int upFace) const {
+        if (upFace < 0 || upFace >= faceCount) {
+            upFace = 0;
         }
+        return faceIndexFromAnimFaceIndexLookup + upFace * faceCount;
     }
 
+    int Layout::faceIndicesFromLEDIndex(int ledIndex, int outFaces[]) const {
+        return ledFaceIndices(layoutType, ledIndex, outFaces);
+    }
+
+    const DaisyChainLEDFaces* Layout::getDaisyChainLEDFaces() const {
+        return daisyChainLEDFaces;
+    }
 
     uint32_t Layout::getTopFaceMask() const {
-        switch (layoutType) {
-            case LEDLayoutType::DieLayoutType_D4:
-            case LEDLayoutType::DieLayoutType_D6_FD6:
-            case LEDLayoutType::DieLayoutType_D8:
-            case LEDLayoutType::DieLayoutType_D10_D00:
-            case LEDLayoutType::DieLayoutType_D12:
-            case LEDLayoutType::DieLayoutType_D20:
-                return 1 << getTopFace();
-            case LEDLayoutType::DieLayoutType_PD6:
-                return 0b111111 << 15;
-            default:
-                return 0xFFFFFFFF;
-        }
-   }
+        return DiceVariants::getTopFaceMask(layoutType);
+    }
 
     uint8_t Layout::getTopFace() const {
-        switch (layoutType) {
-            case LEDLayoutType::DieLayoutType_D4:
-                return 3;
-            case LEDLayoutType::DieLayoutType_D6_FD6:
-            case LEDLayoutType::DieLayoutType_PD6:
-                return 5;
-            case LEDLayoutType::DieLayoutType_D8:
-                return 7;
-            case LEDLayoutType::DieLayoutType_D10_D00:
-                return 0;
-            case LEDLayoutType::DieLayoutType_D12:
-                return 11;
-            case LEDLayoutType::DieLayoutType_D20:
-                return 19;
-            default:
-                return 0;
-        }
+        return DiceVariants::getTopFace(layoutType);
     }
 
     uint8_t Layout::getAdjacentFaces(uint8_t face, uint8_t retFaces[]) const {
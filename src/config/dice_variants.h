@@ -4,6 +4,9 @@
 #include "stdint.h"
 #include "board_config.h"
 
+// Most faces a single LED can be blended from (M20 LEDs sit between 5 faces)
+#define MAX_FACES_PER_LED 5
+
 namespace Config::DiceVariants
 {
     enum DieType : uint8_t
@@ -49,6 +52,52 @@ namespace Config::DiceVariants
         DieLayoutType_D00,
     };
 
+    // Precomputed information for one LED, indexed by daisy chain index
+    struct DaisyChainLEDFaces
+    {
+        uint8_t ledIndex;   // Logical LED index
+        uint8_t faceCount;  // Number of faces whose colors are averaged for this LED
+        uint8_t faces[MAX_FACES_PER_LED];
+    };
+
+    // The face that is up when the die sits in its canonical orientation, and the mask of the
+    // LEDs that light it, usable at compile time (e.g. to build the default data set)
+    constexpr uint8_t getTopFace(LEDLayoutType layoutType) {
+        switch (layoutType) {
+            case LEDLayoutType::DieLayoutType_D4:
+                return 3;
+            case LEDLayoutType::DieLayoutType_D6_FD6:
+            case LEDLayoutType::DieLayoutType_PD6:
+                return 5;
+            case LEDLayoutType::DieLayoutType_D8:
+                return 7;
+            case LEDLayoutType::DieLayoutType_D10_D00:
+                return 0;
+            case LEDLayoutType::DieLayoutType_D12:
+                return 11;
+            case LEDLayoutType::DieLayoutType_D20:
+                return 19;
+            default:
+                return 0;
+        }
+    }
+
+    constexpr uint32_t getTopFaceMask(LEDLayoutType layoutType) {
+        switch (layoutType) {
+            case LEDLayoutType::DieLayoutType_D4:
+            case LEDLayoutType::DieLayoutType_D6_FD6:
+            case LEDLayoutType::DieLayoutType_D8:
+            case LEDLayoutType::DieLayoutType_D10_D00:
+            case LEDLayoutType::DieLayoutType_D12:
+            case LEDLayoutType::DieLayoutType_D20:
+                return 1 << getTopFace(layoutType);
+            case LEDLayoutType::DieLayoutType_PD6:
+                return 0b111111 << 15;
+            default:
+                return 0xFFFFFFFF;
+        }
+    }
+
     struct Layout
     {
         LEDLayoutType layoutType;
@@ -67,14 +116,21 @@ namespace Config::DiceVariants
 
         const uint8_t* LEDIndexFromDaisyChainLookup;            // Reverse lookup for daisy chain index to LED index
 
+        const DaisyChainLEDFaces* daisyChainLEDFaces;           // Faces of each LED, indexed by daisy chain index
+
         const uint32_t* faceAdjacencyMap;                       // Bitfield indicating which faces are adjacent to the current face
 
         int daisyChainIndexFromLEDIndex(int daisyChainIndex) const;
         int LEDIndexFromDaisyChainIndex(int daisyChainIndex) const;
 
         int remapFaceIndexBasedOnUpFace(int upFace, int faceIndex) const;
+        // Row of the remap table for the given up face (faceCount entries), any invalid face gives the first row
+        const uint8_t* getFaceRemap(int upFace) const;
         int faceIndicesFromLEDIndex(int ledIndex, int outFaces[]) const;
 
+        // Fused daisy chain index -> LED index -> faces table, generated at compile time
+        const DaisyChainLEDFaces* getDaisyChainLEDFaces() const;
+
         uint32_t getTopFaceMask() const;
         uint8_t getTopFace() const;
         uint8_t getAdjacentFaces(uint8_t face, uint8_t retFaces[]) const;
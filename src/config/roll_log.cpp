@@ -0,0 +1,282 @@
+#include "roll_log.h"
+#include "drivers_nrf/flash.h"
+#include "drivers_nrf/timers.h"
+#include "app_timer.h"
+#include "app_util_platform.h"
+#include "core/queue.h"
+#include "nrf_log.h"
+
+// Records waiting to be written to flash
+#define MAX_PENDING_RECORDS 8
+
+// A failed erase is tried again after this long, rather than waiting for the next roll
+#define ROLL_LOG_RETRY_MS 1000
+
+#define ERASED_WORD 0xFFFFFFFF
+#define MAX_RECORD_SECONDS 0x7FF
+#define MAX_MARKER_VALUE 0x7FFFFFE
+#define SESSION_MARKER 0
+
+using namespace DriversNRF;
+using namespace Core;
+
+namespace Config::RollLog
+{
+    static Queue<uint32_t, MAX_PENDING_RECORDS> pendingRecords;
+
+    static uint32_t currentPage = 0;    // Index of the page being written to
+    static uint16_t currentSequence = 0;
+    static uint32_t writeOffset = 0;    // Offset of the next record in the current page
+    static uint16_t recordCount = 0;
+
+    static bool ready = false;          // Set once the pages have been scanned (and erased if need be)
+    static bool writing = false;        // A flash operation is in progress
+    static bool paused = false;
+
+    static bool sessionStarted = false;
+    static uint32_t lastRecordMs = 0;
+
+    // Word being written, needs to stay valid until the write completes
+    static uint32_t writeWord;
+
+    // Records lost when the page being erased is recycled, only taken off the count once it's erased
+    static uint16_t recycledRecords = 0;
+
+    APP_TIMER_DEF(retryTimer);
+
+    void pump();
+    void eraseAll();
+
+    uint32_t pageAddress(uint32_t page) {
+        return Flash::getRollLogStartAddress() + page * Flash::getPageSize();
+    }
+
+    const uint32_t* pageWords(uint32_t page) {
+        return (const uint32_t*)pageAddress(page);
+    }
+
+    bool isValidHeader(uint32_t header) {
+        return (header & 0xFFFF0000) == ROLL_LOG_PAGE_MAGIC;
+    }
+
+    void init() {
+        Timers::createTimer(&retryTimer, APP_TIMER_MODE_SINGLE_SHOT, [](void* context) {
+            if (ready) {
+                pump();
+            } else if (!writing) {
+                // The formatting erase failed
+                eraseAll();
+            }
+        });
+
+        const uint32_t pageCount = Flash::getRollLogPageCount();
+        const uint32_t wordsPerPage = Flash::getPageSize() / 4;
+
+        // Find the most recent page, it's the one we're appending to
+        bool found = false;
+        recordCount = 0;
+        for (uint32_t p = 0; p < pageCount; ++p) {
+            uint32_t header = pageWords(p)[0];
+            if (isValidHeader(header)) {
+                uint16_t seq = header & 0xFFFF;
+                if (!found || (int16_t)(seq - currentSequence) > 0) {
+                    currentPage = p;
+                    currentSequence = seq;
+                }
+                found = true;
+
+                // Count the records, they end at the first erased word
+                for (uint32_t w = 1; w < wordsPerPage && pageWords(p)[w] != ERASED_WORD; ++w) {
+                    recordCount++;
+                }
+            }
+        }
+
+        if (found) {
+            writeOffset = 4;
+            const uint32_t* words = pageWords(currentPage);
+            while (writeOffset < Flash::getPageSize() && words[writeOffset / 4] != ERASED_WORD) {
+                writeOffset += 4;
+            }
+            ready = true;
+            NRF_LOG_INFO("Roll log init, %d records, page %d", recordCount, currentPage);
+        } else {
+            // Not formatted yet (or left over data from a larger data set)
+            NRF_LOG_INFO("Roll log init, formatting");
+            eraseAll();
+        }
+    }
+
+    /// <summary>
+    /// Erases all the pages and starts over with the first one
+    /// </summary>
+    void eraseAll() {
+        ready = false;
+        writing = true;
+        Flash::erase(nullptr, pageAddress(0), Flash::getRollLogPageCount(), [](void* context, bool result, uint32_t address, uint16_t size) {
+            writing = false;
+            if (result) {
+                currentPage = 0;
+                currentSequence = 0;
+                writeOffset = 0; // Header is written by pump()
+                recordCount = 0;
+                ready = true;
+                pump();
+            } else {
+                NRF_LOG_ERROR("Could not erase roll log");
+                Timers::startTimer(retryTimer, ROLL_LOG_RETRY_MS);
+            }
+        }, Flash::Priority_Low);
+    }
+
+    /// <summary>
+    /// Writes the next pending record, recycling the oldest page when the current one is full.
+    /// Each page is only erased once per trip around the log, which spreads wear evenly.
+    /// Every flash completion pumps the next record, so the queue drains without waiting for another roll.
+    /// </summary>
+    void pump() {
+        // Flash operations are queued by the driver, records just go after whatever else is pending
+        if (!ready || writing || paused) {
+            return;
+        }
+
+        // Don't recycle a page (or format one) until there's something to write to it
+        if (pendingRecords.count() == 0) {
+            return;
+        }
+
+        if (writeOffset >= Flash::getPageSize()) {
+            // Move on to the next page, erasing it first
+            const uint32_t nextPage = (currentPage + 1) % Flash::getRollLogPageCount();
+            const uint32_t wordsPerPage = Flash::getPageSize() / 4;
+            recycledRecords = 0;
+            if (isValidHeader(pageWords(nextPage)[0])) {
+                for (uint32_t w = 1; w < wordsPerPage && pageWords(nextPage)[w] != ERASED_WORD; ++w) {
+                    recycledRecords++;
+                }
+            }
+            writing = true;
+            Flash::erase(nullptr, pageAddress(nextPage), 1, [](void* context, bool result, uint32_t address, uint16_t size) {
+                writing = false;
+                if (!result) {
+                    // Don't write over a page that may not be blank, the records stay queued until the retry
+                    NRF_LOG_ERROR("Could not erase roll log page");
+                    Timers::startTimer(retryTimer, ROLL_LOG_RETRY_MS);
+                    return;
+                }
+                recordCount -= recycledRecords;
+                currentPage = (currentPage + 1) % Flash::getRollLogPageCount();
+                currentSequence++;
+                writeOffset = 0;
+                pump();
+            }, Flash::Priority_Low);
+        } else if (writeOffset == 0) {
+            // Fresh page, write its header
+            writeWord = ROLL_LOG_PAGE_MAGIC | currentSequence;
+            writing = true;
+            Flash::write(nullptr, pageAddress(currentPage), &writeWord, sizeof(writeWord), [](void* context, bool result, uint32_t address, uint16_t size) {
+                writing = false;
+                writeOffset = 4;
+                pump();
+            }, Flash::Priority_Low);
+        } else if (pendingRecords.tryDequeue(writeWord)) {
+            writing = true;
+            Flash::write(nullptr, pageAddress(currentPage) + writeOffset, &writeWord, sizeof(writeWord), [](void* context, bool result, uint32_t address, uint16_t size) {
+                writing = false;
+                if (result) {
+                    recordCount++;
+                } else {
+                    NRF_LOG_ERROR("Could not write roll log record");
+                }
+                // Never write to the same word twice, even on failure
+                writeOffset += 4;
+                pump();
+            }, Flash::Priority_Low);
+        }
+    }
+
+    bool enqueue(uint32_t record) {
+        if (!pendingRecords.enqueue(record)) {
+            NRF_LOG_WARNING("Roll log pending queue full");
+            return false;
+        }
+        return true;
+    }
+
+    uint32_t saturate(uint32_t value, uint32_t max) {
+        return value > max ? max : value;
+    }
+
+    bool appendRoll(uint8_t face, uint32_t durationMs, uint32_t peakAgitationTimes1000) {
+        uint32_t now = Timers::millis();
+        bool ret = true;
+        if (!sessionStarted) {
+            // The timer restarts from 0 on reset, so mark the beginning of a new session
+            ret = enqueue((SESSION_MARKER << 5) | ROLL_LOG_MARKER_FACE);
+            sessionStarted = true;
+            lastRecordMs = 0;
+        }
+
+        uint32_t seconds = (now - lastRecordMs) / 1000;
+        if (seconds > MAX_RECORD_SECONDS) {
+            ret = enqueue((saturate(seconds, MAX_MARKER_VALUE) << 5) | ROLL_LOG_MARKER_FACE) && ret;
+            seconds = 0;
+        }
+        lastRecordMs = now;
+
+        uint32_t record = (face & 0x1F)
+            | (seconds << 5)
+            | (saturate(durationMs / ROLL_LOG_DURATION_UNIT_MS, 0xFF) << 16)
+            | (saturate(peakAgitationTimes1000 / ROLL_LOG_AGITATION_UNIT, 0xFF) << 24);
+        ret = enqueue(record) && ret;
+        pump();
+        return ret;
+    }
+
+    bool clear() {
+        if (writing) {
+            NRF_LOG_WARNING("Roll log busy, not cleared");
+            return false;
+        }
+        pendingRecords.clear();
+        eraseAll();
+        return true;
+    }
+
+    void pause() {
+        paused = true;
+    }
+
+    void resume() {
+        paused = false;
+        pump();
+    }
+
+    void forEachRecord(RecordMethod method, void* param) {
+        const uint32_t pageCount = Flash::getRollLogPageCount();
+        const uint32_t wordsPerPage = Flash::getPageSize() / 4;
+
+        // The page after the current one is the oldest
+        for (uint32_t i = 1; i <= pageCount; ++i) {
+            uint32_t p = (currentPage + i) % pageCount;
+            const uint32_t* words = pageWords(p);
+            if (isValidHeader(words[0])) {
+                for (uint32_t w = 1; w < wordsPerPage && words[w] != ERASED_WORD; ++w) {
+                    method(param, words[w]);
+                }
+            }
+        }
+    }
+
+    const uint8_t* getData() {
+        return (const uint8_t*)Flash::getRollLogStartAddress();
+    }
+
+    uint32_t getByteSize() {
+        return Flash::getRollLogPageCount() * Flash::getPageSize();
+    }
+
+    uint16_t getRecordCount() {
+        return recordCount;
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace Config::RollLog
+{
+    // Each page of the log starts with a header word: this magic and the page sequence number
+    #define ROLL_LOG_PAGE_MAGIC 0x524C0000
+
+    // Records are stored as 32 bits words:
+    // - bits 0-4: face index, ROLL_LOG_CROOKED_FACE for a crooked landing, or ROLL_LOG_MARKER_FACE for a marker record
+    // - bits 5-15: seconds since the previous record
+    // - bits 16-23: roll duration in ROLL_LOG_DURATION_UNIT_MS units
+    // - bits 24-31: peak agitation in ROLL_LOG_AGITATION_UNIT units (1/1000th of g)
+    // Marker records store their value in bits 5-31: 0 is the start of a new session (after a reset),
+    // anything else is a time gap (in seconds) too long to fit in the following record
+    #define ROLL_LOG_MARKER_FACE 0x1F
+    #define ROLL_LOG_CROOKED_FACE 0x1E
+    #define ROLL_LOG_DURATION_UNIT_MS 20
+    #define ROLL_LOG_AGITATION_UNIT 32
+
+    void init();
+
+    // Appends a roll result, the write to flash happens asynchronously
+    bool appendRoll(uint8_t face, uint32_t durationMs, uint32_t peakAgitationTimes1000);
+
+    // Calls the method for every record stored in flash, oldest first
+    typedef void (*RecordMethod)(void* param, uint32_t record);
+    void forEachRecord(RecordMethod method, void* param);
+
+    inline uint8_t recordFace(uint32_t record) { return record & 0x1F; }
+    inline uint32_t recordDurationMs(uint32_t record) { return ((record >> 16) & 0xFF) * ROLL_LOG_DURATION_UNIT_MS; }
+
+    // Erases all the records, returns false if the log is busy writing and nothing was cleared
+    bool clear();
+
+    // While paused, records are kept in RAM, for instance while the pages are being downloaded
+    void pause();
+    void resume();
+
+    // The log pages are memory mapped, in flash order (use the page headers to order them)
+    const uint8_t* getData();
+    uint32_t getByteSize();
+    uint16_t getRecordCount();
+}
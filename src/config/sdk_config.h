@@ -99,6 +99,17 @@
 #define NRFX_GPIOTE_CONFIG_IRQ_PRIORITY 6
 
 
+//==========================================================
+// <e> NRFX_COMP_ENABLED - nrfx_comp - COMP peripheral driver
+//==========================================================
+#ifndef NRFX_COMP_ENABLED
+#define NRFX_COMP_ENABLED 1
+#endif
+
+// <o> NRFX_COMP_CONFIG_IRQ_PRIORITY  - Interrupt priority
+// <0=> 0 (highest) -> 7 (lowest)
+#define NRFX_COMP_CONFIG_IRQ_PRIORITY 6
+
 //==========================================================
 // <e> NRFX_PPI_ENABLED - nrfx_ppi - PPI peripheral allocator
 //==========================================================
@@ -141,7 +152,7 @@
 #define NRFX_TIMER1_ENABLED 1
 
 // <q> NRFX_TIMER2_ENABLED  - Enable TIMER2 instance
-#define NRFX_TIMER2_ENABLED 0
+#define NRFX_TIMER2_ENABLED 1
 
 // <q> NRFX_TIMER3_ENABLED  - Enable TIMER3 instance
 #define NRFX_TIMER3_ENABLED 0
@@ -517,19 +528,30 @@
 // <i> Requested BLE GAP data length to be negotiated.
 #define NRF_SDH_BLE_GAP_DATA_LENGTH 132
 
+// Optional BLE 5 extended advertising (set by the makefile), falls back to legacy advertising
+// at runtime if the SoftDevice rejects the advertising set
+#ifndef BLE_EXTENDED_ADVERTISING
+#define BLE_EXTENDED_ADVERTISING 0
+#endif
+
+// Centrals connected on top of the main one, only notified of the roll state (set by the makefile)
+#ifndef BLE_LISTENER_LINK_COUNT
+#define BLE_LISTENER_LINK_COUNT 0
+#endif
+
 // <o> NRF_SDH_BLE_PERIPHERAL_LINK_COUNT - Maximum number of peripheral links. 
-#define NRF_SDH_BLE_PERIPHERAL_LINK_COUNT 1
+#define NRF_SDH_BLE_PERIPHERAL_LINK_COUNT (1 + BLE_LISTENER_LINK_COUNT)
 
 // <o> NRF_SDH_BLE_CENTRAL_LINK_COUNT - Maximum number of central links. 
 #define NRF_SDH_BLE_CENTRAL_LINK_COUNT 0
 
 // <o> NRF_SDH_BLE_TOTAL_LINK_COUNT - Total link count. 
 // <i> Maximum number of total concurrent connections using the default configuration.
-#define NRF_SDH_BLE_TOTAL_LINK_COUNT 1
+#define NRF_SDH_BLE_TOTAL_LINK_COUNT (1 + BLE_LISTENER_LINK_COUNT)
 
 // <o> NRF_SDH_BLE_GAP_EVENT_LENGTH - GAP event length. 
 // <i> The time set aside for this connection on every connection interval in 1.25 ms units.
-#define NRF_SDH_BLE_GAP_EVENT_LENGTH 6
+#define NRF_SDH_BLE_GAP_EVENT_LENGTH 12
 
 // <o> NRF_SDH_BLE_GATT_MAX_MTU_SIZE - Static maximum MTU size. 
 #define NRF_SDH_BLE_GATT_MAX_MTU_SIZE 128
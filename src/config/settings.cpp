@@ -9,16 +9,12 @@
 #include "bluetooth/bluetooth_stack.h"
 #include "bluetooth/bluetooth_message_service.h"
 #include "bluetooth/bulk_data_transfer.h"
-#include "malloc.h"
 #include "config/dice_variants.h"
 #include "utils/utils.h"
 #include "data_set/data_set.h"
 #include "pixel.h"
 #include "app_error.h"
 
-#define SETTINGS_VALID_KEY (0x15E77165) // 1SETTINGS in leet speak ;)
-#define SETTINGS_PAGE_COUNT 1
-
 using namespace DriversNRF;
 using namespace Bluetooth;
 using namespace Config;
@@ -28,12 +24,23 @@ using namespace DataSet;
 namespace Config::SettingsManager
 {
     static Settings const * settings = nullptr;
+    static bool settingsValid = false;  // Markers of the settings record, checked when it moves
+
+    // Die type, colorway and layout are looked up in the value store and the settings,
+    // they're resolved once and kept until either is reprogrammed (see invalidateCache)
+    static bool cacheValid = false;
+    static DiceVariants::DieType cachedDieType;
+    static DiceVariants::Colorway cachedColorway;
+    static DiceVariants::LEDLayoutType cachedLayoutType;
+    static const DiceVariants::Layout* cachedLayout;
 
     void ProgramDefaultParametersHandler(const Message* msg);
     void SetDesignTypeAndColorHandler(const Message* msg);
     void SetNameHandler(const Message* msg);
     void SetDebugFlagsHandler(const Message* msg);
     void clearSettingsHandler(const Message* msg);
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt);
+    static void loadSettings();
     
     #if BLE_LOG_ENABLED
     void PrintNormals(const Message* msg) {
@@ -48,11 +55,15 @@ namespace Config::SettingsManager
         static InitCallback _callback; // Don't initialize this static inline because it would only do it on first call!
         _callback = callback;
 
-        settings = (Settings const * const)Flash::getSettingsStartAddress();
+        loadSettings();
 
         auto finishInit = [](bool success) {
             APP_ERROR_CHECK(success ? NRF_SUCCESS : NRF_ERROR_INTERNAL);
 
+            // Programming the defaults appended a new record
+            loadSettings();
+            Flash::hookProgrammingEvent(onProgrammingEvent, nullptr);
+
             // Register as a handler to program settings
             MessageService::RegisterMessageHandler(Message::MessageType_ProgramDefaultParameters, ProgramDefaultParametersHandler);
             MessageService::RegisterMessageHandler(Message::MessageType_SetDesignAndColor, SetDesignTypeAndColorHandler);
@@ -80,46 +91,83 @@ namespace Config::SettingsManager
         }
     }
 
-    bool checkValid() {
-        return (settings->headMarker == SETTINGS_VALID_KEY &&
+    /// <summary>
+    /// Points to the current settings record and validates it. The record doesn't change until
+    /// the next programming ends, so the accelerometer can read it for every sample without
+    /// checking the markers again.
+    /// </summary>
+    static void loadSettings() {
+        settings = (Settings const * const)Flash::getSettingsAddress();
+        settingsValid = settings->headMarker == SETTINGS_VALID_KEY &&
             settings->version == SETTINGS_VERSION &&
-            settings->tailMarker == SETTINGS_VALID_KEY);
+            settings->tailMarker == SETTINGS_VALID_KEY;
+        invalidateCache();
+    }
+
+    bool checkValid() {
+        return settingsValid;
     }
 
     Settings const * const getSettings() {
-        if (!checkValid()) {
-            return nullptr;
-        } else {
-            return settings;
-        }
+        return settingsValid ? settings : nullptr;
     }
 
-    DiceVariants::DieType getDieType() {
-        // First check the data store
+    /// <summary>
+    /// Resolves the die type, colorway and layout, reading the value store is a scan of the UICR registers
+    /// </summary>
+    static void updateCache() {
+        // First check the data store, then the settings
         const int dieTypeFromStore = ValueStore::readValue(ValueStore::ValueType_DieType);
         if (dieTypeFromStore != -1) {
-            return (DiceVariants::DieType)dieTypeFromStore;
+            cachedDieType = (DiceVariants::DieType)dieTypeFromStore;
+        } else if (checkValid()) {
+            cachedDieType = settings->dieType;
         } else {
-            // then check settings
-            if (checkValid()) {
-                return settings->dieType;
-            } else {
-                return DiceVariants::estimateDieTypeFromBoard();
-            }
+            cachedDieType = DiceVariants::estimateDieTypeFromBoard();
+        }
+
+        const int colorWayFromStore = ValueStore::readValue(ValueStore::ValueType_Colorway);
+        if (colorWayFromStore != -1) {
+            cachedColorway = (DiceVariants::Colorway)colorWayFromStore;
+        } else {
+            cachedColorway = checkValid() ? settings->colorway : DiceVariants::Colorway_Unknown;
         }
+
+        cachedLayoutType = DiceVariants::getLayoutType(cachedDieType, (BoardModel)(BoardManager::getBoard()->model));
+        cachedLayout = DiceVariants::getLayout(cachedLayoutType);
+        cacheValid = true;
+    }
+
+    void invalidateCache() {
+        cacheValid = false;
+    }
+
+    DiceVariants::DieType getDieType() {
+        if (!cacheValid) {
+            updateCache();
+        }
+        return cachedDieType;
     }
 
     DiceVariants::Colorway getColorway() {
-        const int colorWayFromStore = ValueStore::readValue(ValueStore::ValueType_Colorway);
-        return colorWayFromStore != -1 ? (DiceVariants::Colorway)colorWayFromStore : SettingsManager::getSettings()->colorway;
+        if (!cacheValid) {
+            updateCache();
+        }
+        return cachedColorway;
     }
 
     DiceVariants::LEDLayoutType getLayoutType() {
-        return DiceVariants::getLayoutType(getDieType(), (BoardModel)(BoardManager::getBoard()->model));
+        if (!cacheValid) {
+            updateCache();
+        }
+        return cachedLayoutType;
     }
 
     const DiceVariants::Layout* getLayout() {
-        return DiceVariants::getLayout(getLayoutType());
+        if (!cacheValid) {
+            updateCache();
+        }
+        return cachedLayout;
     }
 
     void setDefaultParameters(Settings& outSettings) {
@@ -177,6 +225,15 @@ namespace Config::SettingsManager
         outSettings.tailMarker = SETTINGS_VALID_KEY;
     }
 
+    /// <summary>
+    /// Appends the new settings to the settings journal, without touching the data set
+    /// </summary>
+    void programSettings(const Settings& newSettings, SettingsWrittenCallback callback) {
+        if (!Flash::programSettings(newSettings, callback)) {
+            callback(false);
+        }
+    }
+
     void programDefaults(SettingsWrittenCallback callback) {
         Settings defaults;
         setDefaults(defaults);
@@ -216,7 +273,7 @@ namespace Config::SettingsManager
         memcpy(&(settingsCopy.faceNormals[0]), newNormals, count * sizeof(Core::int3));
 
         // Reprogram settings
-        DataSet::ProgramDefaultDataSet(settingsCopy, callback);
+        programSettings(settingsCopy, callback);
     }
 
     void programDesignAndColor(DiceVariants::DieType dieType, DiceVariants::Colorway colorway, SettingsWrittenCallback callback) {
@@ -256,7 +313,7 @@ namespace Config::SettingsManager
             // Reprogram settings
             static SettingsWrittenCallback programNameCallback = nullptr;
             programNameCallback = callback;
-            DataSet::ProgramDefaultDataSet(settingsCopy, [] (bool success) {
+            programSettings(settingsCopy, [] (bool success) {
                 // We want to reset once disconnected so to apply the name change
                 Bluetooth::Stack::resetOnDisconnect();
                 auto callback = programNameCallback;
@@ -271,6 +328,28 @@ namespace Config::SettingsManager
         }
     }
 
+    void programRollThresholds(int lowerTimes1000, int middleTimes1000, int upperTimes1000, SettingsWrittenCallback callback) {
+
+        // Grab current settings
+        Settings settingsCopy;
+        memcpy(&settingsCopy, settings, sizeof(Settings));
+
+        // Update roll detection parameters
+        settingsCopy.lowerThresholdTimes1000 = lowerTimes1000;
+        settingsCopy.middleThresholdTimes1000 = middleTimes1000;
+        settingsCopy.upperThresholdTimes1000 = upperTimes1000;
+        NRF_LOG_INFO("Setting roll thresholds to %d, %d, %d", lowerTimes1000, middleTimes1000, upperTimes1000);
+
+        // Reprogram settings
+        programSettings(settingsCopy, callback);
+    }
+
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt) {
+        if (evt == Flash::ProgrammingEventType_End) {
+            loadSettings();
+        }
+    }
+
     void ProgramDefaultParametersHandler(const Message* msg) {
         programDefaultParameters([] (bool result) {
             // Ignore result for now
@@ -10,6 +10,8 @@
 #define MAX_NAME_LENGTH 31  // See BLE_GAP_DEVNAME_DEFAULT_LEN
 #define MAX_CUSTOM_DESIGN_COLOR_LENGTH 31
 
+#define SETTINGS_VALID_KEY (0x15E77165) // 1SETTINGS in leet speak ;)
+
 namespace Config
 {
     struct Settings
@@ -58,11 +60,15 @@ namespace Config
         DiceVariants::LEDLayoutType getLayoutType();
         const DiceVariants::Layout* getLayout();
 
+        // The values above are cached, the value store calls this when it is written to
+        void invalidateCache();
+
         void setDefaults(Settings& outSettings);
         void programDefaults(SettingsWrittenCallback callback);
         void programDefaultParameters(SettingsWrittenCallback callback);
         void programCalibrationData(const Core::int3* newNormals, int count, SettingsWrittenCallback callback);
         void programDesignAndColor(DiceVariants::DieType dieType, DiceVariants::Colorway colorway, SettingsWrittenCallback callback);
         void programName(const char* newName, SettingsWrittenCallback callback);
+        void programRollThresholds(int lowerTimes1000, int middleTimes1000, int upperTimes1000, SettingsWrittenCallback callback);
     }
 }
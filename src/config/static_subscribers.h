@@ -0,0 +1,27 @@
+#pragma once
+
+#include "core/static_delegates.h"
+#include "modules/charger_proximity.h"
+#include "modules/performance_profiles.h"
+#include "handlers/roll_notifications.h"
+#include "handlers/battery_notifications.h"
+
+// Modules that are always initialized and stay subscribed to the events below for as long as the
+// firmware runs. They are called before the clients hooked at runtime, which remain for the
+// subscribers that come and go. Handlers may be called before their module is initialized.
+namespace Config::StaticSubscribers
+{
+    typedef StaticDelegates<
+        Handlers::RollNotifications::onRollStateChange
+        > RollState;
+
+    typedef StaticDelegates<
+        Modules::ChargerProximity::onBatteryStateChange,
+        Modules::PerformanceProfiles::onBatteryStateChange,
+        Handlers::BatteryNotifications::onBatteryStateChange
+        > BatteryState;
+
+    typedef StaticDelegates<
+        Handlers::BatteryNotifications::onBatteryLevelChange
+        > BatteryLevel;
+}
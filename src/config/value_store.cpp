@@ -1,16 +1,225 @@
 #include "value_store.h"
 #include "drivers_nrf/log.h"
+#include "drivers_nrf/flash.h"
 #include "modules/validation_manager.h"
+#include "config/settings.h"
+#include "app_util_platform.h"
+#include "core/queue.h"
 #include "nrf_nvmc.h"
 
 #define INDEX_RBEGIN (sizeof(NRF_UICR->CUSTOMER) / 4 - 1) // Index of "reverse" begin (higher value)
 #define INDEX_REND 1                                      // Index of "reverse" end (lower value)
 
+// Each page of the runtime log starts with a header word: this magic and the page sequence number
+#define VALUE_STORE_PAGE_MAGIC 0x56530000
+#define VALUE_STORE_RUNTIME_COUNT (ValueType_RuntimeEnd - ValueType_RuntimeStart + 1)
+#define MAX_PENDING_VALUES 8
+#define ERASED_WORD 0xFFFFFFFF
+#define NO_VALUE 0xFFFFFFFF
+
 using namespace Modules;
+using namespace DriversNRF;
+using namespace Core;
 
 namespace Config::ValueStore
 {
+    // Latest value of each factory type, and whether there is any validation timestamp,
+    // indexed from the UICR registers on first use
+    static bool factoryIndexed = false;
+    static uint32_t factoryValues[ValueType_FactoryCount];
+    static bool validated = false;
+
+    // Latest value of each runtime type, from the log and the writes still pending
+    static uint32_t runtimeValues[VALUE_STORE_RUNTIME_COUNT];
+    static Queue<uint32_t, MAX_PENDING_VALUES> pendingRecords;
+
+    static uint32_t currentPage = 0;    // Page being appended to
+    static uint16_t currentSequence = 0;
+    static uint32_t writeOffset = 0;    // Offset of the next record in the current page
+    static bool ready = false;          // Set once the log has been loaded (or formatted)
+    static bool writing = false;        // A flash operation is in progress
+    static bool compactFailed = false;  // The last compaction failed, the values are only in RAM until one succeeds
+
+    // Words being written, they need to stay valid until the write completes
+    static uint32_t writeWord;
+    static uint32_t compactedRecords[VALUE_STORE_RUNTIME_COUNT];
+
+    static void pump();
+
+    static bool isRuntimeType(uint32_t type) {
+        return type >= ValueType_RuntimeStart && type <= ValueType_RuntimeEnd;
+    }
+
+    static bool isValidationTimestamp(uint32_t type) {
+        return type >= ValueType_ValidationTimestampStart && type <= ValueType_ValidationTimestampEnd;
+    }
+
+    static void indexFactoryValue(uint32_t reg) {
+        const uint32_t type = reg >> 24;
+        if (type < ValueType_FactoryCount) {
+            factoryValues[type] = reg & 0xffffff;
+        }
+        validated = validated || isValidationTimestamp(type);
+    }
+
+    /// <summary>
+    /// Scans the UICR registers once, later writes update the index as they go
+    /// </summary>
+    static void indexFactoryValues() {
+        if (!factoryIndexed) {
+            for (int t = 0; t < ValueType_FactoryCount; ++t) {
+                factoryValues[t] = NO_VALUE;
+            }
+            for (int i = INDEX_RBEGIN; i >= INDEX_REND; --i) {
+                const uint32_t reg = NRF_UICR->CUSTOMER[i];
+                if (reg == 0xffffffff) {
+                    // We reached the end of the store
+                    break;
+                }
+                indexFactoryValue(reg);
+            }
+            factoryIndexed = true;
+        }
+    }
+
+    static uint32_t pageAddress(uint32_t page) {
+        return Flash::getValueStoreStartAddress() + page * Flash::getPageSize();
+    }
+
+    static const uint32_t* pageWords(uint32_t page) {
+        return (const uint32_t*)pageAddress(page);
+    }
+
+    static bool isValidHeader(uint32_t header) {
+        return (header & 0xFFFF0000) == VALUE_STORE_PAGE_MAGIC;
+    }
+
+    void init() {
+        indexFactoryValues();
+        for (int t = 0; t < VALUE_STORE_RUNTIME_COUNT; ++t) {
+            runtimeValues[t] = NO_VALUE;
+        }
+
+        // The most recent page has the latest value of every type, replay it in order
+        bool found = false;
+        for (uint32_t p = 0; p < Flash::getValueStorePageCount(); ++p) {
+            const uint32_t header = pageWords(p)[0];
+            if (isValidHeader(header) && (!found || (int16_t)((header & 0xFFFF) - currentSequence) > 0)) {
+                currentPage = p;
+                currentSequence = header & 0xFFFF;
+                found = true;
+            }
+        }
+
+        if (found) {
+            const uint32_t* words = pageWords(currentPage);
+            writeOffset = 4;
+            for (; writeOffset < Flash::getPageSize() && words[writeOffset / 4] != ERASED_WORD; writeOffset += 4) {
+                const uint32_t record = words[writeOffset / 4];
+                if (isRuntimeType(record >> 24)) {
+                    runtimeValues[(record >> 24) - ValueType_RuntimeStart] = record & 0xffffff;
+                }
+            }
+            ready = true;
+            NRF_LOG_INFO("Value store init, page %d, %d B used", currentPage, writeOffset);
+        } else {
+            // Not formatted yet, moving the (no) values over to the first page does it
+            NRF_LOG_INFO("Value store init, formatting");
+            currentPage = Flash::getValueStorePageCount() - 1;
+            currentSequence = 0;
+            writeOffset = Flash::getPageSize();
+            ready = true;
+            pump();
+        }
+    }
+
+    /// <summary>
+    /// Starts over on the other page with the latest value of each type. The page header is written
+    /// last, so the current page stays the valid one until everything has been copied.
+    /// </summary>
+    static void compact() {
+        int count = 0;
+        for (int t = 0; t < VALUE_STORE_RUNTIME_COUNT; ++t) {
+            if (runtimeValues[t] != NO_VALUE) {
+                compactedRecords[count++] = ((uint32_t)(ValueType_RuntimeStart + t) << 24) | runtimeValues[t];
+            }
+        }
+        // Already in the index, so part of the copy
+        pendingRecords.clear();
+
+        // On failure the current page stays the valid one, and the next write tries again
+        static auto finishCompaction = [](bool success) {
+            writing = false;
+            compactFailed = !success;
+            if (success) {
+                pump();
+            }
+        };
+
+        writing = true;
+        const uint32_t nextPage = (currentPage + 1) % Flash::getValueStorePageCount();
+        Flash::erase((void*)(intptr_t)count, pageAddress(nextPage), 1, [](void* context, bool result, uint32_t address, uint16_t size) {
+            if (!result) {
+                NRF_LOG_ERROR("Could not erase value store page");
+                finishCompaction(false);
+                return;
+            }
+            auto writeHeader = [](void* context, bool result, uint32_t address, uint16_t size) {
+                if (!result) {
+                    // Without all the values, the new page must not become the valid one
+                    NRF_LOG_ERROR("Could not write compacted values");
+                    finishCompaction(false);
+                    return;
+                }
+                const uint32_t nextPage = (currentPage + 1) % Flash::getValueStorePageCount();
+                writeWord = VALUE_STORE_PAGE_MAGIC | (uint16_t)(currentSequence + 1);
+                Flash::write(context, pageAddress(nextPage), &writeWord, sizeof(writeWord), [](void* context, bool result, uint32_t address, uint16_t size) {
+                    if (!result) {
+                        NRF_LOG_ERROR("Could not write value store page header");
+                        finishCompaction(false);
+                        return;
+                    }
+                    const int count = (int)(intptr_t)context;
+                    currentPage = (currentPage + 1) % Flash::getValueStorePageCount();
+                    currentSequence++;
+                    writeOffset = 4 + count * sizeof(uint32_t);
+                    finishCompaction(true);
+                }, Flash::Priority_Low);
+            };
+            if ((intptr_t)context > 0) {
+                Flash::write(context, address + 4, compactedRecords, (int)(intptr_t)context * sizeof(uint32_t), writeHeader, Flash::Priority_Low);
+            } else {
+                writeHeader(context, result, address, size);
+            }
+        }, Flash::Priority_Low);
+    }
+
+    /// <summary>
+    /// Writes the next pending record, moving over to the other page when the current one is full
+    /// </summary>
+    static void pump() {
+        if (!ready || writing) {
+            return;
+        }
+        if (writeOffset >= Flash::getPageSize()) {
+            compact();
+        } else if (pendingRecords.tryDequeue(writeWord)) {
+            writing = true;
+            Flash::write(nullptr, pageAddress(currentPage) + writeOffset, &writeWord, sizeof(writeWord), [](void* context, bool result, uint32_t address, uint16_t size) {
+                writing = false;
+                if (!result) {
+                    NRF_LOG_ERROR("Could not write value store record");
+                }
+                // Never write to the same word twice, even on failure
+                writeOffset += 4;
+                pump();
+            }, Flash::Priority_Low);
+        }
+    }
+
     int writeUInt32(uint32_t value) {
+        indexFactoryValues();
+
         // Search for an empty slot in UICR registers.
         // This works similarly to heap v.s. stack:
         // - other setting stored in UICR are written to registers with low indices,
@@ -20,10 +229,12 @@ namespace Config::ValueStore
         // which is reserved for settings (even if empty).
         for (int i = INDEX_RBEGIN; i >= INDEX_REND; --i) {
             uint32_t *reg = (uint32_t *)&NRF_UICR->CUSTOMER[i];
-            NRF_LOG_DEBUG("Read UICR[%d] => %x", i, *reg); 
+            NRF_LOG_DEBUG("Read UICR[%d] => %x", i, *reg);
             if (*reg == 0xffffffff) {
                 NRF_LOG_DEBUG("Writing %x to UICR[%d]", value, i);
                 nrf_nvmc_write_word((uint32_t)&NRF_UICR->CUSTOMER[i], value);
+                indexFactoryValue(value);
+                SettingsManager::invalidateCache();
                 return i;
             }
         }
@@ -32,25 +243,49 @@ namespace Config::ValueStore
 
     int writeValue(ValueType type, uint32_t value) {
         // This version writes the value type along with the value!!
-        return writeUInt32((((uint32_t)type) << 24) | (value & 0xFFFFFF));
+        const uint32_t record = (((uint32_t)type) << 24) | (value & 0xFFFFFF);
+        if (!isRuntimeType(type)) {
+            return writeUInt32(record);
+        }
+
+        if (runtimeValues[type - ValueType_RuntimeStart] == (value & 0xFFFFFF)) {
+            // Unchanged, don't wear the flash
+            return 0;
+        }
+        if (!pendingRecords.enqueue(record)) {
+            NRF_LOG_WARNING("Value store pending queue full");
+            return WriteValueError_StoreFull;
+        }
+        runtimeValues[type - ValueType_RuntimeStart] = value & 0xFFFFFF;
+
+        // The value is kept and written with the next compaction, but the caller gets to know flash is failing
+        const bool failed = compactFailed;
+        pump();
+        return failed ? WriteValueError_WriteFailed : 0;
     }
 
     uint32_t readValue(ValueType type, ValueType typeEnd /*= ValueType_None*/) {
+        indexFactoryValues();
+        if (typeEnd == ValueType_None) {
+            if (type < ValueType_FactoryCount) {
+                return factoryValues[type];
+            } else if (isRuntimeType(type)) {
+                return runtimeValues[type - ValueType_RuntimeStart];
+            }
+        }
+
         uint32_t value = -1;
         const uint32_t typeMask = (uint32_t)type << 24;
-        const uint32_t typeEndMask = (uint32_t)typeEnd << 24;
-        const bool hasTypeEnd = typeEnd != ValueType_None;
+        const uint32_t typeEndMask = (uint32_t)(typeEnd != ValueType_None ? typeEnd : type) << 24;
         // Iterate through all values and keep the last one that has the required type
         for (int i = INDEX_RBEGIN; i >= INDEX_REND; --i) {
             uint32_t *reg = (uint32_t *)&NRF_UICR->CUSTOMER[i];
-            NRF_LOG_DEBUG("Read UICR[%d] => %x", i, *reg);
             if (*reg == 0xffffffff) {
                 // We reached the on the store
                 break;
             }
             const auto mask = *reg & 0xff000000;
-            if ((!hasTypeEnd && mask == typeMask)
-                || (hasTypeEnd && mask >= typeMask && mask <= typeEndMask)) {
+            if (mask >= typeMask && mask <= typeEndMask) {
                 value = *reg & 0xffffff;
             }
         }
@@ -58,6 +293,7 @@ namespace Config::ValueStore
     }
 
     bool hasValidationTimestamp() {
-        return readValue(ValueType_ValidationTimestampStart, ValueType_ValidationTimestampEnd) != (uint32_t)-1;
+        indexFactoryValues();
+        return validated;
     }
-}
\ No newline at end of file
+}
@@ -2,12 +2,18 @@
 
 namespace Config::ValueStore
 {
+    // Values are 24 bits, stored along with their type in 32 bits words. Factory values are written
+    // once to UICR registers, runtime values are appended to a log in flash. Both are indexed in RAM.
     enum ValueType : uint8_t
     {
         ValueType_None = 0,
         ValueType_DieType = 1,
         ValueType_Colorway = 2,
         ValueType_RunMode = 3,
+        ValueType_BoardResistor = 4, // Identified board, see BoardManager::init()
+        ValueType_FactoryCount,      // Indexed factory values are below this
+        ValueType_RuntimeStart = 0x40, // Runtime values, can be written as often as needed
+        ValueType_RuntimeEnd = 0x4F,
         ValueType_ValidationTimestampStart = 0xA0, // Start index for validation timestamps
         ValueType_ValidationTimestampFirmware = ValueType_ValidationTimestampStart,
         ValueType_ValidationTimestampBoardNoCoil,
@@ -21,15 +27,22 @@ namespace Config::ValueStore
     {
         WriteValueError_StoreFull = -1,
         WriteValueError_NotPermited = -2,
+        WriteValueError_WriteFailed = -3,  // Kept in RAM, the flash log couldn't be moved to a fresh page
     };
 
+    // Loads the runtime values from flash, the factory values are available before that
+    void init();
+
     // Write value to store, returns its index (or -1 if full)
     int writeUInt32(uint32_t value);
 
-    // Write specific type of value, returns its index (or -1 if full)
+    // Write specific type of value, returns its index (or -1 if full). Runtime values are written
+    // to flash asynchronously but can be read back right away, they return 0 once queued
+    // (or WriteValueError_WriteFailed if the flash log is failing to be compacted).
     int writeValue(ValueType type, uint32_t value);
 
-    // Read value from store for the given type, returns -1 if not found
+    // Read value from store for the given type, returns -1 if not found.
+    // Single types are looked up in the index, ranges of factory values scan the UICR registers.
     uint32_t readValue(ValueType typeStart, ValueType typeEnd = ValueType_None);
 
     // Check if the board has been validated at least once
@@ -1,10 +1,15 @@
 #pragma once
 
 #include "stdint.h"
+#include "string.h"
+#if defined(__ARM_FEATURE_DSP)
+#include <arm_acle.h>
+#endif
 
 namespace Utils
 {
     int32_t sqrt_i32(int32_t v);
+    uint32_t invSqrt_u32(uint32_t v);
 }
 
 namespace Core
@@ -54,20 +59,42 @@ namespace Core
             zTimes1000 = (int16_t)((int32_t)zTimes1000 * 1000 / rightTimes1000);
             return *this;
         }
+        // x and y packed in one word (x in the low half), for the Cortex-M4 dual 16 bit multiplies
+        int32_t xy() const
+        {
+            int32_t ret;
+            memcpy(&ret, &xTimes1000, sizeof(ret));
+            return ret;
+        }
+        // Sum of the squared components, unsigned since it can exceed INT32_MAX
+        uint32_t sqrMagnitudeTimes1000000() const
+        {
+#if defined(__ARM_FEATURE_DSP)
+            return (uint32_t)__smuad(xy(), xy()) + (uint32_t)((int32_t)zTimes1000 * zTimes1000);
+#else
+            return (uint32_t)((int32_t)xTimes1000 * xTimes1000) + (uint32_t)((int32_t)yTimes1000 * yTimes1000) + (uint32_t)((int32_t)zTimes1000 * zTimes1000);
+#endif
+        }
         int32_t sqrMagnitudeTimes1000() const
         {
-            return ((int32_t)xTimes1000 * xTimes1000 + (int32_t)yTimes1000 * yTimes1000 + (int32_t)zTimes1000 * zTimes1000) / 1000;
+            return (int32_t)(sqrMagnitudeTimes1000000() / 1000);
         }
         int32_t magnitudeTimes1000() const
         {
-            return Utils::sqrt_i32(sqrMagnitudeTimes1000() * 1000);
+            // sqrt(v) = v / sqrt(v)
+            uint32_t sqrMag = sqrMagnitudeTimes1000000();
+            return (int32_t)(((uint64_t)sqrMag * Utils::invSqrt_u32(sqrMag)) >> 31);
         }
         int3& normalize()
         {
-            int magTimes1000 = magnitudeTimes1000();
-            xTimes1000 = (int16_t)((int32_t)xTimes1000 * 1000 / magTimes1000);
-            yTimes1000 = (int16_t)((int32_t)yTimes1000 * 1000 / magTimes1000);
-            zTimes1000 = (int16_t)((int32_t)zTimes1000 * 1000 / magTimes1000);
+            // One inverse square root and three multiplies, instead of a square root and three divides
+            uint32_t sqrMag = sqrMagnitudeTimes1000000();
+            if (sqrMag != 0) {
+                int64_t scale = (int64_t)Utils::invSqrt_u32(sqrMag) * 1000;
+                xTimes1000 = (int16_t)((xTimes1000 * scale + (1 << 30)) >> 31);
+                yTimes1000 = (int16_t)((yTimes1000 * scale + (1 << 30)) >> 31);
+                zTimes1000 = (int16_t)((zTimes1000 * scale + (1 << 30)) >> 31);
+            }
             return *this;
         }
         int3 normalized() const
@@ -76,9 +103,17 @@ namespace Core
             ret.normalize();
             return ret;
         }
+        static int32_t dotTimes1000000(const int3& left, const int3& right)
+        {
+#if defined(__ARM_FEATURE_DSP)
+            return __smlad(left.xy(), right.xy(), (int32_t)left.zTimes1000 * right.zTimes1000);
+#else
+            return (int32_t)left.xTimes1000 * right.xTimes1000 + (int32_t)left.yTimes1000 * right.yTimes1000 + (int32_t)left.zTimes1000 * right.zTimes1000;
+#endif
+        }
         static int32_t dotTimes1000(const int3& left, const int3& right)
         {
-            return ((int32_t)left.xTimes1000 * right.xTimes1000 + (int32_t)left.yTimes1000 * right.yTimes1000 + (int32_t)left.zTimes1000 * right.zTimes1000) / 1000;
+            return dotTimes1000000(left, right) / 1000;
         }
         static int3 cross(const int3& left, const int3& right)
         {
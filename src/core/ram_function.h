@@ -0,0 +1,18 @@
+#pragma once
+
+// Normally set by the makefile
+#ifndef RAM_FUNCTIONS
+#define RAM_FUNCTIONS 1
+#endif
+
+/// <summary>
+/// Places a function in RAM, for the few short loops run every animation frame or accelerometer
+/// sample, so they don't wait on the flash. The section is part of .data (see Firmware.ld), the
+/// startup code copies it from flash along with the initialized variables. Every byte of code
+/// moved there is taken from the RAM, so keep this to small functions.
+/// </summary>
+#if RAM_FUNCTIONS
+#define RAM_FUNCTION __attribute__((section(".data.ramfunc"), noinline))
+#else
+#define RAM_FUNCTION
+#endif
@@ -56,6 +56,28 @@ namespace Core
             return data[dataIndex];
         }
 
+        /// <summary>
+        /// Returns the newest item, so it can be updated in place
+        /// </summary>
+        T& last()
+        {
+            int dataIndex = next - 1;
+            if (dataIndex == -1)
+                dataIndex = MaxCount - 1;
+            return data[dataIndex];
+        }
+
+        /// <summary>
+        /// Sets all the items to the given value
+        /// </summary>
+        void fill(const T& item)
+        {
+            for (int i = 0; i < MaxCount; ++i) {
+                data[i] = item;
+            }
+            next = 0;
+        }
+
         /// <summary>
         /// Returns the number of items in the buffer
         /// </summary>
@@ -0,0 +1,15 @@
+#pragma once
+
+/// <summary>
+/// List of handlers known at compile time, for subscribers that are always there and never
+/// unregister. Unlike DelegateArray they are called directly (and can be inlined), with a null token.
+/// </summary>
+template<auto... Handlers>
+struct StaticDelegates
+{
+    template<typename... Args>
+    static void Call(Args... args)
+    {
+        (Handlers(nullptr, args...), ...);
+    }
+};
@@ -0,0 +1,63 @@
+#include "animation_bits_cache.h"
+#include "app_util_platform.h"
+#include "nrf_log.h"
+
+namespace DataSet::AnimationBitsCache
+{
+    struct Entry
+    {
+        const AnimationBits* bits;
+        uint8_t useCount;
+    };
+    static Entry entries[Source_Count];
+
+    void setBits(Source source, const AnimationBits* bits) {
+        auto& entry = entries[source];
+        if (entry.bits != bits) {
+            if (entry.useCount != 0) {
+                NRF_LOG_WARNING("Animation bits %d replaced while used by %d animations", source, entry.useCount);
+            }
+            entry.bits = bits;
+            entry.useCount = 0;
+        }
+    }
+
+    const AnimationBits* getBits(Source source) {
+        return entries[source].bits;
+    }
+
+    /// <summary>
+    /// The entry of the source owning the given bits, nullptr if not from a source
+    /// </summary>
+    static Entry* findEntry(const AnimationBits* bits) {
+        for (auto& entry : entries) {
+            if (entry.bits == bits && bits != nullptr) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    void acquire(const AnimationBits* bits) {
+        // Instances may be destroyed from an interrupt handler (see the instance pool)
+        CRITICAL_REGION_ENTER();
+        auto entry = findEntry(bits);
+        if (entry != nullptr) {
+            entry->useCount++;
+        }
+        CRITICAL_REGION_EXIT();
+    }
+
+    void release(const AnimationBits* bits) {
+        CRITICAL_REGION_ENTER();
+        auto entry = findEntry(bits);
+        if (entry != nullptr && entry->useCount > 0) {
+            entry->useCount--;
+        }
+        CRITICAL_REGION_EXIT();
+    }
+
+    uint8_t getUseCount(Source source) {
+        return entries[source].useCount;
+    }
+}
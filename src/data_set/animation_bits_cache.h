@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace DataSet
+{
+    struct AnimationBits;
+
+    /// <summary>
+    /// Keeps track of where animations can be played from, and of how many running animation
+    /// instances use each of them, so a source can be replaced without stopping the others.
+    /// </summary>
+    namespace AnimationBitsCache
+    {
+        enum Source : uint8_t
+        {
+            Source_Profile = 0, // The data set, programmed in flash or the built-in defaults
+            Source_Instant,     // Instant animations, in RAM
+            Source_Count
+        };
+
+        // Sets the animation bits of a source, nullptr while it has none (e.g. during a download).
+        // Instances still using the previous bits must have been stopped.
+        void setBits(Source source, const AnimationBits* bits);
+        const AnimationBits* getBits(Source source);
+
+        // Called as animation instances are created and destroyed, bits that don't belong to a
+        // source (e.g. the blink animation's own palette) aren't counted
+        void acquire(const AnimationBits* bits);
+        void release(const AnimationBits* bits);
+
+        // Number of running animation instances using the bits of that source
+        uint8_t getUseCount(Source source);
+    }
+}
@@ -6,6 +6,7 @@
 #include "modules/accelerometer.h"
 #include "config/settings.h"
 #include "config/dice_variants.h"
+#include <string.h>
 
 using namespace Modules;
 using namespace Config;
@@ -24,9 +25,9 @@ namespace DataSet
         }
         else if (colorIndex < (paletteSize / 3)) {
             return Utils::toColor(
-                    palette[colorIndex * 3 + 0],
-                    palette[colorIndex * 3 + 1],
-                    palette[colorIndex * 3 + 2]);
+                    getPalette()[colorIndex * 3 + 0],
+                    getPalette()[colorIndex * 3 + 1],
+                    getPalette()[colorIndex * 3 + 2]);
         } else {
             return 0xFFFFFFFF;
         }
@@ -38,7 +39,7 @@ namespace DataSet
 
     const RGBKeyframe& AnimationBits::getRGBKeyframe(uint16_t keyFrameIndex) const {
         assert(keyFrameIndex < rgbKeyFrameCount);
-        return rgbKeyframes[keyFrameIndex];
+        return rgbKeyframes.get(this)[keyFrameIndex];
     }
 
     uint16_t AnimationBits::getRGBKeyframeCount() const {
@@ -47,12 +48,12 @@ namespace DataSet
 
     const RGBTrack& AnimationBits::getRGBTrack(uint16_t trackIndex) const {
         assert(trackIndex < rgbTrackCount);
-        return rgbTracks[trackIndex];
+        return rgbTracks.get(this)[trackIndex];
     }
 
     RGBTrack const * const AnimationBits::getRGBTracks(uint16_t tracksStartIndex)const  {
         assert(tracksStartIndex < rgbTrackCount);
-        return &(rgbTracks[tracksStartIndex]);
+        return rgbTracks.get(this) + tracksStartIndex;
     }
 
     uint16_t AnimationBits::getRGBTrackCount() const {
@@ -61,7 +62,7 @@ namespace DataSet
 
     const Keyframe& AnimationBits::getKeyframe(uint16_t keyFrameIndex) const {
         assert(keyFrameIndex < keyFrameCount);
-        return keyframes[keyFrameIndex];
+        return keyframes.get(this)[keyFrameIndex];
     }
 
     uint16_t AnimationBits::getKeyframeCount() const {
@@ -70,12 +71,12 @@ namespace DataSet
 
     const Track& AnimationBits::getTrack(uint16_t trackIndex) const {
         assert(trackIndex < trackCount);
-        return tracks[trackIndex];
+        return tracks.get(this)[trackIndex];
     }
 
     Track const * const AnimationBits::getTracks(uint16_t tracksStartIndex) const {
         assert(tracksStartIndex < trackCount);
-        return &(tracks[tracksStartIndex]);
+        return tracks.get(this) + tracksStartIndex;
     }
 
     uint16_t AnimationBits::getTrackCount() const {
@@ -85,7 +86,7 @@ namespace DataSet
     const Animation* AnimationBits::getAnimation(int animationIndex) const {
         if (animationIndex >= 0 && (uint32_t)animationIndex < animationCount) {
             // Grab the preset data
-            auto animationPtr = (const uint8_t *)animations + animationOffsets[animationIndex];
+            auto animationPtr = animations.get(this) + animationOffsets.get(this)[animationIndex];
             return (const Animation*)animationPtr;
         }
         return nullptr;
@@ -96,16 +97,7 @@ namespace DataSet
     }
 
     void AnimationBits::Clear() {
-        palette = nullptr;
-        paletteSize = 0;
-        rgbKeyframes = nullptr;
-        rgbKeyFrameCount = 0;
-        rgbTracks = nullptr;
-        rgbTrackCount = 0;
-        keyframes = nullptr;
-        keyFrameCount = 0;
-        tracks = nullptr;
-        trackCount = 0;
+        memset(this, 0, sizeof(AnimationBits));
     }
 
 }
\ No newline at end of file
@@ -6,42 +6,64 @@ using namespace Animations;
 
 namespace DataSet
 {
+    /// <summary>
+    /// Position independent reference to an array, stored as a byte offset from the start of the
+    /// struct that holds it. The struct and the data can be copied or mapped anywhere together.
+    /// </summary>
+    template <typename T>
+    struct DataOffset
+    {
+        int32_t offset;
+
+        const T* get(const void* base) const {
+            return (const T*)(const void*)((const uint8_t*)base + offset);
+        }
+
+        void set(const void* base, const void* ptr) {
+            offset = (int32_t)((const uint8_t*)ptr - (const uint8_t*)base);
+        }
+    };
+
+    /// <summary>
+    /// The animation data, offsets are relative to this struct
+    /// </summary>
     struct AnimationBits
     {
         // The palette for all animations, stored in RGB RGB RGB etc...
         // Maximum 128 * 3 = 376 bytes
-        const uint8_t* palette;
+        DataOffset<uint8_t> palette;
         uint32_t paletteSize; // In bytes (divide by 3 for colors)
 
         #define PALETTE_COLOR_FROM_FACE     127
         #define PALETTE_COLOR_FROM_RANDOM   126
 
         // The individual RGB keyframes we have, i.e. time and color, packed in
-        const Animations::RGBKeyframe* rgbKeyframes; // pointer to the array of tracks
+        DataOffset<Animations::RGBKeyframe> rgbKeyframes; // the array of keyframes
         uint32_t rgbKeyFrameCount;
 
         // The RGB tracks we have
-        const Animations::RGBTrack* rgbTracks; // pointer to the array of tracks
+        DataOffset<Animations::RGBTrack> rgbTracks; // the array of tracks
         uint32_t rgbTrackCount;
 
         // The individual intensity keyframes we have, i.e. time and intensity, packed in
-        const Animations::Keyframe* keyframes; // pointer to the array of tracks
+        DataOffset<Animations::Keyframe> keyframes; // the array of keyframes
         uint32_t keyFrameCount;
 
         // The RGB tracks we have
-        const Animations::Track* tracks; // pointer to the array of tracks
+        DataOffset<Animations::Track> tracks; // the array of tracks
         uint32_t trackCount;
 
         // The animations. Because animations can be one of multiple classes (simple inheritance system)
         // The dataset stores an offset into the animations buffer for each entry. The first member of
         // The animation base class is a type enum indicating what it actually is.
-        const uint16_t* animationOffsets; // offsets to actual animation from the animation pointer below
+        DataOffset<uint16_t> animationOffsets; // offsets to actual animation from the animations below
         uint32_t animationCount;
 
-        const uint8_t* animations; // The animations we have, 4-byte aligned, so may need some padding
+        DataOffset<uint8_t> animations; // The animations we have, 4-byte aligned, so may need some padding
         uint32_t animationsSize; // In bytes
 
         // Palette
+        const uint8_t* getPalette() const { return palette.get(this); }
         uint16_t getPaletteSize() const;
         uint32_t getPaletteColor(uint16_t colorIndex) const;
 
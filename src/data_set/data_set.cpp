@@ -6,14 +6,16 @@
 #include "drivers_nrf/timers.h"
 #include "drivers_nrf/watchdog.h"
 #include "drivers_nrf/power_manager.h"
+#include "drivers_nrf/retained_state.h"
 #include "modules/accelerometer.h"
 #include "config/board_config.h"
 #include "config/settings.h"
 #include "data_animation_bits.h"
+#include "animation_bits_cache.h"
 #include "bluetooth/bluetooth_messages.h"
 #include "bluetooth/bluetooth_message_service.h"
 #include "bluetooth/bulk_data_transfer.h"
-#include "malloc.h"
+#include "utils/heap.h"
 #include "assert.h"
 #include "nrf_log.h"
 #include "nrf_delay.h"
@@ -32,8 +34,13 @@ namespace DataSet
 {
     void ReceiveDataSetHandler(const Bluetooth::Message* msg);
     void ProgramDefaultAnimSetHandler(const Message* msg);
+    void RequestDataSetHashesHandler(const Message* msg);
+    void ReceiveDataSetPatchHandler(const Message* msg);
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt);
     uint32_t computeDataSetSize();
-    uint32_t computeDataSetHash();
+    void buildIndex();
+    void freeIndex();
+    static void getSection(const Data* theData, const Data* location, DataSetSection section, const uint8_t*& start, uint32_t& sectionSize);
 
     // The animation set always points at a specific address in memory
     Data const * data = nullptr;
@@ -42,8 +49,24 @@ namespace DataSet
     uint32_t size = 0;
     uint32_t hash = 0;
 
+    // Hash of the data set data that was last received from the central, if any
+    uint32_t receivedDataSize = 0;
+    uint32_t receivedDataHash = 0;
+
+    // Pointers to the data set items, built once the data is known to be valid so that lookups
+    // don't go through the offset tables. All the arrays live in the same allocation.
+    struct Index
+    {
+        const Animation** animations;
+        const Condition** conditions;
+        const Action** actions;
+        uint16_t* conditionRules;                       // Behavior rule indices, grouped by condition type
+        uint16_t conditionRulesStart[Condition_Count + 1];
+    };
+    Index* dataIndex = nullptr;
+
     uint32_t availableDataSize() {
-        return Flash::getFlashEndAddress() - Flash::getDataSetDataAddress();
+        return Flash::getDataSetSlotSize() - sizeof(Data);
     }
 
     uint32_t dataSize() {
@@ -54,6 +77,36 @@ namespace DataSet
         return hash;
     }
 
+    /// <summary>
+    /// Uses the data set in flash, or the built-in defaults if none was programmed
+    /// </summary>
+    static void selectData() {
+        data = (Data const *)Flash::getDataSetAddress();
+        if (!CheckValid()) {
+            data = getDefaultDataSet();
+        }
+        size = computeDataSetSize();
+
+        // The built-in defaults don't cache their hash, the palette is always first.
+        // It is kept through System OFF so a warm boot doesn't need to compute it again.
+        auto retained = RetainedState::getState();
+        if (!usingDefaults()) {
+            hash = data->hash;
+        } else if (retained->dataSetAddress == (uint32_t)data && retained->dataSetSize == size) {
+            hash = retained->dataSetHash;
+        } else {
+            hash = Utils::computeHash(data->animationBits.getPalette(), size);
+        }
+        retained->dataSetAddress = (uint32_t)data;
+        retained->dataSetSize = size;
+        retained->dataSetHash = hash;
+        AnimationBitsCache::setBits(AnimationBitsCache::Source_Profile, &data->animationBits);
+    }
+
+    bool usingDefaults() {
+        return (uint32_t)data != Flash::getDataSetAddress();
+    }
+
     void init(InitCallback callback) {
         static InitCallback _callback; // Don't initialize this static inline because it would only do it on first call!
         _callback = callback;
@@ -76,11 +129,14 @@ namespace DataSet
         auto finishInit = [] (bool success) {
             APP_ERROR_CHECK(success ? NRF_SUCCESS : NRF_ERROR_INTERNAL);
 
-            size = computeDataSetSize();
-            hash = computeDataSetHash();
+            selectData();
+            buildIndex();
 
+            Flash::hookProgrammingEvent(onProgrammingEvent, nullptr);
             MessageService::RegisterMessageHandler(Message::MessageType_TransferAnimSet, ReceiveDataSetHandler);
             MessageService::RegisterMessageHandler(Message::MessageType_ProgramDefaultAnimSet, ProgramDefaultAnimSetHandler);
+            MessageService::RegisterMessageHandler(Message::MessageType_RequestDataSetHashes, RequestDataSetHashesHandler);
+            MessageService::RegisterMessageHandler(Message::MessageType_TransferDataSetPatch, ReceiveDataSetPatchHandler);
             NRF_LOG_INFO("DataSet init, size: 0x%x, hash: 0x%08x", size, hash);
             auto callBackCopy = _callback;
             _callback = nullptr;
@@ -89,13 +145,10 @@ namespace DataSet
             }
         };
 
-        //ProgramDefaultDataSet();
         if (!CheckValid()) {
-            NRF_LOG_INFO("DataSet not valid!");
-            ProgramDefaultDataSet(*SettingsManager::getSettings(), finishInit);
-        } else {
-            finishInit(true);
+            NRF_LOG_INFO("No DataSet programmed, using defaults");
         }
+        finishInit(true);
         //printAnimationInfo();
     }
 
@@ -119,67 +172,149 @@ namespace DataSet
     }
 
     const Animation* getAnimation(int animationIndex) {
-        assert(CheckValid());
+        if (animationIndex < 0 || (uint32_t)animationIndex >= data->animationBits.animationCount) {
+            return nullptr;
+        }
+        if (dataIndex != nullptr) {
+            return dataIndex->animations[animationIndex];
+        }
         return data->animationBits.getAnimation(animationIndex);
     }
 
     uint16_t getAnimationCount() {
-        assert(CheckValid());
         return data->animationBits.getAnimationCount();
     }
 
     const Condition* getCondition(int conditionIndex) {
-        assert(CheckValid());
-        if (conditionIndex >= 0 && (uint32_t)conditionIndex < data->conditionCount) {
-            auto conditionPtr = (const uint8_t *)data->conditions + data->conditionsOffsets[conditionIndex];
-            return (const Condition*)conditionPtr;
+        if (conditionIndex < 0 || (uint32_t)conditionIndex >= data->conditionCount) {
+            return nullptr;
         }
-        return nullptr;
+        if (dataIndex != nullptr) {
+            return dataIndex->conditions[conditionIndex];
+        }
+        return data->getCondition(conditionIndex);
     }
 
     uint16_t getConditionCount() {
-        assert(CheckValid());
         return data->conditionCount;
     }
 
     const Action* getAction(int actionIndex) {
-        assert(CheckValid());
-        if (actionIndex >= 0 && (uint32_t)actionIndex < data->actionCount) {
-            auto actionPtr = (const uint8_t*)data->actions + data->actionsOffsets[actionIndex];
-            return (const Action*)actionPtr;
+        if (actionIndex < 0 || (uint32_t)actionIndex >= data->actionCount) {
+            return nullptr;
         }
-        return nullptr;
+        if (dataIndex != nullptr) {
+            return dataIndex->actions[actionIndex];
+        }
+        return data->getAction(actionIndex);
     }
 
     uint16_t getActionCount() {
-        assert(CheckValid());
         return data->actionCount;
     }
 
     const Rule* getRule(int ruleIndex) {
-        assert(CheckValid());
         if (ruleIndex >= 0 && (uint32_t)ruleIndex < data->ruleCount) {
-            return &data->rules[ruleIndex];
+            return &data->getRules()[ruleIndex];
         }
         return nullptr;
     }
 
     uint16_t getRuleCount() {
-        assert(CheckValid());
         return data->ruleCount;
     }
 
+    const uint16_t* getRulesForCondition(ConditionType conditionType, uint16_t& outCount) {
+        outCount = 0;
+        if (dataIndex == nullptr || conditionType >= Condition_Count) {
+            return nullptr;
+        }
+        outCount = dataIndex->conditionRulesStart[conditionType + 1] - dataIndex->conditionRulesStart[conditionType];
+        return dataIndex->conditionRules + dataIndex->conditionRulesStart[conditionType];
+    }
+
     // Behaviors
     const Behavior* getBehavior() {
-        assert(CheckValid());
-        return data->behavior;
+        return data->getBehavior();
     }
 
     uint8_t getBrightness() {
-        assert(CheckValid());
         return data->brightness;
     }
 
+    /// <summary>
+    /// Builds the RAM index of the current data set, which must have been validated.
+    /// Lookups fall back to the offset tables if there isn't enough memory for it.
+    /// </summary>
+    void buildIndex() {
+        freeIndex();
+        if (!CheckValid()) {
+            return;
+        }
+
+        const uint32_t animationCount = data->animationBits.animationCount;
+        const uint32_t conditionCount = data->conditionCount;
+        const uint32_t actionCount = data->actionCount;
+        auto behavior = data->getBehavior();
+
+        // Only keep the rules that the behavior actually references
+        uint32_t ruleCount = behavior->rulesCount;
+        if (behavior->rulesOffset + ruleCount > data->ruleCount) {
+            ruleCount = behavior->rulesOffset < data->ruleCount ? data->ruleCount - behavior->rulesOffset : 0;
+        }
+
+        const uint32_t pointerCount = animationCount + conditionCount + actionCount;
+        auto block = (uint8_t*)Heap::alloc(sizeof(Index) + pointerCount * sizeof(void*) + ruleCount * sizeof(uint16_t), Heap::HeapTag_DataSet);
+        if (block == nullptr) {
+            NRF_LOG_WARNING("Not enough memory to index data set");
+            return;
+        }
+
+        Index* newIndex = (Index*)(void*)block;
+        newIndex->animations = (const Animation**)(void*)(block + sizeof(Index));
+        newIndex->conditions = (const Condition**)(newIndex->animations + animationCount);
+        newIndex->actions = (const Action**)(newIndex->conditions + conditionCount);
+        newIndex->conditionRules = (uint16_t*)(void*)(newIndex->actions + actionCount);
+
+        for (uint32_t i = 0; i < animationCount; ++i) {
+            newIndex->animations[i] = data->animationBits.getAnimation(i);
+        }
+        for (uint32_t i = 0; i < conditionCount; ++i) {
+            newIndex->conditions[i] = data->getCondition(i);
+        }
+        for (uint32_t i = 0; i < actionCount; ++i) {
+            newIndex->actions[i] = data->getAction(i);
+        }
+
+        // Bucket the rules by condition type, rules with a bad condition go with the unknown ones
+        auto ruleConditionType = [&](uint32_t ruleIndex) {
+            uint16_t conditionIndex = data->getRules()[ruleIndex].condition;
+            ConditionType type = conditionIndex < conditionCount ? newIndex->conditions[conditionIndex]->type : Condition_Unknown;
+            return type < Condition_Count ? type : Condition_Unknown;
+        };
+        uint16_t typeCounts[Condition_Count] = {0};
+        for (uint32_t i = 0; i < ruleCount; ++i) {
+            typeCounts[ruleConditionType(behavior->rulesOffset + i)]++;
+        }
+        newIndex->conditionRulesStart[0] = 0;
+        for (int t = 0; t < Condition_Count; ++t) {
+            newIndex->conditionRulesStart[t + 1] = newIndex->conditionRulesStart[t] + typeCounts[t];
+            typeCounts[t] = newIndex->conditionRulesStart[t];
+        }
+        for (uint32_t i = 0; i < ruleCount; ++i) {
+            uint32_t ruleIndex = behavior->rulesOffset + i;
+            newIndex->conditionRules[typeCounts[ruleConditionType(ruleIndex)]++] = (uint16_t)ruleIndex;
+        }
+
+        dataIndex = newIndex;
+    }
+
+    void freeIndex() {
+        Index* oldIndex = dataIndex;
+        dataIndex = nullptr;
+        Heap::free(oldIndex);
+    }
+
     int offset = 0;
 
     void ReceiveDataSetHandler(const Message* msg) {
@@ -201,77 +336,87 @@ namespace DataSet
         NRF_LOG_DEBUG("Rules: %d * %d", message->ruleCount, sizeof(Rule));
         NRF_LOG_DEBUG("Behavior: %d", sizeof(Behavior));
 
-        // Store the address and size
-        NRF_LOG_DEBUG("Setting up pointers");
+        // Lay out the data after the header, the bits' offsets are relative to the bits themselves
+        NRF_LOG_DEBUG("Setting up offsets");
         Data newData  __attribute__ ((aligned (4)));
         newData.headMarker = ANIMATION_SET_VALID_KEY;
         newData.version = ANIMATION_SET_VERSION;
 
-        uint32_t address = Flash::getDataSetDataAddress();
-        newData.animationBits.palette = (const uint8_t*)address;
+        const int32_t bitsOffset = offsetof(Data, animationBits);
+        int32_t offset = sizeof(Data);
+        newData.animationBits.palette.offset = offset - bitsOffset;
         newData.animationBits.paletteSize = message->paletteSize;
-        address += Utils::roundUpTo4(message->paletteSize * sizeof(uint8_t));
+        offset += Utils::roundUpTo4(message->paletteSize * sizeof(uint8_t));
 
-        newData.animationBits.rgbKeyframes = (const RGBKeyframe*)address;
+        newData.animationBits.rgbKeyframes.offset = offset - bitsOffset;
         newData.animationBits.rgbKeyFrameCount = message->rgbKeyFrameCount;
-        address += message->rgbKeyFrameCount * sizeof(RGBKeyframe);
+        offset += message->rgbKeyFrameCount * sizeof(RGBKeyframe);
 
-        newData.animationBits.rgbTracks = (const RGBTrack*)address;
+        newData.animationBits.rgbTracks.offset = offset - bitsOffset;
         newData.animationBits.rgbTrackCount = message->rgbTrackCount;
-        address += message->rgbTrackCount * sizeof(RGBTrack);
+        offset += message->rgbTrackCount * sizeof(RGBTrack);
 
-        newData.animationBits.keyframes = (const Keyframe*)address;
+        newData.animationBits.keyframes.offset = offset - bitsOffset;
         newData.animationBits.keyFrameCount = message->keyFrameCount;
-        address += message->keyFrameCount * sizeof(Keyframe);
+        offset += message->keyFrameCount * sizeof(Keyframe);
 
-        newData.animationBits.tracks = (const Track*)address;
+        newData.animationBits.tracks.offset = offset - bitsOffset;
         newData.animationBits.trackCount = message->trackCount;
-        address += message->trackCount * sizeof(Track);
+        offset += message->trackCount * sizeof(Track);
 
-        newData.animationBits.animationOffsets = (const uint16_t*)address;
+        newData.animationBits.animationOffsets.offset = offset - bitsOffset;
         newData.animationBits.animationCount = message->animationCount;
-        address += Utils::roundUpTo4(message->animationCount * sizeof(uint16_t)); // round to multiple of 4
-        newData.animationBits.animations = (const uint8_t*)address;
+        offset += Utils::roundUpTo4(message->animationCount * sizeof(uint16_t)); // round to multiple of 4
+        newData.animationBits.animations.offset = offset - bitsOffset;
         newData.animationBits.animationsSize = message->animationSize;
-        address += message->animationSize;
+        offset += message->animationSize;
 
-        newData.conditionsOffsets = (const uint16_t*)address;
+        newData.conditionsOffsets.offset = offset;
         newData.conditionCount = message->conditionCount;
-        address += Utils::roundUpTo4(message->conditionCount * sizeof(uint16_t)); // round to multiple of 4
-        newData.conditions = (const Condition*)address;
+        offset += Utils::roundUpTo4(message->conditionCount * sizeof(uint16_t)); // round to multiple of 4
+        newData.conditions.offset = offset;
         newData.conditionsSize = message->conditionSize;
-        address += message->conditionSize;
+        offset += message->conditionSize;
 
-        newData.actionsOffsets = (const uint16_t*)address;
+        newData.actionsOffsets.offset = offset;
         newData.actionCount = message->actionCount;
-        address += Utils::roundUpTo4(message->actionCount * sizeof(uint16_t)); // round to multiple of 4
-        newData.actions = (const Action*)address;
+        offset += Utils::roundUpTo4(message->actionCount * sizeof(uint16_t)); // round to multiple of 4
+        newData.actions.offset = offset;
         newData.actionsSize = message->actionSize;
-        address += message->actionSize;
+        offset += message->actionSize;
 
-        newData.rules = (const Rule*)address;
+        newData.rules.offset = offset;
         newData.ruleCount = message->ruleCount;
-        address += message->ruleCount * sizeof(Rule);
+        offset += message->ruleCount * sizeof(Rule);
 
-        newData.behavior = (const Behavior*)address;
-        address += sizeof(Behavior);
+        newData.behavior.offset = offset;
 
         newData.brightness = message->brightness;
 
         newData.tailMarker = ANIMATION_SET_VALID_KEY;
 
+        static Flash::ProgramFlashFuncCallback _programCallback;
+        static uint32_t _dataSize;
+        _dataSize = computeDataSetDataSize(&newData);
         static auto receiveToFlash = [](Flash::ProgramFlashFuncCallback callback) {
             MessageTransferAnimSetAck ack;
             ack.result = 1;
             MessageService::SendMessage(&ack);
 
             // Transfer data
-            Bluetooth::ReceiveBulkData::receiveToFlash(Flash::getDataSetDataAddress(), nullptr, callback);
+            _programCallback = callback;
+            Bluetooth::ReceiveBulkData::receiveToFlash(Flash::getNextDataSetDataAddress(), _dataSize, nullptr,
+                [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                    // Keep the hash of the data that was just received, so it isn't read back from flash
+                    receivedDataSize = result ? data_size : 0;
+                    receivedDataHash = ReceiveBulkData::dataHash();
+                    _programCallback(context, result, address, data_size);
+                });
         };
 
         static auto onProgramFinished = [](bool result) {
             size = computeDataSetSize();
-            hash = computeDataSetHash();
+            hash = data->hash;
 
             //printAnimationInfo();
             NRF_LOG_INFO("Dataset size=0x%x, hash=0x%08x", size, hash);
@@ -287,6 +432,17 @@ namespace DataSet
         }
     }
 
+    void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt) {
+        if (evt == Flash::ProgrammingEventType_Begin) {
+            // The data may be rewritten, and the memory is welcome while programming
+            freeIndex();
+        } else if (evt == Flash::ProgrammingEventType_End) {
+            // Programming may have switched slots, or cleared them
+            selectData();
+            buildIndex();
+        }
+    }
+
     void ProgramDefaultAnimSetHandler(const Message* msg) {
         // Reprogram the default dataset
         ProgramDefaultDataSet(*SettingsManager::getSettings(), [](bool success) {
@@ -295,6 +451,178 @@ namespace DataSet
 
     }
 
+    /// <summary>
+    /// Finds a section of the data set described by theData, whose header is (or will be) at location
+    /// </summary>
+    static void getSection(const Data* theData, const Data* location, DataSetSection section, const uint8_t*& start, uint32_t& sectionSize) {
+        auto bits = &location->animationBits;
+        start = nullptr;
+        sectionSize = 0;
+        switch (section) {
+            case DataSetSection_Palette:
+                start = (const uint8_t*)theData->animationBits.palette.get(bits);
+                sectionSize = theData->animationBits.paletteSize * sizeof(uint8_t);
+                break;
+            case DataSetSection_RGBKeyframes:
+                start = (const uint8_t*)theData->animationBits.rgbKeyframes.get(bits);
+                sectionSize = theData->animationBits.rgbKeyFrameCount * sizeof(RGBKeyframe);
+                break;
+            case DataSetSection_RGBTracks:
+                start = (const uint8_t*)theData->animationBits.rgbTracks.get(bits);
+                sectionSize = theData->animationBits.rgbTrackCount * sizeof(RGBTrack);
+                break;
+            case DataSetSection_Keyframes:
+                start = (const uint8_t*)theData->animationBits.keyframes.get(bits);
+                sectionSize = theData->animationBits.keyFrameCount * sizeof(Keyframe);
+                break;
+            case DataSetSection_Tracks:
+                start = (const uint8_t*)theData->animationBits.tracks.get(bits);
+                sectionSize = theData->animationBits.trackCount * sizeof(Track);
+                break;
+            case DataSetSection_AnimationOffsets:
+                start = (const uint8_t*)theData->animationBits.animationOffsets.get(bits);
+                sectionSize = theData->animationBits.animationCount * sizeof(uint16_t);
+                break;
+            case DataSetSection_Animations:
+                start = (const uint8_t*)theData->animationBits.animations.get(bits);
+                sectionSize = theData->animationBits.animationsSize;
+                break;
+            case DataSetSection_ConditionOffsets:
+                start = (const uint8_t*)theData->conditionsOffsets.get(location);
+                sectionSize = theData->conditionCount * sizeof(uint16_t);
+                break;
+            case DataSetSection_Conditions:
+                start = (const uint8_t*)theData->conditions.get(location);
+                sectionSize = theData->conditionsSize;
+                break;
+            case DataSetSection_ActionOffsets:
+                start = (const uint8_t*)theData->actionsOffsets.get(location);
+                sectionSize = theData->actionCount * sizeof(uint16_t);
+                break;
+            case DataSetSection_Actions:
+                start = (const uint8_t*)theData->actions.get(location);
+                sectionSize = theData->actionsSize;
+                break;
+            case DataSetSection_Rules:
+                start = (const uint8_t*)theData->rules.get(location);
+                sectionSize = theData->ruleCount * sizeof(Rule);
+                break;
+            case DataSetSection_Behavior:
+                start = (const uint8_t*)theData->behavior.get(location);
+                sectionSize = sizeof(Behavior);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void computeDataSetHashes(Data* newData, const Data* location) {
+        for (int i = 0; i < DataSetSection_Count; ++i) {
+            const uint8_t* start;
+            uint32_t sectionSize;
+            getSection(newData, location, (DataSetSection)i, start, sectionSize);
+            newData->sectionHashes[i] = start != nullptr ? Utils::computeHash(start, sectionSize) : 0;
+        }
+        uint32_t dataSize = computeDataSetDataSize(newData);
+        if (receivedDataSize == dataSize) {
+            newData->hash = receivedDataHash;
+        } else {
+            // The palette is always first
+            newData->hash = Utils::computeHash(newData->animationBits.palette.get(&location->animationBits), dataSize);
+        }
+        receivedDataSize = 0;
+    }
+
+    uint32_t sectionHash(DataSetSection section) {
+        if (usingDefaults()) {
+            const uint8_t* start;
+            uint32_t sectionSize;
+            getSection(data, data, section, start, sectionSize);
+            return start != nullptr ? Utils::computeHash(start, sectionSize) : 0;
+        }
+        return data->sectionHashes[section];
+    }
+
+    void RequestDataSetHashesHandler(const Message* msg) {
+        static_assert(DATA_SET_SECTION_COUNT == DataSetSection_Count, "Section count in messages is out of date");
+        MessageDataSetHashes hashes;
+        hashes.dataSetHash = hash;
+        hashes.dataSetSize = size;
+        for (int i = 0; i < DataSetSection_Count; ++i) {
+            hashes.sectionHashes[i] = sectionHash((DataSetSection)i);
+        }
+        MessageService::SendMessage(&hashes);
+    }
+
+    struct Patch
+    {
+        uint8_t* buffer;        // Word aligned copy of the patched range
+        uint32_t offset;        // Where the buffer goes, from the start of the data
+        uint32_t bufferSize;
+        uint16_t headSize;      // Bytes kept from flash before the patch
+        uint16_t size;          // Bytes sent by the central
+    };
+    static Patch patch = { nullptr, 0, 0, 0, 0 };
+
+    void ReceiveDataSetPatchHandler(const Message* msg) {
+        const MessageTransferDataSetPatch* message = (const MessageTransferDataSetPatch*)msg;
+        NRF_LOG_DEBUG("Received request to patch %d bytes of dataset at 0x%x", message->size, message->offset);
+
+        MessageTransferDataSetPatchAck ack;
+        ack.result = 0;
+        if (patch.buffer != nullptr) {
+            NRF_LOG_ERROR("Dataset patch already in progress");
+        } else if (message->size == 0 || message->size > DATA_SET_PATCH_MAX_SIZE || message->offset + message->size > size) {
+            NRF_LOG_ERROR("Invalid dataset patch");
+        } else if (usingDefaults()) {
+            // The defaults are part of the firmware, the whole data set must be sent instead
+            NRF_LOG_ERROR("Can't patch the default dataset");
+        } else {
+            patch.offset = message->offset & ~3;
+            patch.headSize = message->offset - patch.offset;
+            patch.size = message->size;
+            patch.bufferSize = Utils::roundUpTo4(patch.headSize + patch.size);
+            patch.buffer = (uint8_t*)Heap::alloc(patch.bufferSize, Heap::HeapTag_DataSet);
+            if (patch.buffer == nullptr) {
+                NRF_LOG_ERROR("Not enough ram to patch dataset");
+            } else {
+                // Start from the current bytes so the padding around the patch is unchanged
+                memcpy(patch.buffer, (const void*)(Flash::getDataSetDataAddress() + patch.offset), patch.bufferSize);
+                ack.result = 1;
+            }
+        }
+        MessageService::SendMessage(&ack);
+        if (ack.result == 0) {
+            return;
+        }
+
+        static auto finishPatch = [](bool result) {
+            Heap::free(patch.buffer);
+            patch.buffer = nullptr;
+
+            hash = data->hash;
+            NRF_LOG_INFO("Dataset patched, hash=0x%08x", hash);
+
+            MessageTransferDataSetPatchFinished finished;
+            finished.result = result ? 1 : 0;
+            MessageService::SendMessage(&finished);
+        };
+
+        ReceiveBulkData::receive(nullptr,
+            [](void* context, uint16_t bulkSize) -> uint8_t* {
+                // Bulk data goes straight into the patch buffer
+                return bulkSize == patch.size ? patch.buffer + patch.headSize : nullptr;
+            },
+            [](void* context, bool result, uint8_t* bulkData, uint16_t bulkSize) {
+                if (!result) {
+                    NRF_LOG_ERROR("Failed to receive dataset patch");
+                    finishPatch(false);
+                } else if (!Flash::patchDataSet(patch.offset, patch.buffer, patch.bufferSize, finishPatch)) {
+                    finishPatch(false);
+                }
+            });
+    }
+
     uint32_t computeDataSetDataSize(const Data* newData) {
         return
             Utils::roundUpTo4(newData->animationBits.paletteSize * sizeof(uint8_t)) +
@@ -336,8 +664,4 @@ namespace DataSet
         return computeDataSetDataSize(data);
     }
 
-    uint32_t computeDataSetHash() {
-        return Utils::computeHash((const uint8_t*)Flash::getDataSetDataAddress(), size);
-    }
-
 }
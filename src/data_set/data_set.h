@@ -16,10 +16,32 @@
 #define SPECIAL_COLOR_INDEX (MAX_COLOR_MAP_SIZE - 1)
 #define MAX_ANIMATIONS (64)
 
+// Largest range of the data set that can be replaced at once without reprogramming it all
+#define DATA_SET_PATCH_MAX_SIZE 1024
+
 namespace DataSet
 {
     struct Data;
 
+    // Sections of the data set data, in flash order
+    enum DataSetSection
+    {
+        DataSetSection_Palette = 0,
+        DataSetSection_RGBKeyframes,
+        DataSetSection_RGBTracks,
+        DataSetSection_Keyframes,
+        DataSetSection_Tracks,
+        DataSetSection_AnimationOffsets,
+        DataSetSection_Animations,
+        DataSetSection_ConditionOffsets,
+        DataSetSection_Conditions,
+        DataSetSection_ActionOffsets,
+        DataSetSection_Actions,
+        DataSetSection_Rules,
+        DataSetSection_Behavior,
+        DataSetSection_Count
+    };
+
     typedef void (*InitCallback)();
     typedef void (*DataSetWrittenCallback)(bool success);
 
@@ -31,6 +53,7 @@ namespace DataSet
     // Size Hash
     uint32_t dataSize();
     uint32_t dataHash();
+    uint32_t sectionHash(DataSetSection section);
 
     const Animations::RGBTrack& getHeatTrack();
 
@@ -54,6 +77,10 @@ namespace DataSet
     const Behaviors::Rule* getRule(int ruleIndex);
     uint16_t getRuleCount();
 
+    // Indices of the behavior rules with the given type of condition, in rule order, so events
+    // only go through the rules they can trigger. Returns nullptr if the data set isn't indexed.
+    const uint16_t* getRulesForCondition(Behaviors::ConditionType conditionType, uint16_t& outCount);
+
     // Behaviors
     const Behaviors::Behavior* getBehavior();
 
@@ -62,7 +89,15 @@ namespace DataSet
 
     uint32_t computeDataSetDataSize(const Data* newData);
 
+    // Fills in the cached hashes of a data set whose data is already in flash, location is
+    // where its header is (or will be) written
+    void computeDataSetHashes(Data* newData, const Data* location);
+
+    // The defaults are built into the firmware, these clear the programmed data set (if any) so
+    // they get used, for the layout of the given settings
     void ProgramDefaultDataSet(const Config::Settings& settingsPackAlong, DataSetWrittenCallback callback);
+    const Data* getDefaultDataSet();
+    bool usingDefaults();
 
     void printAnimationInfo();
 }
@@ -4,14 +4,20 @@
 #include "behaviors/action.h"
 #include "behaviors/behavior.h"
 #include "data_animation_bits.h"
+#include "data_set.h"
 
 #define ANIMATION_SET_VALID_KEY (0x600DF00D) // Good Food ;)
-#define ANIMATION_SET_VERSION 3
+#define ANIMATION_SET_VERSION 6
 
 using namespace Animations;
 
 namespace DataSet
 {
+    /// <summary>
+    /// Header of a data set, the data follows it. All the offsets are relative to the header,
+    /// except the animation bits' which are relative to the bits, so the whole data set can be
+    /// copied or mapped at any address.
+    /// </summary>
     struct Data
     {
         // Indicates whether there is valid data
@@ -23,31 +29,49 @@ namespace DataSet
         // The conditions. Because conditions can be one of multiple classes (simple inheritance system)
         // The dataset stores an offset into the conditions buffer for each entry. The first member of
         // The condition base class is a type enum indicating what it actually is.
-        const uint16_t* conditionsOffsets; // offsets to actual conditions from the conditions pointer below
+        DataOffset<uint16_t> conditionsOffsets; // offsets to actual conditions from the conditions below
         uint32_t conditionCount; // The conditions we have, 4-byte aligned, so may need some padding
-        const Behaviors::Condition* conditions;
+        DataOffset<uint8_t> conditions;
         uint32_t conditionsSize; // In bytes
 
         // The actions. Because actions can be one of multiple classes (simple inheritance system)
         // The dataset stores an offset into the actions buffer for each entry. The first member of
         // The action base class is a type enum indicating what it actually is.
-        const uint16_t* actionsOffsets; // offsets to actual actions from the actions pointer below
+        DataOffset<uint16_t> actionsOffsets; // offsets to actual actions from the actions below
         uint32_t actionCount; // The actions we have, 4-byte aligned, so may need some padding
-        const Behaviors::Action* actions;
+        DataOffset<uint8_t> actions;
         uint32_t actionsSize; // In bytes
 
         // Rules are pairs or conditions and actions
-        const Behaviors::Rule* rules; // pointer to array of rules, behaviors index into it!
+        DataOffset<Behaviors::Rule> rules; // array of rules, behaviors index into it!
         uint32_t ruleCount;
 
         // The behavior of this die, or a collection of condition->action pairs
-        const Behaviors::Behavior* behavior;
+        DataOffset<Behaviors::Behavior> behavior;
 
         // Brightness to apply on top of animations
         uint8_t brightness;
 
+        // Hashes of the data, computed once when programming so boot doesn't walk the data
+        uint32_t sectionHashes[DataSetSection_Count];
+        uint32_t hash; // Of the whole data, as reported in IAmADie
+
+        // Incremented each time a data set is programmed, the most recent of the two slots is used
+        uint32_t generation;
+
         // Indicates whether there is valid data
         uint32_t tailMarker;
+
+        const uint16_t* getConditionsOffsets() const { return conditionsOffsets.get(this); }
+        const Behaviors::Condition* getCondition(int index) const {
+            return (const Behaviors::Condition*)(const void*)(conditions.get(this) + getConditionsOffsets()[index]);
+        }
+        const uint16_t* getActionsOffsets() const { return actionsOffsets.get(this); }
+        const Behaviors::Action* getAction(int index) const {
+            return (const Behaviors::Action*)(const void*)(actions.get(this) + getActionsOffsets()[index]);
+        }
+        const Behaviors::Rule* getRules() const { return rules.get(this); }
+        const Behaviors::Behavior* getBehavior() const { return behavior.get(this); }
     };
 
 }
\ No newline at end of file
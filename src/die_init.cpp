@@ -17,6 +17,9 @@
 #include "drivers_nrf/ppi.h"
 #include "drivers_nrf/dfu.h"
 #include "drivers_nrf/mcu_temperature.h"
+#include "drivers_nrf/profiler.h"
+#include "drivers_nrf/trace.h"
+#include "drivers_nrf/retained_state.h"
 
 #include "config/board_config.h"
 #include "config/settings.h"
@@ -29,15 +32,21 @@
 #include "bluetooth/bluetooth_stack.h"
 #include "bluetooth/bluetooth_custom_advertising_data.h"
 #include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/state_characteristics.h"
 #include "bluetooth/bulk_data_transfer.h"
 #include "bluetooth/telemetry.h"
+#include "bluetooth/accel_stream.h"
+#include "bluetooth/transfer_benchmark.h"
 
 #include "animations/animation_cycle.h"
 #include "data_set/data_set.h"
 
 #include "handlers/battery_notifications.h"
 #include "handlers/roll_notifications.h"
+#include "handlers/roll_history.h"
 #include "handlers/rssi_notifications.h"
+#include "handlers/link_info.h"
+#include "handlers/memory_stats.h"
 #include "handlers/power_event.h"
 #include "handlers/set_led_color.h"
 #include "handlers/store_value.h"
@@ -55,7 +64,10 @@
 #include "modules/led_error_indicator.h"
 #include "modules/attract_mode_controller.h"
 #include "modules/user_mode_controller.h"
+#include "modules/performance_profiles.h"
 #include "modules/discharge_controller.h"
+#include "modules/led_stream.h"
+#include "modules/anim_energy.h"
 
 #include "utils/Utils.h"
 
@@ -81,6 +93,29 @@ namespace Die
         PowerManager::feed();
     }
 
+    // Boot steps that other steps wait on, see initNodes
+    enum InitStep : uint16_t
+    {
+        InitStep_Settings           = 1 << 0,
+        InitStep_Accelerometer      = 1 << 1,
+        InitStep_Temperature        = 1 << 2,
+        InitStep_BatteryController  = 1 << 3,
+        InitStep_LEDs               = 1 << 4,
+        InitStep_HardwareChecked    = 1 << 5,
+        InitStep_DataSet            = 1 << 6,
+        InitStep_Modules            = 1 << 7,
+        InitStep_Advertising        = 1 << 8,
+    };
+
+    void completeInitStep(InitStep step);
+
+    // Hardware init results, shown once the LEDs are up
+    static bool batteryInitRet = false;
+    static bool coilInitRet = false;
+    static bool accInitRet = false;
+    static bool tempInitRet = false;
+    static bool ledInitRet = false;
+
     void init() {
         //--------------------
         // Initialize NRF drivers
@@ -94,8 +129,17 @@ namespace Die
         // later on if something bad happens.
         Watchdog::init();
 
+        // Before the reset reason is cleared, it tells whether the retained state is valid
+        RetainedState::init();
+
+        // Parts with an instruction cache leave it off after reset (the nRF52810 doesn't define it)
+        #if defined(NVMC_ICACHECNF_CACHEEN_Msk)
+        NRF_NVMC->ICACHECNF = NVMC_ICACHECNF_CACHEEN_Enabled << NVMC_ICACHECNF_CACHEEN_Pos;
+        #endif
+
         // Then the log system
         Log::init();
+        NRF_LOG_INFO("%s boot", RetainedState::isWarmBoot() ? "Warm" : "Cold");
 
         // Display reset reason bits
         #if defined(NRF_LOG_ENABLED)
@@ -138,12 +182,24 @@ namespace Die
         // Add generic bluetooth data service
         MessageService::init();
 
+        // Roll state, battery and temperature that the central can simply read
+        StateCharacteristics::init();
+
+        // Cycle counters for the animation pipeline (debug builds only)
+        Profiler::init();
+
+        // Binary trace log, drained from the main loop
+        Trace::init();
+
         // Initialize the DFU service so we can upgrade the firmware without needing to reset the die
         DFU::init();
 
         // Flash is needed to update settings/animations
         Flash::init();
 
+        // Runtime values are in flash too
+        ValueStore::init();
+
         //--------------------
         // Fetch board configuration now, so we know how to initialize
         // the rest of the hardware (pins, led count, etc...)
@@ -165,136 +221,228 @@ namespace Die
 
             // Battery sense pin depends on board info
             // on fail blink red one long time then power off
-            static bool batteryInitRet = false;
             batteryInitRet = Battery::init();
 
-            static bool coilInitRet = false;
             coilInitRet = Coil::init();
 
-            // Accel pins depend on the board info
-            // on fail blink 2 short times then power off
-            static bool accInitRet = false;
-            Accelerometer::init([](bool accInitRetParam) {
-                accInitRet = accInitRetParam;
+            // From here on, modules start as soon as the ones they depend on are ready
+            completeInitStep(InitStep_Settings);
+        });
+    }
 
-                // Battery Temperature Module
-                // on fail blink red 3 short times then power off
-                NTC::init();
-
-                // Temperature sensor
-                MCUTemperature::init();
-
-                // Temperature Module
-                Temperature::init([] (bool tempInitRetParam) {
-
-                    static bool tempInitRet = false;
-                    tempInitRet = tempInitRetParam;
-                    // Battery controller relies on the battery driver
-                    BatteryController::init();
-
-                    // Charger proximity translates info from the battery controller
-                    ChargerProximity::init();
-
-                    // Lights depend on board info as well
-                    LEDs::init([](bool ledInitRet) {
-                        const bool engineeringSample = !ValidationManager::inValidation() && !ValueStore::hasValidationTimestamp();
-                        if (!engineeringSample) {
-                            // If LED init failed, we will "try" to turn LEDs on, hoping the problem is simply an led chain thing
-                            if (!ledInitRet) {
-                                LEDErrorIndicator::ShowErrorAndHalt(LEDErrorIndicator::ErrorType_LEDs);
-                            }
-
-                            if (!tempInitRet) {
-                                LEDErrorIndicator::ShowErrorAndHalt(LEDErrorIndicator::ErrorType_NTC);
-                            }
-                        }
-
-                        // Now that we have LEDs, indicate battery or acc errors
-                        if (!batteryInitRet || !coilInitRet) {
-                            LEDErrorIndicator::ShowErrorAndHalt(LEDErrorIndicator::ErrorType_BatterySense);
-                        }
-
-                        if (!accInitRet) {
-                            LEDErrorIndicator::ShowErrorAndHalt(LEDErrorIndicator::ErrorType_Accelerometer);
-                        }
-
-                        // Animation set needs flash and board info
-                        DataSet::init([] () {
-
-                            // Telemetry depends on accelerometer
-                            Telemetry::init();
-
-                            // Animation controller relies on animation set
-                            AnimController::init();
-
-                            //--------------------
-                            // Initialize Bluetooth Advertising Data + Name
-                            //--------------------
-
-                            // Now that the message service added its uuid to the SoftDevice, initialize the advertising
-                            Stack::initAdvertising();
-
-                            // Initialize custom advertising data handler
-                            CustomAdvertisingDataHandler::init();
-
-                            auto runMode = Pixel::getCurrentRunMode();
-                            if (runMode == Pixel::RunMode_User) {
-                                // Want to prevent sleep mode due to animations while not in validation
-                                Accelerometer::hookRollState(feed, nullptr);
-                            }
-
-                            // Behavior Controller relies on all the modules
-                            BehaviorController::init(false, true, true);
-
-                            // Instant Animation Controller preview depends on bluetooth
-                            InstantAnimationController::init();
-
-                            // Another module used in testing
-                            DischargeController::init();
-
-                            // Allow the die to go "silent" and not play animations based on behavior rules, but only when told to
-                            UserModeController::init();
-
-                            // Initialize various message handlers
-                            Handlers::PowerEvent::init();
-                            Handlers::SetLEDColor::init();
-                            Handlers::StoreValue::init();
-                            Handlers::WhoAreYou::init();
-                            Handlers::BatteryNotifications::init();
-                            Handlers::RollNotifications::init();
-                            Handlers::RssiNotifications::init();
-
-                            // Initialize common message handlers
-                            Die::initMainLogic();
-
-                            // Always init validation manager so it handles the ExitValidation message
-                            ValidationManager::init();
-
-                            // Start advertising!
-                            Stack::startAdvertising();
-
-                            // Entering the main loop! Play Hello! anim if in user mode
-                            switch (runMode) {
-                                case Pixel::RunMode_Validation:
-                                    ValidationManager::onPixelInitialized();
-                                    break;
-                                case Pixel::RunMode_Attract:
-                                    AttractModeController::init();
-                                    break;
-                                default:
-                                    Die::initDieLogic();
-                                    BehaviorController::onPixelInitialized();
-                                    Timers::setDelayedCallback([](void* ignore) {
-                                        BehaviorController::EnableAccelerometerRules();
-                                    }, nullptr, 1000);
-                                    break;
-                            }
-
-                            NRF_LOG_INFO("----- Device initialized! -----");
-                        });
-                    });
-                });
-            });
+    //--------------------
+    // Initialization steps that run once the settings are loaded.
+    // Each one lists the steps it depends on and calls completeInitStep() when done (possibly
+    // from a callback), so the independent asynchronous inits (accelerometer, temperature/LEDs
+    // and the data set, which may have to program the defaults to flash) overlap.
+    //--------------------
+
+    void initAccelerometer() {
+        // Accel pins depend on the board info
+        // on fail blink 2 short times then power off
+        Accelerometer::init([](bool accInitRetParam) {
+            accInitRet = accInitRetParam;
+            completeInitStep(InitStep_Accelerometer);
         });
     }
+
+    void initTemperature() {
+        // Battery Temperature Module
+        // on fail blink red 3 short times then power off
+        NTC::init();
+
+        // Temperature sensor
+        MCUTemperature::init();
+
+        // Temperature Module
+        Temperature::init([] (bool tempInitRetParam) {
+            tempInitRet = tempInitRetParam;
+            completeInitStep(InitStep_Temperature);
+        });
+    }
+
+    void initBatteryController() {
+        // Battery controller relies on the battery driver and the temperature
+        BatteryController::init();
+
+        // Charger proximity translates info from the battery controller
+        ChargerProximity::init();
+
+        completeInitStep(InitStep_BatteryController);
+    }
+
+    void initLEDs() {
+        // Lights depend on board info as well, and on the battery state to decide whether to power them
+        LEDs::init([](bool ledInitRetParam) {
+            ledInitRet = ledInitRetParam;
+            completeInitStep(InitStep_LEDs);
+        });
+    }
+
+    void checkHardware() {
+        const bool engineeringSample = !ValidationManager::inValidation() && !ValueStore::hasValidationTimestamp();
+        if (!engineeringSample) {
+            // If LED init failed, we will "try" to turn LEDs on, hoping the problem is simply an led chain thing
+            if (!ledInitRet) {
+                LEDErrorIndicator::ShowErrorAndHalt(LEDErrorIndicator::ErrorType_LEDs);
+            }
+
+            if (!tempInitRet) {
+                LEDErrorIndicator::ShowErrorAndHalt(LEDErrorIndicator::ErrorType_NTC);
+            }
+        }
+
+        // Now that we have LEDs, indicate battery or acc errors
+        if (!batteryInitRet || !coilInitRet) {
+            LEDErrorIndicator::ShowErrorAndHalt(LEDErrorIndicator::ErrorType_BatterySense);
+        }
+
+        if (!accInitRet) {
+            LEDErrorIndicator::ShowErrorAndHalt(LEDErrorIndicator::ErrorType_Accelerometer);
+        }
+
+        completeInitStep(InitStep_HardwareChecked);
+    }
+
+    void initDataSet() {
+        // Animation set needs flash and board info
+        DataSet::init([] () {
+            completeInitStep(InitStep_DataSet);
+        });
+    }
+
+    void initModules() {
+        // Telemetry and the accelerometer stream depend on accelerometer
+        Telemetry::init();
+        AccelStream::init();
+
+        // Bulk transfer throughput measurement
+        TransferBenchmark::init();
+
+        // Animation controller relies on animation set
+        AnimController::init();
+        AnimEnergy::init();
+
+        auto runMode = Pixel::getCurrentRunMode();
+        if (runMode == Pixel::RunMode_User) {
+            // Want to prevent sleep mode due to animations while not in validation
+            Accelerometer::hookRollState(feed, nullptr);
+        }
+
+        // Behavior Controller relies on all the modules
+        BehaviorController::init(false, true, true);
+
+        // Instant Animation Controller preview depends on bluetooth
+        InstantAnimationController::init();
+
+        // Another module used in testing
+        DischargeController::init();
+
+        // Lets the app take over the LEDs from the animation controller
+        LEDStream::init();
+
+        // Allow the die to go "silent" and not play animations based on behavior rules, but only when told to
+        UserModeController::init();
+
+        // Frame rate, LED budget, accelerometer, advertising and telemetry rates, set together
+        PerformanceProfiles::init();
+
+        // Initialize various message handlers
+        Handlers::PowerEvent::init();
+        Handlers::SetLEDColor::init();
+        Handlers::StoreValue::init();
+        Handlers::WhoAreYou::init();
+        Handlers::BatteryNotifications::init();
+        Handlers::RollNotifications::init();
+        Handlers::RollHistory::init();
+        Handlers::RssiNotifications::init();
+        Handlers::LinkInfo::init();
+        Handlers::MemoryStats::init();
+
+        // Initialize common message handlers
+        Die::initMainLogic();
+
+        // Always init validation manager so it handles the ExitValidation message
+        ValidationManager::init();
+
+        // Now advertise the die state and handle the requests that came in meanwhile
+        CustomAdvertisingDataHandler::setModulesReady();
+        MessageService::setReady();
+
+        // Entering the main loop! Play Hello! anim if in user mode
+        switch (runMode) {
+            case Pixel::RunMode_Validation:
+                ValidationManager::onPixelInitialized();
+                break;
+            case Pixel::RunMode_Attract:
+                AttractModeController::init();
+                break;
+            default:
+                Die::initDieLogic();
+                BehaviorController::onPixelInitialized();
+                Timers::setDelayedCallback([](void* ignore) {
+                    BehaviorController::EnableAccelerometerRules();
+                }, nullptr, 1000);
+                break;
+        }
+
+        NRF_LOG_INFO("----- Device initialized! -----");
+        completeInitStep(InitStep_Modules);
+    }
+
+    void initAdvertising() {
+        //--------------------
+        // Initialize Bluetooth Advertising Data + Name
+        //--------------------
+
+        // Now that the message service added its uuid to the SoftDevice, initialize the advertising,
+        // the name and device id only need the settings
+        Stack::initAdvertising();
+
+        // Initialize custom advertising data handler
+        CustomAdvertisingDataHandler::init();
+
+        // Start advertising! Phones can connect while the rest of the modules initialize,
+        // the message service keeps their requests until then
+        Stack::startAdvertising();
+
+        completeInitStep(InitStep_Advertising);
+    }
+
+    struct InitNode
+    {
+        InitStep step;
+        uint16_t prerequisites;
+        void (*run)();
+    };
+
+    static const InitNode initNodes[] =
+    {
+        { InitStep_Advertising,         InitStep_Settings,                                  initAdvertising },
+        { InitStep_Accelerometer,       InitStep_Settings,                                  initAccelerometer },
+        { InitStep_Temperature,         InitStep_Settings,                                  initTemperature },
+        { InitStep_BatteryController,   InitStep_Temperature,                               initBatteryController },
+        { InitStep_LEDs,                InitStep_BatteryController,                         initLEDs },
+        { InitStep_HardwareChecked,     InitStep_Accelerometer | InitStep_LEDs,             checkHardware },
+        { InitStep_DataSet,             InitStep_Settings,                                  initDataSet },
+        { InitStep_Modules,             InitStep_HardwareChecked | InitStep_DataSet | InitStep_Advertising, initModules },
+    };
+
+    static uint16_t startedSteps = 0;
+    static uint16_t completedSteps = 0;
+
+    /// <summary>
+    /// Marks a step as done and runs the steps that were only waiting on it
+    /// </summary>
+    void completeInitStep(InitStep step) {
+        completedSteps |= step;
+        NRF_LOG_DEBUG("Init step 0x%x done at %d ms", step, Timers::millis());
+        for (auto& node : initNodes) {
+            if ((startedSteps & node.step) == 0 && (completedSteps & node.prerequisites) == node.prerequisites) {
+                // Flag it first since run() may complete steps (including this one) right away
+                startedSteps |= node.step;
+                node.run();
+            }
+        }
+    }
 }
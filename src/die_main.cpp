@@ -3,6 +3,7 @@
 #include "drivers_nrf/scheduler.h"
 #include "drivers_nrf/power_manager.h"
 #include "drivers_nrf/log.h"
+#include "drivers_nrf/trace.h"
 #include "bluetooth/bluetooth_message_service.h"
 #include "bluetooth/bluetooth_stack.h"
 #include "modules/accelerometer.h"
@@ -70,21 +71,22 @@ namespace Die
                 } else {
                     // Set interrupt pin to wake up power manager
                     Accelerometer::enableInterrupt([](void* param) {
-                        Scheduler::push(nullptr, 0, [](void* ignoreData, uint16_t ignoreSize) {
+                        Scheduler::pushCoalesced(nullptr, 0, [](void* ignoreData, uint16_t ignoreSize) {
                             // Wake up
                             PowerManager::wakeFromSleep();
-                        });
+                        }, Scheduler::Priority_Realtime);
                     }, nullptr);
                 }
                 break;
             case PowerManager::PowerManagerEvent_WakingUpFromSleep:
                 //NRF_LOG_INFO("Resuming from Sleep");
+                // Advertise first so the app can connect while the rest wakes up
+                Stack::startAdvertising();
                 Accelerometer::wakeUp();
                 //AnimController::start();
                 BatteryController::setControllerOverrideMode(BatteryControllerMode::ControllerOverrideMode_Default);
                 BatteryController::setUpdateRate(BatteryController::UpdateRate_Normal);
                 Temperature::slowMode(false);
-                Stack::startAdvertising();
                 break;
             default:
                 break;
@@ -124,6 +126,7 @@ namespace Die
         Scheduler::update();
         Watchdog::feed();
         MessageService::update();
+        Trace::process();
         if (!MessageService::needUpdate()) {
             // Skip calling power manager so the CPU doesn't go to sleep
             PowerManager::update();
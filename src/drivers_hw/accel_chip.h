@@ -26,6 +26,24 @@ namespace DriversHW
 
         void lowPower();
 
+        // Output data rate, the accelerometer module switches to the high rate while the die is moving.
+        // The low rate also uses the chip's low power resolution where it has one.
+        enum SampleRate : uint8_t
+        {
+            SampleRate_Low = 0,
+            SampleRate_High,
+            SampleRate_Stream,  // Raw data streaming, see setStreamRate()
+        };
+        void setSampleRate(SampleRate rate);
+        SampleRate getSampleRate();
+
+        // Same as setSampleRate(), disableInterrupt() then enableDataInterrupt(), but restarts
+        // the chip only once, so the first sample comes in one sample period later
+        void startData(SampleRate rate);
+
+        // Sets the rate used by SampleRate_Stream, returns the actual rate in Hz
+        uint16_t setStreamRate(uint16_t rateHz);
+
         // Notification management
         typedef void(*AccelClientMethod)(void* param, const Core::int3& acceleration);
         void hook(AccelClientMethod method, void* param);
@@ -8,7 +8,9 @@
 #include "drivers_nrf/timers.h"
 #include "drivers_nrf/power_manager.h"
 #include "drivers_nrf/scheduler.h"
+#include "drivers_nrf/comparator.h"
 #include "drivers_hw/battery.h"
+#include "core/delegate_array.h"
 
 using namespace DriversNRF;
 using namespace Config;
@@ -17,11 +19,14 @@ using namespace Config;
 #define VCOIL_LOW_THRESHOLD (-1000) // mV
 #define VCOIL_HIGH_THRESHOLD 7000 // mV
 
-#define COIL_MEASURE_INTERVAL 100   // ms
+#define COIL_MEASURE_INTERVAL 100   // ms, retry delay when the SAADC is busy
 #define COIL_MEASUREMENT_COUNT 18  // count
+#define COIL_BURST_SAMPLE_INTERVAL_US 10000 // Samples of a burst are taken by hardware, this far apart
 #define COIL_UPDATE_MS_FAST 1000    // ms
 //#define COIL_UPDATE_MS_SLOW 5000    // ms
 
+#define MAX_COIL_CLIENTS 2
+
 #define ChargerOn 4800 // >
 #define ChargerOff 3000 // <
 
@@ -30,6 +35,9 @@ using namespace Config;
 #define ChargerPingMin 1500 // <
 #define ChargerPingMax 3000 // >
 
+// While the coil is off, the comparator waits for it to rise above this before sampling again
+#define COIL_WAKE_THRESHOLD ChargerPingMin // mV
+
 
 namespace DriversHW
 {
@@ -41,15 +49,16 @@ namespace Coil
     int32_t vcoilMinTimes1000;
     int32_t vcoilMaxTimes1000;
 
-    int32_t vcoilMeasurementAccumulator;
-    int32_t vcoilMeasurementCount;
-    int32_t vcoilMeasurementMin;
-    int32_t vcoilMeasurementMax;
-
     CoilState coilState;
 
+    DelegateArray<ClientMethod, MAX_COIL_CLIENTS> clients;
+
+    int lastBurstMs;
+
     int32_t checkVCoilTimes1000();
     void update(void* param);
+    void onBurstDone(void* param, bool success);
+    void onCoilRising(void* param);
 
     bool init() {
         vCoilTimes1000 = checkVCoilTimes1000();
@@ -63,12 +72,8 @@ namespace Coil
             NRF_LOG_ERROR("Coil Voltage invalid, VCoil: %d.%03d", vCoilTimes1000 / 1000, vCoilTimes1000 % 1000);
         }
 
-        vcoilMeasurementCount = 0;
-        vcoilMeasurementMin = 10000;
-        vcoilMeasurementMax = 0;
-
         Timers::createTimer(&coilTimer, APP_TIMER_MODE_SINGLE_SHOT, update);
-        Timers::startTimer(coilTimer, COIL_UPDATE_MS_FAST);
+        Timers::startTimerAligned(coilTimer, COIL_UPDATE_MS_FAST);
 
         NRF_LOG_INFO("Coil init");
         NRF_LOG_INFO("  Voltage: %d.%03d", vCoilTimes1000 / 1000, vCoilTimes1000 % 1000);
@@ -93,25 +98,32 @@ namespace Coil
     }
 
     void update(void* param) {
+        lastBurstMs = Timers::millis();
+
         // Start a measurement burst
-        auto vcoil = checkVCoilTimes1000();
-        vcoilMeasurementAccumulator += vcoil;
+        if (!A2D::startBurst(COIL_MEASUREMENT_COUNT, COIL_BURST_SAMPLE_INTERVAL_US, onBurstDone, nullptr)) {
+            // The SAADC is busy, try again in a bit
+            Timers::startTimerAligned(coilTimer, COIL_MEASURE_INTERVAL);
+        }
+    }
 
-        vcoilMeasurementMin = MIN(vcoilMeasurementMin, vcoil);
-        vcoilMeasurementMax = MAX(vcoilMeasurementMax, vcoil);
+    void onBurstDone(void* param, bool success) {
+        if (success) {
+            int32_t vcoilMeasurementAccumulator = 0;
+            int32_t vcoilMeasurementMin = 10000;
+            int32_t vcoilMeasurementMax = 0;
+            for (int i = 0; i < COIL_MEASUREMENT_COUNT; ++i) {
+                auto vcoil = A2D::getBurstValueTimes1000(A2D::ScanChannel_5V, i) * vCoilMultTimes1000 / 1000;
+                vcoilMeasurementAccumulator += vcoil;
+                vcoilMeasurementMin = MIN(vcoilMeasurementMin, vcoil);
+                vcoilMeasurementMax = MAX(vcoilMeasurementMax, vcoil);
+            }
 
-        vcoilMeasurementCount++;
-        if (vcoilMeasurementCount == COIL_MEASUREMENT_COUNT) {
             // Average the measurements
             vCoilTimes1000 = vcoilMeasurementAccumulator / COIL_MEASUREMENT_COUNT;
             vcoilMinTimes1000 = vcoilMeasurementMin;
             vcoilMaxTimes1000 = vcoilMeasurementMax;
-
-            // Reset counter/accumulator
-            vcoilMeasurementCount = 0;
-            vcoilMeasurementAccumulator = 0;
-            vcoilMeasurementMin = 10000;
-            vcoilMeasurementMax = 0;
+            const CoilState prevState = coilState;
 
             // Determine coil state
             if (vcoilMaxTimes1000 > ChargerOn && vcoilMinTimes1000 > ChargerOn) {
@@ -132,16 +144,52 @@ namespace Coil
                 }
             }
 
+            if (coilState != prevState) {
+                // Notify clients
+                for (int i = 0; i < clients.Count(); ++i) {
+                    clients[i].handler(clients[i].token, coilState);
+                }
+            }
+        }
+
+        // Nothing can change until a charger starts pinging, so don't sample while the coil is off
+        const int32_t wakeThresholdTimes1000 = COIL_WAKE_THRESHOLD * 1000 / vCoilMultTimes1000;
+        if (coilState != CoilState_Off ||
+            !Comparator::start(BoardManager::getBoard()->coilSensePin, wakeThresholdTimes1000, onCoilRising, nullptr)) {
             // Setup timer for next burst
-            Timers::startTimer(coilTimer, COIL_UPDATE_MS_FAST);
+            Timers::startTimerAligned(coilTimer, COIL_UPDATE_MS_FAST);
+        }
+    }
+
+    void onCoilRising(void* param) {
+        // A coil voltage floating around the threshold shouldn't have us sampling back to back
+        const int sinceLastBurst = Timers::millis() - lastBurstMs;
+        if (sinceLastBurst >= COIL_MEASURE_INTERVAL) {
+            update(nullptr);
         } else {
-            // Just keep measuring
-            Timers::startTimer(coilTimer, COIL_MEASURE_INTERVAL);
+            Timers::startTimer(coilTimer, COIL_MEASURE_INTERVAL - sinceLastBurst);
         }
     }
 
     CoilState getCoilState() {
         return coilState;
     }
+
+    /// <summary>
+    /// Method used by clients to request callbacks when the coil state changes
+    /// </summary>
+    void hook(ClientMethod callback, void* parameter) {
+        if (!clients.Register(parameter, callback))
+        {
+            NRF_LOG_ERROR("Too many coil hooks registered.");
+        }
+    }
+
+    /// <summary>
+    /// Method used by clients to stop getting coil callbacks
+    /// </summary>
+    void unHook(ClientMethod callback) {
+        clients.UnregisterWithHandler(callback);
+    }
 }
 }
\ No newline at end of file
@@ -18,6 +18,12 @@ namespace DriversHW
         int32_t getVCoilTimes1000();
         int32_t getVCoilMinTimes1000();
         int32_t getVCoilMaxTimes1000();
+
+        typedef void(*ClientMethod)(void* param, CoilState newState);
+
+        // Notification management, clients are called from the main loop when the coil state changes
+        void hook(ClientMethod method, void* param);
+        void unHook(ClientMethod client);
     }
 }
 
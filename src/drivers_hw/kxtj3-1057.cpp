@@ -77,16 +77,26 @@ namespace AccelChip
     const uint8_t devAddress = 0x0F;
     const Scale fsr = SCALE_4G;
     const int scaleMult = 4;
-    const DataRate dataRate = ODR_6_25;
+    const DataRate lowDataRate = ODR_6_25;
+    const DataRate highDataRate = ODR_25;
+    static DataRate streamDataRate = ODR_100;
+    static SampleRate sampleRate = SampleRate_Low;
     const uint16_t wakeUpThreshold = 32;
     const uint8_t wakeUpCount = 1;
 
+    // CTRL_REG1 RES bit, high resolution (12 bits) when set, low power (8 bits) otherwise
+    #define CTRL_REG1_RES 0b01000000
+
     #define MAX_CLIENTS 2
     DelegateArray<AccelClientMethod, MAX_CLIENTS> clients;
 
     void ApplySettings();
+    void writeDataRate();
     void standby();
     void active();
+    uint8_t enterStandby();
+    void enterActive(uint8_t ctrl1);
+    uint8_t withResolution(uint8_t ctrl1);
 
 
     // APP_TIMER_DEF(checkTimer);
@@ -118,6 +128,11 @@ namespace AccelChip
         Timers::setDelayedCallback([](void* param) {
 
             uint8_t c = I2C::readRegister(devAddress, WHO_AM_I);  // Read WHO_AM_I register
+            if (c != 0x35 && I2C::isFastMode()) {
+                NRF_LOG_WARNING("KXTJ3 - Bad WHOAMI 0x%02x in I2C fast mode, retrying in standard mode", c);
+                I2C::setFastMode(false);
+                c = I2C::readRegister(devAddress, WHO_AM_I);
+            }
             bool success = c == 0x35;
             if (!success) {
                 // WHO_AM_I should always be 0x35 on KXTJ3
@@ -131,13 +146,10 @@ namespace AccelChip
         }, nullptr, 3);
     }
 
-    void read(Core::int3* outAccel) {
-
-        // Read accelerometer data
-        uint8_t accBuffer[6];
-        I2C::readRegisters(devAddress, OUT_X_L, accBuffer, 6);
-
-        // Convert acc (12 bits)
+    /// <summary>
+    /// Converts the raw output registers (12 bits per axis) to acceleration
+    /// </summary>
+    void convert(const uint8_t* accBuffer, Core::int3* outAccel) {
         int16_t cx = (((int16_t)accBuffer[1] << 8) | accBuffer[0]) >> 4;
         if (cx & 0x0800) cx |= 0xF000;
         int16_t cy = (((int16_t)accBuffer[3] << 8) | accBuffer[2]) >> 4;
@@ -150,6 +162,14 @@ namespace AccelChip
         outAccel->zTimes1000 = cz * 1000 / (1 << 11) * scaleMult;
     }
 
+    void read(Core::int3* outAccel) {
+
+        // Read accelerometer data
+        uint8_t accBuffer[6];
+        I2C::readRegisters(devAddress, OUT_X_L, accBuffer, 6);
+        convert(accBuffer, outAccel);
+    }
+
     void standby()
     {
         uint8_t c = I2C::readRegister(devAddress, CTRL_REG1);
@@ -162,6 +182,35 @@ namespace AccelChip
         I2C::writeRegister(devAddress, CTRL_REG1, c | 0b10000000); //Set the active bit to begin detection
     }
 
+    /// <summary>
+    /// Goes into standby and returns CTRL_REG1, so that configuration changes to it can be written
+    /// along with the active bit by enterActive(), saving a read-modify-write on each side
+    /// </summary>
+    uint8_t enterStandby()
+    {
+        uint8_t c = I2C::readRegister(devAddress, CTRL_REG1);
+        I2C::writeRegister(devAddress, CTRL_REG1, c & ~(0b10000000));
+        return c;
+    }
+
+    void enterActive(uint8_t ctrl1)
+    {
+        I2C::writeRegister(devAddress, CTRL_REG1, ctrl1 | 0b10000000);
+    }
+
+    /// <summary>
+    /// Sets the resolution bit to match the sample rate, 8 bits are plenty to tell which face is up
+    /// while the die rests and draw a fraction of the current, rolls and streaming get the full 12 bits
+    /// </summary>
+    uint8_t withResolution(uint8_t ctrl1)
+    {
+        ctrl1 &= ~CTRL_REG1_RES;
+        if (sampleRate != SampleRate_Low) {
+            ctrl1 |= CTRL_REG1_RES;
+        }
+        return ctrl1;
+    }
+
     void lowPower()
     {
         disableDataInterrupt();
@@ -171,70 +220,117 @@ namespace AccelChip
     }
 
     void ApplySettings() {
-        standby();
+        uint8_t cfg = enterStandby();
 
-        // Scale
-        uint8_t cfg = I2C::readRegister(devAddress, CTRL_REG1);
+        // Data Rate
+        writeDataRate();
+
+        // Scale, set when going back to active
         cfg &= 0b11100011; // Mask out scale bits
         cfg |= (fsr << 2);
-        I2C::writeRegister(devAddress, CTRL_REG1, cfg);
+        enterActive(withResolution(cfg));
+    }
 
-        // Data Rate
+    void writeDataRate() {
         uint8_t ctrl = I2C::readRegister(devAddress, DATA_CTRL_REG);
-        ctrl &= 0b11111000; // Mask out data rate bits
-        ctrl |= dataRate;
+        ctrl &= 0b11110000; // Mask out data rate bits
+        switch (sampleRate) {
+            case SampleRate_High:
+                ctrl |= highDataRate;
+                break;
+            case SampleRate_Stream:
+                ctrl |= streamDataRate;
+                break;
+            default:
+                ctrl |= lowDataRate;
+                break;
+        }
         I2C::writeRegister(devAddress, DATA_CTRL_REG, ctrl);
+    }
 
-        active();
+    /// <summary>
+    /// Changes the output data rate, the chip needs to be in standby to do so
+    /// </summary>
+    void setSampleRate(SampleRate rate) {
+        if (rate != sampleRate) {
+            uint8_t ctrl = enterStandby();
+            sampleRate = rate;
+            writeDataRate();
+            enterActive(withResolution(ctrl));
+        }
+    }
+
+    SampleRate getSampleRate() {
+        return sampleRate;
+    }
+
+    /// <summary>
+    /// Picks the slowest data rate at least as fast as requested, up to 200Hz
+    /// (faster than that and the I2C reads and the scheduler can't keep up)
+    /// </summary>
+    uint16_t setStreamRate(uint16_t rateHz) {
+        DataRate rate;
+        uint16_t actualHz;
+        if (rateHz <= 25) {
+            rate = ODR_25;
+            actualHz = 25;
+        } else if (rateHz <= 50) {
+            rate = ODR_50;
+            actualHz = 50;
+        } else if (rateHz <= 100) {
+            rate = ODR_100;
+            actualHz = 100;
+        } else {
+            rate = ODR_200;
+            actualHz = 200;
+        }
+        if (rate != streamDataRate) {
+            streamDataRate = rate;
+            if (sampleRate == SampleRate_Stream) {
+                standby();
+                writeDataRate();
+                active();
+            }
+        }
+        return actualHz;
     }
 
     void enableInterrupt()
     {        
         // Make sure our interrupts are cleared to begin with!
-        standby();
+        uint8_t ctrl1 = enterStandby();
 
-        // enable interrupt on all axis any direction - Latched
-        I2C::writeRegister(devAddress, INT_CTRL_REG2, 0b00111111);
+        // INT_CTRL_REG1 and INT_CTRL_REG2 are consecutive, the chip auto-increments the address
+        uint8_t intCtrl[2];
+        I2C::readRegisters(devAddress, INT_CTRL_REG1, intCtrl, 2);
+        intCtrl[0] |= 0b00100010;   // Enable interrupt, active High, latched
+        intCtrl[1] = 0b00111111;    // enable interrupt on all axis any direction - Latched
+        I2C::writeRegisters(devAddress, INT_CTRL_REG1, intCtrl, 2);
 
         // Set WAKE-UP (motion detect) Threshold
-        I2C::writeRegister(devAddress, WAKEUP_THRD_H, (uint8_t)(wakeUpThreshold >> 4));
-        I2C::writeRegister(devAddress, WAKEUP_THRD_L, (uint8_t)(wakeUpThreshold << 4));
+        const uint8_t threshold[2] = { (uint8_t)(wakeUpThreshold >> 4), (uint8_t)(wakeUpThreshold << 4) };
+        I2C::writeRegisters(devAddress, WAKEUP_THRD_H, threshold, 2);
 
         // WAKEUP_COUNTER -> Sets the time motion must be present before a wake-up interrupt is set
         // WAKEUP_COUNTER (counts) = Wake-Up Delay Time (sec) x Wake-Up Function ODR(Hz)
         I2C::writeRegister(devAddress, WAKEUP_COUNTER, wakeUpCount);
 
-        // Enable interrupt, active High, latched
-        uint8_t _reg2 = I2C::readRegister(devAddress, INT_CTRL_REG1);
-        _reg2 |= 0b00100010;
-        I2C::writeRegister(devAddress, INT_CTRL_REG1, _reg2);
-
-        // WUFE – enables the Wake-Up (motion detect) function.
-        uint8_t _reg1 = I2C::readRegister(devAddress, CTRL_REG1);
-        _reg1 |= (0x01 << 1);
-        I2C::writeRegister(devAddress, CTRL_REG1, _reg1);
-
-        active();
+        // WUFE – enables the Wake-Up (motion detect) function, low power resolution is enough to detect motion
+        enterActive((ctrl1 | (0x01 << 1)) & ~CTRL_REG1_RES);
     }
 
     void disableInterrupt()
     {
-        standby();
+        uint8_t ctrl1 = enterStandby();
 
-        // disables the Wake-Up (motion detect) function.
-        uint8_t _reg1 = I2C::readRegister(devAddress, CTRL_REG1);
-        _reg1 &= ~(0x01 << 1);
-        I2C::writeRegister(devAddress, CTRL_REG1, _reg1);
-
-        // disable interrupt, active High, latched
-        uint8_t _reg2 = I2C::readRegister(devAddress, INT_CTRL_REG1);
-        _reg2 &= ~(0b00100010);
-        I2C::writeRegister(devAddress, INT_CTRL_REG1, _reg2);
-
-        // disable interrupt on all axis any direction - Latched
-        I2C::writeRegister(devAddress, INT_CTRL_REG2, 0b00000000);
+        uint8_t intCtrl[2];
+        I2C::readRegisters(devAddress, INT_CTRL_REG1, intCtrl, 2);
+        intCtrl[0] &= ~(0b00100010);    // disable interrupt, active High, latched
+        intCtrl[1] = 0b00000000;        // disable interrupt on all axis any direction - Latched
+        I2C::writeRegisters(devAddress, INT_CTRL_REG1, intCtrl, 2);
 
-        active();
+        // disables the Wake-Up (motion detect) function.
+        enterActive(ctrl1 & ~(0x01 << 1));
     }
 
     void clearInterrupt()
@@ -243,35 +339,44 @@ namespace AccelChip
     }
 
 
+    // Set while a sample read is in flight, so interrupts that fire before it completes don't queue
+    // more transfers. The chip has no sample buffer, a late read gets the latest sample anyway.
+    static volatile bool readPending = false;
+    static uint8_t sampleBuffer[6];
+
     /// <summary>
     /// Interrupt handler when data is ready
     /// </summary>
     void dataInterruptHandler(uint32_t pin, nrf_gpiote_polarity_t action) {
-
-        //I2C::readRegister(devAddress, STATUS_REG);
-        Core::int3 acc;
-        read(&acc);
-
-        // // DEBUG
-        // accCount++;
-
-        // Trigger the callbacks
-        Scheduler::push(&acc, sizeof(Core::int3), [](void* accCopyPtr, uint16_t event_size) {
-
-            // Cast the param to the right type
-            Core::int3* accCopy = (Core::int3*)(accCopyPtr);
-
-            for (int i = 0; i < clients.Count(); ++i) {
-                clients[i].handler(clients[i].token, *accCopy);
+        if (readPending) {
+            return;
+        }
+        readPending = true;
+
+        // Single burst read of all 3 axes, done in the background, clients get called once the data is in
+        bool queued = I2C::readRegistersAsync(devAddress, OUT_X_L, sampleBuffer, sizeof(sampleBuffer), [](void* ignore, bool success) {
+            readPending = false;
+            if (success) {
+                Core::int3 acc;
+                convert(sampleBuffer, &acc);
+
+                // Trigger the callbacks
+                for (int i = 0; i < clients.Count(); ++i) {
+                    clients[i].handler(clients[i].token, acc);
+                }
             }
-        });
-        //clearInterrupt();
+        }, nullptr);
+        if (!queued) {
+            // Try again on the next interrupt
+            readPending = false;
+        }
     }
 
     /// <summary>
     /// Enable Data ready interrupt
     /// </summary>
     void enableDataInterrupt() {
+        readPending = false;
         standby();
         {
             // Set interrupt pin
@@ -279,20 +384,43 @@ namespace AccelChip
                 BoardManager::getBoard()->accInterruptPin,
                 NRF_GPIO_PIN_NOPULL,
                 NRF_GPIOTE_POLARITY_HITOLO,
-                dataInterruptHandler);
+                dataInterruptHandler,
+                GPIOTE::PinAccuracy_LowPower);
 
             // Enable interrupt pin and set polarity
             I2C::writeRegister(devAddress, INT_CTRL_REG1, 0b00100000);
 
             // Enable data ready interrupt
             uint8_t ctrl = I2C::readRegister(devAddress, CTRL_REG1);
-            ctrl &= ~(0b01100000);
-            ctrl |= 0b01100000;
-            I2C::writeRegister(devAddress, CTRL_REG1, ctrl);
+            ctrl &= ~(0b00100000);
+            ctrl |= 0b00100000;
+            I2C::writeRegister(devAddress, CTRL_REG1, withResolution(ctrl));
         }
         active();
     }
 
+    void startData(SampleRate rate) {
+        readPending = false;
+        uint8_t ctrl = enterStandby();
+        sampleRate = rate;
+        writeDataRate();
+
+        // No more motion detection, only data ready on the interrupt pin
+        const uint8_t intCtrl[2] = { 0b00100000, 0b00000000 };
+        I2C::writeRegisters(devAddress, INT_CTRL_REG1, intCtrl, 2);
+        clearInterrupt();
+
+        GPIOTE::enableInterrupt(
+            BoardManager::getBoard()->accInterruptPin,
+            NRF_GPIO_PIN_NOPULL,
+            NRF_GPIOTE_POLARITY_HITOLO,
+            dataInterruptHandler,
+            GPIOTE::PinAccuracy_LowPower); // Data ready is latched until the sample is read
+        ctrl &= ~((0x01 << 1) | 0b00100000);
+        ctrl |= 0b00100000;
+        enterActive(withResolution(ctrl));
+    }
+
     void disableDataInterrupt() 
     {
         standby();
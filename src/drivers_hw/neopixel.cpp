@@ -6,10 +6,13 @@
 
 #include "neopixel.h"
 #include "nrf_drv_pwm.h"
+#include "nrf_drv_clock.h"
 #include "nrf_delay.h"
 #include "settings.h"
 #include "config/board_config.h"
 #include "../drivers_nrf/log.h"
+#include "string.h"
+#include "app_util_platform.h"
 
 using namespace Config;
 
@@ -22,12 +25,23 @@ using namespace Config;
 #define DUTY0 6
 #define DUTY1 13
 
+// The waveform is streamed through two small buffers the PWM plays alternately,
+// each one is refilled from the color array while the other one is playing.
+// Each LED takes 30us to clock out, so a buffer must be refilled within 8 x 30 = 240us of its END_SEQ
+// event. Encoding 8 LEDs takes about 10us, and the PWM interrupt (APP_IRQ_PRIORITY_HIGH) can only be held
+// off by the SoftDevice's own priorities, for radio events of up to about 100us on the S112, which
+// leaves more than 100us of margin. Flash erases stall the CPU for much longer: a refill that comes too
+// late replays the previous buffer, so a few LEDs show stale colors until the next frame.
+// The two halves take 768 bytes, against about 1KB for the whole 22 LED waveform.
+#define LEDS_PER_HALF_BUFFER 8
+#define HALF_BUFFER_SIZE (LEDS_PER_HALF_BUFFER * NEOPIXEL_BYTES)
+
 namespace DriversHW
 {
     namespace NeoPixel
     {
         static nrf_drv_pwm_t m_pwm0;
-        static nrf_pwm_values_common_t pwm_sequence_values[MAX_LED_COUNT * NEOPIXEL_BYTES + 1];
+        static nrf_pwm_values_common_t pwm_sequence_values[2][HALF_BUFFER_SIZE];
         static uint8_t numLEDs;
         static uint8_t dataPin;
 
@@ -38,20 +52,152 @@ namespace DriversHW
             uint16_t pwmSequenceOffset;
         };
 
-        void writeColor(uint32_t color, uint32_t ledIndex) {
+        // Colors of the frame being streamed out (one extra entry for the LED return test)
+        static uint32_t frameColors[MAX_LED_COUNT + 1];
+        static uint8_t frameLEDCount;   // Number of LEDs to clock out for this frame
+        static uint8_t nextLEDIndex;    // Next LED to encode into a half buffer
+        static uint8_t halvesToPlay;    // Half buffers left to play before stopping, including the final low one
+        static volatile bool playing = false;
+        static ShowCompleteCallback frameCallback;
+        static void* frameCallbackParam;
+
+        // Frame waiting for the current one to be done, so we never overwrite colors in flight
+        static uint32_t pendingColors[MAX_LED_COUNT];
+        static bool pendingFrame = false;
+        static ShowCompleteCallback pendingCallback;
+        static void* pendingCallbackParam;
+
+        // The PWM timing comes from the high frequency clock, the crystal is only kept running
+        // (on our behalf, the SoftDevice may still need it) while a frame is being clocked out
+        static nrf_drv_clock_handler_item_t hfclkHandlerItem;
+        static uint8_t requestedLEDCount;
+
+        void startPlayback(uint8_t ledCount);
+        void requestPlayback(uint8_t ledCount);
+
+        // PWM duty values for bits set / not set, with the polarity bit
+        #define BIT_DUTY(n, bit) ((((n) & (bit)) == 0 ? DUTY0 : DUTY1) | 0x8000)
+        #define NIBBLE_DUTIES(n) { BIT_DUTY(n, 8), BIT_DUTY(n, 4), BIT_DUTY(n, 2), BIT_DUTY(n, 1) }
+
+        // PWM values for each possible 4 bits, MSB first
+        static const nrf_pwm_values_common_t nibbleDuties[16][4] = {
+            NIBBLE_DUTIES(0x0), NIBBLE_DUTIES(0x1), NIBBLE_DUTIES(0x2), NIBBLE_DUTIES(0x3),
+            NIBBLE_DUTIES(0x4), NIBBLE_DUTIES(0x5), NIBBLE_DUTIES(0x6), NIBBLE_DUTIES(0x7),
+            NIBBLE_DUTIES(0x8), NIBBLE_DUTIES(0x9), NIBBLE_DUTIES(0xA), NIBBLE_DUTIES(0xB),
+            NIBBLE_DUTIES(0xC), NIBBLE_DUTIES(0xD), NIBBLE_DUTIES(0xE), NIBBLE_DUTIES(0xF),
+        };
+
+        void writeByte(uint8_t value, nrf_pwm_values_common_t* values) {
+            const nrf_pwm_values_common_t* high = nibbleDuties[value >> 4];
+            const nrf_pwm_values_common_t* low = nibbleDuties[value & 0x0F];
+            for (int i = 0; i < 4; ++i) {
+                values[i] = high[i];
+                values[4 + i] = low[i];
+            }
+        }
 
-            // Reorder the color bytes to match the hardware
-            int pwm_baseIndex = 24 * ledIndex;
-            for (int i = 0; i < 8; ++i) {
-                pwm_sequence_values[pwm_baseIndex + 16 + i] = ((color & 0x000080) == 0 ? DUTY0 : DUTY1) | 0x8000;
-                pwm_sequence_values[pwm_baseIndex +  8 + i] = ((color & 0x800000) == 0 ? DUTY0 : DUTY1) | 0x8000;
-                pwm_sequence_values[pwm_baseIndex      + i] = ((color & 0x008000) == 0 ? DUTY0 : DUTY1) | 0x8000;
-                color <<= 1;
+        void writeColor(uint32_t color, nrf_pwm_values_common_t* values) {
+            // Reorder the color bytes to match the hardware (GRB)
+            writeByte((uint8_t)(color >> 8), values);
+            writeByte((uint8_t)(color >> 16), values + 8);
+            writeByte((uint8_t)color, values + 16);
+        }
+
+        void fillHalfBuffer(int half) {
+            nrf_pwm_values_common_t* values = pwm_sequence_values[half];
+            for (int i = 0; i < LEDS_PER_HALF_BUFFER; ++i) {
+                if (nextLEDIndex < frameLEDCount) {
+                    writeColor(frameColors[nextLEDIndex], values);
+                    nextLEDIndex++;
+                } else {
+                    // Past the last LED, hold the line low (this is also the latch signal)
+                    for (int j = 0; j < NEOPIXEL_BYTES; ++j) {
+                        values[j] = 0x8000;
+                    }
+                }
+                values += NEOPIXEL_BYTES;
             }
         }
 
         void pwm_handler(nrf_drv_pwm_evt_type_t event_type) {
-            // Nothing
+            switch (event_type) {
+                case NRF_DRV_PWM_EVT_END_SEQ0:
+                case NRF_DRV_PWM_EVT_END_SEQ1:
+                    // One half buffer is done playing, the other one is now playing
+                    if (halvesToPlay > 0) {
+                        halvesToPlay--;
+                    }
+                    if (halvesToPlay == 0) {
+                        nrf_drv_pwm_stop(&m_pwm0, false);
+                    } else {
+                        fillHalfBuffer(event_type == NRF_DRV_PWM_EVT_END_SEQ0 ? 0 : 1);
+                    }
+                    break;
+                case NRF_DRV_PWM_EVT_STOPPED: {
+                        // The frame is fully out
+                        auto callback = frameCallback;
+                        auto param = frameCallbackParam;
+                        if (pendingFrame) {
+                            // Start the queued frame right away
+                            pendingFrame = false;
+                            memcpy(frameColors, pendingColors, numLEDs * sizeof(uint32_t));
+                            frameCallback = pendingCallback;
+                            frameCallbackParam = pendingCallbackParam;
+                            startPlayback(numLEDs);
+                        } else {
+                            frameCallback = nullptr;
+                            playing = false;
+                            nrf_drv_clock_hfclk_release();
+                        }
+                        if (callback != nullptr) {
+                            callback(param);
+                        }
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        void startPlayback(uint8_t ledCount) {
+            playing = true;
+            frameLEDCount = ledCount;
+            nextLEDIndex = 0;
+
+            // Data halves, plus one half of low signal at the end
+            halvesToPlay = (ledCount + LEDS_PER_HALF_BUFFER - 1) / LEDS_PER_HALF_BUFFER + 1;
+
+            fillHalfBuffer(0);
+            fillHalfBuffer(1);
+
+            nrf_pwm_sequence_t const seq0 =
+                {
+                    .values = {
+                        .p_common = pwm_sequence_values[0],
+                    },
+                    .length = HALF_BUFFER_SIZE,
+                    .repeats = 0,
+                    .end_delay = 0};
+
+            nrf_pwm_sequence_t const seq1 =
+                {
+                    .values = {
+                        .p_common = pwm_sequence_values[1],
+                    },
+                    .length = HALF_BUFFER_SIZE,
+                    .repeats = 0,
+                    .end_delay = 0};
+
+            (void)nrf_drv_pwm_complex_playback(&m_pwm0, &seq0, &seq1, 1,
+                NRF_DRV_PWM_FLAG_LOOP | NRF_DRV_PWM_FLAG_SIGNAL_END_SEQ0 | NRF_DRV_PWM_FLAG_SIGNAL_END_SEQ1);
+        }
+
+        /// <summary>
+        /// Starts the frame once the high frequency clock is running, right away if it already is
+        /// </summary>
+        void requestPlayback(uint8_t ledCount) {
+            requestedLEDCount = ledCount;
+            nrf_drv_clock_hfclk_request(&hfclkHandlerItem);
         }
 
         void init() {
@@ -63,6 +209,7 @@ namespace DriversHW
             const Board* board = Config::BoardManager::getBoard();
             dataPin = board->ledDataPin;
             numLEDs = board->ledCount;
+            memset(frameColors, 0, sizeof(frameColors));
             
             nrf_drv_pwm_config_t const config0 =
                 {
@@ -73,7 +220,8 @@ namespace DriversHW
                             NRF_DRV_PWM_PIN_NOT_USED, // channel 2
                             NRF_DRV_PWM_PIN_NOT_USED  // channel 3
                         },
-                    .irq_priority = APP_IRQ_PRIORITY_LOWEST,
+                    // The half buffers must be refilled in time, so this can't be the lowest priority
+                    .irq_priority = APP_IRQ_PRIORITY_HIGH,
                     .base_clock = CLOCK,
                     .count_mode = NRF_PWM_MODE_UP,
                     .top_value = TOP,
@@ -81,6 +229,17 @@ namespace DriversHW
                     .step_mode = NRF_PWM_STEP_AUTO};
             APP_ERROR_CHECK(nrf_drv_pwm_init(&m_pwm0, &config0, pwm_handler));
 
+            ret_code_t err_code = nrf_drv_clock_init();
+            if (err_code != NRF_ERROR_MODULE_ALREADY_INITIALIZED) {
+                APP_ERROR_CHECK(err_code);
+            }
+            hfclkHandlerItem.p_next = nullptr;
+            hfclkHandlerItem.event_handler = [](nrf_drv_clock_evt_type_t event) {
+                if (event == NRF_DRV_CLOCK_EVT_HFCLK_STARTED) {
+                    startPlayback(requestedLEDCount);
+                }
+            };
+
             NRF_LOG_DEBUG("Neopixel init");
         }
 
@@ -90,48 +249,45 @@ namespace DriversHW
 
 
         void clear() {
-            for (uint32_t led = 0; led < numLEDs; led++) {
-                writeColor(0, led);
-            }
+            memset(frameColors, 0, sizeof(frameColors));
         }
 
-        void show(uint32_t* colors) {
-            for (int i = 0; i < numLEDs; i++) {
-                writeColor(colors[i], i);
+        void show(uint32_t* colors, ShowCompleteCallback callback, void* param) {
+            bool queued = false;
+            CRITICAL_REGION_ENTER();
+            if (playing) {
+                // Queue the frame, it will start as soon as the current one is out
+                memcpy(pendingColors, colors, numLEDs * sizeof(uint32_t));
+                pendingCallback = callback;
+                pendingCallbackParam = param;
+                pendingFrame = true;
+                queued = true;
+            } else {
+                playing = true;
             }
-            // write the termination word
-            pwm_sequence_values[numLEDs * NEOPIXEL_BYTES] = 0x8000;
+            CRITICAL_REGION_EXIT();
 
-            nrf_pwm_sequence_t const seq0 =
-                {
-                    .values = {
-                        .p_common = pwm_sequence_values,
-                    },
-                    .length = (uint16_t)(NEOPIXEL_BYTES * numLEDs + 1),
-                    .repeats = 0,
-                    .end_delay = 0};
+            if (!queued) {
+                // Copy the colors, the buffer is read while the frame is streamed out
+                memcpy(frameColors, colors, numLEDs * sizeof(uint32_t));
+                frameCallback = callback;
+                frameCallbackParam = param;
+                requestPlayback(numLEDs);
+            }
+        }
 
-            (void)nrf_drv_pwm_simple_playback(&m_pwm0, &seq0, 1, NRF_DRV_PWM_FLAG_STOP);
+        bool isBusy() {
+            return playing;
         }
 
         void testLEDReturn() {
             // Forces LEDs to forward color values past the last one so we can detect it
-            for (int i = 0; i < numLEDs+1; i++) {
-                writeColor(0, i);
-            }
-            // write the termination word
-            pwm_sequence_values[(numLEDs+1) * NEOPIXEL_BYTES] = 0x8000;
-
-            nrf_pwm_sequence_t const seq0 =
-                {
-                    .values = {
-                        .p_common = pwm_sequence_values,
-                    },
-                    .length = (uint16_t)(NEOPIXEL_BYTES * (numLEDs + 1) + 1),
-                    .repeats = 0,
-                    .end_delay = 0};
-
-            (void)nrf_drv_pwm_simple_playback(&m_pwm0, &seq0, 1, NRF_DRV_PWM_FLAG_STOP);
+            // This happens during init, before any frame is shown
+            pendingFrame = false;
+            frameCallback = nullptr;
+            memset(frameColors, 0, sizeof(frameColors));
+            playing = true;
+            requestPlayback(numLEDs + 1);
         }
     }
-}
\ No newline at end of file
+}
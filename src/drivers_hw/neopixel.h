@@ -14,7 +14,13 @@ namespace DriversHW
         void init();
         void uninit(void);
         void clear();
-        void show(uint32_t* colors);
+
+        // Starts clocking out the colors and returns right away, the colors are copied.
+        // If a frame is already in flight, this one is queued (replacing any other queued frame).
+        // The callback is triggered from the PWM interrupt once the frame is fully out.
+        typedef void (*ShowCompleteCallback)(void* param);
+        void show(uint32_t* colors, ShowCompleteCallback callback = nullptr, void* param = nullptr);
+        bool isBusy();
         void testLEDReturn();
     }
 }
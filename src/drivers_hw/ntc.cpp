@@ -87,6 +87,9 @@ namespace DriversHW::NTC
             // Read voltage divider
             int32_t vntcTimes1000 = A2D::readVNTCTimes1000();
 
+            // The board identification divider is powered too, a good time to check the stored board
+            BoardManager::verifyStoredBoard();
+
             // Now that we're done reading, we can turn off the drive pin
             BoardManager::setNTC_ID_VDD(false);
 
@@ -1,12 +1,21 @@
 #include "a2d.h"
 #include "nrf_drv_saadc.h"
+#include "nrf_drv_ppi.h"
+#include "nrf_drv_timer.h"
 #include "config/board_config.h"
 #include "log.h"
 #include "timers.h"
 #include "power_manager.h"
+#include "scheduler.h"
 
 #define BOARD_DETECT_SENSE_PIN NRF_SAADC_INPUT_AIN4
 
+// Readings within this time of the last scan reuse it (battery and coil timers expire together)
+#define A2D_SCAN_SHARE_MS 5
+
+// Channel 0 is used for one-off reads, the scan uses the ones after it
+#define A2D_SCAN_FIRST_CHANNEL 1
+
 namespace DriversNRF::A2D
 {
     bool supportsVCoil = false;
@@ -26,8 +35,41 @@ namespace DriversNRF::A2D
         .pin_n      = NRF_SAADC_INPUT_DISABLED
     };
 
+    // Last scan results, by scan channel
+    static int16_t scanBuffer[ScanChannel_Count];
+    static int32_t scanValuesTimes1000[ScanChannel_Count];
+    static bool scanConfigured = false;
+    static int scanChannelCount = 0;
+    static int scanTimeMs = 0;
+    static bool scanValid = false;
+    static volatile bool scanDone = false;
+
+    // Hardware timed bursts, TIMER1 is used by the battery charge pin filter
+    static const nrf_drv_timer_t burstTimer = NRF_DRV_TIMER_INSTANCE(2);
+    static nrf_ppi_channel_t burstPPIChannel;
+    static bool burstConfigured = false;
+    static volatile bool burstActive = false;
+    static int16_t burstBuffer[A2D_BURST_MAX_SAMPLES * ScanChannel_Count];
+    static int burstSampleCount = 0;
+
+    struct BurstCompletion
+    {
+        BurstCallback callback;
+        void* param;
+        bool success;
+    };
+    static BurstCompletion burstCompletion;
+
+    static void finishBurst(bool success);
+
     void saadc_callback(nrfx_saadc_evt_t const * p_event) {
-        // Do nothing!
+        if (p_event->type == NRFX_SAADC_EVT_DONE) {
+            if (burstActive) {
+                finishBurst(true);
+            } else {
+                scanDone = true;
+            }
+        }
     }
     void init() {
         ret_code_t err_code;
@@ -63,6 +105,181 @@ namespace DriversNRF::A2D
         return ret;
     }
 
+    int32_t toValueTimes1000(int32_t val);
+
+    static nrf_saadc_input_t scanChannelPin(int channel) {
+        auto board = Config::BoardManager::getBoard();
+        switch (channel) {
+            case ScanChannel_VBat:
+                return (nrf_saadc_input_t)(board->vbatSensePin);
+            case ScanChannel_5V:
+                return (nrf_saadc_input_t)(board->coilSensePin);
+            case ScanChannel_NTC:
+                return (nrf_saadc_input_t)(board->ntcSensePin);
+            default:
+                return NRF_SAADC_INPUT_DISABLED;
+        }
+    }
+
+    /// <summary>
+    /// Configures one SAADC channel per input the board has, once the board is known
+    /// </summary>
+    static void configureScan() {
+        scanChannelCount = 0;
+        for (int i = 0; i < ScanChannel_Count; ++i) {
+            auto pin = scanChannelPin(i);
+            if (pin != NRF_SAADC_INPUT_DISABLED) {
+                auto config = channel_config_base;
+                config.pin_p = pin;
+                ret_code_t err_code = nrf_drv_saadc_channel_init(A2D_SCAN_FIRST_CHANNEL + i, &config);
+                APP_ERROR_CHECK(err_code);
+                scanChannelCount++;
+            }
+        }
+        scanConfigured = true;
+    }
+
+    bool scan() {
+        if (!scanConfigured) {
+            configureScan();
+        }
+        if (burstActive) {
+            // This reading can't wait for the burst
+            nrf_drv_saadc_abort();
+            finishBurst(false);
+        }
+
+        // Sample all channels at once, EasyDMA writes them in channel order
+        scanDone = false;
+        ret_code_t err_code = nrf_drv_saadc_buffer_convert(scanBuffer, scanChannelCount);
+        if (err_code == NRF_SUCCESS) {
+            err_code = nrf_drv_saadc_sample();
+        }
+        if (err_code != NRF_SUCCESS) {
+            NRF_LOG_WARNING("A2D scan failed, error 0x%x", err_code);
+            scanValid = false;
+            return false;
+        }
+        while (!scanDone) {
+            // A few conversion times at most
+        }
+
+        int sample = 0;
+        for (int i = 0; i < ScanChannel_Count; ++i) {
+            if (scanChannelPin(i) != NRF_SAADC_INPUT_DISABLED) {
+                scanValuesTimes1000[i] = toValueTimes1000(scanBuffer[sample++]);
+            } else {
+                scanValuesTimes1000[i] = 0;
+            }
+        }
+        scanTimeMs = Timers::millis();
+        scanValid = true;
+        return true;
+    }
+
+    int getScanTimeMs() {
+        return scanTimeMs;
+    }
+
+    static void finishBurst(bool success) {
+        nrf_drv_timer_disable(&burstTimer);
+        burstActive = false;
+
+        if (success) {
+            // The last scan of the burst is the most recent reading
+            const int16_t* last = burstBuffer + (burstSampleCount - 1) * scanChannelCount;
+            int sample = 0;
+            for (int i = 0; i < ScanChannel_Count; ++i) {
+                if (scanChannelPin(i) != NRF_SAADC_INPUT_DISABLED) {
+                    scanValuesTimes1000[i] = toValueTimes1000(last[sample++]);
+                }
+            }
+            scanTimeMs = Timers::millis();
+            scanValid = true;
+        }
+
+        burstCompletion.success = success;
+        Scheduler::push(&burstCompletion, sizeof(BurstCompletion), [](void* p_event_data, uint16_t event_size) {
+            auto c = (BurstCompletion*)p_event_data;
+            c->callback(c->param, c->success);
+        }, Scheduler::Priority_Realtime);
+    }
+
+    bool startBurst(int sampleCount, uint32_t intervalUs, BurstCallback callback, void* param) {
+        ASSERT(sampleCount > 0 && sampleCount <= A2D_BURST_MAX_SAMPLES);
+        if (!scanConfigured) {
+            configureScan();
+        }
+        if (burstActive || nrf_drv_saadc_is_busy()) {
+            return false;
+        }
+
+        ret_code_t err_code;
+        if (!burstConfigured) {
+            nrf_drv_timer_config_t timer_cfg = NRF_DRV_TIMER_DEFAULT_CONFIG;
+            timer_cfg.frequency = NRF_TIMER_FREQ_31250Hz;
+            timer_cfg.bit_width = NRF_TIMER_BIT_WIDTH_16;
+            err_code = nrf_drv_timer_init(&burstTimer, &timer_cfg, [](nrf_timer_event_t event_type, void* p_context) {
+                // Compare events only go to the SAADC
+            });
+            APP_ERROR_CHECK(err_code);
+
+            // Each compare triggers a scan
+            err_code = nrf_drv_ppi_channel_alloc(&burstPPIChannel);
+            APP_ERROR_CHECK(err_code);
+            err_code = nrf_drv_ppi_channel_assign(burstPPIChannel,
+                nrf_drv_timer_event_address_get(&burstTimer, NRF_TIMER_EVENT_COMPARE0),
+                nrf_drv_saadc_sample_task_get());
+            APP_ERROR_CHECK(err_code);
+            err_code = nrf_drv_ppi_channel_enable(burstPPIChannel);
+            APP_ERROR_CHECK(err_code);
+            burstConfigured = true;
+        }
+
+        err_code = nrf_drv_saadc_buffer_convert(burstBuffer, sampleCount * scanChannelCount);
+        if (err_code != NRF_SUCCESS) {
+            return false;
+        }
+
+        burstSampleCount = sampleCount;
+        burstCompletion.callback = callback;
+        burstCompletion.param = param;
+        burstActive = true;
+        nrf_drv_timer_extended_compare(&burstTimer, NRF_TIMER_CC_CHANNEL0, nrf_drv_timer_us_to_ticks(&burstTimer, intervalUs), NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+        nrf_drv_timer_enable(&burstTimer);
+        return true;
+    }
+
+    int32_t getBurstValueTimes1000(ScanChannel channel, int sampleIndex) {
+        if (scanChannelPin(channel) == NRF_SAADC_INPUT_DISABLED) {
+            return 0;
+        }
+        // Samples of a scan are in channel order, skipping the inputs the board doesn't have
+        int offset = 0;
+        for (int i = 0; i < channel; ++i) {
+            if (scanChannelPin(i) != NRF_SAADC_INPUT_DISABLED) {
+                offset++;
+            }
+        }
+        return toValueTimes1000(burstBuffer[sampleIndex * scanChannelCount + offset]);
+    }
+
+    static int32_t readScanChannelTimes1000(ScanChannel channel, bool allowShared) {
+        if (scanChannelPin(channel) == NRF_SAADC_INPUT_DISABLED) {
+            return 0;
+        }
+        // Readings that can share a scan use the last one while a burst is running
+        bool shared = allowShared && scanValid && (burstActive || Timers::millis() - scanTimeMs <= A2D_SCAN_SHARE_MS);
+        if (!shared && !scan()) {
+            return 0;
+        }
+        return scanValuesTimes1000[channel];
+    }
+
+    int32_t toValueTimes1000(int32_t val) {
+        return (val * 3516) / 1000;
+    }
+
     int32_t readPinValueTimes1000(nrf_saadc_input_t pin) {
         // Digital value read is [V(p) - V(n)] * Gain / Reference * 2^(Resolution - m)
         // In our case:
@@ -78,7 +295,7 @@ namespace DriversNRF::A2D
 
         int32_t val = readPin(pin);
         if (val != -1) {
-            return (val * 3516) / 1000;
+            return toValueTimes1000(val);
         } else {
             return 0;
         }
@@ -93,24 +310,15 @@ namespace DriversNRF::A2D
     }
 
     int32_t readVBatTimes1000() {
-        return readPinValueTimes1000((nrf_saadc_input_t)(Config::BoardManager::getBoard()->vbatSensePin));
+        return readScanChannelTimes1000(ScanChannel_VBat, true);
     }
     
     int32_t read5VTimes1000() {
-        auto csPin = (nrf_saadc_input_t)(Config::BoardManager::getBoard()->coilSensePin);
-        if (csPin != NRF_SAADC_INPUT_DISABLED) {
-            return readPinValueTimes1000(csPin);
-        } else {
-            return 0;
-        }
+        return readScanChannelTimes1000(ScanChannel_5V, true);
     }
     
     int32_t readVNTCTimes1000() {
-        auto ntcPin = (nrf_saadc_input_t)(Config::BoardManager::getBoard()->ntcSensePin);
-        if (ntcPin != NRF_SAADC_INPUT_DISABLED) {
-            return readPinValueTimes1000(ntcPin);
-        } else {
-            return 0;
-        }
+        // The NTC divider was just powered, don't use an older scan
+        return readScanChannelTimes1000(ScanChannel_NTC, false);
     }
 }
@@ -18,6 +18,28 @@ namespace DriversNRF
         int32_t readVDDTimes1000();
         int32_t readVNTCTimes1000();
 
+        // The battery, coil and NTC inputs are sampled together in one SAADC scan. A reading
+        // taken right after another one reuses the scan (except for the NTC that is only
+        // powered for its reading).
+        enum ScanChannel : uint8_t
+        {
+            ScanChannel_VBat = 0,
+            ScanChannel_5V,
+            ScanChannel_NTC,
+            ScanChannel_Count
+        };
+
+        bool scan();
+        int getScanTimeMs();
+
+        // Runs sampleCount scans intervalUs apart, triggered by a hardware timer through PPI so the
+        // CPU isn't involved until all the samples are in. The callback is called from the main loop,
+        // with success false if the burst was aborted (e.g. by a reading that can't wait).
+        #define A2D_BURST_MAX_SAMPLES 18
+        typedef void (*BurstCallback)(void* param, bool success);
+        bool startBurst(int sampleCount, uint32_t intervalUs, BurstCallback callback, void* param);
+        int32_t getBurstValueTimes1000(ScanChannel channel, int sampleIndex);
+
         void selfTest();
         void selfTestBatt();
     }
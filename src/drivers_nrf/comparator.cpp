@@ -0,0 +1,109 @@
+#include "comparator.h"
+#include "nrfx_comp.h"
+#include "nrf_saadc.h"
+#include "nrf_log.h"
+#include "app_util_platform.h"
+#include "scheduler.h"
+
+// Steps between the up and down thresholds, out of 64
+#define COMPARATOR_HYSTERESIS_STEPS 4
+
+namespace DriversNRF::Comparator
+{
+    static ClientMethod client = nullptr;
+    static void* clientParam = nullptr;
+    static bool started = false;
+    static volatile bool triggered = false;
+
+    static void onTriggered(void* eventData, uint16_t eventSize) {
+        if (started && triggered) {
+            // Keep the callback from restarting us before we're done
+            auto callback = client;
+            stop();
+            callback(clientParam);
+        }
+    }
+
+    static void compHandler(nrf_comp_event_t event) {
+        if (event == NRF_COMP_EVENT_UP && !triggered) {
+            // The input may cross the threshold many times, only the first one matters
+            triggered = true;
+            nrf_comp_int_disable(NRF_COMP_INT_UP_MASK);
+            Scheduler::push(nullptr, 0, onTriggered);
+        }
+    }
+
+    bool start(uint8_t analogInput, int32_t thresholdTimes1000, ClientMethod callback, void* param) {
+        if (started) {
+            stop();
+        }
+        if (analogInput < NRF_SAADC_INPUT_AIN0 || analogInput > NRF_SAADC_INPUT_AIN7 || thresholdTimes1000 <= 0) {
+            return false;
+        }
+
+        // Smallest internal reference above the threshold, for the best resolution
+        nrf_comp_ref_t reference;
+        int32_t referenceTimes1000;
+        if (thresholdTimes1000 < 1200) {
+            reference = NRF_COMP_REF_Int1V2;
+            referenceTimes1000 = 1200;
+        } else if (thresholdTimes1000 < 1800) {
+            reference = NRF_COMP_REF_Int1V8;
+            referenceTimes1000 = 1800;
+        } else if (thresholdTimes1000 < 2400) {
+            reference = NRF_COMP_REF_Int2V4;
+            referenceTimes1000 = 2400;
+        } else {
+            return false;
+        }
+
+        const int32_t thUp = thresholdTimes1000 * 64 / referenceTimes1000 - 1;
+        const int32_t thDown = thUp > COMPARATOR_HYSTERESIS_STEPS ? thUp - COMPARATOR_HYSTERESIS_STEPS : 0;
+
+        nrfx_comp_config_t config = {};
+        config.reference = reference;
+        config.main_mode = NRF_COMP_MAIN_MODE_SE;
+        config.threshold.th_down = (uint8_t)thDown;
+        config.threshold.th_up = (uint8_t)thUp;
+        config.speed_mode = NRF_COMP_SP_MODE_Low;
+        config.hyst = NRF_COMP_HYST_NoHyst;
+#if defined (COMP_ISOURCE_ISOURCE_Msk)
+        config.isource = NRF_COMP_ISOURCE_Off;
+#endif
+        config.input = (nrf_comp_input_t)(analogInput - NRF_SAADC_INPUT_AIN0);
+        config.interrupt_priority = NRFX_COMP_CONFIG_IRQ_PRIORITY;
+
+        if (nrfx_comp_init(&config, compHandler) != NRFX_SUCCESS) {
+            NRF_LOG_ERROR("Comparator init failed");
+            return false;
+        }
+
+        client = callback;
+        clientParam = param;
+        triggered = false;
+        started = true;
+        nrfx_comp_start(NRFX_COMP_EVT_EN_UP_MASK, 0);
+
+        // Rising edges only, so check that we're not above already
+        CRITICAL_REGION_ENTER();
+        if (nrfx_comp_sample() != 0) {
+            compHandler(NRF_COMP_EVENT_UP);
+        }
+        CRITICAL_REGION_EXIT();
+        return true;
+    }
+
+    void stop() {
+        if (started) {
+            nrfx_comp_stop();
+            nrfx_comp_uninit();
+            started = false;
+            client = nullptr;
+            clientParam = nullptr;
+        }
+    }
+
+    bool isStarted() {
+        return started;
+    }
+}
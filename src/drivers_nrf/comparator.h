@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace DriversNRF
+{
+    /// <summary>
+    /// Wrapper for the analog comparator, used to wait for a voltage to rise without sampling it
+    /// </summary>
+    namespace Comparator
+    {
+        typedef void (*ClientMethod)(void* param);
+
+        // Calls the client from the main loop once the voltage on the analog input (in the
+        // SAADC input numbering of the board config) goes above the threshold, then stops.
+        // If the voltage is already above, the callback is scheduled right away.
+        bool start(uint8_t analogInput, int32_t thresholdTimes1000, ClientMethod callback, void* param);
+        void stop();
+        bool isStarted();
+    }
+}
@@ -1,15 +1,43 @@
 #include "dfu.h"
 #include "ble_dfu.h"
 #include "power_manager.h"
+#include "flash.h"
+#include "timers.h"
 #include "nrf_sdh.h"
+#include "nrf_pwr_mgmt.h"
+#include "app_timer.h"
 #include "app_error.h"
 #include "app_error_weak.h"
 #include "nrf_log.h"
 
 #include "bluetooth/bluetooth_stack.h"
 
+// How often the jump to the bootloader is retried while flash writes are pending
+#define DFU_FLASH_WAIT_RETRY_MS 50
+
 namespace DriversNRF::DFU
 {
+    #if !defined(DEBUG)
+    APP_TIMER_DEF(retryTimer);
+
+    /// <summary>
+    /// Holds off the jump to the bootloader until the queued flash writes are done, so the
+    /// settings and data set don't come back half written (and need to be uploaded again)
+    /// </summary>
+    bool dfuShutdownHandler(nrf_pwr_mgmt_evt_t event)
+    {
+        if (event != NRF_PWR_MGMT_EVT_PREPARE_DFU || !Flash::isBusy()) {
+            return true;
+        }
+        NRF_LOG_INFO("Waiting for flash writes before entering bootloader");
+        Timers::startTimer(retryTimer, DFU_FLASH_WAIT_RETRY_MS);
+        return false;
+    }
+
+    /* Runs before the SDK handlers that take the SoftDevice down. */
+    NRF_PWR_MGMT_HANDLER_REGISTER(dfuShutdownHandler, 0);
+    #endif
+
     void buttonless_dfu_sdh_state_observer(nrf_sdh_state_evt_t state, void * p_context)
     {
         if (state == NRF_SDH_EVT_STATE_DISABLED)
@@ -48,8 +76,8 @@ namespace DriversNRF::DFU
 
             case BLE_DFU_EVT_BOOTLOADER_ENTER_FAILED:
                 NRF_LOG_ERROR("Request to enter bootloader mode failed asynchroneously.");
-                // YOUR_JOB: Take corrective measures to resolve the issue
-                //           like calling APP_ERROR_CHECK to reset the device.
+                // Stay reachable so the update can be tried again
+                Bluetooth::Stack::enableAdvertisingOnDisconnect();
                 break;
 
             case BLE_DFU_EVT_RESPONSE_SEND_ERROR:
@@ -85,6 +113,11 @@ namespace DriversNRF::DFU
 
             err_code = ble_dfu_buttonless_init(&dfus_init);
             APP_ERROR_CHECK(err_code);
+
+            Timers::createTimer(&retryTimer, APP_TIMER_MODE_SINGLE_SHOT, [](void* context) {
+                // Resumes the shutdown from the handler that held it off
+                nrf_pwr_mgmt_shutdown(NRF_PWR_MGMT_SHUTDOWN_GOTO_DFU);
+            });
         #endif
     }
 }
@@ -9,12 +9,17 @@
 #include "log.h"
 #include "nrf_soc.h"
 #include "scheduler.h"
+#include "timers.h"
+#include "profiler.h"
+#include "bluetooth/bluetooth_stack.h"
 #include "core/delegate_array.h"
 #include "config/settings.h"
 #include "data_set/data_set.h"
 #include "data_set/data_set_data.h"
 #include "behaviors/behavior.h"
-#include "malloc.h"
+#include "utils/heap.h"
+#include "utils/utils.h"
+#include "app_util_platform.h"
 
 using namespace DriversNRF;
 using namespace Config;
@@ -23,17 +28,88 @@ using namespace Behaviors;
 
 #define MAX_PROG_CLIENTS 8
 
+// Flash operations that can wait for their turn, and how many adjacent writes can be merged into one
+#define FLASH_MAX_PENDING_OPS 8
+#define FLASH_MAX_COALESCED_WRITES 4
+
+// Low priority erases wait for the radio to be idle, checking again this often, but no
+// longer than the max delay so they aren't held off forever by a busy connection
+#define FLASH_ERASE_RETRY_MS 100
+#define FLASH_ERASE_MAX_DELAY_MS 5000
+
+// Flash pages reserved for the roll log (at least 2 so a page is always left when recycling one)
+#define ROLL_LOG_PAGE_COUNT 2
+
+// Flash pages of the value store log, right before the roll log. The latest values are moved
+// over to the other page when the current one is full.
+#define VALUE_STORE_PAGE_COUNT 2
+
+// Flash pages for the settings journal, each new version of the settings is appended to the current page
+// and the other page is only erased to move the latest record over once the current one is full
+#define SETTINGS_PAGE_COUNT 2
+#define SETTINGS_PAGE_MAGIC 0x5E770000 // Top half of a journal page header, the bottom half is a sequence number
+
 namespace DriversNRF::Flash
 {
     static void fstorage_evt_handler(nrf_fstorage_evt_t * p_evt);
 
     NRF_FSTORAGE_DEF(nrf_fstorage_t fstorage);
 
-    FlashCallback callback; // This should be allocated per call...
-    void* context;
+    enum FlashOpType
+    {
+        FlashOpType_Write = 0,
+        FlashOpType_Erase
+    };
+
+    // Pending flash operations, handed to fstorage one at a time, most urgent first
+    struct FlashOp
+    {
+        bool queued;
+        uint8_t type;
+        uint8_t priority;
+        uint8_t pieceCount;     // Adjacent writes merged into this one
+        uint32_t sequence;      // Submission order, among operations of the same priority
+        int queuedMs;
+        uint32_t address;
+        const void* data;
+        uint32_t size;          // In bytes for writes, pages for erases
+        uint16_t pieceSizes[FLASH_MAX_COALESCED_WRITES];
+        FlashCallback callback;
+        void* context;
+    };
+    static FlashOp ops[FLASH_MAX_PENDING_OPS];
+    static FlashOp* currentOp = nullptr;
+    static uint32_t nextSequence = 0;
+
+    static void startNextOp();
+
+    APP_TIMER_DEF(deferredEraseTimer);
+    static bool deferredEraseTimerRunning = false;
 
     DelegateArray<ProgrammingEventMethod, MAX_PROG_CLIENTS> programmingClients;
 
+    // The data set is double buffered, a new one is written to the other slot and only
+    // replaces the current one once its header is written
+    int activeSlot = 0;
+    uint32_t getDataSetSlotAddress(int slot);
+
+    // Settings journal
+    static uint32_t settingsPage = 0;       // Page being appended to
+    static uint16_t settingsSequence = 0;
+    static uint32_t settingsOffset = 0;     // Offset of the next record in the page
+    static uint32_t settingsAddress = 0;    // Latest valid record, 0 if none
+
+    // Settings and data set programming run one at a time, new requests are rejected meanwhile
+    static bool appendingSettings = false;  // A settings record is being appended to the journal
+    static bool dataSetProgramming = false; // A data set is being programmed, patched or cleared
+
+    static void notifyProgrammingEvent(ProgrammingEventType evt) {
+        for (int i = 0; i < programmingClients.Count(); ++i)
+        {
+            programmingClients[i].handler(programmingClients[i].token, evt);
+        }
+    }
+
     /**@brief   Helper function to obtain the last address on the last page of the on-chip flash that
      *          can be used to write user data.
      */
@@ -49,6 +125,11 @@ namespace DriversNRF::Flash
 
     void init() {
 
+        Timers::createTimer(&deferredEraseTimer, APP_TIMER_MODE_SINGLE_SHOT, [](void* ctx) {
+            deferredEraseTimerRunning = false;
+            startNextOp();
+        });
+
         /* Set a handler for fstorage events. */
         fstorage.evt_handler = fstorage_evt_handler;
 
@@ -62,9 +143,13 @@ namespace DriversNRF::Flash
         ret_code_t rc = nrf_fstorage_init(&fstorage, &nrf_fstorage_sd, NULL);
         APP_ERROR_CHECK(rc);
 
+        findSettings();
+        selectDataSetSlot();
+
         NRF_LOG_INFO("Flash init");
         NRF_LOG_INFO("   Addr range: 0x%08x-0x%08x", fstorage.start_addr, fstorage.end_addr);
         NRF_LOG_INFO("   %d B free", getUsableBytes());
+        NRF_LOG_INFO("   Data set slot %d, %d B each", activeSlot, getDataSetSlotSize());
         NRF_LOG_DEBUG("   Erase unit: %d",      fstorage.p_flash_info->erase_unit);
         NRF_LOG_DEBUG("   Program unit: %d", fstorage.p_flash_info->program_unit);
 
@@ -74,29 +159,16 @@ namespace DriversNRF::Flash
         #endif
     }
 
-    struct FlashCallbackInfo
-    {
-        uint32_t address;
-        uint32_t size;
-        bool result;
-    };
-
     static void fstorage_evt_handler(nrf_fstorage_evt_t * p_evt)
     {
-        FlashCallbackInfo info = {
-            address: p_evt->addr,
-            size: p_evt->len,
-            result: false };
-
-        APP_ERROR_CHECK(p_evt->result);
-        if (p_evt->result != NRF_SUCCESS)
+        TIMELINE_END(Profiler::TimelineEvent_FlashOp);
+        bool result = p_evt->result == NRF_SUCCESS;
+        if (!result)
         {
             NRF_LOG_ERROR("--> Event received: ERROR while executing an fstorage operation.");
-            info.result = false;
         }
         else
         {
-            info.result = true;
             switch (p_evt->id)
             {
                 case NRF_FSTORAGE_EVT_WRITE_RESULT:
@@ -111,26 +183,135 @@ namespace DriversNRF::Flash
                                 p_evt->len, p_evt->addr);
                 } break;
 
-                case NRF_FSTORAGE_EVT_READ_RESULT:
-                {
-                    NRF_LOG_DEBUG("--> Event received: read %d bytes from address 0x%x.",
-                                p_evt->len, p_evt->addr);
-                } break;
-
                 default:
                     break;
             }
         }
-        
-        if (callback != nullptr) {
-            auto callbackCopy = callback;
-            callback = nullptr;
-            callbackCopy(context, info.result, info.address, info.size);
-        } else {
+
+        // Free the operation before calling back, so callbacks can queue the next ones
+        auto op = (FlashOp*)p_evt->p_param;
+        if (op == nullptr) {
             NRF_LOG_INFO("No callback");
+            return;
+        }
+        FlashOp done = *op;
+        CRITICAL_REGION_ENTER();
+        op->queued = false;
+        currentOp = nullptr;
+        CRITICAL_REGION_EXIT();
+
+        if (done.callback != nullptr) {
+            if (done.type == FlashOpType_Write) {
+                // Each merged write gets its own callback
+                uint32_t address = done.address;
+                for (int i = 0; i < done.pieceCount; ++i) {
+                    done.callback(done.context, result, address, done.pieceSizes[i]);
+                    address += done.pieceSizes[i];
+                }
+            } else {
+                done.callback(done.context, result, done.address, p_evt->len);
+            }
+        }
+        startNextOp();
+    }
+
+    /// <summary>
+    /// Hands the most urgent pending operation to fstorage, if it isn't busy with one already
+    /// </summary>
+    static void startNextOp() {
+        FlashOp* next = nullptr;
+        bool deferred = false;
+        bool retryLater = false;
+        const bool radioIdle = Bluetooth::Stack::isRadioIdle();
+        const int now = Timers::millis();
+        CRITICAL_REGION_ENTER();
+        if (currentOp == nullptr) {
+            for (int i = 0; i < FLASH_MAX_PENDING_OPS; ++i) {
+                auto& op = ops[i];
+                if (!op.queued) {
+                    continue;
+                }
+                if (op.type == FlashOpType_Erase && op.priority == Priority_Low && !radioIdle && now - op.queuedMs < FLASH_ERASE_MAX_DELAY_MS) {
+                    // Erases stall the CPU and take radio time, background ones wait for a quiet moment
+                    deferred = true;
+                    continue;
+                }
+                if (next == nullptr || op.priority > next->priority ||
+                    (op.priority == next->priority && (int32_t)(op.sequence - next->sequence) < 0)) {
+                    next = &op;
+                }
+            }
+            currentOp = next;
+        }
+        retryLater = next == nullptr && deferred && !deferredEraseTimerRunning;
+        if (retryLater) {
+            deferredEraseTimerRunning = true;
+        }
+        CRITICAL_REGION_EXIT();
+
+        if (retryLater) {
+            Timers::startTimer(deferredEraseTimer, FLASH_ERASE_RETRY_MS);
+        }
+
+        if (next != nullptr) {
+            TIMELINE_BEGIN(Profiler::TimelineEvent_FlashOp);
+            ret_code_t rc = next->type == FlashOpType_Write ?
+                nrf_fstorage_write(&fstorage, next->address, next->data, next->size, next) :
+                nrf_fstorage_erase(&fstorage, next->address, next->size, next);
+            APP_ERROR_CHECK(rc);
         }
     }
 
+    /// <summary>
+    /// Queues an operation, merging a write with the pending one it directly follows (same destination
+    /// and source, same callback) when possible
+    /// </summary>
+    static void queueOp(FlashOpType type, uint32_t address, const void* data, uint32_t size, FlashCallback callback, void* context, Priority priority) {
+        bool queued = false;
+        CRITICAL_REGION_ENTER();
+        if (type == FlashOpType_Write && size <= 0xFFFF) {
+            for (int i = 0; i < FLASH_MAX_PENDING_OPS && !queued; ++i) {
+                auto& op = ops[i];
+                if (op.queued && &op != currentOp && op.type == FlashOpType_Write &&
+                    op.callback == callback && op.context == context && op.priority == priority &&
+                    op.pieceCount < FLASH_MAX_COALESCED_WRITES &&
+                    op.address + op.size == address && (const uint8_t*)op.data + op.size == data &&
+                    op.size + size <= NRF_FSTORAGE_SD_MAX_WRITE_SIZE) {
+                    op.pieceSizes[op.pieceCount++] = size;
+                    op.size += size;
+                    queued = true;
+                }
+            }
+        }
+        for (int i = 0; i < FLASH_MAX_PENDING_OPS && !queued; ++i) {
+            auto& op = ops[i];
+            if (!op.queued) {
+                op.queued = true;
+                op.type = type;
+                op.priority = priority;
+                op.pieceCount = 1;
+                op.pieceSizes[0] = size;
+                op.sequence = nextSequence++;
+                op.queuedMs = Timers::millis();
+                op.address = address;
+                op.data = data;
+                op.size = size;
+                op.callback = callback;
+                op.context = context;
+                queued = true;
+            }
+        }
+        CRITICAL_REGION_EXIT();
+
+        if (queued) {
+            startNextOp();
+        } else {
+            NRF_LOG_ERROR("Too many pending flash operations");
+            if (callback != nullptr) {
+                callback(context, false, address, size);
+            }
+        }
+    }
 
     void printFlashInfo()
     {
@@ -151,25 +332,20 @@ namespace DriversNRF::Flash
         }
     }
 
-    void write(void* theContext, uint32_t flashAddress, const void* data, uint32_t size, FlashCallback theCallback) {
-        callback = theCallback;
-        context = theContext;
-        ret_code_t rc = nrf_fstorage_write(&fstorage, flashAddress, data, size, NULL);
-        APP_ERROR_CHECK(rc);
+    void write(void* theContext, uint32_t flashAddress, const void* data, uint32_t size, FlashCallback theCallback, Priority priority) {
+        queueOp(FlashOpType_Write, flashAddress, data, size, theCallback, theContext, priority);
     }
 
     void read(void* theContext, uint32_t flashAddress, void* outData, uint32_t size, FlashCallback theCallback) {
-        callback = theCallback;
-        context = theContext;
+        // Flash is memory mapped, reads complete right away
         ret_code_t rc = nrf_fstorage_read(&fstorage, flashAddress, outData, size);
-        APP_ERROR_CHECK(rc);
+        if (theCallback != nullptr) {
+            theCallback(theContext, rc == NRF_SUCCESS, flashAddress, size);
+        }
     }
 
-    void erase(void* theContext, uint32_t flashAddress, uint32_t pages, FlashCallback theCallback) {
-        callback = theCallback;
-        context = theContext;
-        ret_code_t rc = nrf_fstorage_erase(&fstorage, flashAddress, pages, NULL);
-        APP_ERROR_CHECK(rc);
+    void erase(void* theContext, uint32_t flashAddress, uint32_t pages, FlashCallback theCallback, Priority priority) {
+        queueOp(FlashOpType_Erase, flashAddress, nullptr, pages, theCallback, theContext, priority);
     }
 
     uint32_t bytesToPages(uint32_t size) {
@@ -182,11 +358,39 @@ namespace DriversNRF::Flash
     }
 
     uint32_t getFlashEndAddress() {
-        return fstorage.end_addr;
+        return getValueStoreStartAddress();
     }
 
     uint32_t getUsableBytes() {
-        return fstorage.end_addr + 1 - fstorage.start_addr;
+        return getFlashEndAddress() + 1 - fstorage.start_addr;
+    }
+
+    uint32_t getRollLogStartAddress() {
+        return fstorage.end_addr - ROLL_LOG_PAGE_COUNT * getPageSize();
+    }
+
+    uint32_t getRollLogPageCount() {
+        return ROLL_LOG_PAGE_COUNT;
+    }
+
+    uint32_t getValueStoreStartAddress() {
+        return getRollLogStartAddress() - VALUE_STORE_PAGE_COUNT * getPageSize();
+    }
+
+    uint32_t getValueStorePageCount() {
+        return VALUE_STORE_PAGE_COUNT;
+    }
+
+    bool isBusy() {
+        bool busy = currentOp != nullptr;
+        for (int i = 0; i < FLASH_MAX_PENDING_OPS && !busy; ++i) {
+            busy = ops[i].queued;
+        }
+        return busy;
+    }
+
+    bool isProgramming() {
+        return appendingSettings || dataSetProgramming;
     }
 
     uint32_t getPageSize() {
@@ -199,6 +403,184 @@ namespace DriversNRF::Flash
     }
 
 
+    static uint32_t settingsPageAddress(uint32_t page) {
+        return getSettingsStartAddress() + page * getPageSize();
+    }
+
+    static bool isValidSettings(const Settings* record) {
+        return record->headMarker == SETTINGS_VALID_KEY && record->tailMarker == SETTINGS_VALID_KEY;
+    }
+
+    void findSettings() {
+        static_assert(sizeof(Settings) % 4 == 0, "Settings records must be word aligned");
+        settingsAddress = 0;
+        bool found = false;
+        for (uint32_t p = 0; p < SETTINGS_PAGE_COUNT; ++p) {
+            uint32_t header = *(const uint32_t*)settingsPageAddress(p);
+            if ((header & 0xFFFF0000) != SETTINGS_PAGE_MAGIC) {
+                continue;
+            }
+            uint16_t seq = header & 0xFFFF;
+            if (found && (int16_t)(seq - settingsSequence) <= 0) {
+                continue;
+            }
+
+            // The latest record is the last valid one, a record interrupted by a reset is skipped
+            uint32_t latest = 0;
+            uint32_t offset = 4;
+            while (offset + sizeof(Settings) <= getPageSize() && *(const uint32_t*)(settingsPageAddress(p) + offset) != 0xFFFFFFFF) {
+                if (isValidSettings((const Settings*)(settingsPageAddress(p) + offset))) {
+                    latest = settingsPageAddress(p) + offset;
+                }
+                offset += sizeof(Settings);
+            }
+            if (latest != 0) {
+                found = true;
+                settingsPage = p;
+                settingsSequence = seq;
+                settingsOffset = offset;
+                settingsAddress = latest;
+            }
+        }
+
+        if (!found && isValidSettings((const Settings*)getSettingsStartAddress())) {
+            // Settings written before the journal, they're moved over with the next change
+            settingsPage = 0;
+            settingsSequence = 0;
+            settingsOffset = getPageSize();
+            settingsAddress = getSettingsStartAddress();
+        }
+    }
+
+    uint32_t getSettingsAddress() {
+        return settingsAddress != 0 ? settingsAddress : getSettingsStartAddress();
+    }
+
+    /// <summary>
+    /// Appends a settings record to the journal, moving over to the other page when the current one
+    /// is full. The new page's header is written last so the previous page stays current until then.
+    /// </summary>
+    static void appendSettings(const Settings* newSettings, ProgramFlashNotification onAppended) {
+        static const Settings* _newSettings;
+        static ProgramFlashNotification _onAppended;
+        static uint32_t headerWord;
+        static auto finishAppend = [](bool result) {
+            appendingSettings = false;
+            _onAppended(result);
+        };
+        _newSettings = newSettings;
+        _onAppended = onAppended;
+        appendingSettings = true;
+
+        if (settingsAddress != 0 && settingsOffset + sizeof(Settings) <= getPageSize()) {
+            // Never write to the same place twice, even on failure, so the record's place is taken right away
+            const uint32_t recordAddress = settingsPageAddress(settingsPage) + settingsOffset;
+            settingsOffset += sizeof(Settings);
+            Flash::write(nullptr, recordAddress, _newSettings, sizeof(Settings),
+                [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                    if (result) {
+                        settingsAddress = address;
+                    }
+                    finishAppend(result);
+                });
+        } else {
+            // Compact, the other page starts over with just the new record
+            Flash::erase(nullptr, settingsPageAddress(1 - settingsPage), 1, [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                if (!result) {
+                    finishAppend(false);
+                    return;
+                }
+                Flash::write(nullptr, settingsPageAddress(1 - settingsPage) + 4, _newSettings, sizeof(Settings),
+                    [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                        if (!result) {
+                            finishAppend(false);
+                            return;
+                        }
+                        headerWord = SETTINGS_PAGE_MAGIC | (uint16_t)(settingsSequence + 1);
+                        Flash::write(nullptr, settingsPageAddress(1 - settingsPage), &headerWord, sizeof(headerWord),
+                            [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                                if (result) {
+                                    settingsPage = 1 - settingsPage;
+                                    settingsSequence++;
+                                    settingsOffset = 4 + sizeof(Settings);
+                                    settingsAddress = settingsPageAddress(settingsPage) + 4;
+                                }
+                                finishAppend(result);
+                            });
+                    });
+            });
+        }
+    }
+
+    bool programSettings(const Settings& newSettings, ProgramFlashNotification onProgramFinished) {
+        static Settings* _newSettings = nullptr;
+        static ProgramFlashNotification _onProgramFinished;
+        if (appendingSettings || dataSetProgramming) {
+            NRF_LOG_ERROR("Settings or data set already being programmed");
+            return false;
+        }
+        _newSettings = (Settings*)Utils::Heap::alloc(sizeof(Settings), Utils::Heap::HeapTag_Flash);
+        if (_newSettings == nullptr) {
+            NRF_LOG_ERROR("Not enough ram to allocate copy of new settings");
+            return false;
+        }
+        memcpy(_newSettings, &newSettings, sizeof(Settings));
+        _onProgramFinished = onProgramFinished;
+
+        notifyProgrammingEvent(ProgrammingEventType_Begin);
+        appendSettings(_newSettings, [](bool result) {
+            if (result) {
+                NRF_LOG_INFO("Settings flashed at 0x%08x", settingsAddress);
+            } else {
+                NRF_LOG_ERROR("Error flashing settings");
+            }
+            Utils::Heap::free(_newSettings);
+            _newSettings = nullptr;
+            notifyProgrammingEvent(ProgrammingEventType_End);
+            _onProgramFinished(result);
+        });
+        return true;
+    }
+
+    static ProgramFlashNotification clearedCallback = nullptr;
+    static int clearedSlot;
+    static uint32_t invalidHeadMarker = 0; // Write source, must stay valid until the write is done
+
+    static void clearNextDataSetSlot(void* context, bool result, uint32_t address, uint16_t size) {
+        // Slots that are already invalid are left alone
+        while (result && clearedSlot < 2 && ((const Data*)getDataSetSlotAddress(clearedSlot))->headMarker != ANIMATION_SET_VALID_KEY) {
+            clearedSlot++;
+        }
+        if (result && clearedSlot < 2) {
+            write(nullptr, getDataSetSlotAddress(clearedSlot++), &invalidHeadMarker, sizeof(uint32_t), clearNextDataSetSlot);
+        } else {
+            if (!result) {
+                NRF_LOG_ERROR("Error clearing data set");
+            }
+            selectDataSetSlot();
+            auto callback = clearedCallback;
+            clearedCallback = nullptr;
+            dataSetProgramming = false;
+            notifyProgrammingEvent(ProgrammingEventType_End);
+            callback(result);
+        }
+    }
+
+    bool clearDataSets(ProgramFlashNotification onCleared) {
+        if (appendingSettings || dataSetProgramming) {
+            NRF_LOG_ERROR("Settings or data set already being programmed");
+            return false;
+        }
+        dataSetProgramming = true;
+        clearedCallback = onCleared;
+        clearedSlot = 0;
+
+        // Programming can only clear bits, zeroing the head marker doesn't need an erase first
+        notifyProgrammingEvent(ProgrammingEventType_Begin);
+        clearNextDataSetSlot(nullptr, true, 0, 0);
+        return true;
+    }
+
     bool programFlash(
         const Data& newData,
         const Settings& newSettings,
@@ -210,36 +592,45 @@ namespace DriversNRF::Flash
         static ProgramFlashFunc _programDataFunc;
         static ProgramFlashNotification _onProgramFinished;
 
-        static auto beginProgramming = []() {
-            // Notify clients
-            for (int i = 0; i < programmingClients.Count(); ++i)
-            {
-                programmingClients[i].handler(programmingClients[i].token, ProgrammingEventType_Begin);
-            }
-        };
-
-        static auto finishProgramming = []() {
-            free(_newSettings);
+        static auto finishProgramming = [](bool result) {
+            Utils::Heap::free(_newSettings);
                 _newSettings = nullptr;
-            free(_newData);
+            Utils::Heap::free(_newData);
                 _newData = nullptr;
+            dataSetProgramming = false;
 
-            // Notify clients
-            for (int i = 0; i < programmingClients.Count(); ++i)
-            {
-                programmingClients[i].handler(programmingClients[i].token, ProgrammingEventType_End);
-            }
+            // Notify clients, this also ends a background programming that never got to Begin
+            notifyProgrammingEvent(ProgrammingEventType_End);
+            _onProgramFinished(result);
+        };
+
+        // Last step, the header makes the new slot the active one
+        static auto writeDataSetHeader = []() {
+            Flash::write(nullptr, getNextDataSetAddress(), _newData, sizeof(Data),
+                [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                    if (result) {
+                        activeSlot = 1 - activeSlot;
+                        NRF_LOG_INFO("DataSet flashed, slot %d", activeSlot);
+                    } else {
+                        NRF_LOG_ERROR("Error flashing dataset");
+                    }
+                    finishProgramming(result);
+            });
         };
 
-        _newData = (Data*)malloc(sizeof(Data));
+        if (appendingSettings || dataSetProgramming) {
+            NRF_LOG_ERROR("Settings or data set already being programmed");
+            return false;
+        }
+        _newData = (Data*)Utils::Heap::alloc(sizeof(Data), Utils::Heap::HeapTag_Flash);
         if (_newData == nullptr) {
             NRF_LOG_ERROR("Not enough ram to allocate copy of new data");
             return false;
         }
-        _newSettings = (Settings*)malloc(sizeof(Settings));
+        _newSettings = (Settings*)Utils::Heap::alloc(sizeof(Settings), Utils::Heap::HeapTag_Flash);
         if (_newSettings == nullptr) {
             NRF_LOG_ERROR("Not enough ram to allocate copy of new settings");
-            free(_newData);
+            Utils::Heap::free(_newData);
             _newData = nullptr;
             return false;
         }
@@ -248,76 +639,238 @@ namespace DriversNRF::Flash
         _programDataFunc = programFlashFunc;
         _onProgramFinished = onProgramFinished;
 
+        // The slot that's picked at boot when both are valid
+        auto currentData = (const Data*)getDataSetAddress();
+        _newData->generation = currentData->headMarker == ANIMATION_SET_VALID_KEY ? currentData->generation + 1 : 1;
+
         uint32_t bufferSize = DataSet::computeDataSetDataSize(_newData);
         if (availableDataSize() > bufferSize) {
-            beginProgramming();
+            // The current data set stays in use while the other slot is written
+            dataSetProgramming = true;
+            notifyProgrammingEvent(ProgrammingEventType_BeginBackground);
 
-            uint32_t totalSize = bufferSize + sizeof(Data) + sizeof(Settings);
-            uint32_t flashSize = Flash::getFlashByteSize(totalSize);
-            uint32_t pageAddress = Flash::getFlashStartAddress();
+            uint32_t flashSize = Flash::getFlashByteSize(bufferSize + sizeof(Data));
+            uint32_t pageAddress = getNextDataSetAddress();
             uint32_t pageCount = Flash::bytesToPages(flashSize);
 
-            // Start by erasing the flash
+            // Start by erasing the slot
             Flash::erase(nullptr, pageAddress, pageCount, [](void* context, bool result, uint32_t address, uint16_t data_size) {
                 NRF_LOG_INFO("Erased %d pages", data_size);
                 if (result) {
-                    // Program settings
-                    Flash::write(nullptr, getSettingsStartAddress(), _newSettings, sizeof(Settings), [](void* context, bool result, uint32_t address, uint16_t data_size) {
+                    // Receive all the buffers directly to flash
+                    _programDataFunc([](void* context, bool result, uint32_t address, uint16_t data_size) {
                         if (result) {
-                            NRF_LOG_INFO("Settings flashed");
-                            // Receive all the buffers directly to flash
-                            _programDataFunc([](void* context, bool result, uint32_t address, uint16_t data_size) {
-                                if (result) {
-                                    // Program the animation set itself
-                                    NRF_LOG_INFO("DataSet data flashed");
-                                    Flash::write(nullptr, getDataSetAddress(), _newData, sizeof(Data),
-                                        [](void* context, bool result, uint32_t address, uint16_t data_size) {
-                                            if (result) {
-                                                NRF_LOG_INFO("DataSet flashed");
-                                            } else {
-                                                NRF_LOG_ERROR("Error flashing dataset");
-                                            }
-                                            finishProgramming();
-                                            _onProgramFinished(result);
-                                    });
-                                } else {
-                                    NRF_LOG_ERROR("Error flashing DataSet data");
-                                    finishProgramming();
-                                    _onProgramFinished(false);
-                                }
-                            });
+                            NRF_LOG_INFO("DataSet data flashed");
+                            DataSet::computeDataSetHashes(_newData, (const Data*)getNextDataSetAddress());
+
+                            // Switching over, clients must stop using the current data set and settings
+                            notifyProgrammingEvent(ProgrammingEventType_Begin);
+                            if (settingsAddress != 0 && memcmp(_newSettings, (const void*)settingsAddress, sizeof(Settings)) == 0) {
+                                writeDataSetHeader();
+                            } else {
+                                // Program settings
+                                appendSettings(_newSettings, [](bool result) {
+                                    if (result) {
+                                        NRF_LOG_INFO("Settings flashed");
+                                        writeDataSetHeader();
+                                    } else {
+                                        NRF_LOG_ERROR("Error flashing settings");
+                                        finishProgramming(false);
+                                    }
+                                });
+                            }
                         } else {
-                            NRF_LOG_ERROR("Error flashing settings");
-                            finishProgramming();
-                            _onProgramFinished(false);
+                            NRF_LOG_ERROR("Error flashing DataSet data");
+                            finishProgramming(false);
                         }
                     });
                 } else {
                     NRF_LOG_ERROR("Error erasing flash");
-                    finishProgramming();
-                    _onProgramFinished(false);
+                    finishProgramming(false);
                 }
             });
             return true;
         } else {
             NRF_LOG_ERROR("Not enough available flash");
+            Utils::Heap::free(_newSettings);
+            _newSettings = nullptr;
+            Utils::Heap::free(_newData);
+            _newData = nullptr;
             return false;
         }
     }
 
+    bool patchDataSet(
+        uint32_t offset,
+        const void* data,
+        uint32_t size,
+        ProgramFlashNotification onPatchFinished) {
+
+        // The current data set is copied over to the other slot with the patched range replaced,
+        // and the new header is written last, so the current slot stays valid until then.
+        enum PatchStep
+        {
+            PatchStep_EraseSlot = 0,
+            PatchStep_CopyHead,
+            PatchStep_CopyPatch,
+            PatchStep_CopyTail,
+            PatchStep_WriteHeader,
+            PatchStep_Done
+        };
+
+        static Data* _newData = nullptr;
+        static const uint8_t* _data;
+        static uint32_t _start;
+        static uint32_t _end;
+        static uint32_t _dataSize;
+        static int _step;
+        static ProgramFlashNotification _onPatchFinished;
+        static void (*nextStep)();
+
+        static auto finishPatch = [](bool result) {
+            Utils::Heap::free(_newData);
+            _newData = nullptr;
+            dataSetProgramming = false;
+            notifyProgrammingEvent(ProgrammingEventType_End);
+            _onPatchFinished(result);
+        };
+
+        static auto onStepDone = [](void* context, bool result, uint32_t address, uint16_t data_size) {
+            if (result) {
+                _step++;
+                nextStep();
+            } else {
+                NRF_LOG_ERROR("Error patching dataset, step %d", _step);
+                finishPatch(false);
+            }
+        };
+
+        static auto doStep = []() {
+            const uint32_t from = getDataSetDataAddress();
+            const uint32_t to = getNextDataSetDataAddress();
+            switch (_step) {
+                case PatchStep_EraseSlot:
+                    erase(nullptr, getNextDataSetAddress(), bytesToPages(getFlashByteSize(_dataSize + sizeof(Data))), onStepDone);
+                    break;
+                case PatchStep_CopyHead:
+                    if (_start > 0) {
+                        write(nullptr, to, (const void*)from, _start, onStepDone);
+                    } else {
+                        onStepDone(nullptr, true, to, 0);
+                    }
+                    break;
+                case PatchStep_CopyPatch:
+                    write(nullptr, to + _start, _data, _end - _start, onStepDone);
+                    break;
+                case PatchStep_CopyTail:
+                    if (_end < _dataSize) {
+                        write(nullptr, to + _end, (const void*)(from + _end), _dataSize - _end, onStepDone);
+                    } else {
+                        onStepDone(nullptr, true, to + _end, 0);
+                    }
+                    break;
+                case PatchStep_WriteHeader:
+                    DataSet::computeDataSetHashes(_newData, (const Data*)getNextDataSetAddress());
+
+                    // Switching over, clients must stop using the current data set
+                    notifyProgrammingEvent(ProgrammingEventType_Begin);
+                    write(nullptr, getNextDataSetAddress(), _newData, sizeof(Data), onStepDone);
+                    break;
+                default:
+                    activeSlot = 1 - activeSlot;
+                    NRF_LOG_INFO("DataSet patched, slot %d", activeSlot);
+                    finishPatch(true);
+                    break;
+            }
+        };
+
+        if (appendingSettings || dataSetProgramming) {
+            NRF_LOG_ERROR("Settings or data set already being programmed");
+            return false;
+        }
+        auto currentData = (const Data*)getDataSetAddress();
+        const uint32_t dataSize = Utils::roundUpTo4(DataSet::computeDataSetDataSize(currentData));
+        if (currentData->headMarker != ANIMATION_SET_VALID_KEY) {
+            NRF_LOG_ERROR("No dataset to patch");
+            return false;
+        }
+        if (size == 0 || ((offset | size) & 3) != 0 || offset + size > dataSize) {
+            NRF_LOG_ERROR("Invalid dataset patch 0x%04x (%d bytes)", offset, size);
+            return false;
+        }
+
+        _newData = (Data*)Utils::Heap::alloc(sizeof(Data), Utils::Heap::HeapTag_Flash);
+        if (_newData == nullptr) {
+            NRF_LOG_ERROR("Not enough ram to allocate copy of patched data");
+            return false;
+        }
+        // Same layout, it only needs new hashes and to be picked over the current slot at boot
+        memcpy(_newData, currentData, sizeof(Data));
+        _newData->generation = currentData->generation + 1;
+
+        _start = offset;
+        _end = offset + size;
+        _data = (const uint8_t*)data;
+        _dataSize = dataSize;
+        _step = PatchStep_EraseSlot;
+        _onPatchFinished = onPatchFinished;
+        nextStep = doStep;
+
+        // The current data set stays in use while the other slot is written
+        dataSetProgramming = true;
+        notifyProgrammingEvent(ProgrammingEventType_BeginBackground);
+        doStep();
+        return true;
+    }
+
+    uint32_t getDataSetSlotAddress(int slot) {
+        // The settings journal has its own pages, followed by the two data set slots
+        uint32_t slotsStart = getSettingsEndAddress();
+        return slotsStart + slot * getDataSetSlotSize();
+    }
+
+    uint32_t getDataSetSlotSize() {
+        uint32_t slotsStart = getSettingsEndAddress();
+        return ((getFlashEndAddress() - slotsStart) / getPageSize() / 2) * getPageSize();
+    }
+
+    void selectDataSetSlot() {
+        // Pick the most recent valid slot, a slot whose programming didn't complete has no header
+        activeSlot = 0;
+        uint32_t bestGeneration = 0;
+        for (int i = 0; i < 2; ++i) {
+            auto slotData = (const Data*)getDataSetSlotAddress(i);
+            bool valid = slotData->headMarker == ANIMATION_SET_VALID_KEY &&
+                slotData->version == ANIMATION_SET_VERSION &&
+                slotData->tailMarker == ANIMATION_SET_VALID_KEY;
+            if (valid && slotData->generation > bestGeneration) {
+                activeSlot = i;
+                bestGeneration = slotData->generation;
+            }
+        }
+    }
+
     uint32_t getDataSetAddress() {
-        return getSettingsEndAddress();
+        return getDataSetSlotAddress(activeSlot);
     }
 
     uint32_t getDataSetDataAddress() {
         return getDataSetAddress() + sizeof(Data);
     }
 
+    uint32_t getNextDataSetAddress() {
+        return getDataSetSlotAddress(1 - activeSlot);
+    }
+
+    uint32_t getNextDataSetDataAddress() {
+        return getNextDataSetAddress() + sizeof(Data);
+    }
+
     uint32_t getSettingsStartAddress() {
         return (uint32_t)Flash::getFlashStartAddress();
     }
     uint32_t getSettingsEndAddress() {
-        return getSettingsStartAddress() + sizeof(Settings);
+        return getSettingsStartAddress() + SETTINGS_PAGE_COUNT * getPageSize();
     }
 
 
@@ -23,9 +23,18 @@ namespace DriversNRF
 
         typedef void (*FlashCallback)(void* context, bool result, uint32_t address, uint16_t size);
 
-        void write(void* context, uint32_t flashAddress, const void* data, uint32_t size, FlashCallback callback);
+        // Operations are queued and run one at a time, higher priority first, each gets its own callback.
+        // The data to write must stay valid until the callback.
+        enum Priority
+        {
+            Priority_Low = 0,   // Background work, e.g. the roll log
+            Priority_Normal,
+            Priority_High       // Data the central is waiting on
+        };
+
+        void write(void* context, uint32_t flashAddress, const void* data, uint32_t size, FlashCallback callback, Priority priority = Priority_Normal);
         void read(void* context, uint32_t flashAddress, void* outData, uint32_t size, FlashCallback callback);
-        void erase(void* context, uint32_t flashAddress, uint32_t pages, FlashCallback callback);
+        void erase(void* context, uint32_t flashAddress, uint32_t pages, FlashCallback callback, Priority priority = Priority_Normal);
 
         uint32_t getFlashStartAddress();
         uint32_t getFlashEndAddress();
@@ -34,10 +43,31 @@ namespace DriversNRF
         uint32_t bytesToPages(uint32_t size);
         uint32_t getFlashByteSize(uint32_t totalDataByteSize);
 
+        // The data set in use, and the slot the next one gets programmed into
         uint32_t getDataSetAddress();
         uint32_t getDataSetDataAddress();
+        uint32_t getNextDataSetAddress();
+        uint32_t getNextDataSetDataAddress();
+        uint32_t getDataSetSlotSize();
+        void selectDataSetSlot();
+        // Settings pages, the current settings are the latest record written to them
         uint32_t getSettingsStartAddress();
         uint32_t getSettingsEndAddress();
+        uint32_t getSettingsAddress();
+        void findSettings();
+
+        // The roll log pages sit at the end of the user flash, after the data set
+        uint32_t getRollLogStartAddress();
+        uint32_t getRollLogPageCount();
+
+        // The value store pages sit right before the roll log
+        uint32_t getValueStoreStartAddress();
+        uint32_t getValueStorePageCount();
+
+        bool isBusy();
+
+        // Whether settings or a data set are being programmed, other programming requests are rejected meanwhile
+        bool isProgramming();
 
         typedef void (*ProgramFlashNotification)(bool result);
         typedef void (*ProgramFlashFuncCallback)(void* context, bool result, uint32_t address, uint16_t size);
@@ -49,11 +79,26 @@ namespace DriversNRF
             ProgramFlashFunc programFlashFunc,
             ProgramFlashNotification onProgramFinished);
 
+        // Writes new settings on their own, leaving the data set alone
+        bool programSettings(const Config::Settings& newSettings, ProgramFlashNotification onProgramFinished);
+
+        // Invalidates both data set slots in place, without erasing them
+        bool clearDataSets(ProgramFlashNotification onCleared);
+
+        // Replaces a word aligned range of the data set (offset from the start of its data), by writing
+        // a patched copy to the other slot, the current data set stays valid until its header is written.
+        bool patchDataSet(
+            uint32_t offset,
+            const void* data,
+            uint32_t size,
+            ProgramFlashNotification onPatchFinished);
+
 
         enum ProgrammingEventType
         {
-            ProgrammingEventType_Begin = 0,
-            ProgrammingEventType_End
+            ProgrammingEventType_Begin = 0,     // Data set and settings are about to change
+            ProgrammingEventType_End,
+            ProgrammingEventType_BeginBackground, // Flash is in use but the current data set stays valid, ends with End
         };
 
         typedef void (*ProgrammingEventMethod)(void* param, ProgrammingEventType evt);
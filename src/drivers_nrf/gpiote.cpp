@@ -14,10 +14,10 @@ namespace DriversNRF::GPIOTE
         NRF_LOG_DEBUG("GPIOTE init");
     }
 
-    void enableInterrupt(uint32_t pin, nrf_gpio_pin_pull_t pull, nrf_gpiote_polarity_t polarity, PinHandler handler) {
+    void enableInterrupt(uint32_t pin, nrf_gpio_pin_pull_t pull, nrf_gpiote_polarity_t polarity, PinHandler handler, PinAccuracy accuracy) {
         nrf_drv_gpiote_in_config_t in_config;
         in_config.is_watcher = false;
-        in_config.hi_accuracy = true;
+        in_config.hi_accuracy = accuracy == PinAccuracy_High;
         in_config.pull = pull;
         in_config.sense = polarity;
         in_config.skip_gpio_setup = false;
@@ -14,7 +14,15 @@ namespace DriversNRF
         void init();
     
         typedef void (*PinHandler)(uint32_t pin, nrf_gpiote_polarity_t action);
-        void enableInterrupt(uint32_t pin, nrf_gpio_pin_pull_t pull, nrf_gpiote_polarity_t polarity, PinHandler handler);
+
+        enum PinAccuracy
+        {
+            // Dedicated GPIOTE channel, catches short pulses but costs current while sleeping
+            PinAccuracy_High,
+            // Shared PORT event using the pin SENSE, for slow or latched signals
+            PinAccuracy_LowPower,
+        };
+        void enableInterrupt(uint32_t pin, nrf_gpio_pin_pull_t pull, nrf_gpiote_polarity_t polarity, PinHandler handler, PinAccuracy accuracy = PinAccuracy_High);
         void disableInterrupt(uint32_t pin);
     }
 }
@@ -5,21 +5,79 @@
 #include "config/board_config.h"
 #include "nrf_log.h"
 #include "drivers_nrf/gpiote.h"
+#include "drivers_nrf/scheduler.h"
+#include "app_util_platform.h"
+#include <string.h>
+
+#define I2C_MAX_QUEUED_TRANSFERS 4
+
+// Longest register block written at once
+#define I2C_MAX_REGISTER_WRITE 8
 
 namespace DriversNRF::I2C
 {
     /* TWI instance. */
     static const nrf_drv_twi_t m_twi = NRF_DRV_TWI_INSTANCE(0);
 
+    // The driver runs in non-blocking mode, the blocking functions below start a transfer and wait
+    // for its completion event, the async ones are queued and chained from the interrupt handler.
+    struct Transfer
+    {
+        uint8_t device;
+        uint8_t reg;
+        uint8_t* buffer;
+        uint8_t len;
+        TransferCallback callback;
+        void* param;
+    };
+
+    static Transfer queue[I2C_MAX_QUEUED_TRANSFERS];
+    static uint8_t queueHead = 0;
+    static uint8_t queueCount = 0;
+
+    // Set while a transfer is on the bus
+    static volatile bool busy = false;
+    // Whether the transfer on the bus is the head of the async queue (or a blocking one)
+    static bool asyncActive = false;
+    static volatile bool blockingSuccess = false;
+    // Set until the blocking transfer on the bus completes, async reads queued meanwhile run right after it
+    static volatile bool blockingPending = false;
+
+    // Payload of the scheduler event that calls the transfer callback
+    struct Completion
+    {
+        TransferCallback callback;
+        void* param;
+        bool success;
+    };
+
+    void twiHandler(nrf_drv_twi_evt_t const* p_event, void* p_context);
+    void startNextTransfer();
+    void acquireBus();
+    void releaseBus();
+    static void configure();
+
     // Test
     void scanBus(); 
 
+    static bool fastMode = false;
 
     void init()
+    {
+        fastMode = Config::BoardManager::supportsFastI2C();
+        configure();
+
+        // Not needed for validation
+        #if DICE_SELFTEST && I2C_SELFTEST
+        selfTest();
+        #endif
+    }
+
+    static void configure()
     {
         auto board = Config::BoardManager::getBoard();
 
-        nrf_drv_twi_frequency_t freq = NRF_DRV_TWI_FREQ_100K;
+        nrf_drv_twi_frequency_t freq = fastMode ? NRF_DRV_TWI_FREQ_400K : NRF_DRV_TWI_FREQ_100K;
 
         const nrf_drv_twi_config_t twi_config = {
             .scl                = board->i2cClockPin,
@@ -29,7 +87,7 @@ namespace DriversNRF::I2C
             .clear_bus_init     = false
         };
 
-        auto err = nrf_drv_twi_init(&m_twi, &twi_config, NULL, NULL);
+        auto err = nrf_drv_twi_init(&m_twi, &twi_config, twiHandler, NULL);
         if (err != NRF_SUCCESS) {
             NRF_LOG_ERROR("I2C Initialization Failed, err=0x%x", err);
         }
@@ -40,7 +98,7 @@ namespace DriversNRF::I2C
 
         //scanBus();
 
-        NRF_LOG_INFO("I2C init freq: %d", (int)freq);
+        NRF_LOG_INFO("I2C init, %s mode", fastMode ? "fast" : "standard");
     }
 
     void deinit()
@@ -49,18 +107,91 @@ namespace DriversNRF::I2C
         nrf_drv_twi_disable(&m_twi);
     }
 
+    void setFastMode(bool fast)
+    {
+        if (fast != fastMode) {
+            // The frequency is only set when the driver is initialized, the bus must be idle
+            acquireBus();
+            nrf_drv_twi_disable(&m_twi);
+            nrf_drv_twi_uninit(&m_twi);
+            fastMode = fast;
+            configure();
+            blockingPending = false;
+            CRITICAL_REGION_ENTER();
+            releaseBus();
+            CRITICAL_REGION_EXIT();
+        }
+    }
+
+    bool isFastMode()
+    {
+        return fastMode;
+    }
+
     bool write(uint8_t device, uint8_t value, bool no_stop)
     {
         return write(device, &value, 1, no_stop);
     }
 
+    /// <summary>
+    /// Waits for the bus to be free (no transfer in progress or queued) and claims it
+    /// </summary>
+    void acquireBus()
+    {
+        bool acquired = false;
+        while (!acquired) {
+            CRITICAL_REGION_ENTER();
+            if (!busy && queueCount == 0) {
+                busy = true;
+                asyncActive = false;
+                blockingPending = true;
+                acquired = true;
+            }
+            CRITICAL_REGION_EXIT();
+        }
+    }
+
+    /// <summary>
+    /// Hands the bus over to the async reads queued while it was held, if any.
+    /// Called with interrupts disabled or from the TWI interrupt.
+    /// </summary>
+    void releaseBus()
+    {
+        if (queueCount > 0) {
+            startNextTransfer();
+        } else {
+            busy = false;
+        }
+    }
+
+    /// <summary>
+    /// Waits for the blocking transfer started on the bus to complete
+    /// </summary>
+    bool waitForTransfer(ret_code_t err)
+    {
+        if (err != NRF_SUCCESS) {
+            // Nothing started, release the bus
+            CRITICAL_REGION_ENTER();
+            blockingPending = false;
+            releaseBus();
+            CRITICAL_REGION_EXIT();
+            return false;
+        }
+        while (blockingPending) {
+            // The TWI interrupt clears the flag
+        }
+        return blockingSuccess;
+    }
+
     bool write(uint8_t device, const uint8_t* data, size_t size, bool no_stop)
     {
+        acquireBus();
         auto err = nrf_drv_twi_tx(&m_twi, device, data, size, no_stop);
-        if (err != NRF_SUCCESS) {
+        bool ret = waitForTransfer(err);
+        if (!ret) {
             NRF_LOG_ERROR("I2C Write Error 0x%x", err);
         }
-        return err == NRF_SUCCESS;
+        return ret;
     }
 
     bool read(uint8_t device, uint8_t* value)
@@ -70,11 +201,99 @@ namespace DriversNRF::I2C
 
     bool read(uint8_t device, uint8_t* data, size_t size)
     {
+        acquireBus();
         auto err = nrf_drv_twi_rx(&m_twi, device, data, size);
-        if (err != NRF_SUCCESS) {
+        bool ret = waitForTransfer(err);
+        if (!ret) {
             NRF_LOG_ERROR("I2C Read Error 0x%x", err);
         }
-        return err == NRF_SUCCESS;
+        return ret;
+    }
+
+    /// <summary>
+    /// Writes the register address then reads the data back, in a single transfer
+    /// with a repeated start, so that no other transfer can get in between
+    /// </summary>
+    bool readRegistersTxRx(uint8_t device, uint8_t* reg, uint8_t* buffer, uint8_t len)
+    {
+        nrf_drv_twi_xfer_desc_t xfer = NRF_DRV_TWI_XFER_DESC_TXRX(device, reg, 1, buffer, len);
+        return nrf_drv_twi_xfer(&m_twi, &xfer, 0) == NRF_SUCCESS;
+    }
+
+    bool readRegistersAsync(uint8_t device, uint8_t reg, uint8_t* buffer, uint8_t len, TransferCallback callback, void* param)
+    {
+        bool ret = false;
+        CRITICAL_REGION_ENTER();
+        if (queueCount < I2C_MAX_QUEUED_TRANSFERS) {
+            auto& t = queue[(queueHead + queueCount) % I2C_MAX_QUEUED_TRANSFERS];
+            t.device = device;
+            t.reg = reg;
+            t.buffer = buffer;
+            t.len = len;
+            t.callback = callback;
+            t.param = param;
+            queueCount++;
+            ret = true;
+            if (!busy) {
+                startNextTransfer();
+            }
+        }
+        CRITICAL_REGION_EXIT();
+        if (!ret) {
+            NRF_LOG_WARNING("I2C transfer queue full");
+        }
+        return ret;
+    }
+
+    /// <summary>
+    /// Starts the transfer at the head of the queue, if any. Called with interrupts disabled or from the TWI interrupt.
+    /// </summary>
+    void startNextTransfer()
+    {
+        while (queueCount > 0) {
+            auto& t = queue[queueHead];
+            busy = true;
+            asyncActive = true;
+            if (readRegistersTxRx(t.device, &t.reg, t.buffer, t.len)) {
+                return;
+            }
+
+            // Couldn't start it, report the failure and move on to the next one
+            Completion c = { t.callback, t.param, false };
+            queueHead = (queueHead + 1) % I2C_MAX_QUEUED_TRANSFERS;
+            queueCount--;
+            Scheduler::push(&c, sizeof(Completion), [](void* p_event_data, uint16_t event_size) {
+                auto c = (Completion*)p_event_data;
+                c->callback(c->param, c->success);
+            }, Scheduler::Priority_Realtime);
+        }
+        busy = false;
+        asyncActive = false;
+    }
+
+    void twiHandler(nrf_drv_twi_evt_t const* p_event, void* p_context)
+    {
+        bool success = p_event->type == NRF_DRV_TWI_EVT_DONE;
+        if (asyncActive) {
+            // Pop the transfer and notify from the main loop
+            auto& t = queue[queueHead];
+            Completion c = { t.callback, t.param, success };
+            queueHead = (queueHead + 1) % I2C_MAX_QUEUED_TRANSFERS;
+            queueCount--;
+            Scheduler::push(&c, sizeof(Completion), [](void* p_event_data, uint16_t event_size) {
+                auto c = (Completion*)p_event_data;
+                c->callback(c->param, c->success);
+            }, Scheduler::Priority_Realtime);
+
+            // Chain the next queued transfer
+            startNextTransfer();
+        } else {
+            // Async reads may have been queued while the blocking transfer had the bus
+            // (e.g. from the accelerometer interrupt), they start now
+            blockingSuccess = success;
+            blockingPending = false;
+            releaseBus();
+        }
     }
 
     /// <summary>
@@ -89,15 +308,30 @@ namespace DriversNRF::I2C
         write(device, bytes, 2);
     }
 
+    /// <summary>
+    /// WRITE MULTIPLE REGISTERS
+    /// Write "len" bytes to the device, starting at register "reg", in one transfer.
+    /// </summary>
+    void writeRegisters(uint8_t device, uint8_t reg, const uint8_t* data, uint8_t len)
+    {
+        if (len > I2C_MAX_REGISTER_WRITE) {
+            NRF_LOG_ERROR("I2C register block too long: %d", len);
+            return;
+        }
+        uint8_t bytes[I2C_MAX_REGISTER_WRITE + 1];
+        bytes[0] = reg;
+        memcpy(&bytes[1], data, len);
+        write(device, bytes, len + 1);
+    }
+
     /// <summary>
     /// READ A SINGLE REGISTER
     ///	Read a uint8_t from the device register "reg".
     /// </summary>
     uint8_t readRegister(uint8_t device, uint8_t reg)
     {
-        write(device, reg, true);
         uint8_t ret = 0;
-        read(device, &ret, 1);
+        readRegisters(device, reg, &ret, 1);
         return ret;
     }
 
@@ -108,8 +342,10 @@ namespace DriversNRF::I2C
     /// </summary>
     void readRegisters(uint8_t device, uint8_t reg, uint8_t *buffer, uint8_t len)
     {
-        write(device, reg, true);
-        read(device, buffer, len);
+        acquireBus();
+        if (!waitForTransfer(readRegistersTxRx(device, &reg, buffer, len) ? NRF_SUCCESS : NRF_ERROR_BUSY)) {
+            NRF_LOG_ERROR("I2C Read Error");
+        }
     }
 
     /// <summary>
@@ -140,8 +376,34 @@ namespace DriversNRF::I2C
         return output;
     }
 
+    #if DICE_SELFTEST && I2C_SELFTEST
+    // Register read by the self test, the accelerometer's WHO_AM_I on all current boards
+    #define I2C_SELFTEST_DEVICE 0x0F
+    #define I2C_SELFTEST_REGISTER 0x0F
+
+    void selfTest() {
+        // Queue an async read while a blocking transfer holds the bus, as the accelerometer
+        // interrupt can, it must start once the blocking transfer is done
+        NRF_LOG_INFO("Queuing an async read during a blocking transfer");
+        static uint8_t asyncValue = 0;
+        uint8_t reg = I2C_SELFTEST_REGISTER;
+        uint8_t blockingValue = 0;
+        acquireBus();
+        ret_code_t err = readRegistersTxRx(I2C_SELFTEST_DEVICE, &reg, &blockingValue, 1) ? NRF_SUCCESS : NRF_ERROR_BUSY;
+        bool queued = readRegistersAsync(I2C_SELFTEST_DEVICE, I2C_SELFTEST_REGISTER, &asyncValue, 1, [](void* param, bool success) {}, nullptr);
+        bool blockingResult = waitForTransfer(err);
+
+        // Hangs here if the queued read never starts
+        uint8_t value = readRegister(I2C_SELFTEST_DEVICE, I2C_SELFTEST_REGISTER);
+        if (queued && blockingResult && queueCount == 0 && asyncValue == value && blockingValue == value) {
+            NRF_LOG_INFO("Success: read 0x%02x three times", value);
+        } else {
+            NRF_LOG_WARNING("Error: queued=%d, blocking=%d, values 0x%02x 0x%02x 0x%02x", queued, blockingResult, blockingValue, asyncValue, value);
+        }
+    }
+    #endif
+
     void scanBus() {
-        ret_code_t err_code;
         uint8_t address;
         uint8_t sample_data;
 
@@ -151,8 +413,7 @@ namespace DriversNRF::I2C
             for (address = 1; address <= 127; address++)
             {
                 NRF_LOG_INFO("Testing address 0x%x.", address);
-                err_code = nrf_drv_twi_rx(&m_twi, address, &sample_data, sizeof(sample_data));
-                if (err_code == NRF_SUCCESS)
+                if (read(address, &sample_data, sizeof(sample_data)))
                 {
                     detected_device = true;
                     NRF_LOG_INFO("I2C device detected at address 0x%x.", address);
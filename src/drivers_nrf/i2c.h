@@ -13,16 +13,31 @@ namespace DriversNRF
         void init();
         void deinit();
 
+        // Fast mode (400kHz) is used when the board supports it, this switches back to standard
+        // mode (100kHz) if the bus turns out not to work at that speed
+        void setFastMode(bool fast);
+        bool isFastMode();
+
         bool write(uint8_t device, uint8_t value, bool no_stop = false);
         bool write(uint8_t device, const uint8_t* data, size_t size, bool no_stop = false);
         bool read(uint8_t device, uint8_t* value);
         bool read(uint8_t device, uint8_t* data, size_t size);
 
         void writeRegister(uint8_t device, uint8_t reg, uint8_t data);
+        // Writes consecutive registers in a single transfer, for devices that auto-increment the address
+        void writeRegisters(uint8_t device, uint8_t reg, const uint8_t* data, uint8_t len);
         uint8_t readRegister(uint8_t device, uint8_t reg);
         void readRegisters(uint8_t device, uint8_t reg, uint8_t *buffer, uint8_t len);
         int16_t readRegisterInt16(uint8_t device, uint8_t reg);
         uint16_t readRegisterUInt16(uint8_t device, uint8_t reg);
+
+        // Non-blocking register read, queued behind any transfer in progress. The buffer must stay valid
+        // until the callback, which is called from the main loop (through the scheduler) once the data is in.
+        // Returns false if the transfer queue is full.
+        typedef void (*TransferCallback)(void* param, bool success);
+        bool readRegistersAsync(uint8_t device, uint8_t reg, uint8_t* buffer, uint8_t len, TransferCallback callback, void* param);
+
+        void selfTest();
     }
 }
 
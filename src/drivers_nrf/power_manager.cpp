@@ -7,6 +7,7 @@
 #include "log.h"
 #include "core/delegate_array.h"
 #include "drivers_nrf/timers.h"
+#include "drivers_nrf/retained_state.h"
 
 #define GPREGRET_ID 0
 #define SLEEP_TIMEOUT_MS (15*60*1000) //  Comment to disable sleep timeout
@@ -20,6 +21,12 @@ namespace DriversNRF::PowerManager
     APP_TIMER_DEF(sleepTimer);
     void triggerSleepMode(void* context);
 
+    // feed() only records the time, the sleep timer checks it when it fires
+    static volatile int lastActivityMs = 0;
+
+    // Number of times the CPU came back from waiting for an event
+    static uint32_t wakeCount = 0;
+
     enum PowerManagerState {
         PowerManagerState_Normal = 0,
         PowerManagerState_Paused
@@ -36,6 +43,7 @@ namespace DriversNRF::PowerManager
 
         #if defined(SLEEP_TIMEOUT_MS)
             Timers::createTimer(&sleepTimer, APP_TIMER_MODE_SINGLE_SHOT, triggerSleepMode);
+            lastActivityMs = Timers::millis();
             Timers::startTimer(sleepTimer, SLEEP_TIMEOUT_MS);
         #endif
 
@@ -81,6 +89,14 @@ namespace DriversNRF::PowerManager
     NRF_PWR_MGMT_HANDLER_REGISTER(powerEventHandler, 0);
 
     void triggerSleepMode(void* context) {
+        #if defined(SLEEP_TIMEOUT_MS)
+            int remainingMs = SLEEP_TIMEOUT_MS - (Timers::millis() - lastActivityMs);
+            if (remainingMs > 0) {
+                // There was some activity since the timer was started, wait some more
+                Timers::startTimer(sleepTimer, remainingMs);
+                return;
+            }
+        #endif
         NRF_LOG_INFO("PowerManager timeout => sleep");
         goToSleep();
     }
@@ -89,22 +105,33 @@ namespace DriversNRF::PowerManager
         nrf_pwr_mgmt_feed();
 
         if (state == PowerManagerState_Normal) {
-        // Restart the timer
+        // Push back the sleep timeout
         #if defined(SLEEP_TIMEOUT_MS)
-            Timers::stopTimer(sleepTimer);
-            Timers::startTimer(sleepTimer, SLEEP_TIMEOUT_MS);
+            lastActivityMs = Timers::millis();
         #endif
         }
     }
 
     void update() {
         nrf_pwr_mgmt_run();
+        wakeCount++;
+    }
+
+    uint32_t getWakeCount() {
+        return wakeCount;
+    }
+
+    void resetWakeCount() {
+        wakeCount = 0;
     }
 
     void goToSystemOff() {
         // Inform bootloader to skip CRC on next boot.
         nrf_power_gpregret2_set(BOOTLOADER_DFU_SKIP_CRC);
 
+        // Keep what the next boot can reuse
+        RetainedState::retain();
+
         // Go to system off.
         nrf_pwr_mgmt_shutdown(NRF_PWR_MGMT_SHUTDOWN_STAY_IN_SYSOFF);
     }
@@ -113,6 +140,9 @@ namespace DriversNRF::PowerManager
         // Inform bootloader to skip CRC on next boot.
         nrf_power_gpregret2_set(BOOTLOADER_DFU_SKIP_CRC);
 
+        // Keep what the next boot can reuse
+        RetainedState::retain();
+
         // Go to system off.
         nrf_pwr_mgmt_shutdown(NRF_PWR_MGMT_SHUTDOWN_GOTO_SYSOFF);
     }
@@ -126,6 +156,7 @@ namespace DriversNRF::PowerManager
 
         // Restart the sleep timer
         #if defined(SLEEP_TIMEOUT_MS)
+            lastActivityMs = Timers::millis();
             Timers::startTimer(sleepTimer, SLEEP_TIMEOUT_MS);
         #endif
     }
@@ -162,6 +193,7 @@ namespace DriversNRF::PowerManager
         if (state == PowerManagerState_Paused) {
         // Restart the sleep timer
         #if defined(SLEEP_TIMEOUT_MS)
+            lastActivityMs = Timers::millis();
             Timers::startTimer(sleepTimer, SLEEP_TIMEOUT_MS);
         #endif
             state = PowerManagerState_Normal;
@@ -22,6 +22,8 @@ namespace DriversNRF
         void init(PowerManagerClientMethod callback);
         void feed();
         void update();
+        uint32_t getWakeCount();
+        void resetWakeCount();
         void pause();
         void resume();
         void goToSystemOff();
@@ -0,0 +1,286 @@
+#include "profiler.h"
+#include "nrf.h"
+#include "nrf_log.h"
+#include "app_util.h"
+#include "app_util_platform.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bulk_data_transfer.h"
+#include "scheduler.h"
+#include "power_manager.h"
+#include "timers.h"
+#include "core/int3.h"
+#include <stdlib.h>
+
+// Each timeline record is one word: time in us on the low 24 bits, then the event and the phase
+#define TIMELINE_SIZE 128
+#define TIMELINE_TIME_MASK 0xFFFFFF
+#define TIMELINE_EVENT_SHIFT 24
+#define TIMELINE_PHASE_SHIFT 30
+#define TIMELINE_CYCLES_PER_US 64
+
+using namespace Bluetooth;
+
+namespace DriversNRF::Profiler
+{
+    static StageStats stats[Stage_Count];
+
+    static uint32_t timeline[TIMELINE_SIZE];
+    static uint16_t timelineNext = 0;
+    static uint16_t timelineCount = 0;
+    static bool timelinePaused = false;     // While the timeline is being downloaded
+
+    void requestProfileHandler(const Message* msg);
+    void requestSchedulerStatsHandler(const Message* msg);
+    void requestWakeStatsHandler(const Message* msg);
+    void requestTimelineHandler(const Message* msg);
+
+    void init() {
+#if PROFILER_ENABLED
+        // Enable the cycle counter
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        reset();
+
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestProfile, requestProfileHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestSchedulerStats, requestSchedulerStatsHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestWakeStats, requestWakeStatsHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestTimeline, requestTimelineHandler);
+        NRF_LOG_DEBUG("Profiler init");
+
+        #if DICE_SELFTEST && PROFILER_SELFTEST
+        selfTest();
+        #endif
+#endif
+    }
+
+    uint32_t cycles() {
+        return DWT->CYCCNT;
+    }
+
+    void record(Stage stage, uint32_t startCycles) {
+        // Unsigned math takes care of the counter wrapping around
+        uint32_t elapsed = DWT->CYCCNT - startCycles;
+        CRITICAL_REGION_ENTER();
+        auto& s = stats[stage];
+        s.count++;
+        s.totalCycles += elapsed;
+        if (elapsed < s.minCycles) {
+            s.minCycles = elapsed;
+        }
+        if (elapsed > s.maxCycles) {
+            s.maxCycles = elapsed;
+        }
+        CRITICAL_REGION_EXIT();
+    }
+
+    void recordEvent(TimelineEvent event, TimelinePhase phase) {
+        // Microseconds from the cycle counter, wrapping around every 16.7s (the host unwraps them)
+        const uint32_t record = ((DWT->CYCCNT / TIMELINE_CYCLES_PER_US) & TIMELINE_TIME_MASK) |
+            ((uint32_t)event << TIMELINE_EVENT_SHIFT) | ((uint32_t)phase << TIMELINE_PHASE_SHIFT);
+        CRITICAL_REGION_ENTER();
+        if (!timelinePaused) {
+            timeline[timelineNext] = record;
+            timelineNext = (timelineNext + 1) % TIMELINE_SIZE;
+            if (timelineCount < TIMELINE_SIZE) {
+                timelineCount++;
+            }
+        }
+        CRITICAL_REGION_EXIT();
+    }
+
+    const StageStats& getStats(Stage stage) {
+        return stats[stage];
+    }
+
+    void reset() {
+        CRITICAL_REGION_ENTER();
+        for (int i = 0; i < Stage_Count; ++i) {
+            stats[i].count = 0;
+            stats[i].minCycles = 0xFFFFFFFF;
+            stats[i].maxCycles = 0;
+            stats[i].totalCycles = 0;
+        }
+        CRITICAL_REGION_EXIT();
+    }
+
+    void requestProfileHandler(const Message* msg) {
+        auto req = (const MessageRequestProfile*)msg;
+
+        MessageProfile profile;
+        profile.stageCount = Stage_Count;
+        for (int i = 0; i < Stage_Count; ++i) {
+            auto& s = stats[i];
+            auto& out = profile.stages[i];
+            out.count = s.count;
+            out.minCycles = s.count > 0 ? s.minCycles : 0;
+            out.avgCycles = s.count > 0 ? s.totalCycles / s.count : 0;
+            out.maxCycles = s.maxCycles;
+        }
+        MessageService::SendMessage(&profile);
+
+        if (req->reset) {
+            reset();
+        }
+    }
+
+    void requestSchedulerStatsHandler(const Message* msg) {
+        auto req = (const MessageRequestSchedulerStats*)msg;
+
+        MessageSchedulerStats stats;
+        stats.queueCount = Scheduler::Priority_Count;
+        for (int i = 0; i < Scheduler::Priority_Count; ++i) {
+            auto& s = Scheduler::getQueueStats((Scheduler::Priority)i);
+            auto& out = stats.queues[i];
+            out.eventCount = s.eventCount;
+            out.avgWaitMs = s.eventCount > 0 ? s.totalWaitMs / s.eventCount : 0;
+            out.maxWaitMs = s.maxWaitMs;
+            out.maxDepth = s.maxDepth;
+            out.overflowCount = Scheduler::getOverflowCount((Scheduler::Priority)i);
+        }
+        stats.handlerCount = 0;
+        for (int i = 0; i < SCHED_PROFILED_HANDLERS; ++i) {
+            auto& h = Scheduler::getHandlerStats(i);
+            if (h.handler != nullptr) {
+                auto& out = stats.handlers[stats.handlerCount++];
+                out.address = (uint32_t)h.handler;
+                out.count = h.count;
+                out.maxCycles = h.maxCycles;
+                memcpy(out.runtimeHistogram, h.runtimeHistogram, sizeof(out.runtimeHistogram));
+            }
+        }
+        MessageService::SendMessage(&stats);
+
+        if (req->reset) {
+            Scheduler::resetStats();
+        }
+    }
+
+    void requestWakeStatsHandler(const Message* msg) {
+        auto req = (const MessageRequestWakeStats*)msg;
+
+        MessageWakeStats stats;
+        stats.time = Timers::millis();
+        stats.wakeCount = PowerManager::getWakeCount();
+        stats.reasonCount = Scheduler::WakeReason_Count;
+        for (int i = 0; i < Scheduler::WakeReason_Count; ++i) {
+            stats.reasonCounts[i] = Scheduler::getWakeReasonCount((Scheduler::WakeReason)i);
+        }
+        MessageService::SendMessage(&stats);
+
+        if (req->reset) {
+            PowerManager::resetWakeCount();
+            Scheduler::resetWakeReasonCounts();
+        }
+    }
+
+    void requestTimelineHandler(const Message* msg) {
+        auto req = (const MessageRequestTimeline*)msg;
+
+        // Recording stops until the buffer has been sent, so it doesn't change under the transfer
+        timelinePaused = true;
+        MessageTimeline header;
+        header.recordCount = timelineCount;
+        header.firstIndex = (timelineNext + TIMELINE_SIZE - timelineCount) % TIMELINE_SIZE;
+        header.bufferSize = TIMELINE_SIZE;
+        header.cyclesPerUs = TIMELINE_CYCLES_PER_US;
+        MessageService::SendMessage(&header);
+
+        SendBulkData::send((const uint8_t*)timeline, sizeof(timeline), (void*)(uintptr_t)req->reset,
+            [](void* context, bool result, const uint8_t* data, uint16_t size) {
+                if (context != nullptr) {
+                    timelineNext = 0;
+                    timelineCount = 0;
+                }
+                timelinePaused = false;
+            });
+    }
+
+    #if DICE_SELFTEST && PROFILER_SELFTEST
+
+    #define BENCHMARK_VECTOR_COUNT 64
+
+    // The int3 math as it was before the DSP version, to compare against
+    static int32_t referenceDotTimes1000(const Core::int3& left, const Core::int3& right) {
+        return ((int32_t)left.xTimes1000 * right.xTimes1000 + (int32_t)left.yTimes1000 * right.yTimes1000 + (int32_t)left.zTimes1000 * right.zTimes1000) / 1000;
+    }
+
+    static int32_t referenceMagnitudeTimes1000(const Core::int3& v) {
+        return Utils::sqrt_i32(referenceDotTimes1000(v, v) * 1000);
+    }
+
+    static Core::int3 referenceNormalized(const Core::int3& v) {
+        int magTimes1000 = referenceMagnitudeTimes1000(v);
+        return Core::int3(
+            (int32_t)v.xTimes1000 * 1000 / magTimes1000,
+            (int32_t)v.yTimes1000 * 1000 / magTimes1000,
+            (int32_t)v.zTimes1000 * 1000 / magTimes1000);
+    }
+
+    /// <summary>
+    /// Times the int3 dot product, magnitude and normalization against the reference versions,
+    /// on accelerometer sized vectors (up to 4g), and logs the cycles per operation and the largest difference
+    /// </summary>
+    void selfTest() {
+        static Core::int3 vectors[BENCHMARK_VECTOR_COUNT];
+        uint32_t seed = 0x1234567;
+        for (int i = 0; i < BENCHMARK_VECTOR_COUNT; ++i) {
+            seed = seed * 1664525 + 1013904223;
+            vectors[i] = Core::int3((int16_t)(seed >> 16) % 4000, (int16_t)seed % 4000, (int16_t)(seed >> 8) % 4000);
+        }
+
+        volatile int32_t sink = 0;
+        uint32_t start = cycles();
+        for (int i = 0; i < BENCHMARK_VECTOR_COUNT; ++i) {
+            sink += referenceDotTimes1000(vectors[i], vectors[(i + 1) % BENCHMARK_VECTOR_COUNT]);
+        }
+        uint32_t refDot = cycles() - start;
+        start = cycles();
+        for (int i = 0; i < BENCHMARK_VECTOR_COUNT; ++i) {
+            sink += Core::int3::dotTimes1000(vectors[i], vectors[(i + 1) % BENCHMARK_VECTOR_COUNT]);
+        }
+        uint32_t newDot = cycles() - start;
+
+        start = cycles();
+        for (int i = 0; i < BENCHMARK_VECTOR_COUNT; ++i) {
+            sink += referenceMagnitudeTimes1000(vectors[i]);
+        }
+        uint32_t refMag = cycles() - start;
+        start = cycles();
+        for (int i = 0; i < BENCHMARK_VECTOR_COUNT; ++i) {
+            sink += vectors[i].magnitudeTimes1000();
+        }
+        uint32_t newMag = cycles() - start;
+
+        start = cycles();
+        for (int i = 0; i < BENCHMARK_VECTOR_COUNT; ++i) {
+            sink += referenceNormalized(vectors[i]).xTimes1000;
+        }
+        uint32_t refNorm = cycles() - start;
+        start = cycles();
+        for (int i = 0; i < BENCHMARK_VECTOR_COUNT; ++i) {
+            sink += vectors[i].normalized().xTimes1000;
+        }
+        uint32_t newNorm = cycles() - start;
+
+        int maxMagError = 0;
+        int maxNormError = 0;
+        for (int i = 0; i < BENCHMARK_VECTOR_COUNT; ++i) {
+            int magError = abs(vectors[i].magnitudeTimes1000() - referenceMagnitudeTimes1000(vectors[i]));
+            maxMagError = MAX(maxMagError, magError);
+            auto n = vectors[i].normalized();
+            auto r = referenceNormalized(vectors[i]);
+            int normError = MAX(abs(n.xTimes1000 - r.xTimes1000), MAX(abs(n.yTimes1000 - r.yTimes1000), abs(n.zTimes1000 - r.zTimes1000)));
+            maxNormError = MAX(maxNormError, normError);
+        }
+
+        NRF_LOG_INFO("int3 cycles per op (reference / new), over %d vectors", BENCHMARK_VECTOR_COUNT);
+        NRF_LOG_INFO("  dot: %d / %d", refDot / BENCHMARK_VECTOR_COUNT, newDot / BENCHMARK_VECTOR_COUNT);
+        NRF_LOG_INFO("  magnitude: %d / %d, max difference %d", refMag / BENCHMARK_VECTOR_COUNT, newMag / BENCHMARK_VECTOR_COUNT, maxMagError);
+        NRF_LOG_INFO("  normalize: %d / %d, max difference %d", refNorm / BENCHMARK_VECTOR_COUNT, newNorm / BENCHMARK_VECTOR_COUNT, maxNormError);
+        (void)sink;
+    }
+
+    #endif
+}
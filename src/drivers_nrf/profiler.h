@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+
+// The profiler is only compiled in debug builds
+#if defined(DEBUG)
+#define PROFILER_ENABLED 1
+#else
+#define PROFILER_ENABLED 0
+#endif
+
+namespace DriversNRF
+{
+    /// <summary>
+    /// Cycle count profiler for the animation pipeline, based on the Cortex-M4 DWT cycle counter.
+    /// Every stage keeps min / average / max accumulators until reset.
+    /// </summary>
+    namespace Profiler
+    {
+        enum Stage : uint8_t
+        {
+            Stage_AnimUpdate = 0,   // Whole AnimController::update()
+            Stage_AnimInstance,     // Each animation instance's updateDaisyChainLEDs()
+            Stage_Blend,            // Compositing an animation into the frame
+            Stage_Output,           // Brightness / gamma output stage
+            Stage_Show,             // Sending the frame to the LEDs
+            Stage_Count,
+        };
+
+        struct StageStats
+        {
+            uint32_t count;
+            uint32_t minCycles;
+            uint32_t maxCycles;
+            uint32_t totalCycles;
+        };
+
+        void init();
+        void selfTest();
+        uint32_t cycles();
+        void record(Stage stage, uint32_t startCycles);
+        const StageStats& getStats(Stage stage);
+        void reset();
+
+        // Timeline of timestamped events, kept in a ring buffer until downloaded with RequestTimeline
+        enum TimelineEvent : uint8_t
+        {
+            TimelineEvent_AccHandler = 0,       // Processing an accelerometer sample
+            TimelineEvent_AnimUpdate,           // AnimController::update() rendering a frame
+            TimelineEvent_MessageServiceUpdate, // Handling received messages and sending queued ones
+            TimelineEvent_FlashOp,              // From handing an operation to fstorage until it completes
+            TimelineEvent_NotificationsSent,    // BLE_GATTS_EVT_HVN_TX_COMPLETE
+            TimelineEvent_Count,
+        };
+
+        enum TimelinePhase : uint8_t
+        {
+            TimelinePhase_Begin = 0,
+            TimelinePhase_End,
+            TimelinePhase_Instant,
+        };
+
+        void recordEvent(TimelineEvent event, TimelinePhase phase);
+    }
+}
+
+#if PROFILER_ENABLED
+#define PROFILE_BEGIN(name) uint32_t name = DriversNRF::Profiler::cycles()
+#define PROFILE_END(stage, name) DriversNRF::Profiler::record(stage, name)
+#define TIMELINE_BEGIN(event) DriversNRF::Profiler::recordEvent(event, DriversNRF::Profiler::TimelinePhase_Begin)
+#define TIMELINE_END(event) DriversNRF::Profiler::recordEvent(event, DriversNRF::Profiler::TimelinePhase_End)
+#define TIMELINE_INSTANT(event) DriversNRF::Profiler::recordEvent(event, DriversNRF::Profiler::TimelinePhase_Instant)
+#else
+#define PROFILE_BEGIN(name)
+#define PROFILE_END(stage, name)
+#define TIMELINE_BEGIN(event)
+#define TIMELINE_END(event)
+#define TIMELINE_INSTANT(event)
+#endif
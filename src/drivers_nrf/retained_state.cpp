@@ -0,0 +1,81 @@
+#include "retained_state.h"
+#include "utils/utils.h"
+#include "nrf_power.h"
+#include "nrf_soc.h"
+#include "nrf_sdh.h"
+#include "nrf_log.h"
+#include <stddef.h>
+#include <string.h>
+
+#if !defined(BUILD_TIMESTAMP)
+    #warning Build timestamp not defined
+    #define BUILD_TIMESTAMP 0
+#endif
+
+#define RETAINED_STATE_MARKER 0x5E7A1AED
+
+// RAM retention is set per 4KB section, two sections per RAM block
+#define RAM_START 0x20000000
+#define RAM_SECTION_SIZE 0x1000
+#define RAM_SECTIONS_PER_BLOCK 2
+
+namespace DriversNRF::RetainedState
+{
+    struct Block
+    {
+        uint32_t marker;
+        uint32_t buildTimestamp;    // State left by another firmware may not mean the same thing
+        State state;
+        uint32_t checksum;
+    };
+
+    // Not touched by the startup code, see the .noinit section in the linker script
+    static Block block __attribute__((section(".noinit")));
+    static bool warmBoot = false;
+
+    static uint32_t computeChecksum() {
+        return Utils::computeHash((const uint8_t*)&block, offsetof(Block, checksum));
+    }
+
+    void init() {
+        // Any other reset (or a crash before retain()) leaves garbage or stale values
+        warmBoot = (nrf_power_resetreas_get() & NRF_POWER_RESETREAS_OFF_MASK) != 0 &&
+            block.marker == RETAINED_STATE_MARKER &&
+            block.buildTimestamp == BUILD_TIMESTAMP &&
+            block.checksum == computeChecksum();
+        if (!warmBoot) {
+            memset(&block.state, 0, sizeof(State));
+        }
+
+        // Only valid again once sealed by retain()
+        block.marker = 0;
+    }
+
+    bool isWarmBoot() {
+        return warmBoot;
+    }
+
+    State* getState() {
+        return &block.state;
+    }
+
+    void retain() {
+        block.marker = RETAINED_STATE_MARKER;
+        block.buildTimestamp = BUILD_TIMESTAMP;
+        block.checksum = computeChecksum();
+
+        // Retain every section the block overlaps, the others are lost as usual
+        const uint32_t first = ((uint32_t)&block - RAM_START) / RAM_SECTION_SIZE;
+        const uint32_t last = ((uint32_t)&block + sizeof(Block) - 1 - RAM_START) / RAM_SECTION_SIZE;
+        for (uint32_t section = first; section <= last; ++section) {
+            const uint8_t index = section / RAM_SECTIONS_PER_BLOCK;
+            const uint32_t mask = POWER_RAM_POWERSET_S0RETENTION_Msk << (section % RAM_SECTIONS_PER_BLOCK);
+            if (nrf_sdh_is_enabled()) {
+                sd_power_ram_power_set(index, mask);
+            } else {
+                NRF_POWER->RAM[index].POWERSET = mask;
+            }
+        }
+        NRF_LOG_DEBUG("Retained state sealed");
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace DriversNRF
+{
+    /// <summary>
+    /// A small block of RAM kept powered in System OFF, so that waking up from it (an actual
+    /// reset) can reuse what was already checked instead of redoing it
+    /// </summary>
+    namespace RetainedState
+    {
+        struct State
+        {
+            // Hash of the data set, so the built-in defaults don't need hashing again
+            uint32_t dataSetAddress;
+            uint32_t dataSetSize;
+            uint32_t dataSetHash;
+
+            // The LED return test passed, and how many warm boots skipped it since
+            uint8_t ledReturnPassed;
+            uint8_t ledReturnSkipCount;
+        };
+
+        // Must be called before the reset reason is cleared
+        void init();
+
+        // Whether we woke up from System OFF with the state left by this firmware,
+        // otherwise the state starts all zeroes
+        bool isWarmBoot();
+
+        State* getState();
+
+        // Seals the state and retains its RAM through System OFF, call right before going to it
+        void retain();
+    }
+}
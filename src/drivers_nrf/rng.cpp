@@ -4,8 +4,14 @@
 #include "nrf_sdh_soc.h"
 #include "app_error.h"
 
+// Number of pseudo random numbers drawn between attempts at mixing in hardware entropy
+#define FAST_RNG_RESEED_PERIOD 64
+
 namespace DriversNRF::RNG
 {
+    static uint32_t fastState = 0; // Never 0 once seeded
+    static uint8_t drawsSinceReseed = 0;
+
     void init() {
         NRF_LOG_DEBUG("RNG init");
     }
@@ -41,4 +47,35 @@ namespace DriversNRF::RNG
         return ret;
     }
 
+    /// <summary>
+    /// Mixes hardware random bytes into the pseudo random state if there are enough of them already
+    /// </summary>
+    static void reseed() {
+        uint8_t available = 0;
+        sd_rand_application_bytes_available_get(&available);
+        if (available >= sizeof(uint32_t)) {
+            uint32_t entropy;
+            if (sd_rand_application_vector_get((uint8_t*)(void*)&entropy, sizeof(entropy)) == NRF_SUCCESS) {
+                fastState ^= entropy;
+            }
+        }
+        if (fastState == 0) {
+            // Xorshift never leaves 0
+            fastState = 0x6D2B79F5;
+        }
+        drawsSinceReseed = 0;
+    }
+
+    uint32_t fastUInt32() {
+        if (fastState == 0 || ++drawsSinceReseed >= FAST_RNG_RESEED_PERIOD) {
+            reseed();
+        }
+        uint32_t x = fastState;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        fastState = x;
+        return x;
+    }
+
 }
@@ -15,6 +15,10 @@ namespace DriversNRF
         uint8_t randomUInt8();
         uint16_t randomUInt16();
         uint32_t randomUInt32();
+
+        // Fast pseudo random numbers (xorshift) for animations and other cosmetic uses, never waits
+        // on the hardware generator. Its entropy is mixed in whenever some is available.
+        uint32_t fastUInt32();
     }
 }
 
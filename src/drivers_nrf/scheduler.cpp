@@ -2,29 +2,221 @@
 #include "app_error.h"
 #include "app_error_weak.h"
 #include "app_timer.h"
+#include "app_util_platform.h"
+#include "string.h"
 #include "log.h"
+#include "timers.h"
 
 #define SCHED_MAX_EVENT_DATA_SIZE      16        /**< Maximum size of scheduler events. */
-#define SCHED_QUEUE_SIZE               16        /**< Maximum number of events in the scheduler queue. */
+#define SCHED_QUEUE_SIZE               16        /**< Maximum number of events in the scheduler queue (SDK events). */
+
+#define SCHED_REALTIME_QUEUE_SIZE      8
+#define SCHED_NORMAL_QUEUE_SIZE        8
+#define SCHED_BACKGROUND_QUEUE_SIZE    4
 
 namespace DriversNRF::Scheduler
 {
+    struct Event
+    {
+        app_sched_event_handler_t handler;
+        uint16_t size;
+#if PROFILER_ENABLED
+        int queuedMs;
+#endif
+        uint8_t data[SCHED_MAX_EVENT_DATA_SIZE] __attribute__((aligned(4)));
+    };
+
+    // Ring buffer of events for one priority level
+    struct Queue
+    {
+        Event* events;
+        uint8_t capacity;
+        uint8_t head;
+        uint8_t count;
+        uint32_t overflowCount;
+    };
+
+    static Event realtimeEvents[SCHED_REALTIME_QUEUE_SIZE];
+    static Event normalEvents[SCHED_NORMAL_QUEUE_SIZE];
+    static Event backgroundEvents[SCHED_BACKGROUND_QUEUE_SIZE];
+
+    static Queue queues[Priority_Count] =
+    {
+        { realtimeEvents, SCHED_REALTIME_QUEUE_SIZE, 0, 0, 0 },
+        { normalEvents, SCHED_NORMAL_QUEUE_SIZE, 0, 0, 0 },
+        { backgroundEvents, SCHED_BACKGROUND_QUEUE_SIZE, 0, 0, 0 },
+    };
+
+    static uint32_t wakeReasonCounts[WakeReason_Count];
+
+    static QueueStats queueStats[Priority_Count];
+    static HandlerStats handlerStats[SCHED_PROFILED_HANDLERS];
+
+#if PROFILER_ENABLED
+    static void recordRun(Priority priority, const Event& evt, uint32_t startCycles) {
+        uint32_t elapsed = Profiler::cycles() - startCycles;
+
+        auto& qs = queueStats[priority];
+        int waitMs = Timers::millis() - evt.queuedMs;
+        qs.eventCount++;
+        qs.totalWaitMs += waitMs;
+        if (waitMs > qs.maxWaitMs) {
+            qs.maxWaitMs = waitMs > 0xFFFF ? 0xFFFF : waitMs;
+        }
+
+        // Find or add the handler, the ones that don't fit aren't tracked
+        for (int i = 0; i < SCHED_PROFILED_HANDLERS; ++i) {
+            auto& hs = handlerStats[i];
+            if (hs.handler == nullptr) {
+                hs.handler = evt.handler;
+            }
+            if (hs.handler == evt.handler) {
+                hs.count++;
+                if (elapsed > hs.maxCycles) {
+                    hs.maxCycles = elapsed;
+                }
+                int bucket = 0;
+                while (bucket < SCHED_RUNTIME_BUCKETS - 1 && (elapsed >> (10 + 4 * bucket)) != 0) {
+                    bucket++;
+                }
+                if (hs.runtimeHistogram[bucket] < 0xFFFF) {
+                    hs.runtimeHistogram[bucket]++;
+                }
+                break;
+            }
+        }
+    }
+#endif
+
     void init() {
         // Macro expansion calls APP_ERROR_CHECK automatically
         APP_SCHED_INIT(SCHED_MAX_EVENT_DATA_SIZE, SCHED_QUEUE_SIZE);
         NRF_LOG_INFO("Scheduler: %dB free", app_sched_queue_space_get() * SCHED_MAX_EVENT_DATA_SIZE);
     }
 
+    /// <summary>
+    /// Pops the oldest event of the given priority and runs it, returns false if there was none
+    /// </summary>
+    static bool runNext(Priority priority) {
+        auto& q = queues[priority];
+        Event evt;
+        bool ret = false;
+        CRITICAL_REGION_ENTER();
+        ret = q.count > 0;
+        if (ret) {
+            evt = q.events[q.head];
+            q.head = (q.head + 1) % q.capacity;
+            q.count--;
+        }
+        CRITICAL_REGION_EXIT();
+
+        if (ret) {
+            PROFILE_BEGIN(startCycles);
+            evt.handler(evt.size > 0 ? evt.data : nullptr, evt.size);
+#if PROFILER_ENABLED
+            recordRun(priority, evt, startCycles);
+#endif
+        }
+        return ret;
+    }
+
     void update() {
+        WakeReason reason = WakeReason_None;
+        if (runNext(Priority_Realtime)) {
+            reason = WakeReason_Realtime;
+            while (runNext(Priority_Realtime));
+        }
+        if (app_sched_queue_space_get() < SCHED_QUEUE_SIZE && reason == WakeReason_None) {
+            reason = WakeReason_System;
+        }
         app_sched_execute();
+        for (int p = Priority_Normal; p < Priority_Count; ++p) {
+            while (runNext((Priority)p)) {
+                if (reason == WakeReason_None) {
+                    reason = WakeReason_Queued;
+                }
+                // Sensor events that came in meanwhile go first
+                while (runNext(Priority_Realtime));
+            }
+        }
+        wakeReasonCounts[reason]++;
     }
 
-    bool push(const void* eventData, uint16_t size, app_sched_event_handler_t handler) {
+    static bool enqueue(const void* eventData, uint16_t size, app_sched_event_handler_t handler, Priority priority, bool coalesce) {
         ASSERT(size <= SCHED_MAX_EVENT_DATA_SIZE);
-        ret_code_t ret = app_sched_event_put((void*)eventData, size, handler);
-        if (ret != NRF_SUCCESS) {
-            NRF_LOG_ERROR("Scheduler push failed, error %s(0x%x)", NRF_LOG_ERROR_STRING_GET(ret), ret);
+        ASSERT(priority < Priority_Count);
+        auto& q = queues[priority];
+        bool ret = false;
+        CRITICAL_REGION_ENTER();
+        Event* evt = nullptr;
+        if (coalesce) {
+            for (int i = 0; i < q.count && evt == nullptr; ++i) {
+                auto& pending = q.events[(q.head + i) % q.capacity];
+                if (pending.handler == handler) {
+                    evt = &pending;
+                }
+            }
         }
-        return ret == NRF_SUCCESS;
+        if (evt == nullptr && q.count < q.capacity) {
+            evt = &q.events[(q.head + q.count) % q.capacity];
+            q.count++;
+#if PROFILER_ENABLED
+            evt->queuedMs = Timers::millis();
+            if (q.count > queueStats[priority].maxDepth) {
+                queueStats[priority].maxDepth = q.count;
+            }
+#endif
+        }
+        ret = evt != nullptr;
+        if (ret) {
+            evt->handler = handler;
+            evt->size = size;
+            if (size > 0) {
+                memcpy(evt->data, eventData, size);
+            }
+        } else {
+            q.overflowCount++;
+        }
+        CRITICAL_REGION_EXIT();
+
+        if (!ret) {
+            NRF_LOG_ERROR("Scheduler push failed, priority %d queue full", priority);
+        }
+        return ret;
+    }
+
+    bool push(const void* eventData, uint16_t size, app_sched_event_handler_t handler, Priority priority) {
+        return enqueue(eventData, size, handler, priority, false);
+    }
+
+    bool pushCoalesced(const void* eventData, uint16_t size, app_sched_event_handler_t handler, Priority priority) {
+        return enqueue(eventData, size, handler, priority, true);
+    }
+
+    uint32_t getOverflowCount(Priority priority) {
+        return queues[priority].overflowCount;
+    }
+
+    uint32_t getWakeReasonCount(WakeReason reason) {
+        return wakeReasonCounts[reason];
+    }
+
+    void resetWakeReasonCounts() {
+        memset(wakeReasonCounts, 0, sizeof(wakeReasonCounts));
+    }
+
+    const QueueStats& getQueueStats(Priority priority) {
+        return queueStats[priority];
+    }
+
+    const HandlerStats& getHandlerStats(int index) {
+        return handlerStats[index];
+    }
+
+    void resetStats() {
+        CRITICAL_REGION_ENTER();
+        memset(queueStats, 0, sizeof(queueStats));
+        memset(handlerStats, 0, sizeof(handlerStats));
+        CRITICAL_REGION_EXIT();
     }
 }
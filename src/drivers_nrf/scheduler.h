@@ -1,12 +1,69 @@
 #pragma once
 #include "app_scheduler.h"
+#include "profiler.h"
 
 namespace DriversNRF
 {
+    /// <summary>
+    /// Defers work from interrupt handlers to the main loop. Events are queued by priority,
+    /// SDK events (Bluetooth, app_timer) go through app_scheduler and run after the realtime ones.
+    /// </summary>
     namespace Scheduler
     {
+        enum Priority : uint8_t
+        {
+            Priority_Realtime = 0,  // Sensor events, e.g. accelerometer data
+            Priority_Normal,        // Default
+            Priority_Background,    // Notifications that can wait
+            Priority_Count
+        };
+
         void init();
         void update();
-        bool push(const void* eventData, uint16_t size, app_sched_event_handler_t handler);
+        bool push(const void* eventData, uint16_t size, app_sched_event_handler_t handler, Priority priority = Priority_Normal);
+
+        // Same as push, but if an event with this handler is already pending at that priority,
+        // its data is replaced instead of queuing another one
+        bool pushCoalesced(const void* eventData, uint16_t size, app_sched_event_handler_t handler, Priority priority = Priority_Normal);
+
+        // Number of events dropped because their queue was full
+        uint32_t getOverflowCount(Priority priority);
+
+        // Main loop passes, by the most urgent kind of event they ran
+        enum WakeReason : uint8_t
+        {
+            WakeReason_Realtime = 0,
+            WakeReason_System,      // SDK events: Bluetooth and app timers
+            WakeReason_Queued,      // Normal and background events
+            WakeReason_None,        // Nothing to run (e.g. SoftDevice internal events)
+            WakeReason_Count
+        };
+
+        uint32_t getWakeReasonCount(WakeReason reason);
+        void resetWakeReasonCounts();
+
+        // Queue occupancy and handler runtime, only recorded when the profiler is compiled in
+        struct QueueStats
+        {
+            uint32_t eventCount;
+            uint32_t totalWaitMs;   // Time between push and execution
+            uint16_t maxWaitMs;
+            uint8_t maxDepth;
+        };
+
+        #define SCHED_PROFILED_HANDLERS 4
+        #define SCHED_RUNTIME_BUCKETS 4 // Under 16us, 256us, 4ms and above (at 64MHz)
+
+        struct HandlerStats
+        {
+            app_sched_event_handler_t handler; // nullptr for an unused entry
+            uint32_t count;
+            uint32_t maxCycles;
+            uint16_t runtimeHistogram[SCHED_RUNTIME_BUCKETS];
+        };
+
+        const QueueStats& getQueueStats(Priority priority);
+        const HandlerStats& getHandlerStats(int index); // Up to SCHED_PROFILED_HANDLERS, in order of first use
+        void resetStats();
     }
 }
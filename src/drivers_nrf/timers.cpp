@@ -9,7 +9,12 @@
 #include "app_timer2_custom.h"
 
 
-#define MAX_DELAYED_CALLS 8
+// Delayed callbacks live in a fixed pool, a binary min-heap of pool indices orders them by
+// due time so adding and cancelling (by handle) don't shift the whole list
+#define MAX_DELAYED_CALLS 24
+
+// Periodic jobs started with startTimerAligned() expire on multiples of this, so they share wake ups
+#define TIMERS_WAKE_GRID_MS 50
 
 namespace DriversNRF::Timers
 {
@@ -18,14 +23,24 @@ namespace DriversNRF::Timers
 
     struct delayedCallbacksTimerInfo
     {
-        DelayedCallback callback;
+        DelayedCallback callback;   // nullptr when the entry is free
         void* param;
         int callbackTime;
+        uint32_t sequence;          // Callbacks due at the same time run in the order they were set
+        uint8_t heapIndex;
+        uint8_t generation;         // Changes when the entry is freed, so stale handles don't match
     };
+    static_assert(MAX_DELAYED_CALLS < 0xFF, "Delayed callback indices must fit in a byte");
 
     static delayedCallbacksTimerInfo delayedCallbacks[MAX_DELAYED_CALLS];
+    static uint8_t delayedCallbacksHeap[MAX_DELAYED_CALLS];
+    static uint8_t freeDelayedCallbacks[MAX_DELAYED_CALLS];
     static int delayedCallbacksCount;
+    static int freeDelayedCallbacksCount;
     static int delayedCallbackPauseRequestCount;
+    static uint32_t delayedCallbacksSequence = 0;
+    static bool delayedCallbacksTimerRunning = false;
+    static bool dispatchingDelayedCallbacks = false;
 
     void init() {
         ret_code_t err_code;
@@ -49,7 +64,13 @@ namespace DriversNRF::Timers
         // Create a timer that runs delayed callbacks (see setDelayedCallback)
         createTimer(&delayedCallbacksTimer, APP_TIMER_MODE_SINGLE_SHOT, delayedCallbacksTimerCallback);
         delayedCallbacksCount = 0;
+        for (int i = 0; i < MAX_DELAYED_CALLS; ++i) {
+            delayedCallbacks[i].callback = nullptr;
+            freeDelayedCallbacks[i] = MAX_DELAYED_CALLS - 1 - i;
+        }
+        freeDelayedCallbacksCount = MAX_DELAYED_CALLS;
         delayedCallbackPauseRequestCount = 0;
+        delayedCallbacksTimerRunning = false;
 
         #if NRF_LOG_ENABLED
         // Start RTC activity right away to logger timestamps dont stay at 0 (until first timer is started)
@@ -74,6 +95,22 @@ namespace DriversNRF::Timers
         APP_ERROR_CHECK(err_code);
     }
 
+    void startTimerAligned(app_timer_id_t timer_id, uint32_t timeout_ms, void * p_context) {
+        // Move the expiry to the nearest grid point, by at most half the grid
+        const uint32_t gridTicks = APP_TIMER_TICKS(TIMERS_WAKE_GRID_MS);
+        uint32_t ticks = APP_TIMER_TICKS(timeout_ms);
+        uint32_t offset = (uint32_t)((get_now() + ticks) % gridTicks);
+        if (offset < gridTicks / 2) {
+            if (ticks >= offset + APP_TIMER_MIN_TIMEOUT_TICKS) {
+                ticks -= offset;
+            }
+        } else {
+            ticks += gridTicks - offset;
+        }
+        ret_code_t err_code = app_timer_start(timer_id, ticks, p_context);
+        APP_ERROR_CHECK(err_code);
+    }
+
     void stopTimer(app_timer_id_t timer_id) {
         ret_code_t err_code = app_timer_stop(timer_id);
         APP_ERROR_CHECK(err_code);
@@ -101,110 +138,162 @@ namespace DriversNRF::Timers
         return APP_TIMER_MS(ticks);
     }
 
-    void delayedCallbacksTimerCallback(void* ignore) {
-        int time = millis();
-        do
-        {
-            auto cb = delayedCallbacks[0].callback;
-            auto p = delayedCallbacks[0].param;
-            if (delayedCallbacksCount > 1) {
-                // Shift items down
-                for (int i = 0; i < delayedCallbacksCount - 1; ++i) {
-                    delayedCallbacks[i] = delayedCallbacks[i+1];
-                }
-            }
-            delayedCallbacksCount--;
+    static bool isEarlier(int heapA, int heapB) {
+        const auto& a = delayedCallbacks[delayedCallbacksHeap[heapA]];
+        const auto& b = delayedCallbacks[delayedCallbacksHeap[heapB]];
+        int delta = a.callbackTime - b.callbackTime;
+        return delta < 0 || (delta == 0 && (int32_t)(a.sequence - b.sequence) < 0);
+    }
 
-            // Trigger the callback
-            cb(p);
-        }
-        while (delayedCallbacksCount > 0 && delayedCallbacks[0].callbackTime <= time);
+    static void swapHeapEntries(int heapA, int heapB) {
+        uint8_t tmp = delayedCallbacksHeap[heapA];
+        delayedCallbacksHeap[heapA] = delayedCallbacksHeap[heapB];
+        delayedCallbacksHeap[heapB] = tmp;
+        delayedCallbacks[delayedCallbacksHeap[heapA]].heapIndex = heapA;
+        delayedCallbacks[delayedCallbacksHeap[heapB]].heapIndex = heapB;
+    }
 
-        if (delayedCallbacksCount > 0) {
-            // Set the timer for the next call
-            startTimer(delayedCallbacksTimer, delayedCallbacks[0].callbackTime - time);
+    static void siftUp(int index) {
+        while (index > 0) {
+            int parent = (index - 1) / 2;
+            if (!isEarlier(index, parent)) {
+                break;
+            }
+            swapHeapEntries(index, parent);
+            index = parent;
         }
     }
 
-    bool setDelayedCallback(DelayedCallback callback, void* param, int periodMs) {
-        
-        bool ret = delayedCallbacksCount < MAX_DELAYED_CALLS;
-        int ms = millis();
-        if (ret) {
-            // Find where to insert this call
-            int insertIndex = 0;
-            int callbackTime = ms + periodMs;
-            while (insertIndex < delayedCallbacksCount && callbackTime > delayedCallbacks[insertIndex].callbackTime) {
-                insertIndex++;
+    static void siftDown(int index) {
+        while (true) {
+            int earliest = index;
+            int left = 2 * index + 1;
+            int right = left + 1;
+            if (left < delayedCallbacksCount && isEarlier(left, earliest)) {
+                earliest = left;
             }
-
-            // Shift all the elements after the new one to insert
-            if (delayedCallbacksCount >= 1) {
-                for (int i = delayedCallbacksCount - 1; i >= insertIndex; --i) {
-                    delayedCallbacks[i+1] = delayedCallbacks[i];
-                }
+            if (right < delayedCallbacksCount && isEarlier(right, earliest)) {
+                earliest = right;
             }
-            if (insertIndex == 0 && delayedCallbacksCount > 0) {
-                // Stop the current timer since the new callback is sooner
-                stopTimer(delayedCallbacksTimer);
+            if (earliest == index) {
+                break;
             }
+            swapHeapEntries(index, earliest);
+            index = earliest;
+        }
+    }
+
+    /// <summary>
+    /// Takes the callback at the given heap position out of the heap and returns its entry to the pool
+    /// </summary>
+    static void removeDelayedCallbackAt(int index) {
+        int entry = delayedCallbacksHeap[index];
+        delayedCallbacksCount--;
+        if (index < delayedCallbacksCount) {
+            delayedCallbacksHeap[index] = delayedCallbacksHeap[delayedCallbacksCount];
+            delayedCallbacks[delayedCallbacksHeap[index]].heapIndex = index;
+            siftDown(index);
+            siftUp(index);
+        }
+        auto& cb = delayedCallbacks[entry];
+        cb.callback = nullptr;
+        cb.generation++;
+        freeDelayedCallbacks[freeDelayedCallbacksCount++] = entry;
+    }
 
-            // Insert the new callback
-            auto& cb = delayedCallbacks[insertIndex];
-            cb.callback = callback;
-            cb.param = param;
-            cb.callbackTime = callbackTime;
-            delayedCallbacksCount++;
+    static const delayedCallbacksTimerInfo& earliestDelayedCallback() {
+        return delayedCallbacks[delayedCallbacksHeap[0]];
+    }
 
-            if (insertIndex == 0) {
-                // Start the timer
-                startTimer(delayedCallbacksTimer, periodMs);
-            }
+    /// <summary>
+    /// (Re)starts the timer for the earliest callback, unless paused or already running callbacks
+    /// </summary>
+    static void scheduleDelayedCallbacksTimer() {
+        if (delayedCallbacksTimerRunning) {
+            stopTimer(delayedCallbacksTimer);
+            delayedCallbacksTimerRunning = false;
+        }
+        if (delayedCallbacksCount > 0 && delayedCallbackPauseRequestCount == 0 && !dispatchingDelayedCallbacks) {
+            int delayMs = earliestDelayedCallback().callbackTime - millis();
+            startTimer(delayedCallbacksTimer, delayMs > 0 ? delayMs : 1);
+            delayedCallbacksTimerRunning = true;
         }
-        return ret;
     }
 
-    bool cancelDelayedCallback(DelayedCallback callback) { 
-        bool ret = false;
-        for (int i = 0; i < delayedCallbacksCount; ++i) {
-            if (delayedCallbacks[i].callback == callback) {
-                // Found the item to remove
-                if (i == 0) {
-                    stopTimer(delayedCallbacksTimer);
-                    if (delayedCallbacksCount > 1) {
-                        int nextMs = delayedCallbacks[1].callbackTime - delayedCallbacks[0].callbackTime;
-                        // Start the timer
-                        startTimer(delayedCallbacksTimer, nextMs);
-                    }
-                }
-                for (int j = i; j < delayedCallbacksCount - 1; ++j) {
-                    delayedCallbacks[j] = delayedCallbacks[j+1];
-                }
-                delayedCallbacksCount--;
-                ret = true;
+    void delayedCallbacksTimerCallback(void* ignore) {
+        delayedCallbacksTimerRunning = false;
+        dispatchingDelayedCallbacks = true;
+        int time = millis();
+        // The earliest callback is due, even if the time conversion rounded down a little
+        while (delayedCallbacksCount > 0) {
+            auto info = earliestDelayedCallback();
+            removeDelayedCallbackAt(0);
+
+            // Trigger the callback, it may set or cancel others
+            info.callback(info.param);
+
+            if (delayedCallbacksCount == 0 || earliestDelayedCallback().callbackTime - time > 0) {
                 break;
             }
         }
+        dispatchingDelayedCallbacks = false;
+
+        // Set the timer for the next call
+        scheduleDelayedCallbacksTimer();
+    }
+
+    DelayedCallbackHandle addDelayedCallback(DelayedCallback callback, void* param, int periodMs) {
+        if (freeDelayedCallbacksCount == 0) {
+            NRF_LOG_ERROR("Too many delayed callbacks");
+            return INVALID_DELAYED_CALLBACK_HANDLE;
+        }
+
+        int entry = freeDelayedCallbacks[--freeDelayedCallbacksCount];
+        auto& cb = delayedCallbacks[entry];
+        cb.callback = callback;
+        cb.param = param;
+        cb.callbackTime = millis() + periodMs;
+        cb.sequence = delayedCallbacksSequence++;
+        cb.heapIndex = delayedCallbacksCount;
+        delayedCallbacksHeap[delayedCallbacksCount] = entry;
+        siftUp(delayedCallbacksCount++);
+
+        if (cb.heapIndex == 0 || !delayedCallbacksTimerRunning) {
+            // The new callback is the earliest
+            scheduleDelayedCallbacksTimer();
+        }
+        return (DelayedCallbackHandle)((cb.generation << 8) | entry);
+    }
+
+    bool setDelayedCallback(DelayedCallback callback, void* param, int periodMs) {
+        return addDelayedCallback(callback, param, periodMs) != INVALID_DELAYED_CALLBACK_HANDLE;
+    }
+
+    bool cancelDelayedCallbackHandle(DelayedCallbackHandle handle) {
+        int entry = handle & 0xFF;
+        bool ret = entry < MAX_DELAYED_CALLS
+            && delayedCallbacks[entry].callback != nullptr
+            && delayedCallbacks[entry].generation == (handle >> 8);
+        if (ret) {
+            int index = delayedCallbacks[entry].heapIndex;
+            removeDelayedCallbackAt(index);
+            if (index == 0) {
+                scheduleDelayedCallbacksTimer();
+            }
+        }
         return ret;
     }
 
-    bool cancelDelayedCallback(DelayedCallback callback, void* param) { 
+    static bool cancelDelayedCallback(DelayedCallback callback, void* param, bool matchParam) {
         bool ret = false;
         for (int i = 0; i < delayedCallbacksCount; ++i) {
-            if (delayedCallbacks[i].callback == callback && delayedCallbacks[i].param == param) {
+            const auto& cb = delayedCallbacks[delayedCallbacksHeap[i]];
+            if (cb.callback == callback && (!matchParam || cb.param == param)) {
                 // Found the item to remove
+                removeDelayedCallbackAt(i);
                 if (i == 0) {
-                    stopTimer(delayedCallbacksTimer);
-                    if (delayedCallbacksCount > 1) {
-                        int nextMs = delayedCallbacks[1].callbackTime - delayedCallbacks[0].callbackTime;
-                        // Start the timer
-                        startTimer(delayedCallbacksTimer, nextMs);
-                    }
+                    scheduleDelayedCallbacksTimer();
                 }
-                for (int j = i; j < delayedCallbacksCount - 1; ++j) {
-                    delayedCallbacks[j] = delayedCallbacks[j+1];
-                }
-                delayedCallbacksCount--;
                 ret = true;
                 break;
             }
@@ -212,12 +301,21 @@ namespace DriversNRF::Timers
         return ret;
     }
 
+    bool cancelDelayedCallback(DelayedCallback callback) {
+        return cancelDelayedCallback(callback, nullptr, false);
+    }
+
+    bool cancelDelayedCallback(DelayedCallback callback, void* param) {
+        return cancelDelayedCallback(callback, param, true);
+    }
+
     void pauseDelayedCallbacks() {
         if (delayedCallbackPauseRequestCount == 0) {
             // Cancel current timer, if any
-            if (delayedCallbacksCount > 0) {
+            if (delayedCallbacksTimerRunning) {
                 NRF_LOG_DEBUG("Pausing delayed callbacks");
                 stopTimer(delayedCallbacksTimer);
+                delayedCallbacksTimerRunning = false;
             }
         }
         delayedCallbackPauseRequestCount++;
@@ -225,11 +323,13 @@ namespace DriversNRF::Timers
 
     void resumeDelayedCallbacks() {
         delayedCallbackPauseRequestCount--;
-        if (delayedCallbackPauseRequestCount == 0) {
-            // Resume current timer, if any
-            if (delayedCallbacksCount > 0 && delayedCallbacks[0].callbackTime < millis()) {
-                NRF_LOG_DEBUG("Resuming delayed callbacks");
-                delayedCallbacksTimerCallback(nullptr); 
+        if (delayedCallbackPauseRequestCount == 0 && delayedCallbacksCount > 0) {
+            NRF_LOG_DEBUG("Resuming delayed callbacks");
+            if (earliestDelayedCallback().callbackTime - millis() <= 0) {
+                // Overdue, run them now
+                delayedCallbacksTimerCallback(nullptr);
+            } else {
+                scheduleDelayedCallbacksTimer();
             }
         }
     }
@@ -11,6 +11,9 @@ namespace DriversNRF
         void init();
         void createTimer(app_timer_id_t const * p_timer_id, app_timer_mode_t mode, app_timer_timeout_handler_t timeout_handler);
         void startTimer(app_timer_id_t timer_id, uint32_t timeout_ms, void * p_context = nullptr);
+        // Same as startTimer but the timeout is rounded to a common grid, for periodic jobs
+        // whose exact period doesn't matter, so the CPU wakes up once for all of them
+        void startTimerAligned(app_timer_id_t timer_id, uint32_t timeout_ms, void * p_context = nullptr);
         void stopTimer(app_timer_id_t timer_id);
         void stopAll(void);
         void pause(void);
@@ -19,6 +22,13 @@ namespace DriversNRF
         int millis();
 
         typedef void (*DelayedCallback)(void* param);
+        typedef uint16_t DelayedCallbackHandle;
+        #define INVALID_DELAYED_CALLBACK_HANDLE 0xFFFF
+
+        // Returns a handle to cancel the callback with, or INVALID_DELAYED_CALLBACK_HANDLE if all the slots are taken
+        DelayedCallbackHandle addDelayedCallback(DelayedCallback callback, void* param, int periodMs);
+        bool cancelDelayedCallbackHandle(DelayedCallbackHandle handle);
+
         bool setDelayedCallback(DelayedCallback callback, void* param, int periodMs);
         bool cancelDelayedCallback(DelayedCallback callback, void* param);
         bool cancelDelayedCallback(DelayedCallback callback);
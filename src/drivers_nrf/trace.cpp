@@ -0,0 +1,186 @@
+#include "trace.h"
+#include "timers.h"
+#include "nrf_log.h"
+#include "app_util_platform.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bluetooth_stack.h"
+#include <stdarg.h>
+
+#define TRACE_BUFFER_WORDS 64
+#define TRACE_HEADER_WORDS 2        // Format address with the argument count in the top bits, then the time
+#define TRACE_ARG_COUNT_SHIFT 28
+#define TRACE_ADDRESS_MASK ((1 << TRACE_ARG_COUNT_SHIFT) - 1)
+
+using namespace Bluetooth;
+
+namespace DriversNRF::Trace
+{
+#if TRACE_ENABLED
+    // Ring buffer of whole entries, written from anywhere and read from the main loop
+    static uint32_t buffer[TRACE_BUFFER_WORDS];
+    static int head = 0;
+    static int count = 0;
+    static uint8_t droppedCount = 0;
+    static bool enabled = false;
+    static bool sendOverBluetooth = false;
+
+    void requestTraceLogHandler(const Message* msg);
+    void onConnectionEvent(void* param, bool connected);
+#endif
+
+    void init() {
+#if TRACE_ENABLED
+        // The UART log is only there in debug builds, in which case tracing is on from the start
+        enabled = NRF_LOG_ENABLED;
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestTraceLog, requestTraceLogHandler);
+        Stack::hook(onConnectionEvent, nullptr);
+        NRF_LOG_DEBUG("Trace init");
+#endif
+    }
+
+    void setEnabled(bool enable) {
+#if TRACE_ENABLED
+        enabled = enable;
+#endif
+    }
+
+    bool isEnabled() {
+#if TRACE_ENABLED
+        return enabled;
+#else
+        return false;
+#endif
+    }
+
+    void record(int argCount, const char* format, ...) {
+#if TRACE_ENABLED
+        if (!enabled) {
+            return;
+        }
+
+        uint32_t entry[TRACE_HEADER_WORDS + TRACE_MAX_ARGS];
+        argCount = MIN(argCount, TRACE_MAX_ARGS);
+        entry[0] = ((uint32_t)argCount << TRACE_ARG_COUNT_SHIFT) | ((uint32_t)(uintptr_t)format & TRACE_ADDRESS_MASK);
+        entry[1] = Timers::millis();
+        va_list args;
+        va_start(args, format);
+        for (int i = 0; i < argCount; ++i) {
+            entry[TRACE_HEADER_WORDS + i] = va_arg(args, uint32_t);
+        }
+        va_end(args);
+
+        const int size = TRACE_HEADER_WORDS + argCount;
+        CRITICAL_REGION_ENTER();
+        if (count + size <= TRACE_BUFFER_WORDS) {
+            for (int i = 0; i < size; ++i) {
+                buffer[(head + count + i) % TRACE_BUFFER_WORDS] = entry[i];
+            }
+            count += size;
+        } else if (droppedCount < 0xFF) {
+            droppedCount++;
+        }
+        CRITICAL_REGION_EXIT();
+#endif
+    }
+
+#if TRACE_ENABLED
+    static int entrySizeAt(int offset) {
+        return TRACE_HEADER_WORDS + (buffer[(head + offset) % TRACE_BUFFER_WORDS] >> TRACE_ARG_COUNT_SHIFT);
+    }
+
+    static void pop(int words) {
+        CRITICAL_REGION_ENTER();
+        head = (head + words) % TRACE_BUFFER_WORDS;
+        count -= words;
+        CRITICAL_REGION_EXIT();
+    }
+
+    /// <summary>
+    /// Sends as many whole entries as fit in a message, returns false if there was nothing to send
+    /// or the send queue is full
+    /// </summary>
+    static bool sendEntries() {
+        MessageTraceLog msg;
+        int words = 0;
+        while (words < count && words + entrySizeAt(words) <= (int)(sizeof(msg.words) / sizeof(msg.words[0]))) {
+            const int size = entrySizeAt(words);
+            for (int i = 0; i < size; ++i) {
+                msg.words[words + i] = buffer[(head + words + i) % TRACE_BUFFER_WORDS];
+            }
+            words += size;
+        }
+
+        bool ret = words > 0;
+        if (ret) {
+            msg.droppedCount = droppedCount;
+            msg.wordCount = words;
+            ret = MessageService::SendMessage(&msg, offsetof(MessageTraceLog, words) + words * sizeof(uint32_t));
+            if (ret) {
+                pop(words);
+                droppedCount = 0;
+            }
+        }
+        return ret;
+    }
+
+    static void logEntry() {
+        uint32_t entry[TRACE_HEADER_WORDS + TRACE_MAX_ARGS];
+        const int size = entrySizeAt(0);
+        for (int i = 0; i < size; ++i) {
+            entry[i] = buffer[(head + i) % TRACE_BUFFER_WORDS];
+        }
+        pop(size);
+
+        // Format strings come from flash, the top bits of the address were used for the count
+        const char* format = (const char*)(uintptr_t)(entry[0] & TRACE_ADDRESS_MASK);
+        const uint32_t* args = entry + TRACE_HEADER_WORDS;
+#if NRF_LOG_ENABLED
+        switch (size - TRACE_HEADER_WORDS) {
+            case 0: NRF_LOG_INFO(format); break;
+            case 1: NRF_LOG_INFO(format, args[0]); break;
+            case 2: NRF_LOG_INFO(format, args[0], args[1]); break;
+            case 3: NRF_LOG_INFO(format, args[0], args[1], args[2]); break;
+            case 4: NRF_LOG_INFO(format, args[0], args[1], args[2], args[3]); break;
+            case 5: NRF_LOG_INFO(format, args[0], args[1], args[2], args[3], args[4]); break;
+            default: NRF_LOG_INFO(format, args[0], args[1], args[2], args[3], args[4], args[5]); break;
+        }
+#else
+        (void)format;
+        (void)args;
+#endif
+    }
+#endif
+
+    void process() {
+#if TRACE_ENABLED
+        if (sendOverBluetooth) {
+            while (sendEntries());
+        } else {
+            while (count > 0) {
+                logEntry();
+            }
+            if (droppedCount > 0) {
+                NRF_LOG_WARNING("%d trace entries dropped", droppedCount);
+                droppedCount = 0;
+            }
+        }
+#endif
+    }
+
+#if TRACE_ENABLED
+    void requestTraceLogHandler(const Message* msg) {
+        auto req = (const MessageRequestTraceLog*)msg;
+        sendOverBluetooth = req->enable != 0;
+        enabled = sendOverBluetooth || NRF_LOG_ENABLED;
+        NRF_LOG_INFO("Trace over Bluetooth %s", sendOverBluetooth ? "on" : "off");
+    }
+
+    void onConnectionEvent(void* param, bool connected) {
+        if (!connected && sendOverBluetooth) {
+            sendOverBluetooth = false;
+            enabled = NRF_LOG_ENABLED;
+        }
+    }
+#endif
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include "app_util.h"
+
+#define TRACE_ENABLED 1
+
+namespace DriversNRF
+{
+    /// <summary>
+    /// Binary trace log, cheap enough to leave in hot paths and interrupt handlers.
+    /// Only the format string address and the raw arguments are stored, in a ring buffer that is
+    /// drained from the main loop. Over Bluetooth the entries are sent as is and the host looks up
+    /// the format strings in the firmware ELF, otherwise they are formatted to the UART log.
+    /// </summary>
+    namespace Trace
+    {
+        #define TRACE_MAX_ARGS 6
+
+        void init();
+        void process();
+
+        void setEnabled(bool enabled);
+        bool isEnabled();
+
+        // Use TRACE_LOG() rather than calling this directly
+        void record(int argCount, const char* format, ...);
+    }
+}
+
+#if TRACE_ENABLED
+    #define TRACE_LOG(...) DriversNRF::Trace::record(NUM_VA_ARGS_LESS_1(__VA_ARGS__), __VA_ARGS__)
+#else
+    #define TRACE_LOG(...) ;
+#endif
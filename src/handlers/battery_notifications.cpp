@@ -1,6 +1,7 @@
 #include "battery_notifications.h"
 #include "bluetooth/bluetooth_messages.h"
 #include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/state_characteristics.h"
 #include "modules/battery_controller.h"
 #include "nrf_log.h"
 
@@ -10,18 +11,20 @@ using namespace Modules;
 namespace Handlers::BatteryNotifications
 {
     void requestBatteryLevelHandler(const Message *message);
-    void onBatteryStateChange(void *token, BatteryController::BatteryState newState);
-    void onBatteryLevelChange(void *param, uint8_t levelPercent);
+    void updateCharacteristic();
 
     void init() {
         // We always send battery events over Bluetooth when connected
         MessageService::RegisterMessageHandler(Message::MessageType_RequestBatteryLevel, requestBatteryLevelHandler);
-        BatteryController::hookBatteryState(onBatteryStateChange, nullptr);
-        BatteryController::hookLevel(onBatteryLevelChange, nullptr);
+        updateCharacteristic();
 
         NRF_LOG_DEBUG("Battery notifications init");
     }
 
+    void updateCharacteristic() {
+        StateCharacteristics::setBattery(BatteryController::getLevelPercent(), BatteryController::getBatteryState());
+    }
+
     void sendBatteryLevel() {
         if (MessageService::isConnected()) {
             const auto level = BatteryController::getLevelPercent();
@@ -42,10 +45,12 @@ namespace Handlers::BatteryNotifications
     }
 
     void onBatteryLevelChange(void *param, uint8_t levelPercent) {
+        updateCharacteristic();
         sendBatteryLevel();
     }
 
     void onBatteryStateChange(void* token, BatteryController::BatteryState newState) {
+        updateCharacteristic();
         sendBatteryLevel();
     }
 }
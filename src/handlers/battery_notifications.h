@@ -1,4 +1,10 @@
+#include "modules/battery_controller.h"
+
 namespace Handlers::BatteryNotifications
 {
     void init();
+
+    // Called by the battery controller, see config/static_subscribers.h
+    void onBatteryStateChange(void *token, Modules::BatteryController::BatteryState newState);
+    void onBatteryLevelChange(void *param, uint8_t levelPercent);
 }
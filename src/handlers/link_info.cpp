@@ -0,0 +1,61 @@
+#include "link_info.h"
+#include "bluetooth/bluetooth_stack.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "nrf_log.h"
+
+using namespace Bluetooth;
+
+namespace Handlers::LinkInfo
+{
+    static bool sendUpdates = false;
+
+    void requestLinkInfoHandler(const Message* msg);
+    void onConnectionEvent(void* param, bool connected);
+    void onLinkInfo(void* param, const Stack::LinkInfo& info);
+
+    void init() {
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestLinkInfo, requestLinkInfoHandler);
+
+        NRF_LOG_DEBUG("Link info init");
+    }
+
+    void sendLinkInfo(const Stack::LinkInfo& info) {
+        if (MessageService::isConnected()) {
+            MessageLinkInfo retMsg;
+            retMsg.attMtu = info.attMtu;
+            retMsg.dataLengthTx = info.dataLengthTx;
+            retMsg.dataLengthRx = info.dataLengthRx;
+            retMsg.txPhy = info.txPhy;
+            retMsg.rxPhy = info.rxPhy;
+            retMsg.connectionInterval = info.connectionInterval;
+            retMsg.slaveLatency = info.slaveLatency;
+            retMsg.supervisionTimeout = info.supervisionTimeout;
+            MessageService::SendMessage(&retMsg);
+        }
+    }
+
+    void requestLinkInfoHandler(const Message* msg) {
+        NRF_LOG_INFO("Received link info request");
+        sendLinkInfo(Stack::getLinkInfo());
+
+        // Keep the central posted on later changes until it disconnects
+        if (!sendUpdates) {
+            sendUpdates = true;
+            Stack::hookLinkInfo(onLinkInfo, nullptr);
+            Stack::hook(onConnectionEvent, nullptr);
+        }
+    }
+
+    void onConnectionEvent(void* param, bool connected) {
+        if (!connected && sendUpdates) {
+            sendUpdates = false;
+            Stack::unHookLinkInfo(onLinkInfo);
+            Stack::unHook(onConnectionEvent);
+        }
+    }
+
+    void onLinkInfo(void* param, const Stack::LinkInfo& info) {
+        sendLinkInfo(info);
+    }
+}
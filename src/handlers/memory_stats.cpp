@@ -0,0 +1,73 @@
+#include "memory_stats.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "nrf.h"
+#include "utils/heap.h"
+#include "nrf_log.h"
+
+#define STACK_PAINT_PATTERN 0x5AC5AC5A
+#define STACK_PAINT_MARGIN 64   // Bytes left untouched below the current stack pointer when painting
+
+// From the linker script
+extern uint32_t __StackLimit;
+extern uint32_t __StackTop;
+
+using namespace Bluetooth;
+using namespace Utils;
+
+namespace Handlers::MemoryStats
+{
+    void requestMemoryStatsHandler(const Message* msg);
+
+    /// <summary>
+    /// Fills the unused part of the stack with a known pattern, so the deepest use can be found later
+    /// </summary>
+    void paintStack() {
+        uint32_t* end = (uint32_t*)(__get_MSP() - STACK_PAINT_MARGIN);
+        for (uint32_t* p = &__StackLimit; p < end; ++p) {
+            *p = STACK_PAINT_PATTERN;
+        }
+    }
+
+    /// <summary>
+    /// Returns the most stack ever used since it was painted, in bytes
+    /// </summary>
+    uint32_t stackPeakUsage() {
+        const uint32_t* p = &__StackLimit;
+        while (p < &__StackTop && *p == STACK_PAINT_PATTERN) {
+            ++p;
+        }
+        return (uint32_t)&__StackTop - (uint32_t)p;
+    }
+
+    void init() {
+        paintStack();
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestMemoryStats, requestMemoryStatsHandler);
+
+        NRF_LOG_DEBUG("Memory stats init");
+    }
+
+    void requestMemoryStatsHandler(const Message* msg) {
+        NRF_LOG_INFO("Received memory stats request");
+        Heap::Stats heap;
+        Heap::getStats(heap);
+
+        MessageMemoryStats retMsg;
+        retMsg.stackSize = (uint32_t)&__StackTop - (uint32_t)&__StackLimit;
+        retMsg.stackPeak = stackPeakUsage();
+        retMsg.heapSize = heap.size;
+        retMsg.heapUsed = heap.used;
+        retMsg.heapPeak = heap.peak;
+        retMsg.heapFree = heap.size - heap.used;
+        retMsg.heapLargestFree = heap.largestFree;
+        retMsg.heapFreeBlocks = heap.freeBlocks;
+        retMsg.heapAllocFailures = heap.allocFailures;
+        for (int i = 0; i < Heap::HeapTag_Count; ++i) {
+            const auto& tag = Heap::getTagStats((Heap::HeapTag)i);
+            retMsg.heapTags[i].used = tag.used;
+            retMsg.heapTags[i].peak = tag.peak;
+            retMsg.heapTags[i].allocCount = tag.allocCount;
+        }
+        MessageService::SendMessage(&retMsg);
+    }
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+namespace Handlers::MemoryStats
+{
+    void init();
+}
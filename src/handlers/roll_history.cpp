@@ -0,0 +1,86 @@
+#include "roll_history.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bulk_data_transfer.h"
+#include "config/roll_log.h"
+#include "drivers_nrf/flash.h"
+#include "modules/accelerometer.h"
+#include "modules/roll_stats.h"
+#include "nrf_log.h"
+
+using namespace Bluetooth;
+using namespace Modules;
+using namespace Config;
+using namespace DriversNRF;
+
+namespace Handlers::RollHistory
+{
+    void requestRollLogHandler(const Message *message);
+    void onAccelFrame(void *token, const Accelerometer::AccelFrame &frame);
+
+    // Roll being recorded
+    static bool rolling = false;
+    static uint32_t rollStartMs = 0;
+    static int peakAgitationTimes1000 = 0;
+
+    void init() {
+        RollLog::init();
+        RollStats::init();
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestRollLog, requestRollLogHandler);
+        Accelerometer::hookFrameData(onAccelFrame, nullptr);
+
+        NRF_LOG_DEBUG("Roll history init");
+    }
+
+    void onAccelFrame(void *token, const Accelerometer::AccelFrame &frame) {
+        if (frame.determinedRollState == Accelerometer::RollState_Rolling) {
+            if (!rolling) {
+                rolling = true;
+                rollStartMs = frame.time;
+                peakAgitationTimes1000 = 0;
+            }
+            if (frame.agitationTimes1000 > peakAgitationTimes1000) {
+                peakAgitationTimes1000 = frame.agitationTimes1000;
+            }
+        } else if (rolling) {
+            // Only log rolls that ended on a face or crooked, not the die being picked up
+            rolling = false;
+            uint32_t durationMs = frame.time - rollStartMs;
+            if (frame.determinedRollState == Accelerometer::RollState_Rolled) {
+                RollLog::appendRoll(frame.face, durationMs, peakAgitationTimes1000);
+                RollStats::addRoll(frame.face, durationMs);
+            } else if (frame.determinedRollState == Accelerometer::RollState_Crooked) {
+                RollLog::appendRoll(ROLL_LOG_CROOKED_FACE, durationMs, peakAgitationTimes1000);
+                RollStats::addCrooked(durationMs);
+            }
+        }
+    }
+
+    void requestRollLogHandler(const Message* message) {
+        auto req = static_cast<const MessageRequestRollLog*>(message);
+        NRF_LOG_DEBUG("Received Roll Log Request, clear = %d", req->clear);
+        if (req->clear) {
+            // The stats go along with the log, so they're only reset if it was cleared
+            MessageRollLogCleared clearedMsg;
+            clearedMsg.result = RollLog::clear() ? 1 : 0;
+            if (clearedMsg.result) {
+                RollStats::reset();
+            }
+            MessageService::SendMessage(&clearedMsg);
+            return;
+        }
+
+        MessageRollLog infoMsg;
+        infoMsg.recordCount = RollLog::getRecordCount();
+        infoMsg.pageSize = (uint16_t)Flash::getPageSize();
+        infoMsg.pageCount = (uint8_t)Flash::getRollLogPageCount();
+        MessageService::SendMessage(&infoMsg);
+
+        // Send the pages straight from flash, hold new records back meanwhile
+        RollLog::pause();
+        SendBulkData::send(RollLog::getData(), (uint16_t)RollLog::getByteSize(), nullptr, [](void* context, bool result, const uint8_t* data, uint16_t size) {
+            NRF_LOG_INFO("Roll log sent: %d", result);
+            RollLog::resume();
+        });
+    }
+}
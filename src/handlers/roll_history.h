@@ -0,0 +1,4 @@
+namespace Handlers::RollHistory
+{
+    void init();
+}
@@ -1,6 +1,7 @@
 #include "roll_notifications.h"
 #include "bluetooth/bluetooth_messages.h"
 #include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/state_characteristics.h"
 #include "modules/accelerometer.h"
 #include "nrf_log.h"
 
@@ -10,12 +11,16 @@ using namespace Modules;
 namespace Handlers::RollNotifications
 {
     void requestRollStateHandler(const Message *message);
-    void onRollStateChange(void *token, Accelerometer::RollState prevRollState, int prevFace, Accelerometer::RollState newRollState, int newFace);
+    void onLikelyFace(void *token, int face, int confidenceTimes1000);
+
+    // Roll state last handed to the priority slot
+    static Accelerometer::RollState priorityRollState = Accelerometer::RollState_Unknown;
 
     void init() {
         // We always send roll events over Bluetooth when connected
         MessageService::RegisterMessageHandler(Message::MessageType_RequestRollState, requestRollStateHandler);
-        Accelerometer::hookRollState(onRollStateChange, nullptr);
+        Accelerometer::hookLikelyFace(onLikelyFace, nullptr);
+        StateCharacteristics::setRollState(Accelerometer::currentRollState(), Accelerometer::currentFace());
 
         NRF_LOG_DEBUG("Roll notifications init");
     }
@@ -26,7 +31,15 @@ namespace Handlers::RollNotifications
             MessageRollState rollStateMsg;
             rollStateMsg.state = (uint8_t)rollState;
             rollStateMsg.face = (uint8_t)face;
-            MessageService::SendMessage(&rollStateMsg);
+            if (MessageService::hasPendingPriorityMessage() &&
+                (priorityRollState == Accelerometer::RollState_Rolled || priorityRollState == Accelerometer::RollState_Crooked)) {
+                // Don't replace a roll result that is still waiting, queue this one after it
+                MessageService::SendMessage(&rollStateMsg);
+            } else {
+                // Goes out in the next connection event, whatever else is being sent
+                priorityRollState = rollState;
+                MessageService::SendPriorityMessage(&rollStateMsg);
+            }
         } else {
             NRF_LOG_DEBUG("Disconnected, skipped sending roll state message");
         }
@@ -38,6 +51,16 @@ namespace Handlers::RollNotifications
     }
 
     void onRollStateChange(void *token, Accelerometer::RollState prevRollState, int prevFace, Accelerometer::RollState newRollState, int newFace) {
+        StateCharacteristics::setRollState(newRollState, newFace);
         sendRollState(newRollState, newFace);
     }
+
+    void onLikelyFace(void *token, int face, int confidenceTimes1000) {
+        if (MessageService::isConnected()) {
+            MessageLikelyFace likelyFaceMsg;
+            likelyFaceMsg.face = (uint8_t)face;
+            likelyFaceMsg.confidenceTimes1000 = (int16_t)confidenceTimes1000;
+            MessageService::SendMessage(&likelyFaceMsg);
+        }
+    }
 }
@@ -1,4 +1,9 @@
+#include "modules/accelerometer.h"
+
 namespace Handlers::RollNotifications
 {
     void init();
+
+    // Called by the accelerometer for every roll state change, see config/static_subscribers.h
+    void onRollStateChange(void *token, Modules::Accelerometer::RollState prevRollState, int prevFace, Modules::Accelerometer::RollState newRollState, int newFace);
 }
@@ -14,12 +14,14 @@ namespace Handlers::RssiNotifications
     static uint32_t minIntervalMs = 0;
 
     void getRssiHandler(const Message *msg);
+    void setRssiFilterHandler(const Message *msg);
     void stop();
     void onRssi(void *token, int8_t rssi, uint8_t channelIndex);
 
     void init() {
         // We send RSSI over Bluetooth when requested and connected
         Bluetooth::MessageService::RegisterMessageHandler(Bluetooth::Message::MessageType_RequestRssi, getRssiHandler);
+        Bluetooth::MessageService::RegisterMessageHandler(Bluetooth::Message::MessageType_SetRssiFilter, setRssiFilterHandler);
 
         NRF_LOG_DEBUG("RSSI notifications init");
     }
@@ -54,6 +56,12 @@ namespace Handlers::RssiNotifications
         }
     }
 
+    void setRssiFilterHandler(const Message* msg) {
+        auto filterMsg = static_cast<const MessageSetRssiFilter *>(msg);
+        NRF_LOG_INFO("Received RSSI filter, threshold = %d dBm, interval = %d ms", filterMsg->thresholdDbm, filterMsg->minInterval);
+        Stack::setRssiFilter(filterMsg->thresholdDbm, filterMsg->minInterval);
+    }
+
     void stop() {
         if (requestMode != TelemetryRequestMode_Off) {
             NRF_LOG_INFO("Stopping sending RSSI");
@@ -23,16 +23,20 @@ namespace Handlers::SetLEDColor
 {
     void SetLEDToColorHandler(const Message* msg);
     void SetAllLEDsToColorHandler(const Message* msg);
+    void SetLEDColorsHandler(const Message* msg);
     void LightUpFaceHandler(const Message* msg);
     void BlinkLEDsHandler(const Message *msg);
     void BlinkIdHandler(const Message *msg);
+    void BlinkSlotHandler(const Message *msg);
 
     void init() {
         MessageService::RegisterMessageHandler(Message::MessageType_SetLEDToColor, SetLEDToColorHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_SetAllLEDsToColor, SetAllLEDsToColorHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_SetLEDColors, SetLEDColorsHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_LightUpFace, LightUpFaceHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_Blink, BlinkLEDsHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_BlinkId, BlinkIdHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_BlinkSlot, BlinkSlotHandler);
         NRF_LOG_DEBUG("LED Color tester init");
     }
 
@@ -57,6 +61,28 @@ namespace Handlers::SetLEDColor
         LEDs::setAll(color);
     }
 
+    void SetLEDColorsHandler(const Message* msg) {
+        auto colorsMsg = (const MessageSetLEDColors*)msg;
+        NRF_LOG_INFO("Setting LEDs %08x", colorsMsg->ledMask);
+        const int ledCount = MIN(__builtin_popcount(colorsMsg->ledMask), MAX_LED_COUNT);
+        if (MessageService::getReceivedMessageSize() < offsetof(MessageSetLEDColors, colors) + ledCount * 3) {
+            NRF_LOG_WARNING("Not enough colors for %d LEDs", ledCount);
+            return;
+        }
+
+        // Gather all the colors so the LEDs are refreshed only once
+        int indices[MAX_LED_COUNT];
+        uint32_t colors[MAX_LED_COUNT];
+        int count = 0;
+        for (uint32_t remaining = colorsMsg->ledMask; remaining != 0 && count < MAX_LED_COUNT; remaining &= remaining - 1) {
+            const uint8_t* rgb = &colorsMsg->colors[count * 3];
+            indices[count] = Utils::lowestBitIndex(remaining);
+            colors[count] = Utils::toColor(rgb[0], rgb[1], rgb[2]);
+            ++count;
+        }
+        LEDs::setPixelColors(indices, colors, count);
+    }
+
     void LightUpFaceHandler(const Message* msg) {
         // The transformation is:
         // animFaceIndex
@@ -106,6 +132,7 @@ namespace Handlers::SetLEDColor
         static AnimationBlinkId blinkId;
         blinkId.type = Animation_BlinkId;
         blinkId.framesPerBlink = 3; // 3 animation frames per blink
+        blinkId.slotBitsCount = 0;
         blinkId.setDuration(1000);
         blinkId.brightness = message->brightness;
 
@@ -117,4 +144,28 @@ namespace Handlers::SetLEDColor
         MessageService::SendMessage(Message::MessageType_BlinkIdAck);
     }
 
+    void BlinkSlotHandler(const Message* msg)
+    {
+        auto *message = (const MessageBlinkSlot *)msg;
+        NRF_LOG_DEBUG("Received request to blink slot %d (%d bits) at %d", message->slot, message->slotBitsCount, message->globalStartTime);
+
+        // The code is short, so the preamble only needs to be long enough to spot the dice
+        // Note: we keep the data in a static variable so it stays valid after this call returns
+        static AnimationBlinkId blinkSlot;
+        blinkSlot.type = Animation_BlinkId;
+        blinkSlot.framesPerBlink = 3;
+        blinkSlot.slotBitsCount = MAX(message->slotBitsCount, 1);
+        blinkSlot.slot = message->slot;
+        blinkSlot.setDuration(500);
+        blinkSlot.brightness = message->brightness;
+
+        Modules::AnimController::stop(&blinkSlot);
+        Modules::AnimController::playAtGlobalTime(&blinkSlot, nullptr, message->globalStartTime);
+
+        MessageBlinkSlotAck ackMsg;
+        ackMsg.durationMs = blinkSlot.duration;
+        ackMsg.timeSynced = AnimController::isTimeSynced() ? 1 : 0;
+        MessageService::SendMessage(&ackMsg);
+    }
+
 }
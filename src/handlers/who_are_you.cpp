@@ -1,10 +1,14 @@
 #include "who_are_you.h"
 #include "bluetooth/bluetooth_messages.h"
 #include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/bluetooth_stack.h"
 #include "drivers_nrf/flash.h"
 #include "nrf_log.h"
 #include "config/settings.h"
 #include "data_set/data_set.h"
+#include "bluetooth/bulk_data_transfer.h"
+#include "modules/instant_anim_controller.h"
+#include "modules/temperature.h"
 
 using namespace Bluetooth;
 using namespace Modules;
@@ -52,8 +56,24 @@ namespace Handlers::WhoAreYou
         msg.statusInfo.batteryState = BatteryController::getBatteryState();
         msg.statusInfo.rollState = Accelerometer::currentRollState();
         msg.statusInfo.rollFace = Accelerometer::currentFace();
+
+        // Capabilities
+        msg.capabilitiesInfo.capabilities =
+            Capabilities_WindowedBulkData | Capabilities_CompressedBulkData | Capabilities_MessageBatching |
+            Capabilities_LinkInfo | Capabilities_TransferTest | Capabilities_BroadcastMode |
+            Capabilities_SharedTrackData;
+        msg.capabilitiesInfo.bulkDataReceiveWindow = BULK_DATA_RECEIVE_WINDOW;
+        msg.capabilitiesInfo.instantAnimationsMaxSize = InstantAnimationController::getMaxDataSize();
+
+        // Sensors, saves the central a RequestTemperature round trip
+        msg.sensorInfo.mcuTempTimes100 = Temperature::getMCUTemperatureTimes100();
+        msg.sensorInfo.batteryTempTimes100 = Temperature::getNTCTemperatureTimes100();
+        msg.sensorInfo.batteryVoltageMilli = BatteryController::getVoltageMilli();
 #endif
         MessageService::SendMessage(&msg);
+
+        // The central is done setting up the connection
+        Stack::releaseFastConnection(Stack::ConnectionUser_Connecting);
     }
 
     void init() {
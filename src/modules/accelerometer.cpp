@@ -3,9 +3,11 @@
 #include "drivers_hw/accel_chip.h"
 #include "utils/int3_utils.h"
 #include "core/ring_buffer.h"
+#include "core/ram_function.h"
 #include "config/board_config.h"
 #include "config/settings.h"
 #include "config/dice_variants.h"
+#include "config/static_subscribers.h"
 #include "app_error.h"
 #include "app_error_weak.h"
 #include "nrf_log.h"
@@ -18,9 +20,10 @@
 #include "drivers_nrf/timers.h"
 #include "drivers_nrf/flash.h"
 #include "drivers_nrf/scheduler.h"
+#include "drivers_nrf/profiler.h"
 #include "leds.h"
 #include "validation_manager.h"
-#include "malloc.h"
+#include "utils/heap.h"
 
 
 using namespace Modules;
@@ -31,19 +34,117 @@ using namespace Config;
 using namespace Bluetooth;
 
 // This defines how frequently we try to read the accelerometer
-#define MAX_FRAMEDATA_CLIENTS 1
+#define MAX_FRAMEDATA_CLIENTS 2
 #define MAX_ACC_CLIENTS 8
+#define MAX_LIKELY_FACE_CLIENTS 2
+// Depth of the acceleration history used to determine the roll state
 #define MAX_ACCELERATION_FRAMES 3
 
 #define ABS(x) ((x) < 0 ? -(x) : (x))
 
+// The roll detection thresholds are tuned for the low sample rate (6.25Hz),
+// agitation measured at a higher rate is scaled back to that period
+#define ACCEL_REFERENCE_PERIOD_MS 160
+// How long the die must stay still before going back to the low sample rate
+#define ACCEL_LOW_RATE_DELAY_MS 1500
+
+// Resolution of the directions sampled over each octant when building the face lookup table
+#define FACE_LOOKUP_GRID_STEPS 8
+
+// Minimum confidence for a face to be reported as likely before the end of the roll
+#define ROLL_PREDICTION_MIN_CONFIDENCE_TIMES1000 950
+
+// Adaptive thresholds: the noise floor is averaged over about 2^ADAPT_NOISE_SHIFT samples of the die
+// sitting on a face, and the thresholds are updated every ADAPT_UPDATE_SAMPLES samples
+#define ADAPT_NOISE_SHIFT 4
+#define ADAPT_UPDATE_SAMPLES 16
+// The learned lower threshold is the noise floor + this many times its mean deviation
+#define ADAPT_DEVIATION_MULT 4
+// The learned thresholds stay between these ratios (times 1000) of the programmed ones
+#define ADAPT_MIN_SCALE_TIMES1000 500
+#define ADAPT_MAX_SCALE_TIMES1000 2000
+
+// Face calibration averages this many readings of the die sitting still, taken at the high sample rate
+#define CALIBRATION_SAMPLE_COUNT 16
+// And gives up if it doesn't get them within this many frames
+#define CALIBRATION_MAX_FRAMES 64
+
+// Set to 1 to also learn the face normals in the background, off by default so the normals only
+// change through explicit calibration. When on, once the die has rested on a face for a while with
+// good confidence, its reading is folded into a running estimate of the face normal, with a weight
+// of 1 / 2^AUTO_CALIBRATION_SHIFT
+#define AUTO_CALIBRATION 0
+#define AUTO_CALIBRATION_REST_MS 3000
+#define AUTO_CALIBRATION_MIN_CONFIDENCE_TIMES1000 985
+#define AUTO_CALIBRATION_SHIFT 3
+// The estimates are programmed every so many readings, if a face has moved far enough,
+// and no more often than every AUTO_CALIBRATION_PERSIST_INTERVAL_MS to spare the flash
+#define AUTO_CALIBRATION_PERSIST_READINGS 32
+#define AUTO_CALIBRATION_PERSIST_MAX_DOT_TIMES1000 998
+#define AUTO_CALIBRATION_PERSIST_INTERVAL_MS (60 * 60 * 1000)
+
 namespace Modules::Accelerometer
 {
-    // This stores a few frames of acceleration data
-    static AccelFrame frames[MAX_ACCELERATION_FRAMES];
+    // This stores a few frames of acceleration data, newest is last()
+    static RingBuffer<AccelFrame, MAX_ACCELERATION_FRAMES> frames;
+
+    // Running counts of the estimated roll states (and agitated frames) in the history,
+    // updated as frames are added and evicted so the history depth doesn't cost anything per sample
+    static int onFaceCount = 0;
+    static int handlingCount = 0;
+    static int rollingCount = 0;
+    static int agitationCount = 0;
 
     static DelegateArray<FrameDataClientMethod, MAX_FRAMEDATA_CLIENTS> frameDataClients;
     static DelegateArray<RollStateClientMethod, MAX_ACC_CLIENTS> rollStateClients;
+    static DelegateArray<LikelyFaceClientMethod, MAX_LIKELY_FACE_CLIENTS> likelyFaceClients;
+
+    // Whether the likely face was already sent for the current roll
+    static bool likelyFaceNotified = false;
+
+    // Time since which the die has been still, used to switch back to the low sample rate
+    static uint32_t stillSinceMs = 0;
+    static uint16_t lowRateDelayMs = ACCEL_LOW_RATE_DELAY_MS;
+
+    // While streaming raw data the sample rate stays at the stream rate
+    static bool streaming = false;
+
+    // Roll detection thresholds in use, either the programmed ones or learned from the noise floor
+    static int lowerThresholdTimes1000 = 0;
+    static int middleThresholdTimes1000 = 0;
+    static int upperThresholdTimes1000 = 0;
+
+    static bool adaptiveThresholds = false;
+    static int noiseMeanTimes1000Scaled = 0;        // Shifted left by ADAPT_NOISE_SHIFT
+    static int noiseDeviationTimes1000Scaled = 0;   // Shifted left by ADAPT_NOISE_SHIFT
+    static int noiseSampleCount = 0;
+
+    // Averaged reading being taken for face calibration, active while the callback is set
+    typedef void (*FaceSampleCallback)(bool success, const int3& normal);
+    static FaceSampleCallback faceSampleCallback = nullptr;
+    static int32_t faceSampleSum[3];
+    static int faceSampleCount = 0;
+    static int faceSampleFrames = 0;
+    static bool faceSampleDone = false;  // Waiting for the callback to be called from the main loop
+
+    // Face normals measured during a calibration session, programmed together when it's committed
+    static int3* sessionNormals = nullptr;
+    static uint32_t sessionFacesMask = 0;
+
+#if AUTO_CALIBRATION
+    // Running estimates of the face normals, shifted left by AUTO_CALIBRATION_SHIFT
+    static int16_t learnedNormalsScaled[MAX_LED_COUNT][3];
+    static int restFace = -1;           // Face the die is resting on, -1 if not resting
+    static uint32_t restSinceMs = 0;
+    static bool restReadingTaken = false;
+    static int learnedReadingCount = 0; // Since the estimates were last programmed
+    static uint32_t lastPersistMs = 0;
+    static bool persisted = false;      // Whether lastPersistMs is set
+#endif
+
+    // For each octant (sign of x, y and z), bit mask of the faces that can be facing up
+    // for an acceleration in that octant, built from the calibrated normals
+    static uint32_t octantFaceMasks[8];
 
     enum State {
         State_Unknown = 0,
@@ -56,10 +157,22 @@ namespace Modules::Accelerometer
 
     void calibrateHandler(const Message *msg);
     void calibrateFaceHandler(const Message *msg);
+    void calibrateFaceSampleHandler(const Message *msg);
+    void commitFaceCalibrationHandler(const Message *msg);
+    void addFaceSample(const AccelFrame& frame);
+    void finishFaceSample();
+    void loadLearnedNormals();
+    void learnNormals(const AccelFrame& frame);
+    void setAdaptiveThresholdsHandler(const Message *msg);
+    void loadThresholds();
+    void adaptThresholds(const AccelFrame& frame);
+    void recountFrames();
     void onSettingsProgrammingEvent(void *context, Flash::ProgrammingEventType evt);
     void readAccelerometer(int3 *acc);
     void accHandler(const int3 &acc);
     void update(void *context);
+    void updateSampleRate();
+    void buildFaceLookup();
 
     // Given two vectors, return the absolute difference in the axis that changed the most.
     int agitation(int3 xyz0, int3 xyz_minus1) {
@@ -79,6 +192,11 @@ namespace Modules::Accelerometer
             if (result) {
                 MessageService::RegisterMessageHandler(Message::MessageType_Calibrate, calibrateHandler);
                 MessageService::RegisterMessageHandler(Message::MessageType_CalibrateFace, calibrateFaceHandler);
+                MessageService::RegisterMessageHandler(Message::MessageType_CalibrateFaceSample, calibrateFaceSampleHandler);
+                MessageService::RegisterMessageHandler(Message::MessageType_CommitFaceCalibration, commitFaceCalibrationHandler);
+                MessageService::RegisterMessageHandler(Message::MessageType_SetAdaptiveThresholds, setAdaptiveThresholdsHandler);
+                loadThresholds();
+                loadLearnedNormals();
 
                 Flash::hookProgrammingEvent(onSettingsProgrammingEvent, nullptr);
 
@@ -96,15 +214,66 @@ namespace Modules::Accelerometer
         accHandler(acc);
     }
 
+    inline int octantIndex(const int3& v) {
+        return (v.xTimes1000 < 0 ? 1 : 0) | (v.yTimes1000 < 0 ? 2 : 0) | (v.zTimes1000 < 0 ? 4 : 0);
+    }
+
+    /// <summary>
+    /// Builds the per-octant candidate faces from the calibrated normals.
+    /// Directions are sampled on a grid over the cube faces bounding each octant, and every face whose
+    /// dot product comes within the grid's worst case error of the best one is kept as a candidate,
+    /// so the lookup always contains the face determineFace() would have picked by checking them all.
+    /// </summary>
+    void buildFaceLookup() {
+        int faceCount = SettingsManager::getLayout()->faceCount;
+        auto &normals = SettingsManager::getSettings()->faceNormals;
+
+        // Any unit direction is within sqrt(2) / (2 * steps) of a grid sample, and the dot products
+        // of two unit normals with that direction can't drift apart by more than twice that
+        const int marginTimes1000 = 1415 / FACE_LOOKUP_GRID_STEPS + 8; // + fixed point slack
+
+        for (int o = 0; o < 8; ++o) {
+            int sx = (o & 1) ? -1 : 1;
+            int sy = (o & 2) ? -1 : 1;
+            int sz = (o & 4) ? -1 : 1;
+            uint32_t mask = 0;
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int u = 0; u <= FACE_LOOKUP_GRID_STEPS; ++u) {
+                    for (int v = 0; v <= FACE_LOOKUP_GRID_STEPS; ++v) {
+                        int a = u * 1000 / FACE_LOOKUP_GRID_STEPS;
+                        int b = v * 1000 / FACE_LOOKUP_GRID_STEPS;
+                        int3 dir;
+                        switch (axis) {
+                            case 0: dir = int3(sx * 1000, sy * a, sz * b); break;
+                            case 1: dir = int3(sx * a, sy * 1000, sz * b); break;
+                            default: dir = int3(sx * a, sy * b, sz * 1000); break;
+                        }
+                        dir = dir.normalized();
+
+                        int bestDotTimes1000 = -1100;
+                        int dots[MAX_LED_COUNT];
+                        for (int i = 0; i < faceCount; ++i) {
+                            dots[i] = int3::dotTimes1000(dir, normals[i]);
+                            bestDotTimes1000 = MAX(bestDotTimes1000, dots[i]);
+                        }
+                        for (int i = 0; i < faceCount; ++i) {
+                            if (dots[i] >= bestDotTimes1000 - marginTimes1000) {
+                                mask |= 1 << i;
+                            }
+                        }
+                    }
+                }
+            }
+            octantFaceMasks[o] = mask;
+        }
+    }
+
     /// <summary>
     /// Crudely compares accelerometer readings passed in to determine the current face up
     /// Will return the last value if it cannot determine the current face up
     /// </summary>
     /// <returns>The face number, starting at 0</returns>
-    int determineFace(int3 acc, int16_t *outConfidence, int previousFace) {
-        // Compare against face normals stored in layout
-        int faceCount = SettingsManager::getLayout()->faceCount;
-
+    RAM_FUNCTION int determineFace(int3 acc, int16_t *outConfidence, int previousFace) {
         // Use calibrated normals, not canonical ones
         auto settings = SettingsManager::getSettings();
         auto &normals = settings->faceNormals;
@@ -116,148 +285,381 @@ namespace Modules::Accelerometer
             *outConfidence = 0;
             return previousFace;
         } else {
-            // Compare the acceleration vector with the face normals
-            int3 nacc = acc * 1000 / accMagTimes1000; // normalize
-
-            // The starting "best value" should be -1000 as we're comparing this value with
-            // the dot product of 2 normalized vectors, but is set a bit lower due to
-            // imprecision of fixed point operations, which may return a value lower than -1000.
-            int bestDotTimes1000 = -1100;    
+            // Only check the faces that can be up in this octant, scaling the acceleration
+            // doesn't change which normal it is closest to, so compare unnormalized dot products
+            uint32_t candidates = octantFaceMasks[octantIndex(acc)];
+            if (candidates == 0) {
+                // Lookup not built yet
+                candidates = (1 << SettingsManager::getLayout()->faceCount) - 1;
+            }
+            int32_t bestDot = INT32_MIN;
             int bestFace = previousFace;
-            for (int i = 0; i < faceCount; ++i) {
-                int dotTimes1000 = int3::dotTimes1000(nacc, normals[i]);
-                if (dotTimes1000 > bestDotTimes1000) {
-                    // Found a better match
-                    bestDotTimes1000 = dotTimes1000;
-                    bestFace = i;
+            for (int i = 0; candidates != 0; ++i, candidates >>= 1) {
+                if (candidates & 1) {
+                    const int3& n = normals[i];
+                    int32_t dot = (int32_t)acc.xTimes1000 * n.xTimes1000 + (int32_t)acc.yTimes1000 * n.yTimes1000 + (int32_t)acc.zTimes1000 * n.zTimes1000;
+                    if (dot > bestDot) {
+                        // Found a better match
+                        bestDot = dot;
+                        bestFace = i;
+                    }
                 }
             }
-            // Return the best face
-            *outConfidence = bestDotTimes1000;
+
+            // Confidence is the dot product of the normalized acceleration with the best normal
+            int3 nacc = acc * 1000 / accMagTimes1000; // normalize
+            *outConfidence = int3::dotTimes1000(nacc, normals[bestFace]);
             return bestFace;
         }
     }
 
-    void accHandler(void *param, const int3 &acc) {
+    /// <summary>
+    /// Adds (delta = 1) or removes (delta = -1) a frame from the running counts
+    /// </summary>
+    void countFrame(const AccelFrame& frame, int delta) {
+        switch (frame.estimatedRollState) {
+            case EstimatedRollState_OnFace:
+                onFaceCount += delta;
+                break;
+            case EstimatedRollState_Handling:
+                handlingCount += delta;
+                break;
+            case EstimatedRollState_Rolling:
+                rollingCount += delta;
+                break;
+            default:
+                break;
+        }
+        if (frame.agitationTimes1000 > upperThresholdTimes1000) {
+            agitationCount += delta;
+        }
+    }
+
+    /// <summary>
+    /// Adds a frame to the history, evicting the oldest one
+    /// </summary>
+    void pushFrame(const AccelFrame& frame) {
+        countFrame(frames.first(), -1);
+        frames.push(frame);
+        countFrame(frame, 1);
+    }
+
+    /// <summary>
+    /// Resets the history to the given frame
+    /// </summary>
+    void resetFrames(const AccelFrame& frame) {
+        frames.fill(frame);
+        recountFrames();
+    }
+
+    /// <summary>
+    /// Recomputes the running counts, needed when the thresholds change
+    /// </summary>
+    void recountFrames() {
+        onFaceCount = handlingCount = rollingCount = agitationCount = 0;
+        for (int i = 0; i < frames.count(); ++i) {
+            countFrame(frames[i], 1);
+        }
+    }
+
+    /// <summary>
+    /// Uses the programmed thresholds
+    /// </summary>
+    void loadThresholds() {
         auto settings = SettingsManager::getSettings();
+        lowerThresholdTimes1000 = settings->lowerThresholdTimes1000;
+        middleThresholdTimes1000 = settings->middleThresholdTimes1000;
+        upperThresholdTimes1000 = settings->upperThresholdTimes1000;
+        noiseMeanTimes1000Scaled = lowerThresholdTimes1000 << (ADAPT_NOISE_SHIFT - 1); // Start at half the threshold
+        noiseDeviationTimes1000Scaled = 0;
+        noiseSampleCount = 0;
+        recountFrames();
+    }
+
+    /// <summary>
+    /// Tracks the agitation noise floor while the die sits on a face, and scales
+    /// the thresholds so the lower one sits just above the noise
+    /// </summary>
+    void adaptThresholds(const AccelFrame& frame) {
+        if (frame.determinedRollState != RollState_OnFace && frame.determinedRollState != RollState_Rolled) {
+            return;
+        }
+
+        // Exponential moving averages of the agitation and of its deviation,
+        // with spikes clamped so a tap on the table doesn't throw them off
+        int agitation = MIN(frame.agitationTimes1000, middleThresholdTimes1000);
+        int mean = noiseMeanTimes1000Scaled >> ADAPT_NOISE_SHIFT;
+        noiseMeanTimes1000Scaled += agitation - mean;
+        int deviation = noiseDeviationTimes1000Scaled >> ADAPT_NOISE_SHIFT;
+        noiseDeviationTimes1000Scaled += ABS(agitation - mean) - deviation;
 
-        // Shift acceleration data back
-        for (int i = MAX_ACCELERATION_FRAMES-1; i >= 1; --i) {
-            frames[i] = frames[i-1];
+        if (++noiseSampleCount < ADAPT_UPDATE_SAMPLES) {
+            return;
         }
+        noiseSampleCount = 0;
 
-        // Now frame 0 will receive the new data
-        frames[0].time = DriversNRF::Timers::millis();
-        frames[0].acc = acc;
-        frames[0].agitationTimes1000 = agitation(acc, frames[1].acc);
-        frames[0].face = determineFace(acc, &frames[0].faceConfidenceTimes1000, frames[1].face);
+        auto settings = SettingsManager::getSettings();
+        int learnedLower = (noiseMeanTimes1000Scaled + ADAPT_DEVIATION_MULT * noiseDeviationTimes1000Scaled) >> ADAPT_NOISE_SHIFT;
+        int scaleTimes1000 = settings->lowerThresholdTimes1000 > 0 ? learnedLower * 1000 / settings->lowerThresholdTimes1000 : 1000;
+        scaleTimes1000 = MAX(ADAPT_MIN_SCALE_TIMES1000, MIN(scaleTimes1000, ADAPT_MAX_SCALE_TIMES1000));
+
+        // Scale all the thresholds alike so they keep their order
+        lowerThresholdTimes1000 = settings->lowerThresholdTimes1000 * scaleTimes1000 / 1000;
+        middleThresholdTimes1000 = settings->middleThresholdTimes1000 * scaleTimes1000 / 1000;
+        upperThresholdTimes1000 = settings->upperThresholdTimes1000 * scaleTimes1000 / 1000;
+        recountFrames();
+    }
+
+    /// <summary>
+    /// Starts the running estimates from the calibrated normals
+    /// </summary>
+    void loadLearnedNormals() {
+#if AUTO_CALIBRATION
+        auto &normals = SettingsManager::getSettings()->faceNormals;
+        for (int i = 0; i < SettingsManager::getLayout()->faceCount; ++i) {
+            learnedNormalsScaled[i][0] = normals[i].xTimes1000 << AUTO_CALIBRATION_SHIFT;
+            learnedNormalsScaled[i][1] = normals[i].yTimes1000 << AUTO_CALIBRATION_SHIFT;
+            learnedNormalsScaled[i][2] = normals[i].zTimes1000 << AUTO_CALIBRATION_SHIFT;
+        }
+        learnedReadingCount = 0;
+#endif
+    }
+
+    /// <summary>
+    /// Programs the estimated normals if any of them moved away from its calibrated value.
+    /// Returns false if the flash was busy and nothing was checked, so it can be tried again later.
+    /// </summary>
+    bool persistLearnedNormals() {
+#if AUTO_CALIBRATION
+        // Don't queue behind (or get rejected by) another write, the next reading tries again
+        if (Flash::isBusy() || Flash::isProgramming()) {
+            return false;
+        }
+        auto &normals = SettingsManager::getSettings()->faceNormals;
+        int faceCount = SettingsManager::getLayout()->faceCount;
+        int3 newNormals[MAX_LED_COUNT];
+        bool moved = false;
+        for (int i = 0; i < faceCount; ++i) {
+            newNormals[i] = int3(
+                learnedNormalsScaled[i][0] >> AUTO_CALIBRATION_SHIFT,
+                learnedNormalsScaled[i][1] >> AUTO_CALIBRATION_SHIFT,
+                learnedNormalsScaled[i][2] >> AUTO_CALIBRATION_SHIFT).normalized();
+            moved |= int3::dotTimes1000(newNormals[i], normals[i]) <= AUTO_CALIBRATION_PERSIST_MAX_DOT_TIMES1000;
+        }
+        if (moved) {
+            NRF_LOG_INFO("Programming learned face normals");
+            lastPersistMs = DriversNRF::Timers::millis();
+            persisted = true;
+            SettingsManager::programCalibrationData(newNormals, faceCount, [](bool result) {
+                NRF_LOG_INFO("Learned face normals programmed: %d", result);
+            });
+        }
+#endif
+        return true;
+    }
 
-        bool onFace = frames[0].faceConfidenceTimes1000 > settings->faceThresholdTimes1000
+    /// <summary>
+    /// Takes one reading per rest on a face, when the die has been sitting still long enough for
+    /// it to be a good measure of the gravity vector
+    /// </summary>
+    void learnNormals(const AccelFrame& frame) {
+#if AUTO_CALIBRATION
+        bool resting = (frame.determinedRollState == RollState_OnFace || frame.determinedRollState == RollState_Rolled) &&
+            frame.faceConfidenceTimes1000 >= AUTO_CALIBRATION_MIN_CONFIDENCE_TIMES1000;
+        if (!resting) {
+            restFace = -1;
+            return;
+        }
+        if (frame.face != restFace) {
+            restFace = frame.face;
+            restSinceMs = frame.time;
+            restReadingTaken = false;
+            return;
+        }
+        // Leave the normals alone while they're being calibrated explicitly
+        if (restReadingTaken || frame.time - restSinceMs < AUTO_CALIBRATION_REST_MS ||
+            faceSampleCallback != nullptr || sessionNormals != nullptr) {
+            return;
+        }
+        restReadingTaken = true;
+
+        int3 reading = frame.acc.normalized();
+        auto learned = learnedNormalsScaled[frame.face];
+        learned[0] += reading.xTimes1000 - (learned[0] >> AUTO_CALIBRATION_SHIFT);
+        learned[1] += reading.yTimes1000 - (learned[1] >> AUTO_CALIBRATION_SHIFT);
+        learned[2] += reading.zTimes1000 - (learned[2] >> AUTO_CALIBRATION_SHIFT);
+
+        if (++learnedReadingCount >= AUTO_CALIBRATION_PERSIST_READINGS &&
+            (!persisted || frame.time - lastPersistMs >= AUTO_CALIBRATION_PERSIST_INTERVAL_MS)) {
+            learnedReadingCount = 0;
+            // From the main loop, programming the settings stops us
+            Scheduler::push(nullptr, 0, [](void* eventData, uint16_t eventSize) {
+                if (!persistLearnedNormals()) {
+                    // Try again with the next reading
+                    learnedReadingCount = AUTO_CALIBRATION_PERSIST_READINGS;
+                }
+            }, Scheduler::Priority_Background);
+        }
+#endif
+    }
+
+    void accHandler(void *param, const int3 &acc) {
+        TIMELINE_BEGIN(Profiler::TimelineEvent_AccHandler);
+        processSample(acc, DriversNRF::Timers::millis());
+        updateSampleRate();
+        TIMELINE_END(Profiler::TimelineEvent_AccHandler);
+    }
+
+    /// <summary>
+    /// Runs the roll detection on one sample and notifies the clients. The time is passed in rather
+    /// than read from the clock, and nothing here talks to the accelerometer chip, so recorded
+    /// samples can be played back (at any speed) through the exact same logic.
+    /// </summary>
+    void processSample(const int3& acc, uint32_t timeMs) {
+        auto settings = SettingsManager::getSettings();
+
+        // Copy the previous frame, the history slot can be reused by the new one
+        const AccelFrame prev = frames.last();
+
+        AccelFrame frame;
+        frame.time = timeMs;
+        frame.acc = acc;
+        frame.agitationTimes1000 = agitation(acc, prev.acc);
+        int frameDurationMs = frame.time - prev.time;
+        if (frameDurationMs > 0 && frameDurationMs < ACCEL_REFERENCE_PERIOD_MS) {
+            frame.agitationTimes1000 = frame.agitationTimes1000 * ACCEL_REFERENCE_PERIOD_MS / frameDurationMs;
+        }
+        frame.face = determineFace(acc, &frame.faceConfidenceTimes1000, prev.face);
+
+        bool onFace = frame.faceConfidenceTimes1000 > settings->faceThresholdTimes1000
             || SettingsManager::getDieType() != DiceVariants::DieType_D4;
         // Calculate the estimated roll state
-        if (frames[0].agitationTimes1000 < settings->lowerThresholdTimes1000) {
-            frames[0].estimatedRollState = EstimatedRollState_OnFace;
-        } else if (frames[0].agitationTimes1000 >= settings->lowerThresholdTimes1000 && frames[0].agitationTimes1000 < settings->middleThresholdTimes1000) {
+        if (frame.agitationTimes1000 < lowerThresholdTimes1000) {
+            frame.estimatedRollState = EstimatedRollState_OnFace;
+        } else if (frame.agitationTimes1000 >= lowerThresholdTimes1000 && frame.agitationTimes1000 < middleThresholdTimes1000) {
             // Medium amount of agitation... we're handling (or finishing to roll)
-            if (frames[1].estimatedRollState != EstimatedRollState_Rolling) {
-                frames[0].estimatedRollState = EstimatedRollState_Handling;
+            if (prev.estimatedRollState != EstimatedRollState_Rolling) {
+                frame.estimatedRollState = EstimatedRollState_Handling;
             } else {
-                frames[0].estimatedRollState = EstimatedRollState_Rolling;
+                frame.estimatedRollState = EstimatedRollState_Rolling;
             }
         } else {
-            frames[0].estimatedRollState = EstimatedRollState_Rolling;
+            frame.estimatedRollState = EstimatedRollState_Rolling;
         }
         
         // If the time between the last and current time is zero, log it
-        if(frames[0].time - frames[1].time == 0) {
-            NRF_LOG_WARNING("Time diff between frames is 0, time: %d", frames[0].time);
+        if(frameDurationMs == 0) {
+            NRF_LOG_WARNING("Time diff between frames is 0, time: %d", frame.time);
         }      
 
-        // Count how many onface states we estimated in the last 3 frames, same with handling and rolling
-        int onFaceCount = 0;
-        int handlingCount = 0;
-        int rollingCount = 0;
-        int agitationCount = 0;
-        for (int i = 0; i < MAX_ACCELERATION_FRAMES; ++i) {
-            switch (frames[i].estimatedRollState) {
-                case EstimatedRollState_OnFace:
-                    onFaceCount++;
-                    break;
-                case EstimatedRollState_Handling:
-                    handlingCount++;
-                    break;
-                case EstimatedRollState_Rolling:
-                    rollingCount++;
-                    break;
-                default:
-                    break;
-            }
-            if (frames[i].agitationTimes1000 > settings->upperThresholdTimes1000) {
-                agitationCount++;
-            }
-        }
-
-        frames[0].determinedRollState = frames[1].determinedRollState;
-        if (onFaceCount == 3) {
+        // Use the counts of onface, handling and rolling states estimated over the history
+        frame.determinedRollState = prev.determinedRollState;
+        pushFrame(frame);
+        if (onFaceCount == MAX_ACCELERATION_FRAMES) {
             // Are we on a valid face?
             if (onFace) {
                 // Is it a valid roll?
-                if (frames[1].determinedRollState == RollState_Rolling) {
+                if (prev.determinedRollState == RollState_Rolling) {
                     // We were rolling, and now we're on face, so we rolled
-                    frames[0].determinedRollState = RollState_Rolled;
+                    frame.determinedRollState = RollState_Rolled;
                 } else {
-                    frames[0].determinedRollState = RollState_OnFace;
+                    frame.determinedRollState = RollState_OnFace;
                 }
             } else {
-                frames[0].determinedRollState = RollState_Crooked;
+                frame.determinedRollState = RollState_Crooked;
             }
-        } else if (handlingCount == 3) {
-            frames[0].determinedRollState = RollState_Handling;
-        } else if ((rollingCount >= 2) && (agitationCount > 0)) {
-            frames[0].determinedRollState = RollState_Rolling;
+        } else if (handlingCount == MAX_ACCELERATION_FRAMES) {
+            frame.determinedRollState = RollState_Handling;
+        } else if ((rollingCount >= MAX_ACCELERATION_FRAMES - 1) && (agitationCount > 0)) {
+            frame.determinedRollState = RollState_Rolling;
         }
+        frames.last().determinedRollState = frame.determinedRollState;
 
-        bool faceChanged = frames[0].face != frames[1].face;
-        bool stateChanged = frames[0].determinedRollState != frames[1].determinedRollState &&
+        if (adaptiveThresholds) {
+            adaptThresholds(frame);
+        }
+
+        addFaceSample(frame);
+        learnNormals(frame);
+
+        // While rolling, predict the result as soon as the die has settled on a face with good
+        // confidence and the agitation is going down, that's a few frames before the above confirms it
+        if (frame.determinedRollState != RollState_Rolling) {
+            likelyFaceNotified = false;
+        } else if (!likelyFaceNotified &&
+                   frame.estimatedRollState == EstimatedRollState_OnFace &&
+                   frame.face == prev.face &&
+                   onFace &&
+                   frame.faceConfidenceTimes1000 >= ROLL_PREDICTION_MIN_CONFIDENCE_TIMES1000 &&
+                   frame.agitationTimes1000 < prev.agitationTimes1000) {
+            likelyFaceNotified = true;
+            for (int i = 0; i < likelyFaceClients.Count(); ++i) {
+                likelyFaceClients[i].handler(likelyFaceClients[i].token, frame.face, frame.faceConfidenceTimes1000);
+            }
+        }
+
+        bool faceChanged = frame.face != prev.face;
+        bool stateChanged = frame.determinedRollState != prev.determinedRollState &&
                             // Avoid notifying onface just after a valid roll on the same face
-                            (frames[0].determinedRollState != RollState_OnFace || frames[1].determinedRollState != RollState_Rolled);
+                            (frame.determinedRollState != RollState_OnFace || prev.determinedRollState != RollState_Rolled);
         if (faceChanged || stateChanged) {
+            StaticSubscribers::RollState::Call(prev.determinedRollState, prev.face, frame.determinedRollState, frame.face);
             for (int i = 0; i < rollStateClients.Count(); ++i) {
-                rollStateClients[i].handler(rollStateClients[i].token, frames[1].determinedRollState, frames[1].face, frames[0].determinedRollState, frames[0].face);
+                rollStateClients[i].handler(rollStateClients[i].token, prev.determinedRollState, prev.face, frame.determinedRollState, frame.face);
             }
         }
 
         // Notify frame data clients
         for (int i = 0; i < frameDataClients.Count(); ++i) {
-            frameDataClients[i].handler(frameDataClients[i].token, frames[0]);
+            frameDataClients[i].handler(frameDataClients[i].token, frames.last());
+        }
+    }
+
+    /// <summary>
+    /// Samples faster while the die is moving, for quicker roll results, and drops back to the
+    /// low rate once it has been still for a while
+    /// </summary>
+    void updateSampleRate() {
+        if (streaming || faceSampleCallback != nullptr) {
+            return;
+        }
+        auto state = frames.last().determinedRollState;
+        bool still = state == RollState_OnFace || state == RollState_Rolled || state == RollState_Crooked;
+        if (!still) {
+            stillSinceMs = frames.last().time;
+            AccelChip::setSampleRate(AccelChip::SampleRate_High);
+        } else if (lowRateDelayMs != ACCEL_LOW_RATE_NEVER && frames.last().time - stillSinceMs > lowRateDelayMs) {
+            AccelChip::setSampleRate(AccelChip::SampleRate_Low);
         }
     }
 
     /// <summary>
     /// Initialize the acceleration system
     /// </summary>
-    void start() {
+    static void startAt(AccelChip::SampleRate rate) {
         switch (currentState) {
             case State_Off:
             case State_LowPower:
                 {
                     NRF_LOG_DEBUG("Starting accelerometer");
 
+                    // Normals may have been recalibrated
+                    buildFaceLookup();
+
                     // Initialize the acceleration data
-                    readAccelerometer(&frames[0].acc);
-                    frames[0].face = determineFace(frames[0].acc, &frames[0].faceConfidenceTimes1000, 0);
-                    frames[0].time = DriversNRF::Timers::millis();
-                    frames[0].agitationTimes1000 = 0;
-                    frames[0].estimatedRollState = EstimatedRollState_OnFace;
-                    memcpy(&frames[1], &frames[0], sizeof(AccelFrame));
-                    memcpy(&frames[2], &frames[0], sizeof(AccelFrame));
+                    AccelFrame frame = frames.last();
+                    readAccelerometer(&frame.acc);
+                    frame.face = determineFace(frame.acc, &frame.faceConfidenceTimes1000, 0);
+                    frame.time = DriversNRF::Timers::millis();
+                    frame.agitationTimes1000 = 0;
+                    frame.estimatedRollState = EstimatedRollState_OnFace;
+                    resetFrames(frame);
 
                     // Unhook first to avoid being hooked more than once if start() is called multiple times
                     AccelChip::unHook(accHandler);
                     AccelChip::hook(accHandler, nullptr);
-                    AccelChip::disableInterrupt();
-                    AccelChip::clearInterrupt();
-                    AccelChip::enableDataInterrupt();
+                    stillSinceMs = frame.time;
+                    AccelChip::startData(streaming ? AccelChip::SampleRate_Stream : rate);
 
                     // Update current state
                     currentState = State_On;
@@ -269,6 +671,10 @@ namespace Modules::Accelerometer
         }
     }
 
+    void start() {
+        startAt(AccelChip::SampleRate_Low);
+    }
+
     /// <summary>
     /// Stop getting updated from the timer
     /// </summary>
@@ -279,6 +685,11 @@ namespace Modules::Accelerometer
                 AccelChip::disableDataInterrupt();
                 AccelChip::clearInterrupt();
 
+                // No more readings for the face being sampled
+                if (faceSampleCallback != nullptr && !faceSampleDone) {
+                    finishFaceSample();
+                }
+
                 // Update current state
                 currentState = State_Off;
                 NRF_LOG_DEBUG("Stopped accelerometer");
@@ -289,6 +700,30 @@ namespace Modules::Accelerometer
         }
     }
 
+    void setStreaming(bool stream) {
+        streaming = stream;
+        if (streaming) {
+            AccelChip::setSampleRate(AccelChip::SampleRate_Stream);
+        } else {
+            // Let updateSampleRate() drop back to the low rate once still
+            stillSinceMs = DriversNRF::Timers::millis();
+            AccelChip::setSampleRate(AccelChip::SampleRate_High);
+        }
+    }
+
+    void setLowRateDelay(uint16_t delayMs) {
+        lowRateDelayMs = delayMs;
+        if (currentState == State_On && !streaming && faceSampleCallback == nullptr) {
+            // Start over from the high rate, updateSampleRate() drops it with the new delay
+            stillSinceMs = DriversNRF::Timers::millis();
+            AccelChip::setSampleRate(AccelChip::SampleRate_High);
+        }
+    }
+
+    uint16_t getLowRateDelay() {
+        return lowRateDelayMs;
+    }
+
     void lowPower() {
         switch (currentState) {
             case State_Off:
@@ -302,14 +737,16 @@ namespace Modules::Accelerometer
     }
 
     void wakeUp() {
-        start();
+        // Straight to the high rate, the die is most likely being picked up or rolled and
+        // the low rate would delay the first roll state by several samples
+        startAt(AccelChip::SampleRate_High);
 
         // Force override the roll state, since we most likely just woke up from motion
-        frames[0].determinedRollState = RollState_Handling;
+        frames.last().determinedRollState = RollState_Handling;
 
         // Notify frame data clients
         for (int i = 0; i < frameDataClients.Count(); ++i) {
-            frameDataClients[i].handler(frameDataClients[i].token, frames[0]);
+            frameDataClients[i].handler(frameDataClients[i].token, frames.last());
         }
     }
 
@@ -318,15 +755,15 @@ namespace Modules::Accelerometer
     /// Returns the currently stored up face!
     /// </summary>
     int currentFace() {
-        return frames[0].face;
+        return frames.last().face;
     }
 
     int currentFaceConfidenceTimes1000() {
-        return frames[0].faceConfidenceTimes1000;
+        return frames.last().faceConfidenceTimes1000;
     }
 
     RollState currentRollState() {
-        return frames[0].determinedRollState;
+        return frames.last().determinedRollState;
     }
 
     const char *getRollStateString(RollState state) {
@@ -389,6 +826,16 @@ namespace Modules::Accelerometer
         rollStateClients.UnregisterWithToken(param);
     }
 
+    void hookLikelyFace(LikelyFaceClientMethod method, void *param) {
+        if (!likelyFaceClients.Register(param, method)) {
+            NRF_LOG_ERROR("Too many likely face hooks registered.");
+        }
+    }
+
+    void unHookLikelyFace(LikelyFaceClientMethod client) {
+        likelyFaceClients.UnregisterWithHandler(client);
+    }
+
     struct CalibrationNormals
     {
         int3 face1;
@@ -422,7 +869,7 @@ namespace Modules::Accelerometer
         };
 
         // Start calibration!
-        measuredNormals = (CalibrationNormals *)malloc(sizeof(CalibrationNormals));
+        measuredNormals = (CalibrationNormals *)Utils::Heap::alloc(sizeof(CalibrationNormals), Utils::Heap::HeapTag_Accelerometer);
 
 #pragma GCC diagnostic push "-Wstack-usage="
 #pragma GCC diagnostic ignored "-Wstack-usage="
@@ -495,22 +942,169 @@ namespace Modules::Accelerometer
         });
     }
 
+    /// <summary>
+    /// Starts averaging the readings of the die sitting still, the callback is called from the
+    /// main loop with the normalized average. Returns false if it can't be done right now.
+    /// </summary>
+    bool sampleFace(FaceSampleCallback callback) {
+        if (faceSampleCallback != nullptr || currentState != State_On) {
+            return false;
+        }
+        faceSampleSum[0] = faceSampleSum[1] = faceSampleSum[2] = 0;
+        faceSampleCount = 0;
+        faceSampleFrames = 0;
+        faceSampleDone = false;
+        faceSampleCallback = callback;
+        if (!streaming) {
+            AccelChip::setSampleRate(AccelChip::SampleRate_High);
+        }
+        return true;
+    }
+
+    void addFaceSample(const AccelFrame& frame) {
+        if (faceSampleCallback == nullptr || faceSampleDone) {
+            return;
+        }
+        faceSampleFrames++;
+        if (frame.estimatedRollState == EstimatedRollState_OnFace) {
+            faceSampleSum[0] += frame.acc.xTimes1000;
+            faceSampleSum[1] += frame.acc.yTimes1000;
+            faceSampleSum[2] += frame.acc.zTimes1000;
+            faceSampleCount++;
+        }
+        if (faceSampleCount == CALIBRATION_SAMPLE_COUNT || faceSampleFrames == CALIBRATION_MAX_FRAMES) {
+            finishFaceSample();
+        }
+    }
+
+    /// <summary>
+    /// Reports the face sample from the main loop, it failed if there aren't enough readings
+    /// </summary>
+    void finishFaceSample() {
+        // The callback may program the settings, which stops us
+        faceSampleDone = true;
+        bool queued = Scheduler::push(nullptr, 0, [](void* eventData, uint16_t eventSize) {
+            auto callback = faceSampleCallback;
+            faceSampleCallback = nullptr;
+            bool success = faceSampleCount == CALIBRATION_SAMPLE_COUNT;
+            int3 normal(0, 0, 0);
+            if (success) {
+                normal = int3(
+                    faceSampleSum[0] / faceSampleCount,
+                    faceSampleSum[1] / faceSampleCount,
+                    faceSampleSum[2] / faceSampleCount).normalized();
+            }
+            NRF_LOG_INFO("Face sampled: %d, %d of %d frames", success, faceSampleCount, faceSampleFrames);
+            callback(success, normal);
+        });
+        if (!queued) {
+            NRF_LOG_ERROR("Couldn't queue face sample result");
+            faceSampleCallback = nullptr;
+        }
+    }
+
+    void onSessionConnectionEvent(void *param, bool connected);
+
+    /// <summary>
+    /// Measured normals replace the calibrated ones of their face, the others stay as they are
+    /// </summary>
+    bool addSessionNormal(uint8_t face, const int3& normal) {
+        auto l = SettingsManager::getLayout();
+        if (sessionNormals == nullptr) {
+            sessionNormals = (int3 *)Utils::Heap::alloc(l->faceCount * sizeof(int3), Utils::Heap::HeapTag_Accelerometer);
+            if (sessionNormals == nullptr) {
+                NRF_LOG_ERROR("Not enough memory for calibration session");
+                return false;
+            }
+            memcpy(sessionNormals, SettingsManager::getSettings()->faceNormals, l->faceCount * sizeof(int3));
+            sessionFacesMask = 0;
+            Bluetooth::Stack::hook(onSessionConnectionEvent, nullptr);
+        }
+        sessionNormals[face] = normal;
+        sessionFacesMask |= 1 << face;
+        return true;
+    }
+
+    void endSession() {
+        if (sessionNormals != nullptr) {
+            Bluetooth::Stack::unHook(onSessionConnectionEvent);
+            Utils::Heap::free(sessionNormals);
+            sessionNormals = nullptr;
+            sessionFacesMask = 0;
+        }
+    }
+
+    void onSessionConnectionEvent(void *param, bool connected) {
+        if (!connected) {
+            NRF_LOG_INFO("Calibration session dropped");
+            endSession();
+        }
+    }
+
+    /// <summary>
+    /// Programs all the normals measured in the session, in a single settings write
+    /// </summary>
+    void commitSession(SettingsManager::SettingsWrittenCallback callback) {
+        NRF_LOG_INFO("Programming calibrated faces 0x%x", sessionFacesMask);
+        SettingsManager::programCalibrationData(sessionNormals, SettingsManager::getLayout()->faceCount, callback);
+        endSession();
+    }
+
     void calibrateFaceHandler(const Message *msg) {
         const MessageCalibrateFace *faceMsg = (const MessageCalibrateFace *)msg;
-        uint8_t face = faceMsg->face;
+        static uint8_t face;
+        face = faceMsg->face;
+        if (face >= SettingsManager::getLayout()->faceCount) {
+            NRF_LOG_WARNING("Invalid face to calibrate %d", face);
+            return;
+        }
 
-        // Copy current calibration data
-        auto l = SettingsManager::getLayout();
-        int normalCount = l->faceCount;
-        int3 calibratedNormalsCopy[normalCount];
-        memcpy(calibratedNormalsCopy, SettingsManager::getSettings()->faceNormals, normalCount * sizeof(int3));
+        // Replace the face's normal with what we measure, along with any other face measured
+        // in the current session, and flash the new normals
+        bool sampling = sampleFace([](bool success, const int3& normal) {
+            if (success && addSessionNormal(face, normal)) {
+                commitSession([](bool result) {
+                    MessageService::NotifyUser("Face calibrated", true, false, 5, nullptr);
+                });
+            } else {
+                MessageService::NotifyUser("Face calibration failed, keep the die still", true, false, 5, nullptr);
+            }
+        });
+        if (!sampling) {
+            NRF_LOG_WARNING("Can't calibrate face now");
+        }
+    }
+
+    static uint8_t sampledFace;
+
+    void sendFaceSampled(bool success) {
+        MessageCalibrateFaceSampled sampledMsg;
+        sampledMsg.face = sampledFace;
+        sampledMsg.result = success ? 1 : 0;
+        sampledMsg.sampledFacesMask = sessionFacesMask;
+        MessageService::SendMessage(&sampledMsg);
+    }
 
-        // Replace the face's normal with what we measured
-        readAccelerometer(&calibratedNormalsCopy[face]);
+    void calibrateFaceSampleHandler(const Message *msg) {
+        auto sampleMsg = (const MessageCalibrateFaceSample *)msg;
+        sampledFace = sampleMsg->face;
+        bool sampling = sampledFace < SettingsManager::getLayout()->faceCount && sampleFace([](bool success, const int3& normal) {
+            sendFaceSampled(success && addSessionNormal(sampledFace, normal));
+        });
+        if (!sampling) {
+            NRF_LOG_WARNING("Can't sample face %d now", sampledFace);
+            sendFaceSampled(false);
+        }
+    }
 
-        // And flash the new normals
-        SettingsManager::programCalibrationData(calibratedNormalsCopy, normalCount, [](bool result)
-                                                { MessageService::NotifyUser("Face calibrated", true, false, 5, nullptr); });
+    void commitFaceCalibrationHandler(const Message *msg) {
+        if (sessionNormals == nullptr) {
+            NRF_LOG_WARNING("No face calibration to commit");
+            return;
+        }
+        commitSession([](bool result) {
+            MessageService::NotifyUser(result ? "Faces calibrated" : "Face calibration failed", true, false, 5, nullptr);
+        });
     }
 
 #pragma GCC diagnostic pop "-Wstack-usage="
@@ -519,8 +1113,13 @@ namespace Modules::Accelerometer
         if (evt == Flash::ProgrammingEventType_Begin) {
             NRF_LOG_DEBUG("Stopping axel from programming event");
             stop();
-        } else {
+        } else if (evt == Flash::ProgrammingEventType_End) {
             NRF_LOG_DEBUG("Starting axel from programming event");
+            if (!adaptiveThresholds) {
+                loadThresholds();
+            }
+            // The normals may have been calibrated
+            loadLearnedNormals();
             start();
         }
     }
@@ -529,6 +1128,44 @@ namespace Modules::Accelerometer
         AccelChip::read(acc);
     }
 
+    void sendThresholds() {
+        MessageRollThresholds msg;
+        msg.adaptive = adaptiveThresholds ? 1 : 0;
+        msg.noiseFloorTimes1000 = (int16_t)(noiseMeanTimes1000Scaled >> ADAPT_NOISE_SHIFT);
+        msg.lowerThresholdTimes1000 = (int16_t)lowerThresholdTimes1000;
+        msg.middleThresholdTimes1000 = (int16_t)middleThresholdTimes1000;
+        msg.upperThresholdTimes1000 = (int16_t)upperThresholdTimes1000;
+        MessageService::SendMessage(&msg);
+    }
+
+    void setAdaptiveThresholdsHandler(const Message *msg) {
+        auto adaptMsg = (const MessageSetAdaptiveThresholds *)msg;
+        NRF_LOG_INFO("Adaptive thresholds mode: %d", adaptMsg->mode);
+        switch (adaptMsg->mode) {
+            case AdaptiveThresholdsMode_Off:
+                adaptiveThresholds = false;
+                loadThresholds();
+                break;
+            case AdaptiveThresholdsMode_On:
+                if (!adaptiveThresholds) {
+                    loadThresholds();
+                    adaptiveThresholds = true;
+                }
+                break;
+            case AdaptiveThresholdsMode_Persist:
+                // Program the learned values, adaptation restarts from them
+                adaptiveThresholds = false;
+                SettingsManager::programRollThresholds(lowerThresholdTimes1000, middleThresholdTimes1000, upperThresholdTimes1000, [](bool success) {
+                    NRF_LOG_INFO("Roll thresholds programmed: %d", success);
+                });
+                break;
+            default:
+                // Just report
+                break;
+        }
+        sendThresholds();
+    }
+
     // Interrupt Callback Storage
     static void* interruptParam = nullptr;
     static AccelerometerInterruptMethod interruptCallback = nullptr;
@@ -559,7 +1196,8 @@ namespace Modules::Accelerometer
 
                 // Callback!
                 callback(param);
-            });
+            },
+            GPIOTE::PinAccuracy_LowPower); // The pin stays latched until cleared, no need for a GPIOTE channel
         AccelChip::enableInterrupt();
     }
 
@@ -64,6 +64,18 @@ namespace Modules::Accelerometer
 
     void readAccelerometer(int3* acc);
 
+    // Roll detection for one sample taken at the given time, as done for each reading of the chip
+    void processSample(const int3& acc, uint32_t timeMs);
+
+    // Locks the accelerometer at its raw streaming rate (AccelChip::setStreamRate())
+    void setStreaming(bool streaming);
+
+    // How long the die must stay still before the accelerometer drops to its low rate,
+    // ACCEL_LOW_RATE_NEVER keeps it at the high rate
+    #define ACCEL_LOW_RATE_NEVER 0xFFFF
+    void setLowRateDelay(uint16_t delayMs);
+    uint16_t getLowRateDelay();
+
     typedef void(*AccelerometerInterruptMethod)(void* param);
     void enableInterrupt(AccelerometerInterruptMethod callback, void* param);
     void disableInterrupt();
@@ -78,4 +90,10 @@ namespace Modules::Accelerometer
     void hookRollState(RollStateClientMethod method, void* param);
     void unHookRollState(RollStateClientMethod client);
     void unHookRollStateWithParam(void* param);
+
+    // Early notification of the face a roll is most likely to end up on, sent while the
+    // agitation decays and before the roll state goes to RollState_Rolled (or not!)
+    typedef void(*LikelyFaceClientMethod)(void* param, int face, int confidenceTimes1000);
+    void hookLikelyFace(LikelyFaceClientMethod method, void* param);
+    void unHookLikelyFace(LikelyFaceClientMethod client);
 }
@@ -1,5 +1,6 @@
 #include "anim_controller.h"
 #include "animations/animation.h"
+#include "animations/animation_bake.h"
 #include "drivers_nrf/timers.h"
 #include "drivers_nrf/power_manager.h"
 #include "drivers_nrf/flash.h"
@@ -13,8 +14,11 @@
 #include "bluetooth/bluetooth_messages.h"
 #include "bluetooth/bluetooth_message_service.h"
 #include "leds.h"
+#include "anim_energy.h"
 #include "drivers_nrf/scheduler.h"
 #include "core/delegate_array.h"
+#include "core/ram_function.h"
+#include "drivers_nrf/profiler.h"
 
 using namespace Animations;
 using namespace Modules;
@@ -22,17 +26,251 @@ using namespace Config;
 using namespace DriversNRF;
 using namespace Bluetooth;
 
-#define MAX_ANIMS 20
 #define FORCE_FADE_OUT_DURATION_MS 500
 
+// Number of lists the running animations are spread into for lookups by preset and face
+#define ANIM_LOOKUP_BUCKETS 16
+#define NO_SLOT 0xFF
+
+// Animations triggered by other animations that can wait to be started at once
+#define MAX_PENDING_PLAYS 8
+
+// Animations waiting for their start time on the shared clock
+#define MAX_SCHEDULED_PLAYS 4
+
+// Scheduled start times further than this in the future are considered bogus
+#define MAX_SCHEDULED_PLAY_DELAY_MS 10000
+
+// Animation instances that can have an event callback at the same time, see watch()
+#define MAX_ANIM_WATCHERS 4
+
+// Set to 1 to gamma correct the composited colors, by default they are sent to the LEDs linearly
+// (only scaled by the brightness) as the animations were designed for
+#define ANIM_GAMMA_CORRECTION 0
+
+// Set to 1 to dither the fractional part of the output colors over time instead of dropping it.
+// Dithered frames differ from one to the next even when nothing moves, so the LEDs module rarely
+// gets to skip them as unchanged, which costs LED and CPU time
+#define ANIM_TEMPORAL_DITHERING 0
+
 namespace Modules::AnimController
 {
     static DelegateArray<AnimControllerClientMethod, 1> clients;
+    static bool clientsNotifiedAnimating = false;
+
+    // Running animation instances are kept in slots. A slot's generation changes when its
+    // instance is removed, so handles to it (slot and generation) are never reused right away.
+    struct Slot
+    {
+        Animations::AnimationInstance* instance;    // nullptr when free
+        uint8_t generation;
+        uint8_t next;                               // Next slot in the same lookup bucket, or in the free list
+    };
+    static_assert(MAX_ANIMS < NO_SLOT, "Slot indices must fit in a byte");
+    static Slot slots[MAX_ANIMS];
+    static uint8_t freeSlots = NO_SLOT;
 
-    // Our currently running animations
-    static Animations::AnimationInstance *animations[MAX_ANIMS];
+    // Slots of the running animations in blending order, oldest first
+    static uint8_t order[MAX_ANIMS];
     static int animationCount = 0;
 
+    // Slots of the running animations by preset and remap face, most recently played first
+    static uint8_t lookupBuckets[ANIM_LOOKUP_BUCKETS];
+
+#if PROFILER_ENABLED
+    // Render cost and overdraw of each running instance, indexed by slot
+    struct SlotProfile
+    {
+        uint32_t lastCycles;
+        uint32_t maxCycles;
+        uint32_t totalCycles;
+        uint32_t frameCount;
+        uint8_t overdraw;
+    };
+    static SlotProfile slotProfiles[MAX_ANIMS];
+
+    /// <summary>
+    /// Counts the LEDs the instance lit that have a saturated channel once blended into the frame
+    /// </summary>
+    static uint8_t countOverdraw(const uint32_t* colors, const uint32_t* frame, int count) {
+        uint8_t overdraw = 0;
+        for (int j = 0; j < count; ++j) {
+            uint32_t c = frame[j];
+            if (colors[j] != 0 && (Utils::getRed(c) == 0xFF || Utils::getGreen(c) == 0xFF || Utils::getBlue(c) == 0xFF)) {
+                overdraw++;
+            }
+        }
+        return overdraw;
+    }
+#endif
+
+    static int bucketOf(const Animation* animationPreset, uint8_t remapFace) {
+        uint32_t key = (uint32_t)(uintptr_t)animationPreset;
+        key ^= (key >> 4) ^ (key >> 9) ^ remapFace;
+        return key % ANIM_LOOKUP_BUCKETS;
+    }
+
+    static AnimationHandle handleOf(int slot) {
+        return (AnimationHandle)((slots[slot].generation << 8) | slot);
+    }
+
+    static int slotOf(AnimationHandle handle) {
+        int slot = handle & 0xFF;
+        if (slot < MAX_ANIMS && slots[slot].instance != nullptr && slots[slot].generation == (handle >> 8)) {
+            return slot;
+        }
+        return -1;
+    }
+
+    /// <summary>
+    /// Finds the most recently played instance of a preset on a given face, -1 if none
+    /// </summary>
+    static int findSlot(const Animation* animationPreset, uint8_t remapFace) {
+        for (uint8_t s = lookupBuckets[bucketOf(animationPreset, remapFace)]; s != NO_SLOT; s = slots[s].next) {
+            auto instance = slots[s].instance;
+            if (instance->animationPreset == animationPreset && instance->remapFace == remapFace) {
+                return s;
+            }
+        }
+        return -1;
+    }
+
+    static int allocSlot(AnimationInstance* instance) {
+        uint8_t s = freeSlots;
+        if (s != NO_SLOT) {
+            freeSlots = slots[s].next;
+            slots[s].instance = instance;
+            int bucket = bucketOf(instance->animationPreset, instance->remapFace);
+            slots[s].next = lookupBuckets[bucket];
+            lookupBuckets[bucket] = s;
+#if PROFILER_ENABLED
+            memset(&slotProfiles[s], 0, sizeof(SlotProfile));
+#endif
+        }
+        return s == NO_SLOT ? -1 : s;
+    }
+
+    /// <summary>
+    /// Releases the slot and destroys its instance, the caller removes it from the blending order
+    /// </summary>
+    static void freeSlot(int s) {
+        auto instance = slots[s].instance;
+        uint8_t* link = &lookupBuckets[bucketOf(instance->animationPreset, instance->remapFace)];
+        while (*link != s) {
+            link = &slots[*link].next;
+        }
+        *link = slots[s].next;
+        slots[s].instance = nullptr;
+        slots[s].generation++;
+        slots[s].next = freeSlots;
+        freeSlots = s;
+        Animations::destroyAnimationInstance(instance);
+    }
+
+    // Instances with an event callback, a null callback marks a free entry
+    struct Watcher
+    {
+        AnimationEventCallback callback;
+        void* param;
+        AnimationHandle handle;
+    };
+    static Watcher watchers[MAX_ANIM_WATCHERS];
+    static int watcherCount = 0;
+
+    struct FiredEvent
+    {
+        AnimationEventCallback callback;
+        void* param;
+        AnimationHandle handle;
+        AnimationEvent event;
+    };
+
+    /// <summary>
+    /// Queues the callback of the instance in the given slot, if it is watched.
+    /// Must be called before the slot is freed, its handle changes then.
+    /// </summary>
+    static void fireEvent(int slot, AnimationEvent event) {
+        if (watcherCount == 0) {
+            return;
+        }
+        const AnimationHandle handle = handleOf(slot);
+        for (auto& watcher : watchers) {
+            if (watcher.callback != nullptr && watcher.handle == handle) {
+                FiredEvent fired = { watcher.callback, watcher.param, handle, event };
+                if (!Scheduler::push(&fired, sizeof(fired), [](void* eventData, uint16_t size) {
+                    auto fired = (const FiredEvent*)eventData;
+                    fired->callback(fired->param, fired->handle, fired->event);
+                })) {
+                    NRF_LOG_ERROR("Animation event %d lost", event);
+                }
+                if (event == AnimationEvent_Ended || event == AnimationEvent_Stopped) {
+                    watcher.callback = nullptr;
+                    watcherCount--;
+                }
+                break;
+            }
+        }
+    }
+
+    static uint32_t droppedAnimationCount = 0;
+
+    // See MessageEnableAnimEvents
+    static bool sendAnimEvents = false;
+
+    // Animations triggered while the controller was busy with another one, they are started in
+    // the order they were requested, with the start time they were due at
+    struct PendingPlay
+    {
+        const Animation* animationPreset;
+        const DataSet::AnimationBits* animationBits;
+        int startTime;
+        uint8_t remapFace;
+        uint8_t loopCount;
+        AnimationTag tag;
+    };
+    static PendingPlay pendingPlays[MAX_PENDING_PLAYS];
+    static int pendingPlayCount = 0;
+
+    // Offset from the local time to the clock shared with the other dice, see syncTimeHandler
+    static uint32_t globalTimeOffset = 0;
+    static bool globalTimeSynced = false;
+
+    // Animations to start later (on a delayed callback each), a null preset marks a free entry
+    static PendingPlay scheduledPlays[MAX_SCHEDULED_PLAYS];
+
+    /// <summary>
+    /// How much an animation matters when they can't all be played, based on what started it.
+    /// Status and battery feedback win over roll effects and animations requested remotely.
+    /// </summary>
+    static int tagPriority(AnimationTag tag) {
+        switch (tag) {
+            case AnimationTag_Status:
+                return 4;
+            case AnimationTag_BatteryNotification:
+                return 3;
+            case AnimationTag_BluetoothNotification:
+                return 2;
+            case AnimationTag_Accelerometer:
+            case AnimationTag_BluetoothMessage:
+                return 1;
+            default:
+                return 0;
+        }
+    }
+
+    static void resetSlots() {
+        for (int i = 0; i < MAX_ANIMS; ++i) {
+            // Invalidate any handle still held on to
+            slots[i].generation++;
+            slots[i].instance = nullptr;
+            slots[i].next = i + 1 < MAX_ANIMS ? i + 1 : NO_SLOT;
+        }
+        freeSlots = 0;
+        memset(lookupBuckets, NO_SLOT, sizeof(lookupBuckets));
+        animationCount = 0;
+        pendingPlayCount = 0;
+    }
+
     enum State
     {
         State_Unknown = 0,
@@ -50,16 +288,53 @@ namespace Modules::AnimController
     void playLEDAnimHandler(const Message* msg);
     void stopLEDAnimHandler(const Message* msg);
     void stopAllLEDAnimsHandler(const Message* msg);
+    void syncTimeHandler(const Message* msg);
+    void playLEDAnimAtHandler(const Message* msg);
+    static void cancelScheduledPlays();
+    void setFrameRateHandler(const Message* msg);
+    void enableAnimEventsHandler(const Message* msg);
+    void requestFrameRateHandler(const Message* msg);
+    void updateFrameDuration();
+    static AnimationHandle startInstance(const Animation* animationPreset, const DataSet::AnimationBits* animationBits, int startTime, uint8_t remapFace, uint8_t loopCount, AnimationTag tag, bool canEvict);
+    static void startPendingPlays(bool canEvict);
 
     // Update timer
     APP_TIMER_DEF(animControllerTimer);
     // To be passed to the timer
-    static int animControllerTicks = 0;
+    static int frameDurationMs = ANIM_FRAME_DURATION_MS;
+    static FrameRateMode frameRateMode = FrameRateMode_Fixed;
+    static uint8_t frameRate = 1000 / ANIM_FRAME_DURATION_MS;
+
+    // The timer only runs while there are animations to update, so an idle die doesn't wake up every frame
+    static bool timerArmed = false;
+
+    void armTimer()
+    {
+        if (currentState == State_On && !timerArmed) {
+            timerArmed = true;
+            Timers::startTimer(animControllerTimer, frameDurationMs);
+        }
+    }
+
+    void disarmTimer()
+    {
+        if (timerArmed) {
+            timerArmed = false;
+            Timers::stopTimer(animControllerTimer);
+        }
+    }
+
     void animationControllerUpdate(void* param)
     {
-        animControllerTicks++;
-        int timeMs = animControllerTicks * ANIM_FRAME_DURATION_MS;
-        update(timeMs);
+        // Animation time comes straight from the RTC rather than from counting frames, so it doesn't
+        // drift when an update is late or skipped, and stays in sync with Timers::millis() users
+        update(Timers::millis());
+        if (animationCount == 0) {
+            // Nothing left to play, the next call to play() re-arms the timer
+            disarmTimer();
+        } else if (frameRateMode == FrameRateMode_Adaptive) {
+            updateFrameDuration();
+        }
     }
 
     /// <summary>
@@ -68,11 +343,17 @@ namespace Modules::AnimController
     void init()
     {
         currentState = State_Initializing;
+        resetSlots();
         Flash::hookProgrammingEvent(onProgrammingEvent, nullptr);
         MessageService::RegisterMessageHandler(Message::MessageType_PrintAnimControllerState, printAnimControllerStateHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_PlayAnim, playLEDAnimHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_StopAnim, stopLEDAnimHandler);
         MessageService::RegisterMessageHandler(Message::MessageType_StopAllAnims, stopAllLEDAnimsHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_SyncTime, syncTimeHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_PlayAnimAt, playLEDAnimAtHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_SetFrameRate, setFrameRateHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_EnableAnimEvents, enableAnimEventsHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestFrameRate, requestFrameRateHandler);
         Timers::createTimer(&animControllerTimer, APP_TIMER_MODE_REPEATED, animationControllerUpdate);
 
         NRF_LOG_DEBUG("Anim Controller init");
@@ -81,8 +362,147 @@ namespace Modules::AnimController
         start();
     }
 
-#pragma GCC diagnostic push "-Wstack-usage="
-#pragma GCC diagnostic ignored "-Wstack-usage="
+    // Frame buffer the animations are composited into, and scratch buffer for each animation's colors.
+    // These are static so the update doesn't need large stack arrays.
+    static uint32_t frameColors[MAX_LED_COUNT];
+    static uint32_t animColors[MAX_LED_COUNT];
+
+    /// <summary>
+    /// Blends an animation's colors into the frame buffer using the animation's blend mode, applying
+    /// the fade in the same pass. The first layer is copied rather than blended, and may be the frame
+    /// buffer itself.
+    /// </summary>
+    RAM_FUNCTION void compositeColors(uint32_t* dst, const uint32_t* src, int count, uint32_t scaleTimes1000, AnimationBlendMode mode, bool firstLayer)
+    {
+        if (firstLayer) {
+            if (mode == AnimationBlendMode_Multiply) {
+                // Nothing lit below
+                memset(dst, 0, sizeof(uint32_t) * count);
+            } else {
+                // Every other mode over black is the faded color
+                for (int j = 0; j < count; ++j) {
+                    dst[j] = scaleTimes1000 < 1000 ? Utils::scaleColor(src[j], scaleTimes1000) : src[j];
+                }
+            }
+            return;
+        }
+
+        // Modes that don't add light fade by mixing the result with what is below instead of darkening it
+        const bool fade = scaleTimes1000 < 1000;
+        const uint32_t factor256 = (scaleTimes1000 * 16778) >> 16;
+        switch (mode) {
+            case AnimationBlendMode_Add:
+                for (int j = 0; j < count; ++j) {
+                    dst[j] = Utils::addColorsSaturated(dst[j], fade ? Utils::scaleColor(src[j], scaleTimes1000) : src[j]);
+                }
+                break;
+            case AnimationBlendMode_Replace:
+                for (int j = 0; j < count; ++j) {
+                    dst[j] = fade ? Utils::mixColors(dst[j], src[j], factor256) : src[j];
+                }
+                break;
+            case AnimationBlendMode_Multiply:
+                for (int j = 0; j < count; ++j) {
+                    auto color = Utils::mulColors(dst[j], src[j]);
+                    dst[j] = fade ? Utils::mixColors(dst[j], color, factor256) : color;
+                }
+                break;
+            case AnimationBlendMode_AlphaOver:
+                for (int j = 0; j < count; ++j) {
+                    dst[j] = Utils::overColors(dst[j], fade ? Utils::scaleColor(src[j], scaleTimes1000) : src[j]);
+                }
+                break;
+            case AnimationBlendMode_Max:
+            default:
+                for (int j = 0; j < count; ++j) {
+                    dst[j] = Utils::addColors(dst[j], fade ? Utils::scaleColor(src[j], scaleTimes1000) : src[j]);
+                }
+                break;
+        }
+    }
+
+    static AnimationBlendMode getBlendMode(const AnimationInstance* anim)
+    {
+        return (AnimationBlendMode)((anim->animationPreset->animFlags & AnimationFlags_BlendModeMask) >> ANIM_BLEND_MODE_SHIFT);
+    }
+
+    /// <summary>
+    /// Returns the index in the blending order of the topmost layer that hides everything below it
+    /// this frame, i.e. a replace layer that isn't fading out, or 0 if there is none.
+    /// </summary>
+    static int findOpaqueLayer(int ms)
+    {
+        for (int i = animationCount - 1; i > 0; --i) {
+            auto anim = slots[order[i]].instance;
+            if (getBlendMode(anim) == AnimationBlendMode_Replace && anim->forceFadeTime == -1 &&
+                (anim->loopCount > 1 || ms <= anim->startTime + anim->animationPreset->duration)) {
+                return i;
+            }
+        }
+        return 0;
+    }
+
+    // Output stage lookup table, global brightness and gamma combined, rebuilt when the brightness changes.
+    // Values are 8.8 fixed point, the fractional part is what the temporal dithering works from.
+    static uint16_t outputLUT[256];
+    static int outputLUTBrightness = -1;
+    static uint32_t frameFractions[MAX_LED_COUNT];
+
+    /// <summary>
+    /// Applies the global brightness and gamma correction to the frame, with one lookup per channel.
+    /// The fractional part of each channel is returned in fractions, packed like a color.
+    /// </summary>
+    void applyOutputStage(uint32_t* colors, uint32_t* fractions, int count)
+    {
+        int brightness = DataSet::getBrightness();
+        if (brightness != outputLUTBrightness) {
+            for (int c = 0; c < 256; ++c) {
+                uint32_t scaled = c * brightness * 256 / 255;
+#if ANIM_GAMMA_CORRECTION
+                // Interpolate the gamma curve to keep the fractional part
+                uint32_t index = scaled >> 8;
+                uint32_t frac = scaled & 0xFF;
+                uint32_t low = Utils::gamma8((uint8_t)index);
+                uint32_t high = Utils::gamma8((uint8_t)MIN(index + 1, 255));
+                outputLUT[c] = (uint16_t)((low << 8) + (high - low) * frac);
+#else
+                outputLUT[c] = (uint16_t)scaled;
+#endif
+            }
+            outputLUTBrightness = brightness;
+        }
+
+        for (int j = 0; j < count; ++j) {
+            uint32_t color = colors[j];
+            uint16_t r = outputLUT[Utils::getRed(color)];
+            uint16_t g = outputLUT[Utils::getGreen(color)];
+            uint16_t b = outputLUT[Utils::getBlue(color)];
+            colors[j] = Utils::toColor(r >> 8, g >> 8, b >> 8);
+            fractions[j] = Utils::toColor(r & 0xFF, g & 0xFF, b & 0xFF);
+        }
+    }
+
+    /// <summary>
+    /// Lets clients know (from the main loop) when animations start or stop playing
+    /// Nothing is queued while that doesn't change, a failed push is retried on the next call
+    /// </summary>
+    static void notifyClientsIfActivityChanged() {
+        bool animating = animationCount > 0;
+        if (animating != clientsNotifiedAnimating) {
+            bool notified = clients.Count() == 0 || Scheduler::pushCoalesced(nullptr, 0, [](void *p_event_data, uint16_t event_size) {
+                for (int i = 0; i < clients.Count(); ++i) {
+                  clients[i].handler(clients[i].token);
+                }
+            }, Scheduler::Priority_Background);
+            if (notified) {
+                clientsNotifiedAnimating = animating;
+            }
+        }
+    }
+
+    bool isAnimating() {
+        return animationCount > 0;
+    }
 
     /// <summary>
     /// Update all currently running animations, and performing housekeeping when necessary
@@ -92,20 +512,38 @@ namespace Modules::AnimController
     {
         auto l = SettingsManager::getLayout();
 
+        notifyClientsIfActivityChanged();
         if (animationCount > 0) {
-            // Notify clients for feeding or not feeding PowerManager
-            Scheduler::push(nullptr, 0, [](void *p_event_data, uint16_t event_size) {
-                for (int i = 0; i < clients.Count(); ++i) {
-                  clients[i].handler(clients[i].token);
-                }
-            });
+            // Don't queue a frame behind one that is still being clocked out, skip it instead
+            if (LEDs::isBusy()) {
+                return;
+            }
 
-            // Current animations will write their color into this array
-            uint32_t allDaisyChainColors[MAX_LED_COUNT];
-            memset(allDaisyChainColors, 0, sizeof(uint32_t) * l->ledCount);
+            PROFILE_BEGIN(updateStart);
+            TIMELINE_BEGIN(Profiler::TimelineEvent_AnimUpdate);
+            AnimEnergy::beginFrame(ms);
+            bool frameEmpty = true;
 
-            for (int i = 0; i < animationCount; ++i) {
-                auto anim = animations[i];
+            // Layers below an opaque one keep their timing and events but aren't rendered,
+            // except sequences which start their animations from their update
+            const int opaqueLayer = findOpaqueLayer(ms);
+
+            // Finished animations are dropped from the blending order as it is walked. Animations
+            // started along the way are added at the end and rendered in the same pass.
+            int keptCount = 0;
+            for (int i = 0; i < animationCount || pendingPlayCount > 0; ++i) {
+                if (i == animationCount) {
+                    // Compact what was walked so far and append the new ones, they only take
+                    // free slots since evicting would shift the animations already rendered
+                    animationCount = keptCount;
+                    i = keptCount;
+                    startPendingPlays(false);
+                    if (i == animationCount) {
+                        break;
+                    }
+                }
+                int slot = order[i];
+                auto anim = slots[slot].instance;
 
                 bool fade = anim->forceFadeTime != -1;
 
@@ -113,9 +551,13 @@ namespace Modules::AnimController
                 uint32_t fadePercentTimes1000 = 1000;
                 if (anim->loopCount > 1 && ms > endTime) {
                     // Yes, update anim start time so next if statement updates the animation
-                    anim->loopCount--;
-                    anim->startTime += anim->animationPreset->duration;
-                    endTime += anim->animationPreset->duration;
+                    // If updates were late, skip as many loops as necessary to catch up
+                    do {
+                        anim->loopCount--;
+                        anim->startTime += anim->animationPreset->duration;
+                        endTime += anim->animationPreset->duration;
+                    } while (anim->loopCount > 1 && ms > endTime);
+                    fireEvent(slot, AnimationEvent_Loop);
                 } else if (fade) {
                     endTime = anim->forceFadeTime;
                     fadePercentTimes1000 = 1000 * (endTime - ms) / FORCE_FADE_OUT_DURATION_MS;
@@ -124,51 +566,73 @@ namespace Modules::AnimController
                 if (ms > endTime)
                 {
                     // The animation is over, get rid of it!
-                    Animations::destroyAnimationInstance(anim);
-
-                    // Shift the other animations
-                    for (int j = i; j < animationCount - 1; ++j)
-                    {
-                        animations[j] = animations[j + 1];
-                    }
-
-                    // Reduce the count
-                    animationCount--;
-
-                    // Decrement loop counter since we just replaced the current anim
-                    i--;
+                    fireEvent(slot, AnimationEvent_Ended);
+                    freeSlot(slot);
                 }
                 else
                 {
-                    // Collect color values from the animations
-                    uint32_t daisyChainColors[MAX_LED_COUNT];
-                    memset(daisyChainColors, 0, sizeof(uint32_t) * l->ledCount);
-                    anim->updateDaisyChainLEDs(ms, daisyChainColors);
-
-                    // Blend with any other color already written to the led (and fade if necessary)
-                    for (int j = 0; j < l->ledCount; ++j) {
-                        auto color = daisyChainColors[j];
-                        if (fade) {
-                            color = Utils::scaleColor(color, fadePercentTimes1000);
-                        }
-                        allDaisyChainColors[j] = Utils::addColors(allDaisyChainColors[j], color);
+                    order[keptCount++] = slot;
+                    if (i < opaqueLayer && anim->animationPreset->type != Animation_Sequence) {
+                        continue;
                     }
+
+                    // The first animation renders straight into the frame buffer
+                    uint32_t* colors = frameEmpty ? frameColors : animColors;
+                    memset(colors, 0, sizeof(uint32_t) * l->ledCount);
+                    PROFILE_BEGIN(instanceStart);
+                    anim->render(ms, colors);
+                    PROFILE_END(Profiler::Stage_AnimInstance, instanceStart);
+#if PROFILER_ENABLED
+                    {
+                        auto& profile = slotProfiles[slot];
+                        profile.lastCycles = Profiler::cycles() - instanceStart;
+                        profile.maxCycles = MAX(profile.maxCycles, profile.lastCycles);
+                        profile.totalCycles += profile.lastCycles;
+                        profile.frameCount++;
+                    }
+#endif
+                    AnimEnergy::addAnimation(anim, colors, l->ledCount, fadePercentTimes1000);
+
+                    // Blend with any other color already written to the led, fading at the same time
+                    PROFILE_BEGIN(blendStart);
+                    compositeColors(frameColors, colors, l->ledCount, fadePercentTimes1000, getBlendMode(anim), frameEmpty);
+                    PROFILE_END(Profiler::Stage_Blend, blendStart);
+#if PROFILER_ENABLED
+                    // The first animation can't overdraw anything, it rendered straight into the frame
+                    slotProfiles[slot].overdraw = frameEmpty ? 0 : countOverdraw(colors, frameColors, l->ledCount);
+#endif
+                    frameEmpty = false;
                 }
             }
-            
-            // Apply global brightness (do it here, i.e. once per update)
-            uint8_t brightness = DataSet::getBrightness();
-            for (int j = 0; j < l->ledCount; ++j) {
-                allDaisyChainColors[j] = Utils::modulateColor(allDaisyChainColors[j], brightness);
+            animationCount = keptCount;
+            notifyClientsIfActivityChanged();
+
+            if (frameEmpty) {
+                // All animations just ended
+                memset(frameColors, 0, sizeof(uint32_t) * l->ledCount);
+            } else {
+                PROFILE_BEGIN(outputStart);
+                applyOutputStage(frameColors, frameFractions, l->ledCount);
+                PROFILE_END(Profiler::Stage_Output, outputStart);
+                AnimEnergy::endFrame(frameColors);
             }
 
             // Send the colors over!
-            LEDs::setPixelColors(allDaisyChainColors);
+            PROFILE_BEGIN(showStart);
+#if ANIM_TEMPORAL_DITHERING
+            if (!frameEmpty) {
+                LEDs::setPixelColorsDithered(frameColors, frameFractions);
+            } else
+#endif
+            {
+                LEDs::setPixelColors(frameColors);
+            }
+            PROFILE_END(Profiler::Stage_Show, showStart);
+            PROFILE_END(Profiler::Stage_AnimUpdate, updateStart);
+            TIMELINE_END(Profiler::TimelineEvent_AnimUpdate);
         }
     }
 
-#pragma GCC diagnostic pop "-Wstack-usage="
-
     /// <summary>
     /// Stop updating animations
     /// </summary>
@@ -176,7 +640,7 @@ namespace Modules::AnimController
     {
         switch (currentState) {
             case State_On:
-                Timers::stopTimer(animControllerTimer);
+                disarmTimer();
                 // Clear all data
                 stopAll();
                 NRF_LOG_DEBUG("Stopped anim controller");
@@ -193,8 +657,10 @@ namespace Modules::AnimController
         switch (currentState) {
             case State_Off:
                 NRF_LOG_DEBUG("Starting anim controller");
-                Timers::startTimer(animControllerTimer, ANIM_FRAME_DURATION_MS);
                 currentState = State_On;
+                if (animationCount > 0) {
+                    armTimer();
+                }
                 break;
             default:
                 NRF_LOG_WARNING("Anim Controller in invalid state to start");
@@ -202,76 +668,249 @@ namespace Modules::AnimController
         }
     }
 
-    void play(const Animation* animationPreset, const DataSet::AnimationBits* animationBits, uint8_t remapFace, uint8_t loopCount, Animations::AnimationTag tag)
-    {
-        // Is there already an animation for this?
-        int prevAnimIndex = 0;
-        for (; prevAnimIndex < animationCount; ++prevAnimIndex)
-        {
-            auto prevAnim = animations[prevAnimIndex];
-            if (prevAnim->animationPreset == animationPreset && prevAnim->remapFace == remapFace)
-            {
-                break;
+    /// <summary>
+    /// Fades out the instance of the slot, replacing it with a snapshot of its current frame when
+    /// one is available so it doesn't keep being evaluated and its pool slot is freed right away
+    /// </summary>
+    static void fadeOutSlot(int slot, int fadeOutTime) {
+        auto instance = slots[slot].instance;
+        instance->forceFadeOut(fadeOutTime);
+        if (instance->forceFadeTime != -1 && instance->animationPreset->type != Animation_Sequence) {
+            // Sequences keep running to start their animations
+            auto snapshot = Animations::createAnimationSnapshot(instance, Timers::millis());
+            if (snapshot != nullptr) {
+                // Same preset and face, the lookup bucket and handle stay valid
+                slots[slot].instance = snapshot;
+                Animations::destroyAnimationInstance(instance);
+            }
+        }
+        fireEvent(slot, AnimationEvent_FadeOut);
+    }
+
+    /// <summary>
+    /// Makes room for an animation with the given tag when all the slots are taken.
+    /// Animations already fading out go first, then the lowest priority one that isn't above
+    /// the new animation, oldest first. Returns false if everything playing matters more.
+    /// </summary>
+    static bool evictFor(AnimationTag tag) {
+        const int priority = tagPriority(tag);
+        int victim = -1;
+        int victimRank = 0;
+        for (int i = 0; i < animationCount; ++i) {
+            auto instance = slots[order[i]].instance;
+            // Lower rank is evicted first
+            int rank = instance->forceFadeTime != -1 ? -1 : tagPriority(instance->tag);
+            if (rank <= priority && (victim < 0 || rank < victimRank)) {
+                victim = i;
+                victimRank = rank;
             }
         }
+        if (victim >= 0) {
+            NRF_LOG_DEBUG("Evicting animation with tag %d for tag %d", slots[order[victim]].instance->tag, tag);
+            removeAtIndex(victim);
+        }
+        return victim >= 0;
+    }
 
-        int ms = animControllerTicks * ANIM_FRAME_DURATION_MS;
-        if (prevAnimIndex < animationCount)
+    /// <summary>
+    /// Creates an instance of the animation and adds it on top of the others
+    /// </summary>
+    static AnimationHandle startInstance(const Animation* animationPreset, const DataSet::AnimationBits* animationBits, int startTime, uint8_t remapFace, uint8_t loopCount, AnimationTag tag, bool canEvict)
+    {
+        // Is there already an animation for this?
+        int prevSlot = findSlot(animationPreset, remapFace);
+        if (prevSlot >= 0)
         {
             // Fade out the previous animation pretty quickly
-            animations[prevAnimIndex]->forceFadeOut(ms + FORCE_FADE_OUT_DURATION_MS);
+            fadeOutSlot(prevSlot, startTime + FORCE_FADE_OUT_DURATION_MS);
         }
-        
-        if (animationCount < MAX_ANIMS)
+
+        AnimationHandle ret = ANIM_INVALID_HANDLE;
+        if (animationCount < MAX_ANIMS || (canEvict && evictFor(tag)))
         {
             const auto anim = Animations::createAnimationInstance(animationPreset, animationBits);
             if (anim) {
-                // Add a new animation
-                animations[animationCount] = anim;
-                animations[animationCount]->setTag(tag);
-                animations[animationCount]->start(ms, remapFace, loopCount);
-                animationCount++;
+                // Add a new animation, on top of the others
+                anim->setTag(tag);
+                anim->start(startTime, remapFace, loopCount);
+                int slot = allocSlot(anim);
+                order[animationCount++] = slot;
+                ret = handleOf(slot);
+                armTimer();
             }
         }
-        // Else there is no more room
+
+        if (ret == ANIM_INVALID_HANDLE) {
+            droppedAnimationCount++;
+            NRF_LOG_WARNING("Dropped animation with tag %d", tag);
+        }
+        return ret;
     }
 
-    void stop(const Animation* animationPreset, uint8_t remapFace) {
+    /// <summary>
+    /// Starts the animations triggered so far, including the ones they trigger themselves
+    /// </summary>
+    static void startPendingPlays(bool canEvict)
+    {
+        for (int i = 0; i < pendingPlayCount; ++i) {
+            // Copy it, starting the animation may queue more
+            const PendingPlay pending = pendingPlays[i];
+            startInstance(pending.animationPreset, pending.animationBits, pending.startTime, pending.remapFace, pending.loopCount, pending.tag, canEvict);
+        }
+        pendingPlayCount = 0;
+    }
 
-        // Find the animation with that preset and remap face
-        int prevAnimIndex = 0;
-        AnimationInstance* prevAnimInstance = nullptr;
-        for (; prevAnimIndex < animationCount; ++prevAnimIndex)
-        {
-            auto instance = animations[prevAnimIndex];
-            if (instance->animationPreset == animationPreset && (remapFace == 255 || instance->remapFace == remapFace))
-            {
-                prevAnimInstance = instance;
+    AnimationHandle play(const Animation* animationPreset, const DataSet::AnimationBits* animationBits, uint8_t remapFace, uint8_t loopCount, Animations::AnimationTag tag)
+    {
+        auto ret = startInstance(animationPreset, animationBits, Timers::millis(), remapFace, loopCount, tag, true);
+
+        // The animation may have triggered others right away
+        startPendingPlays(true);
+        return ret;
+    }
+
+    void playAt(const Animation* animationPreset, const DataSet::AnimationBits* animationBits, int startTime, uint8_t remapFace, uint8_t loopCount, Animations::AnimationTag tag)
+    {
+        if (pendingPlayCount < MAX_PENDING_PLAYS) {
+            pendingPlays[pendingPlayCount++] = { animationPreset, animationBits, startTime, remapFace, loopCount, tag };
+        } else {
+            droppedAnimationCount++;
+            NRF_LOG_WARNING("Too many animations triggered at once, dropped animation with tag %d", tag);
+        }
+    }
+
+    bool isTimeSynced() {
+        return globalTimeSynced;
+    }
+
+    uint32_t getGlobalTime() {
+        return (uint32_t)Timers::millis() + globalTimeOffset;
+    }
+
+    /// <summary>
+    /// Starts a scheduled animation with the exact time it was due at
+    /// </summary>
+    static void scheduledPlayCallback(void* param) {
+        auto scheduled = (PendingPlay*)param;
+        const PendingPlay play = *scheduled;
+        scheduled->animationPreset = nullptr;
+        startInstance(play.animationPreset, play.animationBits, play.startTime, play.remapFace, play.loopCount, play.tag, true);
+        startPendingPlays(true);
+    }
+
+    static void cancelScheduledPlays() {
+        Timers::cancelDelayedCallback(scheduledPlayCallback);
+        for (int i = 0; i < MAX_SCHEDULED_PLAYS; ++i) {
+            scheduledPlays[i].animationPreset = nullptr;
+        }
+    }
+
+    void playAtGlobalTime(const Animation* animationPreset, const DataSet::AnimationBits* animationBits, uint32_t globalStartTime, uint8_t remapFace, uint8_t loopCount, Animations::AnimationTag tag)
+    {
+        const int now = Timers::millis();
+        const int startTime = globalTimeSynced ? (int)(globalStartTime - globalTimeOffset) : now;
+        const int delayMs = startTime - now;
+        if (delayMs <= 0) {
+            // Due already, starting it in the past skips what the other dice have shown so far
+            startInstance(animationPreset, animationBits, startTime, remapFace, loopCount, tag, true);
+            startPendingPlays(true);
+            return;
+        }
+
+        PendingPlay* scheduled = nullptr;
+        for (int i = 0; i < MAX_SCHEDULED_PLAYS && scheduled == nullptr; ++i) {
+            if (scheduledPlays[i].animationPreset == nullptr) {
+                scheduled = &scheduledPlays[i];
+            }
+        }
+        if (delayMs > MAX_SCHEDULED_PLAY_DELAY_MS || scheduled == nullptr) {
+            droppedAnimationCount++;
+            NRF_LOG_WARNING("Can't schedule animation in %d ms, dropped animation with tag %d", delayMs, tag);
+            return;
+        }
+
+        *scheduled = { animationPreset, animationBits, startTime, remapFace, loopCount, tag };
+        if (!Timers::setDelayedCallback(scheduledPlayCallback, scheduled, delayMs)) {
+            scheduled->animationPreset = nullptr;
+            droppedAnimationCount++;
+            NRF_LOG_WARNING("No timer to schedule animation, dropped animation with tag %d", tag);
+        }
+    }
+
+    uint32_t getDroppedAnimationCount() {
+        return droppedAnimationCount;
+    }
+
+    /// <summary>
+    /// Removes the animation in the given slot from the blending order and destroys it
+    /// </summary>
+    static void removeSlot(int slot) {
+        for (int i = 0; i < animationCount; ++i) {
+            if (order[i] == slot) {
+                removeAtIndex(i);
                 break;
             }
         }
+    }
 
-        if (prevAnimIndex < animationCount)
-        {
-            removeAtIndex(prevAnimIndex);
+    void stop(const Animation* animationPreset, uint8_t remapFace) {
 
-            // Delete the instance
-            Animations::destroyAnimationInstance(prevAnimInstance);
+        // Find the animation with that preset and remap face
+        int slot = -1;
+        if (remapFace != 255) {
+            slot = findSlot(animationPreset, remapFace);
+        } else {
+            // Any face will do, go through them all
+            for (int i = 0; i < animationCount && slot < 0; ++i) {
+                if (slots[order[i]].instance->animationPreset == animationPreset) {
+                    slot = order[i];
+                }
+            }
+        }
+
+        if (slot >= 0) {
+            removeSlot(slot);
         }
         // Else the animation isn't playing
     }
 
+    void stop(AnimationHandle handle) {
+        int slot = slotOf(handle);
+        if (slot >= 0) {
+            removeSlot(slot);
+        }
+    }
+
+    bool isPlaying(AnimationHandle handle) {
+        return slotOf(handle) >= 0;
+    }
+
+    bool watch(AnimationHandle handle, AnimationEventCallback callback, void* param) {
+        if (slotOf(handle) < 0) {
+            return false;
+        }
+        for (auto& watcher : watchers) {
+            if (watcher.callback == nullptr) {
+                watcher = { callback, param, handle };
+                watcherCount++;
+                return true;
+            }
+        }
+        NRF_LOG_ERROR("Too many watched animations");
+        return false;
+    }
+
     void fadeOutAnimsWithTag(Animations::AnimationTag tagToStop, int fadeOutTimeMs) {
 
         // Is there already an animation for this?
-        int ms = animControllerTicks * ANIM_FRAME_DURATION_MS;
+        int ms = Timers::millis();
         for (int prevAnimIndex = 0; prevAnimIndex < animationCount; ++prevAnimIndex)
         {
-            auto prevAnim = animations[prevAnimIndex];
+            auto prevAnim = slots[order[prevAnimIndex]].instance;
             if (prevAnim->tag == tagToStop)
             {
                 // Fade out the previous animation pretty quickly
-                prevAnim->forceFadeOut(ms + fadeOutTimeMs);
+                fadeOutSlot(order[prevAnimIndex], ms + fadeOutTimeMs);
             }
         }
     }
@@ -281,13 +920,26 @@ namespace Modules::AnimController
     /// </summary>
     void stopAll()
     {
+        cancelScheduledPlays();
         for (int i = 0; i < animationCount; ++i)
         {
             // Delete the instance
-            Animations::destroyAnimationInstance(animations[i]);
+            fireEvent(order[i], AnimationEvent_Stopped);
+            Animations::destroyAnimationInstance(slots[order[i]].instance);
         }
-        animationCount = 0;
+        resetSlots();
+        disarmTimer();
         LEDs::clear();
+        notifyClientsIfActivityChanged();
+    }
+
+    void stopAll(const DataSet::AnimationBits* animationBits)
+    {
+        for (int i = animationCount - 1; i >= 0; --i) {
+            if (slots[order[i]].instance->animationBits == animationBits) {
+                removeAtIndex(i);
+            }
+        }
     }
 
     /// <summary>
@@ -298,44 +950,134 @@ namespace Modules::AnimController
     }
 
     /// <summary>
-    /// Helper method: Stop the animation at the given index. Used by Stop(IAnimation*)
+    /// Helper method: Stop the animation at the given index in the blending order, and destroy it
     /// </summary>
     void removeAtIndex(int animIndex)
     {
-        // Shift the other animations
-        for (; animIndex < animationCount - 1; ++animIndex)
-        {
-            animations[animIndex] = animations[animIndex + 1];
+        if (animIndex < 0 || animIndex >= animationCount) {
+            return;
         }
+        fireEvent(order[animIndex], AnimationEvent_Stopped);
+        freeSlot(order[animIndex]);
 
-        // Reduce the count
+        // Keep the blending order of the other animations
+        memmove(order + animIndex, order + animIndex + 1, animationCount - animIndex - 1);
         animationCount--;
     }
 
     void onProgrammingEvent(void* context, Flash::ProgrammingEventType evt){
         if (evt == Flash::ProgrammingEventType_Begin) {
             stop();
-        } else {
+            // The scheduled presets may be overwritten
+            cancelScheduledPlays();
+            // The presets are about to change
+            Animations::flushBakedAnimations();
+        } else if (evt == Flash::ProgrammingEventType_End) {
             start();
         }
     }
 
+    /// <summary>
+    /// Logs the running instances and sends their profiling report, in as many messages as needed
+    /// </summary>
     void printAnimControllerStateHandler(const Message* msg) {
-        NRF_LOG_DEBUG("Anim Controller has %d anims", animationCount);
-        for (int i = 0; i < animationCount; ++i) {
-            AnimationInstance* anim = animations[i];
-            NRF_LOG_DEBUG("Anim %d is of type %d, duration %d", i, anim->animationPreset->type, anim->animationPreset->duration);
-            NRF_LOG_DEBUG("StartTime %d, remapFace %d, loopCount %d", anim->startTime, anim->remapFace, anim->loopCount);
-        }
+        NRF_LOG_DEBUG("Anim Controller has %d anims, %d dropped", animationCount, droppedAnimationCount);
+        NRF_LOG_DEBUG("Instance pool: %d used, %d max used, %d failed allocs",
+            Animations::getAnimationInstanceCount(),
+            Animations::getAnimationInstanceHighWaterMark(),
+            Animations::getAnimationInstanceAllocFailures());
+
+        MessageAnimControllerState state;
+        state.animationCount = (uint8_t)animationCount;
+        state.poolUsed = (uint8_t)Animations::getAnimationInstanceCount();
+        state.poolHighWaterMark = (uint8_t)Animations::getAnimationInstanceHighWaterMark();
+        state.poolAllocFailures = (uint16_t)MIN(Animations::getAnimationInstanceAllocFailures(), 0xFFFF);
+        state.droppedAnimations = (uint16_t)MIN(droppedAnimationCount, 0xFFFF);
+        const int instanceSize = Animations::getAnimationInstanceSlotSize();
+
+        int i = 0;
+        do {
+            state.firstIndex = (uint8_t)i;
+            state.instanceCount = 0;
+            for (; i < animationCount && state.instanceCount < ANIM_CONTROLLER_STATE_INSTANCES; ++i) {
+                int slot = order[i];
+                AnimationInstance* anim = slots[slot].instance;
+                NRF_LOG_DEBUG("Anim %d is of type %d, duration %d", i, anim->animationPreset->type, anim->animationPreset->duration);
+                NRF_LOG_DEBUG("StartTime %d, remapFace %d, loopCount %d", anim->startTime, anim->remapFace, anim->loopCount);
+
+                auto& out = state.instances[state.instanceCount++];
+                memset(&out, 0, sizeof(out));
+                out.type = anim->animationPreset->type;
+                out.tag = anim->tag;
+                out.memorySize = (uint16_t)(anim->animationSize() + instanceSize);
+#if PROFILER_ENABLED
+                const auto& profile = slotProfiles[slot];
+                out.lastCycles = profile.lastCycles;
+                out.avgCycles = profile.frameCount > 0 ? profile.totalCycles / profile.frameCount : 0;
+                out.maxCycles = profile.maxCycles;
+                out.overdraw = profile.overdraw;
+#endif
+            }
+            MessageService::SendMessage(&state, offsetof(MessageAnimControllerState, instances) + state.instanceCount * sizeof(MessageAnimControllerState::Instance));
+        } while (i < animationCount);
     }
 
     void playLEDAnimHandler(const Message* msg) {
         auto playAnimMessage = (const MessagePlayAnim*)msg;
         NRF_LOG_DEBUG("Playing animation %d", playAnimMessage->animation);
         auto animationPreset = DataSet::getAnimation((int)playAnimMessage->animation);
-        play(
+        auto handle = play(
+            animationPreset,
+            DataSet::getAnimationBits(),
+            playAnimMessage->remapFace,
+            playAnimMessage->loopCount,
+            Animations::AnimationTag_BluetoothMessage);
+
+        if (sendAnimEvents && handle != ANIM_INVALID_HANDLE) {
+            // The app gets told what happens to the animation, the message fields travel in the param
+            const uintptr_t param = playAnimMessage->animation | (playAnimMessage->remapFace << 8);
+            watch(handle, [](void* param, AnimationHandle handle, AnimationEvent event) {
+                MessageAnimEvent eventMsg;
+                eventMsg.animation = (uint8_t)(uintptr_t)param;
+                eventMsg.remapFace = (uint8_t)((uintptr_t)param >> 8);
+                eventMsg.event = event;
+                MessageService::SendMessage(&eventMsg);
+            }, (void*)param);
+        }
+    }
+
+    void enableAnimEventsHandler(const Message* msg) {
+        sendAnimEvents = ((const MessageEnableAnimEvents*)msg)->enable != 0;
+        NRF_LOG_DEBUG("Animation events %s", sendAnimEvents ? "enabled" : "disabled");
+    }
+
+    /// <summary>
+    /// Tracks the offset to the shared clock. A message can only arrive late, never early, so
+    /// the largest offset of a burst is the one that was delayed the least by the connection.
+    /// </summary>
+    void syncTimeHandler(const Message* msg) {
+        auto syncTimeMessage = (const MessageSyncTime*)msg;
+        const uint32_t offset = syncTimeMessage->globalTime - (uint32_t)Timers::millis();
+        if (syncTimeMessage->restart || !globalTimeSynced || (int32_t)(offset - globalTimeOffset) > 0) {
+            globalTimeOffset = offset;
+        }
+        globalTimeSynced = true;
+        NRF_LOG_DEBUG("Time sync, offset is %d", globalTimeOffset);
+
+        MessageSyncTimeAck ackMsg;
+        ackMsg.globalTime = syncTimeMessage->globalTime;
+        ackMsg.dieGlobalTime = getGlobalTime();
+        MessageService::SendMessage(&ackMsg);
+    }
+
+    void playLEDAnimAtHandler(const Message* msg) {
+        auto playAnimMessage = (const MessagePlayAnimAt*)msg;
+        NRF_LOG_DEBUG("Playing animation %d at %d", playAnimMessage->animation, playAnimMessage->globalStartTime);
+        auto animationPreset = DataSet::getAnimation((int)playAnimMessage->animation);
+        playAtGlobalTime(
             animationPreset,
             DataSet::getAnimationBits(),
+            playAnimMessage->globalStartTime,
             playAnimMessage->remapFace,
             playAnimMessage->loopCount,
             Animations::AnimationTag_BluetoothMessage);
@@ -354,6 +1096,99 @@ namespace Modules::AnimController
         stopAll();
     }
 
+    /// <summary>
+    /// Computes the frame duration to use, based on the frame rate settings and, in adaptive
+    /// mode, on how fast the currently playing animations change.
+    /// </summary>
+    int computeFrameDuration() {
+        int fastDurationMs = 1000 / frameRate;
+        if (frameRateMode == FrameRateMode_Fixed) {
+            return fastDurationMs;
+        }
+
+        // Slow gradients and holds don't need more than the default rate, or half of it for long ones
+        int normalDurationMs = MAX(fastDurationMs, ANIM_FRAME_DURATION_MS);
+        int slowDurationMs = MAX(normalDurationMs, 2 * ANIM_FRAME_DURATION_MS);
+        int ret = slowDurationMs;
+        for (int i = 0; i < animationCount; ++i) {
+            auto preset = slots[order[i]].instance->animationPreset;
+            switch (preset->type) {
+                case Animation_BlinkId:
+                    // The blink id pattern is encoded one bit per default frame
+                    return ANIM_FRAME_DURATION_MS;
+                case Animation_Rainbow:
+                case Animation_Worm:
+                case Animation_Noise:
+                case Animation_Cycle:
+                    // Colors move every frame
+                    ret = MIN(ret, fastDurationMs);
+                    break;
+                default:
+                    if (preset->duration < 1000) {
+                        ret = MIN(ret, normalDurationMs);
+                    }
+                    break;
+            }
+        }
+        return ret;
+    }
+
+    /// <summary>
+    /// Restarts the update timer if the frame duration needs to change
+    /// </summary>
+    void updateFrameDuration() {
+        int newDurationMs = computeFrameDuration();
+        if (newDurationMs != frameDurationMs) {
+            frameDurationMs = newDurationMs;
+            if (timerArmed) {
+                Timers::stopTimer(animControllerTimer);
+                Timers::startTimer(animControllerTimer, frameDurationMs);
+            }
+        }
+    }
+
+    void setFrameRate(FrameRateMode mode, uint8_t fps) {
+        frameRateMode = mode;
+        frameRate = CLAMP(fps, ANIM_MIN_FPS, ANIM_MAX_FPS);
+        updateFrameDuration();
+        NRF_LOG_INFO("Anim frame rate mode %d, %d fps, %d ms frames", frameRateMode, frameRate, frameDurationMs);
+    }
+
+    FrameRateMode getFrameRateMode() {
+        return frameRateMode;
+    }
+
+    uint8_t getFrameRate() {
+        return frameRate;
+    }
+
+    int getFrameDurationMs() {
+        return frameDurationMs;
+    }
+
+    void sendFrameRate() {
+        MessageFrameRate frameRateMsg;
+        frameRateMsg.mode = frameRateMode;
+        frameRateMsg.fps = frameRate;
+        frameRateMsg.frameDurationMs = (uint8_t)frameDurationMs;
+        MessageService::SendMessage(&frameRateMsg);
+    }
+
+    void setFrameRateHandler(const Message* msg) {
+        auto setFrameRateMsg = (const MessageSetFrameRate*)msg;
+        if (setFrameRateMsg->mode < FrameRateMode_Count) {
+            setFrameRate(setFrameRateMsg->mode, setFrameRateMsg->fps);
+        } else {
+            // Keep the current settings, the reply tells the central what they are
+            NRF_LOG_WARNING("Invalid frame rate mode %d", setFrameRateMsg->mode);
+        }
+        sendFrameRate();
+    }
+
+    void requestFrameRateHandler(const Message* msg) {
+        sendFrameRate();
+    }
+
     /// <summary>
     /// Method used by clients to request timer callbacks
     /// </summary>
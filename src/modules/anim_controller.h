@@ -3,9 +3,13 @@
 #include "stdint.h"
 #include "animations/Animation.h"
 
-// Frame duration = time between each animation update, in ms.
+// Default frame duration = time between each animation update, in ms.
 #define ANIM_FRAME_DURATION_MS 33
 
+// Range of supported frame rates
+#define ANIM_MIN_FPS 10
+#define ANIM_MAX_FPS 60
+
 namespace Animations
 {
     struct Animation;
@@ -17,6 +21,10 @@ namespace Animations
 /// </summary>
 namespace Modules::AnimController
 {
+    // Identifies a running animation instance, stays unique until the instance is removed
+    typedef uint16_t AnimationHandle;
+    #define ANIM_INVALID_HANDLE ((Modules::AnimController::AnimationHandle)0xFFFF)
+
     void stopAtIndex(int animIndex);
     void removeAtIndex(int animIndex);
 
@@ -24,12 +32,59 @@ namespace Modules::AnimController
     void stop();
     void start();
 
-    void play(const Animations::Animation* animationPreset, const DataSet::AnimationBits* animationBits, uint8_t remapFace = 0, uint8_t loopCount = 1, Animations::AnimationTag tag = Animations::AnimationTag_Unknown);
+    AnimationHandle play(const Animations::Animation* animationPreset, const DataSet::AnimationBits* animationBits, uint8_t remapFace = 0, uint8_t loopCount = 1, Animations::AnimationTag tag = Animations::AnimationTag_Unknown);
+    // Plays an animation triggered by another one (e.g. a sequence item), from the time it was due.
+    // It is started as soon as the controller is done with the calling animation, in the same frame.
+    void playAt(const Animations::Animation* animationPreset, const DataSet::AnimationBits* animationBits, int startTime, uint8_t remapFace = 0, uint8_t loopCount = 1, Animations::AnimationTag tag = Animations::AnimationTag_Unknown);
+    // Plays an animation at a time of the clock shared with other dice (see MessageSyncTime),
+    // or right away if the die isn't synced. Late starts catch up so all the dice show the same frame.
+    void playAtGlobalTime(const Animations::Animation* animationPreset, const DataSet::AnimationBits* animationBits, uint32_t globalStartTime, uint8_t remapFace = 0, uint8_t loopCount = 1, Animations::AnimationTag tag = Animations::AnimationTag_Unknown);
+    bool isTimeSynced();
+    uint32_t getGlobalTime();
     void stop(const Animations::Animation* animationPreset, uint8_t remapFace = 0);
+    void stop(AnimationHandle handle);
+    bool isPlaying(AnimationHandle handle);
+
+    // What happened to a watched animation instance, Ended and Stopped are the last event
+    enum AnimationEvent : uint8_t
+    {
+        AnimationEvent_Loop = 0,    // Started another loop
+        AnimationEvent_FadeOut,     // Forced to fade out, e.g. replaced by a new instance
+        AnimationEvent_Ended,       // Played to the end (of the fade out if any)
+        AnimationEvent_Stopped,     // Removed before its end (stopped or evicted)
+    };
+
+    // The callback is called from the main loop, outside of the animation update, so it may play
+    // animations. Only a few instances can be watched at once, returns false if the handle isn't
+    // playing or there is no room.
+    typedef void(*AnimationEventCallback)(void* param, AnimationHandle handle, AnimationEvent event);
+    bool watch(AnimationHandle handle, AnimationEventCallback callback, void* param);
     void fadeOutAnimsWithTag(Animations::AnimationTag tagToStop, int fadeOutTimeMs);
     void stopAll();
 
-    // Notification management
+    // Stops every instance playing from the given animation bits, leaving the others running
+    void stopAll(const DataSet::AnimationBits* animationBits);
+
+    // Number of animations that couldn't be played because all the slots were taken by
+    // animations of a higher priority (or because the instance couldn't be created)
+    uint32_t getDroppedAnimationCount();
+
+    enum FrameRateMode : uint8_t
+    {
+        FrameRateMode_Fixed = 0,    // Update at the requested frame rate
+        FrameRateMode_Adaptive,     // Pick a frame rate based on the animations being played
+        FrameRateMode_Count
+    };
+
+    // In adaptive mode the frame rate parameter is the highest rate to use
+    void setFrameRate(FrameRateMode mode, uint8_t fps);
+    FrameRateMode getFrameRateMode();
+    uint8_t getFrameRate();
+    int getFrameDurationMs();
+
+    // Notification management, clients are called from the main loop when animations
+    // start or stop playing (see isAnimating)
+    bool isAnimating();
     typedef void(*AnimControllerClientMethod)(void* param);
     void hook(AnimControllerClientMethod method, void* param);
     void unHook(AnimControllerClientMethod client);
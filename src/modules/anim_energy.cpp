@@ -0,0 +1,203 @@
+#include "anim_energy.h"
+#include "animations/animation.h"
+#include "data_set/data_animation_bits.h"
+#include "data_set/animation_bits_cache.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "drivers_nrf/timers.h"
+#include "leds.h"
+#include "utils/utils.h"
+#include "nrf_log.h"
+#include <stddef.h>
+#include <string.h>
+
+// Longest time a frame is assumed to stay on the LEDs, frames come much faster than that while
+// animating, this only matters for the first frame after the LEDs were off for a while
+#define ANIM_ENERGY_MAX_FRAME_MS 100
+
+#define MICRO_AMP_MS_PER_NANO_AMP_HOUR 3600
+
+using namespace Animations;
+using namespace Bluetooth;
+using namespace DataSet;
+using namespace DriversNRF;
+
+namespace Modules::AnimEnergy
+{
+    // Whole nano amp hours, plus what is left over to keep the small per frame amounts
+    struct Charge
+    {
+        uint32_t nanoAmpHours;
+        uint32_t remainderMicroAmpMs;
+    };
+
+    struct TrackedAnim
+    {
+        const Animation* preset;
+        const AnimationBits* bits;
+        Charge charge;
+    };
+
+    static Charge totalCharge;
+    static Charge tagCharges[AnimationTag_Count];
+    static TrackedAnim trackedAnims[ANIM_ENERGY_TRACKED_ANIMS];
+    static uint8_t trackedAnimCount;
+    static uint32_t resetTime;
+
+    // The frame being composited, its charge is split according to the intensity each animation
+    // contributed, since blending doesn't let us tell which animation lit what in the end
+    static int lastFrameMs;
+    static int frameDurationMs;
+    static uint32_t frameLevels;
+    static uint32_t tagLevels[AnimationTag_Count];
+    static uint32_t trackedLevels[ANIM_ENERGY_TRACKED_ANIMS];
+
+    void requestAnimEnergyStatsHandler(const Message* msg);
+
+    void init() {
+        reset();
+        lastFrameMs = Timers::millis() - ANIM_ENERGY_MAX_FRAME_MS;
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestAnimEnergyStats, requestAnimEnergyStatsHandler);
+        NRF_LOG_DEBUG("Anim energy init");
+    }
+
+    static void addCharge(Charge& charge, uint32_t microAmpMs) {
+        charge.remainderMicroAmpMs += microAmpMs;
+        if (charge.remainderMicroAmpMs >= MICRO_AMP_MS_PER_NANO_AMP_HOUR) {
+            charge.nanoAmpHours += charge.remainderMicroAmpMs / MICRO_AMP_MS_PER_NANO_AMP_HOUR;
+            charge.remainderMicroAmpMs %= MICRO_AMP_MS_PER_NANO_AMP_HOUR;
+        }
+    }
+
+    static bool isLess(const Charge& a, const Charge& b) {
+        return a.nanoAmpHours < b.nanoAmpHours ||
+            (a.nanoAmpHours == b.nanoAmpHours && a.remainderMicroAmpMs < b.remainderMicroAmpMs);
+    }
+
+    /// <summary>
+    /// Returns the entry of the animation, taking the one that cost the least so far if it isn't tracked yet
+    /// </summary>
+    static int getTrackedAnim(const Animation* preset, const AnimationBits* bits) {
+        for (int i = 0; i < trackedAnimCount; ++i) {
+            if (trackedAnims[i].preset == preset && trackedAnims[i].bits == bits) {
+                return i;
+            }
+        }
+        int index = trackedAnimCount;
+        if (trackedAnimCount < ANIM_ENERGY_TRACKED_ANIMS) {
+            trackedAnimCount++;
+        } else {
+            index = 0;
+            for (int i = 1; i < ANIM_ENERGY_TRACKED_ANIMS; ++i) {
+                if (isLess(trackedAnims[i].charge, trackedAnims[index].charge)) {
+                    index = i;
+                }
+            }
+        }
+        trackedAnims[index].preset = preset;
+        trackedAnims[index].bits = bits;
+        trackedAnims[index].charge = { 0, 0 };
+        trackedLevels[index] = 0;
+        return index;
+    }
+
+    void beginFrame(int ms) {
+        frameDurationMs = ms - lastFrameMs;
+        if (frameDurationMs < 0) {
+            frameDurationMs = 0;
+        } else if (frameDurationMs > ANIM_ENERGY_MAX_FRAME_MS) {
+            frameDurationMs = ANIM_ENERGY_MAX_FRAME_MS;
+        }
+        lastFrameMs = ms;
+        frameLevels = 0;
+        memset(tagLevels, 0, sizeof(tagLevels));
+        memset(trackedLevels, 0, sizeof(trackedLevels));
+    }
+
+    void addAnimation(const AnimationInstance* anim, const uint32_t* colors, int count, uint32_t fadePercentTimes1000) {
+        uint32_t levels = 0;
+        for (int i = 0; i < count; ++i) {
+            uint32_t color = colors[i];
+            levels += Utils::getRed(color) + Utils::getGreen(color) + Utils::getBlue(color);
+        }
+        levels = levels * fadePercentTimes1000 / 1000;
+        if (levels == 0) {
+            return;
+        }
+
+        frameLevels += levels;
+        if (anim->tag < AnimationTag_Count) {
+            tagLevels[anim->tag] += levels;
+        }
+        trackedLevels[getTrackedAnim(anim->animationPreset, anim->animationBits)] += levels;
+    }
+
+    void endFrame(const uint32_t* colors) {
+        if (frameLevels == 0 || frameDurationMs == 0) {
+            return;
+        }
+
+        uint32_t microAmpMs = LEDs::estimateCurrentNanoAmps(colors, nullptr) / 1000 * frameDurationMs;
+        addCharge(totalCharge, microAmpMs);
+        for (int i = 0; i < AnimationTag_Count; ++i) {
+            if (tagLevels[i] != 0) {
+                addCharge(tagCharges[i], (uint32_t)((uint64_t)microAmpMs * tagLevels[i] / frameLevels));
+            }
+        }
+        for (int i = 0; i < trackedAnimCount; ++i) {
+            if (trackedLevels[i] != 0) {
+                addCharge(trackedAnims[i].charge, (uint32_t)((uint64_t)microAmpMs * trackedLevels[i] / frameLevels));
+            }
+        }
+    }
+
+    uint32_t getTotalNanoAmpHours() {
+        return totalCharge.nanoAmpHours;
+    }
+
+    void reset() {
+        totalCharge = { 0, 0 };
+        memset(tagCharges, 0, sizeof(tagCharges));
+        trackedAnimCount = 0;
+        resetTime = Timers::millis();
+    }
+
+    void requestAnimEnergyStatsHandler(const Message* msg) {
+        auto req = (const MessageRequestAnimEnergyStats*)msg;
+
+        MessageAnimEnergyStats stats;
+        stats.time = Timers::millis() - resetTime;
+        stats.totalNanoAmpHours = totalCharge.nanoAmpHours;
+        stats.tagCount = AnimationTag_Count;
+        for (int i = 0; i < AnimationTag_Count; ++i) {
+            stats.tagNanoAmpHours[i] = tagCharges[i].nanoAmpHours;
+        }
+        stats.animCount = trackedAnimCount;
+        for (int i = 0; i < trackedAnimCount; ++i) {
+            auto& tracked = trackedAnims[i];
+            auto& out = stats.anims[i];
+            out.source = 0xFF;
+            out.animationIndex = 0xFFFF;
+            out.nanoAmpHours = tracked.charge.nanoAmpHours;
+
+            // Only bits still used by a source are looked into, others may have been freed since
+            for (int s = 0; s < AnimationBitsCache::Source_Count; ++s) {
+                if (tracked.bits == AnimationBitsCache::getBits((AnimationBitsCache::Source)s)) {
+                    out.source = s;
+                    for (int a = 0; a < tracked.bits->getAnimationCount(); ++a) {
+                        if (tracked.bits->getAnimation(a) == tracked.preset) {
+                            out.animationIndex = a;
+                            break;
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+        MessageService::SendMessage(&stats, offsetof(MessageAnimEnergyStats, anims) + trackedAnimCount * sizeof(MessageAnimEnergyStats::Anim));
+
+        if (req->reset) {
+            reset();
+        }
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+// Number of animations whose charge is tracked individually, the cheapest one is dropped to make room
+#define ANIM_ENERGY_TRACKED_ANIMS 8
+
+namespace Animations
+{
+    class AnimationInstance;
+}
+
+/// <summary>
+/// Integrates the estimated LED charge drawn by animations, per animation tag and for the
+/// animations that cost the most, so the app can tell how much battery a profile uses.
+/// The animation controller reports each frame as it composites it.
+/// </summary>
+namespace Modules::AnimEnergy
+{
+    void init();
+
+    // Called by the animation controller while compositing a frame, with the colors each
+    // animation rendered (before blending) and finally the colors sent to the LEDs
+    void beginFrame(int ms);
+    void addAnimation(const Animations::AnimationInstance* anim, const uint32_t* colors, int count, uint32_t fadePercentTimes1000);
+    void endFrame(const uint32_t* colors);
+
+    uint32_t getTotalNanoAmpHours();
+    void reset();
+}
@@ -6,23 +6,20 @@
 #include "drivers_nrf/power_manager.h"
 #include "animations/blink.h"
 #include "modules/battery_controller.h"
+#include "modules/charger_proximity.h"
 #include "drivers_nrf/rng.h"
 
 using namespace DriversNRF;
 using namespace Modules;
 
-#define ATTRACT_MODE_TIMER_MS 1000
 #define MIN_BATTERY_LEVEL_PERCENT 20
 #define MAX_BATTERY_LEVEL_PERCENT 50
-#define VCOIL_OFF_THRESHOLD 3000 // milliVolts
-#define VCOIL_ON_THRESHOLD 4000 // milliVolts
+#define RECHARGING_BLINK_INTERVAL_MS 3000
 
 namespace Modules::AttractModeController
 {
-    APP_TIMER_DEF(attractModeTimer);
-
-    int nextAnimationStartMs;
     int nextAnimationIndex;
+    static AnimController::AnimationHandle currentAnimation = ANIM_INVALID_HANDLE;
 
     enum CurrentState {
         State_Unknown = 0,
@@ -34,84 +31,99 @@ namespace Modules::AttractModeController
 
     CurrentState currentState = State_Unknown;
 
-    void update(void* context);
+    void setState(CurrentState newState);
+    void playAnimation(int index);
+    void onAnimationEvent(void* param, AnimController::AnimationHandle handle, AnimController::AnimationEvent event);
+    void onChargerStateChange(void* param, ChargerProximity::ChargerProximityState newState);
+    void onBatteryLevelChange(void* param, uint8_t levelPercent);
+    void blinkRecharging(void* param);
 
     void init() {
+        // Nothing is polled, the demo moves on when an animation ends or the charger state changes
+        ChargerProximity::hook(onChargerStateChange, nullptr);
+        BatteryController::hookLevel(onBatteryLevelChange, nullptr);
 
-        Timers::createTimer(&attractModeTimer, APP_TIMER_MODE_REPEATED, update);
-        Timers::startTimer(attractModeTimer, ATTRACT_MODE_TIMER_MS, NULL);
+        // A store display stays on for hours
+        PowerManager::pause();
 
-        auto anim = DataSet::getAnimation(0);
         nextAnimationIndex = 1 % DataSet::getAnimationCount();
-        nextAnimationStartMs = Timers::millis() + anim->duration;
-        AnimController::play(anim, DataSet::getAnimationBits(), Accelerometer::currentFace());
+        playAnimation(0);
         BatteryController::setControllerOverrideMode(BatteryController::ControllerOverrideMode_ForceEnableCharging);
         currentState = State_Attract;
+        if (ChargerProximity::getState() == ChargerProximity::ChargerProximityState_Off) {
+            setState(State_Off);
+        } else if (BatteryController::getLevelPercent() <= MIN_BATTERY_LEVEL_PERCENT) {
+            setState(State_Recharging);
+        }
 
         NRF_LOG_INFO("Attract Mode init");
     }
 
-    void update(void* context) {
-        auto coil = BatteryController::getCoilVoltageMilli();
-        auto battery = BatteryController::getLevelPercent();
-        switch (currentState) {
-            case State_Off:
-                // We are waiting for the die to be put on the charger
-                if (coil > VCOIL_ON_THRESHOLD) {
-                    if (battery > MIN_BATTERY_LEVEL_PERCENT) {
-                        currentState = State_Attract;
-                    } else {
-                        currentState = State_Recharging;
-                    }
-                }
-                // Else stay here
-                break;
+    void playAnimation(int index) {
+        auto anim = DataSet::getAnimation(index);
+        currentAnimation = AnimController::play(anim, DataSet::getAnimationBits(), Accelerometer::currentFace());
+        AnimController::watch(currentAnimation, onAnimationEvent, nullptr);
+    }
+
+    void playNextAnimation() {
+        const int index = nextAnimationIndex;
+        nextAnimationIndex = RNG::fastUInt32() % DataSet::getAnimationCount();
+        playAnimation(index);
+    }
+
+    void setState(CurrentState newState) {
+        if (newState == currentState) {
+            return;
+        }
+        NRF_LOG_INFO("Attract Mode state %d", newState);
+        if (currentState == State_Recharging) {
+            Timers::cancelDelayedCallback(blinkRecharging);
+        }
+        currentState = newState;
+        switch (newState) {
             case State_Recharging:
-                if (coil > VCOIL_OFF_THRESHOLD) {
-                    if (battery > MAX_BATTERY_LEVEL_PERCENT) {
-                        currentState = State_Attract;
-                    } else {
-                        // Else stay here
-                        // Blink repeatedly
-                        int millis = Timers::millis();
-                        if (millis > nextAnimationStartMs) {
-                            nextAnimationStartMs = millis + 3000;
-                            static Blink blink;
-                            auto layout = Config::DiceVariants::getLayout(Config::SettingsManager::getLayoutType());
-                            blink.play(0x040000, 1000, 1, 255, layout->getTopFace(), 1);
-                        }
-                    }
-                } else {
-                    // Came off the coil
-                    currentState = State_Off;
-                }
+                blinkRecharging(nullptr);
                 break;
             case State_Attract:
-                if (coil > VCOIL_OFF_THRESHOLD) {
-                    if (battery > MIN_BATTERY_LEVEL_PERCENT) {
-                        // Play animations
-                        int millis = Timers::millis();
-                        if (millis > nextAnimationStartMs) {
-                            auto anim = DataSet::getAnimation(nextAnimationIndex);
-                            nextAnimationIndex = RNG::randomUInt32() % DataSet::getAnimationCount();
-                            nextAnimationStartMs = millis + anim->duration;
-                            AnimController::play(anim, DataSet::getAnimationBits(), Accelerometer::currentFace());
-                        }
-                    } else {
-                        // Go to recharging mode
-                        currentState = State_Recharging;
-                    }
-                } else {
-                    // Came off the coil
-                    currentState = State_Off;
+                if (!AnimController::isPlaying(currentAnimation)) {
+                    playNextAnimation();
                 }
                 break;
-            case State_AttractCooldown:
             default:
-                NRF_LOG_WARNING("Attract Mode in invalid state");
+                // The last animation (if any) plays until its end
                 break;
         }
-        
-        PowerManager::feed();
+    }
+
+    void blinkRecharging(void* param) {
+        static Blink blink;
+        auto layout = Config::DiceVariants::getLayout(Config::SettingsManager::getLayoutType());
+        blink.play(0x040000, 1000, 1, 255, layout->getTopFace(), 1);
+        Timers::setDelayedCallback(blinkRecharging, nullptr, RECHARGING_BLINK_INTERVAL_MS);
+    }
+
+    void onAnimationEvent(void* param, AnimController::AnimationHandle handle, AnimController::AnimationEvent event) {
+        // Chain the next animation once the last one is done
+        const bool over = event == AnimController::AnimationEvent_Ended || event == AnimController::AnimationEvent_Stopped;
+        if (over && currentState == State_Attract) {
+            playNextAnimation();
+        }
+    }
+
+    void onChargerStateChange(void* param, ChargerProximity::ChargerProximityState newState) {
+        if (newState == ChargerProximity::ChargerProximityState_Off) {
+            // Waiting for the die to be put back on the charger
+            setState(State_Off);
+        } else if (currentState == State_Off) {
+            setState(BatteryController::getLevelPercent() > MIN_BATTERY_LEVEL_PERCENT ? State_Attract : State_Recharging);
+        }
+    }
+
+    void onBatteryLevelChange(void* param, uint8_t levelPercent) {
+        if (currentState == State_Attract && levelPercent <= MIN_BATTERY_LEVEL_PERCENT) {
+            setState(State_Recharging);
+        } else if (currentState == State_Recharging && levelPercent > MAX_BATTERY_LEVEL_PERCENT) {
+            setState(State_Attract);
+        }
     }
 }
@@ -6,6 +6,7 @@
 #include "drivers_hw/coil.h"
 #include "drivers_hw/ntc.h"
 #include "config/settings.h"
+#include "config/static_subscribers.h"
 #include "nrf_log.h"
 #include "utils/utils.h"
 #include "leds.h"
@@ -25,10 +26,12 @@ using namespace Utils;
 #define BATTERY_TIMER_MS 1000	// ms
 #define BATTERY_TIMER_MS_SLOW 5000	// ms
 #define BATTERY_TIMER_MS_FAST 300 // ms
+#define BATTERY_TIMER_MS_STEADY 15000 // ms, off the charger with nothing changing, only voltage drifts
+#define BATTERY_LED_SETTLE_MS 100 // ms, VBat recovery after the LEDs are turned off
 
 #define MAX_STATE_CLIENTS 2
 #define MAX_BATTERY_CLIENTS 4
-#define MAX_LEVEL_CLIENTS 2
+#define MAX_LEVEL_CLIENTS 3
 #define VBAT_LOOKUP_SIZE 11
 #define BATTERY_EMPTY_PCT 1 // 1%
 #define BATTERY_LOW_PCT 10 // 10%
@@ -46,6 +49,7 @@ using namespace Utils;
 #define MAX_CHARGE_START_TIME 3000 //ms
 #define MAX_CHARGE_START_TIME_SLOW (BATTERY_TIMER_MS_SLOW + 100) //ms
 #define VBAT_MEASUREMENT_THRESHOLD 50 //mV
+#define VBAT_INTERNAL_RESISTANCE_MILLIOHMS 350 // Cell and protection circuit, for the drop under LED load
 
 namespace Modules::BatteryController
 {
@@ -53,6 +57,8 @@ namespace Modules::BatteryController
     void update(void* context);
     void onBatteryEventHandler(void* context, Battery::ChargingEvent evt);
     void onLEDPowerEventHandler(void* context, bool powerOn);
+    void onCoilStateChangeHandler(void* context, Coil::CoilState newState);
+    void updateNow();
     void updateLevelPercent();
     State computeNewState();
     BatteryState computeNewBatteryState();
@@ -94,6 +100,7 @@ namespace Modules::BatteryController
     // static uint32_t smoothedLevel = 0;
     static uint8_t levelPercent = 0;
     static bool charging = false;
+    static bool ledsPowered = false;
     static uint16_t batteryTimerMs = BATTERY_TIMER_MS;
     static ControllerOverrideMode overrideMode = ControllerOverrideMode_Default;
 
@@ -132,8 +139,15 @@ namespace Modules::BatteryController
         // Register for battery events
         Battery::hook(onBatteryEventHandler, nullptr);
 
-        // Register for led events
-        //LEDs::hookPowerState(onLEDPowerEventHandler, nullptr);
+        // Register for led and coil events
+        LEDs::hookPowerState(onLEDPowerEventHandler, nullptr);
+        Coil::hook(onCoilStateChangeHandler, nullptr);
+
+        // Charging depends on when these are crossed
+        Temperature::watchNTCThreshold(TEMPERATURE_TOO_COLD);
+        Temperature::watchNTCThreshold(TEMPERATURE_TOO_HOT);
+        Temperature::watchNTCThreshold(TEMPERATURE_COOLDOWN_ENTER);
+        Temperature::watchNTCThreshold(TEMPERATURE_COOLDOWN_LEAVE);
 
         int ntcTimes100 = Temperature::getNTCTemperatureTimes100();
         if (ntcTimes100 <= -2000 || ntcTimes100 >= 10000) {
@@ -161,7 +175,7 @@ namespace Modules::BatteryController
         currentBatteryState = computeNewBatteryState();
         
         Timers::createTimer(&batteryControllerTimer, APP_TIMER_MODE_SINGLE_SHOT, update);
-        Timers::startTimer(batteryControllerTimer, batteryTimerMs);
+        Timers::startTimerAligned(batteryControllerTimer, batteryTimerMs);
 
         MessageService::RegisterMessageHandler(Message::MessageType_SetBatteryControllerMode, onSetBatteryControllerModeHandler);
 
@@ -169,8 +183,16 @@ namespace Modules::BatteryController
     }
 
     void readBatteryValues() {
+        // The LEDs pull VBat down, add back the drop across the battery's internal resistance
+        // for the current they are estimated to draw at the time of the reading (including
+        // the idle draw while they are pre-powered)
+        int32_t measuredVBatMilli = Battery::checkVBatTimes1000();
+        if (ledsPowered) {
+            measuredVBatMilli += (int32_t)LEDs::computeCurrentEstimate() * VBAT_INTERNAL_RESISTANCE_MILLIOHMS / 1000;
+        }
+
         // VBat should only be updated if the difference between the stored and measured value is enough
-        auto newVBatMilli = clamp<int32_t>(Battery::checkVBatTimes1000(), 0, MAX_V_MILLIS);
+        auto newVBatMilli = clamp<int32_t>(measuredVBatMilli, 0, MAX_V_MILLIS);
         if ((newVBatMilli < vBatMilli - VBAT_MEASUREMENT_THRESHOLD) || (newVBatMilli > vBatMilli + VBAT_MEASUREMENT_THRESHOLD)) {
             vBatMilli = newVBatMilli;
         }
@@ -374,6 +396,26 @@ namespace Modules::BatteryController
         return ret;
     }
 
+    /// <summary>
+    /// Time until the next poll. Charger, coil and LED power changes trigger an update right away,
+    /// so polling only needs to be quick while the state can change on its own (transitions,
+    /// charging, temperature).
+    /// </summary>
+    static uint32_t nextUpdateDelayMs() {
+        bool steady = currentUpdateRate != UpdateRate_Fast
+            && !charging
+            && Coil::getCoilState() == Coil::CoilState_Off
+            && (currentBatteryTempState == BatteryTemperatureState_Normal || currentBatteryTempState == BatteryTemperatureState_Disabled)
+            && (currentState == State_Ok || currentState == State_Low || currentState == State_Empty);
+        return steady ? MAX(batteryTimerMs, BATTERY_TIMER_MS_STEADY) : batteryTimerMs;
+    }
+
+    void updateNow() {
+        // Starting a running timer does nothing, so stop it first for update() to restart it
+        Timers::stopTimer(batteryControllerTimer);
+        update(nullptr);
+    }
+
     void update(void* context) {
         // // DEBUG
         // Battery::printA2DReadings();
@@ -505,12 +547,14 @@ namespace Modules::BatteryController
         auto newBatteryState = computeNewBatteryState();
         if (newBatteryState != currentBatteryState) {
             currentBatteryState = newBatteryState;
+            StaticSubscribers::BatteryState::Call(newBatteryState);
             for (int i = 0; i < batteryClients.Count(); ++i) {
                 batteryClients[i].handler(batteryClients[i].token, newBatteryState);
             }
         }
 
         if (prevLevel != levelPercent) {
+            StaticSubscribers::BatteryLevel::Call(levelPercent);
             for (int i = 0; i < levelClients.Count(); ++i) {
                 levelClients[i].handler(levelClients[i].token, levelPercent);
             }
@@ -524,7 +568,7 @@ namespace Modules::BatteryController
             }
         }
 
-        Timers::startTimer(batteryControllerTimer, batteryTimerMs);
+        Timers::startTimerAligned(batteryControllerTimer, nextUpdateDelayMs());
     }
 
     void setUpdateRate(UpdateRate rate) {
@@ -543,18 +587,20 @@ namespace Modules::BatteryController
     }
 
     void onBatteryEventHandler(void* context, Battery::ChargingEvent evt) {
-        update(nullptr);
+        updateNow();
+    }
+
+    void onCoilStateChangeHandler(void* context, Coil::CoilState newState) {
+        updateNow();
     }
 
     void onLEDPowerEventHandler(void* context, bool powerOn) {
-        if (powerOn) {
-            // Stop reading battery voltage as it may significantly drop when LEDs are turned on
-            Timers::stopTimer(batteryControllerTimer);
-        } else {
+        // Readings taken while the LEDs are on are compensated for their current (see readBatteryValues)
+        ledsPowered = powerOn;
+        if (!powerOn) {
+            // Read the voltage again once it has recovered
             Timers::stopTimer(batteryControllerTimer);
-
-            // Restart the timer
-            Timers::startTimer(batteryControllerTimer, batteryTimerMs);
+            Timers::startTimer(batteryControllerTimer, BATTERY_LED_SETTLE_MS);
         }
     }
 
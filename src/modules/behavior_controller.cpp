@@ -7,6 +7,13 @@
 #include "modules/accelerometer.h"
 #include "data_set/data_set.h"
 #include "config/settings.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "modules/anim_controller.h"
+#include "modules/leds.h"
+#include "data_set/data_animation_bits.h"
+#include "data_set/animation_bits_cache.h"
+#include "behaviors/action.h"
 #include "nrf_log.h"
 #include "die.h"
 #include "nrf_assert.h"
@@ -20,17 +27,71 @@ using namespace DataSet;
 #define CONDITION_RECHECK_MAX 8
 #define BATT_TOO_LOW_LEVEL 50 // 50%
 
+// How long the LEDs stay powered ahead of a roll result
+#define ROLL_LED_PRE_POWER_TIMEOUT_MS 1000
+
+// Animations the app can have played on the next roll event (see MessageArmAnimTrigger)
+#define MAX_ARMED_TRIGGERS 4
+
 namespace Modules::BehaviorController
 {
     void onConnectionEvent(void* param, bool connected);
     void onBatteryStateChange(void* param, BatteryController::BatteryState newState);
     void onRollStateChange(void* param, Accelerometer::RollState prevState, int prevFace, Accelerometer::RollState newState, int newFace);
+    void onLikelyFace(void* param, int face, int confidenceTimes1000);
+    void armAnimTriggerHandler(const Message* msg);
+    void disarmAnimTriggersHandler(const Message* msg);
+    void onArmedTriggersConnectionEvent(void* param, bool connected);
+    void fireArmedTriggers(Accelerometer::RollState newState, int newFace);
+
+    // Triggers armed by the app, they fire once and are dropped when the app disconnects
+    struct ArmedTrigger
+    {
+        uint32_t faceMask;
+        uint8_t triggerId;
+        Accelerometer::RollState rollState; // RollState_Unknown when the entry is free
+        AnimTriggerSource source;
+        uint8_t animation;
+        uint8_t remapFace;
+        uint8_t loopCount;
+    };
+    static ArmedTrigger armedTriggers[MAX_ARMED_TRIGGERS];
+    static int armedTriggerCount = 0;
 
     int lastRollStateTimestamp;
+
+    // Face for which the rolled rules were triggered early, -1 if none
+    int earlyRolledFace = -1;
     int disableAccelerometerRulesCount;
     int disableBatteryRulesCount;
     int disableConnectionRulesCount;
 
+    /// <summary>
+    /// Calls func(ruleIndex, rule, condition) for each behavior rule with the given type of condition,
+    /// in rule order. Uses the data set buckets so other rules aren't even looked at.
+    /// </summary>
+    template <typename F>
+    void forEachRule(Behaviors::ConditionType conditionType, F func) {
+        uint16_t count = 0;
+        auto ruleIndices = DataSet::getRulesForCondition(conditionType, count);
+        if (ruleIndices != nullptr) {
+            for (int i = 0; i < count; ++i) {
+                auto rule = DataSet::getRule(ruleIndices[i]);
+                func(ruleIndices[i], rule, DataSet::getCondition(rule->condition));
+            }
+        } else {
+            // Data set isn't indexed, check every rule
+            auto bhv = DataSet::getBehavior();
+            for (int i = 0; i < bhv->rulesCount; ++i) {
+                auto rule = DataSet::getRule(bhv->rulesOffset + i);
+                auto condition = rule != nullptr ? DataSet::getCondition(rule->condition) : nullptr;
+                if (condition != nullptr && condition->type == conditionType) {
+                    func(bhv->rulesOffset + i, rule, condition);
+                }
+            }
+        }
+    }
+
     void init(bool enableAccelerometerRules, bool enableBatteryRules, bool enableConnectionRules) {
 
         // Hook up the behavior controller to all the events it needs to know about to do its job!
@@ -48,6 +109,9 @@ namespace Modules::BehaviorController
             EnableConnectionRules();
         }
 
+        MessageService::RegisterMessageHandler(Message::MessageType_ArmAnimTrigger, armAnimTriggerHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_DisarmAnimTriggers, disarmAnimTriggersHandler);
+
         NRF_LOG_DEBUG("Behavior Controller init");
     }
 
@@ -55,6 +119,7 @@ namespace Modules::BehaviorController
         disableAccelerometerRulesCount += 1;
         if (disableAccelerometerRulesCount == 1) {
             Accelerometer::unHookRollState(onRollStateChange);
+            Accelerometer::unHookLikelyFace(onLikelyFace);
         }
     }
 
@@ -62,6 +127,7 @@ namespace Modules::BehaviorController
         disableAccelerometerRulesCount -= 1;
         if (disableAccelerometerRulesCount == 0) {
             Accelerometer::hookRollState(onRollStateChange, nullptr);
+            Accelerometer::hookLikelyFace(onLikelyFace, nullptr);
         }
     }
 
@@ -95,31 +161,23 @@ namespace Modules::BehaviorController
 
     void onPixelInitialized() {
 
-        // Do we have a hello goodbye condition
-        auto bhv = DataSet::getBehavior();
-
         if (!forceCheckBatteryState()) {
-            // Iterate the rules and look for one!
-            for (int i = 0; i < bhv->rulesCount; ++i) {
-                auto rule = DataSet::getRule(bhv->rulesOffset + i);
-                auto condition = DataSet::getCondition(rule->condition);
-                if (condition->type == Behaviors::Condition_HelloGoodbye) {
-                    // This is the right kind of condition, check it!
-                    auto cond = static_cast<const Behaviors::ConditionHelloGoodbye*>(condition);
-                    if (cond->checkTrigger(true)) {
-                        // Go on, do the thing!
-                        if (PowerManager::checkFromSysOff()) 
-                        {
-                            NRF_LOG_DEBUG("Skipping HelloGoodbye Condition");
-                        }
-                        else
-                        {
-                            NRF_LOG_DEBUG("Triggering a HelloGoodbye Condition");
-                            Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_Status);
-                        }
+            forEachRule(Behaviors::Condition_HelloGoodbye, [](int ruleIndex, const Behaviors::Rule* rule, const Behaviors::Condition* condition) {
+                // This is the right kind of condition, check it!
+                auto cond = static_cast<const Behaviors::ConditionHelloGoodbye*>(condition);
+                if (cond->checkTrigger(true)) {
+                    // Go on, do the thing!
+                    if (PowerManager::checkFromSysOff()) 
+                    {
+                        NRF_LOG_DEBUG("Skipping HelloGoodbye Condition");
+                    }
+                    else
+                    {
+                        NRF_LOG_DEBUG("Triggering a HelloGoodbye Condition");
+                        Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_Status);
                     }
                 }
-            }
+            });
         }
     }
 
@@ -134,27 +192,22 @@ namespace Modules::BehaviorController
     }
 
     void onConnectionEvent(void* param, bool connected) {
-        // Do we have a connection event condition?
-        auto bhv = DataSet::getBehavior();
-
-        // Iterate the rules and look for one!
-        for (int i = 0; i < bhv->rulesCount; ++i) {
-            auto rule = DataSet::getRule(bhv->rulesOffset + i);
-            auto condition = DataSet::getCondition(rule->condition);
-            if (condition->type == Behaviors::Condition_ConnectionState) {
-                // This is the right kind of condition, check it!
-                auto cond = static_cast<const Behaviors::ConditionConnectionState*>(condition);
-                if (cond->checkTrigger(connected)) {
-                    NRF_LOG_DEBUG("Triggering a Connection State Condition");
-                    // Go on, do the thing!
-                    Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_BluetoothNotification);
-                }
+        forEachRule(Behaviors::Condition_ConnectionState, [connected](int ruleIndex, const Behaviors::Rule* rule, const Behaviors::Condition* condition) {
+            // This is the right kind of condition, check it!
+            auto cond = static_cast<const Behaviors::ConditionConnectionState*>(condition);
+            if (cond->checkTrigger(connected)) {
+                NRF_LOG_DEBUG("Triggering a Connection State Condition");
+                // Go on, do the thing!
+                Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_BluetoothNotification);
             }
-        }
+        });
     }
 
     bool processBatteryStateRule(int ruleIndex, BatteryController::BatteryState newState);
 
+    // Pending re-check of the last triggered battery rule, if any
+    static Timers::DelayedCallbackHandle batteryRuleRepeatHandle = INVALID_DELAYED_CALLBACK_HANDLE;
+
     void processBatteryStateRuleCallback(void* param) {
         // Recheck ourselves!
         BatteryController::BatteryState newState = BatteryController::getBatteryState();
@@ -174,11 +227,11 @@ namespace Modules::BehaviorController
             
             // Setup a timer to repeat this check in a little bit if appropriate
             if (cond->repeatPeriodMs != 0) {
-                // If we had any other battery-rule related delayed callback, cancel them
-                Timers::cancelDelayedCallback(processBatteryStateRuleCallback);
+                // If we had any other battery-rule related delayed callback, cancel it
+                Timers::cancelDelayedCallbackHandle(batteryRuleRepeatHandle);
 
                 // And trigger ourselves to check this condition again!
-                Timers::setDelayedCallback(processBatteryStateRuleCallback, (void*)ruleIndex, cond->repeatPeriodMs);
+                batteryRuleRepeatHandle = Timers::addDelayedCallback(processBatteryStateRuleCallback, (void*)ruleIndex, cond->repeatPeriodMs);
             }
 
             // Go on, do the thing!
@@ -188,62 +241,166 @@ namespace Modules::BehaviorController
     }
 
     void onBatteryStateChange(void* param, BatteryController::BatteryState newState) {
-        // Do we have a battery event condition?
-        auto bhv = DataSet::getBehavior();
+        forEachRule(Behaviors::Condition_BatteryState, [newState](int ruleIndex, const Behaviors::Rule* rule, const Behaviors::Condition* condition) {
+            processBatteryStateRule(ruleIndex, newState);
+        });
+    }
+
+    void onRollStateChange(void* param, Accelerometer::RollState prevState, int prevFace, Accelerometer::RollState newState, int newFace) {
+        if (newState == Accelerometer::RollState_Handling || newState == Accelerometer::RollState_Rolling) {
+            // The rolled rules will most likely light the LEDs soon, have them ready
+            LEDs::prePower(ROLL_LED_PRE_POWER_TIMEOUT_MS);
+        }
 
-        // Iterate the rules and look for one!
-        for (int i = 0; i < bhv->rulesCount; ++i) {
-            auto rule = DataSet::getRule(bhv->rulesOffset + i);
-            auto condition = DataSet::getCondition(rule->condition);
-            if (condition->type == Behaviors::Condition_BatteryState) {
+        if (newState != Accelerometer::RollState_Rolled || newFace != earlyRolledFace) {
+            fireArmedTriggers(newState, newFace);
+        }
 
-                processBatteryStateRule(i, newState);
+        // Only the rules with a roll state condition are checked, one type of condition after the other
+        forEachRule(Behaviors::Condition_Handling, [=](int ruleIndex, const Behaviors::Rule* rule, const Behaviors::Condition* condition) {
+            if (static_cast<const Behaviors::ConditionHandling*>(condition)->checkTrigger(newState, newFace)) {
+                Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_Accelerometer);
+            }
+        });
+        forEachRule(Behaviors::Condition_Rolling, [=](int ruleIndex, const Behaviors::Rule* rule, const Behaviors::Condition* condition) {
+            auto rollingCondition = static_cast<const Behaviors::ConditionRolling*>(condition);
+            int timestamp = Timers::millis();
+            if (timestamp - lastRollStateTimestamp > rollingCondition->repeatPeriodMs &&
+                rollingCondition->checkTrigger(newState, newFace)) {
+                lastRollStateTimestamp = timestamp;
+                Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_Accelerometer);
             }
+        });
+        forEachRule(Behaviors::Condition_Crooked, [=](int ruleIndex, const Behaviors::Rule* rule, const Behaviors::Condition* condition) {
+            if (static_cast<const Behaviors::ConditionCrooked*>(condition)->checkTrigger(newState, newFace)) {
+                Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_Accelerometer);
+            }
+        });
+        if (newFace != earlyRolledFace) {
+            // Skip if already triggered by the prediction
+            forEachRule(Behaviors::Condition_Rolled, [=](int ruleIndex, const Behaviors::Rule* rule, const Behaviors::Condition* condition) {
+                if (static_cast<const Behaviors::ConditionRolled*>(condition)->checkTrigger(prevState, prevFace, newState, newFace)) {
+                    Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_Accelerometer);
+                }
+            });
         }
+
+        // Whatever the roll ended up being, the prediction is used up
+        earlyRolledFace = -1;
     }
 
-    void onRollStateChange(void* param, Accelerometer::RollState prevState, int prevFace, Accelerometer::RollState newState, int newFace) {
+    /// <summary>
+    /// Triggers the rolled rules as soon as the result is likely, rather than waiting for the roll
+    /// to be confirmed. If the roll confirms another face, its rules are triggered then.
+    /// </summary>
+    void onLikelyFace(void* param, int face, int confidenceTimes1000) {
+        forEachRule(Behaviors::Condition_Rolled, [face](int ruleIndex, const Behaviors::Rule* rule, const Behaviors::Condition* condition) {
+            if (static_cast<const Behaviors::ConditionRolled*>(condition)->checkTrigger(
+                    Accelerometer::RollState_Rolling, face, Accelerometer::RollState_Rolled, face)) {
+                Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_Accelerometer);
+            }
+        });
+        fireArmedTriggers(Accelerometer::RollState_Rolled, face);
+        earlyRolledFace = face;
+    }
 
-        // Do we have a roll state event condition?
-        auto bhv = DataSet::getBehavior();
+    /// <summary>
+    /// Finds the trigger with the given id, or a free entry if there is none, nullptr if they are all taken
+    /// </summary>
+    static ArmedTrigger* findArmedTrigger(uint8_t triggerId) {
+        ArmedTrigger* freeTrigger = nullptr;
+        for (int i = 0; i < MAX_ARMED_TRIGGERS; ++i) {
+            auto& trigger = armedTriggers[i];
+            if (trigger.rollState == Accelerometer::RollState_Unknown) {
+                if (freeTrigger == nullptr) {
+                    freeTrigger = &trigger;
+                }
+            } else if (trigger.triggerId == triggerId) {
+                return &trigger;
+            }
+        }
+        return freeTrigger;
+    }
 
-        // Iterate the rules and look for one!
-        for (int i = 0; i < bhv->rulesCount; ++i) {
-            auto rule = DataSet::getRule(bhv->rulesOffset + i);
-            auto condition = DataSet::getCondition(rule->condition);
+    static void disarmTrigger(ArmedTrigger& trigger) {
+        if (trigger.rollState != Accelerometer::RollState_Unknown) {
+            trigger.rollState = Accelerometer::RollState_Unknown;
+            armedTriggerCount--;
+            if (armedTriggerCount == 0) {
+                Bluetooth::Stack::unHook(onArmedTriggersConnectionEvent);
+            }
+        }
+    }
 
-            // This is the right kind of condition, check it!
-            bool conditionTriggered = false;
-            switch (condition->type) {
-                case Behaviors::Condition_Handling:
-                    conditionTriggered = static_cast<const Behaviors::ConditionHandling*>(condition)->checkTrigger(newState, newFace);
-                    break;
-                case Behaviors::Condition_Rolling:
-                    {
-                        auto rollingCondition = static_cast<const Behaviors::ConditionRolling*>(condition);
-                        int timestamp = Timers::millis();
-                        if (timestamp - lastRollStateTimestamp > rollingCondition->repeatPeriodMs) {
-                            conditionTriggered = rollingCondition->checkTrigger(newState, newFace);
-                            if (conditionTriggered) {
-                                lastRollStateTimestamp = timestamp;
-                            }
-                        }
-                    }
-                    break;
-                case Behaviors::Condition_Crooked:
-                    conditionTriggered = static_cast<const Behaviors::ConditionCrooked*>(condition)->checkTrigger(newState, newFace);
-                    break;
-                case Behaviors::Condition_Rolled:
-                    conditionTriggered = static_cast<const Behaviors::ConditionRolled*>(condition)->checkTrigger(prevState, prevFace, newState, newFace);
-                    break;
-                default:
-                    break;
+    void armAnimTriggerHandler(const Message* msg) {
+        auto message = (const MessageArmAnimTrigger*)msg;
+        auto trigger = findArmedTrigger(message->triggerId);
+        bool result = trigger != nullptr && message->rollState != Accelerometer::RollState_Unknown && message->rollState < Accelerometer::RollState_Count;
+        if (result) {
+            if (trigger->rollState == Accelerometer::RollState_Unknown) {
+                if (armedTriggerCount == 0) {
+                    Bluetooth::Stack::hook(onArmedTriggersConnectionEvent, nullptr);
+                }
+                armedTriggerCount++;
             }
+            trigger->faceMask = message->faceMask;
+            trigger->triggerId = message->triggerId;
+            trigger->rollState = message->rollState;
+            trigger->source = message->source;
+            trigger->animation = message->animation;
+            trigger->remapFace = message->remapFace;
+            trigger->loopCount = message->loopCount;
+            NRF_LOG_DEBUG("Armed trigger %d for roll state %d", message->triggerId, message->rollState);
+        }
 
-            if (conditionTriggered) {
-                // do the thing
-                Behaviors::triggerActions(rule->actionOffset, rule->actionCount, Animations::AnimationTag_Accelerometer);
+        MessageArmAnimTriggerAck ackMsg;
+        ackMsg.triggerId = message->triggerId;
+        ackMsg.result = result ? 1 : 0;
+        MessageService::SendMessage(&ackMsg);
+    }
+
+    void disarmAnimTriggersHandler(const Message* msg) {
+        auto message = (const MessageDisarmAnimTriggers*)msg;
+        for (int i = 0; i < MAX_ARMED_TRIGGERS; ++i) {
+            if (message->triggerId == 0xFF || armedTriggers[i].triggerId == message->triggerId) {
+                disarmTrigger(armedTriggers[i]);
             }
         }
     }
+
+    void onArmedTriggersConnectionEvent(void* param, bool connected) {
+        if (!connected) {
+            // Nobody to play them for anymore
+            for (int i = 0; i < MAX_ARMED_TRIGGERS; ++i) {
+                disarmTrigger(armedTriggers[i]);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Plays the animations of the triggers matching the roll event, and lets the app know
+    /// </summary>
+    void fireArmedTriggers(Accelerometer::RollState newState, int newFace) {
+        for (int i = 0; i < MAX_ARMED_TRIGGERS && armedTriggerCount > 0; ++i) {
+            auto& trigger = armedTriggers[i];
+            if (trigger.rollState != newState || (trigger.faceMask & (1 << newFace)) == 0) {
+                continue;
+            }
+
+            auto bits = AnimationBitsCache::getBits(trigger.source == AnimTriggerSource_Instant
+                ? AnimationBitsCache::Source_Instant : AnimationBitsCache::Source_Profile);
+            if (bits != nullptr && trigger.animation < bits->getAnimationCount()) {
+                uint8_t remapFace = trigger.remapFace == FACE_INDEX_CURRENT_FACE ? newFace : trigger.remapFace;
+                AnimController::play(bits->getAnimation(trigger.animation), bits, remapFace, trigger.loopCount, Animations::AnimationTag_BluetoothMessage);
+            } else {
+                NRF_LOG_DEBUG("No animation %d for trigger %d", trigger.animation, trigger.triggerId);
+            }
+
+            MessageAnimTriggerFired firedMsg;
+            firedMsg.triggerId = trigger.triggerId;
+            firedMsg.face = (uint8_t)newFace;
+            MessageService::SendMessage(&firedMsg);
+            disarmTrigger(trigger);
+        }
+    }
 }
@@ -11,11 +11,13 @@ namespace Modules::ChargerProximity
     static ChargerProximityState currentProximityState;
 
     ChargerProximityState computeProximityState(BatteryController::BatteryState state);
-    void onBatteryStateChange(void* param, BatteryController::BatteryState newState);
 
     void init() {
         currentProximityState = computeProximityState(BatteryController::getBatteryState());
-        BatteryController::hookBatteryState(onBatteryStateChange, nullptr);
+    }
+
+    ChargerProximityState getState() {
+        return currentProximityState;
     }
 
     ChargerProximityState computeProximityState(BatteryController::BatteryState state) {
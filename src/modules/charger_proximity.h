@@ -1,5 +1,7 @@
 #pragma once
 
+#include "battery_controller.h"
+
 /// <summary>
 /// Manages whether die is on charger or not
 /// </summary>
@@ -12,9 +14,13 @@ namespace Modules::ChargerProximity
     };
 
     void init();
+    ChargerProximityState getState();
 
     typedef void(*ChargerProximityHandler)(void* param, ChargerProximityState newState);
     bool hook(ChargerProximityHandler method, void* param);
     void unHook(ChargerProximityHandler client);
     void unHookWithParam(void* param);
+
+    // Called by the battery controller, see config/static_subscribers.h
+    void onBatteryStateChange(void* param, BatteryController::BatteryState newState);
 }
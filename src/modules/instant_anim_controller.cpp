@@ -1,6 +1,7 @@
 #include "instant_anim_controller.h"
 #include "animations/animation.h"
 #include "data_set/data_animation_bits.h"
+#include "data_set/animation_bits_cache.h"
 #include "bluetooth/bluetooth_messages.h"
 #include "bluetooth/bluetooth_message_service.h"
 #include "bluetooth/bulk_data_transfer.h"
@@ -8,16 +9,23 @@
 #include "behaviors/action.h"
 #include "accelerometer.h"
 #include "utils/utils.h"
-#include "malloc.h"
 #include "nrf_log.h"
 
+// Memory reserved for instant animations, set by the makefile (and taken out of the heap)
+#ifndef INSTANT_ANIM_ARENA_SIZE
+#define INSTANT_ANIM_ARENA_SIZE 2048
+#endif
+
 using namespace Bluetooth;
 using namespace DataSet;
 
 namespace Modules::InstantAnimationController
 {
     static AnimationBits animationBits;
-    static void *animationsData = nullptr;
+
+    // Animations are always received in the same memory so repeated uploads can't fragment the heap
+    static uint32_t animationsArena[INSTANT_ANIM_ARENA_SIZE / sizeof(uint32_t)];
+    static void *animationsData = nullptr; // Points to the arena when it holds valid data
     static uint32_t animationsDataSize;
     static uint32_t animationsDataHash;
 
@@ -26,7 +34,7 @@ namespace Modules::InstantAnimationController
 
     void clearData()
     {
-        free(animationsData);
+        AnimationBitsCache::setBits(AnimationBitsCache::Source_Instant, nullptr);
         animationsData = nullptr;
         animationsDataSize = 0;
         animationsDataHash = 0;
@@ -47,9 +55,12 @@ namespace Modules::InstantAnimationController
         const MessageTransferInstantAnimSet *message = (const MessageTransferInstantAnimSet *)msg;
 
         if (animationsData == nullptr || animationsDataHash != message->hash) {
-            // Stop playing animations as we are about to delete their data
-            for (uint32_t i = 0; i < animationBits.animationCount; ++i) {
-                AnimController::stop(animationBits.getAnimation(i), 255);
+            // Stop the animations still playing from the data we are about to overwrite,
+            // the other ones keep going
+            auto useCount = AnimationBitsCache::getUseCount(AnimationBitsCache::Source_Instant);
+            if (useCount > 0) {
+                NRF_LOG_DEBUG("Stopping %d instant animation instances", useCount);
+                AnimController::stopAll(&animationBits);
             }
 
             // We should download the data
@@ -76,38 +87,38 @@ namespace Modules::InstantAnimationController
                 animationOffsetsBufferSize +
                 message->animationSize;
 
-            // Allocate anim data
-            animationsData = malloc(animationsDataSize);
-            if (animationsData != nullptr) {
+            // Use the arena if the data fits
+            if (animationsDataSize <= sizeof(animationsArena)) {
+                animationsData = animationsArena;
 
                 // Setup pointers
                 NRF_LOG_DEBUG("Animations bufferSize: %d", animationsDataSize);
                 uint32_t address = (uint32_t)animationsData;
-                animationBits.palette = (const uint8_t*)address;
+                animationBits.palette.set(&animationBits, (const void*)address);
                 animationBits.paletteSize = message->paletteSize;
                 address += paletteBufferSize;
 
-                animationBits.rgbKeyframes = (const RGBKeyframe*)address;
+                animationBits.rgbKeyframes.set(&animationBits, (const void*)address);
                 animationBits.rgbKeyFrameCount = message->rgbKeyFrameCount;
                 address += message->rgbKeyFrameCount * sizeof(RGBKeyframe);
 
-                animationBits.rgbTracks = (const RGBTrack*)address;
+                animationBits.rgbTracks.set(&animationBits, (const void*)address);
                 animationBits.rgbTrackCount = message->rgbTrackCount;
                 address += message->rgbTrackCount * sizeof(RGBTrack);
 
-                animationBits.keyframes = (const Keyframe*)address;
+                animationBits.keyframes.set(&animationBits, (const void*)address);
                 animationBits.keyFrameCount = message->keyFrameCount;
                 address += message->keyFrameCount * sizeof(Keyframe);
 
-                animationBits.tracks = (const Track*)address;
+                animationBits.tracks.set(&animationBits, (const void*)address);
                 animationBits.trackCount = message->trackCount;
                 address += message->trackCount * sizeof(Track);
 
-                animationBits.animationOffsets = (const uint16_t*)address;
+                animationBits.animationOffsets.set(&animationBits, (const void*)address);
                 animationBits.animationCount = message->animationCount;
                 address += animationOffsetsBufferSize;
 
-                animationBits.animations = (const uint8_t*)address;
+                animationBits.animations.set(&animationBits, (const void*)address);
                 animationBits.animationsSize = message->animationSize;
 
                 // Send Ack and receive data
@@ -122,7 +133,8 @@ namespace Modules::InstantAnimationController
                     },
                     [](void* context, bool result, uint8_t* data, uint16_t size) {
                     if (result) {
-                        animationsDataHash = Utils::computeHash((uint8_t*)animationsData, size);
+                        animationsDataHash = ReceiveBulkData::dataHash();
+                        AnimationBitsCache::setBits(AnimationBitsCache::Source_Instant, &animationBits);
                         MessageService::SendMessage(Message::MessageType_TransferInstantAnimSetFinished);
                     }
                     else {
@@ -133,6 +145,8 @@ namespace Modules::InstantAnimationController
             }
             else {
                 // No memory
+                NRF_LOG_ERROR("Instant animations too large, %d bytes for %d available", animationsDataSize, sizeof(animationsArena));
+                animationsDataSize = 0;
                 MessageTransferInstantAnimSetAck ackMsg;
                 ackMsg.ackType = TransferInstantAnimSetAck_NoMemory;
                 MessageService::SendMessage(&ackMsg);
@@ -146,23 +160,29 @@ namespace Modules::InstantAnimationController
         }
     }
 
+    uint16_t getMaxDataSize()
+    {
+        return sizeof(animationsArena);
+    }
+
     void PlayInstantAnimHandler(const Message *msg) 
     {
         const MessagePlayInstantAnim *message = (const MessagePlayInstantAnim *)msg;
         NRF_LOG_INFO("Received request to play instant animation %d", message->animation);
 
-        if (animationsData != nullptr && message->animation < animationBits.getAnimationCount()) {
-            // TODO may crash if we are still downloading an animation
-            auto animation = animationBits.getAnimation(message->animation);
+        // The bits are only set once the download is complete
+        auto bits = AnimationBitsCache::getBits(AnimationBitsCache::Source_Instant);
+        if (bits != nullptr && message->animation < bits->getAnimationCount()) {
+            auto animation = bits->getAnimation(message->animation);
             uint8_t faceIndex = message->faceIndex == FACE_INDEX_CURRENT_FACE
                 ? Accelerometer::currentFace() : message->faceIndex;
-            AnimController::play(animation, &animationBits, faceIndex, message->loopCount);
+            AnimController::play(animation, bits, faceIndex, message->loopCount);
         }
-        else if (animationsData == nullptr) {
+        else if (bits == nullptr) {
             NRF_LOG_DEBUG("No instant animation in memory");
         }
         else {
-            NRF_LOG_DEBUG("Animation index out of bounds %d >= %d", message->animation, animationBits.getAnimationCount());
+            NRF_LOG_DEBUG("Animation index out of bounds %d >= %d", message->animation, bits->getAnimationCount());
         }
     }
 }
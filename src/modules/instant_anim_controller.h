@@ -1,6 +1,11 @@
 #pragma once
 
+#include <stdint.h>
+
 namespace Modules::InstantAnimationController
 {
     void init();
+
+    // Size of the memory reserved for instant animations
+    uint16_t getMaxDataSize();
 }
@@ -0,0 +1,143 @@
+#include "led_stream.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "config/settings.h"
+#include "config/dice_variants.h"
+#include "drivers_nrf/timers.h"
+#include "modules/anim_controller.h"
+#include "modules/leds.h"
+#include "utils/Utils.h"
+#include "nrf_log.h"
+#include <string.h>
+
+// Frames are presented on this tick, so the app may send them faster without flooding the LEDs
+#define LED_STREAM_TICK_MS 16
+
+// The stream stops by itself when the app goes quiet, e.g. after a disconnection
+#define LED_STREAM_TIMEOUT_MS 3000
+
+using namespace Bluetooth;
+using namespace Config;
+using namespace DriversNRF;
+
+namespace Modules::LEDStream
+{
+    void LEDStreamHandler(const Message* msg);
+    void LEDStreamFrameHandler(const Message* msg);
+    void onTick(void* param);
+
+    APP_TIMER_DEF(streamTimer);
+
+    // Frames are decoded in this buffer (in daisy chain order), LEDs keeps its own copy
+    // of the frame being shown, so the next frame can be received while it is clocked out
+    static uint32_t backBuffer[MAX_LED_COUNT];
+    static uint32_t palette[LED_STREAM_PALETTE_SIZE];
+    static bool streaming = false;
+    static bool framePending = false;
+    static int lastFrameMs = 0;
+
+    void init() {
+        MessageService::RegisterMessageHandler(Message::MessageType_LEDStream, LEDStreamHandler);
+        MessageService::RegisterMessageHandler(Message::MessageType_LEDStreamFrame, LEDStreamFrameHandler);
+        Timers::createTimer(&streamTimer, APP_TIMER_MODE_REPEATED, onTick);
+        NRF_LOG_DEBUG("LED Stream init");
+    }
+
+    void start() {
+        if (!streaming) {
+            NRF_LOG_INFO("Starting LED stream");
+            AnimController::stop();
+            memset(backBuffer, 0, sizeof(backBuffer));
+            framePending = false;
+            lastFrameMs = Timers::millis();
+            streaming = true;
+            Timers::startTimer(streamTimer, LED_STREAM_TICK_MS);
+        }
+    }
+
+    void stop() {
+        if (streaming) {
+            NRF_LOG_INFO("Stopping LED stream");
+            Timers::stopTimer(streamTimer);
+            streaming = false;
+            framePending = false;
+            LEDs::clear();
+            AnimController::start();
+        }
+    }
+
+    bool isStreaming() {
+        return streaming;
+    }
+
+    void onTick(void* param) {
+        if (Timers::millis() - lastFrameMs > LED_STREAM_TIMEOUT_MS) {
+            NRF_LOG_INFO("No LED stream frame for %dms", LED_STREAM_TIMEOUT_MS);
+            stop();
+        } else if (framePending && !LEDs::isBusy()) {
+            // A frame still being clocked out delays the new one to the next tick
+            framePending = false;
+            LEDs::setPixelColors(backBuffer);
+        }
+    }
+
+    void LEDStreamHandler(const Message* msg) {
+        auto message = (const MessageLEDStream*)msg;
+        const int count = std::min<int>(message->paletteSize, LED_STREAM_PALETTE_SIZE);
+        if (MessageService::getReceivedMessageSize() < offsetof(MessageLEDStream, palette) + count * 3) {
+            NRF_LOG_WARNING("LED stream palette too short for %d colors", count);
+            return;
+        }
+        for (int i = 0; i < count; ++i) {
+            const uint8_t* rgb = &message->palette[i * 3];
+            palette[i] = Utils::toColor(rgb[0], rgb[1], rgb[2]);
+        }
+        if (message->enable) {
+            start();
+        } else {
+            stop();
+        }
+    }
+
+    void LEDStreamFrameHandler(const Message* msg) {
+        if (!streaming) {
+            // Most likely a late frame after the stream was stopped
+            return;
+        }
+
+        auto message = (const MessageLEDStreamFrame*)msg;
+        if (message->format != LEDStreamFormat_Palette4 && message->format != LEDStreamFormat_RGB565) {
+            NRF_LOG_WARNING("Unknown LED stream format %d", message->format);
+            return;
+        }
+
+        // Only the LEDs in the mask are sent, the other ones keep their color
+        auto l = SettingsManager::getLayout();
+        const uint32_t mask = message->ledMask & ((1u << l->ledCount) - 1);
+        const int count = __builtin_popcount(mask);
+        const int dataSize = message->format == LEDStreamFormat_Palette4 ? (count + 1) / 2 : count * 2;
+        if (MessageService::getReceivedMessageSize() < offsetof(MessageLEDStreamFrame, data) + dataSize) {
+            NRF_LOG_WARNING("LED stream frame too short for %d LEDs", count);
+            return;
+        }
+        int n = 0;
+        for (uint32_t remaining = mask; remaining != 0; remaining &= remaining - 1) {
+            int led = Utils::lowestBitIndex(remaining);
+            uint32_t color;
+            if (message->format == LEDStreamFormat_Palette4) {
+                uint8_t pair = message->data[n >> 1];
+                color = palette[(n & 1) ? pair >> 4 : pair & 0xF];
+            } else {
+                uint16_t rgb565 = message->data[2 * n] | (message->data[2 * n + 1] << 8);
+                uint8_t r = (rgb565 >> 11) & 0x1F;
+                uint8_t g = (rgb565 >> 5) & 0x3F;
+                uint8_t b = rgb565 & 0x1F;
+                color = Utils::toColor((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2));
+            }
+            backBuffer[l->daisyChainIndexFromLEDIndexLookup[led]] = color;
+            ++n;
+        }
+        framePending = true;
+        lastFrameMs = Timers::millis();
+    }
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+/// <summary>
+/// Lets the app drive all the LEDs directly with a stream of frames, e.g. for light shows
+/// synchronized between several dice. The animation controller is paused while streaming.
+/// </summary>
+namespace Modules::LEDStream
+{
+    void init();
+    void start();
+    void stop();
+    bool isStreaming();
+}
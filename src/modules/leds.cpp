@@ -10,7 +10,9 @@
 #include "drivers_nrf/timers.h"
 #include "drivers_nrf/scheduler.h"
 #include "drivers_nrf/gpiote.h"
+#include "drivers_nrf/retained_state.h"
 #include "battery_controller.h"
+#include "validation_manager.h"
 #include "utils/Utils.h"
 #include "string.h" // for memset
 
@@ -24,7 +26,24 @@ using namespace DriversNRF;
 #define OFFSET_BLUE 0
 
 #define MAX_APA102_CLIENTS 2
-#define LOW_BATT_LED_INTENSITY_DIVISOR 32
+
+// Default LED current budget, frames estimated to draw more are scaled down
+#define LED_CURRENT_BUDGET_MA 250
+// Below this battery voltage, measured while the LEDs are on, the budget is derated further,
+// down to LED_SAG_MIN_BUDGET_PERCENT at LED_SAG_MIN_VBAT_MILLI
+#define LED_SAG_VBAT_MILLI 3500
+#define LED_SAG_MIN_VBAT_MILLI 3300
+#define LED_SAG_MIN_BUDGET_PERCENT 50
+// The voltage reading is noisy, it only moves the derating once it's moved by this much
+#define LED_SAG_HYSTERESIS_MILLI 50
+
+// LED current model, in nano amps (we don't have anywhere near this precision, it just makes fixed-point computations easier)
+#define LED_BASE_NANO_AMPS 7100000      // As soon as the LEDs are powered, even all black
+#define LED_ON_NANO_AMPS (247000 * 3)   // Per LED that is on
+#define LED_LEVEL_NANO_AMPS 18200       // Per channel intensity level
+
+// Warm boots (from System OFF) trust the last LED return test this many times before running it again
+#define LED_RETURN_RETEST_BOOTS 16
 
 namespace Modules::LEDs
 {
@@ -34,7 +53,26 @@ namespace Modules::LEDs
     static bool powerOn = false;
     static uint32_t pixels[MAX_LED_COUNT];
 
+    // Accumulated (8 bits fractional) error of each channel of each LED, for temporal dithering
+    static uint8_t ditherErrors[MAX_LED_COUNT][3];
+
+    // Copy of the last colors sent to the LEDs, so unchanged frames can be skipped
+    static uint32_t shownPixels[MAX_LED_COUNT];
+    static bool shownPixelsValid = false;
+
+    // Colors actually sent to the LEDs, after the current limiter
+    static uint32_t limitedPixels[MAX_LED_COUNT];
+    static uint16_t currentBudgetMilliAmps = LED_CURRENT_BUDGET_MA;
+    static uint16_t shownBudgetMilliAmps = 0;
+
+    // Budget for the current battery level, recomputed when the level or the base budget changes
+    static uint16_t effectiveBudgetMilliAmps = LED_CURRENT_BUDGET_MA;
+    static int sagVbatMilli = LED_SAG_VBAT_MILLI;  // Last voltage taken into account for the derating
+
     void show();
+    void limitCurrent(const uint32_t* colors, uint32_t* outColors, uint16_t budgetMilliAmps);
+    void updateEffectiveCurrentBudget();
+    void onBatteryLevelChange(void* param, uint8_t levelPercent);
 
     void setPowerOn(Timers::DelayedCallback callback, void* parameter);
     void setPowerOff();
@@ -59,11 +97,26 @@ namespace Modules::LEDs
         // Initialize out LED return pin
         nrf_gpio_cfg_default(board->ledReturnPin);
 
+        // The power budget follows the battery level
+        updateEffectiveCurrentBudget();
+        BatteryController::hookLevel(onBatteryLevelChange, nullptr);
+
         // Initialize our color array
         memset(pixels, 0, MAX_LED_COUNT * sizeof(uint32_t));
         numLed = board->ledCount;
 
-        if (BatteryController::getState() != BatteryController::State_Empty &&
+        // Any other kind of reset, like a watchdog or a brown out, may point at hardware trouble
+        auto retained = RetainedState::getState();
+        const bool skipTest = RetainedState::isWarmBoot() &&
+            retained->ledReturnPassed &&
+            retained->ledReturnSkipCount < LED_RETURN_RETEST_BOOTS &&
+            !ValidationManager::inValidation();
+
+        if (skipTest) {
+            retained->ledReturnSkipCount++;
+            NRF_LOG_DEBUG("LEDs init, powerPin=%d, return test skipped", (int)powerPin);
+            _callback(true);
+        } else if (BatteryController::getState() != BatteryController::State_Empty &&
             BatteryController::getState() != BatteryController::State_Low &&
             BatteryController::getState() != BatteryController::State_ChargingLow) {
             testLEDReturn([](bool success) {
@@ -72,6 +125,9 @@ namespace Modules::LEDs
                 } else {
                     NRF_LOG_ERROR("LED Return not detected");
                 }
+                auto retained = RetainedState::getState();
+                retained->ledReturnPassed = success;
+                retained->ledReturnSkipCount = 0;
                 _callback(success);
             });
         } else {
@@ -157,6 +213,40 @@ namespace Modules::LEDs
         show();
     }
 
+    // Adds the fractional part of a channel to its error term, returns the channel value to display.
+    // Channels that are off stay off, otherwise a dim frame would toggle the LED power every frame.
+    static uint8_t ditherChannel(uint8_t value, uint8_t fraction, uint8_t& error) {
+        if (value == 0) {
+            error = 0;
+            return 0;
+        }
+        uint32_t acc = (uint32_t)error + fraction;
+        error = (uint8_t)(acc & 0xFF);
+        return (acc > 0xFF && value < 0xFF) ? value + 1 : value;
+    }
+
+    /// <summary>
+    /// Sets all the LED colors, also passing the fractional part of each channel (packed like a color).
+    /// Fractions are accumulated per LED across frames, so that over time the LEDs display the exact
+    /// average intensity. This is what makes low intensity fades smooth.
+    /// </summary>
+    void setPixelColorsDithered(uint32_t* colors, uint32_t* fractions) {
+        for (int i = 0; i < numLed; ++i) {
+            uint32_t color = colors[i];
+            uint32_t fraction = fractions[i];
+            uint8_t r = ditherChannel(Utils::getRed(color), Utils::getRed(fraction), ditherErrors[i][0]);
+            uint8_t g = ditherChannel(Utils::getGreen(color), Utils::getGreen(fraction), ditherErrors[i][1]);
+            uint8_t b = ditherChannel(Utils::getBlue(color), Utils::getBlue(fraction), ditherErrors[i][2]);
+            pixels[i] = Utils::toColor(r, g, b);
+        }
+        show();
+    }
+
+
+    bool isBusy() {
+        // Is a frame still being clocked out to the LEDs?
+        return NeoPixel::isBusy();
+    }
 
     void hookPowerState(LEDClientMethod method, void* param) {
         ledPowerClients.Register(param, method);
@@ -179,20 +269,6 @@ namespace Modules::LEDs
         return true;
     }
 
-    void clampColors() {
-        for (int i = 0; i < numLed; ++i) {
-            uint32_t color = pixels[i];
-            // Clamp intensity
-            uint8_t r = Utils::getRed(color);
-            uint8_t g = Utils::getGreen(color);
-            uint8_t b = Utils::getBlue(color);
-            r = (r + LOW_BATT_LED_INTENSITY_DIVISOR - 1) / LOW_BATT_LED_INTENSITY_DIVISOR;
-            g = (g + LOW_BATT_LED_INTENSITY_DIVISOR - 1) / LOW_BATT_LED_INTENSITY_DIVISOR;
-            b = (b + LOW_BATT_LED_INTENSITY_DIVISOR - 1) / LOW_BATT_LED_INTENSITY_DIVISOR;
-            pixels[i] = Utils::toColor(r,g,b);
-        }
-    }
-
     void show() {
         // Do we want all the LEDs to be off?
         if (isPixelDataZero()) {
@@ -200,19 +276,43 @@ namespace Modules::LEDs
         } else {
             // Only turn power on if Battery is strong enough
             if (BatteryController::getState() != BatteryController::State_Empty) {
+                // If the LEDs already display these colors, no need to send them again
+                uint16_t budget = getEffectiveCurrentBudget();
+                if (powerOn && shownPixelsValid && budget == shownBudgetMilliAmps &&
+                    memcmp(pixels, shownPixels, numLed * sizeof(uint32_t)) == 0) {
+                    return;
+                }
+
                 // Turn power on so we display something!!!
                 setPowerOn([](void* ignore) {
-                    // Check battery and coil voltage to determine if we should turn leds on
-                    // if (BatteryController::getState() == BatteryController::State_Low ||
-                    //     BatteryController::getState() == BatteryController::State_ChargingLow) {
-                    //     clampColors();
-                    // }
-                    NeoPixel::show(pixels);
+                    // The current limiter also takes care of dimming the LEDs when the battery is low
+                    memcpy(shownPixels, pixels, numLed * sizeof(uint32_t));
+                    shownPixelsValid = true;
+                    shownBudgetMilliAmps = getEffectiveCurrentBudget();
+                    limitCurrent(pixels, limitedPixels, shownBudgetMilliAmps);
+                    NeoPixel::show(limitedPixels);
                 }, nullptr);
             }
         }
     }
 
+    static void prePowerTimeout(void* ignore) {
+        if (isPixelDataZero()) {
+            setPowerOff();
+        }
+    }
+
+    void prePower(int timeoutMs) {
+        if (BatteryController::getState() == BatteryController::State_Empty) {
+            return;
+        }
+        setPowerOn([](void* ignore) {}, nullptr);
+
+        // Push back the timeout while the frame is still likely to come
+        Timers::cancelDelayedCallback(prePowerTimeout);
+        Timers::setDelayedCallback(prePowerTimeout, nullptr, timeoutMs);
+    }
+
     // Convert separate R,G,B to packed value
     uint32_t color(uint8_t r, uint8_t g, uint8_t b) {
         return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
@@ -249,31 +349,134 @@ namespace Modules::LEDs
         nrf_gpio_pin_clear(powerPin);
         powerOn = false;
 
+        // LEDs lose their colors when unpowered
+        shownPixelsValid = false;
+
         // Notify clients we're turning led power off
         for (int i = 0; i < ledPowerClients.Count(); ++i) {
             ledPowerClients[i].handler(ledPowerClients[i].token, false);
         }
     }
 
-    uint8_t computeCurrentEstimate() {
-        uint32_t nanoAmps = 0; // We don't have anywhere near this precision, it just makes fixed-point computations easier
-        int ledOnCount = 0;
+    /// <summary>
+    /// Estimates the current drawn by the LEDs to display the given colors, in nano amps.
+    /// Optionally returns the part of it that depends on the intensities.
+    /// </summary>
+    uint32_t estimateCurrentNanoAmps(const uint32_t* colors, uint32_t* outLevelsNanoAmps) {
+        uint32_t nanoAmps = 0;
+        uint32_t levels = 0;
         for (int i = 0; i < numLed; ++i) {
-            uint32_t color = pixels[i];
+            uint32_t color = colors[i];
             if (color != 0) {
-                ledOnCount++;
-                // Clamp intensity
-                uint8_t r = Utils::getRed(color);
-                uint8_t g = Utils::getGreen(color);
-                uint8_t b = Utils::getBlue(color);
-                nanoAmps += (uint32_t)247000 * 3 + 18200 * (r + g + b);
+                nanoAmps += LED_ON_NANO_AMPS;
+                levels += Utils::getRed(color) + Utils::getGreen(color) + Utils::getBlue(color);
             }
         }
-        if (ledOnCount > 0) {
-            nanoAmps += 7100000;
+        if (nanoAmps > 0) {
+            nanoAmps += LED_BASE_NANO_AMPS;
         }
+        uint32_t levelsNanoAmps = levels * LED_LEVEL_NANO_AMPS;
+        if (outLevelsNanoAmps != nullptr) {
+            *outLevelsNanoAmps = levelsNanoAmps;
+        }
+        return nanoAmps + levelsNanoAmps;
+    }
+
+    /// <summary>
+    /// Copies the colors, scaling them down proportionally if they would draw more than the budget
+    /// </summary>
+    void limitCurrent(const uint32_t* colors, uint32_t* outColors, uint16_t budgetMilliAmps) {
+        uint32_t levelsNanoAmps = 0;
+        uint32_t nanoAmps = estimateCurrentNanoAmps(colors, &levelsNanoAmps);
+        uint32_t budgetNanoAmps = (uint32_t)budgetMilliAmps * 1000000;
+        if (nanoAmps <= budgetNanoAmps || levelsNanoAmps == 0) {
+            memcpy(outColors, colors, numLed * sizeof(uint32_t));
+        } else {
+            // Only the intensity dependent part of the current can be scaled
+            uint32_t fixedNanoAmps = nanoAmps - levelsNanoAmps;
+            uint32_t availableNanoAmps = budgetNanoAmps > fixedNanoAmps ? budgetNanoAmps - fixedNanoAmps : 0;
+            uint32_t scaleTimes1000 = (uint32_t)((uint64_t)availableNanoAmps * 1000 / levelsNanoAmps);
+            for (int i = 0; i < numLed; ++i) {
+                outColors[i] = Utils::scaleColor(colors[i], scaleTimes1000);
+            }
+        }
+    }
+
+    uint8_t computeCurrentEstimate() {
+        uint32_t nanoAmps = estimateCurrentNanoAmps(pixels, nullptr);
+        if (nanoAmps == 0 && powerOn) {
+            // Pre-powered, or shortly before being turned off
+            nanoAmps = LED_BASE_NANO_AMPS;
+        }
+        uint32_t milliAmps = nanoAmps / 1000000;
+        return (uint8_t)MIN(milliAmps, 255);
+    }
+
+    void setCurrentBudget(uint16_t milliAmps) {
+        currentBudgetMilliAmps = milliAmps;
+        updateEffectiveCurrentBudget();
+    }
+
+    uint16_t getCurrentBudget() {
+        return currentBudgetMilliAmps;
+    }
+
+    /// <summary>
+    /// Power tiers, percentage of the current budget allowed for a given battery level.
+    /// The budget is interpolated between tiers so the LEDs dim gradually as the battery drains.
+    /// </summary>
+    struct PowerTier
+    {
+        uint8_t levelPercent;
+        uint8_t budgetPercent;
+    };
+
+    static const PowerTier powerTiers[] = {
+        {  0,  20 },
+        { 15,  30 },
+        { 30,  60 },
+        { 50, 100 },
+    };
+
+    void updateEffectiveCurrentBudget() {
+        // Scale the budget based on the battery level
+        int level = BatteryController::getLevelPercent();
+        int tierCount = sizeof(powerTiers) / sizeof(powerTiers[0]);
+        int budgetPercent = powerTiers[tierCount - 1].budgetPercent;
+        for (int i = 1; i < tierCount; ++i) {
+            if (level < powerTiers[i].levelPercent) {
+                auto& prev = powerTiers[i - 1];
+                auto& next = powerTiers[i];
+                budgetPercent = prev.budgetPercent + (next.budgetPercent - prev.budgetPercent) * (level - prev.levelPercent) / (next.levelPercent - prev.levelPercent);
+                break;
+            }
+        }
+
+        // And derate further if the battery voltage sags while the LEDs are drawing current,
+        // the last reading taken with the LEDs on is kept until the next one
+        if (powerOn) {
+            int vbat = BatteryController::getVoltageMilli();
+            if (vbat <= sagVbatMilli - LED_SAG_HYSTERESIS_MILLI || vbat >= sagVbatMilli + LED_SAG_HYSTERESIS_MILLI) {
+                sagVbatMilli = MIN(vbat, LED_SAG_VBAT_MILLI);
+            }
+        }
+        if (sagVbatMilli < LED_SAG_VBAT_MILLI) {
+            int sagPercent = LED_SAG_MIN_BUDGET_PERCENT;
+            if (sagVbatMilli > LED_SAG_MIN_VBAT_MILLI) {
+                sagPercent += (100 - LED_SAG_MIN_BUDGET_PERCENT) * (sagVbatMilli - LED_SAG_MIN_VBAT_MILLI) / (LED_SAG_VBAT_MILLI - LED_SAG_MIN_VBAT_MILLI);
+            }
+            budgetPercent = budgetPercent * sagPercent / 100;
+        }
+
+        effectiveBudgetMilliAmps = (uint16_t)(currentBudgetMilliAmps * budgetPercent / 100);
+    }
+
+    uint16_t getEffectiveCurrentBudget() {
+        return effectiveBudgetMilliAmps;
+    }
 
-        return (uint8_t)(nanoAmps / 1000000);
+    void onBatteryLevelChange(void* param, uint8_t levelPercent) {
+        updateEffectiveCurrentBudget();
     }
 
 }
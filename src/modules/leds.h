@@ -12,10 +12,23 @@ namespace Modules::LEDs
     void setPixelColor(uint16_t n, uint32_t c);
     void setPixelColors(int* indices, uint32_t* colors, int count);
     void setPixelColors(uint32_t* colors);
+    void setPixelColorsDithered(uint32_t* colors, uint32_t* fractions);
     void setAll(uint32_t c);
     void clear();
+    bool isBusy();
     uint8_t computeCurrentEstimate();
 
+    // Powers the LEDs ahead of a likely frame (e.g. while the die is rolling) so that it shows without
+    // waiting for them to power up. They go back off after timeoutMs if there is still nothing to show.
+    void prePower(int timeoutMs);
+
+    // Current limiter, frames estimated to draw more than the budget are dimmed proportionally.
+    // The effective budget is lowered gradually as the battery level and loaded voltage drop.
+    void setCurrentBudget(uint16_t milliAmps);
+    uint16_t getCurrentBudget();
+    uint16_t getEffectiveCurrentBudget();
+    uint32_t estimateCurrentNanoAmps(const uint32_t* colors, uint32_t* outLevelsNanoAmps);
+
     typedef void(*LEDClientMethod)(void* param, bool powerOn);
     void hookPowerState(LEDClientMethod method, void* param);
     void unHookPowerState(LEDClientMethod client);
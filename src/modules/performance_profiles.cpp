@@ -0,0 +1,136 @@
+#include "performance_profiles.h"
+#include "accelerometer.h"
+#include "anim_controller.h"
+#include "leds.h"
+#include "bluetooth/bluetooth_custom_advertising_data.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "bluetooth/telemetry.h"
+#include "pixel.h"
+#include "nrf_log.h"
+
+using namespace Bluetooth;
+
+namespace Modules::PerformanceProfiles
+{
+    // 0 keeps the default value, except for the telemetry floor where it is the default
+    struct ProfileSettings
+    {
+        AnimController::FrameRateMode frameRateMode;
+        uint8_t fps;
+        uint16_t ledCurrentBudgetMilliAmps;
+        uint16_t accelLowRateDelayMs;
+        uint16_t advertisingIdleIntervalMs;
+        uint16_t telemetryMinIntervalMs;
+    };
+
+    // Profile_Default is read from the modules by init()
+    static ProfileSettings profiles[Profile_Count] =
+    {
+        { AnimController::FrameRateMode_Fixed,      0,  0,      0,                      0,      0 },    // Profile_Default
+        { AnimController::FrameRateMode_Fixed,      0,  0,      ACCEL_LOW_RATE_NEVER,   100,    0 },    // Profile_Tournament
+        { AnimController::FrameRateMode_Adaptive,   0,  120,    500,                    2000,   1000 }, // Profile_LowBattery
+        { AnimController::FrameRateMode_Adaptive,   60, 0,      0,                      2000,   0 },    // Profile_Display
+        { AnimController::FrameRateMode_Fixed,      0,  0,      ACCEL_LOW_RATE_NEVER,   0,      0 },    // Profile_Factory
+    };
+
+    static bool initialized = false;
+    static Profile selectedProfile = Profile_Default;
+    static Profile activeProfile = Profile_Default;
+    static bool batteryLow = false;
+
+    void setPerformanceProfileHandler(const Message* msg);
+
+    /// <summary>
+    /// Applies all the settings of the profile at once, from the main loop
+    /// </summary>
+    static void apply(Profile profile) {
+        const auto& defaults = profiles[Profile_Default];
+        const auto& settings = profiles[profile];
+        AnimController::setFrameRate(settings.frameRateMode, settings.fps != 0 ? settings.fps : defaults.fps);
+        LEDs::setCurrentBudget(settings.ledCurrentBudgetMilliAmps != 0 ? settings.ledCurrentBudgetMilliAmps : defaults.ledCurrentBudgetMilliAmps);
+        Accelerometer::setLowRateDelay(settings.accelLowRateDelayMs != 0 ? settings.accelLowRateDelayMs : defaults.accelLowRateDelayMs);
+        CustomAdvertisingDataHandler::setIdleInterval(settings.advertisingIdleIntervalMs != 0 ? settings.advertisingIdleIntervalMs : defaults.advertisingIdleIntervalMs);
+        Telemetry::setMinIntervalFloor(settings.telemetryMinIntervalMs);
+        activeProfile = profile;
+        NRF_LOG_INFO("Performance profile %d", profile);
+    }
+
+    static void sendProfile() {
+        MessagePerformanceProfile profileMsg;
+        profileMsg.selectedProfile = selectedProfile;
+        profileMsg.activeProfile = activeProfile;
+        MessageService::SendMessage(&profileMsg);
+    }
+
+    /// <summary>
+    /// Switches to the profile that should be active, returns whether it changed
+    /// </summary>
+    static bool update() {
+        const Profile profile = batteryLow && selectedProfile != Profile_Factory ? Profile_LowBattery : selectedProfile;
+        if (profile != activeProfile) {
+            apply(profile);
+            return true;
+        }
+        return false;
+    }
+
+    void init() {
+        // The default profile is whatever the modules start with
+        auto& defaults = profiles[Profile_Default];
+        defaults.frameRateMode = AnimController::getFrameRateMode();
+        defaults.fps = AnimController::getFrameRate();
+        defaults.ledCurrentBudgetMilliAmps = LEDs::getCurrentBudget();
+        defaults.accelLowRateDelayMs = Accelerometer::getLowRateDelay();
+        defaults.advertisingIdleIntervalMs = CustomAdvertisingDataHandler::getIdleInterval();
+        defaults.telemetryMinIntervalMs = 0;
+
+        MessageService::RegisterMessageHandler(Message::MessageType_SetPerformanceProfile, setPerformanceProfileHandler);
+
+        switch (Pixel::getCurrentRunMode()) {
+            case Pixel::RunMode_Validation:
+                selectedProfile = Profile_Factory;
+                break;
+            case Pixel::RunMode_Attract:
+                selectedProfile = Profile_Display;
+                break;
+            default:
+                selectedProfile = Profile_Default;
+                break;
+        }
+        batteryLow = BatteryController::getBatteryState() == BatteryController::BatteryState_Low;
+        initialized = true;
+        update();
+
+        NRF_LOG_DEBUG("Performance profiles init");
+    }
+
+    void select(Profile profile) {
+        if (profile < Profile_Count) {
+            selectedProfile = profile;
+            update();
+        }
+    }
+
+    Profile getSelectedProfile() {
+        return selectedProfile;
+    }
+
+    Profile getActiveProfile() {
+        return activeProfile;
+    }
+
+    void onBatteryStateChange(void* param, BatteryController::BatteryState newState) {
+        // Charging gets the selected profile back right away
+        batteryLow = newState == BatteryController::BatteryState_Low;
+        if (initialized && update()) {
+            sendProfile();
+        }
+    }
+
+    void setPerformanceProfileHandler(const Message* msg) {
+        auto profileMsg = (const MessageSetPerformanceProfile*)msg;
+        select((Profile)profileMsg->profile);
+        sendProfile();
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "battery_controller.h"
+
+/// <summary>
+/// Sets the frame rate, LED current budget, accelerometer rate, advertising interval and
+/// telemetry rate together, for a given trade-off between latency and battery life
+/// </summary>
+namespace Modules::PerformanceProfiles
+{
+    enum Profile : uint8_t
+    {
+        Profile_Default = 0,    // What the modules are initialized with
+        Profile_Tournament,     // Fastest roll results: the accelerometer and advertising stay at their fast rates
+        Profile_LowBattery,     // Stretches the remaining charge, active whenever the battery is low
+        Profile_Display,        // Smooth animations at a lower advertising rate, for attract mode
+        Profile_Factory,        // Fixed rates for repeatable measurements, for validation
+        Profile_Count
+    };
+
+    void init();
+
+    // The selected profile is active unless the battery is low and it isn't the factory one
+    void select(Profile profile);
+    Profile getSelectedProfile();
+    Profile getActiveProfile();
+
+    // Called by the battery controller, see config/static_subscribers.h
+    void onBatteryStateChange(void* param, BatteryController::BatteryState newState);
+}
@@ -0,0 +1,114 @@
+#include "roll_stats.h"
+#include "config/roll_log.h"
+#include "config/settings.h"
+#include "bluetooth/bluetooth_messages.h"
+#include "bluetooth/bluetooth_message_service.h"
+#include "nrf_log.h"
+#include <string.h>
+
+using namespace Config;
+using namespace Bluetooth;
+
+namespace Modules::RollStats
+{
+    static uint16_t faceCounts[MAX_LED_COUNT];
+    static uint16_t durationBins[ROLL_STATS_DURATION_BINS];
+    static uint16_t rollCount = 0;
+    static uint16_t crookedCount = 0;
+
+    // Sum of the squared face counts, so the chi-square is computed without going through the faces
+    static uint64_t sumOfSquares = 0;
+
+    void requestRollStatsHandler(const Message* message);
+
+    void addDuration(uint32_t durationMs) {
+        uint32_t bin = durationMs / ROLL_STATS_DURATION_BIN_MS;
+        if (bin >= ROLL_STATS_DURATION_BINS) {
+            bin = ROLL_STATS_DURATION_BINS - 1;
+        }
+        if (durationBins[bin] < UINT16_MAX) {
+            durationBins[bin]++;
+        }
+    }
+
+    void addRoll(uint8_t face, uint32_t durationMs) {
+        if (face >= MAX_LED_COUNT || rollCount == UINT16_MAX) {
+            return;
+        }
+        // (n + 1)^2 = n^2 + 2n + 1
+        sumOfSquares += 2 * faceCounts[face] + 1;
+        faceCounts[face]++;
+        rollCount++;
+        addDuration(durationMs);
+    }
+
+    void addCrooked(uint32_t durationMs) {
+        if (crookedCount < UINT16_MAX) {
+            crookedCount++;
+        }
+        addDuration(durationMs);
+    }
+
+    void reset() {
+        memset(faceCounts, 0, sizeof(faceCounts));
+        memset(durationBins, 0, sizeof(durationBins));
+        rollCount = 0;
+        crookedCount = 0;
+        sumOfSquares = 0;
+    }
+
+    void addRecord(void* param, uint32_t record) {
+        uint8_t face = RollLog::recordFace(record);
+        if (face == ROLL_LOG_CROOKED_FACE) {
+            addCrooked(RollLog::recordDurationMs(record));
+        } else if (face != ROLL_LOG_MARKER_FACE) {
+            addRoll(face, RollLog::recordDurationMs(record));
+        }
+    }
+
+    void init() {
+        reset();
+        RollLog::forEachRecord(addRecord, nullptr);
+        MessageService::RegisterMessageHandler(Message::MessageType_RequestRollStats, requestRollStatsHandler);
+        NRF_LOG_INFO("Roll stats init, %d rolls", rollCount);
+    }
+
+    uint16_t getRollCount() {
+        return rollCount;
+    }
+
+    uint16_t getCrookedCount() {
+        return crookedCount;
+    }
+
+    uint16_t getFaceCount(int face) {
+        return faceCounts[face];
+    }
+
+    uint16_t getDurationBin(int bin) {
+        return durationBins[bin];
+    }
+
+    uint32_t getChiSquareTimes1000() {
+        if (rollCount == 0) {
+            return 0;
+        }
+        // With k faces and N rolls, each face is expected N/k times and
+        // sum((c - N/k)^2 / (N/k)) = k * sum(c^2) / N - N
+        uint64_t k = SettingsManager::getLayout()->faceCount;
+        uint64_t nTimes1000 = (uint64_t)rollCount * 1000;
+        uint64_t t = k * sumOfSquares * 1000 / rollCount;
+        return t > nTimes1000 ? (uint32_t)(t - nTimes1000) : 0;
+    }
+
+    void requestRollStatsHandler(const Message* message) {
+        MessageRollStats msg;
+        msg.rollCount = rollCount;
+        msg.crookedCount = crookedCount;
+        msg.faceCount = (uint8_t)SettingsManager::getLayout()->faceCount;
+        msg.chiSquareTimes1000 = getChiSquareTimes1000();
+        memcpy(msg.durationBins, durationBins, sizeof(durationBins));
+        memcpy(msg.faceCounts, faceCounts, sizeof(faceCounts));
+        MessageService::SendMessage(&msg);
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+// Roll duration histogram, the last bin also counts longer rolls
+#define ROLL_STATS_DURATION_BINS 8
+#define ROLL_STATS_DURATION_BIN_MS 250
+
+namespace Modules::RollStats
+{
+    // Rebuilds the statistics from the rolls stored in the roll log
+    void init();
+
+    void addRoll(uint8_t face, uint32_t durationMs);
+    void addCrooked(uint32_t durationMs);
+    void reset();
+
+    uint16_t getRollCount();
+    uint16_t getCrookedCount();
+    uint16_t getFaceCount(int face);
+    uint16_t getDurationBin(int bin);
+
+    // Pearson's chi-square of the face counts against a fair die, times 1000
+    uint32_t getChiSquareTimes1000();
+}
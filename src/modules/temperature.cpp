@@ -6,6 +6,7 @@
 #include "bluetooth/bluetooth_messages.h"
 #include "bluetooth/bluetooth_message_service.h"
 #include "bluetooth/bluetooth_stack.h"
+#include "bluetooth/state_characteristics.h"
 
 using namespace DriversNRF;
 using namespace DriversHW;
@@ -14,6 +15,9 @@ using namespace Bluetooth;
 #define MAX_TEMPERATURE_CLIENTS 2
 #define TEMPERATURE_TIMER_MS 1000	// ms
 #define TEMPERATURE_TIMER_MS_SLOW 10000	// ms
+#define TEMPERATURE_STABLE_SAMPLES 5 // Samples without a change before slowing down
+#define NTC_TEMPERATURE_NEAR_THRESHOLD 300 // 3 degrees, sampled fast this close to a watched threshold
+#define MAX_NTC_THRESHOLDS 4
 #define MCU_TEMPERATURE_CHANGE_THRESHOLD 100 // 1 degree
 #define NTC_TEMPERATURE_CHANGE_THRESHOLD 10 // 0.1 degree
 
@@ -27,13 +31,19 @@ namespace Modules::Temperature
 {
     static int32_t currentMCUTemperature;
     static int32_t currentNTCTemperature;
-    static uint16_t temperatureTimerMs = TEMPERATURE_TIMER_MS;
+    static bool slow = false;
+    static uint8_t stableSampleCount = 0;
+
+    // See watchNTCThreshold()
+    static int16_t ntcThresholds[MAX_NTC_THRESHOLDS];
+    static uint8_t ntcThresholdCount = 0;
     APP_TIMER_DEF(temperatureTimer);
 
     DelegateArray<TemperatureChangeClientMethod, MAX_TEMPERATURE_CLIENTS> clients;
 
     void getTemperatureHandler(const Message* msg);
     void update(void* context);
+    uint16_t getTimerMs();
 
     static InitCallback the_callback = nullptr;
     void init(InitCallback callback) {
@@ -44,9 +54,10 @@ namespace Modules::Temperature
             currentMCUTemperature = MCUTemperature::measure();
 
             MessageService::RegisterMessageHandler(Message::MessageType_RequestTemperature, getTemperatureHandler);
+            StateCharacteristics::setTemperature(currentMCUTemperature, currentNTCTemperature);
 
             Timers::createTimer(&temperatureTimer, APP_TIMER_MODE_SINGLE_SHOT, update);
-            Timers::startTimer(temperatureTimer, temperatureTimerMs);
+            Timers::startTimerAligned(temperatureTimer, getTimerMs());
 
             // Check that the measured voltages are in a valid range
             bool success = currentMCUTemperature > MCU_TEMPERATURE_LOW_THRESHOLD && currentMCUTemperature < MCU_TEMPERATURE_HIGH_THRESHOLD &&
@@ -87,19 +98,45 @@ namespace Modules::Temperature
                 (newNTCTemperature <= (currentNTCTemperature - NTC_TEMPERATURE_CHANGE_THRESHOLD)) || (newNTCTemperature >= (currentNTCTemperature + NTC_TEMPERATURE_CHANGE_THRESHOLD))) {
 
                 // Update temperatures
+                stableSampleCount = 0;
                 currentMCUTemperature = newMCUTemperature;
                 currentNTCTemperature = newNTCTemperature;
+                StateCharacteristics::setTemperature(currentMCUTemperature, currentNTCTemperature);
                 // Notify clients
                 for (int i = 0; i < clients.Count(); ++i) {
                     clients[i].handler(clients[i].token, currentMCUTemperature, currentNTCTemperature);
                 }
+            } else if (stableSampleCount < TEMPERATURE_STABLE_SAMPLES) {
+                stableSampleCount++;
             }
 
             // Restart the timer in any case
-            Timers::startTimer(temperatureTimer, temperatureTimerMs);
+            Timers::startTimerAligned(temperatureTimer, getTimerMs());
         })) {
             NRF_LOG_WARNING("Unable to measure NTC temperature");
-            Timers::startTimer(temperatureTimer, temperatureTimerMs);
+            Timers::startTimerAligned(temperatureTimer, getTimerMs());
+        }
+    }
+
+    /// <summary>
+    /// Sampling is fast while the temperature changes or is close to a threshold someone watches,
+    /// and slows down once it has been stable for a while
+    /// </summary>
+    uint16_t getTimerMs() {
+        for (int i = 0; i < ntcThresholdCount; ++i) {
+            const int32_t distance = currentNTCTemperature - ntcThresholds[i];
+            if (distance > -NTC_TEMPERATURE_NEAR_THRESHOLD && distance < NTC_TEMPERATURE_NEAR_THRESHOLD) {
+                return TEMPERATURE_TIMER_MS;
+            }
+        }
+        return slow || stableSampleCount >= TEMPERATURE_STABLE_SAMPLES ? TEMPERATURE_TIMER_MS_SLOW : TEMPERATURE_TIMER_MS;
+    }
+
+    void watchNTCThreshold(int16_t temperatureTimes100) {
+        if (ntcThresholdCount < MAX_NTC_THRESHOLDS) {
+            ntcThresholds[ntcThresholdCount++] = temperatureTimes100;
+        } else {
+            NRF_LOG_ERROR("Too many NTC thresholds watched");
         }
     }
 
@@ -111,12 +148,8 @@ namespace Modules::Temperature
         return currentNTCTemperature;
     }
 
-    void slowMode(bool slow) {
-        if (slow) {
-            temperatureTimerMs = TEMPERATURE_TIMER_MS_SLOW;
-        } else {
-            temperatureTimerMs = TEMPERATURE_TIMER_MS;
-        }
+    void slowMode(bool slowMode) {
+        slow = slowMode;
         // The new timer duration will kick in on the next reset of the battery timer.
     }
 
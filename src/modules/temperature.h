@@ -11,6 +11,9 @@ namespace Modules::Temperature
     int16_t getNTCTemperatureTimes100();
     void slowMode(bool slow);
 
+    // Temperatures are sampled more often near these, so crossing one is noticed within a second
+    void watchNTCThreshold(int16_t temperatureTimes100);
+
     typedef void(*TemperatureChangeClientMethod)(void* param, int32_t mcuTempTimes100, int32_t ntcTempTimes100);
     bool hookTemperatureChange(TemperatureChangeClientMethod method, void* param);
     void unHookTemperatureChange(TemperatureChangeClientMethod client);
@@ -15,6 +15,10 @@
 #include "nrf_nvmc.h"
 #include "drivers_nrf/timers.h"
 #include "drivers_hw/battery.h"
+#include "drivers_nrf/a2d.h"
+#include "drivers_nrf/retained_state.h"
+#include "modules/accelerometer.h"
+#include "modules/temperature.h"
 
 using namespace Animations;
 using namespace Modules;
@@ -25,6 +29,19 @@ using namespace Bluetooth;
 
 #define VALIDATION_MODE_SLEEP_DELAY_MS 25000 // milliseconds
 
+// Time given to the self test result to go out before turning off
+#define SELF_TEST_SLEEP_DELAY_MS 300
+
+// Self test pass ranges
+#define SELF_TEST_MIN_VBAT_TIMES_1000 3000
+#define SELF_TEST_MAX_VBAT_TIMES_1000 4400
+#define SELF_TEST_MIN_VDD_TIMES_1000 2700
+#define SELF_TEST_MAX_VDD_TIMES_1000 3600
+#define SELF_TEST_MIN_ACC_SQUARED_TIMES_1000000 (800 * 800)    // The die must be still, only gravity is measured
+#define SELF_TEST_MAX_ACC_SQUARED_TIMES_1000000 (1200 * 1200)
+#define SELF_TEST_MIN_NTC_TEMPERATURE_TIMES_100 0
+#define SELF_TEST_MAX_NTC_TEMPERATURE_TIMES_100 5000
+
 namespace Modules::ValidationManager
 {
     static AnimationBlinkId blinkId;
@@ -34,6 +51,7 @@ namespace Modules::ValidationManager
     void startNameAnim();
     void onConnectionEvent(void *token, bool connected);
     void exitValidationModeHandler(const Message *msg);
+    void runSelfTestHandler(const Message *msg);
 
     void GoToSysOffCallback(void* ignore);
 
@@ -47,11 +65,14 @@ namespace Modules::ValidationManager
         // Name animation object
         blinkId.type = Animation_BlinkId;
         blinkId.framesPerBlink = 3; // blink duration = 3 x 33 ms
+        blinkId.slotBitsCount = 0;
         blinkId.setDuration(1000);
         blinkId.brightness = isCastedDie ? 0x80 : 0x10; // Higher brightness for casted dice
 
         Bluetooth::MessageService::RegisterMessageHandler(
             Message::MessageType_ExitValidation, exitValidationModeHandler);
+        Bluetooth::MessageService::RegisterMessageHandler(
+            Message::MessageType_RunSelfTest, runSelfTestHandler);
 
         NRF_LOG_DEBUG("Validation Manager init for %s", isCastedDie ? "casted die" : "bare board");
     }
@@ -92,6 +113,7 @@ namespace Modules::ValidationManager
         if (connected)
         {
             stopNameAnim(); // Stop animation on connect
+            Stack::requestFastConnection(Stack::ConnectionUser_Validation); // Released on disconnect
             BehaviorController::forceCheckBatteryState();
             Timers::cancelDelayedCallback(GoToSysOffCallback, nullptr);
         }
@@ -111,6 +133,63 @@ namespace Modules::ValidationManager
         }
     }
 
+    // Runs all the checks at once, so the test station needs a single round trip per die
+    void runSelfTestHandler(const Message *msg)
+    {
+        auto req = (const MessageRunSelfTest *)msg;
+        NRF_LOG_INFO("Running self test");
+
+        MessageSelfTestResult result;
+        uint32_t failures = SelfTestFailures_None;
+
+        result.vBatTimes1000 = A2D::readVBatTimes1000();
+        if (result.vBatTimes1000 < SELF_TEST_MIN_VBAT_TIMES_1000 || result.vBatTimes1000 > SELF_TEST_MAX_VBAT_TIMES_1000) {
+            failures |= SelfTestFailures_Battery;
+        }
+        result.vddTimes1000 = A2D::readVDDTimes1000();
+        if (result.vddTimes1000 < SELF_TEST_MIN_VDD_TIMES_1000 || result.vddTimes1000 > SELF_TEST_MAX_VDD_TIMES_1000) {
+            failures |= SelfTestFailures_VDD;
+        }
+        result.vBoardTimes1000 = A2D::readVBoardTimes1000();
+        result.vNTCTimes1000 = A2D::readVNTCTimes1000();
+
+        result.ntcTemperatureTimes100 = Temperature::getNTCTemperatureTimes100();
+        result.mcuTemperatureTimes100 = Temperature::getMCUTemperatureTimes100();
+        if (result.ntcTemperatureTimes100 < SELF_TEST_MIN_NTC_TEMPERATURE_TIMES_100 || result.ntcTemperatureTimes100 > SELF_TEST_MAX_NTC_TEMPERATURE_TIMES_100) {
+            failures |= SelfTestFailures_NTC;
+        }
+
+        Core::int3 acc;
+        Accelerometer::readAccelerometer(&acc);
+        result.accXTimes1000 = (int16_t)acc.xTimes1000;
+        result.accYTimes1000 = (int16_t)acc.yTimes1000;
+        result.accZTimes1000 = (int16_t)acc.zTimes1000;
+        result.face = (uint8_t)Accelerometer::currentFace();
+        int32_t accSquared = acc.xTimes1000 * acc.xTimes1000 + acc.yTimes1000 * acc.yTimes1000 + acc.zTimes1000 * acc.zTimes1000;
+        if (accSquared < SELF_TEST_MIN_ACC_SQUARED_TIMES_1000000 || accSquared > SELF_TEST_MAX_ACC_SQUARED_TIMES_1000000) {
+            failures |= SelfTestFailures_Accelerometer;
+        }
+
+        // The LED return test always runs at boot in validation mode
+        result.ledReturn = RetainedState::getState()->ledReturnPassed;
+        if (!result.ledReturn) {
+            failures |= SelfTestFailures_LEDReturn;
+        }
+
+        result.dataSetHash = DataSet::dataHash();
+        if (!DataSet::CheckValid()) {
+            failures |= SelfTestFailures_DataSet;
+        }
+
+        result.failures = failures;
+        NRF_LOG_INFO("Self test failures: 0x%x", failures);
+        MessageService::SendMessage(&result);
+
+        if ((req->flags & SelfTestFlags_SleepWhenDone) != 0) {
+            Timers::setDelayedCallback(GoToSysOffCallback, nullptr, SELF_TEST_SLEEP_DELAY_MS);
+        }
+    }
+
     bool leaveValidation()
     {
         return Pixel::setCurrentRunMode(Pixel::RunMode_User);
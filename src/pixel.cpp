@@ -72,6 +72,6 @@ namespace Pixel
 
     bool setCurrentRunMode(RunMode mode) {
         return getCurrentRunMode() == mode || // Already set
-            Config::ValueStore::writeValue(Config::ValueStore::ValueType_RunMode, mode) != -1;
+            Config::ValueStore::writeValue(Config::ValueStore::ValueType_RunMode, mode) >= 0;
     }
 }
\ No newline at end of file
@@ -10,24 +10,44 @@
 
 namespace Rainbow
 {
+    // The wheel at full intensity, generated at compile time so it sits in flash
+    struct WheelTable
+    {
+        uint32_t colors[256];
+    };
+
+    constexpr WheelTable makeWheelTable() {
+        WheelTable ret = {};
+        for (int pos = 0; pos < 256; ++pos) {
+            if (pos < 85) {
+                ret.colors[pos] = Utils::toColor(pos * 3, 255 - pos * 3, 0);
+            } else if (pos < 170) {
+                ret.colors[pos] = Utils::toColor(255 - (pos - 85) * 3, 0, (pos - 85) * 3);
+            } else {
+                ret.colors[pos] = Utils::toColor(0, (pos - 170) * 3, 255 - (pos - 170) * 3);
+            }
+        }
+        return ret;
+    }
+
+    static constexpr WheelTable wheelTable = makeWheelTable();
+
     // Input a value 0 to 255 to get a color value.
     // The colours are a transition r - g - b - back to r.
     uint32_t wheel(uint8_t WheelPos, uint8_t intensity)
     {
-        if (WheelPos < 85)
-        {
-            return Utils::toColor(WheelPos * 3 * intensity / 255, (255 - WheelPos * 3) * intensity / 255, 0);
-        }
-        else if (WheelPos < 170)
-        {
-            WheelPos -= 85;
-            return Utils::toColor((255 - WheelPos * 3) * intensity / 255, 0, WheelPos * 3 * intensity / 255);
-        }
-        else
-        {
-            WheelPos -= 170;
-            return Utils::toColor(0, WheelPos * 3 * intensity / 255, (255 - WheelPos * 3) * intensity / 255);
+        uint32_t color = wheelTable.colors[WheelPos];
+        if (intensity == 255) {
+            return color;
         }
+
+        // Scale each channel by intensity / 255, red and blue at once. The products fit in 16 bits
+        // and (v + 1 + (v >> 8)) >> 8 is exactly v / 255 for them, so this matches the arithmetic.
+        uint32_t rb = (color & 0x00FF00FF) * intensity;
+        rb = ((rb + 0x00010001 + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+        uint32_t g = ((color >> 8) & 0xFF) * intensity;
+        g = (g + 1 + (g >> 8)) >> 8;
+        return rb | (g << 8);
     }
 
     uint32_t faceWheel(uint8_t face, uint8_t count) {
@@ -17,34 +17,61 @@ namespace Utils
         return (value + 3) & ~(uint32_t)3;
     }
 
-    uint32_t addColors(uint32_t a, uint32_t b) {
-        uint8_t red = MAX(getRed(a), getRed(b));
-        uint8_t green = MAX(getGreen(a), getGreen(b));
-        uint8_t blue = MAX(getBlue(a), getBlue(b));
-        return toColor(red,green,blue);
+    // The color math below works on packed colors, red and blue are processed together as two
+    // 16 bits lanes (0x00RR00BB) and green on its own (0x0000GG00), so that a single multiply
+    // scales all channels. Factors are expressed in 256th, so that divides become shifts.
+    static inline uint32_t scaleColor256(uint32_t color, uint32_t factor256) {
+        uint32_t rb = (((color & 0x00FF00FF) * factor256) >> 8) & 0x00FF00FF;
+        uint32_t g = (((color & 0x0000FF00) * factor256) >> 8) & 0x0000FF00;
+        return rb | g;
+    }
+
+    // Maps an 8 bits intensity (0-255) to a factor in 256th (0-256), exact at both ends
+    static inline uint32_t intensityTo256(uint32_t intensity) {
+        return intensity + (intensity >> 7);
     }
 
     uint32_t mulColors(uint32_t a, uint32_t b) {
-        uint8_t red = getRed(a) * getRed(b) / 255;
-        uint8_t green = getGreen(a) * getGreen(b) / 255;
-        uint8_t blue = getBlue(a) * getBlue(b) / 255;
-        return toColor(red,green,blue);
+        // Each channel has its own factor, so we can't use the lanes here, but we still avoid the divides
+        uint32_t red = (getRed(a) * intensityTo256(getRed(b))) >> 8;
+        uint32_t green = (getGreen(a) * intensityTo256(getGreen(b))) >> 8;
+        uint32_t blue = (getBlue(a) * intensityTo256(getBlue(b))) >> 8;
+        return toColor(red, green, blue);
     }
 
     uint32_t scaleColor(uint32_t color, uint32_t scaleTimes1000) {
-        uint8_t red = CLAMP(getRed(color) * scaleTimes1000 / 1000, 0, 255);
-        uint8_t green = CLAMP(getGreen(color) * scaleTimes1000 / 1000, 0, 255);
-        uint8_t blue = CLAMP(getBlue(color) * scaleTimes1000 / 1000, 0, 255);
-        return toColor(red, green, blue);
+        if (scaleTimes1000 <= 1000) {
+            // 16778 / 65536 ~= 256 / 1000
+            return scaleColor256(color, (scaleTimes1000 * 16778) >> 16);
+        } else {
+            // Brightening can overflow the channels, clamp them
+            uint8_t red = CLAMP(getRed(color) * scaleTimes1000 / 1000, 0, 255);
+            uint8_t green = CLAMP(getGreen(color) * scaleTimes1000 / 1000, 0, 255);
+            uint8_t blue = CLAMP(getBlue(color) * scaleTimes1000 / 1000, 0, 255);
+            return toColor(red, green, blue);
+        }
     }
 
     uint32_t interpolateColors(uint32_t color1, uint32_t time1, uint32_t color2, uint32_t time2, uint32_t time) {
-        // To stick to integer math, we'll scale the values
-        int scaledPercent = (time - time1) * scaler / (time2 - time1);
-        int scaledRed = getRed(color1)* (scaler - scaledPercent) + getRed(color2) * scaledPercent;
-        int scaledGreen = getGreen(color1) * (scaler - scaledPercent) + getGreen(color2) * scaledPercent;
-        int scaledBlue = getBlue(color1) * (scaler - scaledPercent) + getBlue(color2) * scaledPercent;
-        return toColor(scaledRed / scaler, scaledGreen / scaler, scaledBlue / scaler);
+        // Single divide to get the blend factor, in 256th
+        uint32_t factor = (time - time1) * 256 / (time2 - time1);
+        uint32_t invFactor = 256 - factor;
+        uint32_t rb = (((color1 & 0x00FF00FF) * invFactor + (color2 & 0x00FF00FF) * factor) >> 8) & 0x00FF00FF;
+        uint32_t g = (((color1 & 0x0000FF00) * invFactor + (color2 & 0x0000FF00) * factor) >> 8) & 0x0000FF00;
+        return rb | g;
+    }
+
+    uint32_t mixColors(uint32_t color1, uint32_t color2, uint32_t factor256) {
+        uint32_t invFactor = 256 - factor256;
+        uint32_t rb = (((color1 & 0x00FF00FF) * invFactor + (color2 & 0x00FF00FF) * factor256) >> 8) & 0x00FF00FF;
+        uint32_t g = (((color1 & 0x0000FF00) * invFactor + (color2 & 0x0000FF00) * factor256) >> 8) & 0x0000FF00;
+        return rb | g;
+    }
+
+    uint32_t overColors(uint32_t bottom, uint32_t top) {
+        // The top color is premultiplied by its own opacity, so it is added as is
+        uint32_t opacity = intensityTo256(getGreyscale(top));
+        return addColorsSaturated(scaleColor256(bottom, 256 - opacity), top);
     }
 
     // Helper method to convert register readings to signed integers
@@ -217,8 +244,26 @@ for x in range(256):
 
     /* D. J. Bernstein hash function */
     uint32_t computeHash(const uint8_t* data, int size) {
-        uint32_t hash = 5381;
-        for (int i = 0; i < size; ++i) {
+        return updateHash(HASH_SEED, data, size);
+    }
+
+    /// <summary>
+    /// Continues a hash with more data, so data received in pieces hashes the same as in one go.
+    /// Aligned data is read a word at a time, which is much faster on flash.
+    /// </summary>
+    uint32_t updateHash(uint32_t hash, const uint8_t* data, int size) {
+        int i = 0;
+        for (; i < size && ((uint32_t)(data + i) & 3) != 0; ++i) {
+            hash = 33 * hash ^ data[i];
+        }
+        for (; i + 4 <= size; i += 4) {
+            uint32_t word = *(const uint32_t*)(const void*)(data + i);
+            hash = 33 * hash ^ (word & 0xFF);
+            hash = 33 * hash ^ ((word >> 8) & 0xFF);
+            hash = 33 * hash ^ ((word >> 16) & 0xFF);
+            hash = 33 * hash ^ (word >> 24);
+        }
+        for (; i < size; ++i) {
             hash = 33 * hash ^ data[i];
         }
         return hash;
@@ -304,10 +349,7 @@ for x in range(256):
     }
 
     uint32_t modulateColor(uint32_t color, uint8_t intensity) {
-        int red = getRed(color) * intensity / 255;
-        int green = getGreen(color) * intensity / 255;
-        int blue = getBlue(color) * intensity / 255;
-        return toColor((uint8_t)red, (uint8_t)green, (uint8_t)blue);
+        return scaleColor256(color, intensityTo256(intensity));
     }
 
 
@@ -329,4 +371,25 @@ for x in range(256):
         }
         return q;
     }
+
+    // invSqrt_u32 returns 2^31 / sqrt(v), with a relative error under 1e-4.
+    // v is scaled into [2^30, 2^32) by an even shift, then three Newton-Raphson
+    // iterations (in Q30) refine a linear first guess. Returns UINT32_MAX for 0.
+    uint32_t invSqrt_u32(uint32_t v) {
+        if (v == 0) {
+            return 0xFFFFFFFF;
+        }
+        int shift = __builtin_clz(v) & ~1;
+        uint32_t m = v << shift; // m / 2^32 is in [0.25, 1)
+
+        // Line through 1/sqrt(0.25) = 2 and 1/sqrt(1) = 1, i.e. 7/3 - 4/3 * m / 2^32
+        uint32_t y = 2505397589u - m / 3;
+        for (int i = 0; i < 3; ++i) {
+            // y = y * (3 - m * y^2) / 2
+            uint32_t my = (uint32_t)(((uint64_t)m * y) >> 32);
+            uint32_t my2 = (uint32_t)(((uint64_t)my * y) >> 30);
+            y = (uint32_t)(((uint64_t)y * ((3u << 30) - my2)) >> 31);
+        }
+        return y >> (15 - (shift >> 1));
+    }
 }
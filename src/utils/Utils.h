@@ -3,6 +3,15 @@
 #include <stdint.h>
 #include <algorithm>
 
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+// Cortex-M4 SIMD instructions (4 x 8 bits lanes) from CMSIS, used by the color blending helpers below
+#include "nrf.h"
+#define UTILS_USE_SIMD32 1
+#endif
+
+// Initial value of the data hashes, see computeHash()
+#define HASH_SEED 5381
+
 #define CLAMP(a, min, max) ((a) < (min) ? (min) : ((a) > (max) ? (max) : (a)))
 
 namespace Utils
@@ -20,13 +29,58 @@ namespace Utils
     }
 
     uint32_t mulColors(uint32_t a, uint32_t b);
-    uint32_t addColors(uint32_t a, uint32_t b);
+
+    // Combines two colors by keeping the brightest value of each channel.
+    // Inlined since the compositor calls it for every LED of every animation.
+    inline uint32_t addColors(uint32_t a, uint32_t b) {
+#if UTILS_USE_SIMD32
+        // USUB8 sets the per-byte GE flags when a >= b, SEL then picks the bytes accordingly
+        __USUB8(a, b);
+        return __SEL(a, b);
+#else
+        uint32_t red = std::max(a & 0xFF0000, b & 0xFF0000);
+        uint32_t green = std::max(a & 0x00FF00, b & 0x00FF00);
+        uint32_t blue = std::max(a & 0x0000FF, b & 0x0000FF);
+        return red | green | blue;
+#endif
+    }
+
+    // Adds two colors channel by channel, saturating at full intensity
+    inline uint32_t addColorsSaturated(uint32_t a, uint32_t b) {
+#if UTILS_USE_SIMD32
+        return __UQADD8(a, b);
+#else
+        uint32_t red = std::min(getRed(a) + getRed(b), 255);
+        uint32_t green = std::min(getGreen(a) + getGreen(b), 255);
+        uint32_t blue = std::min(getBlue(a) + getBlue(b), 255);
+        return toColor(red, green, blue);
+#endif
+    }
+
+    // Averages two colors, channel by channel (rounding down)
+    inline uint32_t averageColors(uint32_t a, uint32_t b) {
+#if UTILS_USE_SIMD32
+        return __UHADD8(a, b);
+#else
+        return (a & b) + (((a ^ b) & 0xFEFEFEFE) >> 1);
+#endif
+    }
+    // Index of the lowest set bit of a non-zero mask (RBIT + CLZ on the Cortex-M4), to walk the set bits
+    // of a mask with mask &= mask - 1 instead of testing every bit
+    inline int lowestBitIndex(uint32_t mask) {
+        return __builtin_ctz(mask);
+    }
+
     template<typename T> T clamp(T value, T min, T max) {
         return value < min ? min : (value > max ? max : value);
     }
 
     uint32_t scaleColor(uint32_t color, uint32_t scaleTimes1000);
     uint32_t interpolateColors(uint32_t color1, uint32_t time1, uint32_t color2, uint32_t time2, uint32_t time);
+    // Mixes color2 into color1, factor is in 256th (256 gives color2)
+    uint32_t mixColors(uint32_t color1, uint32_t color2, uint32_t factor256);
+    // Draws over a color, the brightest channel of the top color giving its opacity
+    uint32_t overColors(uint32_t bottom, uint32_t top);
     uint8_t sine8(uint8_t x);
     uint8_t gamma8(uint8_t x);
     uint32_t gamma(uint32_t color);
@@ -37,6 +91,7 @@ namespace Utils
     uint32_t lz77_decompress (uint8_t *compressed_text, uint8_t *uncompressed_text);
 
     uint32_t computeHash(const uint8_t* data, int size);
+    uint32_t updateHash(uint32_t hash, const uint8_t* data, int size);
 
     uint8_t interpolateIntensity(uint8_t intensity1, int time1, uint8_t intensity2, int time2, int time);
     uint32_t modulateColor(uint32_t color, uint8_t intensity);
@@ -46,4 +101,5 @@ namespace Utils
     int twosComplement16(uint16_t registerValue);
 
     int32_t sqrt_i32(int32_t v);
+    uint32_t invSqrt_u32(uint32_t v);
 }
@@ -1,2 +1,9 @@
 
+#include "heap.h"
+
 extern "C" void __cxa_pure_virtual() { while (1); }
+
+// Define new and delete
+void* operator new(size_t size) { return Utils::Heap::alloc(size, Utils::Heap::HeapTag_Other); }
+void operator delete(void* ptr) { Utils::Heap::free(ptr); }
+void operator delete(void* ptr, unsigned int) { Utils::Heap::free(ptr); }
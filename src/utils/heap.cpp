@@ -0,0 +1,333 @@
+#include "heap.h"
+#include "app_util_platform.h"
+#include "nrf_log.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Blocks are multiples of 8 bytes, like newlib's, and start with a header of the same size
+#define HEAP_ALIGN 8
+#define HEAP_MIN_BLOCK_SIZE 16
+#define HEAP_MAX_SIZE (0x10000 - HEAP_ALIGN)    // Block sizes and offsets are 16 bits
+#define HEAP_CLASS_COUNT 16
+#define HEAP_NO_BLOCK 0xFFFF
+#define HEAP_TAG_FREE 0xFF
+
+// From the linker script
+extern uint32_t __HeapBase;
+extern uint32_t __HeapLimit;
+
+namespace Utils::Heap
+{
+    // Blocks are laid out back to back, each one knows the size of the previous one so freed
+    // blocks merge with both of their neighbours
+    struct Block
+    {
+        uint16_t size;      // Header included
+        uint16_t prevSize;  // 0 for the first block
+        uint8_t tag;        // HEAP_TAG_FREE when free
+        uint8_t padding[3];
+    };
+    static_assert(sizeof(Block) == HEAP_ALIGN, "Block header must keep the allocations aligned");
+
+    // Free blocks are linked in the list of their size class
+    struct FreeBlock
+        : Block
+    {
+        uint16_t nextFree;  // Offsets from the heap base
+        uint16_t prevFree;
+    };
+    static_assert(sizeof(FreeBlock) <= HEAP_MIN_BLOCK_SIZE, "Free blocks must fit in the smallest block");
+
+    static uint8_t* heapBase = nullptr; // Set on the first allocation, which may happen before main()
+    static uint8_t* heapEnd = nullptr;
+
+    // Free list of each size class, class n holding blocks of 2^n to 2^(n+1)-1 bytes
+    static uint16_t freeLists[HEAP_CLASS_COUNT];
+    static uint32_t classMask = 0; // Classes with a free block
+
+    static Stats stats;
+    static TagStats tagStats[HeapTag_Count];
+
+    static FreeBlock* blockAt(uint16_t offset) {
+        return (FreeBlock*)(heapBase + offset);
+    }
+
+    static uint16_t offsetOf(const Block* block) {
+        return (uint16_t)((const uint8_t*)block - heapBase);
+    }
+
+    static int classOf(uint32_t size) {
+        return 31 - __builtin_clz(size);
+    }
+
+    static Block* nextOf(Block* block) {
+        uint8_t* next = (uint8_t*)block + block->size;
+        return next < heapEnd ? (Block*)next : nullptr;
+    }
+
+    static Block* prevOf(Block* block) {
+        return block->prevSize != 0 ? (Block*)((uint8_t*)block - block->prevSize) : nullptr;
+    }
+
+    static void insertFree(Block* block) {
+        auto freeBlock = static_cast<FreeBlock*>(block);
+        int c = classOf(block->size);
+        freeBlock->tag = HEAP_TAG_FREE;
+        freeBlock->prevFree = HEAP_NO_BLOCK;
+        freeBlock->nextFree = freeLists[c];
+        if (freeLists[c] != HEAP_NO_BLOCK) {
+            blockAt(freeLists[c])->prevFree = offsetOf(block);
+        }
+        freeLists[c] = offsetOf(block);
+        classMask |= 1u << c;
+        stats.freeBlocks++;
+    }
+
+    static void removeFree(Block* block) {
+        auto freeBlock = static_cast<FreeBlock*>(block);
+        int c = classOf(block->size);
+        if (freeBlock->prevFree != HEAP_NO_BLOCK) {
+            blockAt(freeBlock->prevFree)->nextFree = freeBlock->nextFree;
+        } else {
+            freeLists[c] = freeBlock->nextFree;
+        }
+        if (freeBlock->nextFree != HEAP_NO_BLOCK) {
+            blockAt(freeBlock->nextFree)->prevFree = freeBlock->prevFree;
+        }
+        if (freeLists[c] == HEAP_NO_BLOCK) {
+            classMask &= ~(1u << c);
+        }
+        stats.freeBlocks--;
+    }
+
+    /// <summary>
+    /// Turns the heap section of the linker script into a single free block
+    /// </summary>
+    static void init() {
+        heapBase = (uint8_t*)(((uintptr_t)&__HeapBase + HEAP_ALIGN - 1) & ~(uintptr_t)(HEAP_ALIGN - 1));
+        uint32_t size = ((uint8_t*)&__HeapLimit - heapBase) & ~(uint32_t)(HEAP_ALIGN - 1);
+        if (size > HEAP_MAX_SIZE) {
+            size = HEAP_MAX_SIZE;
+        }
+        heapEnd = heapBase + size;
+
+        for (int c = 0; c < HEAP_CLASS_COUNT; ++c) {
+            freeLists[c] = HEAP_NO_BLOCK;
+        }
+        memset(&stats, 0, sizeof(stats));
+        memset(tagStats, 0, sizeof(tagStats));
+        stats.size = (uint16_t)size;
+        if (size >= HEAP_MIN_BLOCK_SIZE) {
+            Block* block = (Block*)heapBase;
+            block->size = (uint16_t)size;
+            block->prevSize = 0;
+            insertFree(block);
+        }
+    }
+
+    void* alloc(size_t size, HeapTag tag) {
+        if (tag >= HeapTag_Count) {
+            tag = HeapTag_Other;
+        }
+        uint32_t blockSize = size <= HEAP_MAX_SIZE - sizeof(Block) ? (size + sizeof(Block) + HEAP_ALIGN - 1) & ~(uint32_t)(HEAP_ALIGN - 1) : 0;
+        if (blockSize < HEAP_MIN_BLOCK_SIZE && blockSize != 0) {
+            blockSize = HEAP_MIN_BLOCK_SIZE;
+        }
+
+        Block* block = nullptr;
+        CRITICAL_REGION_ENTER();
+        if (heapBase == nullptr) {
+            init();
+        }
+        if (blockSize != 0) {
+            // Any block of a larger class fits, so do all the blocks of the same class for a power of 2
+            int c = classOf(blockSize);
+            uint32_t fitMask = classMask & ~((((blockSize & (blockSize - 1)) == 0 ? 1u : 2u) << c) - 1);
+            if (fitMask != 0) {
+                block = blockAt(freeLists[__builtin_ctz(fitMask)]);
+            } else {
+                // The heap is small, try the blocks of the same class before failing
+                for (uint16_t o = freeLists[c]; o != HEAP_NO_BLOCK; o = blockAt(o)->nextFree) {
+                    if (blockAt(o)->size >= blockSize) {
+                        block = blockAt(o);
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (block != nullptr) {
+            removeFree(block);
+            if (block->size - blockSize >= HEAP_MIN_BLOCK_SIZE) {
+                // Give back the end of the block
+                Block* rest = (Block*)((uint8_t*)block + blockSize);
+                rest->size = block->size - blockSize;
+                rest->prevSize = (uint16_t)blockSize;
+                block->size = (uint16_t)blockSize;
+                Block* next = nextOf(rest);
+                if (next != nullptr) {
+                    next->prevSize = rest->size;
+                }
+                insertFree(rest);
+            }
+            block->tag = tag;
+
+            stats.used += block->size;
+            if (stats.used > stats.peak) {
+                stats.peak = stats.used;
+            }
+            auto& t = tagStats[tag];
+            t.used += block->size;
+            if (t.used > t.peak) {
+                t.peak = t.used;
+            }
+            t.allocCount++;
+        } else {
+            stats.allocFailures++;
+        }
+        CRITICAL_REGION_EXIT();
+
+        if (block == nullptr) {
+            NRF_LOG_ERROR("Failed to allocate %d bytes for tag %d", size, tag);
+            return nullptr;
+        }
+        return (uint8_t*)block + sizeof(Block);
+    }
+
+    void free(void* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+        Block* block = (Block*)((uint8_t*)ptr - sizeof(Block));
+        if ((uint8_t*)block < heapBase || (uint8_t*)block >= heapEnd || block->tag >= HeapTag_Count) {
+            NRF_LOG_ERROR("Freeing invalid heap block 0x%08x", ptr);
+            return;
+        }
+
+        CRITICAL_REGION_ENTER();
+        stats.used -= block->size;
+        auto& t = tagStats[block->tag];
+        t.used -= block->size;
+        t.allocCount--;
+
+        // Merge with the free neighbours
+        Block* next = nextOf(block);
+        if (next != nullptr && next->tag == HEAP_TAG_FREE) {
+            removeFree(next);
+            block->size += next->size;
+        }
+        Block* prev = prevOf(block);
+        if (prev != nullptr && prev->tag == HEAP_TAG_FREE) {
+            removeFree(prev);
+            prev->size += block->size;
+            block = prev;
+        }
+        next = nextOf(block);
+        if (next != nullptr) {
+            next->prevSize = block->size;
+        }
+        insertFree(block);
+        CRITICAL_REGION_EXIT();
+    }
+
+    /// <summary>
+    /// Resizes by moving the data to a new block of the same tag, unless the current one is large enough
+    /// </summary>
+    static void* reallocate(void* ptr, size_t size) {
+        if (ptr == nullptr) {
+            return alloc(size, HeapTag_Other);
+        }
+        if (size == 0) {
+            free(ptr);
+            return nullptr;
+        }
+        const Block* block = (const Block*)((uint8_t*)ptr - sizeof(Block));
+        size_t capacity = block->size - sizeof(Block);
+        if (size <= capacity) {
+            return ptr;
+        }
+        void* ret = alloc(size, (HeapTag)block->tag);
+        if (ret != nullptr) {
+            memcpy(ret, ptr, capacity);
+            free(ptr);
+        }
+        return ret;
+    }
+
+    void getStats(Stats& outStats) {
+        CRITICAL_REGION_ENTER();
+        if (heapBase == nullptr) {
+            init();
+        }
+        outStats = stats;
+
+        // The largest block is in the highest non empty class
+        uint16_t largest = 0;
+        if (classMask != 0) {
+            for (uint16_t o = freeLists[classOf(classMask)]; o != HEAP_NO_BLOCK; o = blockAt(o)->nextFree) {
+                if (blockAt(o)->size > largest) {
+                    largest = blockAt(o)->size;
+                }
+            }
+        }
+        outStats.largestFree = largest > sizeof(Block) ? largest - sizeof(Block) : 0;
+        CRITICAL_REGION_EXIT();
+    }
+
+    const TagStats& getTagStats(HeapTag tag) {
+        return tagStats[tag < HeapTag_Count ? tag : HeapTag_Other];
+    }
+}
+
+using namespace Utils;
+
+// Route the C library allocator (and its reentrant versions) to the heap, so that nothing ever
+// falls back to newlib's allocator and its sbrk() over the same memory
+struct _reent;
+
+// Definitions must have the same exception specification as newlib's declarations
+#ifndef _NOTHROW
+#define _NOTHROW
+#endif
+
+extern "C"
+{
+    void* malloc(size_t size) _NOTHROW {
+        return Heap::alloc(size, Heap::HeapTag_Other);
+    }
+
+    void free(void* ptr) _NOTHROW {
+        Heap::free(ptr);
+    }
+
+    void* calloc(size_t count, size_t size) _NOTHROW {
+        if (size != 0 && count > HEAP_MAX_SIZE / size) {
+            return nullptr;
+        }
+        void* ret = Heap::alloc(count * size, Heap::HeapTag_Other);
+        if (ret != nullptr) {
+            memset(ret, 0, count * size);
+        }
+        return ret;
+    }
+
+    void* realloc(void* ptr, size_t size) _NOTHROW {
+        return Heap::reallocate(ptr, size);
+    }
+
+    void* _malloc_r(struct _reent* r, size_t size) _NOTHROW {
+        return malloc(size);
+    }
+
+    void _free_r(struct _reent* r, void* ptr) _NOTHROW {
+        free(ptr);
+    }
+
+    void* _calloc_r(struct _reent* r, size_t count, size_t size) _NOTHROW {
+        return calloc(count, size);
+    }
+
+    void* _realloc_r(struct _reent* r, void* ptr, size_t size) _NOTHROW {
+        return realloc(ptr, size);
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Utils::Heap
+{
+    // Who an allocation belongs to, for the statistics
+    enum HeapTag : uint8_t
+    {
+        HeapTag_Other = 0,      // Anything going through malloc() or new
+        HeapTag_Flash,          // Copies of the data set and settings being programmed
+        HeapTag_DataSet,        // Data set index and patches
+        HeapTag_Animation,      // Baked animation tables
+        HeapTag_Accelerometer,  // Calibration normals
+        HeapTag_Bluetooth,      // Bulk data transfers
+        HeapTag_Count
+    };
+
+    struct Stats
+    {
+        uint16_t size;          // Bytes managed by the heap
+        uint16_t used;          // Bytes taken by allocated blocks, headers included
+        uint16_t peak;          // Most bytes ever used at once
+        uint16_t largestFree;   // Largest block that can be allocated right now
+        uint16_t allocFailures;
+        uint8_t freeBlocks;
+    };
+
+    struct TagStats
+    {
+        uint16_t used;
+        uint16_t peak;
+        uint8_t allocCount;
+    };
+
+    // Constant time allocation, from segregated free lists of power of 2 size classes
+    void* alloc(size_t size, HeapTag tag);
+    void free(void* ptr);
+
+    void getStats(Stats& outStats);
+    const TagStats& getTagStats(HeapTag tag);
+}